@@ -58,9 +58,14 @@ if (LIBBPF_FOUND)
     set(LIBBPF_BTF_DUMP_FOUND TRUE)
   endif()
   check_symbol_exists(btf_dump__emit_type_decl "${LIBBPF_INCLUDE_DIRS}/bpf/btf.h" HAVE_LIBBPF_BTF_DUMP_EMIT_TYPE_DECL)
+  check_symbol_exists(btf__parse_split "${LIBBPF_INCLUDE_DIRS}/bpf/btf.h" HAVE_LIBBPF_BTF_SPLIT)
 
   check_symbol_exists(bpf_map_lookup_batch "${LIBBPF_INCLUDE_DIRS}/bpf/bpf.h" HAVE_LIBBPF_MAP_BATCH)
   check_symbol_exists(bpf_link_create "${LIBBPF_INCLUDE_DIRS}/bpf/bpf.h" HAVE_LIBBPF_LINK_CREATE)
+  check_symbol_exists(ring_buffer__new "${LIBBPF_INCLUDE_DIRS}/bpf/libbpf.h" HAVE_LIBBPF_RINGBUF)
+  include(CheckStructHasMember)
+  check_struct_has_member("struct bpf_link_create_opts" kprobe_multi "${LIBBPF_INCLUDE_DIRS}/bpf/bpf.h" HAVE_LIBBPF_KPROBE_MULTI)
+  check_struct_has_member("struct bpf_link_create_opts" uprobe_multi "${LIBBPF_INCLUDE_DIRS}/bpf/bpf.h" HAVE_LIBBPF_UPROBE_MULTI)
   SET(CMAKE_REQUIRED_DEFINITIONS)
   SET(CMAKE_REQUIRED_LIBRARIES)
 endif()
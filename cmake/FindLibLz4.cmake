@@ -0,0 +1,36 @@
+# - Try to find liblz4
+# Once done this will define
+#
+#  LIBLZ4_FOUND - system has liblz4
+#  LIBLZ4_INCLUDE_DIRS - the liblz4 include directory
+#  LIBLZ4_LIBRARIES - Link these to use liblz4
+
+find_path (LIBLZ4_INCLUDE_DIRS
+  NAMES
+    lz4frame.h
+  PATHS
+    /usr/include
+    /usr/local/include
+    /opt/local/include
+    /sw/include
+    ENV CPATH)
+
+find_library (LIBLZ4_LIBRARIES
+  NAMES
+    lz4
+  PATHS
+    /usr/lib
+    /usr/local/lib
+    /opt/local/lib
+    /sw/lib
+    ENV LIBRARY_PATH
+    ENV LD_LIBRARY_PATH)
+
+include (FindPackageHandleStandardArgs)
+
+# handle the QUIETLY and REQUIRED arguments and set LIBLZ4_FOUND to TRUE if all listed variables are TRUE
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibLz4 "Please install the liblz4 development package"
+  LIBLZ4_LIBRARIES
+  LIBLZ4_INCLUDE_DIRS)
+
+mark_as_advanced(LIBLZ4_INCLUDE_DIRS LIBLZ4_LIBRARIES)
@@ -0,0 +1,36 @@
+# - Try to find libzstd
+# Once done this will define
+#
+#  LIBZSTD_FOUND - system has libzstd
+#  LIBZSTD_INCLUDE_DIRS - the libzstd include directory
+#  LIBZSTD_LIBRARIES - Link these to use libzstd
+
+find_path (LIBZSTD_INCLUDE_DIRS
+  NAMES
+    zstd.h
+  PATHS
+    /usr/include
+    /usr/local/include
+    /opt/local/include
+    /sw/include
+    ENV CPATH)
+
+find_library (LIBZSTD_LIBRARIES
+  NAMES
+    zstd
+  PATHS
+    /usr/lib
+    /usr/local/lib
+    /opt/local/lib
+    /sw/lib
+    ENV LIBRARY_PATH
+    ENV LD_LIBRARY_PATH)
+
+include (FindPackageHandleStandardArgs)
+
+# handle the QUIETLY and REQUIRED arguments and set LIBZSTD_FOUND to TRUE if all listed variables are TRUE
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibZstd "Please install the libzstd development package"
+  LIBZSTD_LIBRARIES
+  LIBZSTD_INCLUDE_DIRS)
+
+mark_as_advanced(LIBZSTD_INCLUDE_DIRS LIBZSTD_LIBRARIES)
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+# Measures how many events a second bpftrace drains before it drops some, as
+# JSON lines for tuning the perf buffers and comparing transports
+#
+#   bench_event_throughput.py --load PATH [--bpftrace PATH] [--pages N,...]
+#                             [--sizes BYTES,...] [--cpus N,...]
+#                             [--rate N] [--seconds S]
+#
+# For each combination of perf buffer pages (BPFTRACE_PERF_RB_PAGES, the BPF
+# ring buffer is turned off), event size and CPU count, bpftrace printf()s
+# the arguments of a uprobe on the event_load test program (from the
+# testprogs build target), which calls it --rate times a second in total
+# (0, the default, for as fast as it can) from a process on each of the CPUs.
+# The events bpftrace received and lost are read from the BPFTRACE_EVENT_STATS
+# it prints on exit, its CPU use is the share of a CPU it took while the load
+# ran and until the events were drained. Needs root.
+#
+#   {"pages": 64, "event_size": 24, "cpus": 2, "rate": 0, "seconds": 5,
+#    "calls": 61442816, "received": 48113920, "lost": 13328896,
+#    "drop_pct": 21.69, "received_per_sec": 9622784, "cpu_pct": 99.4}
+
+import argparse
+import json
+import os
+import signal
+import subprocess
+import sys
+import threading
+import time
+
+CLK_TCK = os.sysconf("SC_CLK_TCK")
+# Longer than any run, so that the stats are only printed on exit
+EVENT_STATS_INTERVAL = 100000
+
+
+def cpu_seconds(pid):
+    """User and system time of all the threads of pid"""
+    with open("/proc/%d/stat" % pid) as f:
+        # The fields after the command, which can hold spaces
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / CLK_TCK
+
+
+class OutputReader(threading.Thread):
+    """Reads the output of bpftrace as fast as it comes, keeping only the
+    lines that aren't events"""
+
+    def __init__(self, stream):
+        super().__init__(daemon=True)
+        self.stream = stream
+        self.attached = threading.Event()
+        self.lines = []
+
+    def run(self):
+        fd = self.stream.fileno()
+        rest = b""
+        while True:
+            chunk = os.read(fd, 1 << 20)
+            if not chunk:
+                break
+            lines = (rest + chunk).split(b"\n")
+            rest = lines.pop()
+            for line in lines:
+                # The events are digits
+                if line and not line[:1].isdigit():
+                    self.lines.append(line.decode(errors="replace"))
+                    if line.startswith(b"Attaching "):
+                        self.attached.set()
+        self.attached.set()
+
+    def event_stats(self):
+        """Total received and lost events of the last stats printed"""
+        received = lost = None
+        for line in self.lines:
+            if line == "Event stats:":
+                received = lost = 0
+            elif received is not None and " received " in line:
+                # "  cpu 3: received 9012, lost 117"
+                counts = line.rsplit(":", 1)[1].split(",")
+                received += int(counts[0].split()[1])
+                lost += int(counts[1].split()[1])
+        return received, lost
+
+
+def run(args, pages, size, cpus):
+    # An event is the printf() id followed by its 8 byte arguments
+    nargs = max(1, (size - 8) // 8)
+    program = "uprobe:%s:event { printf(\"%s\\n\", %s); }" % (
+        args.load, " ".join(["%d"] * nargs), ", ".join(["arg0"] * nargs))
+    env = dict(os.environ,
+               BPFTRACE_PERF_RB_PAGES=str(pages),
+               BPFTRACE_RINGBUF_PAGES="0",
+               BPFTRACE_EVENT_STATS=str(EVENT_STATS_INTERVAL))
+    proc = subprocess.Popen([args.bpftrace, "--no-warnings", "-e", program],
+                            stdout=subprocess.PIPE, env=env)
+    reader = OutputReader(proc.stdout)
+    reader.start()
+    result = {"pages": pages, "event_size": 8 + 8 * nargs, "cpus": cpus,
+              "rate": args.rate, "seconds": args.seconds}
+
+    if not reader.attached.wait(args.timeout) or proc.poll() is not None:
+        proc.kill()
+        proc.wait()
+        result["error"] = "bpftrace didn't attach"
+        return result
+    # "Attaching" is printed before the probes are attached
+    time.sleep(1)
+
+    start = time.monotonic()
+    cpu_start = cpu_seconds(proc.pid)
+    load = subprocess.run([args.load, str(args.rate), str(args.seconds),
+                           str(cpus)],
+                          stdout=subprocess.PIPE, check=True)
+    # What's left in the buffers is read before stopping
+    time.sleep(args.drain)
+    window = time.monotonic() - start
+    cpu = cpu_seconds(proc.pid) - cpu_start
+
+    proc.send_signal(signal.SIGINT)
+    try:
+        proc.wait(args.timeout)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+        proc.wait()
+    reader.join()
+
+    calls = int(load.stdout)
+    received, lost = reader.event_stats()
+    if received is None:
+        result["error"] = "no event stats"
+        return result
+    result.update({
+        "calls": calls,
+        "received": received,
+        "lost": lost,
+        "drop_pct": round(100 * (calls - received) / calls, 2) if calls else 0,
+        "received_per_sec": round(received / args.seconds),
+        "cpu_pct": round(100 * cpu / window, 1),
+    })
+    return result
+
+
+def int_list(value):
+    return [int(v) for v in value.split(",")]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure the events a second bpftrace drains")
+    parser.add_argument("--bpftrace", default="bpftrace",
+                        help="bpftrace binary (default: from PATH)")
+    parser.add_argument("--load", required=True,
+                        help="event_load binary, e.g. build/tests/testprogs/"
+                             "event_load")
+    parser.add_argument("--pages", type=int_list, default=[64],
+                        help="BPFTRACE_PERF_RB_PAGES values (default: 64)")
+    parser.add_argument("--sizes", type=int_list, default=[16],
+                        help="event sizes in bytes (default: 16)")
+    parser.add_argument("--cpus", type=int_list, default=[1],
+                        help="CPUs generating events (default: 1)")
+    parser.add_argument("--rate", type=int, default=0,
+                        help="calls a second in total, 0 for no limit")
+    parser.add_argument("--seconds", type=int, default=5,
+                        help="seconds the load runs")
+    parser.add_argument("--drain", type=float, default=1,
+                        help="seconds given to drain the buffers")
+    parser.add_argument("--timeout", type=float, default=60,
+                        help="seconds bpftrace may take to start or exit")
+    args = parser.parse_args()
+    args.load = os.path.abspath(args.load)
+
+    failed = False
+    for pages in args.pages:
+        for size in args.sizes:
+            for cpus in args.cpus:
+                result = run(args, pages, size, cpus)
+                failed |= "error" in result
+                print(json.dumps(result), flush=True)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+# Measures how long the tools take to start, as JSON lines for tracking the
+# startup time across releases
+#
+#   bench_tool_startup.py [--bpftrace PATH] [--attach] [--repeat N] [TOOL...]
+#
+# Each tool (by default tools/*.bt) goes through `--test codegen`, which
+# parses, imports the headers, analyses and compiles it, and with --attach
+# (as root) through a real run: until its first output after "Attaching N
+# probes...", usually the "Tracing..." of BEGIN printed once all the probes
+# are attached, then until it exits after a SIGINT, which detaches the probes
+# and prints the maps. Each run is a line with the wall times in ms and the
+# peak RSS in KiB:
+#
+#   {"tool": "biolatency", "mode": "codegen", "status": 0, "wall_ms": 812.4,
+#    "max_rss_kb": 181232}
+#   {"tool": "biolatency", "mode": "attach", "status": 0, "wall_ms": 1433.9,
+#    "attach_ms": 1190.2, "detach_ms": 243.7, "max_rss_kb": 190412}
+
+import argparse
+import glob
+import json
+import os
+import select
+import signal
+import subprocess
+import sys
+import threading
+import time
+
+TOOLS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         "..", "tools")
+
+
+def ms_since(start):
+    return round((time.monotonic() - start) * 1000, 1)
+
+
+def wait(proc, timeout):
+    """Waits for proc, returns its exit status and peak RSS, killing it past
+    timeout"""
+    deadline = time.monotonic() + timeout
+    while True:
+        pid, status, rusage = os.wait4(proc.pid, os.WNOHANG)
+        if pid:
+            proc.returncode = os.waitstatus_to_exitcode(status)
+            return proc.returncode, rusage.ru_maxrss
+        if time.monotonic() > deadline:
+            proc.kill()
+            deadline = float("inf")
+        time.sleep(0.005)
+
+
+def run_codegen(bpftrace, tool, timeout):
+    start = time.monotonic()
+    proc = subprocess.Popen([bpftrace, "--no-warnings", "--test", "codegen",
+                             tool],
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    status, rss = wait(proc, timeout)
+    return {"status": status, "wall_ms": ms_since(start), "max_rss_kb": rss}
+
+
+def read_line(proc, deadline):
+    """Next line of the output of proc, None at EOF or past deadline"""
+    line = b""
+    fd = proc.stdout.fileno()
+    while not line.endswith(b"\n"):
+        left = deadline - time.monotonic()
+        if left <= 0 or not select.select([fd], [], [], left)[0]:
+            return None
+        chunk = os.read(fd, 1)
+        if not chunk:
+            return None
+        line += chunk
+    return line
+
+
+def run_attach(bpftrace, tool, timeout):
+    start = time.monotonic()
+    deadline = start + timeout
+    proc = subprocess.Popen([bpftrace, "--no-warnings", tool],
+                            stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL)
+    attach_ms = detach_ms = None
+    attaching = False
+    while True:
+        line = read_line(proc, deadline)
+        if line is None:
+            break
+        if attaching:
+            attach_ms = ms_since(start)
+            break
+        attaching = line.startswith(b"Attaching ")
+
+    detach = time.monotonic()
+    # Not proc.send_signal(), which would reap bpftrace if it already exited,
+    # and its rusage with it
+    os.kill(proc.pid, signal.SIGINT)
+    # The maps printed at exit are read, so that bpftrace doesn't block on
+    # the pipe
+    drain = threading.Thread(target=proc.stdout.read)
+    drain.start()
+    status, rss = wait(proc, timeout)
+    drain.join()
+    proc.stdout.close()
+    if attach_ms is not None:
+        detach_ms = ms_since(detach)
+    return {"status": status, "wall_ms": ms_since(start),
+            "attach_ms": attach_ms, "detach_ms": detach_ms,
+            "max_rss_kb": rss}
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure the startup time of the bpftrace tools")
+    parser.add_argument("--bpftrace", default="bpftrace",
+                        help="bpftrace binary (default: from PATH)")
+    parser.add_argument("--attach", action="store_true",
+                        help="also run the tools for real, needs root")
+    parser.add_argument("--repeat", type=int, default=1,
+                        help="runs of each tool and mode")
+    parser.add_argument("--timeout", type=float, default=60,
+                        help="seconds a run may take")
+    parser.add_argument("tools", nargs="*",
+                        help="tools to run (default: tools/*.bt)")
+    args = parser.parse_args()
+
+    tools = args.tools or sorted(glob.glob(os.path.join(TOOLS_DIR, "*.bt")))
+    modes = [("codegen", run_codegen)]
+    if args.attach:
+        modes.append(("attach", run_attach))
+
+    failed = False
+    for tool in tools:
+        name = os.path.basename(tool)[:-3] if tool.endswith(".bt") else tool
+        for mode, run in modes:
+            for _ in range(args.repeat):
+                result = {"tool": name, "mode": mode}
+                result.update(run(args.bpftrace, tool, args.timeout))
+                failed |= result["status"] != 0
+                print(json.dumps(result), flush=True)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
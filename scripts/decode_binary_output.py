@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+# Prints the output of `bpftrace -f binary` as `-f text` would have printed it,
+# or only its map records as CSV tables with --csv
+#
+#   bpftrace -f binary -o out.bin -e '...'
+#   decode_binary_output.py out.bin
+#   decode_binary_output.py --csv out.bin
+#
+# read_map() returns the columns of a map record, e.g. for pandas.DataFrame.
+#
+# The layout is described in the "Output Formats" section of
+# docs/reference_guide.md.
+
+import csv
+import ipaddress
+import re
+import struct
+import sys
+
+RECORD_SCHEMA = 1
+RECORD_PRINTF = 2
+RECORD_MESSAGE = 3
+RECORD_MAP = 4
+
+COLUMN_U64 = 0
+COLUMN_I64 = 1
+COLUMN_STR = 2
+
+# Map values printed without a newline after them, they end with one
+NO_NEWLINE_TYPES = {"kstack", "ustack", "ksym", "usym", "inet"}
+
+LENGTHS = {"hh": 8, "h": 16, "": 32, "l": 64, "ll": 64, "j": 64, "z": 64, "t": 64}
+SPECIFIER_RE = re.compile(r"%(-?[0-9]*(?:\.[0-9]+)?)(hh|h|ll|l|j|z|t|)([sducxXpr])")
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+        self.order = "<"
+
+    def take(self, size):
+        if self.pos + size > len(self.data):
+            raise EOFError
+        chunk = self.data[self.pos : self.pos + size]
+        self.pos += size
+        return chunk
+
+    def u8(self):
+        return self.take(1)[0]
+
+    def u32(self):
+        return struct.unpack(self.order + "I", self.take(4))[0]
+
+    def array(self, fmt, count):
+        return list(struct.unpack(self.order + fmt * count,
+                                  self.take(struct.calcsize(fmt) * count)))
+
+    def str(self):
+        return self.take(self.u32()).decode("latin-1")
+
+    def type(self):
+        return (self.str(), self.u32(), bool(self.u8()))
+
+
+def read_int(order, data, offset, size, signed):
+    return int.from_bytes(data[offset : offset + size],
+                          "little" if order == "<" else "big",
+                          signed=signed)
+
+
+def format_int(flags, length, conv, value):
+    bits = LENGTHS[length]
+    value &= (1 << bits) - 1
+    if conv == "d" and value >> (bits - 1):
+        value -= 1 << bits
+    if conv == "p":
+        return ("%" + flags + "s") % (hex(value) if value else "(nil)")
+    if conv == "c":
+        return ("%" + flags + "c") % (value & 0xFF)
+    return ("%" + flags + ("d" if conv == "u" else conv)) % value
+
+
+def hex_format_buffer(buf):
+    return "".join(chr(b) if 32 <= b <= 126 else "\\x%02x" % b for b in buf)
+
+
+def decode_arg(schema, order, data, arg):
+    (type, size, signed), offset = arg
+    if type == "string":
+        return data[offset : offset + size].split(b"\0")[0].decode("latin-1")
+    if type == "buffer":
+        length = data[offset]
+        return hex_format_buffer(data[offset + 1 : offset + 1 + length])
+    if type == "inet":
+        af = read_int(order, data, offset, 8, True)
+        addr = data[offset + 8 : offset + 24]
+        if af == 2:
+            return str(ipaddress.IPv4Address(addr[:4]))
+        if af == 10:
+            return str(ipaddress.IPv6Address(addr))
+        return ""
+    if type == "mac_address":
+        return ":".join("%02X" % b for b in data[offset : offset + 6])
+    if type == "probe":
+        return schema["probes"][read_int(order, data, offset, 8, False)]
+    if type == "pointer":
+        return read_int(order, data, offset, 8, False)
+    return read_int(order, data, offset, size, signed)
+
+
+def format_printf(schema, order, data):
+    printf_id = read_int(order, data, 0, 8, False)
+    fmt, args = schema["printfs"][printf_id]
+    out = []
+    pos = 0
+    for i, spec in enumerate(SPECIFIER_RE.finditer(fmt)):
+        # The literal text is printed as is, "%%" included
+        out.append(fmt[pos : spec.start()])
+        flags, length, conv = spec.groups()
+        value = decode_arg(schema, order, data, args[i])
+        if isinstance(value, int):
+            out.append(format_int(flags, length, conv, value))
+        else:
+            out.append(("%" + flags + "s") % value)
+        pos = spec.end()
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+def read_schema(reader):
+    schema = {"printfs": [], "probes": [], "maps": []}
+    for _ in range(reader.u32()):
+        fmt = reader.str()
+        reader.u8()  # printed raw
+        args = []
+        for _ in range(reader.u32()):
+            args.append((reader.type(), reader.u32()))
+        schema["printfs"].append((fmt, args))
+    for _ in range(reader.u32()):
+        schema["probes"].append(reader.str())
+    for _ in range(reader.u32()):
+        name = reader.str()
+        keys = [reader.type() for _ in range(reader.u32())]
+        schema["maps"].append((name, keys, reader.type()))
+    return schema
+
+
+def read_map(reader):
+    """Returns the map name and its columns, as (name, type, values)"""
+    name = reader.str()
+    rows = reader.u32()
+    columns = []
+    for _ in range(reader.u32()):
+        column, type, layout = reader.str(), reader.str(), reader.u8()
+        if layout == COLUMN_U64:
+            values = reader.array("Q", rows)
+        elif layout == COLUMN_I64:
+            values = reader.array("q", rows)
+        else:
+            offsets = reader.array("I", rows + 1)
+            data = reader.take(offsets[-1])
+            values = [data[offsets[i] : offsets[i + 1]].decode("latin-1")
+                      for i in range(rows)]
+        columns.append((column, type, values))
+    return name, columns
+
+
+def format_map(name, columns):
+    *keys, (_, type, values) = columns
+    out = []
+    for row, value in enumerate(values):
+        out.append(name)
+        if keys:
+            out.append("[" + ", ".join(str(key[2][row]) for key in keys) + "]")
+        out.append(": " + str(value))
+        if type not in NO_NEWLINE_TYPES:
+            out.append("\n")
+    out.append("\n")
+    return "".join(out)
+
+
+def write_csv(name, columns, out):
+    out.write("# " + name + "\n")
+    writer = csv.writer(out, lineterminator="\n")
+    writer.writerow(column for column, _, _ in columns)
+    writer.writerows(zip(*(values for _, _, values in columns)))
+    out.write("\n")
+
+
+def decode(data, out, tables=False):
+    reader = Reader(data)
+    if reader.take(8) != b"BPFTRBIN":
+        sys.exit("not the output of bpftrace -f binary")
+    version = reader.take(4)
+    if struct.unpack("<I", reader.take(4))[0] != 0x01020304:
+        reader.order = ">"
+    if struct.unpack(reader.order + "I", version)[0] not in (1, 2):
+        sys.exit("unsupported version")
+
+    schema = None
+    while reader.pos < len(data):
+        kind = reader.u32()
+        payload = Reader(reader.take(reader.u32()))
+        payload.order = reader.order
+        if kind == RECORD_SCHEMA:
+            schema = read_schema(payload)
+        elif kind == RECORD_MAP:
+            name, columns = read_map(payload)
+            if tables:
+                write_csv(name, columns, out)
+            else:
+                out.write(format_map(name, columns))
+        elif tables:
+            continue
+        elif kind == RECORD_PRINTF:
+            out.write(format_printf(schema, reader.order, payload.data))
+        elif kind == RECORD_MESSAGE:
+            payload.str()  # message type, e.g. "map"
+            out.write(payload.data[payload.pos :].decode("latin-1"))
+
+
+def main():
+    args = sys.argv[1:]
+    tables = "--csv" in args
+    if tables:
+        args.remove("--csv")
+    path = args[0] if args else "-"
+    data = sys.stdin.buffer.read() if path == "-" else open(path, "rb").read()
+    out = open(sys.stdout.fileno(), "w", encoding="latin-1", closefd=False)
+    try:
+        decode(data, out, tables)
+    except EOFError:
+        sys.exit("truncated output")
+    finally:
+        out.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -2,6 +2,7 @@
 #include "log.h"
 #include "parser.tab.hh"
 #include "visitors.h"
+#include <cstddef>
 #include <iostream>
 
 namespace bpftrace {
@@ -37,12 +38,95 @@ MAKE_ACCEPT(AttachPoint)
 MAKE_ACCEPT(If)
 MAKE_ACCEPT(Unroll)
 MAKE_ACCEPT(While)
+MAKE_ACCEPT(For)
 MAKE_ACCEPT(Jump)
 MAKE_ACCEPT(Probe)
 MAKE_ACCEPT(Program)
 
 #undef MAKE_ACCEPT
 
+namespace {
+// Each node is preceded by the arena it came from, nullptr for the heap
+const size_t NODE_HEADER = alignof(std::max_align_t);
+const size_t ARENA_CHUNK = 64 * 1024;
+} // namespace
+
+thread_local NodeArena *NodeArena::active_ = nullptr;
+
+NodeArena *NodeArena::create()
+{
+  return new NodeArena();
+}
+
+void NodeArena::release()
+{
+  owned_ = false;
+  if (nodes_ == 0)
+    delete this;
+}
+
+NodeArena::Scope::Scope(NodeArena *arena) : prev_(active_)
+{
+  active_ = arena;
+}
+
+NodeArena::Scope::~Scope()
+{
+  active_ = prev_;
+}
+
+void *NodeArena::allocate(size_t size)
+{
+  size = (size + NODE_HEADER - 1) / NODE_HEADER * NODE_HEADER + NODE_HEADER;
+  NodeArena *arena = active_ && size <= ARENA_CHUNK / 4 ? active_ : nullptr;
+  char *p = arena ? static_cast<char *>(arena->take(size))
+                  : static_cast<char *>(::operator new(size));
+  *reinterpret_cast<NodeArena **>(p) = arena;
+  return p + NODE_HEADER;
+}
+
+void NodeArena::deallocate(void *p)
+{
+  if (!p)
+    return;
+  char *base = static_cast<char *>(p) - NODE_HEADER;
+  NodeArena *arena = *reinterpret_cast<NodeArena **>(base);
+  if (arena)
+    arena->put();
+  else
+    ::operator delete(base);
+}
+
+void *NodeArena::take(size_t size)
+{
+  if (chunks_.empty() || used_ + size > ARENA_CHUNK)
+  {
+    if (!chunks_.empty())
+      chunk_++;
+    if (chunk_ == chunks_.size())
+      chunks_.emplace_back(new char[ARENA_CHUNK]);
+    used_ = 0;
+  }
+  void *p = chunks_[chunk_].get() + used_;
+  used_ += size;
+  nodes_++;
+  return p;
+}
+
+void NodeArena::put()
+{
+  if (--nodes_ > 0)
+    return;
+  if (!owned_)
+  {
+    delete this;
+    return;
+  }
+  // The next parse starts over
+  chunk_ = 0;
+  used_ = 0;
+}
+
 Call::~Call()
 {
   if (vargs)
@@ -179,6 +263,15 @@ While::~While()
   delete stmts;
 }
 
+For::~For()
+{
+  delete decl;
+  delete map;
+  for (auto *stmt : *stmts)
+    delete stmt;
+  delete stmts;
+}
+
 Probe::~Probe()
 {
   if (attach_points)
@@ -204,6 +297,8 @@ Program::~Program()
       delete p;
   delete probes;
   probes = nullptr;
+  delete map_decls;
+  map_decls = nullptr;
 }
 
 Integer::Integer(long n, location loc) : Expression(loc), n(n)
@@ -404,6 +499,21 @@ Program::Program(const std::string &c_definitions, ProbeList *probes)
 {
 }
 
+Program::Program(const std::string &c_definitions,
+                 MapDeclList *map_decls,
+                 ProbeList *probes)
+    : c_definitions(c_definitions), map_decls(map_decls), probes(probes)
+{
+}
+
+MapDecl::MapDecl(const std::string &ident,
+                 const std::string &type,
+                 long max_entries,
+                 location loc)
+    : ident(ident), type(type), max_entries(max_entries), loc(loc)
+{
+}
+
 std::string opstr(Jump &jump)
 {
   switch (jump.ident)
@@ -477,6 +587,8 @@ std::string AttachPoint::name(const std::string &attach_target,
     n += ":" + std::to_string(address);
   if (freq != 0)
     n += ":" + std::to_string(freq);
+  if (!cpus.empty())
+    n += (freq != 0 ? ":" : "::") + cpus;
   if (len != 0)
     n += ":" + std::to_string(len);
   if (mode.size())
@@ -580,6 +692,8 @@ Unroll::Unroll(const Unroll &other) : Statement(other)
 Program::Program(const Program &other) : Node(other)
 {
   c_definitions = other.c_definitions;
+  if (other.map_decls)
+    map_decls = new MapDeclList(*other.map_decls);
 }
 
 Cast::Cast(const Cast &other) : Expression(other)
@@ -592,7 +706,15 @@ Cast::Cast(const Cast &other) : Expression(other)
 Probe::Probe(const Probe &other) : Node(other)
 {
   need_expansion = other.need_expansion;
+  use_cookies = other.use_cookies;
+  probe_ids_at_load = other.probe_ids_at_load;
+  need_scratch = other.need_scratch;
+  self_profile = other.self_profile;
+  target_tracking = other.target_tracking;
+  flush_events = other.flush_events;
+  tail_calls = other.tail_calls;
   tp_args_structs_level = other.tp_args_structs_level;
+  gate = other.gate;
   index_ = other.index_;
 }
 
@@ -600,6 +722,10 @@ While::While(const While &other) : Statement(other)
 {
 }
 
+For::For(const For &other) : Statement(other)
+{
+}
+
 Tuple::Tuple(const Tuple &other) : Expression(other)
 {
 }
@@ -3,6 +3,7 @@
 #include "location.hh"
 #include "utils.h"
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -26,12 +27,73 @@ class VisitorBase;
     return new T(*this);                                                       \
   };
 
+/**
+   Memory of the nodes of a parse, handed out of large chunks rather than
+   allocated from the heap node by node.
+
+   The nodes made while an arena is in use (see Scope) come from it, the
+   others from the heap. Deleting a node still runs its destructor. The
+   chunks are reused once all the nodes of the arena were deleted, and freed
+   with the last of them or release(), whichever comes last, so that an AST
+   may outlive the Driver that parsed it.
+*/
+class NodeArena
+{
+public:
+  // A new arena, owned by the caller until release()
+  static NodeArena *create();
+  // The arena is freed right away, or with the last of its nodes
+  void release();
+
+  NodeArena(const NodeArena &) = delete;
+  NodeArena &operator=(const NodeArena &) = delete;
+
+  // Has the nodes made in its lifetime come from arena
+  class Scope
+  {
+  public:
+    explicit Scope(NodeArena *arena);
+    ~Scope();
+
+  private:
+    NodeArena *prev_;
+  };
+
+  static void *allocate(size_t size);
+  static void deallocate(void *p);
+
+private:
+  NodeArena() = default;
+  ~NodeArena() = default;
+
+  void *take(size_t size);
+  void put();
+
+  static thread_local NodeArena *active_;
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  // Chunk the next node is taken from, and how much of it is used
+  size_t chunk_ = 0;
+  size_t used_ = 0;
+  size_t nodes_ = 0;
+  bool owned_ = true;
+};
+
 class Node {
 public:
   Node() = default;
   Node(location loc) : loc(loc){};
   Node(const Node &other) = default;
 
+  static void *operator new(size_t size)
+  {
+    return NodeArena::allocate(size);
+  }
+  static void operator delete(void *p)
+  {
+    NodeArena::deallocate(p);
+  }
+
   Node &operator=(const Node &) = delete;
   Node(Node &&) = delete;
   Node &operator=(Node &&) = delete;
@@ -477,6 +539,28 @@ private:
   While(const While &other);
 };
 
+// for ($kv : @map) { ... }, runs the statements on each entry of the map
+// with $kv holding the (key, value) tuple
+class For : public Statement
+{
+public:
+  DEFINE_ACCEPT
+  DEFINE_LEAFCOPY(For)
+
+  For(Variable *decl, Map *map, StatementList *stmts, location loc)
+      : Statement(loc), decl(decl), map(map), stmts(stmts)
+  {
+  }
+  ~For();
+
+  Variable *decl = nullptr;
+  Map *map = nullptr;
+  StatementList *stmts = nullptr;
+
+private:
+  For(const For &other);
+};
+
 class AttachPoint : public Node {
 public:
   DEFINE_ACCEPT
@@ -506,7 +590,13 @@ public:
   bool need_expansion = false;
   uint64_t address = 0;
   uint64_t func_offset = 0;
+  int counter_slot = -1; // for hardware probes of a group of events, the
+                         // first of their slots of the counters map
+  std::string cpus; // for profile, interval and hardware probes, the CPU
+                    // list or cgroup cpuset to open the perf events on
   bool ignore_invalid = false;
+  bool from_kprobe = false; // a kfunc written as a kprobe, its argN and
+                            // retval are u64 as a kprobe's are
 
   std::string name(const std::string &attach_point) const;
   std::string name(const std::string &attach_target,
@@ -536,8 +626,23 @@ public:
 
   std::string name() const;
   bool need_expansion = false;        // must build a BPF program per wildcard match
+  bool use_cookies = false;           // the probe builtin is the BPF cookie of
+                                      // the attach point, see kprobe_multi
+  bool probe_ids_at_load = false;     // the kfunc program is shared by the
+                                      // matches, each loads it with its own
+                                      // probe builtin
+  bool need_scratch = false;          // keeps temporaries in the scratch map
+  bool self_profile = false;          // samples bpftrace, see --self-profile
+  bool target_tracking = false;       // keeps the set of --pids and --comm
+  bool flush_events = false;          // flushes the printf() events batched
+                                      // on its CPU, see BPFTRACE_EVENT_BATCH
+  std::vector<size_t> tail_calls;     // statements starting the programs the
+                                      // probe is split into, see
+                                      // TAIL_CALL_THRESHOLD
   int tp_args_structs_level = -1;     // number of levels of structs that must
                                       // be imported/resolved for tracepoints
+  int gate = -1;                      // entry turning the probe on and off
+                                      // in the probe gates map, see enable()
 
   int index() const;
   void set_index(int index);
@@ -548,16 +653,40 @@ private:
 };
 using ProbeList = std::vector<Probe *>;
 
+/**
+   Map declared ahead of the probes to give it its own size, e.g.
+
+     @big = hash(100000);
+*/
+class MapDecl
+{
+public:
+  MapDecl(const std::string &ident,
+          const std::string &type,
+          long max_entries,
+          location loc);
+
+  std::string ident;
+  std::string type;
+  long max_entries;
+  location loc;
+};
+using MapDeclList = std::vector<MapDecl>;
+
 class Program : public Node {
 public:
   DEFINE_ACCEPT
   DEFINE_LEAFCOPY(Program)
 
   Program(const std::string &c_definitions, ProbeList *probes);
+  Program(const std::string &c_definitions,
+          MapDeclList *map_decls,
+          ProbeList *probes);
 
   ~Program();
 
   std::string c_definitions;
+  MapDeclList *map_decls = nullptr;
   ProbeList *probes = nullptr;
 
 private:
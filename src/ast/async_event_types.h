@@ -31,6 +31,22 @@ struct Print
   }
 } __attribute__((packed));
 
+struct Quantiles
+{
+  uint64_t action_id;
+  uint32_t mapid;
+  uint32_t quantiles_id;
+
+  std::vector<llvm::Type*> asLLVMType(ast::IRBuilderBPF& b)
+  {
+    return {
+      b.getInt64Ty(), // asyncid
+      b.getInt32Ty(), // map id
+      b.getInt32Ty(), // quantiles id
+    };
+  }
+} __attribute__((packed));
+
 struct PrintNonMap
 {
   uint64_t action_id;
@@ -124,6 +140,34 @@ struct HelperError
   }
 } __attribute__((packed));
 
+struct Repeated
+{
+  uint64_t action_id;
+  uint64_t count;
+
+  std::vector<llvm::Type*> asLLVMType(ast::IRBuilderBPF& b)
+  {
+    return {
+      b.getInt64Ty(), // asyncid
+      b.getInt64Ty(), // count
+    };
+  }
+} __attribute__((packed));
+
+struct RawSymbolsPid
+{
+  uint64_t action_id;
+  uint64_t pid;
+
+  std::vector<llvm::Type*> asLLVMType(ast::IRBuilderBPF& b)
+  {
+    return {
+      b.getInt64Ty(), // asyncid
+      b.getInt64Ty(), // pid
+    };
+  }
+} __attribute__((packed));
+
 struct Watchpoint
 {
   uint64_t action_id;
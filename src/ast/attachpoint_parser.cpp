@@ -7,6 +7,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include "callback_visitor.h"
 #include "log.h"
 #include "types.h"
 
@@ -29,6 +30,7 @@ int AttachPointParser::parse()
   uint32_t failed = 0;
   for (Probe *probe : *(root_->probes))
   {
+    uint32_t probe_failed = failed;
     for (size_t i = 0; i < probe->attach_points->size(); ++i)
     {
       auto &ap = *(*probe->attach_points)[i];
@@ -55,11 +57,94 @@ int AttachPointParser::parse()
         }
       }
     }
+    if (failed == probe_failed && bpftrace_.kprobe_to_kfunc_ && !listing_)
+      upgrade_kprobes(*probe);
   }
 
   return failed;
 }
 
+// Attaches the probe as a kfunc (fentry/fexit) rather than a kprobe if it
+// only reads the arguments and return value of its functions through argN
+// and retval, which a kfunc program reads from its context as well. The
+// functions must be traceable and have BTF, wildcards and offsets are left
+// to kprobes.
+void AttachPointParser::upgrade_kprobes(Probe &probe)
+{
+  auto &aps = *probe.attach_points;
+  if (aps.empty())
+    return;
+  ProbeType type = probetype(aps.front()->provider);
+  if (type != ProbeType::kprobe && type != ProbeType::kretprobe)
+    return;
+#ifdef HAVE_BCC_KFUNC
+  if (!bpftrace_.feature_->has_prog_kfunc() || !bpftrace_.btf_.has_data())
+    return;
+#else
+  return;
+#endif
+
+  bool upgradable = true;
+  int max_arg = -1;
+  CallbackVisitor usage([&](Node *node) {
+    if (auto builtin = dynamic_cast<Builtin *>(node))
+    {
+      auto &ident = builtin->ident;
+      if (ident.size() == 4 && !ident.compare(0, 3, "arg") &&
+          ident[3] >= '0' && ident[3] <= '9')
+        max_arg = std::max(max_arg, ident[3] - '0');
+      // What a kfunc has of its own or different: the registers, the name
+      // of the probe or of the function hit
+      else if (ident == "ctx" || ident == "args" || ident == "func" ||
+               ident == "probe" || !ident.compare(0, 4, "sarg") ||
+               (ident == "retval" && type != ProbeType::kretprobe))
+        upgradable = false;
+    }
+    else if (auto call = dynamic_cast<Call *>(node))
+    {
+      if (call->func == "reg" || call->func == "override")
+        upgradable = false;
+    }
+  });
+  if (probe.pred)
+    probe.pred->accept(usage);
+  if (probe.stmts)
+  {
+    for (auto stmt : *probe.stmts)
+      stmt->accept(usage);
+  }
+  if (!upgradable)
+    return;
+
+  for (auto ap : aps)
+  {
+    if (probetype(ap->provider) != type || ap->need_expansion ||
+        ap->func_offset != 0 || ap->address != 0 || ap->func.empty())
+      return;
+    std::map<std::string, SizedType> args;
+    try
+    {
+      bpftrace_.btf_.resolve_args(
+          ap->func, args, type == ProbeType::kretprobe);
+    }
+    catch (const std::runtime_error &)
+    {
+      return;
+    }
+    int nargs = args.size() - (type == ProbeType::kretprobe ? 1 : 0);
+    if (max_arg >= nargs)
+      return;
+  }
+
+  for (auto ap : aps)
+  {
+    ap->provider = probetypeName(type == ProbeType::kprobe
+                                     ? ProbeType::kfunc
+                                     : ProbeType::kretfunc);
+    ap->from_kprobe = true;
+  }
+}
+
 AttachPointParser::State AttachPointParser::parse_attachpoint(AttachPoint &ap)
 {
   ap_ = &ap;
@@ -140,6 +225,7 @@ AttachPointParser::State AttachPointParser::parse_attachpoint(AttachPoint &ap)
     case ProbeType::usdt:
       return usdt_parser();
     case ProbeType::tracepoint:
+    case ProbeType::rawtracepoint:
       return tracepoint_parser();
     case ProbeType::profile:
       return profile_parser();
@@ -502,9 +588,10 @@ AttachPointParser::State AttachPointParser::tracepoint_parser()
 
 AttachPointParser::State AttachPointParser::profile_parser()
 {
-  if (parts_.size() != 3)
+  if (parts_.size() != 3 && parts_.size() != 4)
   {
-    errs_ << ap_->provider << " probe type requires 2 arguments" << std::endl;
+    errs_ << ap_->provider << " probe type requires 2 or 3 arguments"
+          << std::endl;
     return INVALID;
   }
 
@@ -529,14 +616,18 @@ AttachPointParser::State AttachPointParser::profile_parser()
     return INVALID;
   }
 
+  if (parts_.size() == 4)
+    return cpus_parser(parts_[3]);
+
   return OK;
 }
 
 AttachPointParser::State AttachPointParser::interval_parser()
 {
-  if (parts_.size() != 3)
+  if (parts_.size() != 3 && parts_.size() != 4)
   {
-    errs_ << ap_->provider << " probe type requires 2 arguments" << std::endl;
+    errs_ << ap_->provider << " probe type requires 2 or 3 arguments"
+          << std::endl;
     return INVALID;
   }
 
@@ -561,6 +652,9 @@ AttachPointParser::State AttachPointParser::interval_parser()
     return INVALID;
   }
 
+  if (parts_.size() == 4)
+    return cpus_parser(parts_[3]);
+
   return OK;
 }
 
@@ -605,19 +699,21 @@ AttachPointParser::State AttachPointParser::software_parser()
 
 AttachPointParser::State AttachPointParser::hardware_parser()
 {
-  if (parts_.size() != 2 && parts_.size() != 3)
+  if (parts_.size() < 2 || parts_.size() > 4)
   {
     if (ap_->ignore_invalid)
       return SKIP;
 
-    errs_ << ap_->provider << " probe type requires 1 or 2 arguments"
+    errs_ << ap_->provider << " probe type requires 1 to 3 arguments"
           << std::endl;
     return INVALID;
   }
 
   ap_->target = parts_[1];
 
-  if (parts_.size() == 3 && parts_[2] != "*")
+  // The count can be left out before the CPUs, hardware:cycles::0-3
+  if (parts_.size() >= 3 && parts_[2] != "*" &&
+      !(parts_.size() == 4 && parts_[2].empty()))
   {
     try
     {
@@ -639,6 +735,29 @@ AttachPointParser::State AttachPointParser::hardware_parser()
     }
   }
 
+  if (parts_.size() == 4)
+    return cpus_parser(parts_[3]);
+
+  return OK;
+}
+
+AttachPointParser::State AttachPointParser::cpus_parser(const std::string &cpus)
+{
+  // The cpuset of a cgroup is only read when the CPUs are needed
+  if (cpus.empty() || cpus[0] != '/')
+  {
+    try
+    {
+      parse_cpu_list(cpus);
+    }
+    catch (const std::invalid_argument &ex)
+    {
+      errs_ << ex.what() << std::endl;
+      return INVALID;
+    }
+  }
+
+  ap_->cpus = cpus;
   return OK;
 }
 
@@ -724,30 +843,45 @@ AttachPointParser::State AttachPointParser::watchpoint_parser(bool async)
 
 AttachPointParser::State AttachPointParser::kfunc_parser()
 {
-  if (parts_.size() != 2)
+  // kfunc:[module:]func
+  if (parts_.size() != 2 && parts_.size() != 3)
   {
     if (ap_->ignore_invalid)
       return SKIP;
 
-    errs_ << ap_->provider << " probe type requires 1 argument" << std::endl;
+    errs_ << ap_->provider << " probe type takes 2 arguments (1 optional)"
+          << std::endl;
     return INVALID;
   }
 
-  if (parts_[1].find('*') != std::string::npos)
+  if (parts_.size() == 3)
+  {
+    if (parts_[1].empty() || has_wildcard(parts_[1]))
+    {
+      errs_ << ap_->provider << " module name must be given, without wildcards"
+            << std::endl;
+      return INVALID;
+    }
+    ap_->target = parts_[1];
+  }
+
+  auto &func = parts_.back();
+  if (func.find('*') != std::string::npos)
     ap_->need_expansion = true;
 
-  ap_->func = parts_[1];
+  ap_->func = func;
   return OK;
 }
 
 AttachPointParser::State AttachPointParser::iter_parser()
 {
-  if (parts_.size() != 2 && parts_.size() != 3)
+  if (parts_.size() < 2 || parts_.size() > 4)
   {
     if (ap_->ignore_invalid)
       return SKIP;
 
-    errs_ << ap_->provider << " probe type takes 2 arguments (1 optional)"
+    errs_ << ap_->provider
+          << " probe type takes 1 argument, and a pin file or an interval"
           << std::endl;
     return INVALID;
   }
@@ -773,6 +907,29 @@ AttachPointParser::State AttachPointParser::iter_parser()
 
   if (parts_.size() == 3)
     ap_->pin = parts_[2];
+  else if (parts_.size() == 4)
+  {
+    // iter:task:s:5 runs the iterator again every 5 seconds, the unit and
+    // period are kept the way interval probes keep them
+    ap_->target = parts_[2];
+    try
+    {
+      std::size_t idx;
+      ap_->freq = std::stoi(parts_[3], &idx, 0);
+      if (idx != parts_[3].size())
+      {
+        errs_ << "Found trailing non-numeric characters: " << parts_[3]
+              << std::endl;
+        return INVALID;
+      }
+    }
+    catch (const std::exception &ex)
+    {
+      errs_ << "Failed to parse '" << parts_[3] << "': " << ex.what()
+            << std::endl;
+      return INVALID;
+    }
+  }
   return OK;
 }
 
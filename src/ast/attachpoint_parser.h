@@ -30,6 +30,7 @@ private:
   };
 
   State parse_attachpoint(AttachPoint &ap);
+  void upgrade_kprobes(Probe &probe);
   /*
    * This method splits an attach point definition into arguments,
    * where arguments are separated by `:`. The exception is `:`s inside
@@ -54,6 +55,8 @@ private:
   State interval_parser();
   State software_parser();
   State hardware_parser();
+  // The CPUs of profile, interval and hardware probes
+  State cpus_parser(const std::string &cpus);
   State watchpoint_parser(bool async = false);
   State kfunc_parser();
   State iter_parser();
@@ -6,26 +6,46 @@
 #include "codegen_helper.h"
 #include "log.h"
 #include "parser.tab.hh"
+#include "probe_matcher.h"
+#include "program_image.h"
 #include "signal_bt.h"
 #include "tracepoint_format_parser.h"
 #include "types.h"
 #include "usdt.h"
 #include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <ctime>
 #include <fstream>
+#include <thread>
 
 #include <llvm-c/Transforms/IPO.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#if LLVM_VERSION_MAJOR >= 7
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#endif
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 namespace bpftrace {
 namespace ast {
 
+// Largest read of several fields, see coalescedField()
+const uint64_t COALESCED_READ_MAX = 64;
+// Fewest instructions of a module worth optimizing and compiling on a thread
+// of its own, see CodegenLLVM::optimizeParts()
+const size_t PARALLEL_PART_MIN = 2000;
+
 CodegenLLVM::CodegenLLVM(Node *root, BPFtrace &bpftrace)
     : root_(root),
       bpftrace_(bpftrace),
@@ -108,8 +128,10 @@ void CodegenLLVM::kstack_ustack(const std::string &ident,
   if (ident == "ustack")
   {
     // pack uint64_t with: (uint32_t)stack_id, (uint32_t)pid
-    Value *pidhigh = b_.CreateShl(b_.CreateGetPidTgid(), 32);
+    Value *pidhigh = b_.CreateShl(getPidTgid(), 32);
     stackid = b_.CreateOr(stackid, pidhigh);
+    if (bpftrace_.maps.Has(MapManager::Type::RawSymbolsPids))
+      b_.CreateRawSymbolsPid(ctx_);
   }
 
   expr_ = stackid;
@@ -141,7 +163,7 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "pid" || builtin.ident == "tid")
   {
-    Value *pidtgid = b_.CreateGetPidTgid();
+    Value *pidtgid = getPidTgid();
     if (builtin.ident == "pid")
     {
       expr_ = b_.CreateLShr(pidtgid, 32);
@@ -153,11 +175,13 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "cgroup")
   {
-    expr_ = b_.CreateGetCurrentCgroupId();
+    expr_ = cachedBuiltin("cgroup",
+                          [this]() { return b_.CreateGetCurrentCgroupId(); });
   }
   else if (builtin.ident == "uid" || builtin.ident == "gid" || builtin.ident == "username")
   {
-    Value *uidgid = b_.CreateGetUidGid();
+    Value *uidgid = cachedBuiltin("uid_gid",
+                                  [this]() { return b_.CreateGetUidGid(); });
     if (builtin.ident == "uid"  || builtin.ident == "username")
     {
       expr_ = b_.CreateAnd(uidgid, 0xffffffff);
@@ -169,11 +193,12 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "cpu")
   {
-    expr_ = b_.CreateGetCpuId();
+    expr_ = cachedBuiltin("cpu", [this]() { return b_.CreateGetCpuId(); });
   }
   else if (builtin.ident == "curtask")
   {
-    expr_ = b_.CreateGetCurrentTask();
+    expr_ = cachedBuiltin("curtask",
+                          [this]() { return b_.CreateGetCurrentTask(); });
   }
   else if (builtin.ident == "rand")
   {
@@ -181,12 +206,25 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "comm")
   {
-    AllocaInst *buf = b_.CreateAllocaBPF(builtin.type, "comm");
-    // initializing memory needed for older kernels:
-    b_.CREATE_MEMSET(buf, b_.getInt8(0), builtin.type.GetSize(), 1);
-    b_.CreateGetCurrentComm(ctx_, buf, builtin.type.GetSize(), builtin.loc);
-    expr_ = buf;
-    expr_deleter_ = [this, buf]() { b_.CreateLifetimeEnd(buf); };
+    auto read_comm = [this, &builtin]() -> Value * {
+      AllocaInst *buf = b_.CreateAllocaBPF(builtin.type, "comm");
+      // initializing memory needed for older kernels:
+      b_.CREATE_MEMSET(buf, b_.getInt8(0), builtin.type.GetSize(), 1);
+      b_.CreateGetCurrentComm(ctx_, buf, builtin.type.GetSize(), builtin.loc);
+      return buf;
+    };
+    // Nothing writes to the buffer, so when comm is read again the same
+    // one can be used for the rest of the probe
+    if (comm_uses_ > 1)
+    {
+      expr_ = cachedBuiltin("comm", read_comm);
+    }
+    else
+    {
+      Value *buf = read_comm();
+      expr_ = buf;
+      expr_deleter_ = [this, buf]() { b_.CreateLifetimeEnd(buf); };
+    }
   }
   else if ((!builtin.ident.compare(0, 3, "arg") && builtin.ident.size() == 4 &&
       builtin.ident.at(3) >= '0' && builtin.ident.at(3) <= '9') ||
@@ -264,14 +302,7 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "probe")
   {
-    auto begin = bpftrace_.probe_ids_.begin();
-    auto end = bpftrace_.probe_ids_.end();
-    auto found = std::find(begin, end, probefull_);
-    builtin.probe_id = std::distance(begin, found);
-    if (found == end) {
-      bpftrace_.probe_ids_.push_back(probefull_);
-    }
-    expr_ = b_.getInt64(builtin.probe_id);
+    expr_ = getProbeId();
   }
   else if (builtin.ident == "args" || builtin.ident == "ctx")
   {
@@ -296,139 +327,218 @@ void CodegenLLVM::visit(Builtin &builtin)
 
 void CodegenLLVM::visit(Call &call)
 {
-  if (call.func == "count")
+  if (call.func == "count" && isMmapped(*call.map))
   {
     Map &map = *call.map;
-    AllocaInst *key = getMapKey(map);
-    Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, call.loc);
-    AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_val");
-    b_.CreateStore(b_.CreateAdd(oldval, b_.getInt64(1)), newval);
-    b_.CreateMapUpdateElem(ctx_, map, key, newval, call.loc);
-
-    // oldval can only be an integer so won't be in memory and doesn't need lifetime end
+    Value *key = getMapKey(map);
+    b_.CreateMapAtomicAdd(ctx_, map, key, b_.getInt64(1), call.loc);
     b_.CreateLifetimeEnd(key);
-    b_.CreateLifetimeEnd(newval);
     expr_ = nullptr;
   }
-  else if (call.func == "sum")
+  else if (call.func == "count")
   {
     Map &map = *call.map;
-    AllocaInst *key = getMapKey(map);
-    Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, call.loc);
-    AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_val");
-
+    Value *key = getMapKey(map);
+    b_.CreateMapUpdateInPlace(
+        ctx_,
+        map,
+        key,
+        b_.getInt64(1),
+        [&](Value *oldval) { return b_.CreateAdd(oldval, b_.getInt64(1)); },
+        call.loc);
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
+  else if (call.func == "sum" && isMmapped(*call.map))
+  {
+    Map &map = *call.map;
+    Value *key = getMapKey(map);
     auto scoped_del = accept(call.vargs->front());
     // promote int to 64-bit
     expr_ = b_.CreateIntCast(expr_,
                              b_.getInt64Ty(),
                              call.vargs->front()->type.IsSigned());
-    b_.CreateStore(b_.CreateAdd(expr_, oldval), newval);
-    b_.CreateMapUpdateElem(ctx_, map, key, newval, call.loc);
+    b_.CreateMapAtomicAdd(ctx_, map, key, expr_, call.loc);
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
+  else if (call.func == "sum")
+  {
+    Map &map = *call.map;
+    Value *key = getMapKey(map);
+
+    auto scoped_del = accept(call.vargs->front());
+    // promote int to 64-bit
+    Value *val = b_.CreateIntCast(expr_,
+                                  b_.getInt64Ty(),
+                                  call.vargs->front()->type.IsSigned());
+    b_.CreateMapUpdateInPlace(
+        ctx_,
+        map,
+        key,
+        val,
+        [&](Value *oldval) { return b_.CreateAdd(val, oldval); },
+        call.loc);
 
-    // oldval can only be an integer so won't be in memory and doesn't need lifetime end
     b_.CreateLifetimeEnd(key);
-    b_.CreateLifetimeEnd(newval);
     expr_ = nullptr;
   }
   else if (call.func == "min")
   {
     Map &map = *call.map;
-    AllocaInst *key = getMapKey(map);
-    Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, call.loc);
-    AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_val");
+    Value *key = getMapKey(map);
 
     // Store the max of (0xffffffff - val), so that our SGE comparison with uninitialized
     // elements will always store on the first occurrence. Revent this later when printing.
-    Function *parent = b_.GetInsertBlock()->getParent();
     auto scoped_del = accept(call.vargs->front());
     // promote int to 64-bit
     expr_ = b_.CreateIntCast(expr_,
                              b_.getInt64Ty(),
                              call.vargs->front()->type.IsSigned());
     Value *inverted = b_.CreateSub(b_.getInt64(0xffffffff), expr_);
-    BasicBlock *lt = BasicBlock::Create(module_->getContext(), "min.lt", parent);
-    BasicBlock *ge = BasicBlock::Create(module_->getContext(), "min.ge", parent);
-    b_.CreateCondBr(b_.CreateICmpSGE(inverted, oldval), ge, lt);
-
-    b_.SetInsertPoint(ge);
-    b_.CreateStore(inverted, newval);
-    b_.CreateMapUpdateElem(ctx_, map, key, newval, call.loc);
-    b_.CreateBr(lt);
+    b_.CreateMapUpdateInPlace(
+        ctx_,
+        map,
+        key,
+        inverted,
+        [&](Value *oldval) {
+          return b_.CreateSelect(b_.CreateICmpSGE(inverted, oldval),
+                                 inverted,
+                                 oldval);
+        },
+        call.loc);
 
-    b_.SetInsertPoint(lt);
     b_.CreateLifetimeEnd(key);
-    b_.CreateLifetimeEnd(newval);
     expr_ = nullptr;
   }
   else if (call.func == "max")
   {
     Map &map = *call.map;
-    AllocaInst *key = getMapKey(map);
-    Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, call.loc);
-    AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_val");
+    Value *key = getMapKey(map);
 
-    Function *parent = b_.GetInsertBlock()->getParent();
+    auto scoped_del = accept(call.vargs->front());
+    // promote int to 64-bit
+    Value *val = b_.CreateIntCast(expr_,
+                                  b_.getInt64Ty(),
+                                  call.vargs->front()->type.IsSigned());
+    b_.CreateMapUpdateInPlace(
+        ctx_,
+        map,
+        key,
+        val,
+        [&](Value *oldval) {
+          return b_.CreateSelect(b_.CreateICmpSGE(val, oldval), val, oldval);
+        },
+        call.loc);
+
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
+  else if (call.func == "distinct")
+  {
+    Map &map = *call.map;
+    Value *key = getMapKey(map);
     auto scoped_del = accept(call.vargs->front());
     // promote int to 64-bit
     expr_ = b_.CreateIntCast(expr_,
                              b_.getInt64Ty(),
                              call.vargs->front()->type.IsSigned());
-    BasicBlock *lt = BasicBlock::Create(module_->getContext(), "min.lt", parent);
-    BasicBlock *ge = BasicBlock::Create(module_->getContext(), "min.ge", parent);
-    b_.CreateCondBr(b_.CreateICmpSGE(expr_, oldval), ge, lt);
-
-    b_.SetInsertPoint(ge);
-    b_.CreateStore(expr_, newval);
-    b_.CreateMapUpdateElem(ctx_, map, key, newval, call.loc);
-    b_.CreateBr(lt);
+    b_.CreateDistinctUpdate(ctx_, map, key, expr_, call.loc);
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
+  else if (call.func == "cms_count")
+  {
+    Map &map = *call.map;
+    Expression &arg = *call.vargs->at(0);
+    uint64_t threshold = CMS_THRESHOLD;
+    if (call.vargs->size() == 2)
+      threshold = static_cast<Integer *>(call.vargs->at(1))->n;
 
-    b_.SetInsertPoint(lt);
+    // The counted value is the key of the tracked heavy hitters
+    auto scoped_del = accept(&arg);
+    AllocaInst *key;
+    Value *hash;
+    if (arg.type.IsStringTy())
+    {
+      key = b_.CreateAllocaBPF(arg.type, map.ident + "_key");
+      b_.CREATE_MEMCPY(key, expr_, arg.type.GetSize(), 1);
+      hash = b_.CreateMix64(b_.CreateStrHash(key, arg.type.GetSize()));
+    }
+    else
+    {
+      key = b_.CreateAllocaBPF(CreateUInt64(), map.ident + "_key");
+      Value *val = b_.CreateIntCast(expr_,
+                                    b_.getInt64Ty(),
+                                    arg.type.IsSigned());
+      b_.CreateStore(val, key);
+      hash = b_.CreateMix64(val);
+    }
+    b_.CreateCmsUpdate(ctx_, map, key, hash, threshold, call.loc);
     b_.CreateLifetimeEnd(key);
-    b_.CreateLifetimeEnd(newval);
     expr_ = nullptr;
   }
   else if (call.func == "avg" || call.func == "stats")
   {
-    // avg stores the count and total in a hist map using indexes 0 and 1
-    // respectively, and the calculation is made when printing.
+    // avg stores the count and total of each key in one value, the
+    // calculation is made when printing.
     Map &map = *call.map;
+    Value *key = getMapKey(map);
 
-    AllocaInst *count_key = getHistMapKey(map, b_.getInt64(0));
-    Value *count_old = b_.CreateMapLookupElem(ctx_, map, count_key, call.loc);
-    AllocaInst *count_new = b_.CreateAllocaBPF(map.type, map.ident + "_num");
-    b_.CreateStore(b_.CreateAdd(count_old, b_.getInt64(1)), count_new);
-    b_.CreateMapUpdateElem(ctx_, map, count_key, count_new, call.loc);
-    b_.CreateLifetimeEnd(count_key);
-    b_.CreateLifetimeEnd(count_new);
-
-    AllocaInst *total_key = getHistMapKey(map, b_.getInt64(1));
-    Value *total_old = b_.CreateMapLookupElem(ctx_, map, total_key, call.loc);
-    AllocaInst *total_new = b_.CreateAllocaBPF(map.type, map.ident + "_val");
     auto scoped_del = accept(call.vargs->front());
     // promote int to 64-bit
-    expr_ = b_.CreateIntCast(expr_,
-                             b_.getInt64Ty(),
-                             call.vargs->front()->type.IsSigned());
-    b_.CreateStore(b_.CreateAdd(expr_, total_old), total_new);
-    b_.CreateMapUpdateElem(ctx_, map, total_key, total_new, call.loc);
-    b_.CreateLifetimeEnd(total_key);
-    b_.CreateLifetimeEnd(total_new);
+    Value *val = b_.CreateIntCast(expr_,
+                                  b_.getInt64Ty(),
+                                  call.vargs->front()->type.IsSigned());
+    b_.CreateMapUpdateInPlace(
+        ctx_,
+        map,
+        key,
+        { b_.getInt64(1), val },
+        [&](std::vector<Value *> old) {
+          return std::vector<Value *>{ b_.CreateAdd(old[0], b_.getInt64(1)),
+                                       b_.CreateAdd(old[1], val) };
+        },
+        call.loc);
 
+    b_.CreateLifetimeEnd(key);
     expr_ = nullptr;
   }
   else if (call.func == "hist")
   {
-    if (!log2_func_)
-      log2_func_ = createLog2Function();
+    // Specialized to the range of the value's type, see
+    // createLog2Function(). 64-bit values from 2^63 stay in the bucket of
+    // the negative ones.
+    auto &type = call.vargs->front()->type;
+    bool is_signed = type.IsSigned();
+    bool negative = is_signed || type.GetSize() >= 8;
+    size_t bits = type.GetSize() * 8 - (is_signed ? 1 : 0);
+    int first_step = bits > 16 ? 4 : bits > 8 ? 3 : 2;
+    auto &log2_func = log2_funcs_[{ first_step, negative }];
+    if (!log2_func)
+      log2_func = createLog2Function(first_step, negative);
 
     Map &map = *call.map;
     auto scoped_del = accept(call.vargs->front());
     // promote int to 64-bit
-    expr_ = b_.CreateIntCast(expr_,
-                             b_.getInt64Ty(),
-                             call.vargs->front()->type.IsSigned());
-    Value *log2 = b_.CreateCall(log2_func_, expr_, "log2");
-    AllocaInst *key = getHistMapKey(map, log2);
+    expr_ = b_.CreateIntCast(expr_, b_.getInt64Ty(), is_signed);
+    Value *log2 = b_.CreateCall(log2_func, expr_, "log2");
+    if (uint32_t buckets = bucketArray(map))
+    {
+      Value *key = getMapKey(map);
+      b_.CreateBucketArrayAdd(ctx_, map, key, log2, buckets, call.loc);
+      b_.CreateLifetimeEnd(key);
+      expr_ = nullptr;
+      return;
+    }
+    Value *key = getHistMapKey(map, log2);
+    if (isMmapped(map))
+    {
+      b_.CreateMapAtomicAdd(ctx_, map, key, b_.getInt64(1), call.loc);
+      b_.CreateLifetimeEnd(key);
+      expr_ = nullptr;
+      return;
+    }
 
     Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, call.loc);
     AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_val");
@@ -442,40 +552,67 @@ void CodegenLLVM::visit(Call &call)
   }
   else if (call.func == "lhist")
   {
-    if (!linear_func_)
-      linear_func_ = createLinearFunction();
-
     Map &map = *call.map;
     auto scoped_del = accept(call.vargs->front());
 
-    // prepare arguments
+    // min, max and step are literals, see the semantic analyser
     auto *value_arg = call.vargs->at(0);
-    auto *min_arg = call.vargs->at(1);
-    auto *max_arg = call.vargs->at(2);
-    auto *step_arg = call.vargs->at(3);
-    Value *value, *min, *max, *step;
+    auto &min = static_cast<Integer &>(*call.vargs->at(1));
+    auto &max = static_cast<Integer &>(*call.vargs->at(2));
+    auto &step = static_cast<Integer &>(*call.vargs->at(3));
     auto scoped_del_value_arg = accept(value_arg);
-    value = expr_;
-    auto scoped_del_min_arg = accept(min_arg);
-    min = expr_;
-    auto scoped_del_max_arg = accept(max_arg);
-    max = expr_;
-    auto scoped_del_step_arg = accept(step_arg);
-    step = expr_;
 
     // promote int to 64-bit
-    value = b_.CreateIntCast(value,
-                             b_.getInt64Ty(),
-                             call.vargs->front()->type.IsSigned());
-    min = b_.CreateIntCast(min, b_.getInt64Ty(), false);
-    max = b_.CreateIntCast(max, b_.getInt64Ty(), false);
-    step = b_.CreateIntCast(step, b_.getInt64Ty(), false);
+    Value *value = b_.CreateIntCast(expr_,
+                                    b_.getInt64Ty(),
+                                    call.vargs->front()->type.IsSigned());
+    Value *linear = createLinear(value, min.n, max.n, step.n);
+
+    if (uint32_t buckets = bucketArray(map))
+    {
+      Value *key = getMapKey(map);
+      b_.CreateBucketArrayAdd(ctx_, map, key, linear, buckets, call.loc);
+      b_.CreateLifetimeEnd(key);
+      expr_ = nullptr;
+      return;
+    }
+    Value *key = getHistMapKey(map, linear);
+    if (isMmapped(map))
+    {
+      b_.CreateMapAtomicAdd(ctx_, map, key, b_.getInt64(1), call.loc);
+      b_.CreateLifetimeEnd(key);
+      expr_ = nullptr;
+      return;
+    }
+
+    Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, call.loc);
+    AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_val");
+    b_.CreateStore(b_.CreateAdd(oldval, b_.getInt64(1)), newval);
+    b_.CreateMapUpdateElem(ctx_, map, key, newval, call.loc);
+
+    // oldval can only be an integer so won't be in memory and doesn't need lifetime end
+    b_.CreateLifetimeEnd(key);
+    b_.CreateLifetimeEnd(newval);
+    expr_ = nullptr;
+  }
+  else if (call.func == "llhist")
+  {
+    if (!log_linear_func_)
+      log_linear_func_ = createLogLinearFunction();
 
-    Value *linear = b_.CreateCall(linear_func_,
-                                  { value, min, max, step },
-                                  "linear");
+    Map &map = *call.map;
+    auto scoped_del = accept(call.vargs->front());
+    // promote int to 64-bit
+    Value *value = b_.CreateIntCast(expr_,
+                                    b_.getInt64Ty(),
+                                    call.vargs->front()->type.IsSigned());
+    auto &sub_buckets = static_cast<Integer &>(*call.vargs->at(1));
+    Value *bits = b_.getInt64(__builtin_ctzll(sub_buckets.n));
+    Value *log_linear = b_.CreateCall(log_linear_func_,
+                                      { value, bits },
+                                      "log_linear");
 
-    AllocaInst *key = getHistMapKey(map, linear);
+    Value *key = getHistMapKey(map, log_linear);
 
     Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, call.loc);
     AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_val");
@@ -491,7 +628,7 @@ void CodegenLLVM::visit(Call &call)
   {
     auto &arg = *call.vargs->at(0);
     auto &map = static_cast<Map&>(arg);
-    AllocaInst *key = getMapKey(map);
+    Value *key = getMapKey(map);
     auto imap = *bpftrace_.maps.Lookup(map.ident);
     if (!imap->is_clearable())
     {
@@ -528,11 +665,11 @@ void CodegenLLVM::visit(Call &call)
     } else {
       b_.CreateStore(b_.getInt64(bpftrace_.strlen_), strlen);
     }
-    AllocaInst *buf = b_.CreateAllocaBPF(bpftrace_.strlen_, "str");
+    Value *buf = b_.CreateScratchBPF(bpftrace_.strlen_, "str");
     b_.CREATE_MEMSET(buf, b_.getInt8(0), bpftrace_.strlen_, 1);
     auto arg0 = call.vargs->front();
     auto scoped_del = accept(call.vargs->front());
-    b_.CreateProbeReadStr(
+    str_len_ = b_.CreateProbeReadStr(
         ctx_, buf, b_.CreateLoad(strlen), expr_, arg0->type.GetAS(), call.loc);
     b_.CreateLifetimeEnd(strlen);
 
@@ -664,42 +801,83 @@ void CodegenLLVM::visit(Call &call)
                     notzero,
                     zero);
 
-    // arg0
     b_.SetInsertPoint(notzero);
     b_.CreateStore(b_.getInt64(asyncactionint(AsyncAction::join)), perfdata);
     b_.CreateStore(b_.getInt64(join_id_),
                    b_.CreateGEP(perfdata, b_.getInt64(8)));
     join_id_++;
-    AllocaInst *arr = b_.CreateAllocaBPF(b_.getInt64Ty(), call.func + "_r0");
-    b_.CreateProbeRead(ctx_, arr, 8, expr_, addrspace, call.loc);
-    b_.CreateProbeReadStr(ctx_,
-                          b_.CreateAdd(perfdata, b_.getInt64(8 + 8)),
-                          bpftrace_.join_argsize_,
-                          b_.CreateLoad(arr),
-                          addrspace,
-                          call.loc);
-
-    for (unsigned int i = 1; i < bpftrace_.join_argnum_; i++)
-    {
-      // argi
+
+    // The length of each argument, then the arguments one after the other,
+    // up to the first NULL pointer of the array
+    size_t argnum = bpftrace_.join_argnum_;
+    size_t argsize = bpftrace_.join_argsize_;
+    size_t strings = 8 + 8 + argnum * sizeof(uint32_t);
+    AllocaInst *offset = b_.CreateAllocaBPF(b_.getInt64Ty(),
+                                            call.func + "_offset");
+    b_.CreateStore(b_.getInt64(0), offset);
+    BasicBlock *emit = BasicBlock::Create(module_->getContext(),
+                                          "joinemit",
+                                          parent);
+    for (size_t i = 0; i < argnum; i++)
+    {
+      Value *len_ptr = b_.CreatePointerCast(
+          b_.CreateGEP(perfdata, b_.getInt64(8 + 8 + i * sizeof(uint32_t))),
+          b_.getInt32Ty()->getPointerTo());
+      // The buffer is reused, the lengths past the last argument are 0
+      b_.CreateStore(b_.getInt32(0), len_ptr);
+
       b_.CreateStore(b_.CreateAdd(expr_, b_.getInt64(8 * i)), first);
       b_.CreateProbeRead(
           ctx_, second, 8, b_.CreateLoad(first), addrspace, call.loc);
-      b_.CreateProbeReadStr(
-          ctx_,
-          b_.CreateAdd(perfdata,
-                       b_.getInt64(8 + 8 + i * bpftrace_.join_argsize_)),
-          bpftrace_.join_argsize_,
-          b_.CreateLoad(second),
-          addrspace,
-          call.loc);
+      Value *arg = b_.CreateLoad(second);
+      BasicBlock *read = BasicBlock::Create(module_->getContext(),
+                                            "joinread",
+                                            parent);
+      b_.CreateCondBr(b_.CreateICmpEQ(arg, b_.getInt64(0)), emit, read);
+
+      // The bounds are spelled out for the verifier
+      b_.SetInsertPoint(read);
+      Value *max_offset = b_.getInt64(i * argsize);
+      Value *off = b_.CreateLoad(offset);
+      off = b_.CreateSelect(b_.CreateICmpULE(off, max_offset), off, max_offset);
+      Value *len = b_.CreateProbeReadStr(ctx_,
+                                         b_.CreateGEP(perfdata,
+                                                      b_.CreateAdd(off,
+                                                                   b_.getInt64(
+                                                                       strings))),
+                                         argsize,
+                                         arg,
+                                         addrspace,
+                                         call.loc);
+      len = b_.CreateIntCast(len, b_.getInt64Ty(), true);
+      len = b_.CreateSelect(b_.CreateICmpSGT(len, b_.getInt64(0)),
+                            len,
+                            b_.getInt64(0));
+      len = b_.CreateSelect(b_.CreateICmpULE(len, b_.getInt64(argsize)),
+                            len,
+                            b_.getInt64(argsize));
+      b_.CreateStore(b_.CreateIntCast(len, b_.getInt32Ty(), false), len_ptr);
+      b_.CreateStore(b_.CreateAdd(off, len), offset);
+      if (i + 1 < argnum)
+      {
+        BasicBlock *next = BasicBlock::Create(module_->getContext(),
+                                              "joinnext",
+                                              parent);
+        b_.CreateCondBr(b_.CreateICmpEQ(len, b_.getInt64(0)), emit, next);
+        b_.SetInsertPoint(next);
+      }
+      else
+        b_.CreateBr(emit);
     }
 
     // emit
-    b_.CreatePerfEventOutput(
-        ctx_,
-        perfdata,
-        8 + 8 + bpftrace_.join_argnum_ * bpftrace_.join_argsize_);
+    b_.SetInsertPoint(emit);
+    Value *max_size = b_.getInt64(argnum * argsize);
+    Value *size = b_.CreateLoad(offset);
+    size = b_.CreateSelect(b_.CreateICmpULE(size, max_size), size, max_size);
+    b_.CreatePerfEventOutput(ctx_,
+                             perfdata,
+                             b_.CreateAdd(size, b_.getInt64(strings)));
 
     b_.CreateBr(zero);
 
@@ -716,6 +894,15 @@ void CodegenLLVM::visit(Call &call)
   {
     auto scoped_del = accept(call.vargs->front());
     expr_ = b_.CreateUSym(expr_);
+    if (bpftrace_.maps.Has(MapManager::Type::RawSymbolsPids))
+      b_.CreateRawSymbolsPid(ctx_);
+  }
+  else if (call.func == "cgroup_path")
+  {
+    // The id, the path is looked up when it is printed
+    auto &arg = *call.vargs->front();
+    auto scoped_del = accept(&arg);
+    expr_ = b_.CreateIntCast(expr_, b_.getInt64Ty(), arg.type.IsSigned());
   }
   else if (call.func == "ntop")
   {
@@ -863,6 +1050,28 @@ void CodegenLLVM::visit(Call &call)
     createFormatStringCall(
         call, cat_id_, bpftrace_.cat_args_, "cat", AsyncAction::cat);
   }
+  else if (call.func == "enable" || call.func == "disable")
+  {
+    // Every probe with an attach point of that name
+    auto name = bpftrace_.get_string_literal(call.vargs->at(0));
+    std::set<uint32_t> gates;
+    for (auto &[gate, gate_name] : bpftrace_.probe_gates_)
+      if (gate_name == name)
+        gates.insert(gate);
+    for (uint32_t gate : gates)
+      b_.CreateSetProbeDisabled(gate, call.func == "disable");
+    expr_ = nullptr;
+  }
+  else if (call.func == "dump")
+  {
+    // Sent like exit(), the events it prints are already in the rings
+    AllocaInst *perfdata = b_.CreateAllocaBPF(b_.getInt64Ty(), "perfdata");
+    b_.CreateStore(b_.getInt64(asyncactionint(AsyncAction::flight_dump)),
+                   perfdata);
+    b_.CreatePerfEventOutput(ctx_, perfdata, sizeof(uint64_t), true);
+    b_.CreateLifetimeEnd(perfdata);
+    expr_ = nullptr;
+  }
   else if (call.func == "exit")
   {
     /*
@@ -872,7 +1081,7 @@ void CodegenLLVM::visit(Call &call)
      */
     AllocaInst *perfdata = b_.CreateAllocaBPF(b_.getInt64Ty(), "perfdata");
     b_.CreateStore(b_.getInt64(asyncactionint(AsyncAction::exit)), perfdata);
-    b_.CreatePerfEventOutput(ctx_, perfdata, sizeof(uint64_t));
+    b_.CreatePerfEventOutput(ctx_, perfdata, sizeof(uint64_t), true);
     b_.CreateLifetimeEnd(perfdata);
     expr_ = nullptr;
     b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
@@ -892,6 +1101,35 @@ void CodegenLLVM::visit(Call &call)
     else
       createPrintNonMapCall(call, non_map_print_id_);
   }
+  else if (call.func == "print_delta")
+  {
+    createPrintMapCall(call);
+  }
+  else if (call.func == "quantiles")
+  {
+    auto elements = AsyncEvent::Quantiles().asLLVMType(b_);
+    StructType *event_struct = b_.GetStructType(call.func + "_t",
+                                                elements,
+                                                true);
+
+    auto &map = static_cast<Map &>(*call.vargs->at(0));
+    AllocaInst *buf = b_.CreateAllocaBPF(event_struct,
+                                         call.func + "_" + map.ident);
+
+    b_.CreateStore(b_.getInt64(asyncactionint(AsyncAction::quantiles)),
+                   b_.CreateGEP(buf, { b_.getInt64(0), b_.getInt32(0) }));
+
+    auto id = bpftrace_.maps[map.ident].value()->id;
+    b_.CreateStore(b_.GetIntSameSize(id, elements.at(1)),
+                   b_.CreateGEP(buf, { b_.getInt64(0), b_.getInt32(1) }));
+    b_.CreateStore(b_.GetIntSameSize(quantiles_id_, elements.at(2)),
+                   b_.CreateGEP(buf, { b_.getInt64(0), b_.getInt32(2) }));
+
+    quantiles_id_++;
+    b_.CreatePerfEventOutput(ctx_, buf, getStructSize(event_struct), true);
+    b_.CreateLifetimeEnd(buf);
+    expr_ = nullptr;
+  }
   else if (call.func == "clear" || call.func == "zero")
   {
     auto elements = AsyncEvent::MapEvent().asLLVMType(b_);
@@ -919,7 +1157,7 @@ void CodegenLLVM::visit(Call &call)
     auto *ident_ptr = b_.CreateGEP(buf, { b_.getInt64(0), b_.getInt32(1) });
     b_.CreateStore(b_.GetIntSameSize(id, elements.at(1)), ident_ptr);
 
-    b_.CreatePerfEventOutput(ctx_, buf, getStructSize(event_struct));
+    b_.CreatePerfEventOutput(ctx_, buf, getStructSize(event_struct), true);
     b_.CreateLifetimeEnd(buf);
     expr_ = nullptr;
   }
@@ -940,7 +1178,7 @@ void CodegenLLVM::visit(Call &call)
                    b_.CreateGEP(buf, { b_.getInt64(0), b_.getInt32(1) }));
 
     time_id_++;
-    b_.CreatePerfEventOutput(ctx_, buf, getStructSize(time_struct));
+    b_.CreatePerfEventOutput(ctx_, buf, getStructSize(time_struct), true);
     b_.CreateLifetimeEnd(buf);
     expr_ = nullptr;
   }
@@ -987,6 +1225,22 @@ void CodegenLLVM::visit(Call &call)
   {
     expr_ = b_.getInt64(call.vargs->at(0)->type.GetSize());
   }
+  else if (call.func == "counter")
+  {
+    auto event = bpftrace_.get_string_literal(call.vargs->at(0));
+    int slot = current_attach_point_->counter_slot +
+               hardware_event_index(current_attach_point_->target, event);
+    expr_ = b_.CreateReadCounter(ctx_, slot, call.loc);
+  }
+  else if (call.func == "sample" || call.func == "ratelimit")
+  {
+    uint64_t n = static_cast<Integer *>(call.vargs->at(0))->n;
+    if (call.func == "sample")
+      expr_ = b_.CreateSample(sample_id_, n);
+    else
+      expr_ = b_.CreateRatelimit(sample_id_, n);
+    sample_id_++;
+  }
   else if (call.func == "strncmp") {
     uint64_t size = static_cast<Integer *>(call.vargs->at(2))->n;
     const auto& left_arg = call.vargs->at(0);
@@ -1028,6 +1282,15 @@ void CodegenLLVM::visit(Call &call)
                                false);
     }
   }
+  else if (call.func == "glob" || call.func == "strcontains")
+  {
+    auto scoped_del = accept(call.vargs->at(0));
+    auto pattern = bpftrace_.get_string_literal(call.vargs->at(1));
+    expr_ = b_.CreateStrMatch(expr_,
+                              call.func == "glob"
+                                  ? StrMatcher::glob(pattern)
+                                  : StrMatcher::contains(pattern));
+  }
   else if (call.func == "override")
   {
     // int bpf_override(struct pt_regs *regs, u64 rc)
@@ -1089,7 +1352,7 @@ void CodegenLLVM::visit(Call &call)
 
 void CodegenLLVM::visit(Map &map)
 {
-  AllocaInst *key = getMapKey(map);
+  Value *key = getMapKey(map);
   Value *value = b_.CreateMapLookupElem(ctx_, map, key, map.loc);
   expr_ = value;
 
@@ -1372,7 +1635,7 @@ void CodegenLLVM::visit(Unop &unop)
         if (unop.expr->is_map)
         {
           Map &map = static_cast<Map&>(*unop.expr);
-          AllocaInst *key = getMapKey(map);
+          Value *key = getMapKey(map);
           Value *oldval = b_.CreateMapLookupElem(ctx_, map, key, unop.loc);
           AllocaInst *newval = b_.CreateAllocaBPF(map.type, map.ident + "_newval");
           if (is_increment)
@@ -1398,6 +1661,7 @@ void CodegenLLVM::visit(Unop &unop)
           else
             newval = b_.CreateSub(oldval, b_.getInt64(1));
           b_.CreateStore(newval, variables_[var.ident]);
+          var_versions_[var.ident]++;
 
           if (unop.is_post_op)
             expr_ = oldval;
@@ -1477,6 +1741,8 @@ void CodegenLLVM::visit(Ternary &ternary)
   b_.CreateCondBr(b_.CreateICmpNE(cond, zero_value, "true_cond"),
                   left_block,
                   right_block);
+  // Neither branch dominates the other one or what follows
+  auto builtins = builtins_;
 
   if (ternary.type.IsIntTy())
   {
@@ -1488,6 +1754,7 @@ void CodegenLLVM::visit(Ternary &ternary)
                              ternary.type.IsSigned());
     b_.CreateStore(expr_, result);
     b_.CreateBr(done);
+    builtins_ = builtins;
 
     b_.SetInsertPoint(right_block);
     auto scoped_del_right = accept(ternary.right);
@@ -1496,6 +1763,7 @@ void CodegenLLVM::visit(Ternary &ternary)
                              ternary.type.IsSigned());
     b_.CreateStore(expr_, result);
     b_.CreateBr(done);
+    builtins_ = builtins;
 
     b_.SetInsertPoint(done);
     expr_ = b_.CreateLoad(result);
@@ -1507,11 +1775,13 @@ void CodegenLLVM::visit(Ternary &ternary)
     auto scoped_del_left = accept(ternary.left);
     b_.CREATE_MEMCPY(buf, expr_, ternary.type.GetSize(), 1);
     b_.CreateBr(done);
+    builtins_ = builtins;
 
     b_.SetInsertPoint(right_block);
     auto scoped_del_right = accept(ternary.right);
     b_.CREATE_MEMCPY(buf, expr_, ternary.type.GetSize(), 1);
     b_.CreateBr(done);
+    builtins_ = builtins;
 
     b_.SetInsertPoint(done);
     expr_ = buf;
@@ -1525,11 +1795,13 @@ void CodegenLLVM::visit(Ternary &ternary)
       auto scoped_del = accept(ternary.left);
     }
     b_.CreateBr(done);
+    builtins_ = builtins;
     b_.SetInsertPoint(right_block);
     {
       auto scoped_del = accept(ternary.right);
     }
     b_.CreateBr(done);
+    builtins_ = builtins;
     b_.SetInsertPoint(done);
     expr_ = nullptr;
   }
@@ -1653,10 +1925,14 @@ void CodegenLLVM::visit(FieldAccess &acc)
         expr_ = b_.CreateAdd(expr_, b_.CreatePtrToInt(ctx_, b_.getInt64Ty()));
       }
     }
+    else if (Value *value = coalescedField(acc, field))
+    {
+      expr_ = value;
+    }
     else
     {
       probereadDatastructElem(expr_,
-                              b_.getInt64(field.offset),
+                              fieldOffset(type, acc.field, field),
                               type,
                               field.type,
                               scoped_del,
@@ -1757,7 +2033,7 @@ void CodegenLLVM::visit(Tuple &tuple)
   compareStructure(tuple.type, tuple_ty);
 
   size_t tuple_size = datalayout().getTypeAllocSize(tuple_ty);
-  AllocaInst *buf = b_.CreateAllocaBPF(tuple_ty, "tuple");
+  Value *buf = b_.CreateScratchBPF(tuple_ty, "tuple");
   b_.CREATE_MEMSET(buf, b_.getInt8(0), tuple_size, 1);
   for (size_t i = 0; i < tuple.elems->size(); ++i)
   {
@@ -1799,7 +2075,7 @@ void CodegenLLVM::visit(AssignMapStatement &assignment)
 
   Value *val, *expr;
   expr = expr_;
-  AllocaInst *key = getMapKey(map);
+  Value *key = getMapKey(map);
   if (shouldBeOnStackAlready(assignment.expr->type))
   {
     val = expr;
@@ -1856,6 +2132,7 @@ void CodegenLLVM::visit(AssignVarStatement &assignment)
   Variable &var = *assignment.var;
 
   auto scoped_del = accept(assignment.expr);
+  var_versions_[var.ident]++;
 
   if (variables_.find(var.ident) == variables_.end())
   {
@@ -1930,11 +2207,15 @@ void CodegenLLVM::visit(If &if_block)
     b_.CreateCondBr(cond, if_true, if_end);
   }
 
+  // Builtins computed in a branch can't be used past it
+  auto builtins = builtins_;
+
   b_.SetInsertPoint(if_true);
   for (Statement *stmt : *if_block.stmts)
     auto scoped_del = accept(stmt);
 
   b_.CreateBr(if_end);
+  builtins_ = builtins;
 
   b_.SetInsertPoint(if_end);
 
@@ -1945,6 +2226,7 @@ void CodegenLLVM::visit(If &if_block)
       auto scoped_del = accept(stmt);
 
     b_.CreateBr(if_end);
+    builtins_ = builtins;
     b_.SetInsertPoint(if_end);
   }
 }
@@ -2014,6 +2296,8 @@ void CodegenLLVM::visit(While &while_block)
                                              parent);
 
   loops_.push_back(std::make_tuple(while_cond, while_end));
+  // What is read before the loop may be changed by the iterations
+  loops_generated_++;
 
   b_.CreateBr(while_cond);
 
@@ -2023,17 +2307,123 @@ void CodegenLLVM::visit(While &while_block)
   auto *cond = b_.CreateICmpNE(expr_, zero_value, "true_cond");
   b_.CreateCondBr(cond, while_body, while_end);
 
+  // The condition dominates the body, not the other way around
+  auto builtins = builtins_;
+
   b_.SetInsertPoint(while_body);
   for (Statement *stmt : *while_block.stmts)
   {
     auto scoped_del = accept(stmt);
   }
   b_.CreateBr(while_cond);
+  builtins_ = builtins;
 
   b_.SetInsertPoint(while_end);
   loops_.pop_back();
 }
 
+// The body is a callback of bpf_for_each_map_elem(), a function of its own
+// in the section of the probe with a frame of its own. The probe's context
+// is passed to it through the callback context, its variables aren't (see
+// the semantic analyser).
+void CodegenLLVM::visit(For &for_loop)
+{
+  Function *parent = b_.GetInsertBlock()->getParent();
+  // long callback(struct bpf_map *map, void *key, void *value, void *ctx)
+  // Return: 0 to go on with the next entry, 1 to stop
+  FunctionType *callback_type = FunctionType::get(
+      b_.getInt64Ty(),
+      { b_.getInt8PtrTy(),
+        b_.getInt8PtrTy(),
+        b_.getInt8PtrTy(),
+        b_.getInt8PtrTy() },
+      false);
+  Function *callback = Function::Create(callback_type,
+                                        Function::InternalLinkage,
+                                        "map_for_each_cb",
+                                        module_.get());
+  callback->addFnAttr(Attribute::NoInline);
+  callback->setSection(parent->getSection());
+
+  AllocaInst *callback_ctx = b_.CreateAllocaBPF(b_.getInt8PtrTy(),
+                                                "for_each_ctx");
+  b_.CreateStore(ctx_, callback_ctx);
+
+  auto ip = b_.saveIP();
+  Value *ctx = ctx_;
+  auto variables = std::move(variables_);
+  auto builtins = std::move(builtins_);
+  auto read_bufs = std::move(read_bufs_);
+  Value *scratch = b_.SuspendScratch();
+  variables_.clear();
+  builtins_.clear();
+  read_bufs_.clear();
+
+  b_.SetInsertPoint(
+      BasicBlock::Create(module_->getContext(), "entry", callback));
+  auto arg = callback->arg_begin();
+  Value *key = arg + 1;
+  Value *val = arg + 2;
+  ctx_ = b_.CreateLoad(
+      b_.getInt8PtrTy(),
+      b_.CreatePointerCast(arg + 3, b_.getInt8PtrTy()->getPointerTo()),
+      "ctx");
+  if (scratch)
+    b_.CreateScratchInit(true);
+
+  // $kv is a copy of the entry, the body may change the map
+  SizedType &type = for_loop.decl->type;
+  AllocaInst *kv = b_.CreateAllocaBPF(type, for_loop.decl->ident);
+  auto *kv_type = b_.GetType(type);
+  for (size_t i = 0; i < 2; i++)
+  {
+    Value *field = b_.CreateGEP(kv_type,
+                                kv,
+                                { b_.getInt32(0), b_.getInt32(i) });
+    b_.CREATE_MEMCPY(field,
+                     i ? val : key,
+                     type.GetField(i).type.GetSize(),
+                     1);
+  }
+  variables_[for_loop.decl->ident] = kv;
+
+  BasicBlock *for_continue = BasicBlock::Create(module_->getContext(),
+                                                "for_continue",
+                                                callback);
+  BasicBlock *for_break = BasicBlock::Create(module_->getContext(),
+                                             "for_break",
+                                             callback);
+  loops_.push_back(std::make_tuple(for_continue, for_break));
+  for (Statement *stmt : *for_loop.stmts)
+  {
+    auto scoped_del = accept(stmt);
+  }
+  b_.CreateBr(for_continue);
+  loops_.pop_back();
+
+  b_.SetInsertPoint(for_continue);
+  b_.CreateRet(b_.getInt64(0));
+  b_.SetInsertPoint(for_break);
+  b_.CreateRet(b_.getInt64(1));
+
+  b_.restoreIP(ip);
+  ctx_ = ctx;
+  variables_ = std::move(variables);
+  builtins_ = std::move(builtins);
+  read_bufs_ = std::move(read_bufs);
+  b_.ResumeScratch(scratch);
+  // What is read before the loop may be changed by the body
+  loops_generated_++;
+
+  b_.CreateForEachMapElem(ctx_,
+                          *for_loop.map,
+                          callback,
+                          b_.CreatePointerCast(callback_ctx,
+                                               b_.getInt8PtrTy()),
+                          for_loop.loc);
+  b_.CreateLifetimeEnd(callback_ctx);
+}
+
 void CodegenLLVM::visit(Predicate &pred)
 {
   Function *parent = b_.GetInsertBlock()->getParent();
@@ -2081,25 +2471,74 @@ void CodegenLLVM::generateProbe(Probe &probe,
     current_attach_point_->set_index(full_func_id, index);
   else
     probe.set_index(index);
+  auto section = get_section_name_for_probe(section_name,
+                                            index,
+                                            usdt_location_index);
   Function *func = Function::Create(
       func_type, Function::ExternalLinkage, section_name, module_.get());
-  func->setSection(
-      get_section_name_for_probe(section_name, index, usdt_location_index));
+  func->setSection(section);
   BasicBlock *entry = BasicBlock::Create(module_->getContext(), "entry", func);
   b_.SetInsertPoint(entry);
 
   // check: do the following 8 lines need to be in the wildcard loop?
   ctx_ = func->arg_begin();
+  comm_uses_ = countBuiltin(probe, "comm");
+  // With --estimate the program attached only counts the runs, the actual
+  // one is generated in a section of its own for its instructions. The
+  // probes run by bpftrace itself work as usual.
+  bool estimate = bpftrace_.estimate_secs_ && !probe.self_profile &&
+                  !probe.target_tracking && !probe.flush_events;
+  if (estimate)
+  {
+    b_.CreateProbeCount(getProbeId());
+    b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
+
+    section = get_section_name_for_estimate(section);
+    if (probe_cookies_ || probe_ids_at_load_)
+    {
+      for (auto &name : probeNames(probe))
+        bpftrace_.estimate_sections_[name] = section;
+    }
+    else
+      bpftrace_.estimate_sections_[probefull_] = section;
+    func = Function::Create(
+        func_type, Function::ExternalLinkage, section, module_.get());
+    func->setSection(section);
+    b_.SetInsertPoint(
+        BasicBlock::Create(module_->getContext(), "entry", func));
+    ctx_ = func->arg_begin();
+  }
+  startProgram(probe);
+  // Every run is counted, even those filtered out below
+  if (bpftrace_.probe_counts_ && !estimate)
+    b_.CreateProbeCount(getProbeId());
+  generateProbeGate(probe);
+  generateTargetFilter(probe);
+  generateAdaptiveSample(probe);
+  if (probe.flush_events)
+    b_.CreateFlushEvents(ctx_);
   if (probe.pred)
   {
     auto scoped_del = accept(probe.pred);
   }
-  variables_.clear();
-  for (Statement *stmt : *probe.stmts)
+  generateStatements(probe, 0);
+
+  // The rest of a large probe goes in programs chained with tail calls
+  for (size_t part = 1; part <= probe.tail_calls.size(); part++)
   {
-    auto scoped_del = accept(stmt);
+    auto tail_section = get_section_name_for_tail_call(section,
+                                                       tail_call_id_++);
+    Function *tail_func = Function::Create(func_type,
+                                           Function::ExternalLinkage,
+                                           tail_section,
+                                           module_.get());
+    tail_func->setSection(tail_section);
+    b_.SetInsertPoint(
+        BasicBlock::Create(module_->getContext(), "entry", tail_func));
+    ctx_ = tail_func->arg_begin();
+    startProgram(probe);
+    generateStatements(probe, part);
   }
-  b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
 
   auto pt = probetype(current_attach_point_->provider);
   if ((pt == ProbeType::watchpoint || pt == ProbeType::asyncwatchpoint) &&
@@ -2108,59 +2547,263 @@ void CodegenLLVM::generateProbe(Probe &probe,
         func_type, section_name, current_attach_point_->address, index);
 }
 
-void CodegenLLVM::visit(Probe &probe)
+void CodegenLLVM::startProgram(Probe &probe)
 {
-  FunctionType *func_type = FunctionType::get(
-      b_.getInt64Ty(),
-      {b_.getInt8PtrTy()}, // struct pt_regs *ctx
-      false);
+  builtins_.clear();
+  read_bufs_.clear();
+  findCoalescedReads(probe);
+  if (bpftrace_.feature_->has_bpf2bpf_call())
+  {
+    // Each program gets its own copy of the helpers it calls
+    log2_funcs_.clear();
+    log_linear_func_ = nullptr;
+  }
+  // Tail calls and BPF to BPF calls don't mix, see
+  // SemanticAnalyser::split_probe()
+  inline_helpers_ = !bpftrace_.feature_->has_bpf2bpf_call() ||
+                    !probe.tail_calls.empty();
+  if (probe.need_scratch)
+    b_.CreateScratchInit();
+}
 
-  // Probe has at least one attach point (required by the parser)
-  auto &attach_point = (*probe.attach_points)[0];
+void CodegenLLVM::generateStatements(Probe &probe, size_t part)
+{
+  auto &splits = probe.tail_calls;
+  size_t begin = part ? splits[part - 1] : 0;
+  size_t end = part < splits.size() ? splits[part] : probe.stmts->size();
 
-  // All usdt probes need expansion to be able to read arguments
-  if (probetype(attach_point->provider) == ProbeType::usdt)
-    probe.need_expansion = true;
+  variables_.clear();
+  for (size_t i = begin; i < end; i++)
+  {
+    auto scoped_del = accept(probe.stmts->at(i));
+  }
+  // Doesn't return unless the next program couldn't be run
+  if (part < splits.size())
+    b_.CreateTailCall(ctx_, tail_call_id_);
+  b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
+  b_.ClearScratch();
+}
 
-  current_attach_point_ = attach_point;
+// Some probes don't run on behalf of any task. The --self-profile probe
+// filters on bpftrace itself, the probes keeping the set of --pids and
+// --comm and flushing the batched events run for any process.
+bool CodegenLLVM::isTasklessProbe(Probe &probe)
+{
+  auto &provider = current_attach_point_->provider;
+  auto pt = probetype(provider);
+  return provider == "BEGIN" || provider == "END" ||
+         pt == ProbeType::interval || pt == ProbeType::iter ||
+         probe.self_profile || probe.target_tracking || probe.flush_events;
+}
 
-  /*
-   * Most of the time, we can take a probe like kprobe:do_f* and build a
-   * single BPF program for that, called "s_kprobe:do_f*", and attach it to
-   * each wildcard match. An exception is the "probe" builtin, where we need
-   * to build different BPF programs for each wildcard match that cantains an
-   * ID for the match. Those programs will be called "s_kprobe:do_fcntl" etc.
-   */
-  if (probe.need_expansion == false) {
-    // build a single BPF program pre-wildcards
-    probefull_ = probe.name();
-    generateProbe(probe, probefull_, probefull_, func_type, false);
-  } else {
-    /*
-     * Build a separate BPF program for each wildcard match.
-     * We begin by saving state that gets changed by the codegen pass, so we
-     * can restore it for the next pass (printf_id_, time_id_).
-     */
-    int starting_printf_id = printf_id_;
-    int starting_cat_id = cat_id_;
-    int starting_system_id = system_id_;
-    int starting_time_id = time_id_;
-    int starting_strftime_id = strftime_id_;
-    int starting_join_id = join_id_;
-    int starting_helper_error_id = b_.helper_error_id_;
-    int starting_non_map_print_id = non_map_print_id_;
-    int starting_seq_printf_id = seq_printf_id_;
+void CodegenLLVM::generateTargetFilter(Probe &probe)
+{
+  auto pt = probetype(current_attach_point_->provider);
+  // USDT probes and watchpoints are only enabled for the process given with
+  // -p already, and uprobes are for the binary it is running.
+  bool any_task = isTasklessProbe(probe);
+  bool pid_task = pt == ProbeType::usdt || pt == ProbeType::watchpoint ||
+                  pt == ProbeType::asyncwatchpoint ||
+                  pt == ProbeType::uprobe || pt == ProbeType::uretprobe;
+  if (any_task)
+    return;
 
-    auto reset_ids = [&]() {
-      printf_id_ = starting_printf_id;
-      cat_id_ = starting_cat_id;
-      system_id_ = starting_system_id;
-      time_id_ = starting_time_id;
-      strftime_id_ = starting_strftime_id;
+  Value *other = nullptr;
+  if (bpftrace_.pid() > 0 && !pid_task)
+  {
+    Value *pid = b_.CreateLShr(getPidTgid(), 32);
+    other = b_.CreateICmpNE(pid, b_.getInt64(bpftrace_.pid()));
+  }
+  // The set is looked up by all the other probes, uprobes included: they're
+  // attached to the binaries once rather than for each process
+  if (auto set = bpftrace_.maps.Lookup(BPFtrace::TARGET_PIDS_MAP))
+  {
+    Value *other_pid = b_.CreateNot(
+        b_.CreateIsTargetPid(**set, b_.CreateLShr(getPidTgid(), 32)));
+    other = other ? b_.CreateOr(other, other_pid) : other_pid;
+  }
+  if (bpftrace_.cgroup_filter_)
+  {
+    Value *cgroup = cachedBuiltin(
+        "cgroup", [this]() { return b_.CreateGetCurrentCgroupId(); });
+    Value *other_cgroup = b_.CreateICmpNE(
+        cgroup, b_.getInt64(bpftrace_.cgroup_filter_));
+    other = other ? b_.CreateOr(other, other_cgroup) : other_cgroup;
+  }
+  if (!other)
+    return;
+
+  Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *other_task = BasicBlock::Create(module_->getContext(),
+                                              "other_task",
+                                              parent);
+  BasicBlock *target_task = BasicBlock::Create(module_->getContext(),
+                                               "target_task",
+                                               parent);
+  b_.CreateCondBr(other, other_task, target_task);
+  b_.SetInsertPoint(other_task);
+  b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
+  b_.SetInsertPoint(target_task);
+}
+
+// The probes run by bpftrace itself, the timers and BEGIN/END aren't sampled
+void CodegenLLVM::generateAdaptiveSample(Probe &probe)
+{
+  if (!bpftrace_.maps.Has(MapManager::Type::AdaptiveSample) ||
+      isTasklessProbe(probe))
+    return;
+
+  Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *sampled_out = BasicBlock::Create(module_->getContext(),
+                                               "sampled_out",
+                                               parent);
+  BasicBlock *sampled_in = BasicBlock::Create(module_->getContext(),
+                                              "sampled_in",
+                                              parent);
+  b_.CreateCondBr(b_.CreateICmpEQ(b_.CreateAdaptiveSample(), b_.getInt64(0)),
+                  sampled_out,
+                  sampled_in);
+  b_.SetInsertPoint(sampled_out);
+  b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
+  b_.SetInsertPoint(sampled_in);
+}
+
+void CodegenLLVM::generateProbeGate(Probe &probe)
+{
+  if (!bpftrace_.maps.Has(MapManager::Type::ProbeGates) || probe.gate < 0)
+    return;
+
+  Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *disabled = BasicBlock::Create(module_->getContext(),
+                                            "probe_disabled",
+                                            parent);
+  BasicBlock *enabled = BasicBlock::Create(module_->getContext(),
+                                           "probe_enabled",
+                                           parent);
+  b_.CreateCondBr(b_.CreateICmpNE(b_.CreateProbeDisabled(probe.gate),
+                                  b_.getInt64(0)),
+                  disabled,
+                  enabled);
+  b_.SetInsertPoint(disabled);
+  b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
+  b_.SetInsertPoint(enabled);
+}
+
+// Names of all the probes the program of probe gets attached to
+std::vector<std::string> CodegenLLVM::probeNames(Probe &probe)
+{
+  std::vector<std::string> names;
+  for (auto attach_point : *probe.attach_points)
+  {
+    std::set<std::string> matches;
+    if (has_wildcard(attach_point->func))
+      matches = bpftrace_.probe_matcher_->get_matches_for_ap(*attach_point);
+    else
+      matches.insert(attach_point->func);
+
+    for (auto &match : matches)
+      names.push_back(attach_point->name(match));
+  }
+  return names;
+}
+
+// Registers the names of all the probes the program of probe gets attached
+// to, BPFtrace::add_probe() then gives each its id as cookie
+void CodegenLLVM::addProbeIds(Probe &probe)
+{
+  auto &ids = bpftrace_.probe_ids_;
+  for (auto &name : probeNames(probe))
+  {
+    if (std::find(ids.begin(), ids.end(), name) == ids.end())
+      ids.push_back(name);
+  }
+}
+
+Value *CodegenLLVM::getProbeId()
+{
+  if (probe_cookies_)
+    return b_.CreateGetAttachCookie(ctx_);
+  if (probe_ids_at_load_)
+    return b_.CreateBpfPseudoCallProbeId();
+
+  auto begin = bpftrace_.probe_ids_.begin();
+  auto end = bpftrace_.probe_ids_.end();
+  auto found = std::find(begin, end, probefull_);
+  uint64_t probe_id = std::distance(begin, found);
+  if (found == end)
+    bpftrace_.probe_ids_.push_back(probefull_);
+  return b_.getInt64(probe_id);
+}
+
+void CodegenLLVM::visit(Probe &probe)
+{
+  FunctionType *func_type = FunctionType::get(
+      b_.getInt64Ty(),
+      {b_.getInt8PtrTy()}, // struct pt_regs *ctx
+      false);
+
+  // Probe has at least one attach point (required by the parser)
+  auto &attach_point = (*probe.attach_points)[0];
+
+  // All usdt probes need expansion to be able to read arguments
+  if (probetype(attach_point->provider) == ProbeType::usdt)
+    probe.need_expansion = true;
+  // The tail calls of a program are shared by all the places it's loaded
+  if (probe.probe_ids_at_load && !probe.tail_calls.empty())
+  {
+    probe.probe_ids_at_load = false;
+    probe.need_expansion = true;
+  }
+
+  current_attach_point_ = attach_point;
+
+  /*
+   * Most of the time, we can take a probe like kprobe:do_f* and build a
+   * single BPF program for that, called "s_kprobe:do_f*", and attach it to
+   * each wildcard match. An exception is the "probe" builtin, where we need
+   * to build different BPF programs for each wildcard match that cantains an
+   * ID for the match. Those programs will be called "s_kprobe:do_fcntl" etc.
+   */
+  if (probe.need_expansion == false) {
+    // build a single BPF program pre-wildcards
+    probefull_ = probe.name();
+    probe_cookies_ = probe.use_cookies;
+    if (probe_cookies_)
+      addProbeIds(probe);
+    probe_ids_at_load_ = probe.probe_ids_at_load;
+    generateProbe(probe, probefull_, probefull_, func_type, false);
+    probe_cookies_ = false;
+    probe_ids_at_load_ = false;
+  } else {
+    /*
+     * Build a separate BPF program for each wildcard match.
+     * We begin by saving state that gets changed by the codegen pass, so we
+     * can restore it for the next pass (printf_id_, time_id_).
+     */
+    int starting_printf_id = printf_id_;
+    int starting_cat_id = cat_id_;
+    int starting_system_id = system_id_;
+    int starting_time_id = time_id_;
+    int starting_strftime_id = strftime_id_;
+    int starting_join_id = join_id_;
+    int starting_helper_error_id = b_.helper_error_id_;
+    int starting_non_map_print_id = non_map_print_id_;
+    int starting_quantiles_id = quantiles_id_;
+    int starting_seq_printf_id = seq_printf_id_;
+    int starting_sample_id = sample_id_;
+
+    auto reset_ids = [&]() {
+      printf_id_ = starting_printf_id;
+      cat_id_ = starting_cat_id;
+      system_id_ = starting_system_id;
+      time_id_ = starting_time_id;
+      strftime_id_ = starting_strftime_id;
       join_id_ = starting_join_id;
       b_.helper_error_id_ = starting_helper_error_id;
       non_map_print_id_ = starting_non_map_print_id;
+      quantiles_id_ = starting_quantiles_id;
       seq_printf_id_ = starting_seq_printf_id;
+      sample_id_ = starting_sample_id;
     };
 
     for (auto attach_point : *probe.attach_points) {
@@ -2233,6 +2876,8 @@ void CodegenLLVM::visit(Probe &probe)
             probefull_ = attach_point->provider;
           else if ((probetype(attach_point->provider) ==
                         ProbeType::tracepoint ||
+                    probetype(attach_point->provider) ==
+                        ProbeType::rawtracepoint ||
                     probetype(attach_point->provider) == ProbeType::uprobe ||
                     probetype(attach_point->provider) == ProbeType::uretprobe))
           {
@@ -2278,18 +2923,39 @@ int CodegenLLVM::getNextIndexForProbe(const std::string &probe_name) {
   return index;
 }
 
-AllocaInst *CodegenLLVM::getMapKey(Map &map)
+Value *CodegenLLVM::getMapKey(Map &map)
 {
-  AllocaInst *key;
+  Value *key;
   if (map.vargs) {
+    if (isDense(map))
+    {
+      // Array index, see IMap::dense_
+      auto scoped_del = accept(map.vargs->at(0));
+      key = b_.CreateAllocaBPF(b_.getInt32Ty(), map.ident + "_key");
+      b_.CreateStore(b_.CreateIntCast(expr_, b_.getInt32Ty(), false), key);
+    }
+    else if (isHashedKey(map))
+    {
+      // Hash of the string, see IMap::hashed_key_
+      Expression *expr = map.vargs->at(0);
+      auto scoped_del = accept(expr);
+      key = b_.CreateAllocaBPF(CreateUInt64(), map.ident + "_key");
+      b_.CreateHashedMapKey(map, expr_, expr->type.GetSize(), key);
+    }
     // A single value as a map key (e.g., @[comm] = 0;)
-    if (map.vargs->size() == 1)
+    else if (map.vargs->size() == 1)
     {
       Expression *expr = map.vargs->at(0);
       auto scoped_del = accept(expr);
-      if (onStack(expr->type))
+      if (onStack(expr->type) && isCachedBuiltin(expr_))
+      {
+        // Still used by the rest of the probe, the call-ee can't free it
+        key = b_.CreateAllocaBPF(expr->type, map.ident + "_key");
+        b_.CREATE_MEMCPY(key, expr_, expr->type.GetSize(), 1);
+      }
+      else if (onStack(expr->type))
       {
-        key = dyn_cast<AllocaInst>(expr_);
+        key = expr_;
         // Call-ee freed
         scoped_del.disarm();
       }
@@ -2317,20 +2983,27 @@ AllocaInst *CodegenLLVM::getMapKey(Map &map)
     else
     {
       // Two or more values as a map key (e.g, @[comm, pid] = 1;)
+      auto &layout = mapKey(map);
       size_t size = 0;
       for (Expression *expr : *map.vargs)
       {
         size += expr->type.GetSize();
       }
+      if (layout.is_packed())
+        size = layout.packed_size();
       key = b_.CreateAllocaBPF(size, map.ident + "_key");
 
       int offset = 0;
       // Construct a map key in the stack
-      for (Expression *expr : *map.vargs)
+      for (size_t i = 0; i < map.vargs->size(); i++)
       {
+        Expression *expr = map.vargs->at(i);
         auto scoped_del = accept(expr);
         Value *offset_val = b_.CreateGEP(
-            key, { b_.getInt64(0), b_.getInt64(offset) });
+            key,
+            { b_.getInt64(0),
+              b_.getInt64(layout.is_packed() ? layout.packed_[i].offset
+                                             : offset) });
 
         if (onStack(expr->type))
           b_.CREATE_MEMCPY(offset_val, expr_, expr->type.GetSize(), 1);
@@ -2346,6 +3019,13 @@ AllocaInst *CodegenLLVM::getMapKey(Map &map)
                                expr->type.GetAS(),
                                expr->loc);
           }
+          else if (layout.is_packed() && layout.packed_[i].size == 4)
+          {
+            b_.CreateStore(
+                b_.CreateIntCast(expr_, b_.getInt32Ty(), expr->type.IsSigned()),
+                b_.CreatePointerCast(offset_val,
+                                     b_.getInt32Ty()->getPointerTo()));
+          }
           else
           {
             // promote map key to 64-bit:
@@ -2368,30 +3048,61 @@ AllocaInst *CodegenLLVM::getMapKey(Map &map)
   return key;
 }
 
-AllocaInst *CodegenLLVM::getHistMapKey(Map &map, Value *log2)
+Value *CodegenLLVM::getHistMapKey(Map &map, Value *log2)
 {
-  AllocaInst *key;
-  if (map.vargs) {
-    size_t size = 8; // Extra space for the bucket value
+  Value *key;
+  if (map.vargs && isHashedKey(map))
+  {
+    // Hash of the string, followed by the bucket value
+    Expression *expr = map.vargs->at(0);
+    auto scoped_del = accept(expr);
+    key = b_.CreateAllocaBPF(16, map.ident + "_key");
+    b_.CreateHashedMapKey(map, expr_, expr->type.GetSize(), key);
+    b_.CreateStore(log2, b_.CreateGEP(key, { b_.getInt64(0), b_.getInt64(8) }));
+  }
+  else if (map.vargs) {
+    auto &layout = mapKey(map);
+    size_t size = 0;
     for (Expression *expr : *map.vargs)
     {
       size += expr->type.GetSize();
     }
+    if (layout.is_packed())
+      size = layout.packed_size();
+    size_t args_size = size;
+    size += 8; // Extra space for the bucket value
     key = b_.CreateAllocaBPF(size, map.ident + "_key");
 
     int offset = 0;
-    for (Expression *expr : *map.vargs) {
+    for (size_t i = 0; i < map.vargs->size(); i++)
+    {
+      Expression *expr = map.vargs->at(i);
       auto scoped_del = accept(expr);
-      Value *offset_val = b_.CreateGEP(key, {b_.getInt64(0), b_.getInt64(offset)});
+      Value *offset_val = b_.CreateGEP(
+          key,
+          { b_.getInt64(0),
+            b_.getInt64(layout.is_packed() ? layout.packed_[i].offset
+                                           : offset) });
       if (shouldBeOnStackAlready(expr->type))
         b_.CREATE_MEMCPY(offset_val, expr_, expr->type.GetSize(), 1);
+      else if (layout.is_packed() && layout.packed_[i].size == 4)
+        b_.CreateStore(
+            b_.CreateIntCast(expr_, b_.getInt32Ty(), expr->type.IsSigned()),
+            b_.CreatePointerCast(offset_val, b_.getInt32Ty()->getPointerTo()));
       else
         b_.CreateStore(expr_, offset_val);
       offset += expr->type.GetSize();
     }
+    offset = args_size;
     Value *offset_val = b_.CreateGEP(key, {b_.getInt64(0), b_.getInt64(offset)});
     b_.CreateStore(log2, offset_val);
   }
+  else if (isMmapped(map))
+  {
+    // Array index, see IMap::is_mmapped()
+    key = b_.CreateAllocaBPF(b_.getInt32Ty(), map.ident + "_key");
+    b_.CreateStore(b_.CreateIntCast(log2, b_.getInt32Ty(), false), key);
+  }
   else
   {
     key = b_.CreateAllocaBPF(CreateUInt64(), map.ident + "_key");
@@ -2400,6 +3111,326 @@ AllocaInst *CodegenLLVM::getHistMapKey(Map &map, Value *log2)
   return key;
 }
 
+// Keyless maps backed by a BPF_F_MMAPABLE array shared by all CPUs, which
+// are updated with atomic adds
+bool CodegenLLVM::isMmapped(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->is_mmapped();
+}
+
+// The key of the map, as it's laid out in the BPF map, see MapKey::packed_
+const MapKey &CodegenLLVM::mapKey(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->key_;
+}
+
+// Buckets of the values of maps holding a bucket array per key, 0 for the
+// others, see IMap::bucket_array_
+uint32_t CodegenLLVM::bucketArray(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->bucket_array_;
+}
+
+// Maps backed by an array indexed by their integer key
+bool CodegenLLVM::isDense(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->dense_;
+}
+
+// Maps keyed by the hash of their string key
+bool CodegenLLVM::isHashedKey(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->hashed_key_;
+}
+
+Value *CodegenLLVM::cachedBuiltin(const std::string &name,
+                                  const std::function<Value *()> &compute)
+{
+  auto it = builtins_.find(name);
+  if (it != builtins_.end())
+    return it->second;
+
+  Value *value = compute();
+  builtins_[name] = value;
+  return value;
+}
+
+bool CodegenLLVM::isCachedBuiltin(Value *value)
+{
+  for (auto &builtin : builtins_)
+  {
+    if (builtin.second == value)
+      return true;
+  }
+  return false;
+}
+
+Value *CodegenLLVM::getPidTgid()
+{
+  return cachedBuiltin("pid_tgid", [this]() { return b_.CreateGetPidTgid(); });
+}
+
+// Offset of field in the struct of record_type, left to be relocated when the
+// program is loaded for the fields of structs read from kernel memory
+Value *CodegenLLVM::fieldOffset(const SizedType &record_type,
+                                const std::string &name,
+                                const Field &field)
+{
+  if (!bpftrace_.relocate_fields_ || record_type.IsCtxAccess() ||
+      record_type.GetAS() == AddrSpace::user)
+    return b_.getInt64(field.offset);
+
+  auto key = std::make_pair(record_type.GetName(), name);
+  auto found = field_reloc_ids_.find(key);
+  if (found == field_reloc_ids_.end())
+  {
+    FieldReloc reloc;
+    reloc.record = record_type.GetName();
+    reloc.field = name;
+    reloc.offset = field.offset;
+    reloc.size = field.type.GetSize();
+    bpftrace_.field_relocs_.push_back(std::move(reloc));
+    found = field_reloc_ids_
+                .emplace(key, bpftrace_.field_relocs_.size() - 1)
+                .first;
+  }
+  return b_.CreateBpfPseudoCallFieldOffset(found->second);
+}
+
+// The fields of a struct read through the same base, e.g. $task->pid and
+// $task->tgid, are read with one probe_read of the bytes covering all of
+// them, at the first of the accesses. The read is kept with the builtins, so
+// it is only used where it dominates. The base is keyed by the versions of
+// its variables and the loops generated before it, a read isn't used once a
+// variable it depends on is assigned or in a loop that follows it.
+Value *CodegenLLVM::coalescedField(FieldAccess &acc, const Field &field)
+{
+  if (!coalescableField(acc))
+    return nullptr;
+
+  uint64_t offset = field.offset;
+  auto base = readBase(*acc.expr, offset, false);
+  if (!base)
+    return nullptr;
+  auto range = read_ranges_.find(*base);
+  if (range == read_ranges_.end() || range->second.fields < 2 ||
+      range->second.end - range->second.begin > COALESCED_READ_MAX)
+    return nullptr;
+  uint64_t begin = range->second.begin;
+  uint64_t size = range->second.end - begin;
+
+  uint64_t versioned_offset = field.offset;
+  auto versioned = readBase(*acc.expr, versioned_offset, true);
+  assert(versioned);
+
+  // expr_ is the struct accessed, offset - field.offset into the base
+  Value *record = expr_;
+  if (record->getType()->isPointerTy())
+    record = b_.CreatePtrToInt(record, b_.getInt64Ty());
+  uint64_t record_offset = offset - field.offset;
+  AddrSpace as = acc.expr->type.GetAS();
+
+  std::string name = "read " + *versioned + " " +
+                     std::to_string(loops_generated_);
+  Value *buf = cachedBuiltin(name, [&]() -> Value * {
+    AllocaInst *&dst = read_bufs_[*base];
+    if (!dst)
+      dst = b_.CreateAllocaBPF(size, "coalesced_read");
+    Value *src = b_.CreateAdd(
+        b_.CreateSub(record, b_.getInt64(record_offset)), b_.getInt64(begin));
+    b_.CreateProbeRead(ctx_, dst, size, src, as, acc.loc);
+    return dst;
+  });
+
+  Value *src = b_.CreateInBoundsGEP(
+      b_.getInt8Ty(),
+      b_.CreatePointerCast(buf, b_.getInt8PtrTy()),
+      b_.getInt64(offset - begin));
+  Value *value = b_.CreateLoad(
+      b_.CreatePointerCast(src, b_.GetType(field.type)->getPointerTo()));
+  return b_.CreateIntCast(value, b_.getInt64Ty(), field.type.IsSigned());
+}
+
+// Find the bytes of each base the probe reads fields from
+void CodegenLLVM::findCoalescedReads(Probe &probe)
+{
+  read_ranges_.clear();
+  if (!bpftrace_.coalesce_reads_)
+    return;
+
+  class Finder : public Visitor
+  {
+  public:
+    explicit Finder(CodegenLLVM &codegen) : codegen_(codegen)
+    {
+    }
+
+    void visit(FieldAccess &acc) override
+    {
+      Visitor::visit(acc);
+      const Field *field = codegen_.coalescableField(acc);
+      if (!field)
+        return;
+      uint64_t offset = field->offset;
+      auto base = codegen_.readBase(*acc.expr, offset, false);
+      if (!base)
+        return;
+      auto &range = codegen_.read_ranges_[*base];
+      range.begin = std::min(range.begin, offset);
+      range.end = std::max<uint64_t>(range.end,
+                                     offset + field->type.GetSize());
+      range.fields++;
+    }
+
+  private:
+    CodegenLLVM &codegen_;
+  };
+
+  Finder finder(*this);
+  finder.Visit(probe);
+}
+
+// Integer and pointer fields of structs read with probe_read
+const Field *CodegenLLVM::coalescableField(FieldAccess &acc)
+{
+  // The reads would cover the offsets as they were compiled
+  if (!bpftrace_.coalesce_reads_ || bpftrace_.relocate_fields_)
+    return nullptr;
+  SizedType &type = acc.expr->type;
+  if (!type.IsRecordTy() || type.IsCtxAccess() || type.is_tparg ||
+      type.is_kfarg || onStack(type))
+    return nullptr;
+
+  auto cstruct = bpftrace_.structs_.find(type.GetName());
+  if (cstruct == bpftrace_.structs_.end())
+    return nullptr;
+  auto field = cstruct->second.fields.find(acc.field);
+  if (field == cstruct->second.fields.end())
+    return nullptr;
+  auto &ftype = field->second.type;
+  if (!(ftype.IsIntTy() || ftype.IsPtrTy()) || field->second.is_bitfield ||
+      field->second.is_data_loc)
+    return nullptr;
+  return &field->second;
+}
+
+std::optional<std::string> CodegenLLVM::readBase(Expression &record,
+                                                 uint64_t &offset,
+                                                 bool versions)
+{
+  if (auto *acc = dynamic_cast<FieldAccess *>(&record))
+  {
+    // A struct embedded in another one
+    SizedType &type = acc->expr->type;
+    if (!type.IsRecordTy() || type.IsCtxAccess() || type.is_tparg ||
+        type.is_kfarg || onStack(type))
+      return std::nullopt;
+    auto cstruct = bpftrace_.structs_.find(type.GetName());
+    if (cstruct == bpftrace_.structs_.end())
+      return std::nullopt;
+    auto field = cstruct->second.fields.find(acc->field);
+    if (field == cstruct->second.fields.end())
+      return std::nullopt;
+    offset += field->second.offset;
+    return readBase(*acc->expr, offset, versions);
+  }
+  if (auto *unop = dynamic_cast<Unop *>(&record))
+  {
+    if (unop->op != bpftrace::Parser::token::MUL ||
+        !unop->expr->type.IsPtrTy())
+      return std::nullopt;
+    return exprKey(*unop->expr, versions);
+  }
+  if (record.is_variable)
+    return exprKey(record, versions);
+  return std::nullopt;
+}
+
+// A key for the value of expr, if it is only changed by assigning the
+// variables in it
+std::optional<std::string> CodegenLLVM::exprKey(Expression &expr,
+                                                bool versions)
+{
+  if (auto *var = dynamic_cast<Variable *>(&expr))
+  {
+    if (!versions)
+      return var->ident;
+    return var->ident + "#" + std::to_string(var_versions_[var->ident]);
+  }
+  if (auto *builtin = dynamic_cast<Builtin *>(&expr))
+  {
+    auto &ident = builtin->ident;
+    if (ident == "ctx" || ident == "curtask" || ident == "retval" ||
+        ident.compare(0, 3, "arg") == 0 || ident.compare(0, 4, "sarg") == 0)
+      return ident;
+    return std::nullopt;
+  }
+  if (auto *integer = dynamic_cast<Integer *>(&expr))
+    return std::to_string(integer->n);
+  if (auto *acc = dynamic_cast<FieldAccess *>(&expr))
+  {
+    auto base = exprKey(*acc->expr, versions);
+    if (!base)
+      return std::nullopt;
+    if (acc->index >= 0)
+      return *base + "." + std::to_string(acc->index);
+    return *base + "." + acc->field;
+  }
+  if (auto *arr = dynamic_cast<ArrayAccess *>(&expr))
+  {
+    auto base = exprKey(*arr->expr, versions);
+    auto index = exprKey(*arr->indexpr, versions);
+    if (!base || !index)
+      return std::nullopt;
+    return *base + "[" + *index + "]";
+  }
+  if (auto *unop = dynamic_cast<Unop *>(&expr))
+  {
+    if (unop->op != bpftrace::Parser::token::MUL)
+      return std::nullopt;
+    auto base = exprKey(*unop->expr, versions);
+    if (!base)
+      return std::nullopt;
+    return "*(" + *base + ")";
+  }
+  if (auto *cast = dynamic_cast<Cast *>(&expr))
+  {
+    auto base = exprKey(*cast->expr, versions);
+    if (!base)
+      return std::nullopt;
+    std::string stars = cast->is_double_pointer ? "**"
+                                                : cast->is_pointer ? "*" : "";
+    return "(" + cast->cast_type + stars + ")" + *base;
+  }
+  return std::nullopt;
+}
+
+int CodegenLLVM::countBuiltin(Probe &probe, const std::string &ident)
+{
+  class Counter : public Visitor
+  {
+  public:
+    explicit Counter(const std::string &ident) : ident_(ident)
+    {
+    }
+
+    void visit(Builtin &builtin) override
+    {
+      if (builtin.ident == ident_)
+        count++;
+    }
+
+    int count = 0;
+
+  private:
+    const std::string &ident_;
+  };
+
+  Counter counter(ident);
+  counter.Visit(probe);
+  return counter.count;
+}
+
 Value *CodegenLLVM::createLogicalAnd(Binop &binop)
 {
   assert(binop.left->type.IsIntTy());
@@ -2419,6 +3450,8 @@ Value *CodegenLLVM::createLogicalAnd(Binop &binop)
                   lhs_true_block,
                   false_block);
 
+  // The right operand isn't always evaluated
+  auto builtins = builtins_;
   b_.SetInsertPoint(lhs_true_block);
   Value *rhs;
   auto scoped_del_right = accept(binop.right);
@@ -2426,6 +3459,7 @@ Value *CodegenLLVM::createLogicalAnd(Binop &binop)
   b_.CreateCondBr(b_.CreateICmpNE(rhs, b_.GetIntSameSize(0, rhs), "rhs_true_cond"),
                   true_block,
                   false_block);
+  builtins_ = builtins;
 
   b_.SetInsertPoint(true_block);
   b_.CreateStore(b_.getInt64(1), result);
@@ -2458,6 +3492,8 @@ Value *CodegenLLVM::createLogicalOr(Binop &binop)
                   true_block,
                   lhs_false_block);
 
+  // The right operand isn't always evaluated
+  auto builtins = builtins_;
   b_.SetInsertPoint(lhs_false_block);
   Value *rhs;
   auto scoped_del_right = accept(binop.right);
@@ -2465,6 +3501,7 @@ Value *CodegenLLVM::createLogicalOr(Binop &binop)
   b_.CreateCondBr(b_.CreateICmpNE(rhs, b_.GetIntSameSize(0, rhs), "rhs_true_cond"),
                   true_block,
                   false_block);
+  builtins_ = builtins;
 
   b_.SetInsertPoint(false_block);
   b_.CreateStore(b_.getInt64(0), result);
@@ -2478,7 +3515,23 @@ Value *CodegenLLVM::createLogicalOr(Binop &binop)
   return b_.CreateLoad(result);
 }
 
-Function *CodegenLLVM::createLog2Function()
+void CodegenLLVM::initHelperFunction(Function &func)
+{
+  if (!inline_helpers_)
+  {
+    // Called as a subprogram, which has to be in the section of the
+    // program calling it
+    func.addFnAttr(Attribute::NoInline);
+    func.setSection(b_.GetInsertBlock()->getParent()->getSection());
+  }
+  else
+  {
+    func.addFnAttr(Attribute::AlwaysInline);
+    func.setSection("helpers");
+  }
+}
+
+Function *CodegenLLVM::createLog2Function(int first_step, bool negative)
 {
   auto ip = b_.saveIP();
   // log2() returns a bucket index for the given value. Index 0 is for
@@ -2491,21 +3544,34 @@ Function *CodegenLLVM::createLog2Function()
   //   int shift;
   //   if (n < 0) return result;
   //   result++;
-  //   if (n == 0) return result;
-  //   result++;
-  //   for (int i = 4; i >= 0; i--)
+  //   for (int i = 4; i >= 2; i--)
   //   {
   //     shift = (v >= (1<<(1<<i))) << i;
   //     n >> = shift;
   //     result += shift;
   //   }
+  //   // 1 + log2(n) for the remaining 0 <= n < 16, 0 for n == 0,
+  //   // one per nibble
+  //   result += (0x4444444433332210 >> (min(n, 15) << 2)) & 0xf;
   //   return result;
   // }
+  //
+  // There is no count leading zeros instruction in BPF, the lookup in a
+  // constant replaces the last two steps of the binary search and the test
+  // for zero.
+  //
+  // The value of a narrower type starts the search at first_step (3 below
+  // 2^16, 2 below 2^8), without the test for less than 0 when it can't be
+  // negative, or the min() when it's below 2^32 and so below 16 by then.
+  bool generic = first_step == 4 && negative;
+  std::string name = "log2";
+  if (!generic)
+    name += std::string(negative ? "_s" : "_u") +
+            std::to_string(1 << (first_step + 1));
 
   FunctionType *log2_func_type = FunctionType::get(b_.getInt64Ty(), {b_.getInt64Ty()}, false);
-  Function *log2_func = Function::Create(log2_func_type, Function::InternalLinkage, "log2", module_.get());
-  log2_func->addFnAttr(Attribute::AlwaysInline);
-  log2_func->setSection("helpers");
+  Function *log2_func = Function::Create(log2_func_type, Function::InternalLinkage, name, module_.get());
+  initHelperFunction(*log2_func);
   BasicBlock *entry = BasicBlock::Create(module_->getContext(), "entry", log2_func);
   b_.SetInsertPoint(entry);
 
@@ -2517,128 +3583,197 @@ Function *CodegenLLVM::createLog2Function()
   b_.CreateStore(b_.getInt64(0), result);
 
   // test for less than zero
-  BasicBlock *is_less_than_zero = BasicBlock::Create(module_->getContext(), "hist.is_less_than_zero", log2_func);
-  BasicBlock *is_not_less_than_zero = BasicBlock::Create(module_->getContext(), "hist.is_not_less_than_zero", log2_func);
-  b_.CreateCondBr(b_.CreateICmpSLT(b_.CreateLoad(n_alloc), b_.getInt64(0)),
-                  is_less_than_zero,
-                  is_not_less_than_zero);
-  b_.SetInsertPoint(is_less_than_zero);
-  b_.CreateRet(b_.CreateLoad(result));
-  b_.SetInsertPoint(is_not_less_than_zero);
+  if (negative)
+  {
+    BasicBlock *is_less_than_zero = BasicBlock::Create(module_->getContext(), "hist.is_less_than_zero", log2_func);
+    BasicBlock *is_not_less_than_zero = BasicBlock::Create(module_->getContext(), "hist.is_not_less_than_zero", log2_func);
+    b_.CreateCondBr(b_.CreateICmpSLT(b_.CreateLoad(n_alloc), b_.getInt64(0)),
+                    is_less_than_zero,
+                    is_not_less_than_zero);
+    b_.SetInsertPoint(is_less_than_zero);
+    b_.CreateRet(b_.CreateLoad(result));
+    b_.SetInsertPoint(is_not_less_than_zero);
+  }
 
-  // test for equal to zero
-  BasicBlock *is_zero = BasicBlock::Create(module_->getContext(), "hist.is_zero", log2_func);
-  BasicBlock *is_not_zero = BasicBlock::Create(module_->getContext(), "hist.is_not_zero", log2_func);
-  b_.CreateCondBr(b_.CreateICmpEQ(b_.CreateLoad(n_alloc), b_.getInt64(0)),
-                  is_zero,
-                  is_not_zero);
-  b_.SetInsertPoint(is_zero);
+  // power-of-2 index, offset by +1
   b_.CreateStore(b_.getInt64(1), result);
-  b_.CreateRet(b_.CreateLoad(result));
-  b_.SetInsertPoint(is_not_zero);
-
-  // power-of-2 index, offset by +2
-  b_.CreateStore(b_.getInt64(2), result);
-  for (int i = 4; i >= 0; i--)
+  for (int i = first_step; i >= 2; i--)
   {
     Value *n = b_.CreateLoad(n_alloc);
     Value *shift = b_.CreateShl(b_.CreateIntCast(b_.CreateICmpSGE(b_.CreateIntCast(n, b_.getInt64Ty(), false), b_.getInt64(1 << (1<<i))), b_.getInt64Ty(), false), i);
     b_.CreateStore(b_.CreateLShr(n, shift), n_alloc);
     b_.CreateStore(b_.CreateAdd(b_.CreateLoad(result), shift), result);
   }
+  Value *n = b_.CreateLoad(n_alloc);
+  Value *index = n;
+  if (generic)
+    index = b_.CreateSelect(b_.CreateICmpUGT(n, b_.getInt64(15)),
+                            b_.getInt64(15),
+                            n);
+  Value *nibble = b_.CreateAnd(
+      b_.CreateLShr(b_.getInt64(0x4444444433332210),
+                    b_.CreateShl(index, 2)),
+      0xf);
+  b_.CreateStore(b_.CreateAdd(b_.CreateLoad(result), nibble), result);
   b_.CreateRet(b_.CreateLoad(result));
   b_.restoreIP(ip);
-  return module_->getFunction("log2");
+  return log2_func;
 }
 
-Function *CodegenLLVM::createLinearFunction()
+// Multiplier and shift for (x * mul) >> shift to be x / d for every x up to
+// range, false when there's none in 64 bits. With mul = ceil(2^shift / d),
+// mul * d - 2^shift is the error, and the result is exact as long as x
+// times the error stays below 2^shift.
+static bool div_reciprocal(uint64_t d, uint64_t range, uint64_t &mul, int &shift)
+{
+  for (shift = 0; shift < 64; shift++)
+  {
+    unsigned __int128 p = static_cast<unsigned __int128>(1) << shift;
+    unsigned __int128 m = (p + d - 1) / d;
+    if ((range * m) >> 64)
+      return false;
+    if (range * (m * d - p) < p)
+    {
+      mul = m;
+      return true;
+    }
+  }
+  return false;
+}
+
+Value *CodegenLLVM::createLinear(Value *value,
+                                 int64_t min,
+                                 int64_t max,
+                                 int64_t step)
 {
-  auto ip = b_.saveIP();
   // lhist() returns a bucket index for the given value. The first and last
   //   bucket indexes are special: they are 0 for the less-than-range
   //   bucket, and index max_bucket+2 for the greater-than-range bucket.
   //   Indexes 1 to max_bucket+1 span the buckets in the range.
   //
-  // int lhist(int value, int min, int max, int step)
-  // {
-  //   int result;
-  //
   //   if (value < min)
   //     return 0;
   //   if (value > max)
-  //     return 1 + (max - min) / step;
-  //   result = 1 + (value - min) / step;
+  //     value = max;
+  //   return 1 + (value - min) / step;
   //
-  //   return result;
+  // The clamps are selects of constants rather than branches, and as
+  // value - min is at most max - min once clamped, the division by step is
+  // a shift for a power of 2 and a multiplication by its reciprocal
+  // otherwise, falling back to a division for the ranges too large for it.
+  // The division on a value below min (wrapped around) is thrown away.
+  Value *clamped = b_.CreateSelect(b_.CreateICmpSGT(value, b_.getInt64(max)),
+                                   b_.getInt64(max),
+                                   value);
+  Value *offset = min ? b_.CreateSub(clamped, b_.getInt64(min)) : clamped;
+  uint64_t range = max - min;
+  uint64_t mul;
+  int shift;
+  Value *div;
+  if (step == 1)
+    div = offset;
+  else if ((step & (step - 1)) == 0)
+    div = b_.CreateLShr(offset, __builtin_ctzll(step));
+  else if (div_reciprocal(step, range, mul, shift))
+    div = b_.CreateLShr(b_.CreateMul(offset, b_.getInt64(mul)), shift);
+  else
+    div = b_.CreateUDiv(offset, b_.getInt64(step));
+  Value *index = b_.CreateAdd(div, b_.getInt64(1));
+  Value *below = b_.CreateICmpSLT(value, b_.getInt64(min));
+  return b_.CreateSelect(below, b_.getInt64(0), index, "linear");
+}
+
+Function *CodegenLLVM::createLogLinearFunction()
+{
+  auto ip = b_.saveIP();
+  // llhist() returns a bucket index for the given value, with every
+  // power-of-2 range split into 2^bits linear buckets. Index 0 is for values
+  // less than 0, values less than 2^bits get a bucket each. See
+  // llhist_bucket_range() for the reverse mapping.
+  //
+  // int llhist(int n, int bits)
+  // {
+  //   int m = n, log2 = 0;
+  //   int shift;
+  //   if (n < 0) return 0;
+  //   if (n < (1 << bits)) return n + 1;
+  //   for (int i = 5; i >= 0; i--)
+  //   {
+  //     shift = (m >= (1<<(1<<i))) << i;
+  //     m >>= shift;
+  //     log2 += shift;
+  //   }
+  //   shift = log2 - bits;
+  //   return 1 + (shift << bits) + (n >> shift);
   // }
 
-  // inlined function initialization
-  FunctionType *linear_func_type = FunctionType::get(b_.getInt64Ty(), {b_.getInt64Ty(), b_.getInt64Ty(), b_.getInt64Ty(), b_.getInt64Ty()}, false);
-  Function *linear_func = Function::Create(linear_func_type, Function::InternalLinkage, "linear", module_.get());
-  linear_func->addFnAttr(Attribute::AlwaysInline);
-  linear_func->setSection("helpers");
-  BasicBlock *entry = BasicBlock::Create(module_->getContext(), "entry", linear_func);
+  FunctionType *log_linear_func_type = FunctionType::get(
+      b_.getInt64Ty(), { b_.getInt64Ty(), b_.getInt64Ty() }, false);
+  Function *log_linear_func = Function::Create(log_linear_func_type,
+                                               Function::InternalLinkage,
+                                               "log_linear",
+                                               module_.get());
+  initHelperFunction(*log_linear_func);
+  BasicBlock *entry = BasicBlock::Create(module_->getContext(),
+                                         "entry",
+                                         log_linear_func);
   b_.SetInsertPoint(entry);
 
-  // pull in arguments
-  Value *value_alloc = b_.CreateAllocaBPF(CreateUInt64());
-  Value *min_alloc = b_.CreateAllocaBPF(CreateUInt64());
-  Value *max_alloc = b_.CreateAllocaBPF(CreateUInt64());
-  Value *step_alloc = b_.CreateAllocaBPF(CreateUInt64());
-  Value *result_alloc = b_.CreateAllocaBPF(CreateUInt64());
-
-  b_.CreateStore(linear_func->arg_begin() + 0, value_alloc);
-  b_.CreateStore(linear_func->arg_begin() + 1, min_alloc);
-  b_.CreateStore(linear_func->arg_begin() + 2, max_alloc);
-  b_.CreateStore(linear_func->arg_begin() + 3, step_alloc);
-
-  Value *cmp = nullptr;
-
-  // algorithm
-  {
-    Value *min = b_.CreateLoad(min_alloc);
-    Value *val = b_.CreateLoad(value_alloc);
-    cmp = b_.CreateICmpSLT(val, min);
-  }
-  BasicBlock *lt_min = BasicBlock::Create(module_->getContext(), "lhist.lt_min", linear_func);
-  BasicBlock *ge_min = BasicBlock::Create(module_->getContext(), "lhist.ge_min", linear_func);
-  b_.CreateCondBr(cmp, lt_min, ge_min);
+  Value *n = log_linear_func->arg_begin();
+  Value *bits = log_linear_func->arg_begin() + 1;
 
-  b_.SetInsertPoint(lt_min);
+  // test for less than zero
+  BasicBlock *is_less_than_zero = BasicBlock::Create(module_->getContext(),
+                                                     "llhist.is_less_than_zero",
+                                                     log_linear_func);
+  BasicBlock *is_not_less_than_zero = BasicBlock::Create(
+      module_->getContext(), "llhist.is_not_less_than_zero", log_linear_func);
+  b_.CreateCondBr(b_.CreateICmpSLT(n, b_.getInt64(0)),
+                  is_less_than_zero,
+                  is_not_less_than_zero);
+  b_.SetInsertPoint(is_less_than_zero);
   b_.CreateRet(b_.getInt64(0));
+  b_.SetInsertPoint(is_not_less_than_zero);
 
-  b_.SetInsertPoint(ge_min);
-  {
-    Value *max = b_.CreateLoad(max_alloc);
-    Value *val = b_.CreateLoad(value_alloc);
-    cmp = b_.CreateICmpSGT(val, max);
-  }
-  BasicBlock *le_max = BasicBlock::Create(module_->getContext(), "lhist.le_max", linear_func);
-  BasicBlock *gt_max = BasicBlock::Create(module_->getContext(), "lhist.gt_max", linear_func);
-  b_.CreateCondBr(cmp, gt_max, le_max);
-
-  b_.SetInsertPoint(gt_max);
-  {
-    Value *step = b_.CreateLoad(step_alloc);
-    Value *min = b_.CreateLoad(min_alloc);
-    Value *max = b_.CreateLoad(max_alloc);
-    Value *div = b_.CreateUDiv(b_.CreateSub(max, min), step);
-    b_.CreateStore(b_.CreateAdd(div, b_.getInt64(1)), result_alloc);
-    b_.CreateRet(b_.CreateLoad(result_alloc));
-  }
-
-  b_.SetInsertPoint(le_max);
+  // test for the linear range
+  BasicBlock *is_linear = BasicBlock::Create(module_->getContext(),
+                                             "llhist.is_linear",
+                                             log_linear_func);
+  BasicBlock *is_not_linear = BasicBlock::Create(module_->getContext(),
+                                                 "llhist.is_not_linear",
+                                                 log_linear_func);
+  b_.CreateCondBr(b_.CreateICmpULT(n, b_.CreateShl(b_.getInt64(1), bits)),
+                  is_linear,
+                  is_not_linear);
+  b_.SetInsertPoint(is_linear);
+  b_.CreateRet(b_.CreateAdd(n, b_.getInt64(1)));
+  b_.SetInsertPoint(is_not_linear);
+
+  // power-of-2 range of n
+  Value *m_alloc = b_.CreateAllocaBPF(CreateUInt64());
+  b_.CreateStore(n, m_alloc);
+  Value *log2_alloc = b_.CreateAllocaBPF(CreateUInt64());
+  b_.CreateStore(b_.getInt64(0), log2_alloc);
+  for (int i = 5; i >= 0; i--)
   {
-    Value *step = b_.CreateLoad(step_alloc);
-    Value *min = b_.CreateLoad(min_alloc);
-    Value *val = b_.CreateLoad(value_alloc);
-    Value *div3 = b_.CreateUDiv(b_.CreateSub(val, min), step);
-    b_.CreateStore(b_.CreateAdd(div3, b_.getInt64(1)), result_alloc);
-    b_.CreateRet(b_.CreateLoad(result_alloc));
+    Value *m = b_.CreateLoad(m_alloc);
+    Value *shift = b_.CreateShl(
+        b_.CreateIntCast(b_.CreateICmpUGE(m, b_.getInt64(1ULL << (1 << i))),
+                         b_.getInt64Ty(),
+                         false),
+        i);
+    b_.CreateStore(b_.CreateLShr(m, shift), m_alloc);
+    b_.CreateStore(b_.CreateAdd(b_.CreateLoad(log2_alloc), shift),
+                   log2_alloc);
   }
 
+  // linear bucket within the range
+  Value *shift = b_.CreateSub(b_.CreateLoad(log2_alloc), bits);
+  Value *result = b_.CreateAdd(b_.CreateShl(shift, bits),
+                               b_.CreateLShr(n, shift));
+  b_.CreateRet(b_.CreateAdd(result, b_.getInt64(1)));
   b_.restoreIP(ip);
-  return module_->getFunction("linear");
+  return log_linear_func;
 }
 
 void CodegenLLVM::createFormatStringCall(Call &call, int &id, CallArgs &call_args,
@@ -2649,6 +3784,13 @@ void CodegenLLVM::createFormatStringCall(Call &call, int &id, CallArgs &call_arg
    * The id maps to bpftrace_.*_args_, and is a way to define the
    * types and offsets of each of the arguments, and share that between BPF and
    * user-space for printing.
+   *
+   * When the last argument is a str(), the event ends at its nul: only the
+   * bytes it read are sent rather than the whole BPFTRACE_STRLEN buffer.
+   *
+   * The struct is packed, the arguments follow each other without padding
+   * and userspace reads them with unaligned loads. Every byte is written, so
+   * it doesn't have to be zeroed first.
    */
   std::vector<llvm::Type *> elements = { b_.getInt64Ty() }; // ID
 
@@ -2658,7 +3800,7 @@ void CodegenLLVM::createFormatStringCall(Call &call, int &id, CallArgs &call_arg
     llvm::Type *ty = b_.GetType(arg.type);
     elements.push_back(ty);
   }
-  StructType *fmt_struct = StructType::create(elements, call_name + "_t", false);
+  StructType *fmt_struct = StructType::create(elements, call_name + "_t", true);
   int struct_size = datalayout().getTypeAllocSize(fmt_struct);
 
   auto *struct_layout = datalayout().getStructLayout(fmt_struct);
@@ -2668,30 +3810,88 @@ void CodegenLLVM::createFormatStringCall(Call &call, int &id, CallArgs &call_arg
     arg.offset = struct_layout->getElementOffset(i+1); // +1 for the id field
   }
 
-  AllocaInst *fmt_args = b_.CreateAllocaBPF(fmt_struct, call_name + "_args");
-  // as the struct is not packed we need to memset it.
-  b_.CREATE_MEMSET(fmt_args, b_.getInt8(0), struct_size, 1);
+  // The struct starts 8 bytes aligned, each argument is stored with the
+  // alignment its offset has so that the stack stores stay aligned for the
+  // verifier
+  Value *fmt_args = b_.CreateScratchBPF(fmt_struct, call_name + "_args");
 
   Value *id_offset = b_.CreateGEP(fmt_args, {b_.getInt32(0), b_.getInt32(0)});
-  b_.CreateStore(b_.getInt64(id + asyncactionint(async_action)), id_offset);
+  b_.CREATE_ALIGNED_STORE(
+      b_.getInt64(id + asyncactionint(async_action)), id_offset, 8);
 
+  Value *size = b_.getInt64(struct_size);
   for (size_t i=1; i<call.vargs->size(); i++)
   {
     Expression &arg = *call.vargs->at(i);
-    auto scoped_del = accept(&arg);
+    Field &field = args[i - 1];
     Value *offset = b_.CreateGEP(fmt_args, {b_.getInt32(0), b_.getInt32(i)});
+    int align = std::min<ssize_t>(field.offset & -field.offset, 8);
+    // A ustack(dwarf) is written in place in the event, it's too big to be
+    // built anywhere else first
+    if (arg.type.IsDwarfStack())
+    {
+      b_.CreateDwarfStack(ctx_, offset, align);
+      continue;
+    }
+    str_len_ = nullptr;
+    auto scoped_del = accept(&arg);
     if (needMemcpy(arg.type))
       b_.CREATE_MEMCPY(offset, expr_, arg.type.GetSize(), 1);
-    else if (arg.type.IsIntegerTy() && arg.type.GetSize() < 8)
-      b_.CreateStore(
-          b_.CreateIntCast(expr_, b_.getInt64Ty(), arg.type.IsSigned()),
-          offset);
+    else if (arg.type.IsIntegerTy())
+      b_.CREATE_ALIGNED_STORE(b_.CreateIntCast(expr_,
+                                               b_.GetType(field.type),
+                                               arg.type.IsSigned()),
+                              offset,
+                              align);
     else
-      b_.CreateStore(expr_, offset);
+      b_.CREATE_ALIGNED_STORE(expr_, offset, align);
+
+    auto str_call = dynamic_cast<Call *>(&arg);
+    if (i == call.vargs->size() - 1 && str_call && str_call->func == "str" &&
+        str_len_)
+    {
+      // The buffer is all zeroes when the read failed, its first byte is
+      // still sent. The bounds are spelled out for the verifier.
+      Value *max = b_.getInt64(arg.type.GetSize());
+      Value *len = b_.CreateSelect(
+          b_.CreateICmpSGT(str_len_, b_.getInt64(0)),
+          str_len_,
+          b_.getInt64(1));
+      len = b_.CreateSelect(b_.CreateICmpULE(len, max), len, max);
+      size = b_.CreateAdd(b_.getInt64(args.back().offset), len, "event_size");
+    }
   }
 
   id++;
-  b_.CreatePerfEventOutput(ctx_, fmt_args, struct_size);
+  // Small printf() events are sent in batches, those of BEGIN and END as they
+  // come, the batches aren't flushed when they run. With --flight-recorder
+  // they're recorded instead, with BPFTRACE_DEDUPE_MS the repeats are only
+  // counted.
+  auto &provider = current_attach_point_->provider;
+  bool probe_event = async_action == AsyncAction::printf &&
+                     provider != "BEGIN" && provider != "END";
+  if (probe_event && bpftrace_.maps.Has(MapManager::Type::FlightRecorder) &&
+      static_cast<uint64_t>(struct_size) <= bpftrace_.flight_event_size_)
+    b_.CreateFlightRecord(fmt_args, size, struct_size);
+  else
+  {
+    BasicBlock *deduped = nullptr;
+    if (probe_event && bpftrace_.maps.Has(MapManager::Type::Dedupe) &&
+        static_cast<uint64_t>(struct_size) <= BPFtrace::DEDUPE_EVENT_MAX)
+      deduped = b_.CreateDedupe(ctx_, fmt_args, size, struct_size);
+
+    if (probe_event && bpftrace_.maps.Has(MapManager::Type::EventBatch) &&
+        b_.IsBatchable(struct_size))
+      b_.CreateBatchedOutput(ctx_, fmt_args, struct_size);
+    else
+      b_.CreatePerfEventOutput(ctx_, fmt_args, size);
+
+    if (deduped)
+    {
+      b_.CreateBr(deduped);
+      b_.SetInsertPoint(deduped);
+    }
+  }
   b_.CreateLifetimeEnd(fmt_args);
   expr_ = nullptr;
 }
@@ -2757,7 +3957,9 @@ void CodegenLLVM::createPrintMapCall(Call &call)
                                        call.func + "_" + map.ident);
 
   // store asyncactionid:
-  b_.CreateStore(b_.getInt64(asyncactionint(AsyncAction::print)),
+  auto action = call.func == "print_delta" ? AsyncAction::print_delta
+                                           : AsyncAction::print;
+  b_.CreateStore(b_.getInt64(asyncactionint(action)),
                  b_.CreateGEP(buf, { b_.getInt64(0), b_.getInt32(0) }));
 
   auto id = bpftrace_.maps[map.ident].value()->id;
@@ -2784,7 +3986,7 @@ void CodegenLLVM::createPrintMapCall(Call &call)
                                 { b_.getInt64(0), b_.getInt32(arg_idx + 1) }));
   }
 
-  b_.CreatePerfEventOutput(ctx_, buf, getStructSize(print_struct));
+  b_.CreatePerfEventOutput(ctx_, buf, getStructSize(print_struct), true);
   b_.CreateLifetimeEnd(buf);
   expr_ = nullptr;
 }
@@ -2847,11 +4049,29 @@ void CodegenLLVM::generate_ir()
   state_ = State::IR;
 }
 
-void CodegenLLVM::emit_elf(const std::string &filename)
+void CodegenLLVM::emit_elf(const std::string &filename,
+                           const std::string &image)
 {
   assert(state_ == State::OPT);
+#ifdef LLVM_ORC_V2
+  linkParts();
+#endif
   legacy::PassManager PM;
 
+  if (!image.empty())
+  {
+    auto data = ConstantDataArray::getString(module_->getContext(),
+                                             image,
+                                             false);
+    auto global = new GlobalVariable(*module_,
+                                     data->getType(),
+                                     true,
+                                     GlobalValue::ExternalLinkage,
+                                     data,
+                                     "bpftrace_image");
+    global->setSection(PROGRAM_IMAGE_SECTION);
+  }
+
 #if LLVM_VERSION_MAJOR >= 10
   auto type = llvm::CGFT_ObjectFile;
 #else
@@ -2889,11 +4109,8 @@ void CodegenLLVM::emit_elf(const std::string &filename)
 #endif
 }
 
-void CodegenLLVM::optimize()
+static void runOptimizations(Module &module, int opt_level)
 {
-  assert(state_ == State::IR);
-  PassManagerBuilder PMB;
-  PMB.OptLevel = 3;
   legacy::PassManager PM;
   PM.add(createFunctionInliningPass());
   /*
@@ -2904,16 +4121,282 @@ void CodegenLLVM::optimize()
    * use below 'stable' workaround
    */
   LLVMAddAlwaysInlinerPass(reinterpret_cast<LLVMPassManagerRef>(&PM));
-  PMB.populateModulePassManager(PM);
 
-  PM.run(*module_.get());
+  if (opt_level == 1)
+  {
+    // What makes a difference to the BPF code of the usual probes: promoting
+    // the allocas of the variables and builtins to registers, folding the
+    // stores of the map keys and values, and specializing the helpers to the
+    // constant arguments of llhist() and friends. Generates about as few
+    // instructions as -O3 in less than half the time, as it leaves out the
+    // loop and vectorization passes.
+    PM.add(createSROAPass());
+    PM.add(createEarlyCSEPass());
+    PM.add(createInstructionCombiningPass());
+    PM.add(createCFGSimplificationPass());
+    PM.add(createDeadStoreEliminationPass());
+    PM.add(createInstructionCombiningPass());
+    PM.add(createIPSCCPPass());
+    PM.add(createDeadArgEliminationPass());
+    PM.add(createInstructionCombiningPass());
+    PM.add(createCFGSimplificationPass());
+    PM.add(createGlobalDCEPass());
+  }
+  else if (opt_level > 1)
+  {
+    PassManagerBuilder PMB;
+    PMB.OptLevel = opt_level;
+    PMB.populateModulePassManager(PM);
+  }
+
+  PM.run(module);
+}
+
+void CodegenLLVM::optimize()
+{
+  assert(state_ == State::IR);
+#ifdef LLVM_ORC_V2
+  uint64_t threads = bpftrace_.codegen_threads_
+                         ? bpftrace_.codegen_threads_
+                         : get_online_cpus().size();
+  if (threads > 1)
+  {
+    size_t insns = 0;
+    for (auto &func : *module_)
+      insns += func.getInstructionCount();
+    splitModule(std::min<size_t>(threads, insns / PARALLEL_PART_MIN));
+  }
+  if (!parts_.empty())
+  {
+    optimizeParts(threads);
+    state_ = State::OPT;
+    return;
+  }
+#endif
+
+  runOptimizations(*module_, bpftrace_.opt_level_);
   state_ = State::OPT;
 }
 
+#ifdef LLVM_ORC_V2
+// The local functions and variables func uses, directly or through the
+// ones it uses
+static void localUses(Function &func, std::set<GlobalValue *> &uses)
+{
+  std::vector<Function *> todo = { &func };
+  while (!todo.empty())
+  {
+    Function *f = todo.back();
+    todo.pop_back();
+    for (auto &inst : instructions(*f))
+    {
+      for (auto &op : inst.operands())
+      {
+        auto global = dyn_cast<GlobalValue>(op->stripPointerCasts());
+        if (!global || !global->hasLocalLinkage() ||
+            !uses.insert(global).second)
+          continue;
+        if (auto callee = dyn_cast<Function>(global))
+          if (!callee->isDeclaration())
+            todo.push_back(callee);
+      }
+    }
+  }
+}
+
+// Splits the programs of module_ into up to nparts modules of about the same
+// number of instructions, each with the local helpers (log2(), linear()...)
+// of its programs. Programs using the same helpers stay together. Leaves
+// parts_ empty if there aren't two parts to make.
+void CodegenLLVM::splitModule(size_t nparts)
+{
+  if (nparts < 2)
+    return;
+
+  // The programs, grouped by the helpers they share
+  struct Group
+  {
+    std::set<const GlobalValue *> globals;
+    size_t insns = 0;
+    std::string symbol;
+  };
+  std::vector<Group> groups;
+  std::map<GlobalValue *, size_t> group_of;
+  for (auto &func : *module_)
+  {
+    if (func.isDeclaration() || func.hasLocalLinkage())
+      continue;
+    std::set<GlobalValue *> uses;
+    localUses(func, uses);
+
+    std::optional<size_t> into;
+    for (auto use : uses)
+    {
+      auto found = group_of.find(use);
+      if (found == group_of.end())
+        continue;
+      if (!into)
+        into = found->second;
+      else if (found->second != *into)
+      {
+        // Merge the other group into this one
+        auto &other = groups[found->second];
+        for (auto global : other.globals)
+          group_of[const_cast<GlobalValue *>(global)] = *into;
+        groups[*into].globals.insert(other.globals.begin(),
+                                     other.globals.end());
+        groups[*into].insns += other.insns;
+        other = Group();
+      }
+    }
+    if (!into)
+    {
+      into = groups.size();
+      groups.emplace_back();
+      groups.back().symbol = func.getName().str();
+    }
+
+    auto &group = groups[*into];
+    group.globals.insert(&func);
+    group.insns += func.getInstructionCount();
+    for (auto use : uses)
+    {
+      group.globals.insert(use);
+      if (auto helper = dyn_cast<Function>(use))
+        group.insns += helper->getInstructionCount();
+      group_of[use] = *into;
+    }
+    group_of[&func] = *into;
+  }
+  groups.erase(std::remove_if(groups.begin(),
+                              groups.end(),
+                              [](const Group &g) { return g.globals.empty(); }),
+               groups.end());
+  nparts = std::min(nparts, groups.size());
+  if (nparts < 2)
+    return;
+
+  // The largest groups first, each into the smallest part so far
+  std::sort(groups.begin(), groups.end(), [](const Group &a, const Group &b) {
+    return a.insns > b.insns;
+  });
+  std::vector<std::set<const GlobalValue *>> globals(nparts);
+  std::vector<size_t> insns(nparts, 0);
+  parts_.resize(nparts);
+  for (auto &group : groups)
+  {
+    size_t i = std::distance(insns.begin(),
+                             std::min_element(insns.begin(), insns.end()));
+    globals[i].insert(group.globals.begin(), group.globals.end());
+    insns[i] += group.insns;
+    if (parts_[i].symbol.empty())
+      parts_[i].symbol = group.symbol;
+  }
+
+  for (size_t i = 0; i < nparts; i++)
+  {
+    ValueToValueMapTy vmap;
+    // The other parts' functions are left as declarations, global
+    // variables not local to a program go with the first part
+    auto part = CloneModule(*module_, vmap, [&](const GlobalValue *global) {
+      return globals[i].count(global) ||
+             (i == 0 && isa<GlobalVariable>(global) &&
+              !global->hasLocalLinkage());
+    });
+    raw_string_ostream out(parts_[i].bitcode);
+    WriteBitcodeToFile(*part, out);
+    out.flush();
+  }
+  module_.reset();
+}
+
+// Reads a part back in a context of its own, and optimizes and compiles it
+static void compilePart(const std::string &bitcode,
+                        int opt_level,
+                        std::string &optimized,
+                        std::string &object)
+{
+  LLVMContext context;
+  auto module = parseBitcodeFile(MemoryBufferRef(bitcode, "part"), context);
+  if (!module)
+    throw std::runtime_error(toString(module.takeError()));
+
+  runOptimizations(**module, opt_level);
+  raw_string_ostream ir(optimized);
+  WriteBitcodeToFile(**module, ir);
+  ir.flush();
+
+  auto tm = BpfOrc::CreateTargetMachine();
+  legacy::PassManager PM;
+  SmallVector<char, 0> buf;
+  raw_svector_ostream out(buf);
+#if LLVM_VERSION_MAJOR >= 10
+  auto type = llvm::CGFT_ObjectFile;
+#else
+  auto type = llvm::TargetMachine::CGFT_ObjectFile;
+#endif
+  if (tm->addPassesToEmitFile(PM, out, nullptr, type))
+    throw std::runtime_error("Cannot emit a file of this type");
+  PM.run(**module);
+  object.assign(buf.data(), buf.size());
+}
+
+void CodegenLLVM::optimizeParts(unsigned threads)
+{
+  int opt_level = bpftrace_.opt_level_;
+  std::atomic<size_t> next = 0;
+  auto work = [&]() {
+    for (size_t n = next++; n < parts_.size(); n = next++)
+    {
+      auto &part = parts_[n];
+      try
+      {
+        compilePart(part.bitcode, opt_level, part.optimized, part.object);
+      }
+      catch (const std::exception &ex)
+      {
+        part.error = ex.what();
+      }
+      part.bitcode.clear();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min<size_t>(threads, parts_.size()); ++i)
+    workers.emplace_back(work);
+  work();
+  for (auto &worker : workers)
+    worker.join();
+
+  for (auto &part : parts_)
+    if (!part.error.empty())
+      throw std::runtime_error("Failed to compile: " + part.error);
+}
+
+// The optimized parts as one module again, for what reads module_
+void CodegenLLVM::linkParts()
+{
+  if (module_)
+    return;
+  module_ = std::make_unique<Module>("bpftrace", orc_->getContext());
+  module_->setDataLayout(datalayout());
+  module_->setTargetTriple(LLVMTargetTriple);
+  Linker linker(*module_);
+  for (auto &part : parts_)
+  {
+    auto module = parseBitcodeFile(MemoryBufferRef(part.optimized, "part"),
+                                   orc_->getContext());
+    if (!module)
+      throw std::runtime_error(toString(module.takeError()));
+    if (linker.linkInModule(std::move(*module)))
+      throw std::runtime_error("Failed to link the optimized modules");
+  }
+}
+#endif
+
 std::unique_ptr<BpfOrc> CodegenLLVM::emit(void)
 {
   assert(state_ == State::OPT);
-  orc_->compile(move(module_));
   state_ = State::DONE;
 
 #ifdef LLVM_ORC_V2
@@ -2921,6 +4404,20 @@ std::unique_ptr<BpfOrc> CodegenLLVM::emit(void)
     auto sym = orc_->lookup(s);
     return (sym && sym->getAddress());
   };
+
+  // Each object is linked, and its sections allocated, once a symbol of it
+  // is looked up
+  if (!parts_.empty())
+  {
+    for (auto &part : parts_)
+      orc_->compile(MemoryBuffer::getMemBufferCopy(part.object, "part"));
+    for (auto &part : parts_)
+      has_sym(part.symbol);
+    parts_.clear();
+    return std::move(orc_);
+  }
+
+  orc_->compile(move(module_));
   for (const auto &probe : bpftrace_.special_probes_)
   {
     if (has_sym(probe.name) || has_sym(probe.orig_name))
@@ -2931,6 +4428,8 @@ std::unique_ptr<BpfOrc> CodegenLLVM::emit(void)
     if (has_sym(probe.name) || has_sym(probe.orig_name))
       return std::move(orc_);
   }
+#else
+  orc_->compile(move(module_));
 #endif
 
   return std::move(orc_);
@@ -2950,6 +4449,9 @@ void CodegenLLVM::DumpIR(void)
 
 void CodegenLLVM::DumpIR(std::ostream &out)
 {
+#ifdef LLVM_ORC_V2
+  linkParts();
+#endif
   assert(module_.get() != nullptr);
   raw_os_ostream os(out);
   module_->print(os, nullptr, false, true);
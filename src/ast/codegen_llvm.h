@@ -49,16 +49,47 @@ public:
   void visit(If &if_block) override;
   void visit(Unroll &unroll) override;
   void visit(While &while_block) override;
+  void visit(For &for_loop) override;
   void visit(Jump &jump) override;
   void visit(Predicate &pred) override;
   void visit(AttachPoint &ap) override;
   void visit(Probe &probe) override;
   void visit(Program &program) override;
-  AllocaInst *getMapKey(Map &map);
-  AllocaInst *getHistMapKey(Map &map, Value *log2);
+  Value *getMapKey(Map &map);
+  Value *getHistMapKey(Map &map, Value *log2);
+  const MapKey &mapKey(Map &map);
+  bool isMmapped(Map &map);
+  bool isDense(Map &map);
+  uint32_t bucketArray(Map &map);
+  bool isHashedKey(Map &map);
   int         getNextIndexForProbe(const std::string &probe_name);
   Value      *createLogicalAnd(Binop &binop);
   Value      *createLogicalOr(Binop &binop);
+  // Returns the value of the builtin if it was already computed in the
+  // probe, or computes it
+  Value *cachedBuiltin(const std::string &name,
+                       const std::function<Value *()> &compute);
+  bool isCachedBuiltin(Value *value);
+  Value *getPidTgid();
+
+  // With BPFTRACE_COALESCE_READS, the integer and pointer fields of structs
+  // read through the same base are taken from one read of the bytes covering
+  // them. Returns nullptr for the fields read on their own.
+  Value *coalescedField(FieldAccess &acc, const Field &field);
+  Value *fieldOffset(const SizedType &record_type,
+                     const std::string &name,
+                     const Field &field);
+  void findCoalescedReads(Probe &probe);
+  const Field *coalescableField(FieldAccess &acc);
+  // The expression the struct being accessed is read from, offset bytes
+  // into it, if one whose value doesn't change while the probe runs unless
+  // a variable in it is assigned. With versions, tells apart the values of
+  // the variables.
+  std::optional<std::string> readBase(Expression &record,
+                                      uint64_t &offset,
+                                      bool versions);
+  std::optional<std::string> exprKey(Expression &expr, bool versions);
+  static int countBuiltin(Probe &probe, const std::string &ident);
 
   // Exists to make calling from a debugger easier
   void DumpIR(void);
@@ -72,7 +103,9 @@ public:
   void generate_ir(void);
   void optimize(void);
   std::unique_ptr<BpfOrc> emit(void);
-  void emit_elf(const std::string &filename);
+  // image is stored in the PROGRAM_IMAGE_SECTION section, for the file to
+  // be loaded back by ProgramImage::load_elf()
+  void emit_elf(const std::string &filename, const std::string &image = "");
   // Combine generate_ir, optimize and emit into one call
   std::unique_ptr<BpfOrc> compile(void);
 
@@ -108,13 +141,37 @@ private:
                      FunctionType *func_type,
                      bool expansion,
                      std::optional<int> usdt_location_index = std::nullopt);
+  // Sets up a program generated for probe, and generates the statements
+  // of the given part of it
+  void startProgram(Probe &probe);
+  void generateStatements(Probe &probe, size_t part);
+  // Returns from the program unless the current task is the one given with
+  // -p, or in the cgroup given with --cgroup
+  void generateTargetFilter(Probe &probe);
+  // Returns from the program for the runs the adaptive sampling leaves out
+  void generateAdaptiveSample(Probe &probe);
+  // Returns from the program while the probe is turned off by disable()
+  void generateProbeGate(Probe &probe);
+  // Whether probe doesn't run on behalf of any task in particular
+  bool isTasklessProbe(Probe &probe);
+  std::vector<std::string> probeNames(Probe &probe);
+  void addProbeIds(Probe &probe);
+  // Id of the probe match the program runs for, the value of the probe
+  // builtin
+  Value *getProbeId();
 
   [[nodiscard]] ScopedExprDeleter accept(Node *node);
 
   void compareStructure(SizedType &our_type, llvm::Type *llvm_type);
 
-  Function *createLog2Function();
-  Function *createLinearFunction();
+  // Helpers are inlined, unless the kernel supports BPF to BPF calls and
+  // the program is not part of a probe split with tail calls
+  void initHelperFunction(Function &func);
+  Function *createLog2Function(int first_step, bool is_signed);
+  Function *createLogLinearFunction();
+  // The lhist() bucket index of value, specialized to the literal min, max
+  // and step
+  Value *createLinear(Value *value, int64_t min, int64_t max, int64_t step);
 
   void binop_string(Binop &binop);
   void binop_buf(Binop &binop);
@@ -165,15 +222,46 @@ private:
 
   Value *expr_ = nullptr;
   std::function<void()> expr_deleter_; // intentionally empty
+  // Bytes the last str() read, with its nul, see createFormatStringCall()
+  Value *str_len_ = nullptr;
   Value *ctx_;
   AttachPoint *current_attach_point_ = nullptr;
   std::string probefull_;
+  // The probe builtin is read from the BPF cookie, see Probe::use_cookies
+  bool probe_cookies_ = false;
+  // The probe builtin is patched in as the program is loaded, see
+  // Probe::probe_ids_at_load
+  bool probe_ids_at_load_ = false;
+  // See initHelperFunction()
+  bool inline_helpers_ = true;
   std::string tracepoint_struct_;
   std::map<std::string, int> next_probe_index_;
   // Used if there are duplicate USDT entries
   int current_usdt_location_index_{ 0 };
 
   std::map<std::string, AllocaInst *> variables_;
+  // Builtins that don't change while a probe runs (pid, comm, curtask...),
+  // computed in a block dominating the code being generated. Code that is
+  // only run conditionally restores them when it's done.
+  std::map<std::string, Value *> builtins_;
+  // Bytes of the bases the current probe reads several fields from, see
+  // coalescedField(). The reads themselves are kept with the builtins.
+  struct ReadRange
+  {
+    uint64_t begin = UINT64_MAX;
+    uint64_t end = 0;
+    int fields = 0;
+  };
+  std::map<std::string, ReadRange> read_ranges_;
+  std::map<std::string, AllocaInst *> read_bufs_;
+  // Number of assignments to each variable generated so far
+  std::map<std::string, int> var_versions_;
+  // Loops generated so far, a read done before one isn't used in it
+  int loops_generated_ = 0;
+  // Indexes in bpftrace_.field_relocs_ of the fields of each struct
+  std::map<std::pair<std::string, std::string>, int> field_reloc_ids_;
+  // Number of times the current probe reads comm
+  int comm_uses_ = 0;
   int printf_id_ = 0;
   int seq_printf_id_ = 0;
   int time_id_ = 0;
@@ -182,10 +270,14 @@ private:
   uint64_t join_id_ = 0;
   int system_id_ = 0;
   int non_map_print_id_ = 0;
+  int quantiles_id_ = 0;
   uint64_t watchpoint_id_ = 0;
+  int sample_id_ = 0;
+  int tail_call_id_ = 0;
 
-  Function *linear_func_ = nullptr;
-  Function *log2_func_ = nullptr;
+  Function *log_linear_func_ = nullptr;
+  // By the first step and signedness of createLog2Function()
+  std::map<std::pair<int, bool>, Function *> log2_funcs_;
 
   size_t getStructSize(StructType *s)
   {
@@ -195,6 +287,26 @@ private:
   std::vector<std::tuple<BasicBlock *, BasicBlock *>> loops_;
   std::unordered_map<std::string, bool> probe_names_;
 
+#ifdef LLVM_ORC_V2
+  // With BPFTRACE_CODEGEN_THREADS, optimize() splits the probes into
+  // modules of their own that are optimized and compiled on worker threads,
+  // each in a context of its own. module_ is then only linked back from
+  // them for DumpIR() and emit_elf().
+  struct Part
+  {
+    std::string bitcode;
+    std::string optimized;
+    std::string object;
+    // A function the part defines, to look it up
+    std::string symbol;
+    std::string error;
+  };
+  std::vector<Part> parts_;
+  void splitModule(size_t nparts);
+  void optimizeParts(unsigned threads);
+  void linkParts();
+#endif
+
   enum class State
   {
     INIT,
@@ -5,24 +5,58 @@ namespace bpftrace {
 int FakeMap::next_mapfd_ = 1;
 
 FakeMap::FakeMap(const std::string &name,
-                 const SizedType &type __attribute__((unused)),
-                 const MapKey &key __attribute__((unused)),
-                 int min __attribute__((unused)),
-                 int max __attribute__((unused)),
-                 int step __attribute__((unused)),
-                 int max_entries __attribute__((unused)))
+                 const SizedType &type,
+                 const MapKey &key,
+                 int min,
+                 int max,
+                 int step,
+                 int max_entries,
+                 MapAlloc alloc __attribute__((unused)),
+                 bool mmapable __attribute__((unused)),
+                 bool dense,
+                 bool task_storage,
+                 bool hashed_key,
+                 bool bucket_array)
 {
   name_ = name;
+  key_ = key;
+  max_entries_ = max_entries;
+  dense_ = dense;
+  task_storage_ = task_storage;
+  hashed_key_ = hashed_key;
+  if (bucket_array && !key.args_.empty() && !dense)
+    bucket_array_ = hist_buckets(type, min, max, step);
   mapfd_ = next_mapfd_++;
+  if (type.IsCmsTy())
+    sketch_mapfd_ = next_mapfd_++;
+  if (hashed_key)
+    strings_mapfd_ = next_mapfd_++;
 }
 
 FakeMap::FakeMap(const std::string &name,
-                 const SizedType &type __attribute__((unused)),
-                 const MapKey &key __attribute__((unused)),
-                 int max_entries __attribute__((unused)))
+                 const SizedType &type,
+                 const MapKey &key,
+                 int max_entries,
+                 MapAlloc alloc __attribute__((unused)),
+                 bool mmapable __attribute__((unused)),
+                 bool dense,
+                 bool task_storage,
+                 bool hashed_key,
+                 bool bucket_array)
 {
   name_ = name;
+  key_ = key;
+  max_entries_ = max_entries;
+  dense_ = dense;
+  task_storage_ = task_storage;
+  hashed_key_ = hashed_key;
+  if (bucket_array && !key.args_.empty() && !dense)
+    bucket_array_ = hist_buckets(type, 0, 0, 0);
   mapfd_ = next_mapfd_++;
+  if (type.IsCmsTy())
+    sketch_mapfd_ = next_mapfd_++;
+  if (hashed_key)
+    strings_mapfd_ = next_mapfd_++;
 }
 
 FakeMap::FakeMap(const std::string &name,
@@ -36,8 +70,10 @@ FakeMap::FakeMap(const std::string &name,
   mapfd_ = next_mapfd_++;
 }
 
-FakeMap::FakeMap(const SizedType &type __attribute__((unused)))
+FakeMap::FakeMap(const SizedType &type __attribute__((unused)),
+                 int max_entries)
 {
+  max_entries_ = max_entries;
   mapfd_ = next_mapfd_++;
 }
 
@@ -46,4 +82,40 @@ FakeMap::FakeMap(enum bpf_map_type map_type __attribute__((unused)))
   mapfd_ = next_mapfd_++;
 }
 
+int FakeMap::make_double_buffered()
+{
+  spare_mapfd_ = next_mapfd_++;
+  outer_mapfd_ = next_mapfd_++;
+  return 0;
+}
+
+int FakeMap::renew_spare()
+{
+  spare_mapfd_ = next_mapfd_++;
+  return 0;
+}
+
+int FakeMap::make_windowed(uint32_t slots, uint64_t slot_ns)
+{
+  window_mapfds_.push_back(mapfd_);
+  for (uint32_t slot = 1; slot < slots; slot++)
+    window_mapfds_.push_back(next_mapfd_++);
+  window_outer_mapfd_ = next_mapfd_++;
+  window_slot_ns_ = slot_ns;
+  return 0;
+}
+
+int FakeMap::renew_window_slot(uint32_t slot)
+{
+  window_mapfds_[slot] = next_mapfd_++;
+  return 0;
+}
+
+int FakeMap::make_ttl(uint64_t ttl_ns)
+{
+  ttl_mapfd_ = next_mapfd_++;
+  ttl_ns_ = ttl_ns;
+  return 0;
+}
+
 } // namespace bpftrace
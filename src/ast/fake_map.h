@@ -10,8 +10,14 @@ public:
   FakeMap(const std::string &name,
           const SizedType &type,
           const MapKey &key,
-          int max_entries = 0);
-  FakeMap(const SizedType &type);
+          int max_entries = 0,
+          MapAlloc alloc = MapAlloc::prealloc,
+          bool mmapable = false,
+          bool dense = false,
+          bool task_storage = false,
+          bool hashed_key = false,
+          bool bucket_array = false);
+  FakeMap(const SizedType &type, int max_entries);
   FakeMap(enum bpf_map_type map_type);
   FakeMap(const std::string &name,
           const SizedType &type,
@@ -19,7 +25,13 @@ public:
           int min,
           int max,
           int step,
-          int max_entries);
+          int max_entries,
+          MapAlloc alloc = MapAlloc::prealloc,
+          bool mmapable = false,
+          bool dense = false,
+          bool task_storage = false,
+          bool hashed_key = false,
+          bool bucket_array = false);
   FakeMap(const std::string &name,
           enum bpf_map_type type,
           int key_size,
@@ -27,6 +39,12 @@ public:
           int max_entries,
           int flags);
 
+  int make_double_buffered() override;
+  int renew_spare() override;
+  int make_windowed(uint32_t slots, uint64_t slot_ns) override;
+  int renew_window_slot(uint32_t slot) override;
+  int make_ttl(uint64_t ttl_ns) override;
+
   static int next_mapfd_;
 };
 
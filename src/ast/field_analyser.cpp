@@ -171,7 +171,19 @@ bool FieldAnalyser::compare_args(const std::map<std::string, SizedType>& args1,
 bool FieldAnalyser::resolve_args(AttachPoint &ap)
 {
   bool kretfunc = ap.provider == "kretfunc";
-  std::string func = ap.func;
+  bool rawtracepoint = ap.provider == "rawtracepoint";
+  // Matches of raw tracepoints are category:event
+  auto resolve = [&](std::string func,
+                     std::map<std::string, SizedType> &args) {
+    if (rawtracepoint)
+    {
+      if (func.find(':') != std::string::npos)
+        erase_prefix(func);
+      bpftrace_.btf_.resolve_raw_tracepoint_args(func, args);
+    }
+    else
+      bpftrace_.btf_.resolve_args(func, args, kretfunc, ap.target);
+  };
 
   // load AP arguments into ap_args_
   ap_args_.clear();
@@ -208,11 +220,13 @@ bool FieldAnalyser::resolve_args(AttachPoint &ap)
       // other functions.
       try
       {
-        bpftrace_.btf_.resolve_args(func, first ? ap_args_ : args, kretfunc);
+        resolve(func, first ? ap_args_ : args);
       }
       catch (const std::runtime_error &e)
       {
-        LOG(WARNING) << "kfunc:" << ap.func << ": " << e.what();
+        // Raw tracepoints are left to read argN
+        if (!rawtracepoint)
+          LOG(WARNING) << "kfunc:" << ap.func << ": " << e.what();
         continue;
       }
 
@@ -231,10 +245,12 @@ bool FieldAnalyser::resolve_args(AttachPoint &ap)
     // Resolving args for an explicit function failed, print an error and fail
     try
     {
-      bpftrace_.btf_.resolve_args(ap.func, ap_args_, kretfunc);
+      resolve(ap.func, ap_args_);
     }
     catch (const std::runtime_error &e)
     {
+      if (rawtracepoint)
+        return false;
       LOG(ERROR, ap.loc, err_) << "kfunc:" << ap.func << ": " << e.what();
       return false;
     }
@@ -263,7 +279,8 @@ bool FieldAnalyser::resolve_args(AttachPoint &ap)
 
 void FieldAnalyser::visit(AttachPoint &ap)
 {
-  if (ap.provider == "kfunc" || ap.provider == "kretfunc")
+  if (ap.provider == "kfunc" || ap.provider == "kretfunc" ||
+      ap.provider == "rawtracepoint")
   {
     has_kfunc_probe_ = true;
 
@@ -7,6 +7,7 @@
 #include "codegen_helper.h"
 #include "irbuilderbpf.h"
 #include "log.h"
+#include "probe_matcher.h"
 #include "utils.h"
 
 #include <llvm/IR/DataLayout.h>
@@ -21,6 +22,10 @@ namespace bpftrace {
 namespace ast {
 
 namespace {
+// Largest printf() event sent in a batch, it is copied there with as many
+// stores
+const size_t BATCHED_EVENT_MAX = 256;
+
 std::string probeReadHelperName(libbpf::bpf_func_id id)
 {
   switch (id)
@@ -204,6 +209,89 @@ AllocaInst *IRBuilderBPF::CreateAllocaBPF(int bytes, const std::string &name)
   return CreateAllocaBPF(ty, name);
 }
 
+Value *IRBuilderBPF::CreateScratchBPF(llvm::Type *ty, const std::string &name)
+{
+  uint64_t size = module_.getDataLayout().getTypeAllocSize(ty);
+  uint64_t offset = (scratch_offset_ + 7) & ~7ULL;
+  // The semantic analyser sized the map for the temporaries of each probe,
+  // those it didn't expect (e.g. in unrolled loops) go on the stack
+  if (!scratch_ || size <= SCRATCH_THRESHOLD ||
+      offset + size > bpftrace_.scratch_size_)
+    return CreateAllocaBPF(ty, name);
+
+  scratch_offset_ = offset + size;
+  Value *slice = CreateInBoundsGEP(getInt8Ty(), scratch_, getInt64(offset));
+  return CreatePointerCast(slice, ty->getPointerTo(), name);
+}
+
+Value *IRBuilderBPF::CreateScratchBPF(const SizedType &stype,
+                                      const std::string &name)
+{
+  return CreateScratchBPF(GetType(stype), name);
+}
+
+Value *IRBuilderBPF::CreateScratchBPF(int bytes, const std::string &name)
+{
+  return CreateScratchBPF(ArrayType::get(getInt8Ty(), bytes), name);
+}
+
+void IRBuilderBPF::CreateScratchInit(bool keep_offset)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "scratch_key");
+  CreateStore(getInt32(0), key);
+  CallInst *call = createMapLookup(
+      bpftrace_.maps[MapManager::Type::Scratch].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  // The only entry of the per-CPU array is always there, the check is for
+  // the verifier
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *failure_block = BasicBlock::Create(module_.getContext(),
+                                                 "scratch_failure",
+                                                 parent);
+  BasicBlock *success_block = BasicBlock::Create(module_.getContext(),
+                                                 "scratch_success",
+                                                 parent);
+  Value *condition = CreateICmpNE(
+      call,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "scratch_cond");
+  CreateCondBr(condition, success_block, failure_block);
+
+  SetInsertPoint(failure_block);
+  CreateRet(getInt64(0));
+
+  SetInsertPoint(success_block);
+  scratch_ = call;
+  if (!keep_offset)
+    scratch_offset_ = 0;
+}
+
+void IRBuilderBPF::ClearScratch()
+{
+  scratch_ = nullptr;
+  scratch_offset_ = 0;
+}
+
+Value *IRBuilderBPF::SuspendScratch()
+{
+  Value *scratch = scratch_;
+  scratch_ = nullptr;
+  return scratch;
+}
+
+void IRBuilderBPF::ResumeScratch(Value *scratch)
+{
+  scratch_ = scratch;
+}
+
+CallInst *IRBuilderBPF::CreateLifetimeEnd(Value *ptr, ConstantInt *size)
+{
+  if (scratch_ && ptr->stripInBoundsOffsets() == scratch_)
+    return nullptr;
+  return IRBuilder<>::CreateLifetimeEnd(ptr, size);
+}
+
 llvm::ConstantInt *IRBuilderBPF::GetIntSameSize(uint64_t C, llvm::Type *ty)
 {
   assert(ty->isIntegerTy());
@@ -220,7 +308,7 @@ llvm::ConstantInt *IRBuilderBPF::GetIntSameSize(uint64_t C, llvm::Value *expr)
 llvm::Type *IRBuilderBPF::GetType(const SizedType &stype)
 {
   llvm::Type *ty;
-  if (stype.IsByteArray() || stype.IsRecordTy())
+  if (stype.IsByteArray() || stype.IsRecordTy() || stype.IsDwarfStack())
   {
     ty = ArrayType::get(getInt8Ty(), stype.GetSize());
   }
@@ -295,10 +383,58 @@ CallInst *IRBuilderBPF::CreateBpfPseudoCallFd(int mapfd)
                     "pseudo");
 }
 
-CallInst *IRBuilderBPF::CreateBpfPseudoCallFd(Map &map)
+// Map pointer to pass to the map helpers. Double-buffered maps are looked up
+// in their outer map, which userspace points at either buffer, and window
+// maps in theirs, by the slot of the current time.
+Value *IRBuilderBPF::createMapPtr(Map &map)
 {
-  int mapfd = bpftrace_.maps[map.ident].value()->mapfd_;
-  return CreateBpfPseudoCallFd(mapfd);
+  IMap *imap = bpftrace_.maps[map.ident].value();
+  if (!imap->is_double_buffered() && !imap->is_windowed())
+    return CreateBpfPseudoCallFd(imap->mapfd_);
+
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "outer_key");
+  CallInst *inner;
+  if (imap->is_windowed())
+  {
+    Value *slice = CreateUDiv(CreateGetNs(false),
+                              getInt64(imap->window_slot_ns_));
+    Value *slot = CreateURem(slice, getInt64(imap->window_mapfds_.size()));
+    CreateStore(CreateTrunc(slot, getInt32Ty()), key);
+    inner = createMapLookup(imap->window_outer_mapfd_, key);
+  }
+  else
+  {
+    CreateStore(getInt32(0), key);
+    inner = createMapLookup(imap->outer_mapfd_, key);
+  }
+  CreateLifetimeEnd(key);
+
+  // The outer map always holds one of the buffers, falling back to the
+  // initial one only keeps the verifier happy
+  Value *is_null = CreateICmpEQ(
+      inner,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "outer_lookup_cond");
+  return CreateSelect(is_null,
+                      CreateBpfPseudoCallFd(imap->mapfd_),
+                      CreatePtrToInt(inner, getInt64Ty()),
+                      "map_ptr");
+}
+
+// Record when the entry of key was last updated, for the maps declared as
+// ttl(N), see IMap::ttl_mapfd_. An entry whose time can't be recorded, e.g.
+// as the map of the times is full, only expires once it's updated again.
+void IRBuilderBPF::createMapTouch(Map &map, Value *key)
+{
+  IMap *imap = bpftrace_.maps[map.ident].value();
+  if (imap->ttl_mapfd_ < 0)
+    return;
+
+  AllocaInst *now = CreateAllocaBPF(getInt64Ty(), map.ident + "_updated");
+  CreateStore(CreateGetNs(false), now);
+  createMapUpdate(
+      CreateBpfPseudoCallFd(imap->ttl_mapfd_), key, now, libbpf::BPF_ANY);
+  CreateLifetimeEnd(now);
 }
 
 CallInst *IRBuilderBPF::CreateBpfPseudoCallValue(int mapfd)
@@ -315,9 +451,29 @@ CallInst *IRBuilderBPF::CreateBpfPseudoCallValue(Map &map)
   return CreateBpfPseudoCallValue(mapfd);
 }
 
-CallInst *IRBuilderBPF::createMapLookup(int mapfd, AllocaInst *key)
+CallInst *IRBuilderBPF::CreateBpfPseudoCallFieldOffset(int reloc)
+{
+  Function *pseudo_func = module_.getFunction("llvm.bpf.pseudo");
+  return CreateCall(pseudo_func,
+                    { getInt64(BPF_PSEUDO_FIELD_OFFSET), getInt64(reloc) },
+                    "field_offset");
+}
+
+CallInst *IRBuilderBPF::CreateBpfPseudoCallProbeId()
+{
+  Function *pseudo_func = module_.getFunction("llvm.bpf.pseudo");
+  return CreateCall(pseudo_func,
+                    { getInt64(BPF_PSEUDO_PROBE_ID), getInt64(0) },
+                    "probe_id");
+}
+
+CallInst *IRBuilderBPF::createMapLookup(int mapfd, Value *key)
+{
+  return createMapLookup(CreateBpfPseudoCallFd(mapfd), key);
+}
+
+CallInst *IRBuilderBPF::createMapLookup(Value *map_ptr, Value *key)
 {
-  Value *map_ptr = CreateBpfPseudoCallFd(mapfd);
   // void *map_lookup_elem(struct bpf_map * map, void * key)
   // Return: Map value or NULL
 
@@ -343,25 +499,387 @@ CallInst *IRBuilderBPF::CreateGetJoinMap(Value *ctx, const location &loc)
   return call;
 }
 
+Value *IRBuilderBPF::CreateSample(int site, uint64_t n)
+{
+  return createSampleCheck(site, n, false);
+}
+
+Value *IRBuilderBPF::CreateRatelimit(int site, uint64_t rate)
+{
+  return createSampleCheck(site, rate, true);
+}
+
+// Returns 1 if the event at the given sample()/ratelimit() call site must be
+// let through, 0 otherwise. The state lives in a per-CPU map so no atomic
+// operations are needed.
+Value *IRBuilderBPF::createSampleCheck(int site, uint64_t n, bool ratelimit)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "sample_key");
+  CreateStore(getInt32(site), key);
+  CallInst *call = createMapLookup(
+      bpftrace_.maps[MapManager::Type::Sample].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  AllocaInst *result = CreateAllocaBPF(getInt64Ty(), "sample_result");
+  CreateStore(getInt64(0), result);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
+                                                        "lookup_success",
+                                                        parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                               "sample_merge",
+                                               parent);
+  Value *condition = CreateICmpNE(
+      call,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "map_lookup_cond");
+  CreateCondBr(condition, lookup_success_block, merge_block);
+
+  SetInsertPoint(lookup_success_block);
+  Value *state = CreatePointerCast(call, getInt64Ty()->getPointerTo());
+  Value *pass;
+  if (!ratelimit)
+  {
+    // Let every n-th event through
+    Value *count = CreateAdd(CreateLoad(getInt64Ty(), state), getInt64(1));
+    pass = CreateICmpUGE(count, getInt64(n));
+    CreateStore(CreateSelect(pass, getInt64(0), count), state);
+  }
+  else
+  {
+    // Let at most n events through in every one second window
+    Value *start_ptr = state;
+    Value *count_ptr = CreateGEP(state, getInt64(1));
+    Value *now = CreateGetNs(false);
+    Value *start = CreateLoad(getInt64Ty(), start_ptr);
+    Value *new_window = CreateICmpUGE(CreateSub(now, start),
+                                      getInt64(1000000000ULL));
+    Value *count = CreateSelect(new_window,
+                                getInt64(0),
+                                CreateLoad(getInt64Ty(), count_ptr));
+    pass = CreateICmpULT(count, getInt64(n));
+    CreateStore(CreateSelect(new_window, now, start), start_ptr);
+    CreateStore(CreateSelect(pass, CreateAdd(count, getInt64(1)), count),
+                count_ptr);
+  }
+  CreateStore(CreateZExt(pass, getInt64Ty()), result);
+  CreateBr(merge_block);
+
+  SetInsertPoint(merge_block);
+  Value *ret = CreateLoad(result);
+  CreateLifetimeEnd(result);
+  return ret;
+}
+
+// Whether pid is in the set of processes of --pids and --comm, see
+// BPFtrace::target_tracking_probes()
+Value *IRBuilderBPF::CreateIsTargetPid(IMap &set, Value *pid)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt64Ty(), "target_pid");
+  CreateStore(pid, key);
+  CallInst *call = createMapLookup(set.mapfd_, key);
+  CreateLifetimeEnd(key);
+  return CreateICmpNE(
+      call,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "target_pid_cond");
+}
+
+// Counts a run of the program under the probe id, see
+// BPFTRACE_PROBE_COUNTS. Ids past the end of the per-CPU map aren't counted.
+void IRBuilderBPF::CreateProbeCount(Value *probe_id)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "probe_count_key");
+  CreateStore(CreateIntCast(probe_id, getInt32Ty(), false), key);
+  CallInst *call = createMapLookup(
+      bpftrace_.maps[MapManager::Type::ProbeCounts].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
+                                                        "probe_count_success",
+                                                        parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                               "probe_count_merge",
+                                               parent);
+  Value *condition = CreateICmpNE(
+      call,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "map_lookup_cond");
+  CreateCondBr(condition, lookup_success_block, merge_block);
+
+  SetInsertPoint(lookup_success_block);
+  Value *count = CreatePointerCast(call, getInt64Ty()->getPointerTo());
+  CreateStore(CreateAdd(CreateLoad(getInt64Ty(), count), getInt64(1)), count);
+  CreateBr(merge_block);
+
+  SetInsertPoint(merge_block);
+}
+
+// The pids sent are kept in an LRU hash, inserted with BPF_NOEXIST so that
+// only one of the CPUs seeing a new process at once sends it. A pid evicted
+// is sent again, RawSymbols::add_process() reads the mappings only once.
+void IRBuilderBPF::CreateRawSymbolsPid(Value *ctx)
+{
+  int mapfd = bpftrace_.maps[MapManager::Type::RawSymbolsPids].value()->mapfd_;
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "raw_symbols_pid");
+  Value *pid = CreateLShr(CreateGetPidTgid(), 32);
+  CreateStore(CreateTrunc(pid, getInt32Ty()), key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *new_block = BasicBlock::Create(module_.getContext(),
+                                             "raw_symbols_pid_new",
+                                             parent);
+  BasicBlock *send_block = BasicBlock::Create(module_.getContext(),
+                                              "raw_symbols_pid_send",
+                                              parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "raw_symbols_pid_done",
+                                              parent);
+  CallInst *seen = createMapLookup(mapfd, key);
+  CreateCondBr(CreateICmpEQ(seen,
+                            ConstantExpr::getCast(Instruction::IntToPtr,
+                                                  getInt64(0),
+                                                  getInt8PtrTy()),
+                            "raw_symbols_pid_cond"),
+               new_block,
+               done_block);
+
+  SetInsertPoint(new_block);
+  AllocaInst *val = CreateAllocaBPF(getInt8Ty(), "raw_symbols_pid_val");
+  CreateStore(getInt8(0), val);
+  CallInst *inserted = createMapUpdate(
+      CreateBpfPseudoCallFd(mapfd), key, val, libbpf::BPF_NOEXIST);
+  CreateLifetimeEnd(val);
+  CreateCondBr(CreateICmpEQ(inserted, getInt64(0), "raw_symbols_pid_inserted"),
+               send_block,
+               done_block);
+
+  SetInsertPoint(send_block);
+  auto elements = AsyncEvent::RawSymbolsPid().asLLVMType(*this);
+  StructType *event_struct = GetStructType("raw_symbols_pid_t",
+                                           elements,
+                                           true);
+  AllocaInst *buf = CreateAllocaBPF(event_struct, "raw_symbols_pid_t");
+  CreateStore(GetIntSameSize(asyncactionint(AsyncAction::raw_symbols_pid),
+                             elements.at(0)),
+              CreateGEP(buf, { getInt64(0), getInt32(0) }));
+  CreateStore(pid, CreateGEP(buf, { getInt64(0), getInt32(1) }));
+  auto &layout = module_.getDataLayout();
+  CreatePerfEventOutput(ctx, buf, layout.getTypeAllocSize(event_struct));
+  CreateLifetimeEnd(buf);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+  CreateLifetimeEnd(key);
+}
+
+// Returns 1 if the run of the probe is let through by the adaptive sampling,
+// 1 out of every divisor runs on each CPU, 0 otherwise. Runs are let through
+// until userspace first sets the divisor. See BPFtrace::adjust_sampling().
+Value *IRBuilderBPF::CreateAdaptiveSample()
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "adaptive_sample_key");
+  CreateStore(getInt32(0), key);
+  CallInst *call = createMapLookup(
+      bpftrace_.maps[MapManager::Type::AdaptiveSample].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  AllocaInst *result = CreateAllocaBPF(getInt64Ty(), "adaptive_sample_result");
+  CreateStore(getInt64(1), result);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success_block = BasicBlock::Create(
+      module_.getContext(), "adaptive_sample_success", parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                               "adaptive_sample_merge",
+                                               parent);
+  Value *condition = CreateICmpNE(
+      call,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "map_lookup_cond");
+  CreateCondBr(condition, lookup_success_block, merge_block);
+
+  SetInsertPoint(lookup_success_block);
+  // { divisor, count, seen, passed }
+  Value *state = CreatePointerCast(call, getInt64Ty()->getPointerTo());
+  Value *count_ptr = CreateGEP(state, getInt64(1));
+  Value *seen_ptr = CreateGEP(state, getInt64(2));
+  Value *passed_ptr = CreateGEP(state, getInt64(3));
+  Value *count = CreateAdd(CreateLoad(getInt64Ty(), count_ptr), getInt64(1));
+  Value *pass = CreateICmpUGE(count, CreateLoad(getInt64Ty(), state));
+  Value *pass64 = CreateZExt(pass, getInt64Ty());
+  CreateStore(CreateSelect(pass, getInt64(0), count), count_ptr);
+  CreateStore(CreateAdd(CreateLoad(getInt64Ty(), seen_ptr), getInt64(1)),
+              seen_ptr);
+  CreateStore(CreateAdd(CreateLoad(getInt64Ty(), passed_ptr), pass64),
+              passed_ptr);
+  CreateStore(pass64, result);
+  CreateBr(merge_block);
+
+  SetInsertPoint(merge_block);
+  Value *ret = CreateLoad(result);
+  CreateLifetimeEnd(result);
+  return ret;
+}
+
+// Returns 1 if the probe with gate was turned off by disable(), 0 otherwise
+Value *IRBuilderBPF::CreateProbeDisabled(int gate)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "probe_gate_key");
+  CreateStore(getInt32(gate), key);
+  CallInst *call = createMapLookup(
+      bpftrace_.maps[MapManager::Type::ProbeGates].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  AllocaInst *result = CreateAllocaBPF(getInt64Ty(), "probe_gate_result");
+  CreateStore(getInt64(0), result);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
+                                                        "probe_gate_success",
+                                                        parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                               "probe_gate_merge",
+                                               parent);
+  Value *condition = CreateICmpNE(
+      call,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "map_lookup_cond");
+  CreateCondBr(condition, lookup_success_block, merge_block);
+
+  SetInsertPoint(lookup_success_block);
+  Value *disabled = CreatePointerCast(call, getInt64Ty()->getPointerTo());
+  CreateStore(CreateLoad(getInt64Ty(), disabled), result);
+  CreateBr(merge_block);
+
+  SetInsertPoint(merge_block);
+  Value *ret = CreateLoad(result);
+  CreateLifetimeEnd(result);
+  return ret;
+}
+
+// Turns the probe with gate on or off, for enable() and disable()
+void IRBuilderBPF::CreateSetProbeDisabled(int gate, bool disabled)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "probe_gate_key");
+  CreateStore(getInt32(gate), key);
+  CallInst *call = createMapLookup(
+      bpftrace_.maps[MapManager::Type::ProbeGates].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
+                                                        "probe_gate_success",
+                                                        parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                               "probe_gate_merge",
+                                               parent);
+  Value *condition = CreateICmpNE(
+      call,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "map_lookup_cond");
+  CreateCondBr(condition, lookup_success_block, merge_block);
+
+  SetInsertPoint(lookup_success_block);
+  CreateStore(getInt64(disabled),
+              CreatePointerCast(call, getInt64Ty()->getPointerTo()));
+  CreateBr(merge_block);
+
+  SetInsertPoint(merge_block);
+}
+
+// Value of the event at slot of the counters map on the current CPU, 0 if it
+// can't be read
+Value *IRBuilderBPF::CreateReadCounter(Value *ctx,
+                                       int slot,
+                                       const location &loc)
+{
+  Value *map_ptr = CreateBpfPseudoCallFd(
+      bpftrace_.maps[MapManager::Type::Counters].value()->mapfd_);
+  Value *index = CreateAdd(getInt64(slot * counter_cpus()),
+                           CreateGetCpuId(),
+                           "counter_index");
+
+  // struct bpf_perf_event_value { u64 counter; u64 enabled; u64 running; }
+  AllocaInst *value = CreateAllocaBPF(ArrayType::get(getInt64Ty(), 3),
+                                      "counter_value");
+
+  // long bpf_perf_event_read_value(struct bpf_map *map, u64 flags,
+  //                                struct bpf_perf_event_value *buf,
+  //                                u32 buf_size)
+  // Return: 0 on success, a negative error otherwise, with buf zeroed
+  FunctionType *read_func_type = FunctionType::get(
+      getInt64Ty(),
+      { map_ptr->getType(), getInt64Ty(), value->getType(), getInt32Ty() },
+      false);
+  PointerType *read_func_ptr_type = PointerType::get(read_func_type, 0);
+  Constant *read_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_perf_event_read_value),
+      read_func_ptr_type);
+  CallInst *call = createCall(read_func,
+                              { map_ptr, index, value, getInt32(24) },
+                              "perf_event_read_value");
+  CreateHelperErrorCond(
+      ctx, call, libbpf::BPF_FUNC_perf_event_read_value, loc);
+
+  Value *counter = CreateLoad(
+      getInt64Ty(), CreateGEP(value, { getInt64(0), getInt64(0) }));
+  CreateLifetimeEnd(value);
+  return counter;
+}
+
 Value *IRBuilderBPF::CreateMapLookupElem(Value *ctx,
                                          Map &map,
-                                         AllocaInst *key,
+                                         Value *key,
                                          const location &loc)
 {
   assert(ctx && ctx->getType() == getInt8PtrTy());
-  int mapfd = bpftrace_.maps[map.ident].value()->mapfd_;
-  return CreateMapLookupElem(ctx, mapfd, key, map.type, loc);
+  if (isTaskStorage(map))
+    return createMapLookupElem(ctx,
+                               createTaskStorageGet(map, 0),
+                               map.type,
+                               libbpf::BPF_FUNC_task_storage_get,
+                               loc);
+  if (isGlobal(map))
+    return CreateLoad(getInt64Ty(), createGlobalPtr(map, 0));
+  if (isBloom(map))
+    return createBloomTest(map, key);
+  return createMapLookupElem(ctx, createMapPtr(map), key, map.type, loc);
 }
 
 Value *IRBuilderBPF::CreateMapLookupElem(Value *ctx,
                                          int mapfd,
-                                         AllocaInst *key,
+                                         Value *key,
                                          SizedType &type,
                                          const location &loc)
 {
   assert(ctx && ctx->getType() == getInt8PtrTy());
-  CallInst *call = createMapLookup(mapfd, key);
+  return createMapLookupElem(
+      ctx, CreateBpfPseudoCallFd(mapfd), key, type, loc);
+}
 
+Value *IRBuilderBPF::createMapLookupElem(Value *ctx,
+                                         Value *map_ptr,
+                                         Value *key,
+                                         SizedType &type,
+                                         const location &loc)
+{
+  return createMapLookupElem(ctx,
+                             createMapLookup(map_ptr, key),
+                             type,
+                             libbpf::BPF_FUNC_map_lookup_elem,
+                             loc);
+}
+
+Value *IRBuilderBPF::createMapLookupElem(Value *ctx,
+                                         CallInst *call,
+                                         SizedType &type,
+                                         libbpf::bpf_func_id func_id,
+                                         const location &loc)
+{
   // Check if result == 0
   Function *parent = GetInsertBlock()->getParent();
   BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(), "lookup_success", parent);
@@ -393,69 +911,827 @@ Value *IRBuilderBPF::CreateMapLookupElem(Value *ctx,
     CREATE_MEMSET(value, getInt8(0), type.GetSize(), 1);
   else
     CreateStore(getInt64(0), value);
+  CreateHelperError(ctx, getInt32(0), func_id, loc);
+  CreateBr(lookup_merge_block);
+
+  SetInsertPoint(lookup_merge_block);
+  if (needMemcpy(type))
+    return value;
+
+  Value *ret = CreateLoad(value);
+  CreateLifetimeEnd(value);
+  return ret;
+}
+
+CallInst *IRBuilderBPF::createMapUpdate(Value *map_ptr,
+                                        Value *key,
+                                        Value *val,
+                                        uint64_t flags)
+{
+  assert(key->getType()->isPointerTy());
+  assert(val->getType()->isPointerTy());
+
+  // int map_update_elem(struct bpf_map * map, void *key, void * value, u64
+  // flags) Return: 0 on success or negative error
+  FunctionType *update_func_type = FunctionType::get(
+      getInt64Ty(),
+      { map_ptr->getType(), key->getType(), val->getType(), getInt64Ty() },
+      false);
+  PointerType *update_func_ptr_type = PointerType::get(update_func_type, 0);
+  Constant *update_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_map_update_elem),
+      update_func_ptr_type);
+  return createCall(update_func,
+                    { map_ptr, key, val, getInt64(flags) },
+                    "update_elem");
+}
+
+void IRBuilderBPF::CreateMapUpdateElem(Value *ctx,
+                                       Map &map,
+                                       Value *key,
+                                       Value *val,
+                                       const location &loc)
+{
+  assert(ctx && ctx->getType() == getInt8PtrTy());
+  if (isTaskStorage(map))
+  {
+    createTaskStorageUpdate(ctx, map, val, loc);
+    return;
+  }
+  if (isGlobal(map))
+  {
+    Value *value = CreateLoad(getInt64Ty(),
+                              CreatePointerCast(val,
+                                                getInt64Ty()->getPointerTo()));
+    CreateStore(value, createGlobalPtr(map, 0));
+    if (map.type.IsIntTy())
+      CreateStore(getInt64(1), createGlobalPtr(map, 8));
+    return;
+  }
+  if (isBloom(map))
+  {
+    createBloomAdd(ctx, map, key, loc);
+    return;
+  }
+  CallInst *call = createMapUpdate(
+      createMapPtr(map), key, val, libbpf::BPF_ANY);
+  CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_map_update_elem, loc);
+  createMapTouch(map, key);
+}
+
+void IRBuilderBPF::CreateMapDeleteElem(Value *ctx,
+                                       Map &map,
+                                       Value *key,
+                                       const location &loc)
+{
+  assert(ctx && ctx->getType() == getInt8PtrTy());
+  assert(key->getType()->isPointerTy());
+  if (isTaskStorage(map))
+  {
+    createTaskStorageDelete(ctx, map, loc);
+    return;
+  }
+  if (isGlobal(map))
+  {
+    CreateStore(getInt64(0), createGlobalPtr(map, 0));
+    if (map.type.IsIntTy())
+      CreateStore(getInt64(0), createGlobalPtr(map, 8));
+    return;
+  }
+  Value *map_ptr = createMapPtr(map);
+
+  // int map_delete_elem(&map, &key)
+  // Return: 0 on success or negative error
+  FunctionType *delete_func_type = FunctionType::get(
+      getInt64Ty(), { map_ptr->getType(), key->getType() }, false);
+  PointerType *delete_func_ptr_type = PointerType::get(delete_func_type, 0);
+  Constant *delete_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_map_delete_elem),
+      delete_func_ptr_type);
+  CallInst *call = createCall(delete_func, { map_ptr, key }, "delete_elem");
+  CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_map_delete_elem, loc);
+
+  IMap *imap = bpftrace_.maps[map.ident].value();
+  if (imap->ttl_mapfd_ >= 0)
+    createCall(delete_func,
+               { CreateBpfPseudoCallFd(imap->ttl_mapfd_), key },
+               "delete_elem");
+}
+
+// Keyless maps of a single value in a mmapped array, see IMap::is_mmapped().
+// hist() and lhist() ones have one value per bucket.
+bool IRBuilderBPF::isGlobal(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->is_mmapped() &&
+         !map.type.IsHistTy() && !map.type.IsLhistTy();
+}
+
+// Address of the value of a global map, resolved when the program is loaded
+// like those of the map fds, see IMap::mmapped_value_size() for the layout
+Value *IRBuilderBPF::createGlobalPtr(Map &map, int64_t offset)
+{
+  Value *addr = CreateBpfPseudoCallValue(map);
+  if (offset)
+    addr = CreateAdd(addr, getInt64(offset));
+  return CreateIntToPtr(addr, getInt64Ty()->getPointerTo(), "global");
+}
+
+// Maps stored with the current task, see IMap::task_storage_. The key, which
+// is always tid, isn't used.
+bool IRBuilderBPF::isBloom(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->bloom_;
+}
+
+// 1 if the key may have been added to the bloom map, 0 if it surely wasn't
+Value *IRBuilderBPF::createBloomTest(Map &map, Value *key)
+{
+  auto &imap = *bpftrace_.maps[map.ident].value();
+  if (imap.bloom_bytes_)
+  {
+    AllocaInst *found = CreateAllocaBPF(getInt64Ty(), "bloom.found");
+    createBloomBytes(imap, key, false, found);
+    Value *result = CreateLoad(getInt64Ty(), found);
+    CreateLifetimeEnd(found);
+    return result;
+  }
+
+  // long map_peek_elem(struct bpf_map *map, void *value)
+  // Return: 0 if the value may be in the bloom filter, -ENOENT otherwise
+  Value *map_ptr = CreateBpfPseudoCallFd(imap.mapfd_);
+  FunctionType *peek_func_type = FunctionType::get(
+      getInt64Ty(), { map_ptr->getType(), key->getType() }, false);
+  PointerType *peek_func_ptr_type = PointerType::get(peek_func_type, 0);
+  Constant *peek_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_map_peek_elem),
+      peek_func_ptr_type);
+  CallInst *call = createCall(peek_func, { map_ptr, key }, "bloom_peek");
+  return CreateZExt(CreateICmpEQ(call, getInt64(0)), getInt64Ty());
+}
+
+void IRBuilderBPF::createBloomAdd(Value *ctx,
+                                  Map &map,
+                                  Value *key,
+                                  const location &loc)
+{
+  auto &imap = *bpftrace_.maps[map.ident].value();
+  if (imap.bloom_bytes_)
+  {
+    createBloomBytes(imap, key, true, nullptr);
+    return;
+  }
+
+  // long map_push_elem(struct bpf_map *map, const void *value, u64 flags)
+  // Return: 0 on success or negative error
+  Value *map_ptr = CreateBpfPseudoCallFd(imap.mapfd_);
+  FunctionType *push_func_type = FunctionType::get(
+      getInt64Ty(),
+      { map_ptr->getType(), key->getType(), getInt64Ty() },
+      false);
+  PointerType *push_func_ptr_type = PointerType::get(push_func_type, 0);
+  Constant *push_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_map_push_elem),
+      push_func_ptr_type);
+  CallInst *call = createCall(push_func,
+                              { map_ptr, key, getInt64(libbpf::BPF_ANY) },
+                              "bloom_push");
+  CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_map_push_elem, loc);
+}
+
+// The bytes of a bloom map without BPF_MAP_TYPE_BLOOM_FILTER picked by the
+// double hashing of the key: set to 1 when adding it, or else checked for
+// being all set into found. Setting a whole byte rather than a bit doesn't
+// race with the other CPUs setting the others.
+void IRBuilderBPF::createBloomBytes(IMap &imap,
+                                    Value *key,
+                                    bool add,
+                                    AllocaInst *found)
+{
+  if (found)
+    CreateStore(getInt64(0), found);
+
+  AllocaInst *index = CreateAllocaBPF(getInt32Ty(), "bloom.index");
+  CreateStore(getInt32(0), index);
+  CallInst *bytes = createMapLookup(imap.mapfd_, index);
+  CreateLifetimeEnd(index);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success = BasicBlock::Create(module_.getContext(),
+                                                  "bloom.lookup_success",
+                                                  parent);
+  BasicBlock *done = BasicBlock::Create(module_.getContext(),
+                                        "bloom.done",
+                                        parent);
+  Value *is_null = CreateICmpEQ(
+      bytes,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "bloom.lookup_cond");
+  CreateCondBr(is_null, done, lookup_success);
+
+  SetInsertPoint(lookup_success);
+  // FNV-1a of all the bytes of the key, mixed so that both halves are usable
+  Value *ptr = CreatePointerCast(key, getInt8PtrTy());
+  Value *hash = getInt64(14695981039346656037ULL);
+  for (size_t i = 0; i < imap.key_.size(); i++)
+  {
+    Value *c = CreateLoad(getInt8Ty(), CreateGEP(ptr, getInt64(i)));
+    hash = CreateMul(CreateXor(hash, CreateZExt(c, getInt64Ty())),
+                     getInt64(1099511628211ULL));
+  }
+  hash = CreateMix64(hash);
+  Value *step = CreateOr(CreateLShr(hash, 32), getInt64(1));
+
+  Value *all_set = getInt1(true);
+  for (int i = 0; i < IMap::BLOOM_HASHES; i++)
+  {
+    Value *offset = CreateAnd(CreateAdd(hash, CreateMul(step, getInt64(i))),
+                              getInt64(imap.bloom_bytes_ - 1));
+    Value *byte = CreateGEP(bytes, offset);
+    if (add)
+      CreateStore(getInt8(1), byte);
+    else
+      all_set = CreateAnd(all_set,
+                          CreateICmpNE(CreateLoad(getInt8Ty(), byte),
+                                       getInt8(0)));
+  }
+  if (found)
+    CreateStore(CreateZExt(all_set, getInt64Ty()), found);
+  CreateBr(done);
+
+  SetInsertPoint(done);
+}
+
+bool IRBuilderBPF::isTaskStorage(Map &map)
+{
+  return bpftrace_.maps[map.ident].value()->task_storage_;
+}
+
+CallInst *IRBuilderBPF::createTaskStorageGet(Map &map, uint64_t flags)
+{
+  // void *bpf_task_storage_get(&map, struct task_struct *task, void *value,
+  //                            u64 flags)
+  // Return: the value of the task or NULL
+  Value *map_ptr = createMapPtr(map);
+  Value *task = CreateGetCurrentTaskBtf();
+  FunctionType *get_func_type = FunctionType::get(
+      getInt8PtrTy(),
+      { map_ptr->getType(), task->getType(), getInt8PtrTy(), getInt64Ty() },
+      false);
+  PointerType *get_func_ptr_type = PointerType::get(get_func_type, 0);
+  Constant *get_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_task_storage_get),
+      get_func_ptr_type);
+  return createCall(get_func,
+                    { map_ptr,
+                      task,
+                      ConstantPointerNull::get(getInt8PtrTy()),
+                      getInt64(flags) },
+                    "task_storage_get");
+}
+
+void IRBuilderBPF::createTaskStorageUpdate(Value *ctx,
+                                           Map &map,
+                                           Value *val,
+                                           const location &loc)
+{
+  CallInst *value = createTaskStorageGet(
+      map, libbpf::BPF_LOCAL_STORAGE_GET_F_CREATE);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *store_block = BasicBlock::Create(module_.getContext(),
+                                               "task_storage.store",
+                                               parent);
+  BasicBlock *failure_block = BasicBlock::Create(module_.getContext(),
+                                                 "task_storage.failure",
+                                                 parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "task_storage.done",
+                                              parent);
+  Value *condition = CreateICmpNE(value,
+                                  ConstantPointerNull::get(getInt8PtrTy()),
+                                  "task_storage_cond");
+  CreateCondBr(condition, store_block, failure_block);
+
+  SetInsertPoint(store_block);
+  CREATE_MEMCPY(value, val, map.type.GetSize(), 1);
+  CreateBr(done_block);
+
+  SetInsertPoint(failure_block);
+  CreateHelperError(ctx, getInt32(0), libbpf::BPF_FUNC_task_storage_get, loc);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+}
+
+void IRBuilderBPF::createTaskStorageDelete(Value *ctx,
+                                           Map &map,
+                                           const location &loc)
+{
+  // long bpf_task_storage_delete(&map, struct task_struct *task)
+  // Return: 0 on success or negative error
+  Value *map_ptr = createMapPtr(map);
+  Value *task = CreateGetCurrentTaskBtf();
+  FunctionType *delete_func_type = FunctionType::get(
+      getInt64Ty(), { map_ptr->getType(), task->getType() }, false);
+  PointerType *delete_func_ptr_type = PointerType::get(delete_func_type, 0);
+  Constant *delete_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_task_storage_delete),
+      delete_func_ptr_type);
+  CallInst *call = createCall(delete_func,
+                              { map_ptr, task },
+                              "task_storage_delete");
+  CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_task_storage_delete, loc);
+}
+
+void IRBuilderBPF::CreateMapAtomicAdd(Value *ctx,
+                                      Map &map,
+                                      Value *key,
+                                      Value *val,
+                                      const location &loc)
+{
+  // Array maps always have a value for every key in range, a lookup failure
+  // is reported like any other:
+  //
+  // ptr = lookup(map, key);
+  // if (ptr)
+  //   __sync_fetch_and_add(ptr, val);
+  //
+  // The single value of keyless count() and sum() maps is added to in place.
+  assert(ctx && ctx->getType() == getInt8PtrTy());
+  assert(val->getType() == getInt64Ty());
+  if (isGlobal(map))
+  {
+    CREATE_ATOMIC_RMW(AtomicRMWInst::BinOp::Add,
+                      createGlobalPtr(map, 0),
+                      val,
+                      8,
+                      AtomicOrdering::SequentiallyConsistent);
+    return;
+  }
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
+                                                        "lookup_success",
+                                                        parent);
+  BasicBlock *lookup_failure_block = BasicBlock::Create(module_.getContext(),
+                                                        "lookup_failure",
+                                                        parent);
+  BasicBlock *lookup_merge_block = BasicBlock::Create(module_.getContext(),
+                                                      "lookup_merge",
+                                                      parent);
+
+  CallInst *lookup = createMapLookup(createMapPtr(map), key);
+  Value *condition = CreateICmpNE(
+      lookup,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "map_lookup_cond");
+  CreateCondBr(condition, lookup_success_block, lookup_failure_block);
+
+  SetInsertPoint(lookup_success_block);
+  CREATE_ATOMIC_RMW(AtomicRMWInst::BinOp::Add,
+                    CreatePointerCast(lookup, getInt64Ty()->getPointerTo()),
+                    val,
+                    8,
+                    AtomicOrdering::SequentiallyConsistent);
+  CreateBr(lookup_merge_block);
+
+  SetInsertPoint(lookup_failure_block);
   CreateHelperError(ctx, getInt32(0), libbpf::BPF_FUNC_map_lookup_elem, loc);
   CreateBr(lookup_merge_block);
 
   SetInsertPoint(lookup_merge_block);
-  if (needMemcpy(type))
-    return value;
+}
 
-  Value *ret = CreateLoad(value);
+void IRBuilderBPF::CreateMapUpdateInPlace(
+    Value *ctx,
+    Map &map,
+    Value *key,
+    Value *init,
+    const std::function<Value *(Value *)> &update,
+    const location &loc)
+{
+  CreateMapUpdateInPlace(
+      ctx,
+      map,
+      key,
+      std::vector<Value *>{ init },
+      [&](std::vector<Value *> fields) {
+        return std::vector<Value *>{ update(fields[0]) };
+      },
+      loc);
+}
+
+void IRBuilderBPF::CreateMapUpdateInPlace(
+    Value *ctx,
+    Map &map,
+    Value *key,
+    const std::vector<Value *> &init,
+    const std::function<std::vector<Value *>(std::vector<Value *>)> &update,
+    const location &loc)
+{
+  // One lookup for the keys already in the map, the values of per-CPU maps
+  // are only written by their CPU:
+  //
+  // ptr = lookup(map, key);
+  // if (ptr)
+  //   *ptr = update(*ptr);
+  // else if (update(map, key, &init, BPF_NOEXIST)) {
+  //   // Inserted by another CPU in the meantime, for the maps that aren't
+  //   // per-CPU
+  //   ptr = lookup(map, key);
+  //   if (ptr)
+  //     *ptr = update(*ptr);
+  // }
+  assert(ctx && ctx->getType() == getInt8PtrTy());
+  for (auto field : init)
+    assert(field->getType() == getInt64Ty());
+  ArrayType *value_type = ArrayType::get(getInt64Ty(), init.size());
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *insert_block = BasicBlock::Create(module_.getContext(),
+                                                "update.insert",
+                                                parent);
+  BasicBlock *retry_block = BasicBlock::Create(module_.getContext(),
+                                               "update.retry",
+                                               parent);
+  BasicBlock *failure_block = BasicBlock::Create(module_.getContext(),
+                                                 "update.failure",
+                                                 parent);
+  BasicBlock *update_block = BasicBlock::Create(module_.getContext(),
+                                                "update.in_place",
+                                                parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "update.done",
+                                              parent);
+  Value *null = ConstantExpr::getCast(Instruction::IntToPtr,
+                                      getInt64(0),
+                                      getInt8PtrTy());
+
+  CallInst *lookup = createMapLookup(createMapPtr(map), key);
+  BasicBlock *lookup_block = GetInsertBlock();
+  CreateCondBr(CreateICmpNE(lookup, null, "map_lookup_cond"),
+               update_block,
+               insert_block);
+
+  SetInsertPoint(insert_block);
+  AllocaInst *value = CreateAllocaBPF(value_type, map.ident + "_val");
+  for (size_t i = 0; i < init.size(); i++)
+    CreateStore(init[i], CreateGEP(value, { getInt64(0), getInt64(i) }));
+  CallInst *insert = createMapUpdate(
+      createMapPtr(map), key, value, libbpf::BPF_NOEXIST);
   CreateLifetimeEnd(value);
-  return ret;
+  CreateCondBr(CreateICmpEQ(insert, getInt64(0), "map_insert_cond"),
+               done_block,
+               retry_block);
+
+  SetInsertPoint(retry_block);
+  CallInst *retry = createMapLookup(createMapPtr(map), key);
+  CreateCondBr(CreateICmpNE(retry, null, "map_lookup_cond"),
+               update_block,
+               failure_block);
+
+  SetInsertPoint(failure_block);
+  CreateHelperError(ctx,
+                    CreateIntCast(insert, getInt32Ty(), true),
+                    libbpf::BPF_FUNC_map_update_elem,
+                    loc);
+  CreateBr(done_block);
+
+  SetInsertPoint(update_block);
+  PHINode *found = CreatePHI(getInt8PtrTy(), 2, "update_ptr");
+  found->addIncoming(lookup, lookup_block);
+  found->addIncoming(retry, retry_block);
+  Value *ptr = CreatePointerCast(found, value_type->getPointerTo());
+  std::vector<Value *> fields;
+  for (size_t i = 0; i < init.size(); i++)
+    fields.push_back(CreateLoad(
+        getInt64Ty(), CreateGEP(ptr, { getInt64(0), getInt64(i) })));
+  auto updated = update(std::move(fields));
+  assert(updated.size() == init.size());
+  for (size_t i = 0; i < updated.size(); i++)
+    CreateStore(updated[i], CreateGEP(ptr, { getInt64(0), getInt64(i) }));
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+  createMapTouch(map, key);
 }
 
-void IRBuilderBPF::CreateMapUpdateElem(Value *ctx,
-                                       Map &map,
-                                       AllocaInst *key,
-                                       Value *val,
-                                       const location &loc)
+void IRBuilderBPF::CreateBucketArrayAdd(Value *ctx,
+                                        Map &map,
+                                        Value *key,
+                                        Value *bucket,
+                                        uint32_t buckets,
+                                        const location &loc)
+{
+  // The values of the per-CPU map are only written by their CPU:
+  //
+  // counts = lookup(map, key);
+  // if (!counts) {
+  //   update(map, key, zeroed buckets, BPF_NOEXIST);
+  //   counts = lookup(map, key);
+  //   if (!counts)
+  //     return;
+  // }
+  // if (bucket < buckets)
+  //   counts[bucket]++;
+  assert(ctx && ctx->getType() == getInt8PtrTy());
+  assert(bucket->getType() == getInt64Ty());
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *init_block = BasicBlock::Create(module_.getContext(),
+                                              "buckets.init",
+                                              parent);
+  BasicBlock *failure_block = BasicBlock::Create(module_.getContext(),
+                                                 "buckets.failure",
+                                                 parent);
+  BasicBlock *found_block = BasicBlock::Create(module_.getContext(),
+                                               "buckets.found",
+                                               parent);
+  BasicBlock *update_block = BasicBlock::Create(module_.getContext(),
+                                                "buckets.update",
+                                                parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "buckets.done",
+                                              parent);
+  Value *null = ConstantExpr::getCast(Instruction::IntToPtr,
+                                      getInt64(0),
+                                      getInt8PtrTy());
+
+  CallInst *lookup = createMapLookup(createMapPtr(map), key);
+  BasicBlock *lookup_block = GetInsertBlock();
+  CreateCondBr(CreateICmpNE(lookup, null, "buckets_found"),
+               found_block,
+               init_block);
+
+  // Too large for the stack, the semantic analyser made room for it in the
+  // scratch map
+  SetInsertPoint(init_block);
+  ArrayType *value_type = ArrayType::get(getInt64Ty(), buckets);
+  Value *zero = CreateScratchBPF(value_type, map.ident + "_zero");
+  CREATE_MEMSET(zero, getInt8(0), buckets * sizeof(uint64_t), 8);
+  CallInst *insert = createMapUpdate(
+      createMapPtr(map), key, zero, libbpf::BPF_NOEXIST);
+  CreateLifetimeEnd(zero);
+  CallInst *init_lookup = createMapLookup(createMapPtr(map), key);
+  BasicBlock *init_lookup_block = GetInsertBlock();
+  CreateCondBr(CreateICmpNE(init_lookup, null, "buckets_found"),
+               found_block,
+               failure_block);
+
+  SetInsertPoint(failure_block);
+  CreateHelperError(ctx,
+                    CreateIntCast(insert, getInt32Ty(), true),
+                    libbpf::BPF_FUNC_map_update_elem,
+                    loc);
+  CreateBr(done_block);
+
+  SetInsertPoint(found_block);
+  PHINode *counts = CreatePHI(getInt8PtrTy(), 2, "buckets_counts");
+  counts->addIncoming(lookup, lookup_block);
+  counts->addIncoming(init_lookup, init_lookup_block);
+  // The bound is for the verifier, the bucket functions stay below it
+  CreateCondBr(CreateICmpULT(bucket, getInt64(buckets), "buckets_in_range"),
+               update_block,
+               done_block);
+
+  SetInsertPoint(update_block);
+  Value *count = CreateGEP(CreatePointerCast(counts, getInt64Ty()->getPointerTo()),
+                           bucket);
+  CreateStore(CreateAdd(CreateLoad(getInt64Ty(), count), getInt64(1)), count);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+  createMapTouch(map, key);
+}
+
+void IRBuilderBPF::CreateDistinctUpdate(Value *ctx,
+                                        Map &map,
+                                        Value *key,
+                                        Value *val,
+                                        const location &loc)
 {
-  Value *map_ptr = CreateBpfPseudoCallFd(map);
+  // distinct() values are DISTINCT_REGISTERS one byte HyperLogLog registers,
+  // updated in place in the map:
+  //
+  // regs = lookup(map, key);
+  // if (!regs) {
+  //   update(map, key, zeroed registers);
+  //   regs = lookup(map, key);
+  //   if (!regs)
+  //     return;
+  // }
+  // h = hash(val);
+  // rho = leading zeros of (h << 8 | 0x80) + 1;
+  // regs[h >> 56] = max(regs[h >> 56], rho);
+  static_assert(DISTINCT_REGISTERS == 256,
+                "the register index is the top byte of the hash");
 
   assert(ctx && ctx->getType() == getInt8PtrTy());
-  assert(key->getType()->isPointerTy());
-  assert(val->getType()->isPointerTy());
+  assert(val->getType() == getInt64Ty());
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *init_block = BasicBlock::Create(module_.getContext(),
+                                              "distinct.init",
+                                              parent);
+  BasicBlock *update_block = BasicBlock::Create(module_.getContext(),
+                                                "distinct.update",
+                                                parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "distinct.done",
+                                              parent);
+  Value *null = ConstantExpr::getCast(Instruction::IntToPtr,
+                                      getInt64(0),
+                                      getInt8PtrTy());
+
+  CallInst *lookup = createMapLookup(createMapPtr(map), key);
+  BasicBlock *lookup_block = GetInsertBlock();
+  CreateCondBr(CreateICmpNE(lookup, null, "distinct_found"),
+               update_block,
+               init_block);
+
+  SetInsertPoint(init_block);
+  AllocaInst *zero = CreateAllocaBPF(DISTINCT_REGISTERS, "distinct_zero");
+  CREATE_MEMSET(zero, getInt8(0), DISTINCT_REGISTERS, 1);
+  CreateMapUpdateElem(ctx, map, key, zero, loc);
+  CreateLifetimeEnd(zero);
+  CallInst *init_lookup = createMapLookup(createMapPtr(map), key);
+  BasicBlock *init_lookup_block = GetInsertBlock();
+  CreateCondBr(CreateICmpNE(init_lookup, null, "distinct_found"),
+               update_block,
+               done_block);
+
+  SetInsertPoint(update_block);
+  PHINode *regs = CreatePHI(getInt8PtrTy(), 2, "distinct_regs");
+  regs->addIncoming(lookup, lookup_block);
+  regs->addIncoming(init_lookup, init_lookup_block);
+
+  Value *hash = CreateMix64(val);
+  Value *idx = CreateLShr(hash, 56);
+  // Bit 7 bounds the number of leading zeros of the remaining 56 bits
+  Value *n = CreateOr(CreateShl(hash, 8), getInt64(0x80));
+  Value *log2 = getInt64(0);
+  for (int i = 5; i >= 0; i--)
+  {
+    Value *shift = CreateShl(
+        CreateIntCast(CreateICmpUGE(n, getInt64(1ULL << (1 << i))),
+                      getInt64Ty(),
+                      false),
+        i);
+    n = CreateLShr(n, shift);
+    log2 = CreateAdd(log2, shift);
+  }
+  Value *rho = CreateIntCast(
+      CreateSub(getInt64(64), log2), getInt8Ty(), false);
 
-  Value *flags = getInt64(0);
+  Value *reg = CreateGEP(regs, idx);
+  Value *old = CreateLoad(getInt8Ty(), reg);
+  CreateStore(CreateSelect(CreateICmpUGT(rho, old), rho, old), reg);
+  CreateBr(done_block);
 
-  // int map_update_elem(struct bpf_map * map, void *key, void * value, u64
-  // flags) Return: 0 on success or negative error
-  FunctionType *update_func_type = FunctionType::get(
-      getInt64Ty(),
-      { map_ptr->getType(), key->getType(), val->getType(), getInt64Ty() },
-      false);
-  PointerType *update_func_ptr_type = PointerType::get(update_func_type, 0);
-  Constant *update_func = ConstantExpr::getCast(
-      Instruction::IntToPtr,
-      getInt64(libbpf::BPF_FUNC_map_update_elem),
-      update_func_ptr_type);
-  CallInst *call = createCall(update_func,
-                              { map_ptr, key, val, flags },
-                              "update_elem");
-  CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_map_update_elem, loc);
+  SetInsertPoint(done_block);
+  createMapTouch(map, key);
 }
 
-void IRBuilderBPF::CreateMapDeleteElem(Value *ctx,
-                                       Map &map,
-                                       AllocaInst *key,
-                                       const location &loc)
+void IRBuilderBPF::CreateCmsUpdate(Value *ctx,
+                                   Map &map,
+                                   Value *key,
+                                   Value *hash,
+                                   uint64_t threshold,
+                                   const location &loc)
 {
+  // Count key in every row of the sketch, then track it once the smallest of
+  // its counters reaches the threshold on this CPU:
+  //
+  // for (row = 0; row < CMS_DEPTH; row++) {
+  //   counters = lookup(sketch, row);
+  //   if (counters)
+  //     min = min(min, ++counters[cms_column(hash, row)]);
+  // }
+  // if (min >= threshold && !lookup(map, key))
+  //   update(map, key, 0);
+  //
+  // See cms_column() for the userspace side.
   assert(ctx && ctx->getType() == getInt8PtrTy());
-  assert(key->getType()->isPointerTy());
-  Value *map_ptr = CreateBpfPseudoCallFd(map);
+  assert(hash->getType() == getInt64Ty());
+  IMap *imap = bpftrace_.maps[map.ident].value();
+  Function *parent = GetInsertBlock()->getParent();
+  Value *null = ConstantExpr::getCast(Instruction::IntToPtr,
+                                      getInt64(0),
+                                      getInt8PtrTy());
+
+  Value *h1 = CreateAnd(hash, getInt64(0xffffffff));
+  Value *h2 = CreateOr(CreateLShr(hash, 32), getInt64(1));
+  AllocaInst *row_key = CreateAllocaBPF(getInt32Ty(), "cms_row");
+  AllocaInst *min = CreateAllocaBPF(getInt64Ty(), "cms_min");
+  CreateStore(getInt64(UINT64_MAX), min);
+  for (int row = 0; row < CMS_DEPTH; row++)
+  {
+    BasicBlock *count_block = BasicBlock::Create(module_.getContext(),
+                                                 "cms.count",
+                                                 parent);
+    BasicBlock *next_block = BasicBlock::Create(module_.getContext(),
+                                                "cms.next",
+                                                parent);
+    CreateStore(getInt32(row), row_key);
+    CallInst *counters = createMapLookup(imap->sketch_mapfd_, row_key);
+    CreateCondBr(CreateICmpNE(counters, null, "cms_found"),
+                 count_block,
+                 next_block);
+
+    SetInsertPoint(count_block);
+    Value *col = CreateAnd(CreateAdd(h1, CreateMul(h2, getInt64(row))),
+                           getInt64(CMS_WIDTH - 1));
+    Value *counter = CreateGEP(
+        CreatePointerCast(counters, getInt64Ty()->getPointerTo()), col);
+    Value *count = CreateAdd(CreateLoad(getInt64Ty(), counter), getInt64(1));
+    CreateStore(count, counter);
+    Value *prev = CreateLoad(getInt64Ty(), min);
+    CreateStore(CreateSelect(CreateICmpULT(count, prev), count, prev), min);
+    CreateBr(next_block);
+
+    SetInsertPoint(next_block);
+  }
+  CreateLifetimeEnd(row_key);
 
-  // int map_delete_elem(&map, &key)
-  // Return: 0 on success or negative error
-  FunctionType *delete_func_type = FunctionType::get(
-      getInt64Ty(), { map_ptr->getType(), key->getType() }, false);
-  PointerType *delete_func_ptr_type = PointerType::get(delete_func_type, 0);
-  Constant *delete_func = ConstantExpr::getCast(
-      Instruction::IntToPtr,
-      getInt64(libbpf::BPF_FUNC_map_delete_elem),
-      delete_func_ptr_type);
-  CallInst *call = createCall(delete_func, { map_ptr, key }, "delete_elem");
-  CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_map_delete_elem, loc);
+  BasicBlock *hot_block = BasicBlock::Create(module_.getContext(),
+                                             "cms.hot",
+                                             parent);
+  BasicBlock *track_block = BasicBlock::Create(module_.getContext(),
+                                               "cms.track",
+                                               parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "cms.done",
+                                              parent);
+  CreateCondBr(CreateICmpUGE(CreateLoad(getInt64Ty(), min),
+                             getInt64(threshold)),
+               hot_block,
+               done_block);
+
+  SetInsertPoint(hot_block);
+  CallInst *tracked = createMapLookup(createMapPtr(map), key);
+  CreateCondBr(CreateICmpEQ(tracked, null, "cms_untracked"),
+               track_block,
+               done_block);
+
+  SetInsertPoint(track_block);
+  AllocaInst *val = CreateAllocaBPF(getInt64Ty(), "cms_tracked");
+  CreateStore(getInt64(0), val);
+  CreateMapUpdateElem(ctx, map, key, val, loc);
+  CreateLifetimeEnd(val);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+  CreateLifetimeEnd(min);
+}
+
+// splitmix64 finalizer, spreads the bits of consecutive values. Keep in sync
+// with cms_hash().
+Value *IRBuilderBPF::CreateMix64(Value *val)
+{
+  Value *hash = val;
+  hash = CreateXor(hash, CreateLShr(hash, 30));
+  hash = CreateMul(hash, getInt64(0xbf58476d1ce4e5b9ULL));
+  hash = CreateXor(hash, CreateLShr(hash, 27));
+  hash = CreateMul(hash, getInt64(0x94d049bb133111ebULL));
+  hash = CreateXor(hash, CreateLShr(hash, 31));
+  return hash;
+}
+
+// FNV-1a of the string up to its terminating NUL, unrolled over the size of
+// the buffer so there are no loops for the verifier to follow
+Value *IRBuilderBPF::CreateStrHash(Value *str, size_t size)
+{
+  Value *ptr = CreatePointerCast(str, getInt8PtrTy());
+  Value *hash = getInt64(14695981039346656037ULL);
+  Value *done = getInt1(false);
+  for (size_t i = 0; i < size; i++)
+  {
+    Value *c = CreateLoad(getInt8Ty(), CreateGEP(ptr, getInt64(i)));
+    done = CreateOr(done, CreateICmpEQ(c, getInt8(0)));
+    Value *next = CreateMul(CreateXor(hash, CreateZExt(c, getInt64Ty())),
+                            getInt64(1099511628211ULL));
+    hash = CreateSelect(done, hash, next);
+  }
+  return hash;
+}
+
+void IRBuilderBPF::CreateHashedMapKey(Map &map,
+                                      Value *str,
+                                      size_t size,
+                                      Value *key)
+{
+  auto &imap = *bpftrace_.maps[map.ident].value();
+  CreateStore(CreateStrHash(str, size),
+              CreatePointerCast(key, getInt64Ty()->getPointerTo()));
+  // Fails once the string is there, or the strings map is full, in which
+  // case the key is printed as its hash
+  createMapUpdate(CreateBpfPseudoCallFd(imap.strings_mapfd_),
+                  key,
+                  CreatePointerCast(str, getInt8PtrTy()),
+                  libbpf::BPF_NOEXIST);
 }
 
 void IRBuilderBPF::CreateProbeRead(Value *ctx,
@@ -540,15 +1816,16 @@ CallInst *IRBuilderBPF::CreateProbeReadStr(Value *ctx,
 }
 
 CallInst *IRBuilderBPF::CreateProbeReadStr(Value *ctx,
-                                           AllocaInst *dst,
+                                           Value *dst,
                                            llvm::Value *size,
                                            Value *src,
                                            AddrSpace as,
                                            const location &loc)
 {
   assert(ctx && ctx->getType() == getInt8PtrTy());
-  assert(dst && dst->getAllocatedType()->isArrayTy() &&
-         dst->getAllocatedType()->getArrayElementType() == getInt8Ty());
+  assert(dst && dst->getType()->getPointerElementType()->isArrayTy() &&
+         dst->getType()->getPointerElementType()->getArrayElementType() ==
+             getInt8Ty());
   assert(size && size->getType()->isIntegerTy());
 
   auto *size_i32 = CreateIntCast(size, getInt32Ty(), false);
@@ -886,6 +2163,142 @@ Value *IRBuilderBPF::CreateStrncmp(Value *ctx,
   return result;
 }
 
+// Whether the string of val matches, following the transitions of the
+// automaton a character at a time. The loop over the characters is unrolled,
+// each of them only checking the states that can be reached by then, so that
+// a pattern without '*' costs about what strncmp() does.
+Value *IRBuilderBPF::CreateStrMatch(Value *val, const StrMatcher &matcher)
+{
+  PointerType *valp = cast<PointerType>(val->getType());
+  assert(valp->getElementType()->isArrayTy() &&
+         valp->getElementType()->getArrayElementType() == getInt8Ty());
+  size_t size = valp->getElementType()->getArrayNumElements();
+
+  if (matcher.matched(0))
+    return getInt64(1);
+
+  Function *parent = GetInsertBlock()->getParent();
+  LLVMContext &context = module_.getContext();
+  BasicBlock *str_end = BasicBlock::Create(context, "strmatch.end", parent);
+  BasicBlock *match = BasicBlock::Create(context, "strmatch.true", parent);
+  BasicBlock *no_match = BasicBlock::Create(context, "strmatch.false", parent);
+  BasicBlock *done = BasicBlock::Create(context, "strmatch.done", parent);
+  AllocaInst *result = CreateAllocaBPF(getInt1Ty(), "strmatch.result");
+  AllocaInst *state = CreateAllocaBPF(getInt32Ty(), "strmatch.state");
+  CreateStore(getInt32(0), state);
+
+  std::set<int> reachable = { 0 };
+  for (size_t i = 0; i < size && !reachable.empty(); i++)
+  {
+    auto *ptr = CreateGEP(val, { getInt32(0), getInt32(i) });
+    Value *c = CreateLoad(getInt8Ty(), ptr);
+    BasicBlock *step = BasicBlock::Create(context, "strmatch.step", parent);
+    BasicBlock *next_char = BasicBlock::Create(context,
+                                               "strmatch.next",
+                                               parent);
+    CreateCondBr(CreateICmpEQ(c, getInt8(0)), str_end, step);
+    SetInsertPoint(step);
+
+    // Blocks moving to each state of the next character
+    std::map<int, BasicBlock *> moves;
+    auto move_to = [&](int to) {
+      if (to == StrMatcher::REJECTED)
+        return no_match;
+      if (matcher.matched(to))
+        return match;
+      auto &move = moves[to];
+      if (!move)
+      {
+        auto ip = saveIP();
+        move = BasicBlock::Create(context, "strmatch.move", parent);
+        SetInsertPoint(move);
+        CreateStore(getInt32(to), state);
+        CreateBr(next_char);
+        restoreIP(ip);
+      }
+      return move;
+    };
+
+    SwitchInst *states = nullptr;
+    if (reachable.size() > 1)
+      states = CreateSwitch(CreateLoad(getInt32Ty(), state),
+                            no_match,
+                            reachable.size());
+    for (int from : reachable)
+    {
+      if (states)
+      {
+        BasicBlock *from_block = BasicBlock::Create(context,
+                                                    "strmatch.state",
+                                                    parent);
+        states->addCase(getInt32(from), from_block);
+        SetInsertPoint(from_block);
+      }
+
+      // The state most characters move to is left for last, the others are
+      // checked by ranges of characters moving to the same state
+      std::map<int, size_t> counts;
+      for (unsigned ch = 1; ch < 256; ch++)
+        counts[matcher.next(from, ch)]++;
+      int fallback = std::max_element(counts.begin(),
+                                      counts.end(),
+                                      [](auto &a, auto &b) {
+                                        return a.second < b.second;
+                                      })
+                         ->first;
+      for (unsigned lo = 1; lo < 256;)
+      {
+        int to = matcher.next(from, lo);
+        unsigned hi = lo;
+        while (hi + 1 < 256 && matcher.next(from, hi + 1) == to)
+          hi++;
+        if (to != fallback)
+        {
+          Value *in_range = lo == hi
+                                ? CreateICmpEQ(c, getInt8(lo))
+                                : CreateICmpULE(CreateSub(c, getInt8(lo)),
+                                                getInt8(hi - lo));
+          BasicBlock *other = BasicBlock::Create(context,
+                                                 "strmatch.other",
+                                                 parent);
+          CreateCondBr(in_range, move_to(to), other);
+          SetInsertPoint(other);
+        }
+        lo = hi + 1;
+      }
+      CreateBr(move_to(fallback));
+    }
+
+    reachable.clear();
+    for (auto &move : moves)
+      reachable.insert(move.first);
+    SetInsertPoint(next_char);
+  }
+  // The whole buffer was read
+  CreateBr(str_end);
+
+  SetInsertPoint(str_end);
+  Value *current = CreateLoad(getInt32Ty(), state);
+  Value *accepted = getInt1(false);
+  for (size_t s = 0; s < matcher.states(); s++)
+    if (matcher.accepting(s))
+      accepted = CreateOr(accepted, CreateICmpEQ(current, getInt32(s)));
+  CreateCondBr(accepted, match, no_match);
+
+  SetInsertPoint(match);
+  CreateStore(getInt1(true), result);
+  CreateBr(done);
+  SetInsertPoint(no_match);
+  CreateStore(getInt1(false), result);
+  CreateBr(done);
+
+  SetInsertPoint(done);
+  Value *matched = CreateLoad(result);
+  CreateLifetimeEnd(result);
+  CreateLifetimeEnd(state);
+  return CreateIntCast(matched, getInt64Ty(), false);
+}
+
 CallInst *IRBuilderBPF::CreateGetNs(bool boot_time)
 {
   // u64 ktime_get_ns()
@@ -929,6 +2342,22 @@ CallInst *IRBuilderBPF::CreateGetCurrentCgroupId()
   return createCall(getcgroupid_func, {}, "get_cgroup_id");
 }
 
+CallInst *IRBuilderBPF::CreateGetAttachCookie(Value *ctx)
+{
+  // u64 bpf_get_attach_cookie(void *ctx)
+  // Return: Value specified by user at BPF link creation/attachment time
+  FunctionType *getcookie_func_type = FunctionType::get(getInt64Ty(),
+                                                        { getInt8PtrTy() },
+                                                        false);
+  PointerType *getcookie_func_ptr_type = PointerType::get(getcookie_func_type,
+                                                          0);
+  Constant *getcookie_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_get_attach_cookie),
+      getcookie_func_ptr_type);
+  return createCall(getcookie_func, { ctx }, "get_attach_cookie");
+}
+
 CallInst *IRBuilderBPF::CreateGetUidGid()
 {
   // u64 bpf_get_current_uid_gid(void)
@@ -968,6 +2397,19 @@ CallInst *IRBuilderBPF::CreateGetCurrentTask()
   return createCall(getcurtask_func, {}, "get_cur_task");
 }
 
+CallInst *IRBuilderBPF::CreateGetCurrentTaskBtf()
+{
+  // struct task_struct *bpf_get_current_task_btf(void)
+  // Return: current task_struct, typed by BTF for the helpers taking it
+  FunctionType *getcurtask_func_type = FunctionType::get(getInt64Ty(), false);
+  PointerType *getcurtask_func_ptr_type = PointerType::get(getcurtask_func_type, 0);
+  Constant *getcurtask_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_get_current_task_btf),
+      getcurtask_func_ptr_type);
+  return createCall(getcurtask_func, {}, "get_cur_task_btf");
+}
+
 CallInst *IRBuilderBPF::CreateGetRandom()
 {
   // u64 bpf_get_prandom_u32(void)
@@ -994,6 +2436,9 @@ CallInst *IRBuilderBPF::CreateGetStackId(Value *ctx,
   int flags = 0;
   if (ustack)
     flags |= (1<<8);
+  // BPF_F_USER_BUILD_ID, for the stack maps created with BPF_F_STACK_BUILD_ID
+  if (stack_type.mode == bpftrace::StackMode::build_id)
+    flags |= (1 << 11);
   Value *flags_val = getInt64(flags);
 
   // int bpf_get_stackid(struct pt_regs *ctx, struct bpf_map *map, u64 flags)
@@ -1014,6 +2459,78 @@ CallInst *IRBuilderBPF::CreateGetStackId(Value *ctx,
   return call;
 }
 
+void IRBuilderBPF::CreateDwarfStack(Value *ctx, Value *dst, int align)
+{
+  assert(ctx && ctx->getType() == getInt8PtrTy());
+  Value *stack = CreatePointerCast(dst, getInt8PtrTy());
+  auto field = [&](size_t offset) {
+    return CreatePointerCast(CreateGEP(stack, getInt64(offset)),
+                             getInt64Ty()->getPointerTo());
+  };
+
+  CREATE_ALIGNED_STORE(CreateLShr(CreateGetPidTgid(), 32),
+                       field(offsetof(DwarfStack, pid)),
+                       align);
+  Value *regs = CreatePointerCast(ctx, getInt64Ty()->getPointerTo());
+  auto reg = [&](int offset, const std::string &name) {
+    // Volatile for the same reason as the loads of the argX builtins
+    LoadInst *load = CreateLoad(getInt64Ty(),
+                                CreateGEP(regs, getInt64(offset)),
+                                name);
+    load->setVolatile(true);
+    return load;
+  };
+  Value *sp = reg(arch::sp_offset(), "reg_sp");
+  CREATE_ALIGNED_STORE(reg(arch::pc_offset(), "reg_ip"),
+                       field(offsetof(DwarfStack, ip)),
+                       align);
+  CREATE_ALIGNED_STORE(sp, field(offsetof(DwarfStack, sp)), align);
+  CREATE_ALIGNED_STORE(reg(arch::offset("bp"), "reg_bp"),
+                       field(offsetof(DwarfStack, bp)),
+                       align);
+
+  // The read fails as a whole when the stack is shorter than the copy, the
+  // rest of the page sp is in is read then. Neither failure is an error,
+  // userspace unwinds what it got.
+  auto read_fn = selectProbeReadHelper(AddrSpace::user, false);
+  Value *data = CreateGEP(stack, getInt64(offsetof(DwarfStack, data)));
+  FunctionType *proberead_func_type = FunctionType::get(
+      getInt64Ty(), { getInt8PtrTy(), getInt32Ty(), getInt64Ty() }, false);
+  Constant *proberead_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(read_fn),
+      PointerType::get(proberead_func_type, 0));
+  Value *size_ptr = field(offsetof(DwarfStack, size));
+  CallInst *call = createCall(proberead_func,
+                              { data, getInt32(DWARF_STACK_SIZE), sp },
+                              probeReadHelperName(read_fn));
+  CREATE_ALIGNED_STORE(getInt64(DWARF_STACK_SIZE), size_ptr, align);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *page_block = BasicBlock::Create(module_.getContext(),
+                                              "dwarf_stack_page",
+                                              parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "dwarf_stack_done",
+                                              parent);
+  CreateCondBr(CreateICmpEQ(call, getInt64(0)), done_block, page_block);
+
+  SetInsertPoint(page_block);
+  Value *page_size = CreateSub(getInt64(4096),
+                               CreateAnd(sp, getInt64(4095)),
+                               "page_size");
+  call = createCall(proberead_func,
+                    { data, CreateTrunc(page_size, getInt32Ty()), sp },
+                    probeReadHelperName(read_fn));
+  CREATE_ALIGNED_STORE(
+      CreateSelect(CreateICmpEQ(call, getInt64(0)), page_size, getInt64(0)),
+      size_ptr,
+      align);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+}
+
 void IRBuilderBPF::CreateGetCurrentComm(Value *ctx,
                                         AllocaInst *buf,
                                         size_t size,
@@ -1039,16 +2556,59 @@ void IRBuilderBPF::CreateGetCurrentComm(Value *ctx,
   CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_get_current_comm, loc);
 }
 
-void IRBuilderBPF::CreatePerfEventOutput(Value *ctx, Value *data, size_t size)
+void IRBuilderBPF::CreatePerfEventOutput(Value *ctx,
+                                         Value *data,
+                                         size_t size,
+                                         bool control)
+{
+  CreatePerfEventOutput(ctx, data, getInt64(size), control);
+}
+
+void IRBuilderBPF::CreatePerfEventOutput(Value *ctx,
+                                         Value *data,
+                                         Value *size,
+                                         bool control)
 {
   assert(ctx && ctx->getType() == getInt8PtrTy());
   assert(data && data->getType()->isPointerTy());
+  assert(size && size->getType() == getInt64Ty());
+
+  if (control && bpftrace_.maps.Has(MapManager::Type::Control))
+  {
+    CallInst *ret = createRingbufCall(
+        bpftrace_.maps[MapManager::Type::Control].value()->mapfd_, data, size);
+
+    // A full control buffer isn't a lost event, the action is sent with the
+    // others instead
+    Function *parent = GetInsertBlock()->getParent();
+    BasicBlock *full_block = BasicBlock::Create(module_.getContext(),
+                                                "control_full",
+                                                parent);
+    BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                                 "control_merge",
+                                                 parent);
+    CreateCondBr(CreateICmpSLT(ret, getInt64(0), "control_ret"),
+                 full_block,
+                 merge_block);
+
+    SetInsertPoint(full_block);
+    CreatePerfEventOutput(ctx, data, size);
+    CreateBr(merge_block);
+
+    SetInsertPoint(merge_block);
+    return;
+  }
+
+  if (bpftrace_.maps.Has(MapManager::Type::Ringbuf))
+  {
+    createRingbufOutput(data, size);
+    return;
+  }
 
   Value *map_ptr = CreateBpfPseudoCallFd(
       bpftrace_.maps[MapManager::Type::PerfEvent].value()->mapfd_);
 
   Value *flags_val = getInt64(BPF_F_CURRENT_CPU);
-  Value *size_val = getInt64(size);
 
   // int bpf_perf_event_output(struct pt_regs *ctx, struct bpf_map *map,
   //                           u64 flags, void *data, u64 size)
@@ -1066,10 +2626,425 @@ void IRBuilderBPF::CreatePerfEventOutput(Value *ctx, Value *data, size_t size)
       getInt64(libbpf::BPF_FUNC_perf_event_output),
       perfoutput_func_ptr_type);
   createCall(perfoutput_func,
-             { ctx, map_ptr, flags_val, data, size_val },
+             { ctx, map_ptr, flags_val, data, size },
              "perf_event_output");
 }
 
+void IRBuilderBPF::createRingbufOutput(Value *data, Value *size)
+{
+  CallInst *ret = createRingbufCall(
+      bpftrace_.maps[MapManager::Type::Ringbuf].value()->mapfd_, data, size);
+
+  // The kernel doesn't keep track of records that didn't fit into the ring
+  // buffer, so count them in a map that userspace reports as lost events.
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *loss_block = BasicBlock::Create(module_.getContext(),
+                                              "event_loss_counter",
+                                              parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                               "counter_merge",
+                                               parent);
+  CreateCondBr(CreateICmpSLT(ret, getInt64(0), "ringbuf_loss"),
+               loss_block,
+               merge_block);
+
+  SetInsertPoint(loss_block);
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "key");
+  CreateStore(getInt32(0), key);
+  CallInst *lookup = createMapLookup(
+      bpftrace_.maps[MapManager::Type::RingbufLoss].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
+                                                        "lookup_success",
+                                                        parent);
+  Value *condition = CreateICmpNE(
+      lookup,
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "map_lookup_cond");
+  CreateCondBr(condition, lookup_success_block, merge_block);
+
+  SetInsertPoint(lookup_success_block);
+  CREATE_ATOMIC_RMW(AtomicRMWInst::BinOp::Add,
+                    CreatePointerCast(lookup, getInt64Ty()->getPointerTo()),
+                    getInt64(1),
+                    8,
+                    AtomicOrdering::SequentiallyConsistent);
+  CreateBr(merge_block);
+
+  SetInsertPoint(merge_block);
+}
+
+// A batch holds at least 4 events. Each is preceded by its size and padded
+// to 8 bytes.
+bool IRBuilderBPF::IsBatchable(size_t size)
+{
+  size_t cap = bpftrace_.event_batch_;
+  return size <= BATCHED_EVENT_MAX &&
+         sizeof(uint64_t) + ((size + 7) & ~7UL) <= cap / 4;
+}
+
+// The batch of a CPU is the value of the EventBatch map: the bytes in use,
+// the AsyncAction::batch id the batch is sent with, then the events. The
+// bytes in use stay below the size of the batch, the events take up to twice
+// as much room so that the masked offsets and sizes the verifier wants stay
+// in bounds.
+void IRBuilderBPF::CreateBatchedOutput(Value *ctx, Value *data, size_t size)
+{
+  uint64_t cap = bpftrace_.event_batch_;
+  uint64_t record = sizeof(uint64_t) + ((size + 7) & ~7UL);
+
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "key");
+  CreateStore(getInt32(0), key);
+  CallInst *batch = createMapLookup(
+      bpftrace_.maps[MapManager::Type::EventBatch].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *found_block = BasicBlock::Create(module_.getContext(),
+                                               "batch_found",
+                                               parent);
+  BasicBlock *missing_block = BasicBlock::Create(module_.getContext(),
+                                                 "batch_missing",
+                                                 parent);
+  BasicBlock *flush_block = BasicBlock::Create(module_.getContext(),
+                                               "batch_flush",
+                                               parent);
+  BasicBlock *append_block = BasicBlock::Create(module_.getContext(),
+                                                "batch_append",
+                                                parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "batch_done",
+                                              parent);
+  CreateCondBr(CreateICmpNE(batch,
+                            ConstantExpr::getCast(Instruction::IntToPtr,
+                                                  getInt64(0),
+                                                  getInt8PtrTy()),
+                            "batch_cond"),
+               found_block,
+               missing_block);
+
+  SetInsertPoint(missing_block);
+  CreatePerfEventOutput(ctx, data, size);
+  CreateBr(done_block);
+
+  SetInsertPoint(found_block);
+  Value *used_ptr = CreatePointerCast(batch, getInt64Ty()->getPointerTo());
+  Value *used = CreateLoad(getInt64Ty(), used_ptr, "batch_used");
+  CreateCondBr(CreateICmpUGT(used, getInt64(cap - record), "batch_full"),
+               flush_block,
+               append_block);
+
+  SetInsertPoint(flush_block);
+  createBatchFlush(ctx, batch, used);
+  CreateBr(append_block);
+
+  SetInsertPoint(append_block);
+  used = CreateLoad(getInt64Ty(), used_ptr, "batch_used");
+  Value *offset = CreateAdd(CreateAnd(used, getInt64(cap - 1)),
+                            getInt64(2 * sizeof(uint64_t)));
+  Value *entry = CreateGEP(batch, offset);
+  CreateStore(getInt64(size),
+              CreatePointerCast(entry, getInt64Ty()->getPointerTo()));
+  CREATE_MEMCPY(CreateGEP(entry, getInt64(sizeof(uint64_t))), data, size, 8);
+  CreateStore(CreateAdd(used, getInt64(record)), used_ptr);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+}
+
+// The event is compared with the copy of the last one 8 bytes at a time,
+// both start 8 bytes aligned. When they're the same and the copy was sent
+// less than BPFTRACE_DEDUPE_MS ago the event is only counted, otherwise the
+// count of the copy is sent ahead of it and it becomes the copy.
+BasicBlock *IRBuilderBPF::CreateDedupe(Value *ctx,
+                                       Value *data,
+                                       Value *size,
+                                       size_t max_size)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "key");
+  CreateStore(getInt32(0), key);
+  CallInst *last = createMapLookup(
+      bpftrace_.maps[MapManager::Type::Dedupe].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *found_block = BasicBlock::Create(module_.getContext(),
+                                               "dedupe_found",
+                                               parent);
+  BasicBlock *repeat_block = BasicBlock::Create(module_.getContext(),
+                                                "dedupe_repeat",
+                                                parent);
+  BasicBlock *change_block = BasicBlock::Create(module_.getContext(),
+                                                "dedupe_change",
+                                                parent);
+  BasicBlock *count_block = BasicBlock::Create(module_.getContext(),
+                                               "dedupe_count",
+                                               parent);
+  BasicBlock *copy_block = BasicBlock::Create(module_.getContext(),
+                                              "dedupe_copy",
+                                              parent);
+  BasicBlock *send_block = BasicBlock::Create(module_.getContext(),
+                                              "dedupe_send",
+                                              parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "dedupe_done",
+                                              parent);
+  CreateCondBr(CreateICmpNE(last,
+                            ConstantExpr::getCast(Instruction::IntToPtr,
+                                                  getInt64(0),
+                                                  getInt8PtrTy()),
+                            "dedupe_cond"),
+               found_block,
+               send_block);
+
+  SetInsertPoint(found_block);
+  PointerType *u64_ptr = getInt64Ty()->getPointerTo();
+  Value *sent_ptr = CreatePointerCast(last, u64_ptr);
+  Value *count_ptr = CreatePointerCast(CreateGEP(last, getInt64(8)), u64_ptr);
+  Value *size_ptr = CreatePointerCast(CreateGEP(last, getInt64(16)), u64_ptr);
+  Value *copy = CreateGEP(last, getInt64(3 * sizeof(uint64_t)));
+  Value *bytes = CreatePointerCast(data, getInt8PtrTy());
+  Value *now = CreateGetNs(false);
+  Value *same = CreateICmpULT(
+      CreateSub(now, CreateLoad(getInt64Ty(), sent_ptr)),
+      getInt64(bpftrace_.dedupe_ms_ * 1000000ULL));
+  same = CreateAnd(same,
+                   CreateICmpEQ(CreateLoad(getInt64Ty(), size_ptr), size));
+  size_t offset = 0;
+  for (; offset + sizeof(uint64_t) <= max_size; offset += sizeof(uint64_t))
+  {
+    Value *a = CreateLoad(getInt64Ty(),
+                          CreatePointerCast(CreateGEP(bytes, getInt64(offset)),
+                                            u64_ptr));
+    Value *b = CreateLoad(getInt64Ty(),
+                          CreatePointerCast(CreateGEP(copy, getInt64(offset)),
+                                            u64_ptr));
+    same = CreateAnd(same, CreateICmpEQ(a, b));
+  }
+  for (; offset < max_size; offset++)
+  {
+    Value *a = CreateLoad(getInt8Ty(), CreateGEP(bytes, getInt64(offset)));
+    Value *b = CreateLoad(getInt8Ty(), CreateGEP(copy, getInt64(offset)));
+    same = CreateAnd(same, CreateICmpEQ(a, b));
+  }
+  CreateCondBr(same, repeat_block, change_block);
+
+  SetInsertPoint(repeat_block);
+  CreateStore(CreateAdd(CreateLoad(getInt64Ty(), count_ptr), getInt64(1)),
+              count_ptr);
+  CreateBr(done_block);
+
+  SetInsertPoint(change_block);
+  Value *count = CreateLoad(getInt64Ty(), count_ptr, "dedupe_count");
+  CreateCondBr(CreateICmpNE(count, getInt64(0)), count_block, copy_block);
+
+  SetInsertPoint(count_block);
+  createRepeatedOutput(ctx, count);
+  CreateBr(copy_block);
+
+  SetInsertPoint(copy_block);
+  CreateStore(now, sent_ptr);
+  CreateStore(getInt64(0), count_ptr);
+  CreateStore(size, size_ptr);
+  CREATE_MEMCPY(copy, bytes, max_size, 8);
+  CreateBr(send_block);
+
+  SetInsertPoint(send_block);
+  return done_block;
+}
+
+// Sent the way the printf() events are, after the one it counts the repeats
+// of
+void IRBuilderBPF::createRepeatedOutput(Value *ctx, Value *count)
+{
+  auto elements = AsyncEvent::Repeated().asLLVMType(*this);
+  StructType *repeated_struct = GetStructType("repeated_t", elements, true);
+  AllocaInst *buf = CreateAllocaBPF(repeated_struct, "repeated_t");
+  CreateStore(getInt64(asyncactionint(AsyncAction::repeated)),
+              CreateGEP(buf, { getInt64(0), getInt32(0) }));
+  CreateStore(count, CreateGEP(buf, { getInt64(0), getInt32(1) }));
+  size_t size = sizeof(AsyncEvent::Repeated);
+  if (bpftrace_.maps.Has(MapManager::Type::EventBatch) && IsBatchable(size))
+    CreateBatchedOutput(ctx, buf, size);
+  else
+    CreatePerfEventOutput(ctx, buf, size);
+  CreateLifetimeEnd(buf);
+}
+
+// Sends the repeats counted since the last event of this CPU was sent
+void IRBuilderBPF::createDedupeFlush(Value *ctx)
+{
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "key");
+  CreateStore(getInt32(0), key);
+  CallInst *last = createMapLookup(
+      bpftrace_.maps[MapManager::Type::Dedupe].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *found_block = BasicBlock::Create(module_.getContext(),
+                                               "dedupe_found",
+                                               parent);
+  BasicBlock *count_block = BasicBlock::Create(module_.getContext(),
+                                               "dedupe_count",
+                                               parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "dedupe_done",
+                                              parent);
+  CreateCondBr(CreateICmpNE(last,
+                            ConstantExpr::getCast(Instruction::IntToPtr,
+                                                  getInt64(0),
+                                                  getInt8PtrTy()),
+                            "dedupe_cond"),
+               found_block,
+               done_block);
+
+  SetInsertPoint(found_block);
+  Value *count_ptr = CreatePointerCast(CreateGEP(last, getInt64(8)),
+                                       getInt64Ty()->getPointerTo());
+  Value *count = CreateLoad(getInt64Ty(), count_ptr, "dedupe_count");
+  CreateCondBr(CreateICmpNE(count, getInt64(0)), count_block, done_block);
+
+  SetInsertPoint(count_block);
+  createRepeatedOutput(ctx, count);
+  CreateStore(getInt64(0), count_ptr);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+}
+
+// Sends the batch of this CPU, if it holds any event, after the repeats
+// counted by BPFTRACE_DEDUPE_MS
+void IRBuilderBPF::CreateFlushEvents(Value *ctx)
+{
+  if (bpftrace_.maps.Has(MapManager::Type::Dedupe))
+    createDedupeFlush(ctx);
+  if (!bpftrace_.maps.Has(MapManager::Type::EventBatch))
+    return;
+
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "key");
+  CreateStore(getInt32(0), key);
+  CallInst *batch = createMapLookup(
+      bpftrace_.maps[MapManager::Type::EventBatch].value()->mapfd_, key);
+  CreateLifetimeEnd(key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *found_block = BasicBlock::Create(module_.getContext(),
+                                               "batch_found",
+                                               parent);
+  BasicBlock *flush_block = BasicBlock::Create(module_.getContext(),
+                                               "batch_flush",
+                                               parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "batch_done",
+                                              parent);
+  CreateCondBr(CreateICmpNE(batch,
+                            ConstantExpr::getCast(Instruction::IntToPtr,
+                                                  getInt64(0),
+                                                  getInt8PtrTy()),
+                            "batch_cond"),
+               found_block,
+               done_block);
+
+  SetInsertPoint(found_block);
+  Value *used = CreateLoad(getInt64Ty(),
+                           CreatePointerCast(batch,
+                                             getInt64Ty()->getPointerTo()),
+                           "batch_used");
+  CreateCondBr(CreateICmpNE(used, getInt64(0), "batch_empty"),
+               flush_block,
+               done_block);
+
+  SetInsertPoint(flush_block);
+  createBatchFlush(ctx, batch, used);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+}
+
+// The head counts the events recorded, the slot of the next one is the head
+// modulo the slots. It's moved on before the slot is written.
+void IRBuilderBPF::CreateFlightRecord(Value *data, Value *size, size_t max_size)
+{
+  uint64_t slots = bpftrace_.flight_recorder_events_;
+  int mapfd = bpftrace_.maps[MapManager::Type::FlightRecorder].value()->mapfd_;
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "key");
+  CreateStore(getInt32(0), key);
+  CallInst *head = createMapLookup(mapfd, key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *head_block = BasicBlock::Create(module_.getContext(),
+                                              "flight_head",
+                                              parent);
+  BasicBlock *slot_block = BasicBlock::Create(module_.getContext(),
+                                              "flight_slot",
+                                              parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "flight_done",
+                                              parent);
+  Value *null = ConstantExpr::getCast(Instruction::IntToPtr,
+                                      getInt64(0),
+                                      getInt8PtrTy());
+  CreateCondBr(CreateICmpNE(head, null, "flight_cond"), head_block, done_block);
+
+  SetInsertPoint(head_block);
+  Value *head_ptr = CreatePointerCast(head, getInt64Ty()->getPointerTo());
+  Value *count = CreateLoad(getInt64Ty(), head_ptr, "flight_count");
+  CreateStore(CreateAdd(count, getInt64(1)), head_ptr);
+  Value *index = CreateAdd(CreateAnd(count, getInt64(slots - 1)), getInt64(1));
+  CreateStore(CreateTrunc(index, getInt32Ty()), key);
+  CallInst *slot = createMapLookup(mapfd, key);
+  CreateCondBr(CreateICmpNE(slot, null, "flight_cond"), slot_block, done_block);
+
+  SetInsertPoint(slot_block);
+  CreateStore(CreateGetNs(false),
+              CreatePointerCast(slot, getInt64Ty()->getPointerTo()));
+  CreateStore(size,
+              CreatePointerCast(CreateGEP(slot, getInt64(sizeof(uint64_t))),
+                                getInt64Ty()->getPointerTo()));
+  CREATE_MEMCPY(
+      CreateGEP(slot, getInt64(2 * sizeof(uint64_t))), data, max_size, 8);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+  CreateLifetimeEnd(key);
+}
+
+void IRBuilderBPF::createBatchFlush(Value *ctx, Value *batch, Value *used)
+{
+  uint64_t cap = bpftrace_.event_batch_;
+  Value *start = CreateGEP(batch, getInt64(sizeof(uint64_t)));
+  CreateStore(getInt64(asyncactionint(AsyncAction::batch)),
+              CreatePointerCast(start, getInt64Ty()->getPointerTo()));
+  Value *size = CreateAdd(CreateAnd(used, getInt64(2 * cap - 1)),
+                          getInt64(sizeof(uint64_t)),
+                          "batch_size");
+  CreatePerfEventOutput(ctx, start, size);
+  CreateStore(getInt64(0),
+              CreatePointerCast(batch, getInt64Ty()->getPointerTo()));
+}
+
+CallInst *IRBuilderBPF::createRingbufCall(int mapfd, Value *data, Value *size)
+{
+  Value *map_ptr = CreateBpfPseudoCallFd(mapfd);
+
+  // long bpf_ringbuf_output(void *ringbuf, void *data, u64 size, u64 flags)
+  FunctionType *ringbuf_output_func_type = FunctionType::get(
+      getInt64Ty(),
+      { map_ptr->getType(), data->getType(), getInt64Ty(), getInt64Ty() },
+      false);
+
+  PointerType *ringbuf_output_func_ptr_type = PointerType::get(
+      ringbuf_output_func_type, 0);
+  Constant *ringbuf_output_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_ringbuf_output),
+      ringbuf_output_func_ptr_type);
+  return createCall(ringbuf_output_func,
+                    { map_ptr, data, size, getInt64(0) },
+                    "ringbuf_output");
+}
+
 void IRBuilderBPF::CreateSignal(Value *ctx, Value *sig, const location &loc)
 {
   // int bpf_send_signal(u32 sig)
@@ -1087,6 +3062,55 @@ void IRBuilderBPF::CreateSignal(Value *ctx, Value *sig, const location &loc)
   CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_send_signal, loc);
 }
 
+void IRBuilderBPF::CreateTailCall(Value *ctx, int slot)
+{
+  // long bpf_tail_call(void *ctx, struct bpf_map *prog_array_map, u32 index)
+  // Return: doesn't return on success, a negative error otherwise
+  Value *map_ptr = CreateBpfPseudoCallFd(
+      bpftrace_.maps[MapManager::Type::TailCalls].value()->mapfd_);
+  FunctionType *tail_call_func_type = FunctionType::get(
+      getInt64Ty(),
+      { getInt8PtrTy(), map_ptr->getType(), getInt32Ty() },
+      false);
+  PointerType *tail_call_func_ptr_type = PointerType::get(tail_call_func_type,
+                                                          0);
+  Constant *tail_call_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_tail_call),
+      tail_call_func_ptr_type);
+  createCall(tail_call_func, { ctx, map_ptr, getInt32(slot) }, "tail_call");
+}
+
+CallInst *IRBuilderBPF::CreateForEachMapElem(Value *ctx,
+                                             Map &map,
+                                             Function *callback,
+                                             Value *callback_ctx,
+                                             const location &loc)
+{
+  // long bpf_for_each_map_elem(struct bpf_map *map, void *callback_fn,
+  //                            void *callback_ctx, u64 flags)
+  // Return: the number of entries the callback ran on, or a negative error
+  Value *map_ptr = createMapPtr(map);
+  FunctionType *for_each_func_type = FunctionType::get(
+      getInt64Ty(),
+      { map_ptr->getType(),
+        callback->getType(),
+        callback_ctx->getType(),
+        getInt64Ty() },
+      false);
+  PointerType *for_each_func_ptr_type = PointerType::get(for_each_func_type,
+                                                         0);
+  Constant *for_each_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(libbpf::BPF_FUNC_for_each_map_elem),
+      for_each_func_ptr_type);
+  CallInst *call = createCall(for_each_func,
+                              { map_ptr, callback, callback_ctx, getInt64(0) },
+                              "for_each_map_elem");
+  CreateHelperErrorCond(ctx, call, libbpf::BPF_FUNC_for_each_map_elem, loc);
+  return call;
+}
+
 void IRBuilderBPF::CreateOverrideReturn(Value *ctx, Value *rc)
 {
   // int bpf_override_return(struct pt_regs *regs, u64 rc)
@@ -1154,6 +3178,12 @@ void IRBuilderBPF::CreateHelperError(Value *ctx,
   int error_id = helper_error_id_++;
   bpftrace_.helper_error_info_[error_id] = { .func_id = func_id, .loc = loc };
 
+  if (bpftrace_.maps.Has(MapManager::Type::HelperErrors))
+  {
+    createHelperErrorCount(error_id, return_value);
+    return;
+  }
+
   auto elements = AsyncEvent::HelperError().asLLVMType(*this);
   StructType *helper_error_struct = GetStructType("helper_error_t",
                                                   elements,
@@ -1172,6 +3202,56 @@ void IRBuilderBPF::CreateHelperError(Value *ctx,
   CreateLifetimeEnd(buf);
 }
 
+// Counts the failure in the HelperErrors map rather than sending an event
+// for each, userspace reports the counts every second. The map helpers are
+// called without checking them, they would count their own failures.
+void IRBuilderBPF::createHelperErrorCount(int error_id, Value *return_value)
+{
+  int mapfd = bpftrace_.maps[MapManager::Type::HelperErrors].value()->mapfd_;
+  StructType *key_struct = GetStructType("helper_error_key",
+                                         { getInt32Ty(), getInt32Ty() },
+                                         false);
+  AllocaInst *key = CreateAllocaBPF(key_struct, "helper_error_key");
+  CreateStore(getInt32(error_id), CreateGEP(key, { getInt64(0), getInt32(0) }));
+  CreateStore(return_value, CreateGEP(key, { getInt64(0), getInt32(1) }));
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *found_block = BasicBlock::Create(module_.getContext(),
+                                               "helper_error_found",
+                                               parent);
+  BasicBlock *missing_block = BasicBlock::Create(module_.getContext(),
+                                                 "helper_error_missing",
+                                                 parent);
+  BasicBlock *done_block = BasicBlock::Create(module_.getContext(),
+                                              "helper_error_done",
+                                              parent);
+  CallInst *count = createMapLookup(mapfd, key);
+  CreateCondBr(CreateICmpNE(count,
+                            ConstantExpr::getCast(Instruction::IntToPtr,
+                                                  getInt64(0),
+                                                  getInt8PtrTy()),
+                            "helper_error_cond"),
+               found_block,
+               missing_block);
+
+  // The map is per-CPU, the count isn't updated concurrently
+  SetInsertPoint(found_block);
+  Value *count_ptr = CreatePointerCast(count, getInt64Ty()->getPointerTo());
+  CreateStore(CreateAdd(CreateLoad(getInt64Ty(), count_ptr), getInt64(1)),
+              count_ptr);
+  CreateBr(done_block);
+
+  SetInsertPoint(missing_block);
+  AllocaInst *one = CreateAllocaBPF(getInt64Ty(), "helper_error_count");
+  CreateStore(getInt64(1), one);
+  createMapUpdate(CreateBpfPseudoCallFd(mapfd), key, one, libbpf::BPF_NOEXIST);
+  CreateLifetimeEnd(one);
+  CreateBr(done_block);
+
+  SetInsertPoint(done_block);
+  CreateLifetimeEnd(key);
+}
+
 // Report error if a return value < 0 (or return value == 0 if compare_zero is
 // true)
 void IRBuilderBPF::CreateHelperErrorCond(Value *ctx,
@@ -1231,7 +3311,7 @@ void IRBuilderBPF::CreatePath(Value *ctx,
 void IRBuilderBPF::CreateSeqPrintf(Value *ctx,
                                    Value *fmt,
                                    Value *fmt_size,
-                                   AllocaInst *data,
+                                   Value *data,
                                    Value *data_len,
                                    const location &loc)
 {
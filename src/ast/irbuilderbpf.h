@@ -2,8 +2,10 @@
 
 #include "ast.h"
 #include "bpftrace.h"
+#include "str_match.h"
 #include "types.h"
 #include <bcc/bcc_usdt.h>
+#include <functional>
 
 #include <llvm/Config/llvm-config.h>
 #include <llvm/IR/IRBuilder.h>
@@ -35,6 +37,22 @@
   CreateMemSet((ptr), (val), (size), (align))
 #endif
 
+#if LLVM_VERSION_MAJOR >= 10
+#define CREATE_ALIGNED_STORE(val, ptr, align)                                  \
+  CreateAlignedStore((val), (ptr), MaybeAlign((align)))
+#else
+#define CREATE_ALIGNED_STORE(val, ptr, align)                                  \
+  CreateAlignedStore((val), (ptr), (align))
+#endif
+
+#if LLVM_VERSION_MAJOR >= 13
+#define CREATE_ATOMIC_RMW(op, ptr, val, align, order)                          \
+  CreateAtomicRMW((op), (ptr), (val), MaybeAlign((align)), (order))
+#else
+#define CREATE_ATOMIC_RMW(op, ptr, val, align, order)                          \
+  CreateAtomicRMW((op), (ptr), (val), (order))
+#endif
+
 namespace bpftrace {
 namespace ast {
 
@@ -51,31 +69,97 @@ public:
   AllocaInst *CreateAllocaBPF(llvm::Type *ty, llvm::Value *arraysize, const std::string &name="");
   AllocaInst *CreateAllocaBPF(const SizedType &stype, llvm::Value *arraysize, const std::string &name="");
   AllocaInst *CreateAllocaBPF(int bytes, const std::string &name="");
+  // Room for a temporary of type ty, in the scratch map if it's larger than
+  // SCRATCH_THRESHOLD and the probe has room left there, on the stack
+  // otherwise. Scratch slices aren't zeroed.
+  Value *CreateScratchBPF(llvm::Type *ty, const std::string &name = "");
+  Value *CreateScratchBPF(const SizedType &stype, const std::string &name = "");
+  Value *CreateScratchBPF(int bytes, const std::string &name = "");
+  // Looks up the scratch map at the start of a probe which needs it, see
+  // Probe::need_scratch
+  void CreateScratchInit(bool keep_offset = false);
+  void ClearScratch();
+  // Callbacks can't use the scratch pointer of the probe calling them: the
+  // callback looks the map up again, keeping the offset so that its slices
+  // follow the caller's
+  Value *SuspendScratch();
+  void ResumeScratch(Value *scratch);
+  // Scratch slices are never reused within a probe, their lifetime isn't
+  // ended
+  CallInst *CreateLifetimeEnd(Value *ptr, ConstantInt *size = nullptr);
   llvm::Type *GetType(const SizedType &stype);
   llvm::ConstantInt *GetIntSameSize(uint64_t C, llvm::Value *expr);
   llvm::ConstantInt *GetIntSameSize(uint64_t C, llvm::Type *ty);
   CallInst *CreateBpfPseudoCallFd(int mapfd);
-  CallInst *CreateBpfPseudoCallFd(Map &map);
   CallInst *CreateBpfPseudoCallValue(int mapfd);
   CallInst *CreateBpfPseudoCallValue(Map &map);
+  // Offset of the field of bpftrace_.field_relocs_[reloc]
+  CallInst *CreateBpfPseudoCallFieldOffset(int reloc);
+  // Probe builtin of the match the program is loaded for
+  CallInst *CreateBpfPseudoCallProbeId();
   Value *CreateMapLookupElem(Value *ctx,
                              Map &map,
-                             AllocaInst *key,
+                             Value *key,
                              const location &loc);
   Value *CreateMapLookupElem(Value *ctx,
                              int mapfd,
-                             AllocaInst *key,
+                             Value *key,
                              SizedType &type,
                              const location &loc);
   void CreateMapUpdateElem(Value *ctx,
                            Map &map,
-                           AllocaInst *key,
+                           Value *key,
                            Value *val,
                            const location &loc);
   void CreateMapDeleteElem(Value *ctx,
                            Map &map,
-                           AllocaInst *key,
+                           Value *key,
                            const location &loc);
+  void CreateMapAtomicAdd(Value *ctx,
+                          Map &map,
+                          Value *key,
+                          Value *val,
+                          const location &loc);
+  // Update the 64 bit value of key in place, to update(value). A new key
+  // is inserted with init instead.
+  void CreateMapUpdateInPlace(Value *ctx,
+                              Map &map,
+                              Value *key,
+                              Value *init,
+                              const std::function<Value *(Value *)> &update,
+                              const location &loc);
+  // The same for a value made of several 64 bit fields, e.g. the count and
+  // total of avg()
+  void CreateMapUpdateInPlace(
+      Value *ctx,
+      Map &map,
+      Value *key,
+      const std::vector<Value *> &init,
+      const std::function<std::vector<Value *>(std::vector<Value *>)> &update,
+      const location &loc);
+  // Count 1 in the bucket of key's bucket array, see IMap::bucket_array_
+  void CreateBucketArrayAdd(Value *ctx,
+                            Map &map,
+                            Value *key,
+                            Value *bucket,
+                            uint32_t buckets,
+                            const location &loc);
+  void CreateDistinctUpdate(Value *ctx,
+                            Map &map,
+                            Value *key,
+                            Value *val,
+                            const location &loc);
+  void CreateCmsUpdate(Value *ctx,
+                       Map &map,
+                       Value *key,
+                       Value *hash,
+                       uint64_t threshold,
+                       const location &loc);
+  Value *CreateMix64(Value *val);
+  Value *CreateStrHash(Value *str, size_t size);
+  // Store the hash of str in the 64 bit key, recording str in the strings
+  // map of the map if it isn't there yet, see IMap::hashed_key_
+  void CreateHashedMapKey(Map &map, Value *str, size_t size, Value *key);
   void CreateProbeRead(Value *ctx,
                        Value *dst,
                        size_t size,
@@ -89,7 +173,7 @@ public:
                        AddrSpace as,
                        const location &loc);
   CallInst *CreateProbeReadStr(Value *ctx,
-                               AllocaInst *dst,
+                               Value *dst,
                                llvm::Value *size,
                                Value *src,
                                AddrSpace as,
@@ -142,20 +226,54 @@ public:
                        uint64_t n,
                        const location &loc,
                        bool inverse = false);
+  Value *CreateStrMatch(Value *val, const StrMatcher &matcher);
   CallInst *CreateGetNs(bool boot_time);
   CallInst   *CreateGetPidTgid();
   CallInst   *CreateGetCurrentCgroupId();
   CallInst   *CreateGetUidGid();
   CallInst   *CreateGetCpuId();
   CallInst   *CreateGetCurrentTask();
+  CallInst *CreateGetCurrentTaskBtf();
   CallInst   *CreateGetRandom();
+  CallInst   *CreateGetAttachCookie(Value *ctx);
   CallInst   *CreateGetStackId(Value *ctx, bool ustack, StackType stack_type, const location& loc);
+  // Fills in the DwarfStack at dst, whose fields are aligned to align bytes
+  void        CreateDwarfStack(Value *ctx, Value *dst, int align);
   CallInst   *CreateGetJoinMap(Value *ctx, const location& loc);
+  Value      *CreateSample(int site, uint64_t n);
+  Value      *CreateRatelimit(int site, uint64_t rate);
+  void        CreateProbeCount(Value *probe_id);
+  // Sends the pid of the current process the first time it's seen, for
+  // --raw-symbols to read its mappings while it runs
+  void        CreateRawSymbolsPid(Value *ctx);
+  Value      *CreateAdaptiveSample();
+  Value      *CreateProbeDisabled(int gate);
+  void        CreateSetProbeDisabled(int gate, bool disabled);
+  Value      *CreateReadCounter(Value *ctx, int slot, const location &loc);
+  Value      *CreateIsTargetPid(IMap &set, Value *pid);
   CallInst   *createCall(Value *callee, ArrayRef<Value *> args, const Twine &Name);
   void        CreateGetCurrentComm(Value *ctx, AllocaInst *buf, size_t size, const location& loc);
-  void        CreatePerfEventOutput(Value *ctx, Value *data, size_t size);
+  // control: an async action read ahead of the printf() events, see
+  // MapManager::Type::Control
+  void        CreatePerfEventOutput(Value *ctx, Value *data, size_t size, bool control = false);
+  void        CreatePerfEventOutput(Value *ctx, Value *data, Value *size, bool control = false);
+  // Appends the event to the batch of the CPU, sending the batch first if
+  // it's full, see MapManager::Type::EventBatch
+  bool        IsBatchable(size_t size);
+  void        CreateBatchedOutput(Value *ctx, Value *data, size_t size);
+  void        CreateFlushEvents(Value *ctx);
+  // Writes the event over the oldest one in the ring of the CPU, see
+  // MapManager::Type::FlightRecorder. The max_size bytes of data are copied.
+  void        CreateFlightRecord(Value *data, Value *size, size_t max_size);
+  // Counts the event rather than sending it when it repeats the last one of
+  // the CPU, see MapManager::Type::Dedupe. The insert point is left where
+  // the event is to be sent, which then goes on at the returned block.
+  BasicBlock *CreateDedupe(Value *ctx, Value *data, Value *size, size_t max_size);
   void        CreateSignal(Value *ctx, Value *sig, const location &loc);
   void        CreateOverrideReturn(Value *ctx, Value *rc);
+  void        CreateTailCall(Value *ctx, int slot);
+  // Runs callback on each entry of the map, see ast::For
+  CallInst   *CreateForEachMapElem(Value *ctx, Map &map, Function *callback, Value *callback_ctx, const location &loc);
   void        CreateHelperError(Value *ctx, Value *return_value, libbpf::bpf_func_id func_id, const location& loc);
   void        CreateHelperErrorCond(Value *ctx, Value *return_value, libbpf::bpf_func_id func_id, const location& loc, bool compare_zero=false);
   StructType *GetStructType(std::string name, const std::vector<llvm::Type *> & elements, bool packed = false);
@@ -168,7 +286,7 @@ public:
   void CreateSeqPrintf(Value *ctx,
                        Value *fmt,
                        Value *fmt_size,
-                       AllocaInst *data,
+                       Value *data,
                        Value *data_len,
                        const location &loc);
   int helper_error_id_ = 0;
@@ -176,13 +294,54 @@ public:
 private:
   Module &module_;
   BPFtrace &bpftrace_;
+  // Scratch map value of the probe being generated, and how much of it is
+  // used already
+  Value *scratch_ = nullptr;
+  uint64_t scratch_offset_ = 0;
 
   Value *CreateUSDTReadArgument(Value *ctx,
                                 struct bcc_usdt_argument *argument,
                                 Builtin &builtin,
                                 AddrSpace as,
                                 const location &loc);
-  CallInst   *createMapLookup(int mapfd, AllocaInst *key);
+  CallInst   *createMapLookup(int mapfd, Value *key);
+  void        createRepeatedOutput(Value *ctx, Value *count);
+  void        createDedupeFlush(Value *ctx);
+  CallInst   *createMapLookup(Value *map_ptr, Value *key);
+  CallInst *createMapUpdate(Value *map_ptr,
+                            Value *key,
+                            Value *val,
+                            uint64_t flags);
+  Value *createMapPtr(Map &map);
+  void createMapTouch(Map &map, Value *key);
+  Value *createMapLookupElem(Value *ctx,
+                             Value *map_ptr,
+                             Value *key,
+                             SizedType &type,
+                             const location &loc);
+  Value *createMapLookupElem(Value *ctx,
+                             CallInst *lookup,
+                             SizedType &type,
+                             libbpf::bpf_func_id func_id,
+                             const location &loc);
+  bool isTaskStorage(Map &map);
+  CallInst *createTaskStorageGet(Map &map, uint64_t flags);
+  void createTaskStorageUpdate(Value *ctx,
+                               Map &map,
+                               Value *val,
+                               const location &loc);
+  void createTaskStorageDelete(Value *ctx, Map &map, const location &loc);
+  bool isGlobal(Map &map);
+  Value *createGlobalPtr(Map &map, int64_t offset);
+  bool isBloom(Map &map);
+  Value *createBloomTest(Map &map, Value *key);
+  void createBloomAdd(Value *ctx, Map &map, Value *key, const location &loc);
+  void createBloomBytes(IMap &imap, Value *key, bool add, AllocaInst *found);
+  void createRingbufOutput(Value *data, Value *size);
+  CallInst *createRingbufCall(int mapfd, Value *data, Value *size);
+  void createBatchFlush(Value *ctx, Value *batch, Value *used);
+  void createHelperErrorCount(int error_id, Value *return_value);
+  Value *createSampleCheck(int site, uint64_t n, bool ratelimit);
   Constant *createProbeReadStrFn(llvm::Type *dst,
                                  llvm::Type *src,
                                  AddrSpace as);
@@ -0,0 +1,636 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+#include "ast.h"
+#include "parser.tab.hh"
+#include "utils.h"
+
+namespace bpftrace {
+namespace ast {
+
+namespace {
+
+using Token = Parser::token;
+
+// Whether evaluating expr can't change anything, so that it can be left out
+bool is_pure(Expression *expr)
+{
+  if (dynamic_cast<Call *>(expr))
+    return false;
+  if (auto *map = dynamic_cast<Map *>(expr))
+  {
+    if (map->vargs)
+      for (Expression *key : *map->vargs)
+        if (!is_pure(key))
+          return false;
+    return true;
+  }
+  if (auto *binop = dynamic_cast<Binop *>(expr))
+    return is_pure(binop->left) && is_pure(binop->right);
+  if (auto *unop = dynamic_cast<Unop *>(expr))
+    return unop->op != Token::INCREMENT && unop->op != Token::DECREMENT &&
+           is_pure(unop->expr);
+  if (auto *ternary = dynamic_cast<Ternary *>(expr))
+    return is_pure(ternary->cond) && is_pure(ternary->left) &&
+           is_pure(ternary->right);
+  if (auto *acc = dynamic_cast<FieldAccess *>(expr))
+    return is_pure(acc->expr);
+  if (auto *arr = dynamic_cast<ArrayAccess *>(expr))
+    return is_pure(arr->expr) && is_pure(arr->indexpr);
+  if (auto *cast = dynamic_cast<Cast *>(expr))
+    return is_pure(cast->expr);
+  if (auto *tuple = dynamic_cast<Tuple *>(expr))
+  {
+    for (Expression *elem : *tuple->elems)
+      if (!is_pure(elem))
+        return false;
+    return true;
+  }
+  return true;
+}
+
+// Mirrors what codegen does with two 64-bit signed integers, see
+// CodegenLLVM::binop_int(). Leaves out what is undefined or warned about.
+std::optional<long> fold(int op, long l, long r)
+{
+  auto ul = static_cast<uint64_t>(l);
+  auto ur = static_cast<uint64_t>(r);
+  switch (op)
+  {
+    case Token::EQ:
+      return l == r;
+    case Token::NE:
+      return l != r;
+    case Token::LE:
+      return l <= r;
+    case Token::GE:
+      return l >= r;
+    case Token::LT:
+      return l < r;
+    case Token::GT:
+      return l > r;
+    case Token::LAND:
+      return l && r;
+    case Token::LOR:
+      return l || r;
+    case Token::LEFT:
+      if (r < 0 || r >= 64)
+        return std::nullopt;
+      return static_cast<long>(ul << ur);
+    case Token::RIGHT:
+      if (r < 0 || r >= 64)
+        return std::nullopt;
+      return static_cast<long>(ul >> ur);
+    case Token::PLUS:
+      return static_cast<long>(ul + ur);
+    case Token::MINUS:
+      return static_cast<long>(ul - ur);
+    case Token::MUL:
+      return static_cast<long>(ul * ur);
+    case Token::DIV:
+      if (l < 0 || r <= 0)
+        return std::nullopt;
+      return l / r;
+    case Token::MOD:
+      if (l < 0 || r <= 0)
+        return std::nullopt;
+      return l % r;
+    case Token::BAND:
+      return l & r;
+    case Token::BOR:
+      return l | r;
+    case Token::BXOR:
+      return l ^ r;
+  }
+  return std::nullopt;
+}
+
+// The target of a compound assignment is also the left operand of its
+// expression, which owns it
+template <typename S, typename T>
+S *copy_assignment(Mutator &mutator, S &assignment, T *S::*target)
+{
+  auto *a = assignment.leafcopy();
+  a->expr = static_cast<Expression *>(mutator.Visit(*assignment.expr));
+  auto *binop = dynamic_cast<Binop *>(a->expr);
+  if (assignment.compound && binop)
+    a->*target = static_cast<T *>(binop->left);
+  else
+    a->*target = static_cast<T *>(mutator.Visit(*(assignment.*target)));
+  return a;
+}
+
+void delete_stmts(StatementList *stmts)
+{
+  for (Statement *stmt : *stmts)
+    delete stmt;
+  delete stmts;
+}
+
+/**
+   Counts the nodes referring to maps and variables
+*/
+class References : public Visitor
+{
+public:
+  void visit(Map &map) override
+  {
+    maps[map.ident]++;
+    Visitor::visit(map);
+  }
+
+  void visit(Variable &var) override
+  {
+    vars[var.ident]++;
+  }
+
+  void visit(Unop &unop) override
+  {
+    if (unop.op == Token::INCREMENT || unop.op == Token::DECREMENT)
+    {
+      if (auto *map = dynamic_cast<Map *>(unop.expr))
+        defined_maps.insert(map->ident);
+      else if (auto *var = dynamic_cast<Variable *>(unop.expr))
+        defined_vars.insert(var->ident);
+    }
+    Visitor::visit(unop);
+  }
+
+  void visit(AssignMapStatement &assignment) override
+  {
+    defined_maps.insert(assignment.map->ident);
+    Visitor::visit(assignment);
+  }
+
+  void visit(AssignVarStatement &assignment) override
+  {
+    defined_vars.insert(assignment.var->ident);
+    var_stores[assignment.var->ident]++;
+    Visitor::visit(assignment);
+  }
+
+  std::unordered_map<std::string, int> maps;
+  std::unordered_map<std::string, int> vars;
+  std::unordered_map<std::string, int> var_stores;
+  std::unordered_set<std::string> defined_maps;
+  std::unordered_set<std::string> defined_vars;
+};
+
+// Rough cost of evaluating expr, counting helper calls and reads of memory
+// other than the stack
+int cost(Expression *expr)
+{
+  if (auto *builtin = dynamic_cast<Builtin *>(expr))
+    return builtin->ident == "comm" ? 2 : 1;
+  if (auto *map = dynamic_cast<Map *>(expr))
+  {
+    int c = 2;
+    if (map->vargs)
+      for (Expression *key : *map->vargs)
+        c += cost(key);
+    return c;
+  }
+  if (auto *binop = dynamic_cast<Binop *>(expr))
+  {
+    int c = cost(binop->left) + cost(binop->right);
+    // Strings are compared byte by byte
+    auto is_string = [](Expression *e) {
+      auto *builtin = dynamic_cast<Builtin *>(e);
+      return dynamic_cast<String *>(e) || (builtin && builtin->ident == "comm");
+    };
+    if (is_string(binop->left) || is_string(binop->right))
+      c += 4;
+    return c;
+  }
+  if (auto *unop = dynamic_cast<Unop *>(expr))
+    return cost(unop->expr) + (unop->op == Token::MUL ? 2 : 0);
+  if (auto *ternary = dynamic_cast<Ternary *>(expr))
+    return cost(ternary->cond) + cost(ternary->left) + cost(ternary->right);
+  if (auto *acc = dynamic_cast<FieldAccess *>(expr))
+    return cost(acc->expr) + 2;
+  if (auto *arr = dynamic_cast<ArrayAccess *>(expr))
+    return cost(arr->expr) + cost(arr->indexpr) + 2;
+  if (auto *cast = dynamic_cast<Cast *>(expr))
+    return cost(cast->expr);
+  if (auto *tuple = dynamic_cast<Tuple *>(expr))
+  {
+    int c = 0;
+    for (Expression *elem : *tuple->elems)
+      c += cost(elem);
+    return c;
+  }
+  if (dynamic_cast<Call *>(expr))
+    return 4;
+  return 0;
+}
+
+// The operands of a chain of &&, in the order they are evaluated
+void conjuncts(Expression *expr, std::vector<Expression *> &terms)
+{
+  auto *binop = dynamic_cast<Binop *>(expr);
+  if (binop && binop->op == Token::LAND)
+  {
+    conjuncts(binop->left, terms);
+    conjuncts(binop->right, terms);
+  }
+  else
+    terms.push_back(expr);
+}
+
+} // namespace
+
+Node *ConstantFolder::visit(PositionalParameter &param)
+{
+  if (in_str_)
+    return param.leafcopy();
+
+  switch (param.ptype)
+  {
+    case PositionalParameterType::positional:
+      if (param.n > 0)
+      {
+        std::string pstr = bpftrace_.get_param(param.n, false);
+        if (is_numeric(pstr))
+          return new Integer(std::stoll(pstr, nullptr, 0), param.loc);
+      }
+      break;
+    case PositionalParameterType::count:
+      return new Integer(bpftrace_.num_params(), param.loc);
+  }
+  return param.leafcopy();
+}
+
+Node *ConstantFolder::visit(Call &call)
+{
+  bool in_str = in_str_;
+  in_str_ = call.func == "str";
+  auto *c = Mutator::visit(call);
+  in_str_ = in_str;
+  return c;
+}
+
+Node *ConstantFolder::visit(Binop &binop)
+{
+  auto *left = static_cast<Expression *>(Visit(*binop.left));
+  auto *right = static_cast<Expression *>(Visit(*binop.right));
+  auto *l = dynamic_cast<Integer *>(left);
+  auto *r = dynamic_cast<Integer *>(right);
+
+  std::optional<long> n;
+  if (l && r)
+    n = fold(binop.op, l->n, r->n);
+  // The right operand is never evaluated
+  else if (l && binop.op == Token::LAND && l->n == 0 && is_pure(right))
+    n = 0;
+  else if (l && binop.op == Token::LOR && l->n != 0 && is_pure(right))
+    n = 1;
+
+  if (n)
+  {
+    delete left;
+    delete right;
+    return new Integer(*n, binop.loc);
+  }
+
+  auto *b = binop.leafcopy();
+  b->left = left;
+  b->right = right;
+  return b;
+}
+
+Node *ConstantFolder::visit(Unop &unop)
+{
+  auto *expr = static_cast<Expression *>(Visit(*unop.expr));
+  if (auto *integer = dynamic_cast<Integer *>(expr))
+  {
+    std::optional<long> n;
+    switch (unop.op)
+    {
+      case Token::LNOT:
+        n = !integer->n;
+        break;
+      case Token::BNOT:
+        n = ~integer->n;
+        break;
+      case Token::MINUS:
+        n = static_cast<long>(-static_cast<uint64_t>(integer->n));
+        break;
+      default:
+        break;
+    }
+    if (n)
+    {
+      delete expr;
+      return new Integer(*n, unop.loc);
+    }
+  }
+
+  auto *u = unop.leafcopy();
+  u->expr = expr;
+  return u;
+}
+
+Node *ConstantFolder::visit(Ternary &ternary)
+{
+  auto *cond = static_cast<Expression *>(Visit(*ternary.cond));
+  auto *left = static_cast<Expression *>(Visit(*ternary.left));
+  auto *right = static_cast<Expression *>(Visit(*ternary.right));
+
+  if (auto *integer = dynamic_cast<Integer *>(cond))
+  {
+    auto *taken = integer->n ? left : right;
+    auto *skipped = integer->n ? right : left;
+    if (is_pure(skipped))
+    {
+      delete cond;
+      delete skipped;
+      return taken;
+    }
+  }
+
+  return new Ternary(cond, left, right, ternary.loc);
+}
+
+Node *ConstantFolder::visit(AssignMapStatement &assignment)
+{
+  auto *a = copy_assignment(*this, assignment, &AssignMapStatement::map);
+  a->expr->map = a->map;
+  return a;
+}
+
+Node *ConstantFolder::visit(AssignVarStatement &assignment)
+{
+  return copy_assignment(*this, assignment, &AssignVarStatement::var);
+}
+
+bool DeadCodeEliminator::drop(StatementList::iterator begin,
+                              StatementList::iterator end,
+                              bool keep_definitions)
+{
+  if (begin == end)
+    return true;
+
+  References refs;
+  for (auto it = begin; it != end; ++it)
+    refs.Visit(**it);
+
+  if (keep_definitions)
+  {
+    for (auto &ident : refs.defined_maps)
+      if (refs.maps[ident] != maps_[ident])
+        return false;
+    for (auto &ident : refs.defined_vars)
+      if (refs.vars[ident] != vars_[ident])
+        return false;
+  }
+
+  for (auto &map : refs.maps)
+    maps_[map.first] -= map.second;
+  for (auto &var : refs.vars)
+    vars_[var.first] -= var.second;
+  for (auto &var : refs.var_stores)
+    var_stores_[var.first] -= var.second;
+  changed_ = true;
+  return true;
+}
+
+StatementList *DeadCodeEliminator::simplify(StatementList *stmts)
+{
+  auto *dst = new StatementList;
+  for (auto it = stmts->begin(); it != stmts->end(); ++it)
+  {
+    Statement *stmt = *it;
+    if (auto *if_block = dynamic_cast<If *>(stmt))
+    {
+      if (auto *cond = dynamic_cast<Integer *>(if_block->cond))
+      {
+        auto *taken = cond->n ? if_block->stmts : if_block->else_stmts;
+        auto *skipped = cond->n ? if_block->else_stmts : if_block->stmts;
+        if (!skipped || drop(skipped->begin(), skipped->end()))
+        {
+          if (taken)
+          {
+            auto *kept = simplify(taken);
+            dst->insert(dst->end(), kept->begin(), kept->end());
+            delete kept;
+          }
+          continue;
+        }
+      }
+    }
+    else if (auto *while_block = dynamic_cast<While *>(stmt))
+    {
+      auto *cond = dynamic_cast<Integer *>(while_block->cond);
+      if (cond && cond->n == 0 &&
+          drop(while_block->stmts->begin(), while_block->stmts->end()))
+        continue;
+    }
+    else if (auto *assignment = dynamic_cast<AssignVarStatement *>(stmt))
+    {
+      // Nothing reads the variable, whatever type the other assignments
+      // give it
+      auto &ident = assignment->var->ident;
+      if (!assignment->compound && vars_[ident] == var_stores_[ident] &&
+          is_pure(assignment->expr))
+      {
+        drop(it, std::next(it), false);
+        continue;
+      }
+    }
+
+    dst->push_back(static_cast<Statement *>(Visit(*stmt)));
+
+    if (dynamic_cast<Jump *>(stmt) && drop(std::next(it), stmts->end()))
+      break;
+  }
+  return dst;
+}
+
+Node *DeadCodeEliminator::visit(AssignMapStatement &assignment)
+{
+  auto *a = copy_assignment(*this, assignment, &AssignMapStatement::map);
+  a->expr->map = a->map;
+  return a;
+}
+
+Node *DeadCodeEliminator::visit(AssignVarStatement &assignment)
+{
+  return copy_assignment(*this, assignment, &AssignVarStatement::var);
+}
+
+Node *DeadCodeEliminator::visit(If &if_block)
+{
+  auto *i = if_block.leafcopy();
+  i->cond = static_cast<Expression *>(Visit(*if_block.cond));
+  i->stmts = simplify(if_block.stmts);
+  if (if_block.else_stmts)
+    i->else_stmts = simplify(if_block.else_stmts);
+  return i;
+}
+
+Node *DeadCodeEliminator::visit(Unroll &unroll)
+{
+  auto *u = unroll.leafcopy();
+  u->expr = static_cast<Expression *>(Visit(*unroll.expr));
+  u->stmts = simplify(unroll.stmts);
+  return u;
+}
+
+Node *DeadCodeEliminator::visit(While &while_block)
+{
+  auto *w = while_block.leafcopy();
+  w->cond = static_cast<Expression *>(Visit(*while_block.cond));
+  w->stmts = simplify(while_block.stmts);
+  return w;
+}
+
+Node *DeadCodeEliminator::visit(For &for_loop)
+{
+  auto *f = for_loop.leafcopy();
+  f->decl = static_cast<Variable *>(Visit(*for_loop.decl));
+  f->map = static_cast<Map *>(Visit(*for_loop.map));
+  f->stmts = simplify(for_loop.stmts);
+  return f;
+}
+
+Node *DeadCodeEliminator::visit(Probe &probe)
+{
+  References refs;
+  refs.Visit(probe);
+  vars_ = std::move(refs.vars);
+  var_stores_ = std::move(refs.var_stores);
+
+  auto *p = probe.leafcopy();
+  p->attach_points = new AttachPointList;
+  for (AttachPoint *ap : *probe.attach_points)
+    p->attach_points->push_back(static_cast<AttachPoint *>(Visit(*ap)));
+
+  auto *cond = probe.pred ? dynamic_cast<Integer *>(probe.pred->expr)
+                          : nullptr;
+  if (probe.pred && !(cond && cond->n))
+    p->pred = static_cast<Predicate *>(Visit(*probe.pred));
+
+  if (cond && !cond->n && drop(probe.stmts->begin(), probe.stmts->end()))
+  {
+    p->stmts = new StatementList;
+    return p;
+  }
+
+  // Removing a statement can leave others unused
+  changed_ = false;
+  p->stmts = simplify(probe.stmts);
+  while (changed_)
+  {
+    changed_ = false;
+    auto *stmts = simplify(p->stmts);
+    delete_stmts(p->stmts);
+    p->stmts = stmts;
+  }
+  return p;
+}
+
+Node *DeadCodeEliminator::visit(Program &program)
+{
+  References refs;
+  refs.Visit(program);
+  maps_ = std::move(refs.maps);
+
+  auto *p = program.leafcopy();
+  p->probes = new ProbeList;
+  for (Probe *probe : *program.probes)
+    p->probes->push_back(static_cast<Probe *>(Visit(*probe)));
+
+  // Maps that were only used by the code removed aren't created, forget them
+  // rather than warning that they're unused
+  if (p->map_decls)
+  {
+    auto &decls = *p->map_decls;
+    decls.erase(std::remove_if(decls.begin(),
+                               decls.end(),
+                               [this](const MapDecl &decl) {
+                                 auto refs = maps_.find(decl.ident);
+                                 return refs != maps_.end() &&
+                                        refs->second == 0;
+                               }),
+                decls.end());
+  }
+  return p;
+}
+
+Node *PredicateReorderer::visit(Predicate &pred)
+{
+  auto *p = static_cast<Predicate *>(Mutator::visit(pred));
+  std::vector<Expression *> terms;
+  conjuncts(p->expr, terms);
+
+  // Only the runs of pure operands are sorted, whether the others get
+  // evaluated mustn't change
+  auto sorted = terms;
+  for (auto begin = sorted.begin(); begin != sorted.end();)
+  {
+    auto end = std::find_if(begin, sorted.end(), [](Expression *expr) {
+      return !is_pure(expr);
+    });
+    std::stable_sort(begin, end, [](Expression *a, Expression *b) {
+      return cost(a) < cost(b);
+    });
+    begin = end == sorted.end() ? end : end + 1;
+  }
+  if (sorted == terms)
+    return p;
+
+  // Keep the operands when deleting the old chain
+  std::function<void(Expression *)> release = [&](Expression *expr) {
+    auto *binop = dynamic_cast<Binop *>(expr);
+    if (!binop || binop->op != Token::LAND)
+      return;
+    release(binop->left);
+    release(binop->right);
+    binop->left = nullptr;
+    binop->right = nullptr;
+    delete binop;
+  };
+  auto loc = p->expr->loc;
+  release(p->expr);
+
+  Expression *expr = sorted.front();
+  for (auto it = sorted.begin() + 1; it != sorted.end(); ++it)
+    expr = new Binop(expr, Token::LAND, *it, loc);
+  p->expr = expr;
+  return p;
+}
+
+Pass CreateFoldPass()
+{
+  auto fn = [](Node &n, PassContext &ctx) {
+    ConstantFolder folder(ctx.b);
+    return PassResult::Success(folder.Visit(n));
+  };
+  return Pass("ConstantFolder", fn);
+}
+
+Pass CreateDeadCodePass()
+{
+  auto fn = [](Node &n, PassContext &ctx __attribute__((unused))) {
+    DeadCodeEliminator eliminator;
+    return PassResult::Success(eliminator.Visit(n));
+  };
+  return Pass("DeadCode", fn);
+}
+
+Pass CreatePredicateReorderPass()
+{
+  auto fn = [](Node &n, PassContext &ctx __attribute__((unused))) {
+    PredicateReorderer reorderer;
+    return PassResult::Success(reorderer.Visit(n));
+  };
+  return Pass("PredicateReorder", fn);
+}
+
+} // namespace ast
+} // namespace bpftrace
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include "bpftrace.h"
+#include "pass_manager.h"
+#include "visitors.h"
+
+namespace bpftrace {
+namespace ast {
+
+/**
+   Folds the operations on integer literals and numeric positional
+   parameters into literals, and ternaries with a constant condition into the
+   branch they take.
+
+   Runs ahead of the semantic analyser, so that the passes after it only see
+   the simplified program. Operands that would be dropped are kept unless
+   they have no side effects.
+*/
+class ConstantFolder : public Mutator
+{
+public:
+  explicit ConstantFolder(BPFtrace &bpftrace) : bpftrace_(bpftrace)
+  {
+  }
+
+  Node *visit(PositionalParameter &param) override;
+  Node *visit(Call &call) override;
+  Node *visit(Binop &binop) override;
+  Node *visit(Unop &unop) override;
+  Node *visit(Ternary &ternary) override;
+  Node *visit(AssignMapStatement &assignment) override;
+  Node *visit(AssignVarStatement &assignment) override;
+
+private:
+  BPFtrace &bpftrace_;
+  // str($1 + n) reads the string of $1 from offset n, leave it alone
+  bool in_str_ = false;
+};
+
+/**
+   Removes statements that can never run: the branches of ifs and the loops
+   with a constant condition, the bodies of probes whose predicate is always
+   false, what follows a return, break or continue, and assignments to
+   variables that are never read. Maps only used by those are no longer
+   created then.
+
+   Code that assigns a map or a variable used elsewhere is kept, as it
+   declares its type.
+*/
+class DeadCodeEliminator : public Mutator
+{
+public:
+  explicit DeadCodeEliminator() = default;
+
+  Node *visit(AssignMapStatement &assignment) override;
+  Node *visit(AssignVarStatement &assignment) override;
+  Node *visit(If &if_block) override;
+  Node *visit(Unroll &unroll) override;
+  Node *visit(While &while_block) override;
+  Node *visit(For &for_loop) override;
+  Node *visit(Probe &probe) override;
+  Node *visit(Program &program) override;
+
+private:
+  // Copies the statements that may run
+  StatementList *simplify(StatementList *stmts);
+  // Forgets about the references in the statements, if they can be removed.
+  // Without keep_definitions, they can even if they assign a map or a
+  // variable used elsewhere.
+  bool drop(StatementList::iterator begin,
+            StatementList::iterator end,
+            bool keep_definitions = true);
+
+  // Number of nodes referring to each map in the program
+  std::unordered_map<std::string, int> maps_;
+  // Number of nodes referring to each variable in the current probe, and
+  // how many of them are assigned to
+  std::unordered_map<std::string, int> vars_;
+  std::unordered_map<std::string, int> var_stores_;
+  bool changed_ = false;
+};
+
+/**
+   Reorders the operands of the && chains of predicates by how costly they
+   are to evaluate, so that events get filtered out by the comparisons of
+   pid, tid or cgroup before the ones of comm or of memory read through
+   pointers. Operands with side effects stay where they are, the others are
+   only moved around between them.
+*/
+class PredicateReorderer : public Mutator
+{
+public:
+  explicit PredicateReorderer() = default;
+
+  Node *visit(Predicate &pred) override;
+};
+
+Pass CreateFoldPass();
+Pass CreateDeadCodePass();
+Pass CreatePredicateReorderPass();
+
+} // namespace ast
+} // namespace bpftrace
@@ -3,6 +3,7 @@
 
 #include "bpftrace.h"
 #include "printer.h"
+#include "timings.h"
 
 namespace bpftrace {
 namespace ast {
@@ -31,7 +32,10 @@ std::unique_ptr<Node> PassManager::Run(std::unique_ptr<Node> node,
     print(root, "parser", std::cout);
   for (auto &pass : passes_)
   {
-    auto result = pass.Run(*root, ctx);
+    PassResult result = [&]() {
+      Timings::Scope timing("pass " + pass.name);
+      return pass.Run(*root, ctx);
+    }();
     if (!result.Ok())
       return {};
 
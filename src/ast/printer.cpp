@@ -319,6 +319,24 @@ void Printer::visit(While &while_block)
   }
 }
 
+void Printer::visit(For &for_loop)
+{
+  std::string indent(depth_, ' ');
+  out_ << indent << "for" << std::endl;
+
+  ++depth_;
+  for_loop.decl->accept(*this);
+  for_loop.map->accept(*this);
+  out_ << indent << " block" << std::endl;
+
+  ++depth_;
+  for (Statement *stmt : *for_loop.stmts)
+  {
+    stmt->accept(*this);
+  }
+  depth_ -= 2;
+}
+
 void Printer::visit(Jump &jump)
 {
   std::string indent(depth_, ' ');
@@ -366,6 +384,13 @@ void Printer::visit(Program &program)
   out_ << indent << "Program" << std::endl;
 
   ++depth_;
+  if (program.map_decls)
+  {
+    std::string indent_decl(depth_, ' ');
+    for (auto &decl : *program.map_decls)
+      out_ << indent_decl << decl.ident << " = " << decl.type << "("
+           << decl.max_entries << ")" << std::endl;
+  }
   for (Probe *probe : *program.probes)
     probe->accept(*this);
   --depth_;
@@ -7,11 +7,14 @@
 #include "printf.h"
 #include "probe_matcher.h"
 #include "signal_bt.h"
+#include "str_match.h"
 #include "tracepoint_format_parser.h"
 #include "usdt.h"
 #include <algorithm>
 #include <cstring>
+#include <functional>
 #include <regex>
+#include <set>
 #include <string>
 #include <sys/stat.h>
 
@@ -107,6 +110,10 @@ void SemanticAnalyser::visit(StackMode &mode)
     mode.type.stack_type.mode = bpftrace::StackMode::bpftrace;
   } else if (mode.mode == "perf") {
     mode.type.stack_type.mode = bpftrace::StackMode::perf;
+  } else if (mode.mode == "build_id") {
+    mode.type.stack_type.mode = bpftrace::StackMode::build_id;
+  } else if (mode.mode == "dwarf") {
+    mode.type.stack_type.mode = bpftrace::StackMode::dwarf;
   } else {
     mode.type = CreateNone();
     LOG(ERROR, mode.loc, err_) << "Unknown stack mode: '" + mode.mode + "'";
@@ -180,6 +187,140 @@ ProbeType SemanticAnalyser::single_provider_type(void)
   return type;
 }
 
+// Whether all the attach points of the probe can be attached with kprobe_multi
+// links, which give each of them a cookie the probe builtin can be read from
+bool SemanticAnalyser::has_probe_cookies(void)
+{
+  for (auto &attach_point : *probe_->attach_points)
+  {
+    ProbeType type = probetype(attach_point->provider);
+    if ((type != ProbeType::kprobe && type != ProbeType::kretprobe) ||
+        attach_point->func_offset != 0 || attach_point->address != 0)
+      return false;
+  }
+
+  return bpftrace_.feature_->has_kprobe_multi() &&
+         bpftrace_.feature_->has_helper_get_attach_cookie();
+}
+
+// Whether all the attach points of the probe are kfuncs. Their matches each
+// load a program of their own anyway, which can be the same one with the
+// probe id patched in, see BPF_PSEUDO_PROBE_ID.
+bool SemanticAnalyser::has_probe_ids_at_load(void)
+{
+  for (auto &attach_point : *probe_->attach_points)
+  {
+    ProbeType type = probetype(attach_point->provider);
+    if (type != ProbeType::kfunc && type != ProbeType::kretfunc)
+      return false;
+  }
+  return true;
+}
+
+// Makes room in the scratch map for a temporary of size bytes of the probe,
+// if codegen keeps it there. Slices are 8 bytes aligned like in
+// IRBuilderBPF::CreateScratchBPF().
+void SemanticAnalyser::reserve_scratch(uint64_t size)
+{
+  if (is_final_pass() && probe_ && size > SCRATCH_THRESHOLD)
+    probe_scratch_ += (size + 7) & ~7ULL;
+}
+
+namespace {
+
+// Number of nodes of a statement, counting unrolled loops once per
+// iteration, and the variables it uses
+class StatementSize : public Visitor
+{
+public:
+  void Visit(Node &node) override
+  {
+    nodes++;
+    Visitor::Visit(node);
+  }
+
+  void visit(Variable &var) override
+  {
+    vars.insert(var.ident);
+  }
+
+  void visit(Unroll &unroll) override
+  {
+    Visit(*unroll.expr);
+    StatementSize body;
+    for (Statement *stmt : *unroll.stmts)
+      body.Visit(*stmt);
+    nodes += body.nodes * unroll.var;
+    vars.insert(body.vars.begin(), body.vars.end());
+    has_for |= body.has_for;
+  }
+
+  void visit(For &for_loop) override
+  {
+    has_for = true;
+    Visitor::visit(for_loop);
+  }
+
+  uint64_t nodes = 0;
+  std::set<std::string> vars;
+  // for loops are BPF subprograms
+  bool has_for = false;
+};
+
+} // namespace
+
+// Splits the statements of large probes into several programs, where no
+// variable is used on both sides: they live on the stack of a program.
+// Programs built for each wildcard match or USDT location, and watchpoints,
+// which come with a setup program, are left in one piece. So are probes with
+// for loops: kernels before 5.10 and most JITs other than x86's reject
+// programs mixing tail calls and BPF to BPF calls.
+void SemanticAnalyser::split_probe(Probe &probe)
+{
+  probe.tail_calls.clear();
+  if (probe.need_expansion || !probe.stmts)
+    return;
+  for (AttachPoint *ap : *probe.attach_points)
+  {
+    auto type = probetype(ap->provider);
+    if (type == ProbeType::usdt || type == ProbeType::watchpoint ||
+        type == ProbeType::asyncwatchpoint)
+      return;
+  }
+
+  std::vector<uint64_t> nodes;
+  std::vector<std::set<std::string>> vars;
+  std::map<std::string, size_t> last_use;
+  for (size_t i = 0; i < probe.stmts->size(); i++)
+  {
+    StatementSize size;
+    size.Visit(*probe.stmts->at(i));
+    if (size.has_for)
+      return;
+    nodes.push_back(size.nodes);
+    for (auto &var : size.vars)
+      last_use[var] = i;
+    vars.push_back(std::move(size.vars));
+  }
+
+  uint64_t program_nodes = 0;
+  // Last statement using a variable of the current program
+  size_t live_until = 0;
+  for (size_t i = 0; i < nodes.size(); i++)
+  {
+    if (i > 0 && live_until < i &&
+        program_nodes + nodes[i] > TAIL_CALL_THRESHOLD)
+    {
+      probe.tail_calls.push_back(i);
+      program_nodes = 0;
+    }
+    program_nodes += nodes[i];
+    for (auto &var : vars[i])
+      live_until = std::max(live_until, last_use[var]);
+  }
+  tail_calls_ += probe.tail_calls.size();
+}
+
 AddrSpace SemanticAnalyser::find_addrspace(ProbeType pt)
 {
   switch (pt)
@@ -189,6 +330,7 @@ AddrSpace SemanticAnalyser::find_addrspace(ProbeType pt)
     case ProbeType::kfunc:
     case ProbeType::kretfunc:
     case ProbeType::tracepoint:
+    case ProbeType::rawtracepoint:
     case ProbeType::iter:
       return AddrSpace::kernel;
     case ProbeType::uprobe:
@@ -319,10 +461,17 @@ void SemanticAnalyser::visit(Builtin &builtin)
     {
       auto it = ap_args_.find("$retval");
 
-      if (it != ap_args_.end())
-        builtin.type = it->second;
-      else
+      if (it == ap_args_.end())
         LOG(ERROR, builtin.loc, err_) << "Can't find a field $retval";
+      else if (probe_->attach_points->front()->from_kprobe)
+      {
+        // Read as a kretprobe would, whatever its type
+        builtin.type = CreateUInt64();
+        builtin.type.is_kfarg = true;
+        builtin.type.kfarg_idx = it->second.kfarg_idx;
+      }
+      else
+        builtin.type = it->second;
     }
     else
     {
@@ -339,10 +488,12 @@ void SemanticAnalyser::visit(Builtin &builtin)
   else if (builtin.ident == "kstack") {
     builtin.type = CreateStack(true, StackType());
     needs_stackid_maps_.insert(builtin.type.stack_type);
+    bpftrace_.needs_ksyms_ = true;
   }
   else if (builtin.ident == "ustack") {
     builtin.type = CreateStack(false, StackType());
     needs_stackid_maps_.insert(builtin.type.stack_type);
+    needs_raw_symbols_pids_ = true;
   }
   else if (builtin.ident == "comm") {
     builtin.type = CreateString(COMM_SIZE);
@@ -355,8 +506,10 @@ void SemanticAnalyser::visit(Builtin &builtin)
     {
       ProbeType type = probetype(attach_point->provider);
       if (type == ProbeType::kprobe ||
-          type == ProbeType::kretprobe)
+          type == ProbeType::kretprobe) {
         builtin.type = CreateKSym();
+        bpftrace_.needs_ksyms_ = true;
+      }
       else if (type == ProbeType::uprobe || type == ProbeType::uretprobe)
         builtin.type = CreateUSym();
       else
@@ -369,22 +522,35 @@ void SemanticAnalyser::visit(Builtin &builtin)
       builtin.ident.at(3) >= '0' && builtin.ident.at(3) <= '9') {
     ProbeType pt = probetype((*probe_->attach_points)[0]->provider);
     AddrSpace addrspace = find_addrspace(pt);
+    // Whether the arguments are read from the array of the context rather
+    // than from the registers
+    bool ctx_args = true;
     for (auto &attach_point : *probe_->attach_points)
     {
       ProbeType type = probetype(attach_point->provider);
+      bool in_ctx = attach_point->from_kprobe ||
+                    type == ProbeType::rawtracepoint;
+      ctx_args = ctx_args && in_ctx;
       if (type != ProbeType::kprobe &&
           type != ProbeType::uprobe &&
-          type != ProbeType::usdt)
+          type != ProbeType::usdt && !in_ctx)
         LOG(ERROR, builtin.loc, err_)
             << "The " << builtin.ident << " builtin can only be used with "
-            << "'kprobes', 'uprobes' and 'usdt' probes";
+            << "'kprobes', 'uprobes', 'usdt' and 'rawtracepoint' probes";
     }
     int arg_num = atoi(builtin.ident.substr(3).c_str());
-    if (arg_num > arch::max_arg())
+    if (arg_num > arch::max_arg() && !ctx_args)
       LOG(ERROR, builtin.loc, err_)
           << arch::name() << " doesn't support " << builtin.ident;
     builtin.type = CreateUInt64();
     builtin.type.SetAS(addrspace);
+    // The kfuncs of AttachPointParser::upgrade_kprobes() and the raw
+    // tracepoints read it as a kfunc does
+    if (ctx_args)
+    {
+      builtin.type.is_kfarg = true;
+      builtin.type.kfarg_idx = arg_num;
+    }
   }
   else if (!builtin.ident.compare(0, 4, "sarg") && builtin.ident.size() == 5 &&
       builtin.ident.at(4) >= '0' && builtin.ident.at(4) <= '9') {
@@ -411,7 +577,12 @@ void SemanticAnalyser::visit(Builtin &builtin)
   }
   else if (builtin.ident == "probe") {
     builtin.type = CreateProbe();
-    probe_->need_expansion = true;
+    if (has_probe_cookies())
+      probe_->use_cookies = true;
+    else if (has_probe_ids_at_load())
+      probe_->probe_ids_at_load = true;
+    else
+      probe_->need_expansion = true;
   }
   else if (builtin.ident == "username") {
     builtin.type = CreateUsername();
@@ -422,6 +593,11 @@ void SemanticAnalyser::visit(Builtin &builtin)
       LOG(ERROR, builtin.loc, err_)
           << "cpid cannot be used without child command";
     }
+    else if (bpftrace_.child_runs_ > 1)
+    {
+      LOG(ERROR, builtin.loc, err_)
+          << "cpid cannot be used with --repeat, each run has another child";
+    }
     builtin.type = CreateUInt32();
   }
   else if (builtin.ident == "args") {
@@ -442,8 +618,13 @@ void SemanticAnalyser::visit(Builtin &builtin)
     {
       // no special action in here
     }
-    else if (type == ProbeType::kfunc || type == ProbeType::kretfunc)
+    else if (type == ProbeType::kfunc || type == ProbeType::kretfunc ||
+             type == ProbeType::rawtracepoint)
     {
+      if (type == ProbeType::rawtracepoint && ap_args_.empty())
+        LOG(ERROR, builtin.loc, err_)
+            << "The arguments of " << probe_->name()
+            << " can't be read from BTF, use argN instead";
       builtin.type = CreatePointer(CreateRecord(0, "struct kfunc"),
                                    AddrSpace::kernel);
       builtin.type.MarkCtxAccess();
@@ -452,7 +633,8 @@ void SemanticAnalyser::visit(Builtin &builtin)
     else
     {
       LOG(ERROR, builtin.loc, err_)
-          << "The args builtin can only be used with tracepoint/kfunc probes ("
+          << "The args builtin can only be used with "
+             "tracepoint/rawtracepoint/kfunc probes ("
           << probetypeName(type) << " used here)";
     }
   }
@@ -518,6 +700,11 @@ void SemanticAnalyser::visit(Call &call)
     check_arg(call, Type::integer, 0);
 
     call.type = CreateHist();
+    // The zeroed bucket array a new key is inserted with, see
+    // IMap::bucket_array_
+    if (bpftrace_.hist_arrays_ && call.map && call.map->vargs)
+      reserve_scratch(IMap::hist_buckets(call.type, 0, 0, 0) *
+                      sizeof(uint64_t));
   }
   else if (call.func == "lhist") {
     check_assignment(call, true, false, false);
@@ -573,9 +760,41 @@ void SemanticAnalyser::visit(Call &call)
       auto search = map_args_.find(call.map->ident);
       if (search == map_args_.end())
         map_args_.insert({call.map->ident, *call.vargs});
+
+      uint32_t buckets = IMap::hist_buckets(CreateLhist(),
+                                            min.n,
+                                            max.n,
+                                            step.n);
+      if (bpftrace_.hist_arrays_ && call.map->vargs &&
+          buckets <= IMap::BUCKET_ARRAY_MAX)
+        reserve_scratch(buckets * sizeof(uint64_t));
     }
     call.type = CreateLhist();
   }
+  else if (call.func == "llhist") {
+    check_assignment(call, true, false, false);
+    if (check_nargs(call, 2)) {
+      check_arg(call, Type::integer, 0, false);
+      check_arg(call, Type::integer, 1, true);
+    }
+
+    if (is_final_pass()) {
+      auto &sub_buckets = static_cast<Integer &>(*call.vargs->at(1));
+      if (sub_buckets.n < 2 || sub_buckets.n > 256 ||
+          (sub_buckets.n & (sub_buckets.n - 1)))
+      {
+        LOG(ERROR, call.loc, err_)
+            << "llhist() sub_buckets must be a power of 2 between 2 and 256 ("
+            << sub_buckets.n << " provided)";
+      }
+
+      // store args for later passing to bpftrace::Map
+      auto search = map_args_.find(call.map->ident);
+      if (search == map_args_.end())
+        map_args_.insert({call.map->ident, *call.vargs});
+    }
+    call.type = CreateLlhist();
+  }
   else if (call.func == "count") {
     check_assignment(call, true, false, false);
     check_nargs(call, 0);
@@ -609,6 +828,45 @@ void SemanticAnalyser::visit(Call &call)
     }
     call.type = CreateMax(sign);
   }
+  else if (call.func == "distinct") {
+    check_assignment(call, true, false, false);
+    if (check_nargs(call, 1))
+      check_arg(call, Type::integer, 0);
+    call.type = CreateDistinct();
+  }
+  else if (call.func == "cms_count") {
+    check_assignment(call, true, false, false);
+    if (call.map && call.map->vargs)
+    {
+      LOG(ERROR, call.loc, err_)
+          << "cms_count() maps can't have keys, the key to count is the "
+             "argument of cms_count()";
+    }
+    if (check_varargs(call, 1, 2)) {
+      auto &arg = *call.vargs->at(0);
+      if (is_final_pass() && !arg.type.IsIntTy() && !arg.type.IsStringTy())
+      {
+        LOG(ERROR, call.loc, err_)
+            << "cms_count() expects an integer or string key (" << arg.type
+            << " provided)";
+      }
+      if (call.vargs->size() == 2 && check_arg(call, Type::integer, 1, true))
+      {
+        auto &threshold = static_cast<Integer &>(*call.vargs->at(1));
+        if (threshold.n < 1)
+          LOG(ERROR, call.loc, err_)
+              << "cms_count() threshold must be at least 1";
+      }
+
+      if (call.map)
+      {
+        auto search = map_args_.find(call.map->ident);
+        if (search == map_args_.end())
+          map_args_.insert({ call.map->ident, *call.vargs });
+      }
+    }
+    call.type = CreateCms();
+  }
   else if (call.func == "avg") {
     check_assignment(call, true, false, false);
     check_nargs(call, 1);
@@ -642,6 +900,7 @@ void SemanticAnalyser::visit(Call &call)
             << "argument (" << t << " provided)";
       }
       call.type = CreateString(bpftrace_.strlen_);
+      reserve_scratch(call.type.GetSize());
       if (has_pos_param_)
       {
         if (dynamic_cast<PositionalParameter *>(arg))
@@ -755,10 +1014,15 @@ void SemanticAnalyser::visit(Call &call)
             << call.func << "() expects an integer or pointer argument";
     }
 
-    if (call.func == "ksym")
+    if (call.func == "ksym") {
       call.type = CreateKSym();
+      bpftrace_.needs_ksyms_ = true;
+    }
     else if (call.func == "usym")
+    {
       call.type = CreateUSym();
+      needs_raw_symbols_pids_ = true;
+    }
   }
   else if (call.func == "ntop") {
     if (!check_varargs(call, 1, 2))
@@ -904,6 +1168,17 @@ void SemanticAnalyser::visit(Call &call)
     }
     call.type = CreateUInt64();
   }
+  else if (call.func == "cgroup_path") {
+    if (check_nargs(call, 1))
+    {
+      auto &arg = *call.vargs->at(0);
+      if (!arg.type.IsIntTy())
+        LOG(ERROR, call.loc, err_)
+            << call.func << "() expects an integer argument, got "
+            << arg.type.type;
+    }
+    call.type = CreateCgroupPath();
+  }
   else if (call.func == "printf" || call.func == "system" || call.func == "cat")
   {
     check_assignment(call, false, false, false);
@@ -921,8 +1196,12 @@ void SemanticAnalyser::visit(Call &call)
           // NOTE: modifying the type will break the resizing that happens
           // in the codegen. We have to copy the type here to avoid modification
           SizedType ty = (*iter)->type;
-          // Promote to 64-bit if it's not an aggregate type
-          if (!ty.IsAggregate() && !ty.IsTimestampTy())
+          // Promote to 64-bit if it's not an aggregate type. Integers keep
+          // their size, the event is packed.
+          size_t size = ty.GetSize();
+          bool is_int_size = size == 1 || size == 2 || size == 4;
+          if (!ty.IsAggregate() && !ty.IsTimestampTy() &&
+              !ty.IsDwarfStack() && !(ty.IsIntTy() && is_int_size))
             ty.SetSize(8);
           args.push_back(Field{
             .type =  ty,
@@ -941,8 +1220,18 @@ void SemanticAnalyser::visit(Call &call)
           LOG(ERROR, call.loc, err_) << msg;
         }
 
+        // Codegen packs the arguments after the id
+        uint64_t args_size = 8;
+        for (auto &arg : args)
+          args_size += arg.type.GetSize();
+        if (call.func != "printf" || single_provider_type() != ProbeType::iter)
+          reserve_scratch(args_size);
+
         if (call.func == "printf")
         {
+          for (auto iter = call.vargs->begin() + 1; iter != call.vargs->end();
+               iter++)
+            dwarf_stacks_.erase(dynamic_cast<Call *>(*iter));
           if (single_provider_type() == ProbeType::iter)
           {
             bpftrace_.seq_printf_args_.emplace_back(fmt.str, args);
@@ -951,6 +1240,11 @@ void SemanticAnalyser::visit(Call &call)
           else
           {
             bpftrace_.printf_args_.emplace_back(fmt.str, args);
+            // The slots of --flight-recorder fit the largest event
+            if (bpftrace_.flight_recorder_secs_ &&
+                args_size <= BPFtrace::FLIGHT_EVENT_MAX)
+              bpftrace_.flight_event_size_ = std::max(
+                  bpftrace_.flight_event_size_, args_size);
           }
         }
         else if (call.func == "system")
@@ -965,6 +1259,41 @@ void SemanticAnalyser::visit(Call &call)
   else if (call.func == "exit") {
     check_assignment(call, false, false, false);
     check_nargs(call, 0);
+    if (for_depth_)
+      LOG(ERROR, call.loc, err_)
+          << "exit() can't be used in the body of a for loop";
+  }
+  else if (call.func == "enable" || call.func == "disable") {
+    check_assignment(call, false, false, false);
+    needs_probe_gates_ = true;
+    if (check_nargs(call, 1)) {
+      auto &arg = *call.vargs->at(0);
+      if (!arg.type.IsStringTy() || !arg.is_literal)
+      {
+        LOG(ERROR, call.loc, err_)
+            << call.func << "() expects the name of a probe as a string "
+            << "literal, e.g. \"kprobe:vfs_read\"";
+      }
+      else
+      {
+        auto name = bpftrace_.get_string_literal(&arg);
+        bool found = false;
+        for (auto &gate : bpftrace_.probe_gates_)
+          found |= gate.second == name;
+        if (!found)
+          LOG(ERROR, call.loc, err_)
+              << call.func << "(): the program has no probe \"" << name
+              << "\", BEGIN and END can't be turned on and off";
+      }
+    }
+  }
+  else if (call.func == "dump") {
+    check_assignment(call, false, false, false);
+    check_nargs(call, 0);
+    if (!bpftrace_.flight_recorder_secs_)
+      LOG(ERROR, call.loc, err_)
+          << "dump() prints the events of --flight-recorder, which isn't "
+             "enabled";
   }
   else if (call.func == "print") {
     check_assignment(call, false, false, false);
@@ -1027,6 +1356,102 @@ void SemanticAnalyser::visit(Call &call)
       }
     }
   }
+  else if (call.func == "print_delta") {
+    check_assignment(call, false, false, false);
+    if (check_varargs(call, 1, 3)) {
+      auto &arg = *call.vargs->at(0);
+      if (!arg.is_map)
+        LOG(ERROR, call.loc, err_)
+            << "print_delta() expects a map to be provided";
+      else {
+        Map &map = static_cast<Map&>(arg);
+        map.skip_key_validation = true;
+        if (map.vargs != nullptr) {
+          LOG(ERROR, call.loc, err_)
+              << "The map passed to " << call.func << "() should not be "
+              << "indexed by a key";
+        }
+        if (is_final_pass() && !map.type.IsCountTy() && !map.type.IsSumTy() &&
+            !map.type.IsIntTy())
+        {
+          LOG(ERROR, call.loc, err_)
+              << "print_delta() expects a count(), sum() or integer map, "
+              << map.type << " provided";
+        }
+      }
+
+      if (is_final_pass())
+      {
+        if (call.vargs->size() > 1)
+          check_arg(call, Type::integer, 1, true);
+        if (call.vargs->size() > 2)
+          check_arg(call, Type::integer, 2, true);
+      }
+    }
+  }
+  else if (call.func == "quantiles") {
+    check_assignment(call, false, false, false);
+    if (check_varargs(call, 1, 9)) {
+      auto &arg = *call.vargs->at(0);
+      if (!arg.is_map)
+        LOG(ERROR, call.loc, err_)
+            << "quantiles() expects a map to be provided";
+      else {
+        Map &map = static_cast<Map&>(arg);
+        map.skip_key_validation = true;
+        if (map.vargs != nullptr) {
+          LOG(ERROR, call.loc, err_)
+              << "The map passed to " << call.func << "() should not be "
+              << "indexed by a key";
+        }
+        if (is_final_pass() && !map.type.IsHistTy() &&
+            !map.type.IsLhistTy() && !map.type.IsLlhistTy())
+        {
+          LOG(ERROR, call.loc, err_)
+              << "quantiles() expects a hist(), lhist() or llhist() map, "
+              << map.type << " provided";
+        }
+      }
+
+      // Quantiles are given in percent, either as integers or as strings for
+      // fractions, e.g. "99.9"
+      std::vector<double> quantiles;
+      for (size_t i = 1; i < call.vargs->size(); i++)
+      {
+        auto *q = call.vargs->at(i);
+        double value = -1;
+        if (auto *integer = dynamic_cast<Integer *>(q))
+          value = integer->n;
+        else if (auto *string = dynamic_cast<String *>(q))
+        {
+          auto &str = string->str;
+          char *end;
+          value = std::strtod(str.c_str(), &end);
+          if (str.empty() || *end != '\0')
+            value = -1;
+        }
+        else
+        {
+          LOG(ERROR, call.loc, err_)
+              << "quantiles() expects integer or string literals for the "
+                 "quantiles";
+          continue;
+        }
+
+        if (!(value > 0 && value <= 100))
+        {
+          LOG(ERROR, call.loc, err_)
+              << "quantiles() percentiles must be in (0, 100]";
+        }
+        quantiles.push_back(value);
+      }
+      if (quantiles.empty())
+        quantiles = { 50, 90, 99, 99.9 };
+
+      if (is_final_pass())
+        bpftrace_.quantiles_args_.emplace_back(quantiles);
+    }
+  }
   else if (call.func == "clear") {
     check_assignment(call, false, false, false);
     if (check_nargs(call, 1)) {
@@ -1177,6 +1602,48 @@ void SemanticAnalyser::visit(Call &call)
                                    << "'kfunc', 'kretfunc', 'iter' probes";
     }
   }
+  else if (call.func == "counter")
+  {
+    if (!bpftrace_.feature_->has_helper_perf_event_read_value())
+    {
+      LOG(ERROR, call.loc, err_) << "BPF_FUNC_perf_event_read_value not "
+                                    "available for your kernel version";
+    }
+
+    if (check_nargs(call, 1) && check_arg(call, Type::string, 0, true))
+    {
+      auto event = bpftrace_.get_string_literal(call.vargs->at(0));
+      auto &attach_points = *probe_->attach_points;
+      if (attach_points.size() != 1 ||
+          probetype(attach_points[0]->provider) != ProbeType::hardware)
+      {
+        LOG(ERROR, call.loc, err_)
+            << call.func << "() can only be used in a probe with a single "
+            << "hardware attach point";
+      }
+      else if (hardware_events(attach_points[0]->target).size() < 2 ||
+               hardware_event_index(attach_points[0]->target, event) < 0)
+      {
+        LOG(ERROR, call.loc, err_)
+            << event << " isn't one of the events of a group counted by "
+            << attach_points[0]->name(attach_points[0]->func);
+      }
+    }
+    call.type = CreateUInt64();
+  }
+  else if (call.func == "sample" || call.func == "ratelimit")
+  {
+    if (check_nargs(call, 1) && check_arg(call, Type::integer, 0, true))
+    {
+      auto &arg = static_cast<Integer &>(*call.vargs->at(0));
+      if (arg.n < 1)
+        LOG(ERROR, call.loc, err_)
+            << call.func << "() requires a positive integer literal";
+    }
+    if (is_final_pass())
+      sample_sites_++;
+    call.type = CreateUInt64();
+  }
   else if (call.func == "strncmp") {
     if (check_nargs(call, 3)) {
       check_arg(call, Type::string, 0);
@@ -1190,6 +1657,30 @@ void SemanticAnalyser::visit(Call &call)
     }
     call.type = CreateUInt64();
   }
+  else if (call.func == "glob" || call.func == "strcontains")
+  {
+    // The pattern is compiled into the program, see StrMatcher
+    if (check_nargs(call, 2))
+    {
+      check_arg(call, Type::string, 0);
+      if (check_arg(call, Type::string, 1, true))
+      {
+        auto pattern = bpftrace_.get_string_literal(call.vargs->at(1));
+        try
+        {
+          if (call.func == "glob")
+            StrMatcher::glob(pattern);
+          else
+            StrMatcher::contains(pattern);
+        }
+        catch (const std::invalid_argument &e)
+        {
+          LOG(ERROR, call.loc, err_) << call.func << "(): " << e.what();
+        }
+      }
+    }
+    call.type = CreateUInt64();
+  }
   else if (call.func == "override")
   {
     if (!bpftrace_.feature_->has_helper_override_return())
@@ -1270,6 +1761,10 @@ void SemanticAnalyser::visit(Call &call)
 void SemanticAnalyser::check_stack_call(Call &call, bool kernel)
 {
   call.type = CreateStack(kernel);
+  if (kernel)
+    bpftrace_.needs_ksyms_ = true;
+  else
+    needs_raw_symbols_pids_ = true;
   if (!check_varargs(call, 0, 2))
   {
     return;
@@ -1327,18 +1822,84 @@ void SemanticAnalyser::check_stack_call(Call &call, bool kernel)
         << call.func << "([int limit]): limit shouldn't exceed "
         << MAX_STACK_SIZE << ", " << stack_type.limit << " given";
   }
+  // The kernel has no build IDs for its own frames, and its stacks are
+  // always unwound by the kernel
+  bool build_id = stack_type.mode == bpftrace::StackMode::build_id;
+  bool dwarf = stack_type.mode == bpftrace::StackMode::dwarf;
+  if (kernel && (build_id || dwarf))
+  {
+    LOG(ERROR, call.loc, err_)
+        << "kstack() doesn't support the " << (build_id ? "build_id" : "dwarf")
+        << " mode, only ustack() does";
+  }
   call.type = CreateStack(kernel, stack_type);
-  needs_stackid_maps_.insert(stack_type);
+  if (kernel || !dwarf)
+  {
+    needs_stackid_maps_.insert(stack_type);
+    return;
+  }
+
+  // The registers and the stack are copied as they were when the probe
+  // fired, unwinding them is left to userspace
+  if (arch::name() != "x86_64")
+  {
+    LOG(ERROR, call.loc, err_)
+        << arch::name() << " doesn't support ustack(dwarf)";
+  }
+  for (auto &attach_point : *probe_->attach_points)
+  {
+    ProbeType type = probetype(attach_point->provider);
+    if (type != ProbeType::uprobe && type != ProbeType::uretprobe &&
+        type != ProbeType::usdt && type != ProbeType::profile &&
+        type != ProbeType::software && type != ProbeType::hardware)
+    {
+      LOG(ERROR, call.loc, err_)
+          << "ustack(dwarf) can only be used with uprobes, usdt, profile, "
+             "software and hardware probes";
+      break;
+    }
+  }
+  // Written in place in the printf() event, which takes the scratch space
+  dwarf_stacks_.insert(&call);
+}
+
+// How narrow the value of an integer map key is known to be, before it's
+// widened to 64 bits, see MapKey::pack()
+static MapKey::Width key_width(const Expression &expr)
+{
+  if (!expr.type.IsIntTy())
+    return MapKey::Width::any;
+  if (expr.type.GetSize() <= 4)
+    return expr.type.IsSigned() ? MapKey::Width::s32 : MapKey::Width::u32;
+  // Including the casts to 64 bits added to the keys by earlier passes,
+  // which extend as the type they cast to is signed
+  auto cast = dynamic_cast<const Cast *>(&expr);
+  if (cast && cast->expr->type.IsIntTy())
+  {
+    auto width = key_width(*cast->expr);
+    if (width == MapKey::Width::any || cast->expr->type.GetSize() == 8)
+      return width;
+    return expr.type.IsSigned() ? MapKey::Width::s32 : MapKey::Width::u32;
+  }
+  // IDs and CPU numbers, which are 32-bit in the kernel
+  auto builtin = dynamic_cast<const Builtin *>(&expr);
+  if (builtin && (builtin->ident == "pid" || builtin->ident == "tid" ||
+                  builtin->ident == "uid" || builtin->ident == "gid" ||
+                  builtin->ident == "cpu"))
+    return MapKey::Width::u32;
+  return MapKey::Width::any;
 }
 
 void SemanticAnalyser::visit(Map &map)
 {
   MapKey key;
+  std::vector<MapKey::Width> widths;
 
   if (map.vargs) {
     for (unsigned int i = 0; i < map.vargs->size(); i++){
       Expression * expr = map.vargs->at(i);
       expr->accept(*this);
+      widths.push_back(key_width(*expr));
 
       // Insert a cast to 64 bits if needed by injecting
       // a cast into the ast.
@@ -1362,21 +1923,25 @@ void SemanticAnalyser::visit(Map &map)
                " array instead (eg `@map[$1, $2] = ...)`.";
       }
 
-      if (is_final_pass()) {
-        if (expr->type.IsNoneTy())
-          LOG(ERROR, expr->loc, err_) << "Invalid expression for assignment: ";
+      if (is_final_pass() && expr->type.IsNoneTy())
+        LOG(ERROR, expr->loc, err_) << "Invalid expression for assignment: ";
 
-        SizedType keytype = expr->type;
-        // Skip.IsSigned() when comparing keys to not break existing scripts
-        // which use maps as a lookup table
-        // TODO (fbs): This needs a better solution
-        if (expr->type.IsIntTy())
-          keytype = CreateUInt(keytype.GetSize() * 8);
-        key.args_.push_back(keytype);
-      }
+      SizedType keytype = expr->type;
+      // Skip.IsSigned() when comparing keys to not break existing scripts
+      // which use maps as a lookup table
+      // TODO (fbs): This needs a better solution
+      if (expr->type.IsIntTy())
+        keytype = CreateUInt(keytype.GetSize() * 8);
+      key.args_.push_back(keytype);
     }
   }
 
+  if (!map.skip_key_validation &&
+      std::none_of(key.args_.begin(), key.args_.end(), [](auto &arg) {
+        return arg.IsNoneTy();
+      }))
+    seen_map_keys_[map.ident] = key;
+
   if (is_final_pass()) {
     if (!map.skip_key_validation) {
       auto search = map_key_.find(map.ident);
@@ -1392,7 +1957,38 @@ void SemanticAnalyser::visit(Map &map)
       else {
         map_key_.insert({map.ident, key});
       }
+
+      auto seen_widths = map_key_widths_.emplace(map.ident, widths);
+      auto &map_widths = seen_widths.first->second;
+      for (size_t i = 0; i < map_widths.size() && i < widths.size(); i++)
+      {
+        if (map_widths[i] != widths[i])
+          map_widths[i] = MapKey::Width::any;
+      }
+
+      auto builtin = map.vargs && map.vargs->size() == 1
+                         ? dynamic_cast<Builtin *>(map.vargs->at(0))
+                         : nullptr;
+      std::string builtin_key = builtin ? builtin->ident : "";
+      auto builtin_keys = map_builtin_keys_.emplace(map.ident, builtin_key);
+      if (builtin_keys.first->second != builtin_key)
+        builtin_keys.first->second = "";
     }
+    else if (func_ == "clear" && is_end_probe())
+      map_end_cleared_.insert(map.ident);
+    else
+      map_userspace_.insert(map.ident);
+  }
+
+  // The keys of bloom maps can't be listed nor taken out
+  if (is_final_pass() && is_bloom(map.ident) &&
+      (func_ == "delete" ||
+       (!map.vargs && (func_ == "print" || func_ == "print_delta" ||
+                       func_ == "clear" || func_ == "zero"))))
+  {
+    LOG(ERROR, map.loc, err_)
+        << map.ident << ": bloom maps only support adding a key, with "
+        << map.ident << "[key] = 1, and looking it up";
   }
 
   auto search_val = map_val_.find(map.ident);
@@ -1409,6 +2005,15 @@ void SemanticAnalyser::visit(Map &map)
 
 void SemanticAnalyser::visit(Variable &var)
 {
+  if (for_depth_ && for_outer_vars_.count(var.ident))
+  {
+    LOG(ERROR, var.loc, err_)
+        << var.ident << ": variables of the probe can't be used in the body "
+        << "of a for loop";
+    var.type = CreateNone();
+    return;
+  }
+
   auto search_val = variable_val_.find(var.ident);
   if (search_val != variable_val_.end()) {
     var.type = search_val->second;
@@ -1670,6 +2275,10 @@ void SemanticAnalyser::visit(Unop &unop)
     if (unop.expr->is_map) {
       Map &map = static_cast<Map&>(*unop.expr);
       assign_map_type(map, CreateInt64());
+      if (is_bloom(map.ident))
+        LOG(ERROR, unop.loc, err_)
+            << map.ident << ": the keys of bloom maps are added with "
+            << map.ident << "[key] = 1";
     }
   }
 
@@ -1826,7 +2435,11 @@ void SemanticAnalyser::visit(Jump &jump)
   switch (jump.ident)
   {
     case bpftrace::Parser::token::RETURN:
-      // return can be used outside of loops
+      // return can be used outside of loops, but not to leave a for loop's
+      // callback
+      if (for_depth_)
+        LOG(ERROR, jump.loc, err_)
+            << "return can't be used in the body of a for loop";
       break;
     case bpftrace::Parser::token::BREAK:
     case bpftrace::Parser::token::CONTINUE:
@@ -1854,6 +2467,83 @@ void SemanticAnalyser::visit(While &while_block)
   loop_depth_--;
 }
 
+void SemanticAnalyser::visit(For &for_loop)
+{
+  if (is_final_pass() && !bpftrace_.feature_->has_helper_for_each_map_elem())
+  {
+    LOG(ERROR, for_loop.loc, err_)
+        << "for loops need bpf_for_each_map_elem(), which the kernel doesn't "
+           "support (Linux 5.13)";
+  }
+
+  Map &map = *for_loop.map;
+  map.skip_key_validation = true;
+  map.accept(*this);
+  iterated_maps_.insert(map.ident);
+
+  // $kv is (key, value), the types are known once the map has been used
+  // with a key and assigned
+  SizedType kv_type = CreateNone();
+  auto key = is_final_pass() ? map_key_.find(map.ident)
+                             : seen_map_keys_.find(map.ident);
+  auto end = is_final_pass() ? map_key_.end() : seen_map_keys_.end();
+  if (key != end && key->second.args_.size() == 1 && !map.type.IsNoneTy())
+    kv_type = CreateTuple({ key->second.args_[0], map.type });
+
+  if (is_final_pass() && key != end)
+  {
+    auto decl = map_decls_.find(map.ident);
+    const SizedType &type = map.type;
+    if (key->second.args_.size() != 1)
+    {
+      LOG(ERROR, for_loop.loc, err_)
+          << "for loops need a map with a single key, " << map.ident
+          << " has " << key->second.args_.size();
+    }
+    else if (type.IsCountTy() || type.IsSumTy() || type.IsMinTy() ||
+             type.IsMaxTy() || type.IsAvgTy() || type.IsStatsTy() ||
+             type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy() ||
+             type.IsDistinctTy() || type.IsCmsTy())
+    {
+      LOG(ERROR, for_loop.loc, err_)
+          << "for loops can't run over " << map.ident << ", the values of "
+          << type << "() maps are per-CPU";
+    }
+    else if (decl != map_decls_.end() && decl->second.type != "hash")
+    {
+      LOG(ERROR, for_loop.loc, err_)
+          << "for loops can't run over " << map.ident << ", it is declared "
+          << decl->second.type;
+    }
+  }
+
+  auto &ident = for_loop.decl->ident;
+  if (variable_val_.count(ident))
+  {
+    LOG(ERROR, for_loop.decl->loc, err_)
+        << ident << " is used by the probe already, for loops need a "
+        << "variable of their own";
+  }
+
+  // The body is a function of its own, only $kv is in scope there
+  auto variables = std::move(variable_val_);
+  auto outer_vars = for_outer_vars_;
+  for (auto &var : variables)
+    for_outer_vars_.insert(var.first);
+  variable_val_.clear();
+  variable_val_[ident] = kv_type;
+  for_loop.decl->type = kv_type;
+
+  loop_depth_++;
+  for_depth_++;
+  accept_statements(for_loop.stmts);
+  for_depth_--;
+  loop_depth_--;
+
+  variable_val_ = std::move(variables);
+  for_outer_vars_ = std::move(outer_vars);
+}
+
 void SemanticAnalyser::visit(FieldAccess &acc)
 {
   // A field access must have a field XOR index
@@ -2092,6 +2782,7 @@ void SemanticAnalyser::visit(Tuple &tuple)
   }
 
   tuple.type = CreateTuple(elements);
+  reserve_scratch(tuple.type.GetSize());
 }
 
 void SemanticAnalyser::visit(ExprStatement &expr)
@@ -2109,6 +2800,15 @@ void SemanticAnalyser::visit(AssignMapStatement &assignment)
   const std::string &map_ident = assignment.map->ident;
   auto type = assignment.expr->type;
 
+  // Only whether a key was added is kept
+  auto *one = dynamic_cast<Integer *>(assignment.expr);
+  if (is_bloom(map_ident) && (!one || one->n != 1))
+  {
+    LOG(ERROR, assignment.loc, err_)
+        << map_ident << ": the keys of bloom maps are added with "
+        << map_ident << "[key] = 1";
+  }
+
   if (type.IsRecordTy())
   {
     std::string ty = assignment.expr->type.GetName();
@@ -2172,6 +2872,20 @@ void SemanticAnalyser::visit(AssignMapStatement &assignment)
     // bpf_map_update_elem() only accepts a pointer to a element in the stack
     LOG(ERROR, assignment.loc, err_) << "context cannot be assigned to a map";
   }
+  else if ((type.IsDistinctTy() || type.IsCmsTy()) &&
+           !dynamic_cast<Call *>(assignment.expr))
+  {
+    LOG(ERROR, assignment.loc, err_)
+        << (type.IsCmsTy() ? "cms_count()" : "distinct()")
+        << " values can only be printed, not assigned to a map";
+  }
+  else if ((type.IsAvgTy() || type.IsStatsTy()) &&
+           !dynamic_cast<Call *>(assignment.expr))
+  {
+    // The value is the count and the total
+    LOG(ERROR, assignment.loc, err_)
+        << type << "() values can only be printed, not assigned to a map";
+  }
   else if (type.IsTupleTy())
   {
     // Early passes may not have been able to deduce the full types of tuple
@@ -2210,6 +2924,12 @@ void SemanticAnalyser::visit(AssignVarStatement &assignment)
   assignment.expr->accept(*this);
 
   std::string var_ident = assignment.var->ident;
+  if (for_depth_ && for_outer_vars_.count(var_ident))
+  {
+    LOG(ERROR, assignment.loc, err_)
+        << var_ident << ": variables of the probe can't be used in the body "
+        << "of a for loop";
+  }
   auto search = variable_val_.find(var_ident);
   assignment.var->type = assignment.expr->type;
 
@@ -2219,6 +2939,19 @@ void SemanticAnalyser::visit(AssignVarStatement &assignment)
     LOG(ERROR, assignment.loc, err_) << "args cannot be assigned to a variable";
   }
 
+  if (assignment.expr->type.IsDistinctTy() || assignment.expr->type.IsCmsTy())
+  {
+    LOG(ERROR, assignment.loc, err_)
+        << (assignment.expr->type.IsCmsTy() ? "cms_count()" : "distinct()")
+        << " values can only be printed, not assigned to a variable";
+  }
+  else if (assignment.expr->type.IsAvgTy() || assignment.expr->type.IsStatsTy())
+  {
+    LOG(ERROR, assignment.loc, err_)
+        << assignment.expr->type
+        << "() values can only be printed, not assigned to a variable";
+  }
+
   if (search != variable_val_.end()) {
     if (search->second.IsNoneTy())
     {
@@ -2324,6 +3057,19 @@ void SemanticAnalyser::visit(AttachPoint &ap)
 {
   ap.provider = probetypeName(ap.provider);
 
+  if (!ap.cpus.empty() && !listing_)
+  {
+    // Only set for profile, interval and hardware probes
+    try
+    {
+      get_probe_cpus(ap.cpus);
+    }
+    catch (const std::exception &ex)
+    {
+      LOG(ERROR, ap.loc, err_) << ex.what();
+    }
+  }
+
   if (ap.provider == "kprobe" || ap.provider == "kretprobe") {
     if (ap.target != "")
       LOG(ERROR, ap.loc, err_) << "kprobes should not have a target";
@@ -2366,6 +3112,10 @@ void SemanticAnalyser::visit(AttachPoint &ap)
   }
   else if (ap.provider == "usdt") {
     bpftrace_.has_usdt_ = true;
+    if (has_child_ && bpftrace_.child_runs_ > 1)
+      LOG(ERROR, ap.loc, err_)
+          << "usdt probes cannot be used with --repeat, they'd only be "
+             "enabled for the first run of the command";
     if (ap.func == "")
       LOG(ERROR, ap.loc, err_)
           << "usdt probe must have a target function or wildcard";
@@ -2416,6 +3166,20 @@ void SemanticAnalyser::visit(AttachPoint &ap)
     if (ap.target == "" || ap.func == "")
       LOG(ERROR, ap.loc, err_) << "tracepoint probe must have a target";
   }
+  else if (ap.provider == "rawtracepoint")
+  {
+    if (ap.target == "" || ap.func == "")
+      LOG(ERROR, ap.loc, err_) << "rawtracepoint probe must have a target";
+    else if (!bpftrace_.feature_->has_prog_raw_tracepoint())
+      LOG(ERROR, ap.loc, err_)
+          << "rawtracepoint not available for your kernel version.";
+
+    // The arguments of the event, for args, when there's BTF
+    ap_args_.clear();
+    auto it = bpftrace_.btf_ap_args_.find(probe_->name());
+    if (!listing_ && it != bpftrace_.btf_ap_args_.end())
+      ap_args_.insert(it->second.begin(), it->second.end());
+  }
   else if (ap.provider == "profile") {
     if (ap.target == "")
       LOG(ERROR, ap.loc, err_) << "profile probe must have unit of time";
@@ -2521,19 +3285,24 @@ void SemanticAnalyser::visit(AttachPoint &ap)
     else {
       if (!has_wildcard(ap.target) && !ap.ignore_invalid)
       {
-        bool found = false;
-        for (auto &probeListItem : HW_PROBE_LIST)
+        auto events = hardware_events(ap.target);
+        std::set<const ProbeListItem *> seen;
+        for (auto &event : events)
         {
-          if (ap.target == probeListItem.path ||
-              (!probeListItem.alias.empty() &&
-               ap.target == probeListItem.alias))
-          {
-            found = true;
-            break;
-          }
+          auto item = hardware_event(event);
+          if (!item)
+            LOG(ERROR, ap.loc, err_) << event + " is not a hardware probe";
+          else if (!seen.insert(item).second)
+            LOG(ERROR, ap.loc, err_)
+                << event << " is counted twice by " << ap.target;
+        }
+        if (events.size() > 1 && is_final_pass())
+        {
+          // The other events are counted along with the leader, for
+          // counter() to read them
+          ap.counter_slot = counter_slots_;
+          counter_slots_ += events.size();
         }
-        if (!found)
-          LOG(ERROR, ap.loc, err_) << ap.target + " is not a hardware probe";
       }
       else if (!listing_)
       {
@@ -2625,6 +3394,14 @@ void SemanticAnalyser::visit(AttachPoint &ap)
       LOG(ERROR, ap.loc, err_)
           << "iter " << ap.func << " not available for your kernel version.";
     }
+
+    if (ap.target != "" && ap.target != "ms" && ap.target != "s" &&
+        ap.target != "us" && ap.target != "hz")
+      LOG(ERROR, ap.loc, err_)
+          << ap.target << " is not an accepted unit of time";
+    else if (ap.target != "" && ap.freq <= 0)
+      LOG(ERROR, ap.loc, err_)
+          << "iter probe interval should be a positive integer";
   }
   else {
     LOG(ERROR, ap.loc, err_) << "Invalid provider: '" << ap.provider << "'";
@@ -2638,6 +3415,35 @@ void SemanticAnalyser::visit(Probe &probe)
   // Clear out map of variable names - variables should be probe-local
   variable_val_.clear();
   probe_ = &probe;
+  probe_scratch_ = 0;
+  dwarf_stacks_.clear();
+
+  // Runs are counted by probe id, so the matches of a probe are told apart
+  // the way the probe builtin does. Single matches already have their own.
+  if (bpftrace_.probe_counts_)
+  {
+    bool matches = aps > 1;
+    for (AttachPoint *ap : *probe.attach_points)
+      matches |= has_wildcard(ap->target) || has_wildcard(ap->func);
+    if (has_probe_cookies())
+      probe.use_cookies = true;
+    else if (matches && has_probe_ids_at_load())
+      probe.probe_ids_at_load = true;
+    else if (matches)
+      probe.need_expansion = true;
+
+    if (is_final_pass())
+    {
+      for (AttachPoint *ap : *probe.attach_points)
+      {
+        if (!matches || ap->provider == "BEGIN" || ap->provider == "END")
+          probe_count_ids_++;
+        else
+          probe_count_ids_ +=
+              bpftrace_.probe_matcher_->get_matches_for_ap(*ap).size();
+      }
+    }
+  }
 
   for (AttachPoint *ap : *probe.attach_points) {
     if (!listing_ && aps > 1 && ap->provider == "iter")
@@ -2652,17 +3458,211 @@ void SemanticAnalyser::visit(Probe &probe)
   }
   if (probe.stmts)
   {
-    for (Statement *stmt : *probe.stmts)
+    for (size_t i = 0; i < probe.stmts->size(); i++)
     {
-      stmt->accept(*this);
+      probe.stmts->at(i)->accept(*this);
+      if (is_final_pass())
+        find_print_clear(probe.stmts, i);
     }
   }
+
+  if (is_final_pass())
+  {
+    // The stack is too big for a map value and meaningless to compare, it's
+    // only sent through the printf() event to be unwound
+    for (Call *call : dwarf_stacks_)
+      LOG(ERROR, call->loc, err_)
+          << "ustack(dwarf) can only be printed by printf()";
+    probe.need_scratch = probe_scratch_ > 0;
+    bpftrace_.scratch_size_ = std::max(bpftrace_.scratch_size_,
+                                       probe_scratch_);
+    split_probe(probe);
+  }
+}
+
+// Whether a map can be an array indexed by its key, see IMap::dense_
+static bool can_be_dense(const SizedType &type, const MapKey &key)
+{
+  return key.args_.size() == 1 && key.args_[0].IsIntTy() &&
+         (type.IsCountTy() || type.IsSumTy() || type.IsIntTy());
+}
+
+// Most slots a window map is split into, the slots are at least a second
+// long
+const uint32_t WINDOW_SLOTS_MAX = 60;
+
+// Whether the values of a map can be added up across the slots of a window,
+// see IMap::make_windowed()
+static bool can_be_windowed(const SizedType &type)
+{
+  return type.IsCountTy() || type.IsSumTy() || type.IsAvgTy() ||
+         type.IsStatsTy() || type.IsHistTy() || type.IsLhistTy();
 }
 
 void SemanticAnalyser::visit(Program &program)
 {
+  map_decls_.clear();
+  if (program.map_decls)
+  {
+    for (auto &decl : *program.map_decls)
+    {
+      if (decl.type != "hash" && decl.type != "array" &&
+          decl.type != "window" && decl.type != "bloom" && decl.type != "ttl")
+      {
+        LOG(ERROR, decl.loc, err_)
+            << "Unknown map type: '" << decl.type
+            << "', expected 'hash', 'array', 'window', 'bloom' or 'ttl'";
+      }
+      // Other tools would try to list their keys
+      if (decl.type == "bloom" && !bpftrace_.pin_maps_dir_.empty())
+        LOG(ERROR, decl.loc, err_)
+            << decl.ident << ": bloom maps can't be pinned";
+      if (decl.type == "window")
+      {
+        if (decl.max_entries < 1)
+          LOG(ERROR, decl.loc, err_)
+              << decl.ident << ": the window must be at least 1 second";
+        // Other tools would only see the current slot
+        if (!bpftrace_.pin_maps_dir_.empty())
+          LOG(ERROR, decl.loc, err_)
+              << decl.ident << ": window maps can't be pinned";
+      }
+      else if (decl.type == "ttl")
+      {
+        if (decl.max_entries < 1)
+          LOG(ERROR, decl.loc, err_)
+              << decl.ident << ": the ttl must be at least 1 second";
+      }
+      else if (decl.max_entries < 1)
+      {
+        LOG(ERROR, decl.loc, err_)
+            << decl.ident << ": the number of entries must be at least 1";
+      }
+      if (!map_decls_.emplace(decl.ident, decl).second)
+      {
+        LOG(ERROR, decl.loc, err_)
+            << decl.ident << " is declared more than once";
+      }
+    }
+  }
+
+  // Every probe but BEGIN, END and those bpftrace runs itself gets a gate,
+  // enable() and disable() can name any of its attach points
+  bpftrace_.probe_gates_.clear();
+  uint32_t gates = 0;
+  for (Probe *probe : *program.probes)
+  {
+    bool gated = !probe->self_profile && !probe->target_tracking &&
+                 !probe->flush_events;
+    for (AttachPoint *ap : *probe->attach_points)
+      gated &= ap->provider != "BEGIN" && ap->provider != "END";
+    if (!gated)
+      continue;
+    probe->gate = gates++;
+    for (AttachPoint *ap : *probe->attach_points)
+      bpftrace_.probe_gates_.emplace_back(probe->gate, ap->name(ap->func));
+  }
+
   for (Probe *probe : *program.probes)
     probe->accept(*this);
+
+  // The iter probes are run by a loop of their own, see BPFtrace::run_iter()
+  if (!listing_)
+  {
+    AttachPoint *iter = nullptr, *other = nullptr;
+    for (Probe *probe : *program.probes)
+      for (AttachPoint *ap : *probe->attach_points)
+        (ap->provider == "iter" ? iter : other) = ap;
+    if (iter && other)
+      LOG(ERROR, other->loc, err_)
+          << "iter probes can't be mixed with other probes";
+  }
+
+  if (is_final_pass() && program.map_decls)
+  {
+    for (auto &decl : *program.map_decls)
+    {
+      auto val = map_val_.find(decl.ident);
+      if (val == map_val_.end())
+      {
+        LOG(WARNING, decl.loc, out_)
+            << decl.ident << " is declared but never used";
+        continue;
+      }
+      if (decl.type == "array" && !can_be_dense(val->second,
+                                                 map_key_[decl.ident]))
+      {
+        LOG(ERROR, decl.loc, err_)
+            << decl.ident << ": array maps need a single integer key and "
+            << "count(), sum() or integer values";
+      }
+      if (decl.type == "bloom" && map_key_[decl.ident].args_.empty())
+      {
+        LOG(ERROR, decl.loc, err_)
+            << decl.ident << ": bloom maps need a key";
+      }
+      if (decl.type == "ttl" && (map_key_[decl.ident].args_.empty() ||
+                                 val->second.IsCmsTy()))
+      {
+        LOG(ERROR, decl.loc, err_)
+            << decl.ident << ": ttl maps need a key, and can't hold "
+            << "cms_count() values";
+      }
+      if (decl.type == "window" && !can_be_windowed(val->second))
+      {
+        LOG(ERROR, decl.loc, err_)
+            << decl.ident << ": window maps need count(), sum(), avg(), "
+            << "stats(), hist() or lhist() values";
+      }
+    }
+  }
+}
+
+// Whether two types, tuple elements included, are the same
+static bool same_type(const SizedType &x, const SizedType &y)
+{
+  if (x != y || x.is_internal != y.is_internal || x.GetAS() != y.GetAS())
+    return false;
+  if (!x.IsTupleTy())
+    return true;
+  auto &xf = x.GetFields(), &yf = y.GetFields();
+  return std::equal(
+      xf.begin(), xf.end(), yf.begin(), yf.end(), [](auto &f, auto &g) {
+        return same_type(f.type, g.type);
+      });
+}
+
+static bool same_types(const std::vector<SizedType> &a,
+                       const std::vector<SizedType> &b)
+{
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(), same_type);
+}
+
+// Whether the types by map of a and b are the same
+template <typename T, typename F>
+static bool same_map_types(const std::map<std::string, T> &a,
+                           const std::map<std::string, T> &b,
+                           F same)
+{
+  return std::equal(
+      a.begin(), a.end(), b.begin(), b.end(), [&](auto &x, auto &y) {
+        return x.first == y.first && same(x.second, y.second);
+      });
+}
+
+// Types of the arguments the maps were first called with, which later
+// passes may still change
+std::map<std::string, std::vector<SizedType>> SemanticAnalyser::
+    map_arg_types() const
+{
+  std::map<std::string, std::vector<SizedType>> types;
+  for (auto &[name, args] : map_args_)
+  {
+    auto &arg_types = types[name];
+    for (auto *arg : args)
+      arg_types.push_back(arg->type);
+  }
+  return types;
 }
 
 int SemanticAnalyser::analyse()
@@ -2673,12 +3673,33 @@ int SemanticAnalyser::analyse()
   int num_passes = listing_ ? 1 : num_passes_;
   for (pass_ = 1; pass_ <= num_passes; pass_++)
   {
+    // Variables start over with each probe, what one pass hands the next
+    // is in the maps: the types of their values, of their keys and of the
+    // arguments they are called with, and the widths of their keys. A pass
+    // that didn't change them would only be repeated by the next ones until
+    // the final pass.
+    auto map_val = map_val_;
+    auto map_arg_types = this->map_arg_types();
+    auto map_key_widths = map_key_widths_;
+    auto seen_map_keys = seen_map_keys_;
+
     root_->accept(*this);
     errors = err_.str();
     if (!errors.empty()) {
       out_ << errors;
       return pass_;
     }
+
+    if (pass_ < num_passes - 1 &&
+        same_map_types(map_val_, map_val, same_type) &&
+        same_map_types(this->map_arg_types(), map_arg_types, same_types) &&
+        same_map_types(seen_map_keys_,
+                       seen_map_keys,
+                       [](const MapKey &a, const MapKey &b) {
+                         return same_types(a.args_, b.args_);
+                       }) &&
+        map_key_widths_ == map_key_widths)
+      pass_ = num_passes - 1;
   }
 
   return 0;
@@ -2715,7 +3736,76 @@ int SemanticAnalyser::create_maps_impl(void)
 
     auto &key = search_args->second;
 
-    if (type.IsLhistTy())
+    uint64_t max_entries = bpftrace_.mapmax_;
+    bool dense = false;
+    uint64_t window_seconds = 0;
+    uint64_t ttl_seconds = 0;
+    auto decl = map_decls_.find(map_name);
+    if (decl != map_decls_.end() && decl->second.type == "window")
+    {
+      // The slots are all of the default size
+      window_seconds = decl->second.max_entries;
+    }
+    else if (decl != map_decls_.end() && decl->second.type == "ttl")
+    {
+      ttl_seconds = decl->second.max_entries;
+    }
+    else if (decl != map_decls_.end())
+    {
+      max_entries = decl->second.max_entries;
+      dense = decl->second.type == "array";
+    }
+    else if ((type.IsCountTy() || type.IsSumTy()) &&
+             map_builtin_keys_[map_name] == "cpu")
+    {
+      // cpu is always one of the possible CPUs
+      max_entries = get_possible_cpus().back() + 1;
+      dense = true;
+    }
+
+    // Start timestamps and the like of the current thread, which are only
+    // cleared on exit, live as long as the thread does without taking up
+    // hash map entries. The off-CPU start times are never printed.
+    bool task_storage = decl == map_decls_.end() && type.IsIntTy() &&
+                        map_builtin_keys_[map_name] == "tid" &&
+                        (map_end_cleared_.count(map_name) ||
+                         map_name == BPFtrace::OFF_CPU_START_MAP) &&
+                        !map_userspace_.count(map_name) &&
+                        bpftrace_.feature_->has_task_storage();
+
+    // Pinned maps are read by other tools, which don't know of the strings
+    // map, and for loops hand the key to the program as it is stored
+    bool iterated = iterated_maps_.count(map_name);
+    bool hashed_key = bpftrace_.hash_str_keys_ && key.args_.size() == 1 &&
+                      key.args_[0].IsStringTy() && !type.IsCmsTy() &&
+                      bpftrace_.pin_maps_dir_.empty() && !window_seconds &&
+                      !is_bloom(map_name) && !iterated;
+    // Keys are packed unless seen by others as they are stored, as hashed
+    // keys are
+    key.packed_.clear();
+    if (!hashed_key && !dense && !iterated && !type.IsCmsTy() &&
+        !is_bloom(map_name) && bpftrace_.pin_maps_dir_.empty())
+      key.pack(map_key_widths_[map_name]);
+    // Userspace splits the arrays into buckets, others would see them as
+    // they are stored
+    bool bucket_array = bpftrace_.hist_arrays_ &&
+                        (type.IsHistTy() || type.IsLhistTy()) &&
+                        !key.args_.empty() && !dense && !iterated &&
+                        bpftrace_.pin_maps_dir_.empty();
+    // The slots are looked up rather than addressed directly
+    bool mmapable = bpftrace_.feature_->has_map_mmapable() && !window_seconds &&
+                    !ttl_seconds;
+
+    std::unique_ptr<T> map;
+    if (is_bloom(map_name))
+    {
+      map = create_bloom_map<T>(map_name,
+                                type,
+                                key,
+                                max_entries,
+                                bpftrace_.feature_->has_map_bloom_filter());
+    }
+    else if (type.IsLhistTy())
     {
       auto map_args = map_args_.find(map_name);
       if (map_args == map_args_.end())
@@ -2730,24 +3820,118 @@ int SemanticAnalyser::create_maps_impl(void)
       Integer &min = static_cast<Integer &>(min_arg);
       Integer &max = static_cast<Integer &>(max_arg);
       Integer &step = static_cast<Integer &>(step_arg);
-      auto map = std::make_unique<T>(
-          map_name, type, key, min.n, max.n, step.n, bpftrace_.mapmax_);
-      failed_maps += is_invalid_map(map->mapfd_);
-      bpftrace_.maps.Add(std::move(map));
+      bucket_array &= IMap::hist_buckets(type, min.n, max.n, step.n) <=
+                      IMap::BUCKET_ARRAY_MAX;
+      map = std::make_unique<T>(map_name,
+                                type,
+                                key,
+                                min.n,
+                                max.n,
+                                step.n,
+                                max_entries,
+                                bpftrace_.map_alloc_,
+                                mmapable,
+                                false,
+                                false,
+                                hashed_key,
+                                bucket_array);
+    }
+    else if (type.IsLlhistTy())
+    {
+      auto map_args = map_args_.find(map_name);
+      if (map_args == map_args_.end())
+      {
+        out_ << "map arg \"" << map_name << "\" not found" << std::endl;
+        abort();
+      }
+
+      Integer &sub_buckets = static_cast<Integer &>(*map_args->second.at(1));
+      map = std::make_unique<T>(map_name,
+                                type,
+                                key,
+                                0,
+                                0,
+                                sub_buckets.n,
+                                max_entries,
+                                bpftrace_.map_alloc_,
+                                false,
+                                false,
+                                false,
+                                hashed_key);
+    }
+    else if (type.IsCmsTy())
+    {
+      auto map_args = map_args_.find(map_name);
+      if (map_args == map_args_.end())
+      {
+        out_ << "map arg \"" << map_name << "\" not found" << std::endl;
+        abort();
+      }
+
+      // The map holds the tracked keys, keyed by the counted value
+      SizedType keytype = map_args->second.at(0)->type;
+      if (keytype.IsIntTy())
+        keytype = CreateUInt64();
+      MapKey cms_key;
+      cms_key.args_ = { keytype };
+      map = std::make_unique<T>(
+          map_name, type, cms_key, max_entries, bpftrace_.map_alloc_);
     }
     else
     {
-      auto map = std::make_unique<T>(map_name, type, key, bpftrace_.mapmax_);
-      failed_maps += is_invalid_map(map->mapfd_);
-      bpftrace_.maps.Add(std::move(map));
+      map = std::make_unique<T>(map_name,
+                                type,
+                                key,
+                                max_entries,
+                                bpftrace_.map_alloc_,
+                                mmapable,
+                                dense,
+                                task_storage,
+                                hashed_key,
+                                bucket_array);
+    }
+    failed_maps += is_invalid_map(map->mapfd_);
+
+    // Each of them is made of several map entries, which can be evicted
+    // independently of each other, unless they are held in one bucket array
+    if (bpftrace_.map_alloc_ == MapAlloc::lru && !map->bucket_array_ &&
+        (type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy()))
+    {
+      LOG(WARNING) << map_name << ": LRU maps can evict single buckets of "
+                   << type << "() values, they may be inaccurate once the "
+                   << "map is full";
+    }
+
+    // Only maps that are cleared, and always cleared after being printed,
+    // can be double buffered, and arrays (count() maps without keys, mmapped
+    // and dense maps) can't be cleared. cms_count() maps keep their counts
+    // in the sketch map instead, and for loops run over the map itself, as
+    // the expiry of ttl maps does.
+    if (bpftrace_.double_buffer_maps_ && map->mapfd_ >= 0 &&
+        cleared_maps_.count(map_name) && !iterated &&
+        !print_only_maps_.count(map_name) &&
+        !(type.IsCountTy() && key.args_.empty()) && !map->is_mmapped() &&
+        !map->dense_ && !map->task_storage_ && !type.IsCmsTy() &&
+        !window_seconds && !ttl_seconds)
+      failed_maps += is_invalid_map(map->make_double_buffered());
+    if (window_seconds && map->mapfd_ >= 0)
+    {
+      uint32_t slots = std::min<uint64_t>(window_seconds, WINDOW_SLOTS_MAX);
+      failed_maps += is_invalid_map(
+          map->make_windowed(slots, window_seconds * 1000000000ULL / slots));
     }
+    if (ttl_seconds && map->mapfd_ >= 0)
+      failed_maps += is_invalid_map(
+          map->make_ttl(ttl_seconds * 1000000000ULL));
+    bpftrace_.maps.Add(std::move(map));
   }
 
   for (StackType stack_type : needs_stackid_maps_) {
     // The stack type doesn't matter here, so we use kstack to force SizedType
     // to set stack_size.
 
-    auto map = std::make_unique<T>(CreateStack(true, stack_type));
+    auto map = std::make_unique<T>(CreateStack(true, stack_type),
+                                   bpftrace_.stack_map_entries_);
     failed_maps += is_invalid_map(map->mapfd_);
     bpftrace_.maps.Set(stack_type, std::move(map));
   }
@@ -2756,7 +3940,7 @@ int SemanticAnalyser::create_maps_impl(void)
   {
     // join uses map storage as we'd like to process data larger than can fit on
     // the BPF stack.
-    int value_size = 8 + 8 + bpftrace_.join_argnum_ * bpftrace_.join_argsize_;
+    int value_size = bpftrace_.join_size();
     auto map = std::make_unique<T>(
         "join", BPF_MAP_TYPE_PERCPU_ARRAY, 4, value_size, 1, 0);
     failed_maps += is_invalid_map(map->mapfd_);
@@ -2771,6 +3955,141 @@ int SemanticAnalyser::create_maps_impl(void)
     failed_maps += is_invalid_map(map->mapfd_);
     bpftrace_.maps.Set(MapManager::Type::Elapsed, std::move(map));
   }
+  if (bpftrace_.scratch_size_)
+  {
+    // Large temporaries, see IRBuilderBPF::CreateScratchBPF()
+    auto map = std::make_unique<T>("scratch",
+                                   BPF_MAP_TYPE_PERCPU_ARRAY,
+                                   4,
+                                   bpftrace_.scratch_size_,
+                                   1,
+                                   0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::Scratch, std::move(map));
+  }
+  if (tail_calls_)
+  {
+    // Programs split off large probes, see CodegenLLVM::generateProbe()
+    auto map = std::make_unique<T>(
+        "tail_calls", BPF_MAP_TYPE_PROG_ARRAY, 4, 4, tail_calls_, 0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::TailCalls, std::move(map));
+  }
+  if (counter_slots_)
+  {
+    // The events of hardware probe groups by slot and CPU, see
+    // AttachedProbe::attach_hardware()
+    auto map = std::make_unique<T>("counters",
+                                   BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+                                   4,
+                                   4,
+                                   counter_slots_ * counter_cpus(),
+                                   0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::Counters, std::move(map));
+  }
+  if (bpftrace_.probe_counts_)
+  {
+    // Runs of each probe by probe id, see CodegenLLVM::getProbeId(). There
+    // are no more ids than matches of the attach points.
+    auto map = std::make_unique<T>("probe_counts",
+                                   BPF_MAP_TYPE_PERCPU_ARRAY,
+                                   4,
+                                   8,
+                                   std::max<uint32_t>(probe_count_ids_, 1),
+                                   0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::ProbeCounts, std::move(map));
+  }
+  if (sample_sites_)
+  {
+    // Per-CPU state of each sample()/ratelimit() call site: the number of
+    // events seen for sample(), the start of the current one second window
+    // and the number of events let through in it for ratelimit().
+    auto map = std::make_unique<T>(
+        "sample", BPF_MAP_TYPE_PERCPU_ARRAY, 4, 16, sample_sites_, 0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::Sample, std::move(map));
+  }
+  if (bpftrace_.event_batch_)
+  {
+    auto map = std::make_unique<T>(
+        "event_batch",
+        BPF_MAP_TYPE_PERCPU_ARRAY,
+        4,
+        BPFtrace::event_batch_value_size(bpftrace_.event_batch_),
+        1,
+        0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::EventBatch, std::move(map));
+  }
+  if (bpftrace_.helper_check_level_ && !bpftrace_.helper_error_events_)
+  {
+    // The key is the helper error id and the return value
+    auto map = std::make_unique<T>("helper_errors",
+                                   BPF_MAP_TYPE_PERCPU_HASH,
+                                   8,
+                                   8,
+                                   BPFtrace::HELPER_ERRORS_MAX,
+                                   0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::HelperErrors, std::move(map));
+  }
+  if (bpftrace_.adaptive_sampling_)
+  {
+    auto map = std::make_unique<T>(
+        "adaptive_sample", BPF_MAP_TYPE_PERCPU_ARRAY, 4, 32, 1, 0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::AdaptiveSample, std::move(map));
+  }
+  if (bpftrace_.flight_event_size_)
+  {
+    // Entry 0 holds the head of the ring of each CPU
+    auto map = std::make_unique<T>(
+        "flight_recorder",
+        BPF_MAP_TYPE_PERCPU_ARRAY,
+        4,
+        BPFtrace::flight_slot_size(bpftrace_.flight_event_size_),
+        bpftrace_.flight_recorder_events_ + 1,
+        0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::FlightRecorder, std::move(map));
+  }
+  // Turned on and off by the program, or by --attach-session when pinned
+  if ((needs_probe_gates_ || !bpftrace_.pin_maps_dir_.empty()) &&
+      !bpftrace_.probe_gates_.empty())
+  {
+    auto map = std::make_unique<T>("probe_gates",
+                                   BPF_MAP_TYPE_ARRAY,
+                                   4,
+                                   8,
+                                   bpftrace_.probe_gates_.back().first + 1,
+                                   0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::ProbeGates, std::move(map));
+  }
+  if (needs_raw_symbols_pids_ && bpftrace_.raw_symbols_)
+  {
+    auto map = std::make_unique<T>("raw_symbols_pids",
+                                   BPF_MAP_TYPE_LRU_HASH,
+                                   4,
+                                   1,
+                                   BPFtrace::RAW_SYMBOLS_PIDS_MAX,
+                                   0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::RawSymbolsPids, std::move(map));
+  }
+  if (bpftrace_.dedupe_ms_ && !bpftrace_.printf_args_.empty())
+  {
+    auto map = std::make_unique<T>("dedupe",
+                                   BPF_MAP_TYPE_PERCPU_ARRAY,
+                                   4,
+                                   BPFtrace::DEDUPE_VALUE_SIZE,
+                                   1,
+                                   0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::Dedupe, std::move(map));
+  }
   if (needs_data_map_)
   {
     size_t size = 0;
@@ -2814,12 +4133,46 @@ int SemanticAnalyser::create_maps_impl(void)
                     0);
   }
 
+  if (bpftrace_.use_ringbuf_)
+  {
+    // A single ring buffer shared by all CPUs. Its size must be a power of 2
+    // multiple of the page size, which is checked when parsing the env.
+    auto map = std::make_unique<T>(
+        "ringbuf",
+        static_cast<enum bpf_map_type>(libbpf::BPF_MAP_TYPE_RINGBUF),
+        0,
+        0,
+        bpftrace_.ringbuf_pages_ * getpagesize(),
+        0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::Ringbuf, std::move(map));
+
+    // Ring buffers don't report dropped records, so we count them ourselves
+    auto loss_map = std::make_unique<T>(
+        "ringbuf_loss", BPF_MAP_TYPE_ARRAY, 4, 8, 1, 0);
+    failed_maps += is_invalid_map(loss_map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::RingbufLoss, std::move(loss_map));
+  }
+  else
   {
     auto map = std::make_unique<T>(BPF_MAP_TYPE_PERF_EVENT_ARRAY);
     failed_maps += is_invalid_map(map->mapfd_);
     bpftrace_.maps.Set(MapManager::Type::PerfEvent, std::move(map));
   }
 
+  if (bpftrace_.use_control_ringbuf_)
+  {
+    auto map = std::make_unique<T>(
+        "control",
+        static_cast<enum bpf_map_type>(libbpf::BPF_MAP_TYPE_RINGBUF),
+        0,
+        0,
+        bpftrace_.control_ringbuf_pages_ * getpagesize(),
+        0);
+    failed_maps += is_invalid_map(map->mapfd_);
+    bpftrace_.maps.Set(MapManager::Type::Control, std::move(map));
+  }
+
   if (failed_maps > 0)
   {
     out_ << "Creation of the required BPF maps has failed." << std::endl;
@@ -2837,6 +4190,20 @@ bool SemanticAnalyser::is_final_pass() const
   return pass_ == num_passes_;
 }
 
+bool SemanticAnalyser::is_bloom(const std::string &map) const
+{
+  auto decl = map_decls_.find(map);
+  return decl != map_decls_.end() && decl->second.type == "bloom";
+}
+
+bool SemanticAnalyser::is_end_probe() const
+{
+  for (AttachPoint *ap : *probe_->attach_points)
+    if (ap->provider != "END")
+      return false;
+  return true;
+}
+
 bool SemanticAnalyser::check_assignment(const Call &call, bool want_map, bool want_var, bool want_map_key)
 {
   if (want_map && want_var && want_map_key)
@@ -3059,6 +4426,7 @@ bool SemanticAnalyser::check_available(const Call &call, const AttachPoint &ap)
         return true;
       case ProbeType::invalid:
       case ProbeType::tracepoint:
+      case ProbeType::rawtracepoint:
       case ProbeType::kfunc:
       case ProbeType::kretfunc:
       case ProbeType::iter:
@@ -3086,6 +4454,7 @@ bool SemanticAnalyser::check_available(const Call &call, const AttachPoint &ap)
       case ProbeType::kfunc:
       case ProbeType::kretfunc:
       case ProbeType::iter:
+      case ProbeType::rawtracepoint:
         return false;
     }
   }
@@ -3101,6 +4470,7 @@ bool SemanticAnalyser::check_available(const Call &call, const AttachPoint &ap)
       case ProbeType::uretprobe:
       case ProbeType::usdt:
       case ProbeType::tracepoint:
+      case ProbeType::rawtracepoint:
       case ProbeType::profile:
       case ProbeType::kfunc:
       case ProbeType::kretfunc:
@@ -3207,6 +4577,8 @@ void SemanticAnalyser::accept_statements(StatementList *stmts)
 
     if (is_final_pass())
     {
+      find_print_clear(stmts, i);
+
       auto *jump = dynamic_cast<Jump *>(stmt);
       if (jump && i < (stmts->size() - 1))
       {
@@ -3217,6 +4589,43 @@ void SemanticAnalyser::accept_statements(StatementList *stmts)
   }
 }
 
+// Record whether stmts[i] is a clear(@x), or a print(@x) that isn't directly
+// followed by a clear(@x)
+void SemanticAnalyser::find_print_clear(StatementList *stmts, size_t i)
+{
+  auto map_call = [&](size_t idx, const std::string &func) -> Map * {
+    auto *expr = dynamic_cast<ExprStatement *>(stmts->at(idx));
+    if (!expr)
+      return nullptr;
+    auto *call = dynamic_cast<Call *>(expr->expr);
+    if (!call || call->func != func || !call->vargs || call->vargs->empty())
+      return nullptr;
+    return dynamic_cast<Map *>(call->vargs->at(0));
+  };
+
+  if (Map *clear = map_call(i, "clear"))
+  {
+    cleared_maps_.insert(clear->ident);
+    return;
+  }
+
+  // print_delta() reads the map the programs update, it's never
+  // double-buffered
+  if (Map *delta = map_call(i, "print_delta"))
+  {
+    print_only_maps_.insert(delta->ident);
+    return;
+  }
+
+  Map *print = map_call(i, "print");
+  if (!print)
+    return;
+
+  Map *clear = i + 1 < stmts->size() ? map_call(i + 1, "clear") : nullptr;
+  if (!clear || clear->ident != print->ident)
+    print_only_maps_.insert(print->ident);
+}
+
 Pass CreateSemanticPass()
 {
   auto fn = [](Node &n, PassContext &ctx) {
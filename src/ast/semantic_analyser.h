@@ -55,6 +55,7 @@ public:
   void visit(Binop &binop) override;
   void visit(Unop &unop) override;
   void visit(While &while_block) override;
+  void visit(For &for_loop) override;
   void visit(Jump &jump) override;
   void visit(Ternary &ternary) override;
   void visit(FieldAccess &acc) override;
@@ -84,6 +85,10 @@ private:
   bool listing_;
 
   bool is_final_pass() const;
+  bool is_end_probe() const;
+  std::map<std::string, std::vector<SizedType>> map_arg_types() const;
+  // Whether the map is declared as bloom(N), see IMap::bloom_
+  bool is_bloom(const std::string &map) const;
 
   bool check_assignment(const Call &call, bool want_map, bool want_var, bool want_map_key);
   bool check_nargs(const Call &call, size_t expected_nargs);
@@ -105,6 +110,10 @@ private:
 
   void builtin_args_tracepoint(AttachPoint *attach_point, Builtin &builtin);
   ProbeType single_provider_type(void);
+  bool has_probe_cookies(void);
+  bool has_probe_ids_at_load(void);
+  void reserve_scratch(uint64_t size);
+  void split_probe(Probe &probe);
   template <typename T>
   int create_maps_impl(void);
   AddrSpace find_addrspace(ProbeType pt);
@@ -115,7 +124,7 @@ private:
   };
   void accept_statements(StatementList *stmts);
 
-  Probe *probe_;
+  Probe *probe_ = nullptr;
 
   // Holds the function currently being visited by this SemanticAnalyser.
   std::string func_;
@@ -126,14 +135,57 @@ private:
   std::map<std::string, SizedType> variable_val_;
   std::map<std::string, SizedType> map_val_;
   std::map<std::string, MapKey> map_key_;
+  // The keys of the maps as typed so far, map_key_ is only filled in by the
+  // final pass
+  std::map<std::string, MapKey> seen_map_keys_;
   std::map<std::string, ExpressionList> map_args_;
+  // The maps declared ahead of the probes
+  std::map<std::string, MapDecl> map_decls_;
+  // The builtin all the accesses of a map are keyed by, e.g. cpu, or "" when
+  // there's another key. See IMap::dense_ and IMap::task_storage_.
+  std::map<std::string, std::string> map_builtin_keys_;
+  // How narrow the integer arguments of the keys are in all the accesses of
+  // a map, see MapKey::pack()
+  std::map<std::string, std::vector<MapKey::Width>> map_key_widths_;
+  // Maps read from userspace by print(), zero() and the like, or cleared
+  // before the END probes
+  std::unordered_set<std::string> map_userspace_;
+  // Maps cleared by the END probes, not to be printed on exit
+  std::unordered_set<std::string> map_end_cleared_;
   std::map<std::string, SizedType> ap_args_;
   std::unordered_set<StackType> needs_stackid_maps_;
 
   uint32_t loop_depth_ = 0;
+  // Nesting of the for loop bodies being visited, and the variables of the
+  // probe around them, which the bodies can't use
+  uint32_t for_depth_ = 0;
+  std::unordered_set<std::string> for_outer_vars_;
+  // Maps for loops run over, see visit(For)
+  std::unordered_set<std::string> iterated_maps_;
   bool needs_join_map_ = false;
   bool needs_elapsed_map_ = false;
   bool needs_data_map_ = false;
+  bool needs_probe_gates_ = false;
+  // User addresses are printed, the processes are sent for --raw-symbols
+  bool needs_raw_symbols_pids_ = false;
+  // Number of sample()/ratelimit() call sites, each gets its own state
+  uint32_t sample_sites_ = 0;
+  // Slots of the counters map taken by the events of hardware probe groups
+  uint32_t counter_slots_ = 0;
+  // Probe ids the runs are counted under, with BPFTRACE_PROBE_COUNTS
+  uint32_t probe_count_ids_ = 0;
+  // Bytes of the scratch map used by the probe being visited
+  uint64_t probe_scratch_ = 0;
+  // The ustack(dwarf) calls of the probe being visited not yet found to be
+  // printf() arguments
+  std::unordered_set<Call *> dwarf_stacks_;
+  // Number of programs split off the probes, each gets a tail call map slot
+  uint32_t tail_calls_ = 0;
+  // Maps cleared, and maps printed other than right before being cleared,
+  // to find the maps that can be double-buffered
+  std::unordered_set<std::string> cleared_maps_;
+  std::unordered_set<std::string> print_only_maps_;
+  void find_print_clear(StatementList *stmts, size_t i);
   bool has_begin_probe_ = false;
   bool has_end_probe_ = false;
   bool has_child_ = false;
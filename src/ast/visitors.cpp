@@ -148,6 +148,17 @@ void Visitor::visit(While &while_block)
   }
 }
 
+void Visitor::visit(For &for_loop)
+{
+  Visit(*for_loop.decl);
+  Visit(*for_loop.map);
+
+  for (Statement *stmt : *for_loop.stmts)
+  {
+    Visit(*stmt);
+  }
+}
+
 void Visitor::visit(Jump &jump __attribute__((__unused__)))
 {
 }
@@ -353,6 +364,16 @@ Node *Mutator::visit(While &while_block)
   return w;
 }
 
+Node *Mutator::visit(For &for_loop)
+{
+  auto f = for_loop.leafcopy();
+  f->decl = Value<Variable>(for_loop.decl);
+  f->map = Value<Map>(for_loop.map);
+
+  f->stmts = mutateStmtList(for_loop.stmts);
+  return f;
+}
+
 Node *Mutator::visit(Probe &probe)
 {
   auto p = probe.leafcopy();
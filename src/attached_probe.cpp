@@ -2,6 +2,7 @@
 #define _GNU_SOURCE
 #endif
 
+#include <chrono>
 #include <cstring>
 #include <elf.h>
 #include <fcntl.h>
@@ -10,6 +11,9 @@
 #include <linux/hw_breakpoint.h>
 #include <linux/limits.h>
 #include <linux/perf_event.h>
+#include <map>
+#include <memory>
+#include <optional>
 #include <regex>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
@@ -26,6 +30,7 @@
 #include "disasm.h"
 #include "log.h"
 #include "probe_matcher.h"
+#include "symbol_cache.h"
 #include "usdt.h"
 #ifdef HAVE_LIBBPF_BPF_H
 #include <bpf/bpf.h>
@@ -74,6 +79,10 @@ bpf_prog_type progtype(ProbeType t)
     case ProbeType::uretprobe:  return BPF_PROG_TYPE_KPROBE; break;
     case ProbeType::usdt:       return BPF_PROG_TYPE_KPROBE; break;
     case ProbeType::tracepoint: return BPF_PROG_TYPE_TRACEPOINT; break;
+    case ProbeType::rawtracepoint:
+      return static_cast<enum ::bpf_prog_type>(
+          libbpf::BPF_PROG_TYPE_RAW_TRACEPOINT);
+      break;
     case ProbeType::profile:
       return BPF_PROG_TYPE_PERF_EVENT;
       break;
@@ -111,6 +120,7 @@ std::string progtypeName(bpf_prog_type t)
     case libbpf::BPF_PROG_TYPE_TRACEPOINT: return "BPF_PROG_TYPE_TRACEPOINT"; break;
     case libbpf::BPF_PROG_TYPE_PERF_EVENT: return "BPF_PROG_TYPE_PERF_EVENT"; break;
     case libbpf::BPF_PROG_TYPE_TRACING:    return "BPF_PROG_TYPE_TRACING";    break;
+    case libbpf::BPF_PROG_TYPE_RAW_TRACEPOINT: return "BPF_PROG_TYPE_RAW_TRACEPOINT"; break;
     // clang-format on
     default:
       LOG(FATAL) << "invalid program type: " << t;
@@ -154,6 +164,46 @@ int AttachedProbe::detach_kfunc(void)
 }
 #endif // HAVE_BCC_KFUNC
 
+#ifdef HAVE_LIBBPF_KPROBE_MULTI
+#ifndef BPF_F_KPROBE_MULTI_RETURN
+#define BPF_F_KPROBE_MULTI_RETURN (1U << 0)
+#endif
+
+void AttachedProbe::attach_multi_kprobe(void)
+{
+  std::vector<const char *> syms;
+  for (auto &func : probe_.funcs)
+    syms.push_back(func.c_str());
+
+  DECLARE_LIBBPF_OPTS(bpf_link_create_opts, opts);
+  opts.kprobe_multi.syms = syms.data();
+  opts.kprobe_multi.cnt = syms.size();
+  // The probe builtin, if the program reads it
+  if (!probe_.cookies.empty())
+    opts.kprobe_multi.cookies = reinterpret_cast<const __u64 *>(
+        probe_.cookies.data());
+  if (probe_.type == ProbeType::kretprobe)
+    opts.kprobe_multi.flags = BPF_F_KPROBE_MULTI_RETURN;
+
+  linkfd_ = bpf_link_create(progfd_,
+                            0,
+                            static_cast<enum ::bpf_attach_type>(
+                                libbpf::BPF_TRACE_KPROBE_MULTI),
+                            &opts);
+  if (linkfd_ < 0)
+  {
+    throw std::runtime_error("Error attaching probe: '" + probe_.name + "'");
+  }
+}
+#else
+void AttachedProbe::attach_multi_kprobe(void)
+{
+  throw std::runtime_error(
+      "Error attaching probe: " + probe_.name +
+      ", kprobe_multi is not available for linked libbpf version");
+}
+#endif // HAVE_LIBBPF_KPROBE_MULTI
+
 #ifdef HAVE_LIBBPF_LINK_CREATE
 void AttachedProbe::attach_iter(void)
 {
@@ -188,10 +238,15 @@ int AttachedProbe::detach_iter(void)
 }
 #endif // HAVE_LIBBPF_LINK_CREATE
 
-AttachedProbe::AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> func, bool safe_mode)
-  : probe_(probe), func_(func)
+AttachedProbe::AttachedProbe(Probe &probe,
+                             std::tuple<uint8_t *, uintptr_t> func,
+                             bool safe_mode,
+                             int progfd)
+    : probe_(probe), func_(func), progfd_(progfd)
 {
-  load_prog();
+  // progfd is the program already loaded by load_prog(), if any
+  if (progfd_ < 0)
+    progfd_ = load_prog(probe_, func_, true, &load_stats_);
   if (bt_verbose)
     std::cerr << "Attaching " << probe_.name << std::endl;
   switch (probe_.type)
@@ -200,7 +255,10 @@ AttachedProbe::AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> func
       attach_kprobe(safe_mode);
       break;
     case ProbeType::kretprobe:
-      check_banned_kretprobes(probe_.attach_point);
+      if (probe_.funcs.empty())
+        check_banned_kretprobes(probe_.attach_point);
+      for (auto &func : probe_.funcs)
+        check_banned_kretprobes(func);
       attach_kprobe(safe_mode);
       break;
     case ProbeType::uprobe:
@@ -210,6 +268,9 @@ AttachedProbe::AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> func
     case ProbeType::tracepoint:
       attach_tracepoint();
       break;
+    case ProbeType::rawtracepoint:
+      attach_raw_tracepoint();
+      break;
     case ProbeType::profile:
       attach_profile();
       break;
@@ -241,7 +302,7 @@ AttachedProbe::AttachedProbe(Probe &probe,
                              BPFfeature &feature)
     : probe_(probe), func_(func)
 {
-  load_prog();
+  progfd_ = load_prog(probe_, func_, true, &load_stats_);
   switch (probe_.type)
   {
     case ProbeType::usdt:
@@ -257,6 +318,16 @@ AttachedProbe::AttachedProbe(Probe &probe,
   }
 }
 
+AttachedProbe::AttachedProbe(Probe &probe,
+                             std::tuple<uint8_t *, uintptr_t> func,
+                             const std::vector<int> &sem_pids,
+                             BPFfeature &feature)
+    : probe_(probe), func_(func)
+{
+  progfd_ = load_prog(probe_, func_, true, &load_stats_);
+  attach_usdt(0, feature, sem_pids);
+}
+
 AttachedProbe::~AttachedProbe()
 {
   int err = 0;
@@ -272,7 +343,10 @@ AttachedProbe::~AttachedProbe()
   {
     case ProbeType::kprobe:
     case ProbeType::kretprobe:
-      err = bpf_detach_kprobe(eventname().c_str());
+      if (probe_.funcs.empty())
+        err = bpf_detach_kprobe(eventname().c_str());
+      else
+        close(linkfd_);
       break;
     case ProbeType::kfunc:
     case ProbeType::kretfunc:
@@ -284,13 +358,19 @@ AttachedProbe::~AttachedProbe()
     case ProbeType::uprobe:
     case ProbeType::uretprobe:
     case ProbeType::usdt:
-      if (usdt_destructor_)
-        usdt_destructor_();
-      err = bpf_detach_uprobe(eventname().c_str());
+      for (auto &destructor : usdt_destructors_)
+        destructor();
+      if (probe_.funcs.empty())
+        err = bpf_detach_uprobe(eventname().c_str());
+      else
+        close(linkfd_);
       break;
     case ProbeType::tracepoint:
       err = bpf_detach_tracepoint(probe_.path.c_str(), eventname().c_str());
       break;
+    case ProbeType::rawtracepoint:
+      close(linkfd_);
+      break;
     case ProbeType::profile:
     case ProbeType::interval:
     case ProbeType::software:
@@ -314,6 +394,31 @@ const Probe &AttachedProbe::probe() const
   return probe_;
 }
 
+int AttachedProbe::progfd() const
+{
+  return progfd_;
+}
+
+std::tuple<uint8_t *, uintptr_t> AttachedProbe::func() const
+{
+  return func_;
+}
+
+void AttachedProbe::set_func(std::tuple<uint8_t *, uintptr_t> func)
+{
+  func_ = func;
+}
+
+const LoadStats &AttachedProbe::load_stats() const
+{
+  return load_stats_;
+}
+
+const std::map<uint32_t, int> &AttachedProbe::counter_fds() const
+{
+  return counter_fds_;
+}
+
 std::string AttachedProbe::eventprefix() const
 {
   switch (attachtype(probe_.type))
@@ -407,6 +512,68 @@ resolve_offset(const std::string &path, const std::string &symbol, uint64_t loc)
   return bcc_sym.offset;
 }
 
+namespace {
+
+/**
+   Function symbols of the binaries uprobes attach to, and of the vmlinux
+   kprobe offsets are checked against, looked up by name.
+
+   Each binary is read in a single pass, however many probes it gets, where
+   bcc reads its symbol tables twice for every probe. Probes are only
+   attached at startup, so the binaries aren't expected to change meanwhile.
+   The index is the one probe matching listed the functions with.
+*/
+class ElfSymbols
+{
+public:
+  struct Symbol
+  {
+    uint64_t start;
+    uint64_t size;
+    uint64_t offset; // in the file, what uprobes are attached at
+  };
+
+  /**
+     nullptr when path has no such symbol or its symbols couldn't be read,
+     for the caller to fall back to bcc
+  */
+  static const Symbol *find(const std::string &path, const std::string &name)
+  {
+    static std::map<std::string, std::unique_ptr<ElfSymbols>> binaries;
+    auto it = binaries.find(path);
+    if (it == binaries.end())
+      it = binaries.emplace(path, read(path)).first;
+    if (!it->second)
+      return nullptr;
+
+    auto sym = it->second->syms_.find(name);
+    return sym != it->second->syms_.end() ? &sym->second : nullptr;
+  }
+
+private:
+  static std::unique_ptr<ElfSymbols> read(const std::string &path)
+  {
+    auto index = SymbolIndex::shared(path);
+    if (!index)
+      return nullptr;
+
+    auto binary = std::make_unique<ElfSymbols>();
+    for (auto &sym : *index)
+    {
+      uint64_t offset;
+      // Symbols are sorted by address, the first of a name is kept
+      if (index->offset(sym.start, offset))
+        binary->syms_.emplace(index->name(sym),
+                              Symbol{ sym.start, sym.size, offset });
+    }
+    return binary;
+  }
+
+  std::unordered_map<std::string, Symbol> syms_;
+};
+
+} // namespace
+
 static void check_alignment(std::string &path,
                             std::string &symbol,
                             uint64_t sym_offset,
@@ -414,8 +581,12 @@ static void check_alignment(std::string &path,
                             bool safe_mode,
                             ProbeType type)
 {
-  Disasm dasm(path);
-  AlignState aligned = dasm.is_aligned(sym_offset, func_offset);
+  // One per binary, however many probes it gets
+  static std::map<std::string, std::unique_ptr<Disasm>> disasms;
+  auto &dasm = disasms[path];
+  if (!dasm)
+    dasm = std::make_unique<Disasm>(path);
+  AlignState aligned = dasm->is_aligned(sym_offset, func_offset);
   std::string probe_name = probetypeName(type);
 
   std::string tmp = path + ":" + symbol + "+" + std::to_string(func_offset);
@@ -466,6 +637,8 @@ void AttachedProbe::resolve_offset_uprobe(bool safe_mode)
   struct symbol sym = { };
   std::string &symbol = probe_.attach_point;
   uint64_t func_offset = probe_.func_offset;
+  // Taken from the symbol indexes when they have the symbol, 0 included
+  std::optional<uint64_t> sym_offset;
 
   sym.name = "";
   option.use_debug_file  = 1;
@@ -474,7 +647,18 @@ void AttachedProbe::resolve_offset_uprobe(bool safe_mode)
   if (symbol.empty())
   {
     sym.address = probe_.address;
-    bcc_elf_foreach_sym(probe_.path.c_str(), sym_address_cb, &option, &sym);
+    auto index = SymbolIndex::shared(probe_.path);
+    auto found = index ? index->lookup(probe_.address) : nullptr;
+    uint64_t found_offset;
+    if (found && index->offset(found->start, found_offset))
+    {
+      sym.start = found->start;
+      sym.size = found->size;
+      sym.name = index->name(*found);
+      sym_offset = found_offset;
+    }
+    else
+      bcc_elf_foreach_sym(probe_.path.c_str(), sym_address_cb, &option, &sym);
 
     if (!sym.start)
     {
@@ -499,6 +683,14 @@ void AttachedProbe::resolve_offset_uprobe(bool safe_mode)
     symbol = sym.name;
     func_offset = probe_.address - sym.start;
   }
+  else if (auto uprobe_sym = probe_.loc ? nullptr
+                                        : ElfSymbols::find(probe_.path,
+                                                              symbol))
+  {
+    sym.start = uprobe_sym->start;
+    sym.size = uprobe_sym->size;
+    sym_offset = uprobe_sym->offset;
+  }
   else
   {
     sym.name = symbol;
@@ -521,8 +713,9 @@ void AttachedProbe::resolve_offset_uprobe(bool safe_mode)
     throw std::runtime_error("Offset outside the function bounds ('" + symbol + "' size is " + ss.str() + ")");
   }
 
-  uint64_t sym_offset = resolve_offset(probe_.path, probe_.attach_point, probe_.loc);
-  offset_ = sym_offset + func_offset;
+  if (!sym_offset)
+    sym_offset = resolve_offset(probe_.path, probe_.attach_point, probe_.loc);
+  offset_ = *sym_offset + func_offset;
 
   // If we are not aligned to the start of the symbol,
   // check if we are on the instruction boundary.
@@ -530,12 +723,14 @@ void AttachedProbe::resolve_offset_uprobe(bool safe_mode)
     return;
 
   check_alignment(
-      probe_.path, symbol, sym_offset, func_offset, safe_mode, probe_.type);
+      probe_.path, symbol, *sym_offset, func_offset, safe_mode, probe_.type);
 }
 
 // find vmlinux file containing the given symbol information
+// sym_offset is left empty when the symbol wasn't found through ElfSymbols
 static std::string find_vmlinux(const struct vmlinux_location *locs,
-                                struct symbol &sym)
+                                struct symbol &sym,
+                                std::optional<uint64_t> &sym_offset)
 {
   struct bcc_symbol_option option = {};
   option.use_debug_file = 0;
@@ -552,7 +747,19 @@ static std::string find_vmlinux(const struct vmlinux_location *locs,
     snprintf(path, PATH_MAX, locs[i].path, buf.release);
     if (access(path, R_OK))
       continue;
-    bcc_elf_foreach_sym(path, sym_name_cb, &option, &sym);
+    // vmlinux is only scanned once for all the kprobes, through bcc only if
+    // it couldn't be indexed
+    if (SymbolIndex::shared(path))
+    {
+      if (auto found = ElfSymbols::find(path, sym.name))
+      {
+        sym.start = found->start;
+        sym.size = found->size;
+        sym_offset = found->offset;
+      }
+    }
+    else
+      bcc_elf_foreach_sym(path, sym_name_cb, &option, &sym);
     if (sym.start)
     {
       if (bt_verbose)
@@ -591,7 +798,8 @@ void AttachedProbe::resolve_offset_kprobe(bool safe_mode)
     locs = locs_env;
   }
 
-  std::string path = find_vmlinux(locs, sym);
+  std::optional<uint64_t> sym_offset;
+  std::string path = find_vmlinux(locs, sym, sym_offset);
   if (path.empty())
   {
     if (safe_mode)
@@ -621,29 +829,239 @@ void AttachedProbe::resolve_offset_kprobe(bool safe_mode)
     throw std::runtime_error("Offset outside the function bounds ('" + symbol +
                              "' size is " + std::to_string(sym.size) + ")");
 
-  uint64_t sym_offset = resolve_offset(path, probe_.attach_point, probe_.loc);
+  if (!sym_offset)
+    sym_offset = resolve_offset(path, probe_.attach_point, probe_.loc);
 
   check_alignment(
-      path, symbol, sym_offset, func_offset, safe_mode, probe_.type);
+      path, symbol, *sym_offset, func_offset, safe_mode, probe_.type);
+}
+
+// Fd of the BTF object the kernel has for module (Linux 5.11), -1 if there is
+// none
+static int module_btf_fd(const std::string &module)
+{
+  // BPF_BTF_GET_FD_BY_ID and BPF_BTF_GET_NEXT_ID, and the fields of struct
+  // bpf_btf_info naming the module, from linux/bpf.h, which may be older than
+  // the running kernel
+  const int bpf_btf_get_fd_by_id_cmd = 19;
+  const int bpf_btf_get_next_id_cmd = 23;
+  union
+  {
+    struct
+    {
+      uint32_t id;
+      uint32_t next_id;
+    } btf;
+    uint8_t pad[128];
+  } attr;
+  struct
+  {
+    alignas(8) uint64_t btf;
+    uint32_t btf_size;
+    uint32_t id;
+    alignas(8) uint64_t name;
+    uint32_t name_len;
+    uint32_t kernel_btf;
+  } info;
+  char name[64];
+
+  uint32_t id = 0;
+  while (true)
+  {
+    attr = {};
+    attr.btf.id = id;
+    if (syscall(__NR_bpf, bpf_btf_get_next_id_cmd, &attr, sizeof(attr)))
+      return -1;
+    id = attr.btf.next_id;
+
+    attr = {};
+    attr.btf.id = id;
+    int fd = syscall(__NR_bpf, bpf_btf_get_fd_by_id_cmd, &attr, sizeof(attr));
+    if (fd < 0)
+      continue;
+    info = {};
+    name[0] = '\0';
+    info.name = reinterpret_cast<uint64_t>(name);
+    info.name_len = sizeof(name);
+    uint32_t info_len = sizeof(info);
+    if (bpf_obj_get_info(fd, &info, &info_len) == 0 && info.kernel_btf &&
+        module == name)
+      return fd;
+    close(fd);
+  }
+}
+
+// bcc only finds the functions of kfunc programs in the vmlinux BTF, the ones
+// of modules are loaded against the BTF object of their module
+static int load_module_kfunc(const Probe &probe,
+                             const char *name,
+                             uint8_t *insns,
+                             int prog_len,
+                             const char *license,
+                             int log_level,
+                             char *log_buf,
+                             uint32_t log_buf_size)
+{
+  int btf_fd = module_btf_fd(probe.path);
+  if (btf_fd < 0)
+    throw std::runtime_error("Error loading program: " + probe.name +
+                             ", the kernel has no BTF for module " +
+                             probe.path);
+
+  // BPF_PROG_LOAD and its attributes up to attach_btf_obj_fd (Linux 5.11)
+  const int bpf_prog_load_cmd = 5;
+  union
+  {
+    struct
+    {
+      uint32_t prog_type;
+      uint32_t insn_cnt;
+      alignas(8) uint64_t insns;
+      alignas(8) uint64_t license;
+      uint32_t log_level;
+      uint32_t log_size;
+      alignas(8) uint64_t log_buf;
+      uint32_t kern_version;
+      uint32_t prog_flags;
+      char prog_name[16];
+      uint32_t prog_ifindex;
+      uint32_t expected_attach_type;
+      uint32_t prog_btf_fd;
+      uint32_t func_info_rec_size;
+      alignas(8) uint64_t func_info;
+      uint32_t func_info_cnt;
+      uint32_t line_info_rec_size;
+      alignas(8) uint64_t line_info;
+      uint32_t line_info_cnt;
+      uint32_t attach_btf_id;
+      uint32_t attach_btf_obj_fd;
+    } load;
+    uint8_t pad[128];
+  } attr = {};
+  attr.load.prog_type = libbpf::BPF_PROG_TYPE_TRACING;
+  attr.load.expected_attach_type = probe.type == ProbeType::kretfunc
+                                       ? libbpf::BPF_TRACE_FEXIT
+                                       : libbpf::BPF_TRACE_FENTRY;
+  attr.load.insns = reinterpret_cast<uint64_t>(insns);
+  attr.load.insn_cnt = prog_len / sizeof(struct bpf_insn);
+  attr.load.license = reinterpret_cast<uint64_t>(license);
+  if (log_level)
+  {
+    attr.load.log_level = log_level;
+    attr.load.log_buf = reinterpret_cast<uint64_t>(log_buf);
+    attr.load.log_size = log_buf_size;
+  }
+  strncpy(attr.load.prog_name, name, sizeof(attr.load.prog_name) - 1);
+  attr.load.attach_btf_id = probe.btf_id;
+  attr.load.attach_btf_obj_fd = btf_fd;
+
+  int progfd = syscall(__NR_bpf, bpf_prog_load_cmd, &attr, sizeof(attr));
+  close(btf_fd);
+  return progfd;
+}
+
+// Replaces the ld_imm64s of the probe builtin of a program shared by the
+// matches of a kfunc probe with ones loading the id of the match
+static void patch_probe_id(std::vector<uint8_t> &code, int64_t probe_id)
+{
+  auto insns = reinterpret_cast<struct bpf_insn *>(code.data());
+  size_t n = code.size() / sizeof(struct bpf_insn);
+  for (size_t i = 0; i + 1 < n; ++i)
+  {
+    auto &insn = insns[i];
+    if (insn.code != (BPF_LD | BPF_DW | BPF_IMM))
+      continue;
+    if (insn.src_reg == BPF_PSEUDO_PROBE_ID)
+    {
+      insn.src_reg = 0;
+      insn.imm = static_cast<int32_t>(probe_id);
+      insns[i + 1].imm = static_cast<int32_t>(probe_id >> 32);
+    }
+    // The second half holds no opcode
+    ++i;
+  }
+}
+
+#ifndef BPF_PSEUDO_FUNC
+#define BPF_PSEUDO_FUNC 4
+#endif
+
+// Whether the program calls bpf_for_each_map_elem(), see
+// patch_func_pointers()
+static bool calls_for_each_map_elem(const uint8_t *code, size_t size)
+{
+  auto insns = reinterpret_cast<const struct bpf_insn *>(code);
+  size_t n = size / sizeof(struct bpf_insn);
+  for (size_t i = 0; i < n; ++i)
+    if (insns[i].code == (BPF_JMP | BPF_CALL) && insns[i].src_reg == 0 &&
+        insns[i].imm == libbpf::BPF_FUNC_for_each_map_elem)
+      return true;
+  return false;
+}
+
+// The callbacks of for loops are passed to bpf_for_each_map_elem() by
+// address, which LLVM leaves as a ld_imm64 of their byte offset in the
+// section since the relocation isn't applied to BPF code. The kernel wants
+// them as BPF_PSEUDO_FUNC loads of the instruction offset instead.
+// Constants that small would have been a mov, the other ld_imm64s of
+// bpftrace programs load maps and the like with src_reg set.
+static void patch_func_pointers(std::vector<uint8_t> &code)
+{
+  auto insns = reinterpret_cast<struct bpf_insn *>(code.data());
+  size_t n = code.size() / sizeof(struct bpf_insn);
+  for (size_t i = 0; i + 1 < n; ++i)
+  {
+    auto &insn = insns[i];
+    if (insn.code != (BPF_LD | BPF_DW | BPF_IMM))
+      continue;
+    if (insn.src_reg == 0 && insns[i + 1].imm == 0 && insn.imm >= 0 &&
+        insn.imm % sizeof(struct bpf_insn) == 0 &&
+        static_cast<size_t>(insn.imm) / sizeof(struct bpf_insn) < n)
+    {
+      insn.src_reg = BPF_PSEUDO_FUNC;
+      insn.imm = insn.imm / sizeof(struct bpf_insn) - i - 1;
+    }
+    // The second half holds no opcode
+    ++i;
+  }
 }
 
-void AttachedProbe::load_prog()
+int AttachedProbe::load_prog(const Probe &probe,
+                             std::tuple<uint8_t *, uintptr_t> func,
+                             bool silence_stderr,
+                             LoadStats *stats)
 {
-  uint8_t *insns = std::get<0>(func_);
-  int prog_len = std::get<1>(func_);
+  int progfd = -1;
+  uint8_t *insns = std::get<0>(func);
+  int prog_len = std::get<1>(func);
+  std::vector<uint8_t> patched;
+  if (probe.probe_id >= 0)
+  {
+    patched.assign(insns, insns + prog_len);
+    patch_probe_id(patched, probe.probe_id);
+    insns = patched.data();
+  }
+  if (calls_for_each_map_elem(insns, prog_len))
+  {
+    if (patched.empty())
+      patched.assign(insns, insns + prog_len);
+    patch_func_pointers(patched);
+    insns = patched.data();
+  }
   const char *license = "GPL";
   int log_level = 0;
 
-  uint64_t log_buf_size = probe_.log_size;
+  uint64_t log_buf_size = probe.log_size;
   auto log_buf = std::make_unique<char[]>(log_buf_size);
   char name[STRING_SIZE];
   const char *namep;
   std::string tracing_type, tracing_name;
+  auto start = std::chrono::steady_clock::now();
 
   {
     // Redirect stderr, so we don't get error messages from BCC
     StderrSilencer silencer;
-    if (bt_debug == DebugLevel::kNone)
+    if (silence_stderr && bt_debug == DebugLevel::kNone)
       silencer.silence();
 
     if (bt_debug != DebugLevel::kNone)
@@ -653,16 +1071,25 @@ void AttachedProbe::load_prog()
       log_level = 1;
 
     // bpf_prog_load rejects colons in the probe name
-    strncpy(name, probe_.name.c_str(), STRING_SIZE - 1);
+    strncpy(name, probe.name.c_str(), STRING_SIZE - 1);
     namep = name;
     if (strrchr(name, ':') != NULL)
       namep = strrchr(name, ':') + 1;
 
+    // Multi probes are named after their wildcard, which the kernel
+    // doesn't allow in program names either
+    if (!probe.funcs.empty())
+    {
+      for (char *c = name; *c; c++)
+        if (!isalnum(*c) && *c != '_' && *c != ':')
+          *c = '_';
+    }
+
     // The bcc_prog_load function now recognizes 'kfunc__/kretfunc__'
     // prefixes and detects and fills in all the necessary BTF related
     // attributes for loading the kfunc program.
 
-    tracing_type = probetypeName(probe_.type);
+    tracing_type = probetypeName(probe.type);
     if (!tracing_type.empty())
     {
       if (tracing_type == "iter")
@@ -672,61 +1099,75 @@ void AttachedProbe::load_prog()
       namep = tracing_name.c_str();
     }
 
-    for (int attempt = 0; attempt < 3; attempt++)
+    // Tracing programs don't need the kernel version
+    if (probe.btf_id)
+      progfd = load_module_kfunc(probe,
+                                 probe.attach_point.c_str(),
+                                 insns,
+                                 prog_len,
+                                 license,
+                                 log_level,
+                                 log_buf.get(),
+                                 log_buf_size);
+
+    // A program that fails to load for another reason than its version is
+    // verified once per version, the same version isn't tried twice
+    for (auto version : probe.btf_id ? std::vector<uint32_t>()
+                                     : kernel_load_versions())
     {
-      auto version = kernel_version(attempt);
-      if (version == 0 && attempt > 0)
-      {
-        // Recent kernels don't check the version so we should try to call
-        // bcc_prog_load during first iteration even if we failed to determine
-        // the version. We should not do that in subsequent iterations to avoid
-        // zeroing of log_buf on systems with older kernels.
-        continue;
-      }
-
 #ifdef HAVE_BCC_PROG_LOAD_XATTR
       struct bpf_load_program_attr attr = {};
 
-      attr.prog_type = progtype(probe_.type);
+      attr.prog_type = progtype(probe.type);
       attr.name = namep;
       attr.insns = reinterpret_cast<struct bpf_insn *>(insns);
       attr.license = license;
 
       libbpf::bpf_prog_type prog_type = static_cast<libbpf::bpf_prog_type>(
-          progtype(probe_.type));
+          progtype(probe.type));
 
       if (prog_type != libbpf::BPF_PROG_TYPE_TRACING &&
           prog_type != libbpf::BPF_PROG_TYPE_EXT)
         attr.kern_version = version;
 
+      if (!probe.funcs.empty())
+        attr.expected_attach_type = static_cast<enum ::bpf_attach_type>(
+            probe.type == ProbeType::uprobe ||
+                    probe.type == ProbeType::uretprobe
+                ? libbpf::BPF_TRACE_UPROBE_MULTI
+                : libbpf::BPF_TRACE_KPROBE_MULTI);
+
       attr.log_level = log_level;
 
-      progfd_ = bcc_prog_load_xattr(
+      progfd = bcc_prog_load_xattr(
           &attr, prog_len, log_buf.get(), log_buf_size, true);
 
 #else // HAVE_BCC_PROG_LOAD_XATTR
 #ifdef HAVE_BCC_PROG_LOAD
-      progfd_ = bcc_prog_load(progtype(probe_.type),
-                              namep,
+      progfd = bcc_prog_load(progtype(probe.type),
+                             namep,
 #else
-      progfd_ = bpf_prog_load(progtype(probe_.type),
-                              namep,
+      progfd = bpf_prog_load(progtype(probe.type),
+                             namep,
 #endif
-                              reinterpret_cast<struct bpf_insn *>(insns),
-                              prog_len,
-                              license,
-                              version,
-                              log_level,
-                              log_buf.get(),
-                              log_buf_size);
+                             reinterpret_cast<struct bpf_insn *>(insns),
+                             prog_len,
+                             license,
+                             version,
+                             log_level,
+                             log_buf.get(),
+                             log_buf_size);
 #endif // HAVE_BCC_PROG_LOAD_XATTR
 
-      if (progfd_ >= 0)
+      if (progfd >= 0)
+      {
+        kernel_version_loaded(version);
         break;
+      }
     }
   }
 
-  if (progfd_ < 0) {
+  if (progfd < 0) {
     if (bt_verbose) {
       std::cerr << std::endl
                 << "Error log: " << std::endl
@@ -736,12 +1177,28 @@ void AttachedProbe::load_prog()
         errmsg << "Error: Failed to load program, verification log buffer "
                << "not big enough, try increasing the BPFTRACE_LOG_SIZE "
                << "environment variable beyond the current value of "
-               << probe_.log_size << " bytes";
+               << probe.log_size << " bytes";
 
         throw std::runtime_error(errmsg.str());
       }
     }
-    throw std::runtime_error("Error loading program: " + probe_.name + (bt_verbose ? "" : " (try -v)"));
+    throw std::runtime_error("Error loading program: " + probe.name + (bt_verbose ? "" : " (try -v)"));
+  }
+
+  if (stats)
+  {
+    stats->progs++;
+    stats->insns += prog_len / sizeof(struct bpf_insn);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    stats->load_time_us +=
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    // e.g. "processed 95 insns (limit 1000000) max_states_per_insn 0 ...",
+    // or "processed 95 insns, stack depth 16" on older kernels
+    unsigned long long verified;
+    const char *processed = log_level ? strstr(log_buf.get(), "processed ")
+                                      : nullptr;
+    if (processed && sscanf(processed, "processed %llu insns", &verified) == 1)
+      stats->verified_insns += verified;
   }
 
   if (bt_verbose) {
@@ -749,7 +1206,7 @@ void AttachedProbe::load_prog()
     uint32_t info_len = sizeof(info);
     int ret;
 
-    ret = bpf_obj_get_info(progfd_, &info, &info_len);
+    ret = bpf_obj_get_info(progfd, &info, &info_len);
     if (ret == 0) {
       std::cout << std::endl << "Program ID: " << info.id << std::endl;
     }
@@ -757,10 +1214,20 @@ void AttachedProbe::load_prog()
               << "The verifier log: " << std::endl
               << log_buf.get() << std::endl;
   }
+
+  return progfd;
 }
 
 void AttachedProbe::attach_kprobe(bool safe_mode)
 {
+  // A single link attaches the program to all the functions the wildcard
+  // matched, see BPFtrace::add_probe()
+  if (!probe_.funcs.empty())
+  {
+    attach_multi_kprobe();
+    return;
+  }
+
   resolve_offset_kprobe(safe_mode);
 #ifdef LIBBCC_ATTACH_KPROBE_SIX_ARGS_SIGNATURE
   int perf_event_fd = bpf_attach_kprobe(progfd_,
@@ -791,8 +1258,57 @@ void AttachedProbe::attach_kprobe(bool safe_mode)
   perf_event_fds_.push_back(perf_event_fd);
 }
 
+#ifdef HAVE_LIBBPF_UPROBE_MULTI
+#ifndef BPF_F_UPROBE_MULTI_RETURN
+#define BPF_F_UPROBE_MULTI_RETURN (1U << 0)
+#endif
+
+void AttachedProbe::attach_multi_uprobe(void)
+{
+  std::vector<unsigned long> offsets;
+  for (auto &func : probe_.funcs)
+  {
+    auto sym = ElfSymbols::find(probe_.path, func);
+    offsets.push_back(sym ? sym->offset : resolve_offset(probe_.path, func, 0));
+  }
+
+  DECLARE_LIBBPF_OPTS(bpf_link_create_opts, opts);
+  opts.uprobe_multi.path = probe_.path.c_str();
+  opts.uprobe_multi.offsets = offsets.data();
+  opts.uprobe_multi.cnt = offsets.size();
+  opts.uprobe_multi.pid = probe_.pid > 0 ? probe_.pid : 0;
+  if (probe_.type == ProbeType::uretprobe)
+    opts.uprobe_multi.flags = BPF_F_UPROBE_MULTI_RETURN;
+
+  linkfd_ = bpf_link_create(progfd_,
+                            0,
+                            static_cast<enum ::bpf_attach_type>(
+                                libbpf::BPF_TRACE_UPROBE_MULTI),
+                            &opts);
+  if (linkfd_ < 0)
+  {
+    throw std::runtime_error("Error attaching probe: '" + probe_.name + "'");
+  }
+}
+#else
+void AttachedProbe::attach_multi_uprobe(void)
+{
+  throw std::runtime_error(
+      "Error attaching probe: " + probe_.name +
+      ", uprobe_multi is not available for linked libbpf version");
+}
+#endif // HAVE_LIBBPF_UPROBE_MULTI
+
 void AttachedProbe::attach_uprobe(bool safe_mode)
 {
+  // A single link attaches the program to all the functions of the binary
+  // the wildcard matched, see BPFtrace::add_probe()
+  if (!probe_.funcs.empty())
+  {
+    attach_multi_uprobe();
+    return;
+  }
+
   resolve_offset_uprobe(safe_mode);
 
   int perf_event_fd =
@@ -839,7 +1355,7 @@ int AttachedProbe::usdt_sem_up_manual(const std::string &fn_name, void *ctx)
 
   // Defer context destruction until probes are detached b/c context
   // destruction will decrement usdt semaphore count.
-  usdt_destructor_ = [ctx]() { bcc_usdt_close(ctx); };
+  usdt_destructors_.emplace_back([ctx]() { bcc_usdt_close(ctx); });
 
   return err;
 }
@@ -865,14 +1381,14 @@ int AttachedProbe::usdt_sem_up_manual_addsem(int pid,
   };
 
   // Set destructor to decrement the semaphore count
-  usdt_destructor_ = [pid, addsem]() {
+  usdt_destructors_.emplace_back([pid, addsem]() {
     void *c = bcc_usdt_new_frompid(pid, nullptr);
     if (!c)
       return;
 
     addsem(c, -1);
     bcc_usdt_close(c);
-  };
+  });
 
   // Use semaphore increment API to avoid having to hold onto the usdt context
   // for the entire tracing session. Reason we do it this way instead of
@@ -918,7 +1434,35 @@ int AttachedProbe::usdt_sem_up([[maybe_unused]] BPFfeature &feature,
 #endif
 }
 
-void AttachedProbe::attach_usdt(int pid, BPFfeature &feature)
+// The semaphores of the processes a probe attached once to their binary is
+// for. Processes which exited since they were found are skipped, it fails
+// only if none of them could be activated.
+int AttachedProbe::usdt_sem_up_pids(BPFfeature &feature,
+                                    const std::vector<int> &pids,
+                                    const std::string &fn_name)
+{
+  if (feature.has_uprobe_refcnt())
+    return 0;
+
+  size_t activated = 0;
+  for (int pid : pids)
+  {
+    // Only the binary of the probe is read, not all the process maps
+    void *ctx = bcc_usdt_new_frompid(pid, probe_.path.c_str());
+    if (!ctx)
+      continue;
+    if (usdt_sem_up(feature, pid, fn_name, ctx) == 0)
+      activated++;
+    else
+      LOG(WARNING) << "Could not enable probe " << probe_.name
+                   << " in PID " << pid;
+  }
+  return activated ? 0 : -1;
+}
+
+void AttachedProbe::attach_usdt(int pid,
+                                BPFfeature &feature,
+                                const std::vector<int> &sem_pids)
 {
   struct bcc_usdt_location loc = {};
   int err;
@@ -972,7 +1516,16 @@ void AttachedProbe::attach_usdt(int pid, BPFfeature &feature)
   //
   // NB: Do *not* use `ctx` after this call. It may either be open or closed,
   // depending on which path was taken.
-  err = usdt_sem_up(feature, pid, fn_name, ctx);
+  //
+  // A probe for several processes is attached once to their binary, only
+  // their semaphores are activated one by one
+  if (sem_pids.empty())
+    err = usdt_sem_up(feature, pid, fn_name, ctx);
+  else
+  {
+    bcc_usdt_close(ctx);
+    err = usdt_sem_up_pids(feature, sem_pids, fn_name);
+  }
 
   if (err)
   {
@@ -1024,6 +1577,15 @@ void AttachedProbe::attach_tracepoint()
   perf_event_fds_.push_back(perf_event_fd);
 }
 
+// The program is called with the arguments of the tracepoint's probe
+// function, the kernel doesn't copy them into the event record first
+void AttachedProbe::attach_raw_tracepoint()
+{
+  linkfd_ = bpf_attach_raw_tracepoint(progfd_, probe_.attach_point.c_str());
+  if (linkfd_ < 0)
+    throw std::runtime_error("Error attaching probe: " + probe_.name);
+}
+
 void AttachedProbe::attach_profile()
 {
   int pid = -1;
@@ -1055,7 +1617,7 @@ void AttachedProbe::attach_profile()
     LOG(FATAL) << "invalid profile path \"" << probe_.path << "\"";
   }
 
-  std::vector<int> cpus = get_online_cpus();
+  std::vector<int> cpus = get_probe_cpus(probe_.cpus);
   for (int cpu : cpus)
   {
     int perf_event_fd = bpf_attach_perf_event(progfd_, PERF_TYPE_SOFTWARE,
@@ -1072,7 +1634,8 @@ void AttachedProbe::attach_interval()
 {
   int pid = -1;
   int group_fd = -1;
-  int cpu = 0;
+  // The first of the CPUs it was given, if any
+  int cpu = probe_.cpus.empty() ? 0 : get_probe_cpus(probe_.cpus).at(0);
 
   uint64_t period = 0, freq = 0;
   if (probe_.path == "s")
@@ -1155,20 +1718,20 @@ void AttachedProbe::attach_hardware()
   uint64_t defaultp = 1000000;
   uint32_t type = 0;
 
-  // from linux/perf_event.h, with aliases from perf:
-  for (auto &probeListItem : HW_PROBE_LIST)
+  // from linux/perf_event.h, with aliases from perf. The first event of a
+  // group leads it, its samples run the program.
+  auto events = hardware_events(probe_.path);
+  auto leader = hardware_event(events.at(0));
+  if (leader)
   {
-    if (probe_.path == probeListItem.path || probe_.path == probeListItem.alias)
-    {
-      type = probeListItem.type;
-      defaultp = probeListItem.defaultp;
-    }
+    type = leader->type;
+    defaultp = leader->defaultp;
   }
 
   if (period == 0)
     period = defaultp;
 
-  std::vector<int> cpus = get_online_cpus();
+  std::vector<int> cpus = get_probe_cpus(probe_.cpus);
   for (int cpu : cpus)
   {
     int perf_event_fd = bpf_attach_perf_event(progfd_, PERF_TYPE_HARDWARE,
@@ -1178,10 +1741,39 @@ void AttachedProbe::attach_hardware()
       throw std::runtime_error("Error attaching probe: " + probe_.name);
 
     perf_event_fds_.push_back(perf_event_fd);
+    if (probe_.counter_slot < 0)
+      continue;
+
+    // The other events only count, scheduled on the PMU along with the
+    // leader so that counter() reads them over the same period of time
+    counter_fds_[probe_.counter_slot * counter_cpus() + cpu] = perf_event_fd;
+    for (size_t i = 1; i < events.size(); i++)
+    {
+      struct perf_event_attr attr = {};
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = hardware_event(events[i])->type;
+      int member_fd = syscall(__NR_perf_event_open,
+                              &attr,
+                              pid,
+                              cpu,
+                              perf_event_fd,
+                              PERF_FLAG_FD_CLOEXEC);
+      if (member_fd < 0)
+        throw std::system_error(errno,
+                                std::generic_category(),
+                                "Error attaching probe: " + probe_.name);
+
+      perf_event_fds_.push_back(member_fd);
+      counter_fds_[(probe_.counter_slot + i) * counter_cpus() + cpu] =
+          member_fd;
+    }
   }
 }
 
-void AttachedProbe::attach_watchpoint(int pid, const std::string& mode)
+static struct perf_event_attr watchpoint_attr(const std::string &mode,
+                                              uint64_t addr,
+                                              uint64_t len)
 {
   struct perf_event_attr attr = {};
   attr.type = PERF_TYPE_BREAKPOINT;
@@ -1198,10 +1790,42 @@ void AttachedProbe::attach_watchpoint(int pid, const std::string& mode)
       attr.bp_type |= HW_BREAKPOINT_X;
   }
 
-  attr.bp_addr = probe_.address;
-  attr.bp_len = probe_.len;
+  attr.bp_addr = addr;
+  attr.bp_len = len;
   // Generate a notification every 1 event; we care about every event
   attr.sample_period = 1;
+  return attr;
+}
+
+void AttachedProbe::disarm()
+{
+  for (int perf_event_fd : perf_event_fds_)
+    ioctl(perf_event_fd, PERF_EVENT_IOC_DISABLE, 0);
+}
+
+bool AttachedProbe::rearm(uint64_t addr)
+{
+#ifdef PERF_EVENT_IOC_MODIFY_ATTRIBUTES
+  auto attr = watchpoint_attr(probe_.mode, addr, probe_.len);
+  for (int perf_event_fd : perf_event_fds_)
+  {
+    // Moving the breakpoint keeps its debug register and program
+    if (ioctl(perf_event_fd, PERF_EVENT_IOC_MODIFY_ATTRIBUTES, &attr) != 0 ||
+        ioctl(perf_event_fd, PERF_EVENT_IOC_ENABLE, 0) != 0)
+      return false;
+  }
+  watched_address_ = addr;
+  return true;
+#else
+  (void)addr;
+  return false;
+#endif
+}
+
+void AttachedProbe::attach_watchpoint(int pid, const std::string& mode)
+{
+  auto attr = watchpoint_attr(mode, probe_.address, probe_.len);
+  watched_address_ = probe_.address;
 
   std::vector<int> cpus;
   if (pid >= 1)
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "bpffeature.h"
+#include "output.h"
 #include "types.h"
 
 #include <bcc/libbpf.h>
@@ -21,27 +22,76 @@ class AttachedProbe
 public:
   AttachedProbe(Probe &probe,
                 std::tuple<uint8_t *, uintptr_t> func,
-                bool safe_mode);
+                bool safe_mode,
+                int progfd = -1);
   AttachedProbe(Probe &probe,
                 std::tuple<uint8_t *, uintptr_t> func,
                 int pid,
                 BPFfeature &feature);
+  // A USDT probe attached once to its binary, activating the semaphores of
+  // the processes in sem_pids
+  AttachedProbe(Probe &probe,
+                std::tuple<uint8_t *, uintptr_t> func,
+                const std::vector<int> &sem_pids,
+                BPFfeature &feature);
   ~AttachedProbe();
   AttachedProbe(const AttachedProbe &) = delete;
   AttachedProbe &operator=(const AttachedProbe &) = delete;
 
   const Probe &probe() const;
+  int progfd() const;
+  // Code the program was loaded from
+  std::tuple<uint8_t *, uintptr_t> func() const;
+  // The code was moved, see BPFtrace::compact()
+  void set_func(std::tuple<uint8_t *, uintptr_t> func);
+  const LoadStats &load_stats() const;
+  // For hardware probes of a group of events, the fd of each event by its
+  // index in the counters map
+  const std::map<uint32_t, int> &counter_fds() const;
   int linkfd_ = -1;
 
+  // The address a watchpoint watches, probe().address is the last one its
+  // probe was attached to
+  uint64_t watched_address() const
+  {
+    return watched_address_;
+  }
+  // Disable the perf events of a watchpoint, keeping them for rearm()
+  void disarm();
+  /**
+     Move the breakpoints of a watchpoint to addr and enable them again.
+     Returns false if the kernel can't change them, which takes
+     PERF_EVENT_IOC_MODIFY_ATTRIBUTES (Linux 4.17).
+  */
+  bool rearm(uint64_t addr);
+
+  /**
+     Verifies and loads the program of probe, returning its fd. Throws
+     std::runtime_error if it can't be loaded.
+
+     Doesn't touch anything but its arguments, so programs can be loaded on
+     several threads at once as long as silence_stderr is false (stderr is
+     process-wide, the caller silences it once instead) and the verifier log
+     isn't printed, i.e. bt_verbose isn't set.
+
+     What it took is added to stats, if given. The verifier only reports the
+     instructions it went through in its log, with bt_verbose.
+  */
+  static int load_prog(const Probe &probe,
+                       std::tuple<uint8_t *, uintptr_t> func,
+                       bool silence_stderr = true,
+                       LoadStats *stats = nullptr);
+
 private:
   std::string eventprefix() const;
   std::string eventname() const;
   static std::string sanitise(const std::string &str);
   void resolve_offset_kprobe(bool safe_mode);
   void resolve_offset_uprobe(bool safe_mode);
-  void load_prog();
   void attach_kprobe(bool safe_mode);
+  void attach_multi_kprobe(void);
   void attach_uprobe(bool safe_mode);
+  void attach_multi_uprobe(void);
 
   // Note: the following usdt attachment functions will only activate a
   // semaphore if one exists.
@@ -55,9 +105,15 @@ private:
                   int pid,
                   const std::string &fn_name,
                   void *ctx);
-  void attach_usdt(int pid, BPFfeature &feature);
+  int usdt_sem_up_pids(BPFfeature &feature,
+                       const std::vector<int> &pids,
+                       const std::string &fn_name);
+  void attach_usdt(int pid,
+                   BPFfeature &feature,
+                   const std::vector<int> &sem_pids = {});
 
   void attach_tracepoint();
+  void attach_raw_tracepoint();
   void attach_profile();
   void attach_interval();
   void attach_software();
@@ -71,12 +127,16 @@ private:
   Probe &probe_;
   std::tuple<uint8_t *, uintptr_t> func_;
   std::vector<int> perf_event_fds_;
+  std::map<uint32_t, int> counter_fds_;
   int progfd_ = -1;
+  uint64_t watched_address_ = 0;
+  LoadStats load_stats_;
   uint64_t offset_ = 0;
 #ifdef HAVE_BCC_KFUNC
   int tracing_fd_ = -1;
 #endif
-  std::function<void()> usdt_destructor_;
+  // Decrement the semaphores, one for each process activated
+  std::vector<std::function<void()>> usdt_destructors_;
 };
 
 } // namespace bpftrace
@@ -38,23 +38,35 @@ static int fprintf_nop(void *out __attribute__((unused)), const char *fmt __attr
   return 0;
 }
 
+// The running binary, only used for its architecture. Opened on the first
+// uprobe checked and kept open for the run, nullptr if that failed.
+static bfd *self_bfd()
+{
+  static bfd *bfdf = []() -> bfd * {
+    std::string tpath = get_pid_exe("self");
+    bfd *b = bfd_openr(tpath.c_str(), nullptr);
+    if (b == nullptr)
+      return nullptr;
+
+    if (!bfd_check_format(b, bfd_object))
+    {
+      bfd_close(b);
+      return nullptr;
+    }
+    return b;
+  }();
+  return bfdf;
+}
+
 static AlignState is_aligned_buf(void *buf, uint64_t size, uint64_t offset)
 {
   disassembler_ftype disassemble;
   struct disassemble_info info;
-  std::string tpath = get_pid_exe("self");
-  bfd *bfdf;
+  bfd *bfdf = self_bfd();
 
-  bfdf = bfd_openr(tpath.c_str(), nullptr);
   if (bfdf == nullptr)
     return AlignState::Fail;
 
-  if (!bfd_check_format(bfdf, bfd_object))
-  {
-    bfd_close(bfdf);
-    return AlignState::Fail;
-  }
-
   init_disassemble_info(&info, stdout, fprintf_nop);
 
   info.arch = bfd_get_arch(bfdf);
@@ -81,14 +93,10 @@ static AlignState is_aligned_buf(void *buf, uint64_t size, uint64_t offset)
     pc += static_cast<uint64_t>(count);
 
     if (pc == offset)
-    {
-      bfd_close(bfdf);
       return AlignState::Ok;
-    }
 
   } while (static_cast<uint64_t>(count) > 0 && pc < size && pc < offset);
 
-  bfd_close(bfdf);
   return AlignState::NotAlign;
 }
 
@@ -1,5 +1,6 @@
 #include <bcc/libbpf.h>
-#ifdef HAVE_LIBBPF_MAP_BATCH
+#if defined(HAVE_LIBBPF_MAP_BATCH) || defined(HAVE_LIBBPF_KPROBE_MULTI) || \
+    defined(HAVE_LIBBPF_UPROBE_MULTI)
 #include <bpf/bpf.h>
 #endif
 #include <bpffeature.h>
@@ -7,11 +8,18 @@
 #include <cstdio>
 #include <fcntl.h>
 #include <fstream>
+#include <map>
+#include <sstream>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 
 #include "btf.h"
+#include "build_info.h"
+#include "log.h"
+#include "map.h"
 #include "probe_matcher.h"
+#include "timings.h"
 #include "utils.h"
 
 namespace bpftrace {
@@ -26,20 +34,14 @@ static bool try_load(const char* name,
                      char* logbuf,
                      size_t logbuf_size)
 {
+  Timings::Scope timing("feature detection");
   int ret = 0;
   StderrSilencer silencer;
   silencer.silence();
-  for (int attempt = 0; attempt < 3; attempt++)
+  // Probes that aren't supported fail to load with every version, each is
+  // tried only once
+  for (auto version : kernel_load_versions())
   {
-    auto version = kernel_version(attempt);
-    if (version == 0 && attempt > 0)
-    {
-      // Recent kernels don't check the version so we should try to call
-      // bcc_prog_load during first iteration even if we failed to determine
-      // the version. We should not do that in subsequent iterations to avoid
-      // zeroing of log_buf on systems with older kernels.
-      continue;
-    }
 
 #ifdef HAVE_BCC_PROG_LOAD
     ret = bcc_prog_load(
@@ -58,6 +60,7 @@ static bool try_load(const char* name,
     if (ret >= 0)
     {
       close(ret);
+      kernel_version_loaded(version);
       return true;
     }
   }
@@ -154,6 +157,16 @@ bool BPFfeature::detect_map(enum libbpf::bpf_map_type map_type)
     case libbpf::BPF_MAP_TYPE_STACK_TRACE:
       value_size = 8;
       break;
+    case libbpf::BPF_MAP_TYPE_RINGBUF:
+      // Ring buffers have no key/value and must be sized in whole pages
+      key_size = 0;
+      value_size = 0;
+      max_entries = getpagesize();
+      break;
+    case libbpf::BPF_MAP_TYPE_BLOOM_FILTER:
+      // The elements are values, there are no keys
+      key_size = 0;
+      break;
     default:
       break;
   }
@@ -194,6 +207,24 @@ bool BPFfeature::has_loop(void)
   return has_loop();
 }
 
+bool BPFfeature::has_bpf2bpf_call(void)
+{
+  if (has_bpf2bpf_call_.has_value())
+    return *has_bpf2bpf_call_;
+
+  struct bpf_insn insns[] = {
+    BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, BPF_PSEUDO_CALL, 0, 1),
+    BPF_EXIT_INSN(),
+    BPF_MOV64_IMM(BPF_REG_0, 0),
+    BPF_EXIT_INSN(),
+  };
+
+  has_bpf2bpf_call_ = std::make_optional<bool>(
+      try_load(libbpf::BPF_PROG_TYPE_KPROBE, insns, ARRAY_SIZE(insns)));
+
+  return has_bpf2bpf_call();
+}
+
 bool BPFfeature::has_btf(void)
 {
   BTF btf;
@@ -251,6 +282,7 @@ int BPFfeature::instruction_limit(void)
 bool BPFfeature::has_map_batch()
 {
 #ifndef HAVE_LIBBPF_MAP_BATCH
+  has_map_batch_ = false;
   return false;
 
 #else
@@ -291,6 +323,38 @@ bool BPFfeature::has_map_batch()
 #endif
 }
 
+bool BPFfeature::has_map_mmapable()
+{
+  if (has_map_mmapable_.has_value())
+    return *has_map_mmapable_;
+
+#ifdef HAVE_BCC_CREATE_MAP
+  int map_fd = bcc_create_map(
+#else
+  int map_fd = bpf_create_map(
+#endif
+      static_cast<enum ::bpf_map_type>(libbpf::BPF_MAP_TYPE_ARRAY),
+      nullptr,
+      4,
+      8,
+      1,
+      libbpf::BPF_F_MMAPABLE);
+  if (map_fd >= 0)
+    close(map_fd);
+
+  has_map_mmapable_ = map_fd >= 0;
+  return *has_map_mmapable_;
+}
+
+bool BPFfeature::has_ringbuf()
+{
+#ifndef HAVE_LIBBPF_RINGBUF
+  return false;
+#else
+  return has_map_ringbuf() && has_helper_ringbuf_output();
+#endif
+}
+
 bool BPFfeature::has_d_path(void)
 {
   if (has_d_path_.has_value())
@@ -333,6 +397,119 @@ bool BPFfeature::has_uprobe_refcnt()
   return *has_uprobe_refcnt_;
 }
 
+bool BPFfeature::has_kprobe_multi()
+{
+  if (has_kprobe_multi_.has_value())
+    return *has_kprobe_multi_;
+
+#if defined(HAVE_LIBBPF_KPROBE_MULTI) && defined(HAVE_BCC_PROG_LOAD_XATTR)
+  const char* sym = "ksys_read";
+  struct bpf_insn insns[] = { BPF_MOV64_IMM(BPF_REG_0, 0), BPF_EXIT_INSN() };
+  auto attach_type = static_cast<enum ::bpf_attach_type>(
+      libbpf::BPF_TRACE_KPROBE_MULTI);
+
+  struct bpf_load_program_attr attr = {};
+  attr.prog_type = static_cast<enum ::bpf_prog_type>(
+      libbpf::BPF_PROG_TYPE_KPROBE);
+  attr.expected_attach_type = attach_type;
+  attr.insns = insns;
+  attr.license = "GPL";
+
+  int progfd;
+  {
+    StderrSilencer silencer;
+    silencer.silence();
+    progfd = bcc_prog_load_xattr(&attr, sizeof(insns), nullptr, 0, true);
+  }
+
+  int linkfd = -1;
+  if (progfd >= 0)
+  {
+    DECLARE_LIBBPF_OPTS(bpf_link_create_opts, opts);
+    opts.kprobe_multi.syms = &sym;
+    opts.kprobe_multi.cnt = 1;
+    linkfd = bpf_link_create(progfd, 0, attach_type, &opts);
+    close(progfd);
+  }
+
+  if (linkfd >= 0)
+    close(linkfd);
+
+  has_kprobe_multi_ = linkfd >= 0;
+#else
+  has_kprobe_multi_ = false;
+#endif // HAVE_LIBBPF_KPROBE_MULTI && HAVE_BCC_PROG_LOAD_XATTR
+
+  return *has_kprobe_multi_;
+}
+
+bool BPFfeature::has_uprobe_multi()
+{
+  if (has_uprobe_multi_.has_value())
+    return *has_uprobe_multi_;
+
+#if defined(HAVE_LIBBPF_UPROBE_MULTI) && defined(HAVE_BCC_PROG_LOAD_XATTR)
+  auto attach_type = static_cast<enum ::bpf_attach_type>(
+      libbpf::BPF_TRACE_UPROBE_MULTI);
+  struct bpf_insn insns[] = { BPF_MOV64_IMM(BPF_REG_0, 0), BPF_EXIT_INSN() };
+
+  struct bpf_load_program_attr attr = {};
+  attr.prog_type = static_cast<enum ::bpf_prog_type>(
+      libbpf::BPF_PROG_TYPE_KPROBE);
+  attr.expected_attach_type = attach_type;
+  attr.insns = insns;
+  attr.license = "GPL";
+
+  int progfd;
+  {
+    StderrSilencer silencer;
+    silencer.silence();
+    progfd = bcc_prog_load_xattr(&attr, sizeof(insns), nullptr, 0, true);
+  }
+
+  bool supported = false;
+  if (progfd >= 0)
+  {
+    // "/" can't be probed, kernels knowing uprobe_multi links reject it
+    // with EBADF rather than not knowing the attach type
+    const unsigned long offset = 0;
+    DECLARE_LIBBPF_OPTS(bpf_link_create_opts, opts);
+    opts.uprobe_multi.path = "/";
+    opts.uprobe_multi.offsets = &offset;
+    opts.uprobe_multi.cnt = 1;
+    int linkfd = bpf_link_create(progfd, 0, attach_type, &opts);
+    supported = linkfd < 0 && errno == EBADF;
+    if (linkfd >= 0)
+      close(linkfd);
+    close(progfd);
+  }
+
+  has_uprobe_multi_ = supported;
+#else
+  has_uprobe_multi_ = false;
+#endif // HAVE_LIBBPF_UPROBE_MULTI && HAVE_BCC_PROG_LOAD_XATTR
+
+  return *has_uprobe_multi_;
+}
+
+bool BPFfeature::has_task_storage()
+{
+  if (has_task_storage_.has_value())
+    return *has_task_storage_;
+
+  bool supported = false;
+  if (has_helper_get_current_task_btf() && has_helper_task_storage_get())
+  {
+    int map_fd = create_task_storage_map("", 8);
+    if (map_fd >= 0)
+      close(map_fd);
+    supported = map_fd >= 0;
+  }
+
+  has_task_storage_ = supported;
+  return *has_task_storage_;
+}
+
 std::string BPFfeature::report(void)
 {
   std::stringstream buf;
@@ -355,23 +532,41 @@ std::string BPFfeature::report(void)
       << "  override_return: " << to_str(has_helper_override_return())
       << "  get_boot_ns: " << to_str(has_helper_ktime_get_boot_ns())
       << "  dpath: " << to_str(has_d_path())
-      << std::endl;
+      << "  ringbuf_output: " << to_str(has_helper_ringbuf_output())
+      << "  get_attach_cookie: " << to_str(has_helper_get_attach_cookie())
+      << "  task_storage_get: " << to_str(has_helper_task_storage_get())
+      << "  get_current_task_btf: "
+      << to_str(has_helper_get_current_task_btf())
+      << "  for_each_map_elem: " << to_str(has_helper_for_each_map_elem())
+      << "  perf_event_read_value: "
+      << to_str(has_helper_perf_event_read_value()) << std::endl;
 
   buf << "Kernel features" << std::endl
       << "  Instruction limit: " << instruction_limit() << std::endl
       << "  Loop support: " << to_str(has_loop())
+      << "  bpf2bpf calls: " << to_str(has_bpf2bpf_call())
       << "  btf (depends on Build:libbpf): " << to_str(has_btf())
       << "  map batch (depends on Build:libbpf): " << to_str(has_map_batch())
+      << "  mmapable maps: " << to_str(has_map_mmapable())
+      << "  ringbuf (depends on Build:libbpf): " << to_str(has_ringbuf())
       << "  uprobe refcount (depends on Build:bcc bpf_attach_uprobe refcount): "
-      << to_str(has_uprobe_refcnt()) << std::endl;
+      << to_str(has_uprobe_refcnt())
+      << "  kprobe_multi (depends on Build:libbpf): "
+      << to_str(has_kprobe_multi())
+      << "  uprobe_multi (depends on Build:libbpf): "
+      << to_str(has_uprobe_multi())
+      << "  task storage: " << to_str(has_task_storage()) << std::endl;
 
   buf << "Map types" << std::endl
       << "  hash: " << to_str(has_map_hash())
       << "  percpu hash: " << to_str(has_map_percpu_hash())
+      << "  lru hash: " << to_str(has_map_lru_hash())
       << "  array: " << to_str(has_map_array())
       << "  percpu array: " << to_str(has_map_percpu_array())
       << "  stack_trace: " << to_str(has_map_stack_trace())
       << "  perf_event_array: " << to_str(has_map_perf_event_array())
+      << "  ringbuf: " << to_str(has_map_ringbuf())
+      << "  bloom_filter: " << to_str(has_map_bloom_filter())
       << std::endl;
 
   buf << "Probe types" << std::endl
@@ -379,10 +574,135 @@ std::string BPFfeature::report(void)
       << "  tracepoint: " << to_str(has_prog_tracepoint())
       << "  perf_event: " << to_str(has_prog_perf_event())
       << "  kfunc: " << to_str(has_prog_kfunc())
+      << "  rawtracepoint: " << to_str(has_prog_raw_tracepoint())
       << "  iter:task: " << to_str(has_prog_iter_task())
       << "  iter:task_file: " << to_str(has_prog_iter_task_file()) << std::endl;
 
   return buf.str();
 }
 
+std::string BPFfeature::cache_key()
+{
+  std::ostringstream key;
+  key << BuildInfo::report();
+
+  struct utsname utsname;
+  uname(&utsname);
+  key << "kernel: " << utsname.release << " " << utsname.version << " "
+      << utsname.machine << std::endl;
+
+  // Features can be turned on and off by reloading modules or changing
+  // sysctls, which a reboot brings back
+  key << "boot id: " << get_boot_id() << std::endl;
+  return key.str();
+}
+
+template <typename F>
+void BPFfeature::for_each_result(F f)
+{
+  f("insns_limit", insns_limit_);
+  f("loop", has_loop_);
+  f("bpf2bpf_call", has_bpf2bpf_call_);
+  f("d_path", has_d_path_);
+  f("map_batch", has_map_batch_);
+  f("map_mmapable", has_map_mmapable_);
+  f("uprobe_refcnt", has_uprobe_refcnt_);
+  f("kprobe_multi", has_kprobe_multi_);
+  f("uprobe_multi", has_uprobe_multi_);
+  f("task_storage", has_task_storage_);
+
+  f("map_array", map_array_);
+  f("map_hash", map_hash_);
+  f("map_percpu_array", map_percpu_array_);
+  f("map_percpu_hash", map_percpu_hash_);
+  f("map_lru_hash", map_lru_hash_);
+  f("map_stack_trace", map_stack_trace_);
+  f("map_perf_event_array", map_perf_event_array_);
+  f("map_ringbuf", map_ringbuf_);
+  f("map_bloom_filter", map_bloom_filter_);
+
+  f("helper_send_signal", has_send_signal_);
+  f("helper_override_return", has_override_return_);
+  f("helper_get_current_cgroup_id", has_get_current_cgroup_id_);
+  f("helper_probe_read", has_probe_read_);
+  f("helper_probe_read_str", has_probe_read_str_);
+  f("helper_probe_read_user", has_probe_read_user_);
+  f("helper_probe_read_kernel", has_probe_read_kernel_);
+  f("helper_probe_read_user_str", has_probe_read_user_str_);
+  f("helper_probe_read_kernel_str", has_probe_read_kernel_str_);
+  f("helper_ktime_get_boot_ns", has_ktime_get_boot_ns_);
+  f("helper_ringbuf_output", has_ringbuf_output_);
+  f("helper_get_attach_cookie", has_get_attach_cookie_);
+  f("helper_task_storage_get", has_task_storage_get_);
+  f("helper_get_current_task_btf", has_get_current_task_btf_);
+  f("helper_for_each_map_elem", has_for_each_map_elem_);
+  f("helper_perf_event_read_value", has_perf_event_read_value_);
+
+  f("prog_kprobe", prog_kprobe_);
+  f("prog_tracepoint", prog_tracepoint_);
+  f("prog_perf_event", prog_perf_event_);
+  f("prog_kfunc", prog_kfunc_);
+  f("prog_raw_tracepoint", prog_raw_tracepoint_);
+  f("prog_iter_task", prog_iter_task_);
+  f("prog_iter_task_file", prog_iter_task_file_);
+}
+
+bool BPFfeature::load(const std::string &path)
+{
+  std::ifstream file(path);
+  if (!file)
+    return false;
+
+  std::stringstream contents;
+  contents << file.rdbuf();
+  std::string data = contents.str();
+  std::string key = cache_key();
+  if (data.compare(0, key.size(), key) != 0)
+    return false;
+
+  std::map<std::string, int> values;
+  std::istringstream results(data.substr(key.size()));
+  std::string name;
+  int value;
+  while (results >> name >> value)
+    values[name] = value;
+
+  bool complete = true;
+  for_each_result([&](const char *name, auto &result) {
+    auto value = values.find(name);
+    if (value == values.end())
+      complete = false;
+    else if (!result.has_value())
+      result = static_cast<typename std::decay_t<decltype(result)>::value_type>(
+          value->second);
+  });
+  return complete;
+}
+
+bool BPFfeature::detected()
+{
+  bool complete = true;
+  for_each_result([&](const char *, auto &result) {
+    if (!result.has_value())
+      complete = false;
+  });
+  return complete;
+}
+
+void BPFfeature::store(const std::string &path)
+{
+  // Runs every detection
+  report();
+
+  std::ostringstream data;
+  data << cache_key();
+  for_each_result([&](const char *name, auto &result) {
+    if (result.has_value())
+      data << name << " " << static_cast<int>(*result) << std::endl;
+  });
+
+  if (!write_file_atomic(path, data.str()))
+    LOG(WARNING) << "Could not write the BPF features to " << path;
+}
+
 } // namespace bpftrace
@@ -73,19 +73,48 @@ public:
 
   int instruction_limit();
   bool has_loop();
+  bool has_bpf2bpf_call();
   bool has_btf();
   bool has_map_batch();
+  bool has_map_mmapable();
+  bool has_ringbuf();
   bool has_d_path();
   bool has_uprobe_refcnt();
+  bool has_kprobe_multi();
+  bool has_uprobe_multi();
+  bool has_task_storage();
 
   std::string report(void);
 
+  /**
+     Takes the results of an earlier detection from the file at path, which
+     holds the kernel release and boot id they were found on. Returns false
+     if there is no such file, it's from another boot or bpftrace build, or
+     it's missing some of the features.
+  */
+  bool load(const std::string &path);
+
+  /**
+     Detects all the features that aren't known yet and writes the results to
+     the file at path, for load() to read
+  */
+  void store(const std::string &path);
+
+  /**
+     True when all the features are known, e.g. read by load(), so that none
+     is left to detect
+  */
+  bool detected();
+
   DEFINE_MAP_TEST(array, libbpf::BPF_MAP_TYPE_ARRAY);
   DEFINE_MAP_TEST(hash, libbpf::BPF_MAP_TYPE_HASH);
   DEFINE_MAP_TEST(percpu_array, libbpf::BPF_MAP_TYPE_PERCPU_ARRAY);
   DEFINE_MAP_TEST(percpu_hash, libbpf::BPF_MAP_TYPE_ARRAY);
+  DEFINE_MAP_TEST(lru_hash, libbpf::BPF_MAP_TYPE_LRU_HASH);
   DEFINE_MAP_TEST(stack_trace, libbpf::BPF_MAP_TYPE_STACK_TRACE);
   DEFINE_MAP_TEST(perf_event_array, libbpf::BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+  DEFINE_MAP_TEST(ringbuf, libbpf::BPF_MAP_TYPE_RINGBUF);
+  DEFINE_MAP_TEST(bloom_filter, libbpf::BPF_MAP_TYPE_BLOOM_FILTER);
   DEFINE_HELPER_TEST(send_signal, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_HELPER_TEST(override_return, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_HELPER_TEST(get_current_cgroup_id, libbpf::BPF_PROG_TYPE_KPROBE);
@@ -96,10 +125,17 @@ public:
   DEFINE_HELPER_TEST(probe_read_user_str, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_HELPER_TEST(probe_read_kernel_str, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_HELPER_TEST(ktime_get_boot_ns, libbpf::BPF_PROG_TYPE_KPROBE);
+  DEFINE_HELPER_TEST(ringbuf_output, libbpf::BPF_PROG_TYPE_KPROBE);
+  DEFINE_HELPER_TEST(get_attach_cookie, libbpf::BPF_PROG_TYPE_KPROBE);
+  DEFINE_HELPER_TEST(task_storage_get, libbpf::BPF_PROG_TYPE_KPROBE);
+  DEFINE_HELPER_TEST(get_current_task_btf, libbpf::BPF_PROG_TYPE_KPROBE);
+  DEFINE_HELPER_TEST(for_each_map_elem, libbpf::BPF_PROG_TYPE_KPROBE);
+  DEFINE_HELPER_TEST(perf_event_read_value, libbpf::BPF_PROG_TYPE_PERF_EVENT);
   DEFINE_PROG_TEST(kprobe, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_PROG_TEST(tracepoint, libbpf::BPF_PROG_TYPE_TRACEPOINT);
   DEFINE_PROG_TEST(perf_event, libbpf::BPF_PROG_TYPE_PERF_EVENT);
   DEFINE_PROG_TEST(kfunc, libbpf::BPF_PROG_TYPE_TRACING);
+  DEFINE_PROG_TEST(raw_tracepoint, libbpf::BPF_PROG_TYPE_RAW_TRACEPOINT);
   DEFINE_PROG_TEST_FUNC(iter_task,
                         libbpf::BPF_PROG_TYPE_TRACING,
                         "bpf_iter__task");
@@ -109,12 +145,22 @@ public:
 
 protected:
   std::optional<bool> has_loop_;
+  std::optional<bool> has_bpf2bpf_call_;
   std::optional<bool> has_d_path_;
   std::optional<int> insns_limit_;
   std::optional<bool> has_map_batch_;
+  std::optional<bool> has_map_mmapable_;
   std::optional<bool> has_uprobe_refcnt_;
+  std::optional<bool> has_kprobe_multi_;
+  std::optional<bool> has_uprobe_multi_;
+  std::optional<bool> has_task_storage_;
 
 private:
+  std::string cache_key();
+  // Calls f(name, result) for each of the std::optional results above
+  template <typename F>
+  void for_each_result(F f);
+
   bool detect_map(enum libbpf::bpf_map_type map_type);
   bool detect_helper(enum libbpf::bpf_func_id func_id,
                      enum libbpf::bpf_prog_type prog_type);
@@ -37,6 +37,12 @@ std::optional<std::tuple<uint8_t *, uintptr_t>> BpfOrc::getSection(
   return sec->second;
 }
 
+void BpfOrc::addSection(const std::string &name, std::vector<uint8_t> data)
+{
+  auto &section = added_sections_.emplace_back(std::move(data));
+  sections_[name] = std::make_tuple(section.data(), section.size());
+}
+
 #ifdef LLVM_ORC_V1
 #include "bpforcv1.cpp"
 #else // LLVM_ORC_V2
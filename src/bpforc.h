@@ -22,6 +22,7 @@
 #include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
 #endif
 
+#include <list>
 #include <optional>
 
 namespace bpftrace {
@@ -63,6 +64,8 @@ class BpfOrc
 {
 private:
   SectionMap sections_;
+  // Storage of the sections added by addSection()
+  std::list<std::vector<uint8_t>> added_sections_;
   std::unique_ptr<TargetMachine> TM;
   DataLayout DL;
 #if LLVM_VERSION_MAJOR >= 7
@@ -94,6 +97,13 @@ private:
 public:
   BpfOrc(TargetMachine *TM, DataLayout DL);
   void compile(std::unique_ptr<Module> M);
+#ifdef LLVM_ORC_V2
+  /* add an object compiled elsewhere, e.g. on another thread */
+  void compile(std::unique_ptr<MemoryBuffer> Obj);
+
+  /* a target machine of its own, TargetMachine isn't thread safe */
+  static std::unique_ptr<TargetMachine> CreateTargetMachine();
+#endif
 
   /* Helper for creating a orc object, responsible for creating internal objects
    */
@@ -103,6 +113,14 @@ public:
   std::optional<std::tuple<uint8_t *, uintptr_t>> getSection(
       const std::string &name);
 
+  /* add a section of a program that wasn't compiled here, see ProgramImage */
+  void addSection(const std::string &name, std::vector<uint8_t> data);
+
+  const SectionMap &getSections() const
+  {
+    return sections_;
+  }
+
   LLVMContext &getContext();
   const DataLayout &getDataLayout() const
   {
@@ -41,7 +41,19 @@ std::unique_ptr<BpfOrc> BpfOrc::Create()
   return std::make_unique<BpfOrc>(TM.release(), std::move(DL));
 }
 
+std::unique_ptr<TargetMachine> BpfOrc::CreateTargetMachine()
+{
+  auto JTMB = cantFail(
+      Expected<JITTargetMachineBuilder>(Triple(LLVMTargetTriple)));
+  return cantFail(JTMB.createTargetMachine());
+}
+
 void BpfOrc::compile(std::unique_ptr<Module> M)
 {
   cantFail(CompileLayer.add(MainJD, ThreadSafeModule(std::move(M), CTX)));
 }
+
+void BpfOrc::compile(std::unique_ptr<MemoryBuffer> Obj)
+{
+  cantFail(ObjectLayer.add(MainJD, std::move(Obj)));
+}
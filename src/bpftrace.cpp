@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
@@ -7,14 +11,20 @@
 #include <glob.h>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <malloc.h>
 #include <sstream>
 #include <sys/epoll.h>
+#include <thread>
 
 #include <fcntl.h>
+#include <linux/netlink.h>
 #include <signal.h>
 #include <sys/personality.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -30,12 +40,18 @@
 #ifdef HAVE_LIBBPF_BPF_H
 #include <bpf/bpf.h>
 #endif
+#ifdef HAVE_LIBBPF_RINGBUF
+#include <bpf/libbpf.h>
+#endif
 
 #include "ast/async_event_types.h"
 #include "bpftrace.h"
 #include "log.h"
+#include "map_pins.h"
+#include "output_writer.h"
 #include "printf.h"
 #include "resolve_cgroupid.h"
+#include "timings.h"
 #include "triggers.h"
 #include "utils.h"
 
@@ -51,78 +67,78 @@ DebugLevel bt_debug = DebugLevel::kNone;
 bool bt_quiet = false;
 bool bt_verbose = false;
 volatile sig_atomic_t BPFtrace::exitsig_recv = false;
-const int FMT_BUF_SZ = 512;
+volatile sig_atomic_t BPFtrace::self_stats_recv = false;
+volatile sig_atomic_t BPFtrace::print_maps_recv = false;
+volatile sig_atomic_t BPFtrace::flight_dump_recv = false;
+volatile sig_atomic_t BPFtrace::reload_recv = false;
+
+namespace {
+// Adds the time from its construction to its destruction to handling, if
+// there's one
+// Flushes the output after an event when it's line buffered
+class EventFlush
+{
+public:
+  explicit EventFlush(const Output &out) : out_(out)
+  {
+  }
+  ~EventFlush()
+  {
+    if (out_.line_buffered())
+      out_.outputstream().flush();
+  }
+
+private:
+  const Output &out_;
+};
+
+class HandlingTimer
+{
+public:
+  explicit HandlingTimer(SelfStats::Handling *handling) : handling_(handling)
+  {
+    if (handling_)
+      start_ = std::chrono::steady_clock::now();
+  }
+  ~HandlingTimer()
+  {
+    if (!handling_)
+      return;
+    handling_->count++;
+    handling_->time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start_)
+                              .count();
+  }
+
+private:
+  SelfStats::Handling *handling_;
+  std::chrono::steady_clock::time_point start_;
+};
+} // namespace
+// How long to wait for perf events before checking whether we should exit
+const int PERF_POLL_TIMEOUT_MS = 100;
+// Upper bound when backing off on idle perf buffers with a wakeup watermark
+const int PERF_POLL_TIMEOUT_MAX_MS = 1000;
+// Probes detached by each thread at least, fewer aren't worth a thread
+const size_t DETACH_PROBES_MIN = 16;
 
 std::string format(std::string fmt,
                    std::vector<std::unique_ptr<IPrintable>> &args)
 {
-  std::string retstr;
-  auto buffer = std::vector<char>(FMT_BUF_SZ);
-  auto check_snprintf_ret = [](int r) {
-    if (r < 0)
-    {
-      LOG(FATAL) << "format() error occurred: " << std::strerror(errno);
-    }
-  };
-  // Args have been made safe for printing by now, so replace nonstandard format
-  // specifiers with %s
-  size_t start_pos = 0;
-  while ((start_pos = fmt.find("%r", start_pos)) != std::string::npos)
-  {
-    fmt.replace(start_pos, 2, "%s");
-    start_pos += 2;
-  }
-
-  auto tokens_begin = std::sregex_iterator(fmt.begin(),
-                                           fmt.end(),
-                                           format_specifier_re);
-  auto tokens_end = std::sregex_iterator();
-
-  // replace format string tokens with args one by one
-  int literal_text_pos = 0; // starting pos of literal text (text that is not
-                            // format specifier)
-  int i = 0;                // args index
-  while (tokens_begin != tokens_end)
-  {
-    // take out the literal text
-    retstr += fmt.substr(literal_text_pos,
-                         tokens_begin->position() - literal_text_pos);
-    // replace current specifier with an arg
-    int r = args.at(i)->print(buffer.data(),
-                              buffer.capacity(),
-                              tokens_begin->str().c_str());
-
-    check_snprintf_ret(r);
-    if (static_cast<size_t>(r) >= buffer.capacity())
-    {
-      // the buffer is not big enough to hold the string, resize it
-      buffer.resize(r + 1);
-      int r = args.at(i)->print(buffer.data(),
-                                buffer.capacity(),
-                                tokens_begin->str().c_str());
-      check_snprintf_ret(r);
-    }
-    retstr += std::string(buffer.data());
-    // move to the next literal text
-    literal_text_pos = tokens_begin->position() + tokens_begin->length();
-    ++tokens_begin;
-    ++i;
-  }
-  // append whatever is left
-  retstr += fmt.substr(literal_text_pos);
-  return retstr;
+  return FormatPlan(fmt).render(args);
 }
 
 BPFtrace::~BPFtrace()
 {
-  for (const auto& pair : exe_sym_)
-  {
-    if (pair.second.second)
-      bcc_free_symcache(pair.second.second, pair.second.first);
-  }
+  // Before the retired programs they can refer to
+  attached_probes_.clear();
+  spare_watchpoints_.clear();
+  free_ringbuf();
 
-  if (ksyms_)
-    bcc_free_symcache(ksyms_, -1);
+  if (bpf_stats_fd_ >= 0)
+    close(bpf_stats_fd_);
+  if (hotplug_fd_ >= 0)
+    close(hotplug_fd_);
 }
 
 Probe BPFtrace::generateWatchpointSetupProbe(const std::string &func,
@@ -229,6 +245,8 @@ int BPFtrace::add_probe(ast::Probe &p)
         attach_funcs.push_back(attach_point->target + ":" + attach_point->ns +
                                ":" + attach_point->func);
       else if (probetype(attach_point->provider) == ProbeType::tracepoint ||
+               probetype(attach_point->provider) ==
+                   ProbeType::rawtracepoint ||
                probetype(attach_point->provider) == ProbeType::uprobe ||
                probetype(attach_point->provider) == ProbeType::uretprobe)
         attach_funcs.push_back(attach_point->target + ":" + attach_point->func);
@@ -236,6 +254,84 @@ int BPFtrace::add_probe(ast::Probe &p)
         attach_funcs.push_back(attach_point->func);
     }
 
+    // With kprobe_multi, a single probe attaches the program to all the
+    // matches at once. Unless the program has to be built for each of them,
+    // in which case each needs its own probe. Programs reading the probe
+    // builtin from the cookie are always attached that way, as that's what
+    // gives them a cookie.
+    auto type = probetype(attach_point->provider);
+    if ((type == ProbeType::kprobe || type == ProbeType::kretprobe) &&
+        !p.need_expansion && !attach_funcs.empty() &&
+        (p.use_cookies ||
+         (has_wildcard(attach_point->func) && attach_funcs.size() > 1 &&
+          feature_->has_kprobe_multi())))
+    {
+      Probe probe;
+      probe.type = type;
+      probe.attach_point = attach_point->func;
+      probe.log_size = log_size_;
+      probe.orig_name = p.name();
+      probe.name = attach_point->name(attach_point->func);
+      probe.index = attach_point->index(attach_point->func) > 0
+                        ? attach_point->index(attach_point->func)
+                        : p.index();
+      if (p.use_cookies)
+      {
+        // Ids were registered by codegen, see CodegenLLVM::addProbeIds()
+        for (auto &func : attach_funcs)
+        {
+          auto found = std::find(probe_ids_.begin(),
+                                 probe_ids_.end(),
+                                 attach_point->name(func));
+          probe.cookies.push_back(std::distance(probe_ids_.begin(), found));
+        }
+      }
+      probe.funcs = std::move(attach_funcs);
+      probes_.push_back(std::move(probe));
+      continue;
+    }
+
+    // Likewise with uprobe_multi, only a link attaches to the functions of a
+    // single binary, so the matches are grouped by binary. Binaries with a
+    // single match are attached to the usual way.
+    if ((type == ProbeType::uprobe || type == ProbeType::uretprobe) &&
+        !p.need_expansion && attach_point->address == 0 &&
+        attach_point->func_offset == 0 &&
+        (has_wildcard(attach_point->func) ||
+         has_wildcard(attach_point->target)) &&
+        attach_funcs.size() > 1 && feature_->has_uprobe_multi())
+    {
+      std::map<std::string, std::vector<std::string>> binaries;
+      for (auto func : attach_funcs)
+      {
+        std::string target = erase_prefix(func);
+        binaries[target].push_back(func);
+      }
+
+      attach_funcs.clear();
+      for (auto &[target, funcs] : binaries)
+      {
+        if (funcs.size() == 1)
+        {
+          attach_funcs.push_back(target + ":" + funcs.front());
+          continue;
+        }
+
+        Probe probe;
+        probe.type = type;
+        probe.path = target;
+        probe.attach_point = attach_point->func;
+        probe.log_size = log_size_;
+        probe.orig_name = p.name();
+        probe.name = attach_point->name(target, attach_point->func);
+        probe.index = attach_point->index(attach_point->func) > 0
+                          ? attach_point->index(attach_point->func)
+                          : p.index();
+        probe.funcs = std::move(funcs);
+        probes_.push_back(std::move(probe));
+      }
+    }
+
     // You may notice that the below loop is somewhat duplicated in
     // codegen_llvm.cpp. The reason is because codegen tries to avoid
     // generating duplicate programs if it can be avoided. For example, a
@@ -266,6 +362,8 @@ int BPFtrace::add_probe(ast::Probe &p)
         attach_point->func = func_id;
       }
       else if (probetype(attach_point->provider) == ProbeType::tracepoint ||
+               probetype(attach_point->provider) ==
+                   ProbeType::rawtracepoint ||
                probetype(attach_point->provider) == ProbeType::uprobe ||
                probetype(attach_point->provider) == ProbeType::uretprobe)
       {
@@ -304,6 +402,21 @@ int BPFtrace::add_probe(ast::Probe &p)
       probe.mode = attach_point->mode;
       probe.async = attach_point->async;
       probe.pin = attach_point->pin;
+      probe.counter_slot = attach_point->counter_slot;
+      probe.cpus = attach_point->cpus;
+      if ((probe.type == ProbeType::kfunc ||
+           probe.type == ProbeType::kretfunc) &&
+          !target.empty())
+        probe.btf_id = btf_.module_func_id(target, func_id);
+      if (p.probe_ids_at_load)
+      {
+        // The id the probe builtin would have with a program per match
+        auto name = attach_point->name(func);
+        auto found = std::find(probe_ids_.begin(), probe_ids_.end(), name);
+        probe.probe_id = std::distance(probe_ids_.begin(), found);
+        if (found == probe_ids_.end())
+          probe_ids_.push_back(name);
+      }
 
       if (probetype(attach_point->provider) == ProbeType::usdt)
       {
@@ -348,25 +461,68 @@ int BPFtrace::num_probes() const
 void BPFtrace::request_finalize()
 {
   finalize_ = true;
-  attached_probes_.clear();
+  // The stats go away with the programs, keep the final ones for print_maps()
+  if (probe_stats_enabled())
+    read_probe_stats();
+  detach_probes();
   if (child_)
     child_->terminate();
 }
 
-void perf_event_printer(void *cb_cookie, void *data, int size)
+static std::string helper_error_msg(const HelperErrorInfo &info,
+                                    int32_t return_value)
+{
+  std::stringstream msg;
+  msg << "Failed to " << libbpf::bpf_func_name[info.func_id] << ": ";
+  if (return_value < 0)
+    msg << strerror(-return_value) << " (" << return_value << ")";
+  else
+    msg << return_value;
+  return msg.str();
+}
+
+// The events of a batch, each preceded by its size and padded to 8 bytes,
+// see IRBuilderBPF::CreateBatchedOutput()
+static void unpack_batch(void *cb_cookie, uint8_t *data, size_t size)
 {
-  // The perf event data is not aligned, so we use memcpy to copy the data and
-  // avoid UBSAN errors. Using an std::vector guarantees that it will be aligned
-  // to the largest type. See:
-  // https://stackoverflow.com/questions/8456236/how-is-a-vectors-data-aligned.
-  std::vector<uint8_t> data_aligned;
-  data_aligned.resize(size);
-  memcpy(data_aligned.data(), data, size);
+  size_t offset = sizeof(uint64_t);
+  while (offset + sizeof(uint64_t) <= size)
+  {
+    auto len = read_data<uint64_t>(data + offset);
+    offset += sizeof(uint64_t);
+    if (len == 0 || len > size - offset)
+      break;
+    perf_event_printer(cb_cookie, data + offset, len);
+    offset += (len + 7) & ~7UL;
+  }
+}
 
+void perf_event_printer(void *cb_cookie, void *data, int size)
+{
+  // The perf event data is not aligned. Rather than copying every event into
+  // aligned memory, the event is decoded in place: the AsyncEvent structs are
+  // packed and all other fields are read with read_data(), which does an
+  // unaligned load.
   auto bpftrace = static_cast<BPFtrace*>(cb_cookie);
-  auto arg_data = data_aligned.data();
+  auto arg_data = static_cast<uint8_t *>(data);
+
+  if (size < static_cast<int>(sizeof(uint64_t)))
+    return;
+  if (read_data<uint64_t>(arg_data) == asyncactionint(AsyncAction::batch))
+  {
+    unpack_batch(cb_cookie, arg_data, size);
+    return;
+  }
+  EventFlush flush(*bpftrace->out_);
+
+  bpftrace->event_count_++;
 
-  auto printf_id = *reinterpret_cast<uint64_t *>(arg_data);
+  auto printf_id = read_data<uint64_t>(arg_data);
+  if (bpftrace->event_stats_interval_)
+    bpftrace->event_stats_.events[printf_id]++;
+  HandlingTimer timer(bpftrace->self_stats_interval_
+                          ? &bpftrace->self_stats_.events[printf_id]
+                          : nullptr);
 
   int err;
 
@@ -381,17 +537,56 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
     return;
   }
 
+  // Only printf() messages go through the reorder buffer, everything else
+  // has to wait for the ones still being symbolized
+  auto &pool = bpftrace->symbolize_pool_;
+  if (pool && !pool->empty())
+  {
+    if (printf_id < asyncactionint(AsyncAction::syscall))
+      pool->flush();
+    else
+      pool->drain();
+  }
+
   // async actions
   if (printf_id == asyncactionint(AsyncAction::exit))
   {
     bpftrace->request_finalize();
     return;
   }
+  else if (printf_id == asyncactionint(AsyncAction::flight_dump))
+  {
+    bpftrace->dump_flight_recorder();
+    return;
+  }
+  else if (printf_id == asyncactionint(AsyncAction::repeated))
+  {
+    auto repeated = static_cast<AsyncEvent::Repeated *>(data);
+    bpftrace->printf_output().repeated_events(repeated->count);
+    return;
+  }
+  else if (printf_id == asyncactionint(AsyncAction::raw_symbols_pid))
+  {
+    // A program built for --raw-symbols can run without it, from an image
+    auto raw_symbols_pid = static_cast<AsyncEvent::RawSymbolsPid *>(data);
+    if (bpftrace->raw_symbols_)
+      bpftrace->raw_symbols_->add_process(raw_symbols_pid->pid);
+    return;
+  }
   else if (printf_id == asyncactionint(AsyncAction::print))
   {
     auto print = static_cast<AsyncEvent::Print *>(data);
     IMap *map = *bpftrace->maps[print->mapid];
 
+    if (map->is_double_buffered())
+    {
+      err = bpftrace->flip_map(*map);
+      if (err)
+        throw std::runtime_error("Could not flip map with ident \"" +
+                                 map->name_ + "\", err=" +
+                                 std::to_string(err));
+    }
+
     err = bpftrace->print_map(*map, print->top, print->div);
 
     if (err)
@@ -399,14 +594,36 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
                                map->name_ + "\", err=" + std::to_string(err));
     return;
   }
+  else if (printf_id == asyncactionint(AsyncAction::print_delta))
+  {
+    auto print = static_cast<AsyncEvent::Print *>(data);
+    IMap *map = *bpftrace->maps[print->mapid];
+    err = bpftrace->print_map_delta(*map, print->top, print->div);
+    if (err)
+      throw std::runtime_error("Could not print map with ident \"" +
+                               map->name_ + "\", err=" + std::to_string(err));
+    return;
+  }
+  else if (printf_id == asyncactionint(AsyncAction::quantiles))
+  {
+    auto event = static_cast<AsyncEvent::Quantiles *>(data);
+    IMap *map = *bpftrace->maps[event->mapid];
+    err = bpftrace->print_map_quantiles(
+        *map, bpftrace->quantiles_args_.at(event->quantiles_id));
+    if (err)
+      throw std::runtime_error("Could not print quantiles of map with ident \"" +
+                               map->name_ + "\", err=" + std::to_string(err));
+    return;
+  }
   else if (printf_id == asyncactionint(AsyncAction::print_non_map))
   {
     auto print = static_cast<AsyncEvent::PrintNonMap *>(data);
     const SizedType &ty = bpftrace->non_map_print_args_.at(print->print_id);
 
-    std::vector<uint8_t> bytes;
-    for (size_t i = 0; i < ty.GetSize(); ++i)
-      bytes.emplace_back(reinterpret_cast<uint8_t>(print->content[i]));
+    // Output::value() wants an owned buffer. Reuse one across events so that
+    // it only grows when a larger value is printed.
+    static thread_local std::vector<uint8_t> bytes;
+    bytes.assign(print->content, print->content + ty.GetSize());
 
     bpftrace->out_->value(*bpftrace, ty, bytes);
 
@@ -455,16 +672,21 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
   }
   else if (printf_id == asyncactionint(AsyncAction::join))
   {
-    uint64_t join_id = (uint64_t) * (static_cast<uint64_t *>(data) + 1);
+    uint64_t join_id = read_data<uint64_t>(arg_data + sizeof(uint64_t));
     auto delim = bpftrace->join_args_[join_id].c_str();
     std::stringstream joined;
+    // The lengths include the NUL of each argument, 0 ends the list
+    auto lens = arg_data + 2 * sizeof(uint64_t);
+    auto arg = reinterpret_cast<char *>(
+        lens + bpftrace->join_argnum_ * sizeof(uint32_t));
     for (unsigned int i = 0; i < bpftrace->join_argnum_; i++) {
-      auto *arg = arg_data + 2*sizeof(uint64_t) + i * bpftrace->join_argsize_;
-      if (arg[0] == 0)
+      auto len = read_data<uint32_t>(lens + i * sizeof(uint32_t));
+      if (len == 0)
         break;
       if (i)
         joined << delim;
-      joined << arg;
+      joined.write(arg, strnlen(arg, len));
+      arg += len;
     }
     bpftrace->out_->message(MessageType::join, joined.str());
     return;
@@ -475,105 +697,22 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
     auto error_id = helpererror->error_id;
     auto return_value = helpererror->return_value;
     auto &info = bpftrace->helper_error_info_[error_id];
-    std::stringstream msg;
-    msg << "Failed to " << libbpf::bpf_func_name[info.func_id] << ": ";
-    if (return_value < 0)
-      msg << strerror(-return_value) << " (" << return_value << ")";
-    else
-      msg << return_value;
-    LOG(WARNING, info.loc, std::cerr) << msg.str();
+    LOG(WARNING, info.loc, std::cerr) << helper_error_msg(info, return_value);
     return;
   }
   else if (printf_id == asyncactionint(AsyncAction::watchpoint_attach))
   {
-    bool abort = false;
+    // Attaching takes loading the program and opening a perf event per CPU,
+    // it is done for the whole batch of events at once
     auto watchpoint = static_cast<AsyncEvent::Watchpoint *>(data);
-    uint64_t probe_idx = watchpoint->watchpoint_idx;
-    uint64_t addr = watchpoint->addr;
-
-    if (probe_idx >= bpftrace->watchpoint_probes_.size())
-    {
-      std::cerr << "Invalid watchpoint probe idx=" << probe_idx << std::endl;
-      abort = true;
-      goto out;
-    }
-
-    // Ignore duplicate watchpoints (idx && addr same), but allow the same
-    // address to be watched by different probes.
-    //
-    // NB: this check works b/c we set Probe::addr below
-    //
-    // TODO: Should we be printing a warning or info message out here?
-    if (bpftrace->watchpoint_probes_[probe_idx].address == addr)
-      goto out;
-
-    // Attach the real watchpoint probe
-    {
-      bool registers_available = true;
-      Probe &wp_probe = bpftrace->watchpoint_probes_[probe_idx];
-      wp_probe.address = addr;
-      std::vector<std::unique_ptr<AttachedProbe>> aps;
-      try
-      {
-        aps = bpftrace->attach_probe(wp_probe, *bpftrace->bpforc_);
-      }
-      catch (const EnospcException &ex)
-      {
-        registers_available = false;
-        bpftrace->out_->message(MessageType::lost_events,
-                                "Failed to attach watchpoint probe. You are "
-                                "out of watchpoint registers.");
-        goto out;
-      }
-
-      if (aps.empty() && registers_available)
-      {
-        std::cerr << "Unable to attach real watchpoint probe" << std::endl;
-        abort = true;
-        goto out;
-      }
-
-      for (auto &ap : aps)
-        bpftrace->attached_probes_.emplace_back(std::move(ap));
-    }
-
-  out:
-    // Async watchpoints are not SIGSTOP'd
-    if (bpftrace->watchpoint_probes_[probe_idx].async)
-      return;
-
-    // Let the tracee continue
-    pid_t pid = bpftrace->child_
-                    ? bpftrace->child_->pid()
-                    : (bpftrace->procmon_ ? bpftrace->procmon_->pid() : -1);
-    if (pid == -1 || ::kill(pid, SIGCONT) != 0)
-    {
-      std::cerr << "Failed to SIGCONT tracee: " << strerror(errno) << std::endl;
-      abort = true;
-    }
-
-    if (abort)
-      std::abort();
-
+    bpftrace->watchpoint_requests_.push_back(
+        { true, watchpoint->watchpoint_idx, watchpoint->addr });
     return;
   }
   else if (printf_id == asyncactionint(AsyncAction::watchpoint_detach))
   {
     auto unwatch = static_cast<AsyncEvent::WatchpointUnwatch *>(data);
-    uint64_t addr = unwatch->addr;
-
-    // Remove all probes watching `addr`. Note how we fail silently here
-    // (ie invalid addr). This lets script writers be a bit more aggressive
-    // when unwatch'ing addresses, especially if they're sampling a portion
-    // of addresses they're interested in watching.
-    bpftrace->attached_probes_.erase(
-        std::remove_if(bpftrace->attached_probes_.begin(),
-                       bpftrace->attached_probes_.end(),
-                       [&](const auto &ap) {
-                         return ap->probe().address == addr;
-                       }),
-        bpftrace->attached_probes_.end());
-
+    bpftrace->watchpoint_requests_.push_back({ false, 0, unwatch->addr });
     return;
   }
   else if ( printf_id >= asyncactionint(AsyncAction::syscall) &&
@@ -589,9 +728,12 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
     auto args = std::get<1>(bpftrace->system_args_[id]);
     auto arg_values = bpftrace->get_arg_values(args, arg_data);
 
-    bpftrace->out_->message(MessageType::syscall,
-                            exec_system(format(fmt, arg_values).c_str()),
-                            false);
+    if (bpftrace->system_pool_ && bpftrace->system_threads_)
+      bpftrace->system_pool_->submit(format(fmt, arg_values));
+    else
+      bpftrace->out_->message(MessageType::syscall,
+                              exec_system(format(fmt, arg_values).c_str()),
+                              false);
     return;
   }
   else if ( printf_id >= asyncactionint(AsyncAction::cat))
@@ -601,84 +743,127 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
     auto args = std::get<1>(bpftrace->cat_args_[id]);
     auto arg_values = bpftrace->get_arg_values(args, arg_data);
 
-    std::stringstream buf;
-    cat_file(format(fmt, arg_values).c_str(), bpftrace->cat_bytes_max_, buf);
-    bpftrace->out_->message(MessageType::cat, buf.str(), false);
+    if (bpftrace->system_pool_ && bpftrace->cat_threads_)
+      bpftrace->system_pool_->submit_cat(format(fmt, arg_values));
+    else if (bpftrace->cat_cache_)
+    {
+      std::string contents, error;
+      if (bpftrace->cat_cache_->read(format(fmt, arg_values), contents, error))
+        bpftrace->out_->message(MessageType::cat, contents, false);
+      else
+        LOG(ERROR) << error;
+    }
+    else
+    {
+      std::stringstream buf;
+      cat_file(format(fmt, arg_values).c_str(), bpftrace->cat_bytes_max_, buf);
+      bpftrace->out_->message(MessageType::cat, buf.str(), false);
+    }
 
     return;
   }
 
   // printf
-  auto fmt = std::get<0>(bpftrace->printf_args_[printf_id]);
-  auto args = std::get<1>(bpftrace->printf_args_[printf_id]);
-  auto arg_values = bpftrace->get_arg_values(args, arg_data);
+  // Written as is unless it would pass the messages still being symbolized
+  if ((!pool || pool->empty()) &&
+      bpftrace->printf_output().printf_event(printf_id, arg_data, size))
+    return;
+  auto &fmt = std::get<0>(bpftrace->printf_args_[printf_id]);
+  auto &args = std::get<1>(bpftrace->printf_args_[printf_id]);
+  if (pool && SymbolizePool::wants(args))
+  {
+    pool->submit(fmt, args, arg_data);
+    return;
+  }
+  auto &msg = bpftrace->printf_buf_;
+  msg.clear();
+  bpftrace->format_args(bpftrace->printf_plans_.at(printf_id),
+                        args,
+                        arg_data,
+                        msg);
+
+  if (pool && !pool->empty())
+    pool->submit(msg);
+  else
+    bpftrace->printf_output().message(MessageType::printf, msg, false);
+}
+
+// Reads the integer argument, sign extended if it is signed
+static uint64_t read_integer(const Field &arg, uint8_t *arg_data)
+{
+  bool is_signed = arg.type.IsSigned();
+  switch (arg.type.GetIntBitWidth())
+  {
+    case 64:
+      return read_data<uint64_t>(arg_data + arg.offset);
+    case 32:
+      return is_signed ? read_data<int32_t>(arg_data + arg.offset)
+                       : read_data<uint32_t>(arg_data + arg.offset);
+    case 16:
+      return is_signed ? read_data<int16_t>(arg_data + arg.offset)
+                       : read_data<uint16_t>(arg_data + arg.offset);
+    case 8:
+    case 1:
+      return is_signed ? read_data<int8_t>(arg_data + arg.offset)
+                       : read_data<uint8_t>(arg_data + arg.offset);
+    default:
+      LOG(FATAL) << "get_arg_values: invalid integer size. 8, 4, 2 and "
+                    "byte supported. "
+                 << arg.type.GetSize() << "provided";
+  }
+  return 0;
+}
 
-  bpftrace->out_->message(MessageType::printf, format(fmt, arg_values), false);
+void BPFtrace::format_args(const FormatPlan &plan,
+                           const std::vector<Field> &args,
+                           uint8_t *arg_data,
+                           std::string &out)
+{
+  for (size_t i = 0; i < args.size(); i++)
+  {
+    auto &arg = args[i];
+    out += plan.literal(i);
+    switch (arg.type.type)
+    {
+      case Type::integer:
+        plan.append_int(out, i, read_integer(arg, arg_data));
+        break;
+      case Type::pointer:
+        plan.append_int(out, i, read_data<uint64_t>(arg_data + arg.offset));
+        break;
+      case Type::string:
+      {
+        auto p = reinterpret_cast<char *>(arg_data + arg.offset);
+        plan.append_str(out,
+                        i,
+                        std::string_view(p, strnlen(p, arg.type.GetSize())));
+        break;
+      }
+      default:
+        plan.append_str(out, i, resolve_arg(arg, arg_data));
+    }
+  }
+  out += plan.tail();
 }
 
-std::vector<std::unique_ptr<IPrintable>> BPFtrace::get_arg_values(const std::vector<Field> &args, uint8_t* arg_data)
+std::vector<std::unique_ptr<IPrintable>> BPFtrace::get_arg_values(
+    const std::vector<Field> &args,
+    uint8_t *arg_data,
+    std::vector<PrintableSymbols *> *deferred)
 {
   std::vector<std::unique_ptr<IPrintable>> arg_values;
 
-  for (auto arg : args)
+  for (auto &arg : args)
   {
     switch (arg.type.type)
     {
       case Type::integer:
         if (arg.type.IsSigned())
-        {
-          int64_t val = 0;
-          switch (arg.type.GetIntBitWidth())
-          {
-            case 64:
-              val = *reinterpret_cast<int64_t *>(arg_data + arg.offset);
-              break;
-            case 32:
-              val = *reinterpret_cast<int32_t *>(arg_data + arg.offset);
-              break;
-            case 16:
-              val = *reinterpret_cast<int16_t *>(arg_data + arg.offset);
-              break;
-            case 8:
-              val = *reinterpret_cast<int8_t *>(arg_data + arg.offset);
-              break;
-            case 1:
-              val = *reinterpret_cast<int8_t *>(arg_data + arg.offset);
-              break;
-            default:
-              LOG(FATAL) << "get_arg_values: invalid integer size. 8, 4, 2 and "
-                            "byte supported. "
-                         << arg.type.GetSize() << "provided";
-          }
-          arg_values.push_back(std::make_unique<PrintableSInt>(val));
-        }
+          arg_values.push_back(std::make_unique<PrintableSInt>(
+              static_cast<int64_t>(read_integer(arg, arg_data))));
         else
-        {
-          uint64_t val = 0;
-          switch (arg.type.GetIntBitWidth())
-          {
-            case 64:
-              val = *reinterpret_cast<uint64_t *>(arg_data + arg.offset);
-              break;
-            case 32:
-              val = *reinterpret_cast<uint32_t *>(arg_data + arg.offset);
-              break;
-            case 16:
-              val = *reinterpret_cast<uint16_t *>(arg_data + arg.offset);
-              break;
-            case 8:
-              val = *reinterpret_cast<uint8_t *>(arg_data + arg.offset);
-              break;
-            case 1:
-              val = *reinterpret_cast<uint8_t *>(arg_data + arg.offset);
-              break;
-            default:
-              LOG(FATAL) << "get_arg_values: invalid integer size. 8, 4, 2 and "
-                            "byte supported. "
-                         << arg.type.GetSize() << "provided";
-          }
-          arg_values.push_back(std::make_unique<PrintableInt>(val));
-        }
+          arg_values.push_back(
+              std::make_unique<PrintableInt>(read_integer(arg, arg_data)));
         break;
       case Type::string:
       {
@@ -687,85 +872,111 @@ std::vector<std::unique_ptr<IPrintable>> BPFtrace::get_arg_values(const std::vec
             std::string(p, strnlen(p, arg.type.GetSize()))));
         break;
       }
-      case Type::buffer:
-        arg_values.push_back(std::make_unique<PrintableString>(resolve_buf(
-            reinterpret_cast<AsyncEvent::Buf *>(arg_data + arg.offset)->content,
-            reinterpret_cast<AsyncEvent::Buf *>(arg_data + arg.offset)
-                ->length)));
-        break;
-      case Type::ksym:
-        arg_values.push_back(
-          std::make_unique<PrintableString>(
-            resolve_ksym(*reinterpret_cast<uint64_t*>(arg_data+arg.offset))));
-        break;
       case Type::usym:
+        if (deferred)
+        {
+          auto symbols = std::make_unique<PrintableSymbols>(
+              read_data<uint64_t>(arg_data + arg.offset + 8),
+              read_data<uint64_t>(arg_data + arg.offset));
+          deferred->push_back(symbols.get());
+          arg_values.push_back(std::move(symbols));
+          break;
+        }
         arg_values.push_back(
-          std::make_unique<PrintableString>(
-            resolve_usym(
-              *reinterpret_cast<uint64_t*>(arg_data+arg.offset),
-              *reinterpret_cast<uint64_t*>(arg_data+arg.offset + 8))));
-        break;
-      case Type::inet:
-        arg_values.push_back(
-          std::make_unique<PrintableString>(
-            resolve_inet(
-              *reinterpret_cast<int64_t*>(arg_data+arg.offset),
-              reinterpret_cast<uint8_t*>(arg_data+arg.offset + 8))));
-        break;
-      case Type::username:
-        arg_values.push_back(
-          std::make_unique<PrintableString>(
-            resolve_uid(
-              *reinterpret_cast<uint64_t*>(arg_data+arg.offset))));
-        break;
-      case Type::probe:
-        arg_values.push_back(
-          std::make_unique<PrintableString>(
-            resolve_probe(
-              *reinterpret_cast<uint64_t*>(arg_data+arg.offset))));
-        break;
-      case Type::kstack:
-        arg_values.push_back(
-          std::make_unique<PrintableString>(
-            get_stack(
-              *reinterpret_cast<uint64_t*>(arg_data+arg.offset),
-              false,
-              arg.type.stack_type, 8)));
+            std::make_unique<PrintableString>(resolve_arg(arg, arg_data)));
         break;
       case Type::ustack:
+        // Frames of the build_id mode need no symbols
+        if (deferred && arg.type.stack_type.mode != StackMode::build_id)
+        {
+          int pid;
+          std::vector<uint64_t> frames;
+          if (arg.type.IsDwarfStack())
+          {
+            // The event data won't outlive the callback, the stack is
+            // unwound right away
+            frames = unwind_stack(
+                arg_data + arg.offset, arg.type.stack_type.limit, pid);
+          }
+          else
+          {
+            uint64_t stackidpid = read_data<uint64_t>(arg_data + arg.offset);
+            pid = stackidpid >> 32;
+            if (!read_stack(stackidpid, arg.type.stack_type, frames))
+              frames.clear();
+          }
+          auto symbols = std::make_unique<PrintableSymbols>(
+              pid, std::move(frames), arg.type.stack_type, 8);
+          deferred->push_back(symbols.get());
+          arg_values.push_back(std::move(symbols));
+          break;
+        }
         arg_values.push_back(
-          std::make_unique<PrintableString>(
-            get_stack(
-              *reinterpret_cast<uint64_t*>(arg_data+arg.offset),
-              true,
-              arg.type.stack_type, 8)));
-        break;
-      case Type::timestamp:
-        arg_values.push_back(
-            std::make_unique<PrintableString>(resolve_timestamp(
-                reinterpret_cast<AsyncEvent::Strftime *>(arg_data + arg.offset)
-                    ->strftime_id,
-                reinterpret_cast<AsyncEvent::Strftime *>(arg_data + arg.offset)
-                    ->nsecs_since_boot)));
+            std::make_unique<PrintableString>(resolve_arg(arg, arg_data)));
         break;
       case Type::pointer:
         arg_values.push_back(std::make_unique<PrintableInt>(
-            *reinterpret_cast<uint64_t *>(arg_data + arg.offset)));
+            read_data<uint64_t>(arg_data + arg.offset)));
         break;
-      case Type::mac_address:
-        arg_values.push_back(
-            std::make_unique<PrintableString>(resolve_mac_address(
-                reinterpret_cast<uint8_t *>(arg_data + arg.offset))));
-        break;
-        // fall through
       default:
-        LOG(FATAL) << "invalid argument type";
+        arg_values.push_back(
+            std::make_unique<PrintableString>(resolve_arg(arg, arg_data)));
     }
   }
 
   return arg_values;
 }
 
+std::string BPFtrace::resolve_arg(const Field &arg, uint8_t *arg_data)
+{
+  switch (arg.type.type)
+  {
+    case Type::buffer:
+      return resolve_buf(
+          reinterpret_cast<AsyncEvent::Buf *>(arg_data + arg.offset)->content,
+          reinterpret_cast<AsyncEvent::Buf *>(arg_data + arg.offset)->length);
+    case Type::ksym:
+      return resolve_ksym(read_data<uint64_t>(arg_data + arg.offset));
+    case Type::usym:
+      return resolve_usym(read_data<uint64_t>(arg_data + arg.offset),
+                          read_data<uint64_t>(arg_data + arg.offset + 8));
+    case Type::inet:
+      return resolve_inet(read_data<int64_t>(arg_data + arg.offset),
+                          reinterpret_cast<uint8_t *>(arg_data + arg.offset +
+                                                      8));
+    case Type::username:
+      return resolve_uid(read_data<uint64_t>(arg_data + arg.offset));
+    case Type::cgroup_path:
+      return resolve_cgroup_path(read_data<uint64_t>(arg_data + arg.offset));
+    case Type::probe:
+      return resolve_probe(read_data<uint64_t>(arg_data + arg.offset));
+    case Type::kstack:
+      return get_stack(read_data<uint64_t>(arg_data + arg.offset),
+                       false,
+                       arg.type.stack_type,
+                       8);
+    case Type::ustack:
+      if (arg.type.IsDwarfStack())
+        return get_dwarf_stack(arg_data + arg.offset, arg.type.stack_type, 8);
+      return get_stack(read_data<uint64_t>(arg_data + arg.offset),
+                       true,
+                       arg.type.stack_type,
+                       8);
+    case Type::timestamp:
+      return resolve_timestamp(
+          reinterpret_cast<AsyncEvent::Strftime *>(arg_data + arg.offset)
+              ->strftime_id,
+          reinterpret_cast<AsyncEvent::Strftime *>(arg_data + arg.offset)
+              ->nsecs_since_boot);
+    case Type::mac_address:
+      return resolve_mac_address(
+          reinterpret_cast<uint8_t *>(arg_data + arg.offset));
+    default:
+      LOG(FATAL) << "invalid argument type";
+  }
+  return "";
+}
+
 void BPFtrace::add_param(const std::string &param)
 {
   params_.emplace_back(param);
@@ -784,12 +995,43 @@ size_t BPFtrace::num_params() const
   return params_.size();
 }
 
+#ifdef HAVE_LIBBPF_RINGBUF
+static int ringbuf_printer(void *cb_cookie, void *data, size_t size)
+{
+  // The ring buffer is the only reader
+  static_cast<BPFtrace *>(cb_cookie)->event_stats_.readers[0].received++;
+  perf_event_printer(cb_cookie, data, size);
+  return 0;
+}
+
+// The async actions aren't counted as events of a reader
+static int control_printer(void *cb_cookie, void *data, size_t size)
+{
+  perf_event_printer(cb_cookie, data, size);
+  return 0;
+}
+#endif
+
 void perf_event_lost(void *cb_cookie, uint64_t lost)
 {
   auto bpftrace = static_cast<BPFtrace*>(cb_cookie);
   bpftrace->out_->lost_events(lost);
 }
 
+static void perf_reader_printer(void *cb_cookie, void *data, int size)
+{
+  auto cookie = static_cast<PerfReaderCookie *>(cb_cookie);
+  cookie->bpftrace->event_stats_.readers[cookie->reader].received++;
+  perf_event_printer(cookie->bpftrace, data, size);
+}
+
+static void perf_reader_lost(void *cb_cookie, uint64_t lost)
+{
+  auto cookie = static_cast<PerfReaderCookie *>(cb_cookie);
+  cookie->bpftrace->event_stats_.readers[cookie->reader].lost += lost;
+  perf_event_lost(cookie->bpftrace, lost);
+}
+
 std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_usdt_probe(
     Probe &probe,
     std::tuple<uint8_t *, uintptr_t> func,
@@ -798,25 +1040,35 @@ std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_usdt_probe(
 {
   std::vector<std::unique_ptr<AttachedProbe>> ret;
 
-  if (feature_->has_uprobe_refcnt() || !(file_activation && probe.path.size()))
+  // The semaphores of the --pids processes are activated like the ones
+  // file activation finds
+  bool activate_pids = pid == 0 && !target_pids_.empty();
+  if (feature_->has_uprobe_refcnt() || probe.path.empty() ||
+      !(file_activation || activate_pids))
   {
     ret.emplace_back(
         std::make_unique<AttachedProbe>(probe, func, pid, *feature_));
     return ret;
   }
 
+  std::vector<int> sem_pids;
+  if (activate_pids)
+    sem_pids.assign(target_pids_.begin(), target_pids_.end());
+  if (!file_activation)
+  {
+    ret.emplace_back(
+        std::make_unique<AttachedProbe>(probe, func, sem_pids, *feature_));
+    return ret;
+  }
+
   // File activation works by scanning through /proc/*/maps and seeing
   // which processes have the target executable in their address space
-  // with execute permission. If found, we will try to attach to each
-  // process we find.
+  // with execute permission. The probe is attached once to the executable,
+  // for all the processes found, which only get their semaphores activated.
   //
   // Note that this is the slow path. If the kernel has semaphore support
   // (feature_->has_uprobe_refcnt()), the kernel can do this for us and
   // much faster too.
-  glob_t globbuf;
-  if (::glob("/proc/[0-9]*/maps", GLOB_NOSORT, nullptr, &globbuf))
-    throw std::runtime_error("failed to glob");
-
   char *p;
   if (!(p = realpath(probe.path.c_str(), nullptr)))
   {
@@ -826,6 +1078,10 @@ std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_usdt_probe(
   std::string resolved(p);
   free(p);
 
+  glob_t globbuf;
+  if (::glob("/proc/[0-9]*/maps", GLOB_NOSORT, nullptr, &globbuf))
+    throw std::runtime_error("failed to glob");
+
   for (size_t i = 0; i < globbuf.gl_pathc; ++i)
   {
     std::string path(globbuf.gl_pathv[i]);
@@ -861,25 +1117,29 @@ std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_usdt_probe(
         throw std::runtime_error("failed to parse pid=" + pid_str);
       }
 
-      ret.emplace_back(
-          std::make_unique<AttachedProbe>(probe, func, pid_parsed, *feature_));
+      if (std::find(sem_pids.begin(), sem_pids.end(), pid_parsed) ==
+          sem_pids.end())
+        sem_pids.push_back(pid_parsed);
       break;
     }
   }
+  globfree(&globbuf);
 
-  if (ret.empty())
+  if (sem_pids.empty())
+  {
     LOG(ERROR) << "Failed to find processes running " << probe.path;
+    return ret;
+  }
 
+  ret.emplace_back(
+      std::make_unique<AttachedProbe>(probe, func, sem_pids, *feature_));
   return ret;
 }
 
-std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_probe(
-    Probe &probe,
+std::optional<std::tuple<uint8_t *, uintptr_t>> BPFtrace::get_probe_section(
+    const Probe &probe,
     BpfOrc &bpforc)
 {
-  std::vector<std::unique_ptr<AttachedProbe>> ret;
-
-
   // use the single-probe program if it exists (as is the case with wildcards
   // and the name builtin, which must be expanded into separate programs per
   // probe), else try to find a the program based on the original probe name
@@ -902,6 +1162,50 @@ std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_probe(
     section = bpforc.getSection(orig_name);
   }
 
+  return section;
+}
+
+// Loads the programs split off the one of probe into the slots of the tail
+// call map they are called through, before that one gets to run. Split
+// probes aren't expanded (nor USDT probes), all their matches share the
+// programs.
+void BPFtrace::load_tail_calls(const Probe &probe, BpfOrc &bpforc)
+{
+  auto section = get_section_name_for_probe(probe.orig_name, probe.index);
+  if (!tail_calls_loaded_.insert(section).second)
+    return;
+
+  // See get_section_name_for_tail_call()
+  auto prefix = section + "_tail";
+  int mapfd = maps[MapManager::Type::TailCalls].value()->mapfd_;
+  for (auto &[name, code] : bpforc.getSections())
+  {
+    if (name.compare(0, prefix.size(), prefix) != 0)
+      continue;
+    auto slot = name.substr(prefix.size());
+    if (slot.empty() || !std::all_of(slot.begin(), slot.end(), ::isdigit))
+      continue;
+
+    uint32_t key = std::stoul(slot);
+    int progfd = AttachedProbe::load_prog(
+        probe, code, true, &load_stats_[probe.name]);
+    // The map keeps the program loaded
+    int err = bpf_update_elem(mapfd, &key, &progfd, 0);
+    close(progfd);
+    if (err)
+      throw std::runtime_error("Failed to add program " + name +
+                               " to the tail call map");
+  }
+}
+
+std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_probe(
+    Probe &probe,
+    BpfOrc &bpforc,
+    int progfd)
+{
+  std::vector<std::unique_ptr<AttachedProbe>> ret;
+
+  auto section = get_probe_section(probe, bpforc);
   if (!section)
   {
     if (probe.name != probe.orig_name)
@@ -916,6 +1220,9 @@ std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_probe(
   {
     pid_t pid = child_ ? child_->pid() : this->pid();
 
+    if (maps.Has(MapManager::Type::TailCalls))
+      load_tail_calls(probe, bpforc);
+
     if (probe.type == ProbeType::usdt)
     {
       auto aps = attach_usdt_probe(probe, *section, pid, usdt_file_activation_);
@@ -933,8 +1240,19 @@ std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_probe(
     }
     else
     {
-      ret.emplace_back(
-          std::make_unique<AttachedProbe>(probe, *section, safe_mode_));
+      ret.emplace_back(std::make_unique<AttachedProbe>(
+          probe, *section, safe_mode_, progfd));
+      // The events of a hardware probe group are read by counter() through
+      // the counters map
+      for (auto &[index, fd] : ret.back()->counter_fds())
+      {
+        int mapfd = maps[MapManager::Type::Counters].value()->mapfd_;
+        uint32_t key = index;
+        int value = fd;
+        if (bpf_update_elem(mapfd, &key, &value, 0))
+          throw std::runtime_error("Error attaching probe: " + probe.name +
+                                   ", the counters map couldn't be updated");
+      }
       return ret;
     }
   }
@@ -966,6 +1284,7 @@ bool attach_reverse(const Probe &p)
     case ProbeType::kretfunc:
     case ProbeType::kretprobe:
     case ProbeType::tracepoint:
+    case ProbeType::rawtracepoint:
     case ProbeType::profile:
     case ProbeType::interval:
     case ProbeType::watchpoint:
@@ -979,6 +1298,604 @@ bool attach_reverse(const Probe &p)
   return {}; // unreached
 }
 
+// Verifying a program can take the kernel much longer than attaching it, so
+// the programs of the probes are loaded across a few threads up front,
+// leaving only the attachment, which needs to happen in order, to run().
+// Returns the fd of each program of probes_ that got loaded, -1 for the ones
+// that will be loaded when they're attached.
+std::vector<int> BPFtrace::load_progs(BpfOrc &bpforc)
+{
+  std::vector<int> progfds(probes_.size(), -1);
+
+  // The verifier log is printed along with the probe it is for, and debug
+  // output needs stderr, which can only be silenced for the whole process
+  if (bt_verbose || bt_debug != DebugLevel::kNone)
+    return progfds;
+
+  std::vector<std::pair<size_t, std::tuple<uint8_t *, uintptr_t>>> progs;
+  for (size_t i = 0; i < probes_.size(); ++i)
+  {
+    // USDT probes get a program per location and PID, watchpoints are
+    // loaded along with the perf event they're attached to
+    auto type = probes_[i].type;
+    if (type == ProbeType::usdt || type == ProbeType::watchpoint ||
+        type == ProbeType::asyncwatchpoint)
+      continue;
+
+    if (auto section = get_probe_section(probes_[i], bpforc))
+      progs.emplace_back(i, *section);
+  }
+
+  uint64_t threads = load_threads_ ? load_threads_ : get_online_cpus().size();
+  threads = std::min<uint64_t>(threads, progs.size());
+  if (threads <= 1)
+    return progfds;
+
+  // Redirect stderr, so we don't get error messages from BCC
+  StderrSilencer silencer;
+  silencer.silence();
+
+  std::atomic<size_t> next = 0;
+  auto load = [&]() {
+    for (size_t n = next++; n < progs.size(); n = next++)
+    {
+      auto &[i, func] = progs[n];
+      try
+      {
+        progfds[i] = AttachedProbe::load_prog(probes_[i], func, false);
+      }
+      catch (const std::runtime_error &)
+      {
+        // Left to attach_probe(), which loads it again and reports the error
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (uint64_t i = 0; i < threads; ++i)
+    workers.emplace_back(load);
+  for (auto &worker : workers)
+    worker.join();
+
+  return progfds;
+}
+
+// Destroying an AttachedProbe detaches it, which for kprobes, uprobes and
+// tracepoints not attached through a link means a write to tracefs. With
+// hundreds of them that's seconds at exit, during which the probes left keep
+// firing and END waits, so they are detached by as many threads as loaded
+// them.
+void BPFtrace::detach_probes()
+{
+  auto probes = std::move(attached_probes_);
+  attached_probes_.clear();
+  spare_watchpoints_.clear();
+
+  uint64_t threads = load_threads_ ? load_threads_ : get_online_cpus().size();
+  threads = std::min<uint64_t>(threads, probes.size() / DETACH_PROBES_MIN);
+  if (threads <= 1)
+    return;
+
+  Timings::Scope timing("detach");
+  // The USDT semaphores are released through bcc's USDT contexts, which are
+  // left to this thread
+  std::vector<std::unique_ptr<AttachedProbe> *> parallel;
+  for (auto &ap : probes)
+    if (ap->probe().type != ProbeType::usdt)
+      parallel.push_back(&ap);
+
+  std::atomic<size_t> next = 0;
+  auto detach = [&]() {
+    for (size_t n = next++; n < parallel.size(); n = next++)
+      parallel[n]->reset();
+  };
+
+  std::vector<std::thread> workers;
+  for (uint64_t i = 0; i < threads; ++i)
+    workers.emplace_back(detach);
+  for (auto &worker : workers)
+    worker.join();
+}
+
+// Once the probes are attached the JIT's state is only needed for the code
+// of the programs loaded later (END, watchpoints, --reload), which is copied
+// out of it. BTF, macros and enums are only needed to compile, which only
+// --reload does again. The structs are kept, printing records reads them.
+void BPFtrace::compact()
+{
+  Timings::Scope timing("compact");
+  auto compacted = BpfOrc::Create();
+  std::unordered_map<uint8_t *, std::tuple<uint8_t *, uintptr_t>> moved;
+  for (auto &[name, section] : bpforc_->getSections())
+  {
+    auto code = std::get<0>(section);
+    compacted->addSection(
+        name, std::vector<uint8_t>(code, code + std::get<1>(section)));
+    moved[code] = *compacted->getSection(name);
+  }
+  for (auto &ap : attached_probes_)
+  {
+    auto it = moved.find(std::get<0>(ap->func()));
+    if (it != moved.end())
+      ap->set_func(it->second);
+  }
+  bpforc_ = std::move(compacted);
+
+  macros_.clear();
+  enums_.clear();
+  if (!reload_)
+    btf_.release();
+#ifdef __GLIBC__
+  // What was freed is handed back, rather than kept for allocations that
+  // won't come
+  malloc_trim(0);
+#endif
+}
+
+void BPFtrace::swap_program(ProgramState &state)
+{
+  maps.Swap(state.maps);
+  std::swap(bpforc_, state.bpforc);
+  std::swap(probes_, state.probes);
+  std::swap(special_probes_, state.special_probes);
+  std::swap(watchpoint_probes_, state.watchpoint_probes);
+  // Of the probes of the program swapped out
+  spare_watchpoints_.clear();
+  std::swap(structs_, state.structs);
+  std::swap(macros_, state.macros);
+  std::swap(enums_, state.enums);
+  std::swap(printf_args_, state.printf_args);
+  std::swap(printf_plans_, state.printf_plans);
+  std::swap(system_args_, state.system_args);
+  std::swap(seq_printf_args_, state.seq_printf_args);
+  std::swap(join_args_, state.join_args);
+  std::swap(time_args_, state.time_args);
+  std::swap(strftime_args_, state.strftime_args);
+  std::swap(cat_args_, state.cat_args);
+  std::swap(non_map_print_args_, state.non_map_print_args);
+  std::swap(quantiles_args_, state.quantiles_args);
+  std::swap(helper_error_info_, state.helper_error_info);
+  std::swap(probe_ids_, state.probe_ids);
+  std::swap(probe_gates_, state.probe_gates);
+  std::swap(seq_printf_ids_, state.seq_printf_ids);
+  std::swap(btf_set_, state.btf_set);
+  std::swap(btf_ap_args_, state.btf_ap_args);
+  std::swap(scratch_size_, state.scratch_size);
+  std::swap(has_usdt_, state.has_usdt);
+  std::swap(tail_calls_loaded_, state.tail_calls_loaded);
+}
+
+// Whether the running map a can stand in for the newly created b, i.e. the
+// programs of the new script read and write it the same way
+static bool same_map(IMap &a, IMap &b)
+{
+  if (a.type_ != b.type_ || a.key_.args_ != b.key_.args_ ||
+      a.key_.packed_ != b.key_.packed_ || a.map_type_ != b.map_type_ ||
+      a.max_entries_ != b.max_entries_ ||
+      a.is_mmapped() != b.is_mmapped() ||
+      a.is_double_buffered() != b.is_double_buffered() ||
+      a.window_mapfds_.size() != b.window_mapfds_.size() ||
+      a.window_slot_ns_ != b.window_slot_ns_ ||
+      (a.sketch_mapfd_ < 0) != (b.sketch_mapfd_ < 0) ||
+      (a.ttl_mapfd_ < 0) != (b.ttl_mapfd_ < 0) || a.ttl_ns_ != b.ttl_ns_ ||
+      a.hashed_key_ != b.hashed_key_ || a.bloom_ != b.bloom_ ||
+      a.bucket_array_ != b.bucket_array_)
+    return false;
+  if ((a.type_.IsLhistTy() || a.type_.IsLlhistTy()) &&
+      (a.lqmin != b.lqmin || a.lqmax != b.lqmax || a.lqstep != b.lqstep))
+    return false;
+#ifdef HAVE_LIBBPF_BPF_H
+  struct bpf_map_info ia = {}, ib = {};
+  uint32_t len_a = sizeof(ia), len_b = sizeof(ib);
+  if (bpf_obj_get_info(a.mapfd_, &ia, &len_a) != 0 ||
+      bpf_obj_get_info(b.mapfd_, &ib, &len_b) != 0)
+    return false;
+  return ia.type == ib.type && ia.key_size == ib.key_size &&
+         ia.value_size == ib.value_size && ia.max_entries == ib.max_entries &&
+         ia.map_flags == ib.map_flags;
+#else
+  return true;
+#endif
+}
+
+// Whether the new probe b attaches to the same thing as the running a
+static bool same_probe(const Probe &a, const Probe &b)
+{
+  return a.name == b.name && a.orig_name == b.orig_name &&
+         a.index == b.index && a.type == b.type && a.path == b.path &&
+         a.usdt_location_idx == b.usdt_location_idx && a.pid == b.pid &&
+         a.freq == b.freq && a.funcs == b.funcs && a.cookies == b.cookies &&
+         a.probe_id == b.probe_id && a.counter_slot == b.counter_slot &&
+         a.address == b.address && a.len == b.len && a.mode == b.mode &&
+         a.cpus == b.cpus;
+}
+
+static bool same_code(std::tuple<uint8_t *, uintptr_t> a,
+                      std::tuple<uint8_t *, uintptr_t> b)
+{
+  return std::get<1>(a) == std::get<1>(b) &&
+         memcmp(std::get<0>(a), std::get<0>(b), std::get<1>(a)) == 0;
+}
+
+// Points the map references of code at the maps given by fds
+static void patch_map_fds(uint8_t *code,
+                          size_t size,
+                          const std::unordered_map<int32_t, int32_t> &fds)
+{
+  auto insns = reinterpret_cast<struct bpf_insn *>(code);
+  size_t n = size / sizeof(struct bpf_insn);
+  for (size_t i = 0; i + 1 < n; ++i)
+  {
+    auto &insn = insns[i];
+    if (insn.code != (BPF_LD | BPF_DW | BPF_IMM))
+      continue;
+    if (insn.src_reg == BPF_PSEUDO_MAP_FD ||
+        insn.src_reg == BPF_PSEUDO_MAP_VALUE)
+    {
+      auto fd = fds.find(insn.imm);
+      if (fd != fds.end())
+        insn.imm = fd->second;
+    }
+    // The second half holds no opcode
+    ++i;
+  }
+}
+
+// Attaches and detaches the watchpoints asked for by the events read since
+// the last call, then lets the tracee stopped by the synchronous ones go on
+void BPFtrace::arm_watchpoints()
+{
+  if (watchpoint_requests_.empty())
+    return;
+
+  bool abort = false;
+  bool stopped = false;
+  auto requests = std::move(watchpoint_requests_);
+  watchpoint_requests_.clear();
+  for (auto &request : requests)
+  {
+    if (!request.attach)
+    {
+      detach_watchpoint(request.addr);
+      continue;
+    }
+    if (request.probe_idx >= watchpoint_probes_.size())
+    {
+      std::cerr << "Invalid watchpoint probe idx=" << request.probe_idx
+                << std::endl;
+      abort = true;
+      continue;
+    }
+    Probe &probe = watchpoint_probes_[request.probe_idx];
+    // Async watchpoints are not SIGSTOP'd
+    if (!probe.async)
+      stopped = true;
+    if (!attach_watchpoint(probe, request.addr))
+      abort = true;
+  }
+
+  // Let the tracee continue, once for all the events that stopped it
+  if (stopped || abort)
+  {
+    pid_t pid = child_ ? child_->pid() : (procmon_ ? procmon_->pid() : -1);
+    if (pid == -1 || ::kill(pid, SIGCONT) != 0)
+    {
+      std::cerr << "Failed to SIGCONT tracee: " << strerror(errno) << std::endl;
+      abort = true;
+    }
+  }
+
+  if (abort)
+    std::abort();
+}
+
+// Returns false if the watchpoint couldn't be attached, but for running out
+// of debug registers
+bool BPFtrace::attach_watchpoint(Probe &probe, uint64_t addr)
+{
+  // Ignore duplicate watchpoints (probe && addr same), but allow the same
+  // address to be watched by different probes.
+  for (auto &ap : attached_probes_)
+  {
+    if (&ap->probe() == &probe && ap->watched_address() == addr)
+      return true;
+  }
+
+  auto spare = std::find_if(spare_watchpoints_.begin(),
+                            spare_watchpoints_.end(),
+                            [&](auto &ap) { return &ap->probe() == &probe; });
+  if (spare != spare_watchpoints_.end())
+  {
+    auto ap = std::move(*spare);
+    spare_watchpoints_.erase(spare);
+    if (ap->rearm(addr))
+    {
+      probe.address = addr;
+      attached_probes_.emplace_back(std::move(ap));
+      return true;
+    }
+  }
+
+  probe.address = addr;
+  std::vector<std::unique_ptr<AttachedProbe>> aps;
+  while (true)
+  {
+    try
+    {
+      aps = attach_probe(probe, *bpforc_);
+      break;
+    }
+    catch (const EnospcException &ex)
+    {
+      // The spares hold on to their registers
+      if (!spare_watchpoints_.empty())
+      {
+        spare_watchpoints_.clear();
+        continue;
+      }
+      out_->message(MessageType::lost_events,
+                    "Failed to attach watchpoint probe. You are "
+                    "out of watchpoint registers.");
+      return true;
+    }
+  }
+
+  if (aps.empty())
+  {
+    std::cerr << "Unable to attach real watchpoint probe" << std::endl;
+    return false;
+  }
+  for (auto &ap : aps)
+    attached_probes_.emplace_back(std::move(ap));
+  return true;
+}
+
+// Removes all the watchpoints watching addr. Note how we fail silently here
+// (ie invalid addr). This lets script writers be a bit more aggressive when
+// unwatch'ing addresses, especially if they're sampling a portion of
+// addresses they're interested in watching.
+void BPFtrace::detach_watchpoint(uint64_t addr)
+{
+  for (auto it = attached_probes_.begin(); it != attached_probes_.end();)
+  {
+    auto &ap = *it;
+    if ((ap->probe().type == ProbeType::watchpoint ||
+         ap->probe().type == ProbeType::asyncwatchpoint) &&
+        ap->watched_address() == addr)
+    {
+      ap->disarm();
+      spare_watchpoints_.emplace_back(std::move(ap));
+      it = attached_probes_.erase(it);
+    }
+    else
+      ++it;
+  }
+}
+
+// Reads what the kernel has buffered, so that the events of the probes
+// about to be replaced are printed with the program that sent them
+void BPFtrace::read_pending_events()
+{
+  consume_control();
+#ifdef HAVE_LIBBPF_RINGBUF
+  if (ringbuf_)
+    ring_buffer__consume(ringbuf_);
+#endif
+  for (auto &reader : open_perf_buffers_)
+  {
+    if (reader)
+      perf_reader_event_read((perf_reader *)reader.get());
+  }
+  arm_watchpoints();
+  if (symbolize_pool_)
+    symbolize_pool_->drain();
+  if (system_pool_)
+    system_pool_->drain();
+}
+
+// Replaces the running program with the one reload_ compiles from the
+// changed script. The maps whose type didn't change are kept along with
+// their contents, and the probes whose code is the same as before stay
+// attached, so that nothing is missed while the rest are swapped. Any
+// error leaves the running program as it is.
+void BPFtrace::reload()
+{
+  reload_recv = false;
+  if (!reload_)
+    return;
+  if (perf_consumers_)
+  {
+    LOG(ERROR) << "--reload doesn't work with BPFTRACE_PERF_CONSUMERS";
+    return;
+  }
+  Timings::Scope timing("reload");
+
+  // The new program is compiled into this BPFtrace, as it would be on start
+  auto staged = std::make_unique<ProgramState>();
+  swap_program(*staged);
+  bool had_iter = has_iter_;
+  std::unique_ptr<BpfOrc> bpforc = reload_();
+  swap_program(*staged);
+  staged->bpforc = std::move(bpforc);
+  bool has_iter = std::exchange(has_iter_, had_iter);
+  if (!staged->bpforc || has_iter)
+  {
+    if (has_iter)
+      LOG(ERROR) << "iter probes can't be reloaded";
+    LOG(ERROR) << "Reload failed, the running program is kept";
+    return;
+  }
+
+  // New map fd -> running map fd of the maps that are kept
+  std::unordered_map<int32_t, int32_t> fds;
+  auto adopt = [&](IMap &running, IMap &created) {
+    fds[created.mapfd_] = running.mapfd_;
+    if (created.outer_mapfd_ >= 0)
+      fds[created.outer_mapfd_] = running.outer_mapfd_;
+    if (created.window_outer_mapfd_ >= 0)
+      fds[created.window_outer_mapfd_] = running.window_outer_mapfd_;
+    if (created.sketch_mapfd_ >= 0)
+      fds[created.sketch_mapfd_] = running.sketch_mapfd_;
+    if (created.strings_mapfd_ >= 0)
+      fds[created.strings_mapfd_] = running.strings_mapfd_;
+    if (created.ttl_mapfd_ >= 0)
+      fds[created.ttl_mapfd_] = running.ttl_mapfd_;
+  };
+  std::vector<std::string> named;
+  for (auto &map : staged->maps)
+  {
+    auto running = maps[map->name_];
+    if (running && same_map(**running, *map))
+    {
+      adopt(**running, *map);
+      named.push_back(map->name_);
+    }
+  }
+  // The maps of the tail calls, seq_printf() and counter() are filled for
+  // each program, there's nothing to keep in them
+  std::vector<MapManager::Type> types;
+  for (auto type : { MapManager::Type::PerfEvent,
+                     MapManager::Type::Ringbuf,
+                     MapManager::Type::Control,
+                     MapManager::Type::RingbufLoss,
+                     MapManager::Type::Join,
+                     MapManager::Type::Elapsed,
+                     MapManager::Type::Sample,
+                     MapManager::Type::Scratch,
+                     MapManager::Type::ProbeCounts,
+                     MapManager::Type::AdaptiveSample,
+                     MapManager::Type::FlightRecorder })
+  {
+    if (!staged->maps.Has(type))
+      continue;
+    if (maps.Has(type) &&
+        same_map(*maps[type].value(), *staged->maps[type].value()))
+    {
+      adopt(*maps[type].value(), *staged->maps[type].value());
+      types.push_back(type);
+    }
+    else if (type == MapManager::Type::PerfEvent ||
+             type == MapManager::Type::Ringbuf ||
+             type == MapManager::Type::Control)
+    {
+      // The buffers being read are the ones of the running maps
+      LOG(ERROR) << "Reload failed, the " << to_string(type)
+                 << " map changed, the running program is kept";
+      return;
+    }
+  }
+  std::vector<StackType> stack_types;
+  for (auto &[type, map] : staged->maps.StackMaps())
+  {
+    if (maps.Has(type) && same_map(*maps[type].value(), *map))
+    {
+      adopt(*maps[type].value(), *map);
+      stack_types.push_back(type);
+    }
+  }
+  for (auto &[name, section] : staged->bpforc->getSections())
+    if (name.rfind("s_", 0) == 0)
+      patch_map_fds(std::get<0>(section), std::get<1>(section), fds);
+
+  // The probes whose program is still the same stay attached, the
+  // programs of the others are replaced
+  std::vector<bool> kept(staged->probes.size(), false);
+  std::vector<std::unique_ptr<AttachedProbe>> keep, detach;
+  for (auto &ap : attached_probes_)
+  {
+    bool same = false;
+    for (size_t i = 0; i < staged->probes.size() && !same; ++i)
+    {
+      if (!same_probe(ap->probe(), staged->probes[i]))
+        continue;
+      auto section = get_probe_section(staged->probes[i], *staged->bpforc);
+      if (section && same_code(*section, ap->func()))
+      {
+        kept[i] = true;
+        same = true;
+      }
+    }
+    (same ? keep : detach).push_back(std::move(ap));
+  }
+  attached_probes_ = std::move(keep);
+  detach.clear();
+  read_pending_events();
+  print_helper_errors();
+
+  // The new program takes over the running maps it kept
+  for (auto &name : named)
+    staged->maps.SwapMap(maps, name);
+  for (auto type : types)
+    staged->maps.SwapMap(maps, type);
+  for (auto type : stack_types)
+    staged->maps.SwapMap(maps, type);
+  swap_program(*staged);
+
+  printf_plans_.clear();
+  for (auto &args : printf_args_)
+    printf_plans_.emplace_back(std::get<0>(args));
+  // The map ids changed, so did the helper error ids
+  delta_snapshots_.clear();
+  helper_errors_reported_.clear();
+  if (!pin_maps_dir_.empty())
+    pin_maps(*this, pin_maps_dir_);
+  if (maps.Has(MapManager::Type::Elapsed) &&
+      std::find(types.begin(), types.end(), MapManager::Type::Elapsed) ==
+          types.end())
+  {
+    uint64_t key = 0;
+    bpf_update_elem(maps[MapManager::Type::Elapsed].value()->mapfd_,
+                    &key,
+                    &elapsed_start_ns_,
+                    0);
+  }
+
+  // The probes kept attached need the old program's Probe and code, not
+  // its maps
+  {
+    MapManager released;
+    staged->maps.Swap(released);
+  }
+  retired_programs_.push_back(std::move(staged));
+
+  size_t attached = 0;
+  auto attach = [&](size_t i) {
+    auto aps = attach_probe(probes_[i], *bpforc_);
+    if (aps.empty())
+      LOG(ERROR) << "Failed to attach " << probes_[i].name << " on reload";
+    for (auto &ap : aps)
+      attached_probes_.emplace_back(std::move(ap));
+    attached++;
+  };
+  for (size_t i = 0; i < probes_.size(); ++i)
+    if (!kept[i] && !attach_reverse(probes_[i]))
+      attach(i);
+  for (size_t i = probes_.size(); i-- > 0;)
+    if (!kept[i] && attach_reverse(probes_[i]))
+      attach(i);
+
+  // Drop the programs none of whose probes are attached anymore
+  retired_programs_.erase(
+      std::remove_if(retired_programs_.begin(),
+                     retired_programs_.end(),
+                     [&](const std::unique_ptr<ProgramState> &state) {
+                       return std::none_of(
+                           attached_probes_.begin(),
+                           attached_probes_.end(),
+                           [&](const std::unique_ptr<AttachedProbe> &ap) {
+                             auto &probes = state->probes;
+                             return &ap->probe() >= probes.data() &&
+                                    &ap->probe() <
+                                        probes.data() + probes.size();
+                           });
+                     }),
+      retired_programs_.end());
+
+  if (!bt_quiet)
+    std::cerr << "Reloaded, " << attached << " probes attached, "
+              << probes_.size() - attached << " kept" << std::endl;
+}
+
 int BPFtrace::run_special_probe(std::string name,
                                 BpfOrc &bpforc,
                                 void (*trigger)(void))
@@ -999,55 +1916,153 @@ int BPFtrace::run_special_probe(std::string name,
 }
 
 #ifdef HAVE_LIBBPF_LINK_CREATE
-int BPFtrace::run_iter(std::unique_ptr<BpfOrc> bpforc)
+// Moves what an iter program writes to out_fd without copying it through
+// user space, through a pipe unless out_fd is one. Returns false when that
+// can't be done before anything was moved, e.g. the kernel's bpf_iter files
+// can't be spliced from, for the caller to read the iter instead.
+static bool splice_iter(int iter_fd, int out_fd, size_t chunk)
 {
-  auto probe = probes_.begin();
-  char buf[1024] = {};
-  ssize_t len;
+  struct stat st;
+  if (fstat(out_fd, &st) != 0 ||
+      !(S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode) || S_ISSOCK(st.st_mode)))
+    return false;
+
+  int pipefd[2] = { -1, -1 };
+  int to = out_fd;
+  if (!S_ISFIFO(st.st_mode))
+  {
+    if (pipe2(pipefd, O_CLOEXEC) != 0)
+      return false;
+    to = pipefd[1];
+  }
 
-  if (probe == probes_.end())
+  bool moved = false;
+  ssize_t len;
+  while ((len = splice(iter_fd, nullptr, to, nullptr, chunk, SPLICE_F_MOVE)) >
+         0)
   {
-    LOG(ERROR) << "Failed to create iter probe";
-    return 1;
+    moved = true;
+    if (to == out_fd)
+      continue;
+    while (len > 0)
+    {
+      ssize_t n = splice(
+          pipefd[0], nullptr, out_fd, nullptr, len, SPLICE_F_MOVE);
+      if (n <= 0)
+        break;
+      len -= n;
+    }
+    if (len > 0)
+    {
+      LOG(ERROR) << "Failed to write the iter output: " << strerror(errno);
+      break;
+    }
   }
+  if (len < 0 && moved)
+    LOG(ERROR) << "Failed to read the iter output: " << strerror(errno);
 
-  auto aps = attach_probe(*probe, *bpforc.get());
-  if (aps.empty())
+  if (pipefd[0] >= 0)
   {
-    LOG(ERROR) << "Failed to attach iter probe";
-    return 1;
+    close(pipefd[0]);
+    close(pipefd[1]);
   }
+  return moved || len == 0;
+}
+
+// Time between the runs of a periodic iter probe (iter:task:s:5), zero for
+// one that runs once
+static std::chrono::nanoseconds iter_period(const Probe &probe)
+{
+  if (probe.path == "s")
+    return std::chrono::seconds(probe.freq);
+  else if (probe.path == "ms")
+    return std::chrono::milliseconds(probe.freq);
+  else if (probe.path == "us")
+    return std::chrono::microseconds(probe.freq);
+  else if (probe.path == "hz" && probe.freq > 0)
+    return std::chrono::nanoseconds(1000000000 / probe.freq);
+  return std::chrono::nanoseconds(0);
+}
+
+void BPFtrace::read_iter(int iter_fd, std::mutex &output_mutex)
+{
+  std::vector<char> buf(iter_buffer_size_);
+  // The reads don't end on lines, only whole lines are printed so that the
+  // ones of iterators running at the same time don't mix
+  std::string line;
+  ssize_t len;
+  while ((len = read(iter_fd, buf.data(), buf.size())) > 0)
+  {
+    const char *data = buf.data(), *end = data + len;
+    const char *last = static_cast<const char *>(memrchr(data, '\n', len));
+    if (!last)
+    {
+      line.append(data, end);
+      continue;
+    }
 
-  auto &ap = *aps.begin();
+    std::lock_guard<std::mutex> lock(output_mutex);
+    if (out_->raw_text())
+    {
+      out_->outputstream() << line;
+      out_->outputstream().write(data, last + 1 - data);
+    }
+    else
+    {
+      // A printf message a line
+      while (const char *nl = static_cast<const char *>(
+                 memchr(data, '\n', end - data)))
+      {
+        line.append(data, nl + 1);
+        out_->message(MessageType::printf, line, false);
+        line.clear();
+        data = nl + 1;
+      }
+    }
+    line.assign(last + 1, end);
+  }
 
-  int link_fd = ap.get()->linkfd_;
+  std::lock_guard<std::mutex> lock(output_mutex);
+  if (!line.empty())
+    out_->message(MessageType::printf, line, false);
+  out_->outputstream().flush();
+}
 
-  if (link_fd < 0)
+int BPFtrace::run_iter(std::unique_ptr<BpfOrc> bpforc)
+{
+  if (probes_.empty())
   {
-    LOG(ERROR) << "Failed to link iter probe";
+    LOG(ERROR) << "Failed to create iter probe";
     return 1;
   }
 
-  if (probe->pin.empty())
+  // The links of the iter probes to run, the others are pinned
+  std::vector<std::pair<const Probe *, int>> iters;
+  std::vector<std::unique_ptr<AttachedProbe>> attached;
+  for (auto &probe : probes_)
   {
-    int iter_fd = bpf_iter_create(link_fd);
+    auto aps = attach_probe(probe, *bpforc.get());
+    if (aps.empty())
+    {
+      LOG(ERROR) << "Failed to attach iter probe";
+      return 1;
+    }
 
-    if (iter_fd < 0)
+    int link_fd = aps.front()->linkfd_;
+    std::move(aps.begin(), aps.end(), std::back_inserter(attached));
+    if (link_fd < 0)
     {
-      LOG(ERROR) << "Failed to open iter probe link";
+      LOG(ERROR) << "Failed to link iter probe";
       return 1;
     }
 
-    while ((len = read(iter_fd, buf, sizeof(buf))) > 0)
+    if (probe.pin.empty())
     {
-      fwrite(buf, len, 1, stdout);
+      iters.emplace_back(&probe, link_fd);
+      continue;
     }
 
-    close(iter_fd);
-  }
-  else
-  {
-    auto pin = probe->pin;
+    auto pin = probe.pin;
 
     if (pin.at(0) != '/')
       pin = "/sys/fs/bpf/" + pin;
@@ -1058,7 +2073,50 @@ int BPFtrace::run_iter(std::unique_ptr<BpfOrc> bpforc)
       std::cout << "Program pinned to " << pin << std::endl;
   }
 
-  return 0;
+  // Whatever was printed before goes first
+  out_->outputstream().flush();
+  fflush(stdout);
+  // A single iterator has the output to itself
+  bool splice = iters.size() == 1 && out_->raw_text() && output_fd_ >= 0;
+
+  std::mutex output_mutex;
+  std::atomic<int> err(0);
+  auto run = [&](const Probe &probe, int link_fd) {
+    auto period = iter_period(probe);
+    auto next = std::chrono::steady_clock::now();
+    do
+    {
+      int iter_fd = bpf_iter_create(link_fd);
+      if (iter_fd < 0)
+      {
+        LOG(ERROR) << "Failed to open iter probe link";
+        err = 1;
+        return;
+      }
+      if (!splice || !splice_iter(iter_fd, output_fd_, iter_buffer_size_))
+        read_iter(iter_fd, output_mutex);
+      close(iter_fd);
+
+      // Woken up now and then to see if bpftrace was asked to exit
+      next += period;
+      while (!exitsig_recv && std::chrono::steady_clock::now() < next)
+        std::this_thread::sleep_for(
+            std::min<std::chrono::steady_clock::duration>(
+                next - std::chrono::steady_clock::now(),
+                std::chrono::milliseconds(100)));
+    } while (period.count() && !exitsig_recv);
+  };
+
+  // Each iterator runs on a thread of its own, the first on this one
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < iters.size(); i++)
+    threads.emplace_back(run, std::cref(*iters[i].first), iters[i].second);
+  if (!iters.empty())
+    run(*iters[0].first, iters[0].second);
+  for (auto &thread : threads)
+    thread.join();
+
+  return err;
 }
 #else
 int BPFtrace::run_iter(std::unique_ptr<BpfOrc> bpforc __attribute__((unused)))
@@ -1070,25 +2128,70 @@ int BPFtrace::run_iter(std::unique_ptr<BpfOrc> bpforc __attribute__((unused)))
 
 int BPFtrace::run(std::unique_ptr<BpfOrc> bpforc)
 {
+  out_->header(*this);
+  if (printf_out_)
+    printf_out_->header(*this);
+
+  if (check_memory() < 0)
+    return -1;
+
   if (has_iter_)
     return run_iter(move(bpforc));
 
   bpforc_ = std::move(bpforc);
 
+  // Split the printf() format strings once rather than on every event
+  printf_plans_.clear();
+  for (auto &args : printf_args_)
+    printf_plans_.emplace_back(std::get<0>(args));
+
   int epollfd = setup_perf_events();
   if (epollfd < 0)
     return epollfd;
 
+  if (metrics_server_ && setup_metrics(epollfd) < 0)
+    return -1;
+
+  if (setup_exit_watch(epollfd) < 0)
+    return -1;
+
+  if (setup_hotplug_watch(epollfd) < 0)
+    return -1;
+
+  if (!pin_maps_dir_.empty() && pin_maps(*this, pin_maps_dir_) < 0)
+    return -1;
+
+  if (probe_stats_enabled() && enable_probe_stats() < 0)
+    return -1;
+
+  // Raw symbols are never resolved, nothing to hand to the workers
+  if (symbolize_threads_ && !raw_symbols_)
+    symbolize_pool_ = std::make_unique<SymbolizePool>(*this,
+                                                      symbolize_threads_);
+  if (!cat_args_.empty())
+    cat_cache_ = std::make_unique<CatCache>(cat_cache_ms_,
+                                            cat_fds_,
+                                            cat_bytes_max_);
+  // cat() shares the workers and the queue of system()
+  uint64_t pool_threads = 0;
+  if (!system_args_.empty())
+    pool_threads = system_threads_;
+  if (!cat_args_.empty())
+    pool_threads = std::max(pool_threads, cat_threads_);
+  if (pool_threads)
+    system_pool_ = std::make_unique<SystemPool>(
+        *this, pool_threads, system_queue_, system_drop_);
+
   if (maps.Has(MapManager::Type::Elapsed))
   {
     struct timespec ts;
     clock_gettime(CLOCK_BOOTTIME, &ts);
-    auto nsec = 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+    elapsed_start_ns_ = 1000000000ULL * ts.tv_sec + ts.tv_nsec;
     uint64_t key = 0;
 
     if (bpf_update_elem(maps[MapManager::Type::Elapsed].value()->mapfd_,
                         &key,
-                        &nsec,
+                        &elapsed_start_ns_,
                         0) < 0)
     {
       perror("Failed to write start time to elapsed map");
@@ -1096,8 +2199,11 @@ int BPFtrace::run(std::unique_ptr<BpfOrc> bpforc)
     }
   }
 
-  if (run_special_probe("BEGIN_trigger", *bpforc_, BEGIN_trigger))
-    return -1;
+  {
+    Timings::Scope timing("BEGIN");
+    if (run_special_probe("BEGIN_trigger", *bpforc_, BEGIN_trigger))
+      return -1;
+  }
 
   if (child_ && has_usdt_)
   {
@@ -1118,32 +2224,67 @@ int BPFtrace::run(std::unique_ptr<BpfOrc> bpforc)
   // twice: in the first pass iterate forward and attach the probes that will
   // be fired in the same order they were attached, and in the second pass
   // iterate in reverse and attach the rest.
-  for (auto probes = probes_.begin(); probes != probes_.end(); ++probes)
+  std::vector<int> progfds;
   {
-    if (!attach_reverse(*probes)) {
-      auto aps = attach_probe(*probes, *bpforc_);
-
-      if (aps.empty())
-        return -1;
-
-      for (auto &ap : aps)
-        attached_probes_.emplace_back(std::move(ap));
-    }
+    Timings::Scope timing("load_progs");
+    progfds = load_progs(*bpforc_);
   }
+  auto attach = [&](size_t i) {
+    auto start = std::chrono::steady_clock::now();
+    auto aps = attach_probe(probes_[i],
+                            *bpforc_,
+                            std::exchange(progfds[i], -1));
+    auto &timings = Timings::get();
+    // The programs not loaded by load_progs() are loaded on attaching,
+    // their time is told apart with the load stats
+    std::chrono::microseconds load_time{ 0 };
+    for (auto &ap : aps)
+    {
+      load_time += std::chrono::microseconds(ap->load_stats().load_time_us);
+      load_stats_[probes_[i].name] += ap->load_stats();
+      attached_probes_.emplace_back(std::move(ap));
+    }
+    if (timings.enabled())
+    {
+      if (load_time.count())
+        timings.add("load_prog " + probes_[i].name, load_time);
+      timings.add("attach " + probes_[i].name,
+                  std::chrono::steady_clock::now() - start - load_time);
+    }
+    return !aps.empty();
+  };
+  auto close_progs = [&]() {
+    for (int progfd : progfds)
+      if (progfd >= 0)
+        close(progfd);
+  };
 
-  for (auto r_probes = probes_.rbegin(); r_probes != probes_.rend(); ++r_probes)
+  for (size_t i = 0; i < probes_.size(); ++i)
   {
-    if (attach_reverse(*r_probes)) {
-      auto aps = attach_probe(*r_probes, *bpforc_);
-
-      if (aps.empty())
-        return -1;
+    if (!attach_reverse(probes_[i]) && !attach(i))
+    {
+      close_progs();
+      return -1;
+    }
+  }
 
-      for (auto &ap : aps)
-        attached_probes_.emplace_back(std::move(ap));
+  for (size_t i = probes_.size(); i-- > 0;)
+  {
+    if (attach_reverse(probes_[i]) && !attach(i))
+    {
+      close_progs();
+      return -1;
     }
   }
 
+  if (bt_verbose)
+    out_->load_stats(load_stats_);
+
+  if (add_target_pids() < 0)
+    return -1;
+
+  compact();
+
   // Kick the child to execute the command.
   if (child_)
   {
@@ -1164,24 +2305,118 @@ int BPFtrace::run(std::unique_ptr<BpfOrc> bpforc)
   if (bt_verbose)
     std::cerr << "Running..." << std::endl;
 
-  poll_perf_events(epollfd);
-  attached_probes_.clear();
+  estimate_start_ = std::chrono::steady_clock::now();
+  {
+    Timings::Scope timing("poll");
+    poll_perf_events(epollfd);
+    // --repeat: the command is run again until it was run child_runs_ times,
+    // unless bpftrace was asked to stop
+    uint64_t run = 1;
+    for (; run < child_runs_ && !exitsig_recv && !finalize_; run++)
+    {
+      if (rerun_child(epollfd, run + 1) < 0)
+        return -1;
+      poll_perf_events(epollfd);
+    }
+    if (symbolize_pool_)
+      symbolize_pool_->drain();
+    if (system_pool_)
+      system_pool_->drain();
+    if (child_runs_ > 1 && child_)
+      out_->child_run(run,
+                      child_->is_alive() ? -1 : child_->exit_code(),
+                      child_->is_alive() ? -1 : child_->term_signal());
+  }
+  // The stats go away with the programs, keep the final ones for print_maps()
+  if (probe_stats_enabled())
+    read_probe_stats();
+  detach_probes();
   // finalize_ and exitsig_recv should be false from now on otherwise
   // perf_event_printer() can ignore the END_trigger() events.
   finalize_ = false;
   exitsig_recv = false;
+  drain_event_batches();
+  drain_repeats();
 
-  if (run_special_probe("END_trigger", *bpforc_, END_trigger))
-    return -1;
+  {
+    Timings::Scope timing("END drain");
+    if (run_special_probe("END_trigger", *bpforc_, END_trigger))
+      return -1;
 
-  poll_perf_events(epollfd, true);
+    poll_perf_events(epollfd, true);
+    if (symbolize_pool_)
+      symbolize_pool_->drain();
+    if (system_pool_)
+      system_pool_->drain();
+  }
+  print_helper_errors();
+  print_sampling();
 
+  if (event_stats_interval_)
+  {
+    read_stack_map_stats();
+    out_->event_stats(event_stats_);
+  }
+  out_->outputstream().flush();
+  if (printf_out_)
+    printf_out_->outputstream().flush();
+
+  // The consumer threads must be stopped before their readers go away
+  perf_consumers_.reset();
+  symbolize_pool_.reset();
+  if (system_pool_ && system_pool_->dropped())
+    LOG(WARNING) << system_pool_->dropped() << " system() commands or cat() "
+                 << "reads were dropped as BPFTRACE_SYSTEM_QUEUE was full";
+  system_pool_.reset();
+  cat_cache_.reset();
   // Calls perf_reader_free() on all open perf buffers.
   open_perf_buffers_.clear();
+  perf_reader_cookies_.clear();
+  perf_reader_cpus_.clear();
+  if (hotplug_fd_ >= 0)
+  {
+    close(hotplug_fd_);
+    hotplug_fd_ = -1;
+  }
+  free_ringbuf();
 
   return 0;
 }
 
+// The number of possible CPUs up to the highest one of cpus, the values of
+// per-CPU maps are in the order of the possible CPUs
+static int cpus_up_to(const std::vector<int> &cpus)
+{
+  std::vector<int> possible = get_possible_cpus();
+  if (cpus.empty())
+    return possible.size();
+  auto found = std::find(possible.begin(),
+                         possible.end(),
+                         *std::max_element(cpus.begin(), cpus.end()));
+  if (found == possible.end())
+    return possible.size();
+  return found - possible.begin() + 1;
+}
+
+static void *open_perf_buffer(perf_reader_raw_cb raw_cb,
+                              perf_reader_lost_cb lost_cb,
+                              void *cb_cookie,
+                              int cpu,
+                              int page_cnt,
+                              int wakeup_events)
+{
+#ifdef HAVE_BCC_PERF_BUFFER_OPTS
+  struct bcc_perf_buffer_opts opts = {};
+  opts.pid = -1;
+  opts.cpu = cpu;
+  opts.wakeup_events = wakeup_events;
+  return bpf_open_perf_buffer_opts(raw_cb, lost_cb, cb_cookie, page_cnt, &opts);
+#else
+  (void)wakeup_events;
+  return bpf_open_perf_buffer(raw_cb, lost_cb, cb_cookie, -1, cpu, page_cnt);
+#endif
+}
+
 int BPFtrace::setup_perf_events()
 {
   int epollfd = epoll_create1(EPOLL_CLOEXEC);
@@ -1193,261 +2428,1938 @@ int BPFtrace::setup_perf_events()
 
   std::vector<int> cpus = get_online_cpus();
   online_cpus_ = cpus.size();
-  for (int cpu : cpus)
+  online_cpu_list_ = cpus;
+  // Pinned maps can hold the values of CPUs of earlier runs
+  if (pin_maps_dir_.empty())
+    seen_cpus_ = cpus_up_to(cpus);
+  cpus_checked_ = std::chrono::steady_clock::now();
+  event_stats_last_ = std::chrono::steady_clock::now();
+  self_stats_last_ = event_stats_last_;
+  probe_counts_last_ = event_stats_last_;
+  helper_errors_last_ = event_stats_last_;
+  if (maps.Has(MapManager::Type::Control) &&
+      setup_control_ringbuf(epollfd) < 0)
+    return -1;
+  if (use_ringbuf_)
+  {
+    event_stats_.readers.push_back({ "ringbuf" });
+    if (setup_ringbuf(epollfd) < 0)
+      return -1;
+    return epollfd;
+  }
+
+  if (perf_consumer_threads_ > 1)
   {
-    void *reader = bpf_open_perf_buffer(
-        &perf_event_printer, &perf_event_lost, this, -1, cpu, perf_rb_pages_);
-    if (reader == nullptr)
+    try
     {
-      LOG(ERROR) << "Failed to open perf buffer";
+      perf_consumers_ = std::make_unique<PerfConsumers>(
+          *this,
+          std::min<uint64_t>(perf_consumer_threads_, cpus.size()),
+          get_numa_nodes());
+    }
+    catch (const std::runtime_error &e)
+    {
+      LOG(ERROR) << e.what();
       return -1;
     }
-    // Store the perf buffer pointers in a vector of unique_ptrs.
-    // When open_perf_buffers_ is cleared or destroyed,
-    // perf_reader_free is automatically called.
-    open_perf_buffers_.emplace_back(reader, perf_reader_free);
+  }
 
-    struct epoll_event ev = {};
-    ev.events = EPOLLIN;
-    ev.data.ptr = reader;
-    int reader_fd = perf_reader_fd((perf_reader*)reader);
+#ifndef HAVE_BCC_PERF_BUFFER_OPTS
+  if (perf_rb_wakeup_ > 1)
+  {
+    LOG(WARNING) << "BPFTRACE_PERF_RB_WAKEUP is not supported by the linked "
+                    "bcc version, waking up on every event";
+    perf_rb_wakeup_ = 1;
+  }
+#endif
 
-    bpf_update_elem(
-        maps[MapManager::Type::PerfEvent].value()->mapfd_, &cpu, &reader_fd, 0);
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, reader_fd, &ev) == -1)
-    {
-      LOG(ERROR) << "Failed to add perf reader to epoll";
+  for (int cpu : cpus)
+  {
+    if (open_perf_reader(epollfd, cpu) < 0)
       return -1;
-    }
   }
+
+  if (perf_consumers_)
+    perf_consumers_->start();
+
   return epollfd;
 }
 
-void BPFtrace::poll_perf_events(int epollfd, bool drain)
+static std::string memory_str(uint64_t bytes)
 {
-  auto events = std::vector<struct epoll_event>(online_cpus_);
-  while (true)
-  {
-    int ready = epoll_wait(epollfd, events.data(), online_cpus_, 100);
-    if (ready < 0 && errno == EINTR && !BPFtrace::exitsig_recv) {
-      // We received an interrupt not caused by SIGINT, skip and run again
-      continue;
-    }
-
-    // Return if either
-    //   * epoll_wait has encountered an error (eg signal delivery)
-    //   * There's no events left and we've been instructed to drain or
-    //     finalization has been requested through exit() builtin.
-    if (ready < 0 || (ready == 0 && (drain || finalize_)))
-    {
-      return;
-    }
+  std::ostringstream str;
+  if (bytes < (1 << 20))
+    str << (bytes + 1023) / 1024 << " KiB";
+  else
+    str << std::fixed << std::setprecision(1)
+        << static_cast<double>(bytes) / (1 << 20) << " MiB";
+  return str.str();
+}
 
-    for (int i=0; i<ready; i++)
-    {
-      perf_reader_event_read((perf_reader*)events[i].data.ptr);
-    }
+// Estimates the kernel memory the maps and the perf buffers about to be
+// opened lock, which the unlimited RLIMIT_MEMLOCK doesn't bound. Printed
+// with -v, and bpftrace refuses to start over BPFTRACE_MEMORY_BUDGET.
+int BPFtrace::check_memory()
+{
+  if (!bt_verbose && !memory_budget_)
+    return 0;
 
-    // If we are tracing a specific pid and it has exited, we should exit
-    // as well b/c otherwise we'd be tracing nothing.
-    if ((procmon_ && !procmon_->is_alive()) || (child_ && !child_->is_alive()))
-    {
-      return;
-    }
+  std::vector<std::pair<uint64_t, std::string>> usage;
+  uint64_t total = 0;
+  for (auto &[name, map] : maps.All())
+  {
+    uint64_t bytes = map_memory(*map);
+    usage.emplace_back(bytes, name);
+    total += bytes;
   }
-  return;
-}
+  std::sort(usage.rbegin(), usage.rend());
 
-int BPFtrace::print_maps()
-{
-  for (auto &mapmap : maps)
+  // Each perf buffer also has its header page
+  uint64_t perf_buffers = 0;
+  if (!use_ringbuf_ && maps.Has(MapManager::Type::PerfEvent))
+    perf_buffers = (perf_rb_pages_ + 1) * getpagesize() *
+                   get_online_cpus().size();
+  total += perf_buffers;
+
+  if (bt_verbose)
   {
-    int err = print_map(*mapmap.get(), 0, 0);
-    if (err)
-      return err;
+    LOG(INFO) << "Kernel memory: " << memory_str(total) << " ("
+              << memory_str(total - perf_buffers) << " of maps, "
+              << memory_str(perf_buffers) << " of perf buffers)";
+    for (size_t i = 0; i < usage.size() && i < 10 && usage[i].first; i++)
+      LOG(INFO) << "  " << usage[i].second << ": "
+                << memory_str(usage[i].first);
   }
 
+  if (memory_budget_ && total > memory_budget_)
+  {
+    std::string largest = usage.empty() ? "" : usage[0].second;
+    if (perf_buffers > (usage.empty() ? 0 : usage[0].first))
+      largest = "the perf buffers";
+    LOG(ERROR) << "The maps and buffers would lock about " << memory_str(total)
+               << " of kernel memory, over BPFTRACE_MEMORY_BUDGET ("
+               << memory_str(memory_budget_) << "). The most goes to "
+               << largest
+               << ", see BPFTRACE_MAP_KEYS_MAX, BPFTRACE_STACK_MAP_ENTRIES "
+                  "and BPFTRACE_PERF_RB_PAGES to make them smaller.";
+    return -1;
+  }
   return 0;
 }
 
-// clear a map
-int BPFtrace::clear_map(IMap &map)
+// Opens the perf buffer of cpu and adds it to the epoll set, or to the
+// consumer threads. A CPU which was online before gets back its place in
+// open_perf_buffers_ and event_stats_.readers.
+int BPFtrace::open_perf_reader(int epollfd, int cpu)
 {
-  if (!map.is_clearable())
-    return zero_map(map);
+  auto found = std::find(perf_reader_cpus_.begin(),
+                         perf_reader_cpus_.end(),
+                         cpu);
+  size_t i = found - perf_reader_cpus_.begin();
+  if (found == perf_reader_cpus_.end())
+  {
+    event_stats_.readers.push_back({ "cpu " + std::to_string(cpu) });
+    perf_reader_cpus_.push_back(cpu);
+    // When open_perf_buffers_ is cleared or destroyed, perf_reader_free is
+    // automatically called.
+    open_perf_buffers_.emplace_back(nullptr, perf_reader_free);
+    perf_reader_cookies_.emplace_back(
+        std::make_unique<PerfReaderCookie>(PerfReaderCookie{ this, i }));
+  }
 
-  std::vector<uint8_t> old_key;
-  try
+  void *reader;
+  if (perf_consumers_)
   {
-    if (map.type_.IsHistTy() || map.type_.IsLhistTy() ||
-        map.type_.IsStatsTy() || map.type_.IsAvgTy())
-      // hist maps have 8 extra bytes for the bucket number
-      old_key = find_empty_key(map, map.key_.size() + 8);
-    else
-      old_key = find_empty_key(map, map.key_.size());
+    reader = open_perf_buffer(&perf_event_enqueue,
+                              &perf_event_lost_enqueue,
+                              perf_consumers_->cookie(i, cpu),
+                              cpu,
+                              perf_rb_pages_,
+                              perf_rb_wakeup_);
   }
-  catch (std::runtime_error &e)
+  else
   {
-    LOG(ERROR) << "failed to get key for map '" << map.name_
-               << "': " << e.what();
-    return -2;
+    reader = open_perf_buffer(&perf_reader_printer,
+                              &perf_reader_lost,
+                              perf_reader_cookies_[i].get(),
+                              cpu,
+                              perf_rb_pages_,
+                              perf_rb_wakeup_);
   }
-  auto key(old_key);
-
-  // snapshot keys, then operate on them
-  std::vector<std::vector<uint8_t>> keys;
-  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  if (reader == nullptr)
   {
-    keys.push_back(key);
-    old_key = key;
+    LOG(ERROR) << "Failed to open perf buffer";
+    return -1;
   }
+  open_perf_buffers_[i].reset(reader);
 
-  for (auto &key : keys)
+  int reader_fd = perf_reader_fd((perf_reader*)reader);
+
+  bpf_update_elem(
+      maps[MapManager::Type::PerfEvent].value()->mapfd_, &cpu, &reader_fd, 0);
+  if (perf_consumers_)
   {
-    int err = bpf_delete_elem(map.mapfd_, key.data());
-    if (err)
+    if (perf_consumers_->add_reader(i, reader, reader_fd) < 0)
     {
-      LOG(ERROR) << "failed to look up elem: " << err;
+      LOG(ERROR) << "Failed to add perf reader to epoll";
       return -1;
     }
+    return 0;
   }
 
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = reader;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, reader_fd, &ev) == -1)
+  {
+    LOG(ERROR) << "Failed to add perf reader to epoll";
+    return -1;
+  }
   return 0;
 }
 
-// zero a map
-int BPFtrace::zero_map(IMap &map)
+// The CPU of the idx-th perf buffer went offline: the events it left are
+// read, then the buffer is closed until the CPU comes back
+void BPFtrace::close_perf_reader(int epollfd, size_t idx)
 {
-  uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
-  std::vector<uint8_t> old_key;
-  try
+  auto reader = static_cast<perf_reader *>(open_perf_buffers_[idx].get());
+  int reader_fd = perf_reader_fd(reader);
+  if (perf_consumers_)
   {
-    if (map.type_.IsHistTy() || map.type_.IsLhistTy() ||
-        map.type_.IsStatsTy() || map.type_.IsAvgTy())
-      // hist maps have 8 extra bytes for the bucket number
-      old_key = find_empty_key(map, map.key_.size() + 8);
-    else
-      old_key = find_empty_key(map, map.key_.size());
+    perf_consumers_->remove_reader(idx, reader, reader_fd);
   }
-  catch (std::runtime_error &e)
+  else
   {
-    LOG(ERROR) << "failed to get key for map '" << map.name_
-               << "': " << e.what();
-    return -2;
+    perf_reader_event_read(reader);
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, reader_fd, nullptr);
   }
-  auto key(old_key);
 
-  // snapshot keys, then operate on them
-  std::vector<std::vector<uint8_t>> keys;
-  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  int cpu = perf_reader_cpus_[idx];
+  bpf_delete_elem(maps[MapManager::Type::PerfEvent].value()->mapfd_, &cpu);
+  open_perf_buffers_[idx].reset();
+}
+
+// Listens to the kernel uevents, see cpus_changed(). It takes privileges and
+// only works in the initial network namespace, the online CPUs are checked
+// once a second otherwise.
+int BPFtrace::setup_hotplug_watch(int epollfd)
+{
+  int fd = socket(AF_NETLINK,
+                  SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return 0;
+
+  struct sockaddr_nl addr = {};
+  addr.nl_family = AF_NETLINK;
+  // The kernel's own uevents rather than the ones udev passes on
+  addr.nl_groups = 1;
+  if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
   {
-    keys.push_back(key);
-    old_key = key;
+    close(fd);
+    return 0;
   }
 
-  int value_size = map.type_.GetSize() * nvalues;
-  std::vector<uint8_t> zero(value_size, 0);
-  for (auto &key : keys)
+  // The consumer threads have their own epoll instance, the socket is read
+  // after every dispatch() instead
+  if (!perf_consumers_)
   {
-    int err = bpf_update_elem(map.mapfd_, key.data(), zero.data(), BPF_EXIST);
-
-    if (err)
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &hotplug_fd_;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
     {
-      LOG(ERROR) << "failed to look up elem: " << err;
+      LOG(ERROR) << "Failed to add uevent socket to epoll";
+      close(fd);
       return -1;
     }
   }
-
+  hotplug_fd_ = fd;
   return 0;
 }
 
-std::string BPFtrace::map_value_to_str(const SizedType &stype,
-                                       std::vector<uint8_t> value,
-                                       bool is_per_cpu,
-                                       uint32_t div,
-                                       const Output &output)
+// Whether CPUs may have gone online or offline since the last call
+bool BPFtrace::cpus_changed()
 {
-  uint32_t nvalues = is_per_cpu ? ncpus_ : 1;
-  if (stype.IsKstackTy())
-    return get_stack(
-        read_data<uint64_t>(value.data()), false, stype.stack_type, 8);
-  else if (stype.IsUstackTy())
-    return get_stack(
-        read_data<uint64_t>(value.data()), true, stype.stack_type, 8);
-  else if (stype.IsKsymTy())
-    return resolve_ksym(read_data<uintptr_t>(value.data()));
-  else if (stype.IsUsymTy())
-    return resolve_usym(read_data<uintptr_t>(value.data()),
-                        read_data<uintptr_t>(value.data() + 8));
-  else if (stype.IsInetTy())
-    return resolve_inet(read_data<uint64_t>(value.data()),
-                        (uint8_t *)(value.data() + 8));
-  else if (stype.IsUsernameTy())
-    return resolve_uid(read_data<uint64_t>(value.data()));
-  else if (stype.IsBufferTy())
-    return resolve_buf(reinterpret_cast<char *>(value.data() + 1),
-                       *reinterpret_cast<uint8_t *>(value.data()));
-  else if (stype.IsStringTy())
+  if (hotplug_fd_ < 0)
   {
-    auto p = reinterpret_cast<const char *>(value.data());
-    return std::string(p, strnlen(p, stype.GetSize()));
+    auto now = std::chrono::steady_clock::now();
+    if (now - cpus_checked_ < std::chrono::seconds(1))
+      return false;
+    cpus_checked_ = now;
+    return get_online_cpus() != online_cpu_list_;
   }
-  else if (stype.IsArrayTy())
+
+  // e.g. "online@/devices/system/cpu/cpu3", then the variables of the event
+  bool changed = false;
+  char buf[4096];
+  ssize_t len;
+  while ((len = recv(hotplug_fd_, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
   {
-    size_t elem_size = stype.GetElementTy()->GetSize();
-    std::vector<std::string> elems;
-    for (size_t i = 0; i < stype.GetNumElements(); i++)
+    std::string_view header(buf, strnlen(buf, len));
+    if (header.find("@/devices/system/cpu/cpu") != std::string_view::npos)
+      changed = true;
+  }
+  return changed;
+}
+
+// Opens the perf buffers of the CPUs that came online and closes the ones of
+// the CPUs that went offline
+int BPFtrace::sync_perf_readers(int epollfd)
+{
+  std::vector<int> cpus = get_online_cpus();
+  if (cpus == online_cpu_list_)
+    return 0;
+  online_cpu_list_ = cpus;
+  online_cpus_ = cpus.size();
+  if (pin_maps_dir_.empty())
+    seen_cpus_ = std::max(seen_cpus_, cpus_up_to(cpus));
+
+  // The ring buffer is shared by all the CPUs
+  if (use_ringbuf_)
+    return 0;
+
+  if (perf_consumers_)
+    perf_consumers_->stop();
+  int err = 0;
+  for (size_t i = 0; i < perf_reader_cpus_.size(); i++)
+  {
+    bool online = std::find(cpus.begin(), cpus.end(), perf_reader_cpus_[i]) !=
+                  cpus.end();
+    if (!online && open_perf_buffers_[i])
     {
-      std::vector<uint8_t> elem_data(value.begin() + i * elem_size,
-                                     value.begin() + (i + 1) * elem_size);
-      elems.push_back(map_value_to_str(
-          *stype.GetElementTy(), elem_data, is_per_cpu, div, output));
+      if (bt_verbose)
+        LOG(INFO) << "CPU " << perf_reader_cpus_[i]
+                  << " went offline, closing its perf buffer";
+      close_perf_reader(epollfd, i);
     }
-
-    return "[" + str_join(elems, ",") + "]";
   }
-  else if (stype.IsRecordTy())
+  for (int cpu : cpus)
   {
-    auto &struct_type = structs_[stype.GetName()];
-    std::vector<std::string> elems;
-    for (auto &field : struct_type.fields)
+    auto found = std::find(perf_reader_cpus_.begin(),
+                           perf_reader_cpus_.end(),
+                           cpu);
+    if (found != perf_reader_cpus_.end() &&
+        open_perf_buffers_[found - perf_reader_cpus_.begin()])
+      continue;
+    if (bt_verbose)
+      LOG(INFO) << "CPU " << cpu << " came online, opening its perf buffer";
+    if (open_perf_reader(epollfd, cpu) < 0)
     {
-      std::vector<uint8_t> elem_data(value.begin() + field.second.offset,
-                                     value.begin() + field.second.offset +
-                                         field.second.type.GetSize());
-      elems.push_back(
-          output.struct_field_def_to_str(field.first) +
-          map_value_to_str(
-              field.second.type, elem_data, is_per_cpu, div, output));
+      err = -1;
+      break;
     }
-    return "{ " + str_join(elems, ", ") + " }";
   }
-  else if (stype.IsCountTy())
-    return std::to_string(reduce_value<uint64_t>(value, nvalues) / div);
-  else if (stype.IsIntTy())
+  if (perf_consumers_)
+    perf_consumers_->start();
+  return err;
+}
+
+int BPFtrace::setup_ringbuf(int epollfd)
+{
+#ifdef HAVE_LIBBPF_RINGBUF
+  int mapfd = maps[MapManager::Type::Ringbuf].value()->mapfd_;
+  ringbuf_ = ring_buffer__new(mapfd, &ringbuf_printer, this, nullptr);
+  if (ringbuf_ == nullptr)
   {
-    auto sign = stype.IsSigned();
-    switch (stype.GetIntBitWidth())
-    {
-      // clang-format off
-      case 64:
-        if (sign)
-          return std::to_string(
-            reduce_value<int64_t>(value, nvalues) / (int64_t)div);
-        return std::to_string(reduce_value<uint64_t>(value, nvalues) / div);
-      case 32:
-        if (sign)
-          return std::to_string(
-            reduce_value<int32_t>(value, nvalues) / (int32_t)div);
-        return std::to_string(reduce_value<uint32_t>(value, nvalues) / div);
-      case 16:
-        if (sign)
-          return std::to_string(
-            reduce_value<int16_t>(value, nvalues) / (int16_t)div);
-        return std::to_string(reduce_value<uint16_t>(value, nvalues) / div);
-      case 8:
-        if (sign)
-          return std::to_string(
+    LOG(ERROR) << "Failed to open ring buffer";
+    return -1;
+  }
+
+  // The ring buffer has its own epoll instance covering the whole buffer,
+  // nest it into ours so that a single wait serves all event sources.
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = ringbuf_;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ring_buffer__epoll_fd(ringbuf_), &ev) ==
+      -1)
+  {
+    LOG(ERROR) << "Failed to add ring buffer to epoll";
+    return -1;
+  }
+  return 0;
+#else
+  (void)epollfd;
+  LOG(ERROR) << "ring buffer is not available for linked bpf version";
+  return -1;
+#endif
+}
+
+int BPFtrace::setup_control_ringbuf(int epollfd)
+{
+#ifdef HAVE_LIBBPF_RINGBUF
+  int mapfd = maps[MapManager::Type::Control].value()->mapfd_;
+  control_ringbuf_ = ring_buffer__new(mapfd, &control_printer, this, nullptr);
+  if (control_ringbuf_ == nullptr)
+  {
+    LOG(ERROR) << "Failed to open the control ring buffer";
+    return -1;
+  }
+
+  // The perf consumers don't wait on our epoll instance, it is read around
+  // each of their dispatches instead
+  if (perf_consumer_threads_ > 1 && !use_ringbuf_)
+    return 0;
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = control_ringbuf_;
+  if (epoll_ctl(epollfd,
+                EPOLL_CTL_ADD,
+                ring_buffer__epoll_fd(control_ringbuf_),
+                &ev) == -1)
+  {
+    LOG(ERROR) << "Failed to add the control ring buffer to epoll";
+    return -1;
+  }
+  return 0;
+#else
+  (void)epollfd;
+  LOG(ERROR) << "ring buffer is not available for linked bpf version";
+  return -1;
+#endif
+}
+
+// Print the printf() events left in the batches of the CPUs once the probes
+// are detached, those the flush probe didn't send yet
+void BPFtrace::drain_event_batches()
+{
+  auto map = maps[MapManager::Type::EventBatch];
+  if (!map)
+    return;
+  size_t value_size = event_batch_value_size(event_batch_);
+  std::vector<uint8_t> values(value_size * ncpus_);
+  uint32_t key = 0;
+  if (bpf_lookup_elem((*map)->mapfd_, &key, values.data()))
+    return;
+  for (int cpu = 0; cpu < ncpus_; cpu++)
+  {
+    uint8_t *batch = values.data() + cpu * value_size;
+    uint64_t used = read_data<uint64_t>(batch);
+    if (used == 0 || used > 2 * event_batch_)
+      continue;
+    // Laid out as it would have been sent
+    uint64_t id = asyncactionint(AsyncAction::batch);
+    std::memcpy(batch + sizeof(uint64_t), &id, sizeof(id));
+    perf_event_printer(this, batch + sizeof(uint64_t), used + sizeof(id));
+  }
+}
+
+// Print the repeats of the last printf() event of each CPU the flush probe
+// didn't send yet
+void BPFtrace::drain_repeats()
+{
+  auto map = maps[MapManager::Type::Dedupe];
+  if (!map)
+    return;
+  std::vector<uint8_t> values(DEDUPE_VALUE_SIZE * ncpus_);
+  uint32_t key = 0;
+  if (bpf_lookup_elem((*map)->mapfd_, &key, values.data()))
+    return;
+  for (int cpu = 0; cpu < ncpus_; cpu++)
+  {
+    uint64_t count = read_data<uint64_t>(values.data() +
+                                         cpu * DEDUPE_VALUE_SIZE +
+                                         sizeof(uint64_t));
+    if (count)
+      printf_output().repeated_events(count);
+  }
+}
+
+// The rings stay as they are, an event is printed when it's recent enough and
+// newer than the last one printed. Each slot is read for all the CPUs at
+// once, and the events of the CPUs are merged by their times.
+void BPFtrace::dump_flight_recorder()
+{
+  auto map = maps[MapManager::Type::FlightRecorder];
+  if (!map)
+    return;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+  uint64_t window = 1000000000ULL * flight_recorder_secs_;
+  uint64_t since = std::max(flight_dumped_ns_,
+                            now > window ? now - window : 0);
+
+  size_t slot_size = flight_slot_size(flight_event_size_);
+  std::vector<uint8_t> values(slot_size * ncpus_);
+  std::vector<std::pair<uint64_t, std::vector<uint8_t>>> events;
+  for (uint32_t key = 1; key < (*map)->max_entries_; key++)
+  {
+    if (bpf_lookup_elem((*map)->mapfd_, &key, values.data()))
+      break;
+    for (int cpu = 0; cpu < ncpus_; cpu++)
+    {
+      uint8_t *slot = values.data() + cpu * slot_size;
+      uint64_t ns = read_data<uint64_t>(slot);
+      uint64_t size = read_data<uint64_t>(slot + sizeof(uint64_t));
+      if (ns <= since || size < sizeof(uint64_t) || size > flight_event_size_)
+        continue;
+      uint8_t *event = slot + 2 * sizeof(uint64_t);
+      events.emplace_back(ns, std::vector<uint8_t>(event, event + size));
+    }
+  }
+  std::stable_sort(events.begin(),
+                   events.end(),
+                   [](const auto &a, const auto &b) {
+                     return a.first < b.first;
+                   });
+  for (auto &event : events)
+    perf_event_printer(this, event.second.data(), event.second.size());
+  if (!events.empty())
+    flight_dumped_ns_ = events.back().first;
+}
+
+// Print the async actions waiting in the control ring buffer, ahead of the
+// events queued in the other buffers
+void BPFtrace::consume_control()
+{
+#ifdef HAVE_LIBBPF_RINGBUF
+  if (control_ringbuf_)
+    ring_buffer__consume(control_ringbuf_);
+#endif
+}
+
+void BPFtrace::free_ringbuf()
+{
+#ifdef HAVE_LIBBPF_RINGBUF
+  if (ringbuf_)
+    ring_buffer__free(ringbuf_);
+  if (control_ringbuf_)
+    ring_buffer__free(control_ringbuf_);
+#endif
+  ringbuf_ = nullptr;
+  control_ringbuf_ = nullptr;
+}
+
+// Records that didn't fit into the ring buffer are counted by the BPF program
+// instead of being reported by the kernel, forward new drops to the output.
+void BPFtrace::poll_ringbuf_loss()
+{
+  uint32_t key = 0;
+  uint64_t lost = 0;
+  int mapfd = maps[MapManager::Type::RingbufLoss].value()->mapfd_;
+  if (bpf_lookup_elem(mapfd, &key, &lost) < 0)
+    return;
+
+  if (lost > ringbuf_loss_cnt_)
+  {
+    out_->lost_events(lost - ringbuf_loss_cnt_);
+    event_stats_.readers[0].lost += lost - ringbuf_loss_cnt_;
+    ringbuf_loss_cnt_ = lost;
+  }
+}
+
+// Print the event stats every event_stats_interval_ seconds and the probe
+// stats every probe_stats_interval_ seconds
+void BPFtrace::poll_stats()
+{
+  auto now = std::chrono::steady_clock::now();
+  if (event_stats_interval_ &&
+      now - event_stats_last_ >= std::chrono::seconds(event_stats_interval_))
+  {
+    read_stack_map_stats();
+    out_->event_stats(event_stats_);
+    event_stats_last_ = now;
+  }
+
+  if (probe_stats_interval_ &&
+      now - probe_stats_last_ >= std::chrono::seconds(probe_stats_interval_))
+  {
+    read_probe_stats();
+    out_->probe_stats(probe_stats_);
+    probe_stats_last_ = now;
+  }
+
+  if (probe_counts_interval_ &&
+      now - probe_counts_last_ >= std::chrono::seconds(probe_counts_interval_))
+  {
+    print_probe_counts();
+    probe_counts_last_ = now;
+  }
+
+  if (now - helper_errors_last_ >= std::chrono::seconds(1))
+  {
+    print_helper_errors();
+    helper_errors_last_ = now;
+  }
+
+  if (self_stats_interval_ &&
+      (self_stats_recv ||
+       now - self_stats_last_ >= std::chrono::seconds(self_stats_interval_)))
+    print_self_stats();
+
+  if ((probe_max_cpu_pct_ || probe_max_ns_) &&
+      now - probe_budget_last_ >= std::chrono::seconds(1))
+    check_probe_budget();
+
+  if (maps.Has(MapManager::Type::AdaptiveSample) &&
+      now - sampling_last_ >= std::chrono::seconds(1))
+    adjust_sampling();
+
+  if (now - ttl_last_ >= std::chrono::seconds(1))
+    expire_maps();
+
+  if (estimate_secs_ &&
+      now - estimate_start_ >= std::chrono::seconds(estimate_secs_))
+    finalize_ = true;
+
+  if (print_maps_recv)
+    print_signal_maps();
+
+  if (flight_dump_recv)
+  {
+    flight_dump_recv = false;
+    dump_flight_recorder();
+  }
+}
+
+void BPFtrace::print_self_stats()
+{
+  auto now = std::chrono::steady_clock::now();
+  self_stats_.elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               now - self_stats_last_)
+                               .count();
+  if (output_counter_)
+  {
+    uint64_t bytes = output_counter_->bytes();
+    self_stats_.output_bytes = bytes - output_bytes_last_;
+    output_bytes_last_ = bytes;
+  }
+  out_->self_stats(self_stats_);
+  self_stats_ = SelfStats();
+  self_stats_last_ = now;
+  self_stats_recv = false;
+}
+
+// The children the processes of the set fork are added to it, along with the
+// processes exec'ing comm. The tasks are removed as they exit, including the
+// threads, which the fork tracepoint reports as well.
+std::string BPFtrace::target_tracking_probes(const std::string &comm)
+{
+  std::string set = TARGET_PIDS_MAP;
+  std::string probes = "tracepoint:sched:sched_process_fork /" + set +
+                       "[pid]/ { " + set +
+                       "[(uint64)args->child_pid] = 1; }\n"
+                       "tracepoint:sched:sched_process_exit /" +
+                       set + "[tid]/ { delete(" + set + "[tid]); }";
+  if (!comm.empty())
+    probes += "\ntracepoint:sched:sched_process_exec /comm == \"" + comm +
+              "\"/ { " + set + "[pid] = 1; }";
+  return probes;
+}
+
+int BPFtrace::target_tracking_probe_count(const std::string &comm)
+{
+  return comm.empty() ? 2 : 3;
+}
+
+// Adds the processes of --pids and the running ones named --comm to the set
+// of TARGET_PIDS_MAP, once the probes keeping it are attached
+int BPFtrace::add_target_pids()
+{
+  auto map = maps.Lookup(TARGET_PIDS_MAP);
+  if (!map)
+    return 0;
+
+  std::vector<pid_t> pids = target_pids_;
+  if (!target_comm_.empty())
+  {
+    auto named = get_pids_by_comm(target_comm_);
+    pids.insert(pids.end(), named.begin(), named.end());
+  }
+
+  for (pid_t pid : pids)
+  {
+    uint64_t key = pid;
+    int64_t value = 1;
+    if (bpf_update_elem((*map)->mapfd_, &key, &value, BPF_ANY) != 0)
+    {
+      LOG(ERROR) << "Failed to add pid " << pid
+                 << " to the target processes: " << strerror(errno);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Samples the threads of this process, by thread name. Kernel stacks would
+// mostly show bpftrace reading its events, the time goes to it either way.
+std::string BPFtrace::self_profile_probe(int hz)
+{
+  return "profile:hz:" + std::to_string(hz) + " /pid == " +
+         std::to_string(getpid()) + "/ { " + SELF_PROFILE_MAP +
+         "[comm, ustack] = count(); }";
+}
+
+std::string BPFtrace::event_batch_probe()
+{
+  // The body comes from Probe::flush_events
+  return "profile:ms:" + std::to_string(EVENT_BATCH_FLUSH_MS) + " { }";
+}
+
+// The start times are kept in task storage, where the kernel supports it,
+// for the thread leaving the CPU in sched_switch. finish_task_switch() runs
+// for the one coming back, whose stacks are still where it blocked. Only the
+// times long enough are summed, in the kernel, by stack ids.
+std::string BPFtrace::off_cpu_probes(uint64_t min_us)
+{
+  std::string start = std::string(OFF_CPU_START_MAP) + "[tid]";
+  return "tracepoint:sched:sched_switch /tid/ { " + start + " = nsecs; }\n"
+         "kprobe:finish_task_switch* { $start = " + start + "; if ($start) { "
+         "$us = (nsecs - $start) / 1000; if ($us >= " +
+         std::to_string(min_us) + ") { " + OFF_CPU_MAP +
+         "[comm, ustack, kstack] = sum($us); } } }";
+}
+
+int BPFtrace::print_folded(IMap &map, std::ostream &out)
+{
+  // Printed like the maps are, through a folded output for the occasion
+  std::unique_ptr<Output> output = std::make_unique<FoldedOutput>(out);
+  std::swap(out_, output);
+  int err = print_map(map, 0, 0);
+  std::swap(out_, output);
+  return err;
+}
+
+void BPFtrace::print_self_profile(std::ostream &out)
+{
+  if (auto map = maps.Lookup(SELF_PROFILE_MAP))
+    print_folded(**map, out);
+}
+
+void BPFtrace::warm_up()
+{
+  feature_->report();
+  ksyms_.load();
+  probe_matcher_->prefetch_kernel_symbols();
+}
+
+void BPFtrace::start_startup_work()
+{
+  // The features are detected into a BPFfeature of their own, the parser
+  // may look some up meanwhile. Nothing is left to detect when they were
+  // read from BPFTRACE_CACHE_DIR.
+  if (!features_detected_.valid() && !feature_->detected())
+    features_detected_ = std::async(std::launch::async, []() {
+      auto feature = std::make_unique<BPFfeature>();
+      feature->report();
+      return feature;
+    });
+  if (!btf_indexed_.valid() && btf_.has_data())
+    btf_indexed_ = std::async(std::launch::async,
+                              [this]() { btf_.prefetch_index(); });
+}
+
+void BPFtrace::finish_startup_work()
+{
+  Timings::Scope timing("startup work");
+  if (features_detected_.valid())
+    feature_ = features_detected_.get();
+  if (btf_indexed_.valid())
+    btf_indexed_.get();
+}
+
+void BPFtrace::prefetch_ksyms()
+{
+  if (raw_symbols_ || ksyms_loaded_.valid())
+    return;
+  ksyms_loaded_ = std::async(std::launch::async, [this]() { ksyms_.load(); })
+                      .share();
+}
+
+// Sums the per-CPU counts of the runs of each probe id, most run first
+void BPFtrace::print_probe_counts()
+{
+  auto map = maps[MapManager::Type::ProbeCounts];
+  if (!map)
+    return;
+
+  std::vector<std::pair<std::string, uint64_t>> counts;
+  std::vector<uint64_t> values(ncpus_);
+  for (uint32_t id = 0; id < probe_ids_.size(); id++)
+  {
+    if (bpf_lookup_elem(map.value()->mapfd_, &id, values.data()) < 0)
+      continue;
+    uint64_t count = 0;
+    for (int cpu = 0; cpu < seen_cpus_; cpu++)
+      count += values[cpu];
+    counts.emplace_back(probe_ids_[id], count);
+  }
+  std::stable_sort(counts.begin(), counts.end(), [](auto &a, auto &b) {
+    return a.second > b.second;
+  });
+  out_->probe_counts(counts);
+}
+
+// The instructions of a program are those of its section and of the ones
+// split off it, see get_section_name_for_tail_call(). All of them could run
+// on every run of the probe, which makes the projection an upper bound.
+void BPFtrace::print_estimates()
+{
+  auto map = maps[MapManager::Type::ProbeCounts];
+  if (!map)
+    return;
+
+  uint64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - estimate_start_)
+                            .count();
+  std::vector<ProbeEstimate> estimates;
+  std::vector<uint64_t> values(ncpus_);
+  for (uint32_t id = 0; id < probe_ids_.size(); id++)
+  {
+    auto &name = probe_ids_[id];
+    auto section = estimate_sections_.find(name);
+    if (name == "BEGIN" || name == "END" ||
+        section == estimate_sections_.end() ||
+        bpf_lookup_elem(map.value()->mapfd_, &id, values.data()) < 0)
+      continue;
+
+    ProbeEstimate estimate;
+    estimate.name = name;
+    for (int cpu = 0; cpu < seen_cpus_; cpu++)
+      estimate.runs += values[cpu];
+    auto tail_prefix = section->second + "_tail";
+    for (auto &[sec_name, code] : bpforc_->getSections())
+    {
+      if (sec_name == section->second ||
+          sec_name.compare(0, tail_prefix.size(), tail_prefix) == 0)
+        estimate.insns += std::get<1>(code) / sizeof(struct bpf_insn);
+    }
+    estimates.push_back(std::move(estimate));
+  }
+  std::stable_sort(estimates.begin(),
+                   estimates.end(),
+                   [](auto &a, auto &b) { return a.runs > b.runs; });
+  out_->probe_estimates(estimates, elapsed_ns);
+}
+
+// Sums the per-CPU counts of the failed helper calls, one warning for each
+// call site and return value that failed again since the previous call
+void BPFtrace::print_helper_errors()
+{
+  auto map = maps[MapManager::Type::HelperErrors];
+  if (!map)
+    return;
+
+  int mapfd = map.value()->mapfd_;
+  std::map<std::pair<int32_t, int32_t>, uint64_t> counts;
+  std::vector<uint64_t> values(ncpus_);
+  std::pair<int32_t, int32_t> key, prev;
+  void *prev_key = nullptr;
+  while (bpf_get_next_key(mapfd, prev_key, &key) == 0)
+  {
+    prev = key;
+    prev_key = &prev;
+    if (bpf_lookup_elem(mapfd, &key, values.data()) < 0)
+      continue;
+    uint64_t count = 0;
+    for (int cpu = 0; cpu < ncpus_; cpu++)
+      count += values[cpu];
+    counts[key] = count;
+  }
+
+  for (auto &[key, count] : counts)
+  {
+    auto &reported = helper_errors_reported_[key];
+    if (count <= reported)
+      continue;
+    auto found = helper_error_info_.find(key.first);
+    if (found == helper_error_info_.end())
+      continue;
+    auto &info = found->second;
+    uint64_t failed = count - reported;
+    reported = count;
+    if (failed == 1)
+      LOG(WARNING, info.loc, std::cerr) << helper_error_msg(info, key.second);
+    else
+      LOG(WARNING, info.loc, std::cerr)
+          << helper_error_msg(info, key.second) << " (" << failed << " times)";
+  }
+}
+
+// The divisor is multiplied by how many more events there were than the
+// ones received, at least 2, on every second events were lost, and halved
+// after 5 seconds without loss
+void BPFtrace::adjust_sampling()
+{
+  sampling_last_ = std::chrono::steady_clock::now();
+  uint64_t received = 0, lost = 0;
+  for (auto &reader : event_stats_.readers)
+  {
+    received += reader.received;
+    lost += reader.lost;
+  }
+  uint64_t new_received = received - sampling_received_;
+  uint64_t new_lost = lost - sampling_lost_;
+  sampling_received_ = received;
+  sampling_lost_ = lost;
+
+  uint64_t divisor = sampling_divisor_;
+  if (new_lost)
+  {
+    uint64_t factor = 2;
+    if (new_received)
+      factor = std::max<uint64_t>(
+          factor, (new_received + new_lost + new_received - 1) / new_received);
+    divisor = std::min(divisor * factor, ADAPTIVE_SAMPLING_MAX);
+    sampling_clean_secs_ = 0;
+  }
+  else if (divisor > 1 && ++sampling_clean_secs_ >= 5)
+  {
+    divisor /= 2;
+    sampling_clean_secs_ = 0;
+  }
+  if (divisor == sampling_divisor_)
+    return;
+
+  // The counts of the runs racing with the update are lost, they're only
+  // for the rate printed at exit
+  int mapfd = maps[MapManager::Type::AdaptiveSample].value()->mapfd_;
+  uint32_t key = 0;
+  std::vector<uint64_t> values(4 * ncpus_);
+  if (bpf_lookup_elem(mapfd, &key, values.data()) < 0)
+    return;
+  for (int cpu = 0; cpu < ncpus_; cpu++)
+    values[cpu * 4] = divisor;
+  if (bpf_update_elem(mapfd, &key, values.data(), BPF_ANY) < 0)
+  {
+    LOG(WARNING) << "Failed to update the adaptive sampling divisor: "
+                 << strerror(errno);
+    return;
+  }
+
+  if (divisor > sampling_divisor_)
+    LOG(WARNING) << new_lost << " events lost, now sampling 1 in " << divisor
+                 << " runs of the probes";
+  else
+    LOG(WARNING) << "Now sampling 1 in " << divisor << " runs of the probes";
+  sampling_divisor_ = divisor;
+}
+
+void BPFtrace::print_sampling()
+{
+  auto map = maps[MapManager::Type::AdaptiveSample];
+  if (!map)
+    return;
+
+  uint32_t key = 0;
+  std::vector<uint64_t> values(4 * ncpus_);
+  if (bpf_lookup_elem(map.value()->mapfd_, &key, values.data()) < 0)
+    return;
+  uint64_t seen = 0, passed = 0;
+  for (int cpu = 0; cpu < ncpus_; cpu++)
+  {
+    seen += values[cpu * 4 + 2];
+    passed += values[cpu * 4 + 3];
+  }
+  if (!passed || seen == passed)
+    return;
+
+  std::ostringstream scale;
+  scale << std::fixed << std::setprecision(2)
+        << static_cast<double>(seen) / passed;
+  LOG(WARNING) << "Adaptive sampling let " << passed << " of " << seen
+               << " runs of the probes through, the counts and sums of the "
+                  "maps are about 1/"
+               << scale.str() << " of the actual ones";
+}
+
+bool BPFtrace::probe_stats_enabled() const
+{
+  return probe_stats_interval_ || probe_max_cpu_pct_ || probe_max_ns_;
+}
+
+// Detach the probes which, since the last check, used more than
+// probe_max_cpu_pct_ of a CPU or more than probe_max_ns_ per run on average
+void BPFtrace::check_probe_budget()
+{
+  auto now = std::chrono::steady_clock::now();
+  uint64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            now - probe_budget_last_)
+                            .count();
+  probe_budget_last_ = now;
+
+  read_probe_stats();
+  std::set<std::string> over_budget;
+  for (auto &ap : attached_probes_)
+  {
+    auto &name = ap->probe().name;
+    auto &cur = probe_stats_[name];
+    auto &last = probe_budget_stats_[name];
+    uint64_t runs = cur.run_cnt - last.run_cnt;
+    uint64_t run_time = cur.run_time_ns - last.run_time_ns;
+    last = cur;
+
+    if (probe_max_cpu_pct_ && run_time * 100 > probe_max_cpu_pct_ * elapsed_ns)
+    {
+      LOG(WARNING) << "Detaching " << name << ": used "
+                   << run_time * 100 / elapsed_ns << "% of a CPU, over the "
+                   << probe_max_cpu_pct_ << "% budget";
+      over_budget.insert(name);
+    }
+    else if (probe_max_ns_ && runs && run_time / runs > probe_max_ns_)
+    {
+      LOG(WARNING) << "Detaching " << name << ": took " << run_time / runs
+                   << " ns per run, over the " << probe_max_ns_
+                   << " ns budget";
+      over_budget.insert(name);
+    }
+  }
+
+  if (over_budget.empty())
+    return;
+
+  attached_probes_.erase(
+      std::remove_if(attached_probes_.begin(),
+                     attached_probes_.end(),
+                     [&](const std::unique_ptr<AttachedProbe> &ap) {
+                       return over_budget.count(ap->probe().name) != 0;
+                     }),
+      attached_probes_.end());
+
+  if (attached_probes_.empty())
+  {
+    LOG(WARNING) << "All probes were detached, exiting";
+    request_finalize();
+  }
+}
+
+// Have the kernel account the run count and time of all BPF programs, for as
+// long as bpf_stats_fd_ is open
+int BPFtrace::enable_probe_stats()
+{
+  // BPF_ENABLE_STATS and BPF_STATS_RUN_TIME (Linux 5.8) from linux/bpf.h,
+  // which may be older than the running kernel
+  const int bpf_enable_stats_cmd = 32;
+  const uint32_t bpf_stats_run_time = 0;
+  union
+  {
+    struct
+    {
+      uint32_t type;
+    } enable_stats;
+    uint8_t pad[128];
+  } attr = {};
+  attr.enable_stats.type = bpf_stats_run_time;
+
+  bpf_stats_fd_ = syscall(__NR_bpf, bpf_enable_stats_cmd, &attr, sizeof(attr));
+  probe_stats_last_ = std::chrono::steady_clock::now();
+  probe_budget_last_ = probe_stats_last_;
+  if (bpf_stats_fd_ >= 0)
+    return 0;
+
+  // Older kernels only have the global switch, don't flip it behind the
+  // user's back
+  std::ifstream sysctl("/proc/sys/kernel/bpf_stats_enabled");
+  std::string enabled;
+  if (sysctl >> enabled && enabled == "1")
+    return 0;
+
+  LOG(ERROR) << "Failed to enable BPF program stats: " << strerror(errno)
+             << ". On kernels older than 5.8, run 'sysctl -w "
+                "kernel.bpf_stats_enabled=1' first.";
+  return -1;
+}
+
+// Probes that have been detached keep the stats last read for them
+void BPFtrace::read_probe_stats()
+{
+  std::map<std::string, ProbeStats> stats;
+  for (auto &ap : attached_probes_)
+  {
+    struct bpf_prog_info info = {};
+    uint32_t info_len = sizeof(info);
+    if (bpf_obj_get_info(ap->progfd(), &info, &info_len) != 0)
+      continue;
+
+    // A probe can be made of several programs, e.g. one per uprobe target
+    auto &s = stats[ap->probe().name];
+    s.run_cnt += info.run_cnt;
+    s.run_time_ns += info.run_time_ns;
+  }
+
+  for (auto &s : stats)
+    probe_stats_[s.first] = s.second;
+}
+
+void BPFtrace::poll_perf_events(int epollfd, bool drain)
+{
+  if (perf_consumers_)
+  {
+    poll_perf_consumers(drain);
+    return;
+  }
+
+  // With a wakeup watermark, the perf buffers can hold events without being
+  // reported as ready, so all of them are read whenever the wait times out.
+  // The timeout then backs off while there's nothing to read, trading latency
+  // for fewer wakeups, and is reset as soon as events show up.
+  bool watermark = perf_rb_wakeup_ > 1;
+  int timeout = PERF_POLL_TIMEOUT_MS;
+  auto events = std::vector<struct epoll_event>(online_cpus_);
+  while (true)
+  {
+    if (reload_recv && !drain)
+      reload();
+    advance_windows();
+    // Without the uevents the CPUs are checked on every wakeup, at most once
+    // a second
+    if (hotplug_fd_ < 0 && cpus_changed() && sync_perf_readers(epollfd) < 0)
+      return;
+    // One event per CPU at a time, as many as there are CPUs online
+    events.resize(online_cpus_);
+
+    int ready = epoll_wait(epollfd, events.data(), online_cpus_, timeout);
+    if (ready < 0 && errno == EINTR && !BPFtrace::exitsig_recv) {
+      // We received an interrupt not caused by SIGINT, skip and run again,
+      // it may have been SIGUSR1 asking for the maps or the self stats
+      poll_stats();
+      continue;
+    }
+
+    consume_control();
+    bool swept = false;
+    if (watermark && ready == 0)
+    {
+      uint64_t seen = event_count_;
+      for (auto &reader : open_perf_buffers_)
+      {
+        if (reader)
+          perf_reader_event_read((perf_reader *)reader.get());
+      }
+      swept = event_count_ != seen;
+    }
+
+    // The slots of window maps are at least a second long, waking up later
+    // than that would leave some of them unrenewed
+    if (watermark && ready == 0 && !swept && !has_windows_)
+      timeout = std::min(timeout * 2, PERF_POLL_TIMEOUT_MAX_MS);
+    else
+      timeout = PERF_POLL_TIMEOUT_MS;
+
+    // Return if either
+    //   * epoll_wait has encountered an error (eg signal delivery)
+    //   * There's no events left and we've been instructed to drain or
+    //     finalization has been requested through exit() builtin.
+    if (ready < 0 || (ready == 0 && !swept && (drain || finalize_)))
+    {
+      if (ringbuf_)
+        poll_ringbuf_loss();
+      // The tracee can be waiting for a watchpoint of the sweep
+      arm_watchpoints();
+      return;
+    }
+
+    bool exited = false;
+    for (int i=0; i<ready; i++)
+    {
+      if (exit_watched_ && exit_watch_event(epollfd, events[i].data.ptr))
+      {
+        exited = true;
+        continue;
+      }
+      if (metrics_server_ && events[i].data.ptr == metrics_server_.get())
+      {
+        serve_metrics();
+        continue;
+      }
+      if (events[i].data.ptr == &hotplug_fd_)
+      {
+        // The buffers of the CPUs going offline are read before closing
+        // them, the other events of this batch can be theirs
+        if (cpus_changed() && sync_perf_readers(epollfd) < 0)
+          return;
+        continue;
+      }
+      if (control_ringbuf_ && events[i].data.ptr == control_ringbuf_)
+        continue;
+      // The async actions sent while the previous buffer was read go first
+      consume_control();
+#ifdef HAVE_LIBBPF_RINGBUF
+      if (ringbuf_ && events[i].data.ptr == ringbuf_)
+      {
+        ring_buffer__consume(ringbuf_);
+        continue;
+      }
+#endif
+      perf_reader_event_read((perf_reader*)events[i].data.ptr);
+    }
+
+    arm_watchpoints();
+    if (ringbuf_)
+      poll_ringbuf_loss();
+    poll_stats();
+    if (symbolize_pool_)
+      symbolize_pool_->flush();
+    if (system_pool_)
+      system_pool_->flush();
+    // End of the batch of events
+    out_->outputstream().flush();
+    if (printf_out_)
+      printf_out_->outputstream().flush();
+
+    // If we are tracing a specific pid and it has exited, we should exit
+    // as well b/c otherwise we'd be tracing nothing. With the exits watched
+    // this only has to be asked once one of them was seen.
+    if ((exited || !exit_watched_) &&
+        ((procmon_ && !procmon_->is_alive()) ||
+         (child_ && !child_->is_alive())))
+    {
+      return;
+    }
+  }
+  return;
+}
+
+// The pidfds of procmon_ and child_ are readable once they exited, waiting
+// for that along with the events saves asking after every wakeup
+int BPFtrace::setup_exit_watch(int epollfd)
+{
+  // The consumer threads have their own epoll instance, see
+  // poll_perf_consumers()
+  if (perf_consumers_ || (!procmon_ && !child_))
+    return 0;
+
+  std::vector<std::pair<int, void *>> watches;
+  if (procmon_)
+    watches.emplace_back(procmon_->exit_fd(), procmon_.get());
+  if (child_)
+    watches.emplace_back(child_->exit_fd(), child_.get());
+  for (auto &[fd, ptr] : watches)
+  {
+    // Without a pidfd every wakeup asks is_alive() as before
+    if (fd < 0)
+      return 0;
+  }
+
+  for (auto &[fd, ptr] : watches)
+  {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+      LOG(ERROR) << "Failed to add process exit fd to epoll";
+      return -1;
+    }
+  }
+  exit_watched_ = true;
+  return 0;
+}
+
+// The child of the previous run exited: the events it left are printed, then
+// the maps of its run, which are cleared for the next one. The probes stay
+// attached, so the new child only has to be started.
+int BPFtrace::rerun_child(int epollfd, uint64_t run)
+{
+  if (perf_consumers_)
+  {
+    while (perf_consumers_->dispatch(PERF_POLL_TIMEOUT_MS) > 0)
+      ;
+  }
+  else
+    poll_perf_events(epollfd, true);
+  if (symbolize_pool_)
+    symbolize_pool_->drain();
+  if (system_pool_)
+    system_pool_->drain();
+
+  out_->child_run(run - 1, child_->exit_code(), child_->term_signal());
+  int err = print_maps();
+  if (err)
+    return err;
+  for (auto &map : maps)
+  {
+    if (map->name_ == SELF_PROFILE_MAP || map->name_ == TARGET_PIDS_MAP)
+      continue;
+    err = clear_map(*map);
+    if (err)
+      return err;
+  }
+
+  try
+  {
+    child_ = std::make_unique<ChildProc>(cmd_);
+    child_->run();
+  }
+  catch (const std::runtime_error &e)
+  {
+    LOG(ERROR) << "Failed to run child: " << e.what();
+    return -1;
+  }
+
+  if (exit_watched_)
+  {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = child_.get();
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, child_->exit_fd(), &ev) == -1)
+    {
+      LOG(ERROR) << "Failed to add process exit fd to epoll";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Whether ptr is the one of an exit watched by setup_exit_watch(). The fd
+// stays readable once the process exited, so it's taken out of the epoll set
+// for draining the events left to work.
+bool BPFtrace::exit_watch_event(int epollfd, void *ptr)
+{
+  int fd = -1;
+  if (procmon_ && ptr == procmon_.get())
+    fd = procmon_->exit_fd();
+  else if (child_ && ptr == child_.get())
+    fd = child_->exit_fd();
+  else
+    return false;
+
+  epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+  return true;
+}
+
+// The perf buffers are read by the consumer threads, we only wait for their
+// batches and print them in order.
+// Replace the slot of each window map that the programs move to next with an
+// empty map, once the slot before it became the current one. The slot then
+// only holds the counts of its own slice of time, and the oldest slice of
+// the window is dropped a slice early rather than being added to.
+void BPFtrace::advance_windows()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+  // A reload can add or remove them
+  has_windows_ = false;
+  for (auto &map : maps)
+  {
+    if (!map->is_windowed())
+      continue;
+    has_windows_ = true;
+    uint64_t slots = map->window_mapfds_.size();
+    uint64_t slice = now / map->window_slot_ns_;
+    // All the slots are empty until the first slice
+    uint64_t from = map->window_slice_ ? map->window_slice_ + 1 : slice;
+    if (slice >= slots)
+      from = std::max(from, slice - slots + 1);
+    for (uint64_t s = from; s <= slice; s++)
+      map->renew_window_slot((s + 1) % slots);
+    map->window_slice_ = slice;
+  }
+}
+
+// Delete the entries of the ttl maps that weren't updated for their ttl,
+// along with their times, see IMap::ttl_mapfd_. The times are read and the
+// entries deleted in batches when the kernel supports it. An entry updated
+// again between the two is deleted all the same.
+void BPFtrace::expire_maps()
+{
+  ttl_last_ = std::chrono::steady_clock::now();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+  for (auto &map : maps)
+  {
+    if (map->ttl_mapfd_ < 0)
+      continue;
+    size_t key_size = map->bpf_key_size();
+
+    std::vector<uint8_t> keys, times;
+    int err = read_ttl_times(*map, key_size, keys, times);
+    if (err)
+      continue;
+
+    std::vector<uint8_t> expired;
+    for (size_t i = 0; i < times.size() / sizeof(uint64_t); i++)
+    {
+      uint64_t updated = read_data<uint64_t>(&times[i * sizeof(uint64_t)]);
+      if (updated + map->ttl_ns_ <= now)
+        expired.insert(expired.end(),
+                       keys.begin() + i * key_size,
+                       keys.begin() + (i + 1) * key_size);
+    }
+    if (expired.empty())
+      continue;
+    uint32_t count = expired.size() / key_size;
+    if (bt_verbose)
+      LOG(INFO) << map->name_ << ": " << count << " entries expired";
+
+#ifdef HAVE_LIBBPF_MAP_BATCH
+    if (feature_->has_map_batch())
+    {
+      // Keys that are already gone, e.g. deleted by the programs, stop the
+      // batch, the rest is deleted one by one
+      uint32_t deleted = count;
+      bpf_map_delete_batch(map->mapfd_, expired.data(), &deleted, nullptr);
+      uint32_t times_deleted = count;
+      bpf_map_delete_batch(
+          map->ttl_mapfd_, expired.data(), &times_deleted, nullptr);
+      if (deleted == count && times_deleted == count)
+        continue;
+    }
+#endif
+    for (uint32_t i = 0; i < count; i++)
+    {
+      bpf_delete_elem(map->mapfd_, &expired[i * key_size]);
+      bpf_delete_elem(map->ttl_mapfd_, &expired[i * key_size]);
+    }
+  }
+}
+
+// Read the keys and times of the ttl map of map, as arrays of key_size and
+// 8 bytes
+int BPFtrace::read_ttl_times(IMap &map,
+                             size_t key_size,
+                             std::vector<uint8_t> &keys,
+                             std::vector<uint8_t> &times)
+{
+#ifdef HAVE_LIBBPF_MAP_BATCH
+  if (feature_->has_map_batch())
+  {
+    // As dump_map_batch() reads them
+    std::vector<uint8_t> in_batch(std::max<size_t>(key_size, sizeof(uint64_t)));
+    std::vector<uint8_t> out_batch(in_batch.size());
+    uint32_t batch_size = std::max<uint32_t>(
+        std::min<uint32_t>(1024, map.max_entries_), 1);
+    bool first = true;
+    while (true)
+    {
+      size_t read = times.size() / sizeof(uint64_t);
+      keys.resize((read + batch_size) * key_size);
+      times.resize((read + batch_size) * sizeof(uint64_t));
+      uint32_t count = batch_size;
+      int err = bpf_map_lookup_batch(map.ttl_mapfd_,
+                                     first ? nullptr : in_batch.data(),
+                                     out_batch.data(),
+                                     &keys[read * key_size],
+                                     &times[read * sizeof(uint64_t)],
+                                     &count,
+                                     nullptr);
+      int saved_errno = errno;
+      keys.resize((read + count) * key_size);
+      times.resize((read + count) * sizeof(uint64_t));
+      if (err && saved_errno == ENOSPC && count == 0)
+      {
+        batch_size *= 2;
+        continue;
+      }
+      if (err && saved_errno != ENOENT)
+      {
+        LOG(ERROR) << "failed to look up elems of map '" << map.name_
+                   << "': " << strerror(saved_errno);
+        return -1;
+      }
+      if (err)
+        return 0;
+      std::swap(in_batch, out_batch);
+      first = false;
+    }
+  }
+#endif
+
+  std::vector<uint8_t> key(key_size), next(key_size);
+  void *prev = nullptr;
+  while (bpf_get_next_key(map.ttl_mapfd_, prev, next.data()) == 0)
+  {
+    uint64_t updated;
+    if (bpf_lookup_elem(map.ttl_mapfd_, next.data(), &updated) == 0)
+    {
+      keys.insert(keys.end(), next.begin(), next.end());
+      times.resize(times.size() + sizeof(updated));
+      std::memcpy(&times[times.size() - sizeof(updated)],
+                  &updated,
+                  sizeof(updated));
+    }
+    std::swap(key, next);
+    prev = key.data();
+  }
+  return 0;
+}
+
+void BPFtrace::poll_perf_consumers(bool drain)
+{
+  while (true)
+  {
+    advance_windows();
+    if (cpus_changed() && sync_perf_readers(-1) < 0)
+      return;
+    consume_control();
+    size_t handled = perf_consumers_->dispatch(PERF_POLL_TIMEOUT_MS);
+    consume_control();
+    arm_watchpoints();
+
+    // Same exit conditions as poll_perf_events(): a signal was delivered, or
+    // there's nothing left to print and we've been asked to drain or exit.
+    if (BPFtrace::exitsig_recv || (handled == 0 && (drain || finalize_)))
+    {
+      if (drain)
+      {
+        perf_consumers_->drain();
+        arm_watchpoints();
+      }
+      return;
+    }
+
+    // Scrapes wait for at most one dispatch() timeout
+    if (metrics_server_)
+      serve_metrics();
+    poll_stats();
+    if (symbolize_pool_)
+      symbolize_pool_->flush();
+    if (system_pool_)
+      system_pool_->flush();
+    // End of the batch of events
+    out_->outputstream().flush();
+    if (printf_out_)
+      printf_out_->outputstream().flush();
+
+    if ((procmon_ && !procmon_->is_alive()) || (child_ && !child_->is_alive()))
+      return;
+  }
+}
+
+int BPFtrace::print_maps()
+{
+  if (estimate_secs_)
+  {
+    print_estimates();
+    return 0;
+  }
+  if (probe_stats_interval_)
+    out_->probe_stats(probe_stats_);
+  if (probe_counts_)
+    print_probe_counts();
+
+  int err = print_program_maps(false);
+  if (err)
+    return err;
+
+  for (auto &lost : lost_stacks_)
+  {
+    if (lost.second.empty())
+      continue;
+    LOG(WARNING) << "Stacks (of up to " << lost.first.limit << " frames) of "
+                 << lost.second.size()
+                 << " processes were lost to stack map hash collisions. "
+                 << "Consider raising BPFTRACE_STACK_MAP_ENTRIES (currently "
+                 << stack_map_entries_ << ").";
+  }
+
+  return 0;
+}
+
+// The maps of the program, without the ones bpftrace keeps for itself, and
+// without those written to a --snapshot unless snapshot_maps is set
+int BPFtrace::print_program_maps(bool snapshot_maps)
+{
+  std::vector<IMap *> printed;
+  IMap *off_cpu = nullptr;
+  for (auto &mapmap : maps)
+  {
+    bool unprinted = !snapshot_maps && unprinted_maps_.count(mapmap->name_);
+    if (mapmap->name_ == OFF_CPU_MAP && !unprinted)
+      off_cpu = mapmap.get();
+    if (mapmap->name_ == SELF_PROFILE_MAP ||
+        mapmap->name_ == TARGET_PIDS_MAP || mapmap->name_ == OFF_CPU_MAP ||
+        mapmap->name_ == OFF_CPU_START_MAP || unprinted || mapmap->bloom_)
+      continue;
+    printed.push_back(mapmap.get());
+  }
+
+  prefetch_maps(printed);
+  int err = 0;
+  for (auto map : printed)
+  {
+    err = print_map(*map, 0, 0);
+    if (err)
+      break;
+  }
+  prefetched_maps_.clear();
+  if (err)
+    return err;
+  if (off_cpu)
+    return print_folded(*off_cpu, out_->outputstream());
+  return 0;
+}
+
+// On SIGUSR1, rather than from a print() of an interval probe: the maps of
+// --print, or all of them, are read from userspace while the probes run
+void BPFtrace::print_signal_maps()
+{
+  print_maps_recv = false;
+  if (signal_maps_.empty())
+    print_program_maps(true);
+  for (auto &name : signal_maps_)
+  {
+    if (auto map = maps.Lookup(name))
+      print_map(**map, 0, 0);
+  }
+  out_->outputstream().flush();
+}
+
+// Read the maps print_maps() is about to print on worker threads, one map
+// at a time each, for print_map() to find their entries in prefetched_maps_.
+// With large maps most of the time goes to the syscalls reading them, while
+// the formatting resolves symbols through caches only this thread uses, so
+// it is left to print_map(), in the order of the maps.
+void BPFtrace::prefetch_maps(const std::vector<IMap *> &printed)
+{
+  uint64_t threads = print_threads_ ? print_threads_
+                                    : get_online_cpus().size();
+  threads = std::min<uint64_t>(threads, printed.size());
+  // Streamed maps aren't to be held whole
+  if (threads <= 1 || stream_maps_)
+    return;
+
+  // The size of the keys the print_map_*() functions read the map with
+  auto key_size = [](IMap &map) {
+    auto &type = map.type_;
+    if (type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy())
+      return map.key_.size() + 8;
+    return map.key_.size();
+  };
+
+  std::vector<PrefetchedMap> fetched(printed.size());
+  std::atomic<size_t> next = 0;
+  auto read = [&]() {
+    for (size_t n = next++; n < printed.size(); n = next++)
+    {
+      auto &map = *printed[n];
+      fetched[n].err = dump_map(map, key_size(map), fetched[n].entries);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (uint64_t i = 0; i < threads; ++i)
+    workers.emplace_back(read);
+  for (auto &worker : workers)
+    worker.join();
+
+  for (size_t i = 0; i < printed.size(); i++)
+    prefetched_maps_.emplace(std::make_pair(printed[i], key_size(*printed[i])),
+                             std::move(fetched[i]));
+}
+
+// Count the entries in use in each stack id map, for the event stats
+void BPFtrace::read_stack_map_stats()
+{
+  event_stats_.stack_maps.clear();
+  for (auto &stack_map : maps.StackMaps())
+  {
+    auto &stack_type = stack_map.first;
+    auto &map = *stack_map.second;
+    EventStats::StackMap stats;
+    stats.name = "stacks(";
+    if (stack_type.mode == StackMode::perf)
+      stats.name += "perf, ";
+    else if (stack_type.mode == StackMode::build_id)
+      stats.name += "build_id, ";
+    stats.name += std::to_string(stack_type.limit) + ")";
+    stats.max_entries = map.max_entries_;
+    stats.lost = lost_stacks_[stack_type].size();
+
+    uint32_t key, next_key;
+    uint32_t *prev = nullptr;
+    while (bpf_get_next_key(map.mapfd_, prev, &next_key) == 0)
+    {
+      stats.used++;
+      key = next_key;
+      prev = &key;
+    }
+    event_stats_.stack_maps.push_back(std::move(stats));
+  }
+}
+
+// Point the BPF programs at the spare buffer of a double-buffered map and
+// leave the one they were updating as a snapshot for print() and clear()
+int BPFtrace::flip_map(IMap &map)
+{
+  // The previous snapshot wasn't cleared, keep printing it rather than
+  // dropping it
+  if (map.snapshot_)
+    return 0;
+
+  uint32_t key = 0;
+  if (bpf_update_elem(map.outer_mapfd_, &key, &map.spare_mapfd_, 0))
+  {
+    LOG(ERROR) << "failed to flip map '" << map.name_
+               << "': " << strerror(errno);
+    return -1;
+  }
+  std::swap(map.mapfd_, map.spare_mapfd_);
+  map.snapshot_ = true;
+  return 0;
+}
+
+// clear a map
+int BPFtrace::clear_map(IMap &map)
+{
+  // The entries go away with their tasks, bloom maps can't be cleared
+  if (map.task_storage_ || map.bloom_)
+    return 0;
+
+  if (map.type_.IsCmsTy())
+  {
+    int err = zero_cms_sketch(map);
+    if (err)
+      return err;
+  }
+
+  if (map.is_windowed())
+  {
+    for (uint32_t slot = 0; slot < map.window_mapfds_.size(); slot++)
+      if (map.renew_window_slot(slot))
+        return -1;
+    return 0;
+  }
+
+  if (!map.is_clearable())
+    return zero_map(map);
+
+  // The times of the entries of ttl maps go with them
+  if (map.ttl_mapfd_ >= 0)
+  {
+    std::vector<uint8_t> key(map.bpf_key_size());
+    while (bpf_get_next_key(map.ttl_mapfd_, nullptr, key.data()) == 0 &&
+           bpf_delete_elem(map.ttl_mapfd_, key.data()) == 0)
+      ;
+  }
+
+  // The programs record again the strings of the keys they use
+  if (map.strings_mapfd_ >= 0)
+  {
+    // With a key that is missing, e.g. the hash 0, the first key is returned
+    uint64_t missing = 0, hash;
+    while (bpf_get_next_key(map.strings_mapfd_, &missing, &hash) == 0 &&
+           bpf_delete_elem(map.strings_mapfd_, &hash) == 0)
+      ;
+  }
+
+  // The entries of a double-buffered map are dropped along with the buffer
+  // holding them: the programs are switched to the spare one, if they
+  // weren't already by print(), and a new empty map takes its place. Both
+  // take a syscall or two whatever the size of the map.
+  if (map.is_double_buffered())
+  {
+    if (!map.snapshot_ && flip_map(map))
+      return -1;
+    if (map.renew_spare() == 0)
+    {
+      map.snapshot_ = false;
+      return 0;
+    }
+    // Otherwise the snapshot is emptied below
+  }
+
+  // hist maps have 8 extra bytes for the bucket number, see
+  // IMap::bpf_key_size()
+  size_t key_size = map.bpf_key_size();
+
+  // Delete the entries batch by batch, the values read along are dropped
+  if (feature_->has_map_batch())
+  {
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+    int err = dump_map_batch(map, key_size, entries, true);
+    if (err == 0)
+      map.snapshot_ = false;
+    if (err <= 0)
+      return err;
+  }
+
+  std::vector<uint8_t> old_key;
+  try
+  {
+    old_key = find_empty_key(map, key_size);
+  }
+  catch (std::runtime_error &e)
+  {
+    LOG(ERROR) << "failed to get key for map '" << map.name_
+               << "': " << e.what();
+    return -2;
+  }
+  auto key(old_key);
+
+  // snapshot keys, then operate on them
+  std::vector<std::vector<uint8_t>> keys;
+  while (bpf_get_next_key(map.read_mapfd(), old_key.data(), key.data()) == 0)
+  {
+    keys.push_back(key);
+    old_key = key;
+  }
+
+  for (auto &key : keys)
+  {
+    int err = bpf_delete_elem(map.read_mapfd(), key.data());
+    if (err)
+    {
+      LOG(ERROR) << "failed to look up elem: " << err;
+      return -1;
+    }
+  }
+
+  // Once the snapshot of a double-buffered map is cleared, it's the spare
+  map.snapshot_ = false;
+  return 0;
+}
+
+// zero a map
+int BPFtrace::zero_map(IMap &map)
+{
+  if (map.task_storage_ || map.bloom_)
+    return 0;
+
+  // The entries of all the slots would have to be zeroed, they are dropped
+  // instead
+  if (map.is_windowed())
+    return clear_map(map);
+
+  if (map.type_.IsCmsTy())
+  {
+    int err = zero_cms_sketch(map);
+    if (err)
+      return err;
+  }
+
+  if (map.is_mmapped())
+  {
+    auto values = static_cast<uint64_t *>(map.mmapped_);
+    size_t nvalues = map.max_entries_ * map.mmapped_value_size() /
+                     sizeof(uint64_t);
+    for (size_t i = 0; i < nvalues; i++)
+      __atomic_store_n(&values[i], 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
+  std::vector<uint8_t> old_key;
+  try
+  {
+    // hist maps have 8 extra bytes for the bucket number
+    old_key = find_empty_key(map, map.bpf_key_size());
+  }
+  catch (std::runtime_error &e)
+  {
+    LOG(ERROR) << "failed to get key for map '" << map.name_
+               << "': " << e.what();
+    return -2;
+  }
+  auto key(old_key);
+
+  // snapshot keys, then operate on them
+  std::vector<std::vector<uint8_t>> keys;
+  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  {
+    keys.push_back(key);
+    old_key = key;
+  }
+
+  int value_size = map.bpf_value_size() * nvalues;
+  std::vector<uint8_t> zero(value_size, 0);
+  for (auto &key : keys)
+  {
+    int err = bpf_update_elem(map.mapfd_, key.data(), zero.data(), BPF_EXIST);
+
+    if (err)
+    {
+      LOG(ERROR) << "failed to look up elem: " << err;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+std::string BPFtrace::map_value_to_str(const SizedType &stype,
+                                       const std::vector<uint8_t> &value,
+                                       bool is_per_cpu,
+                                       uint32_t div,
+                                       const Output &output)
+{
+  uint32_t nvalues = is_per_cpu ? seen_cpus_ : 1;
+  if (stype.IsKstackTy())
+    return get_stack(
+        read_data<uint64_t>(value.data()), false, stype.stack_type, 8);
+  else if (stype.IsUstackTy())
+    return get_stack(
+        read_data<uint64_t>(value.data()), true, stype.stack_type, 8);
+  else if (stype.IsKsymTy())
+    return resolve_ksym(read_data<uintptr_t>(value.data()));
+  else if (stype.IsUsymTy())
+    return resolve_usym(read_data<uintptr_t>(value.data()),
+                        read_data<uintptr_t>(value.data() + 8));
+  else if (stype.IsInetTy())
+    return resolve_inet(read_data<uint64_t>(value.data()),
+                        (uint8_t *)(value.data() + 8));
+  else if (stype.IsUsernameTy())
+    return resolve_uid(read_data<uint64_t>(value.data()));
+  else if (stype.IsCgroupPathTy())
+    return resolve_cgroup_path(read_data<uint64_t>(value.data()));
+  else if (stype.IsBufferTy())
+    return resolve_buf(const_cast<char *>(reinterpret_cast<const char *>(
+                           value.data() + 1)),
+                       value[0]);
+  else if (stype.IsStringTy())
+  {
+    auto p = reinterpret_cast<const char *>(value.data());
+    return std::string(p, strnlen(p, stype.GetSize()));
+  }
+  else if (stype.IsArrayTy())
+  {
+    size_t elem_size = stype.GetElementTy()->GetSize();
+    std::vector<std::string> elems;
+    for (size_t i = 0; i < stype.GetNumElements(); i++)
+    {
+      std::vector<uint8_t> elem_data(value.begin() + i * elem_size,
+                                     value.begin() + (i + 1) * elem_size);
+      elems.push_back(map_value_to_str(
+          *stype.GetElementTy(), elem_data, is_per_cpu, div, output));
+    }
+
+    return "[" + str_join(elems, ",") + "]";
+  }
+  else if (stype.IsRecordTy())
+  {
+    auto &struct_type = structs_[stype.GetName()];
+    std::vector<std::string> elems;
+    for (auto &field : struct_type.fields)
+    {
+      std::vector<uint8_t> elem_data(value.begin() + field.second.offset,
+                                     value.begin() + field.second.offset +
+                                         field.second.type.GetSize());
+      elems.push_back(
+          output.struct_field_def_to_str(field.first) +
+          map_value_to_str(
+              field.second.type, elem_data, is_per_cpu, div, output));
+    }
+    return "{ " + str_join(elems, ", ") + " }";
+  }
+  else if (stype.IsCountTy())
+    return std::to_string(reduce_value<uint64_t>(value, nvalues) / div);
+  else if (stype.IsIntTy())
+  {
+    auto sign = stype.IsSigned();
+    switch (stype.GetIntBitWidth())
+    {
+      // clang-format off
+      case 64:
+        if (sign)
+          return std::to_string(
+            reduce_value<int64_t>(value, nvalues) / (int64_t)div);
+        return std::to_string(reduce_value<uint64_t>(value, nvalues) / div);
+      case 32:
+        if (sign)
+          return std::to_string(
+            reduce_value<int32_t>(value, nvalues) / (int32_t)div);
+        return std::to_string(reduce_value<uint32_t>(value, nvalues) / div);
+      case 16:
+        if (sign)
+          return std::to_string(
+            reduce_value<int16_t>(value, nvalues) / (int16_t)div);
+        return std::to_string(reduce_value<uint16_t>(value, nvalues) / div);
+      case 8:
+        if (sign)
+          return std::to_string(
             reduce_value<int8_t>(value, nvalues) / (int8_t)div);
         return std::to_string(reduce_value<uint8_t>(value, nvalues) / div);
         // clang-format on
@@ -1469,12 +4381,15 @@ std::string BPFtrace::map_value_to_str(const SizedType &stype,
     return std::to_string(min_value(value, nvalues) / div);
   else if (stype.IsMaxTy())
     return std::to_string(max_value(value, nvalues) / div);
+  else if (stype.IsDistinctTy())
+    return std::to_string(distinct_value(value, nvalues) / div);
   else if (stype.IsProbeTy())
     return resolve_probe(read_data<uint64_t>(value.data()));
   else if (stype.IsTimestampTy())
     return resolve_timestamp(
-        reinterpret_cast<AsyncEvent::Strftime *>(value.data())->strftime_id,
-        reinterpret_cast<AsyncEvent::Strftime *>(value.data())
+        reinterpret_cast<const AsyncEvent::Strftime *>(value.data())
+            ->strftime_id,
+        reinterpret_cast<const AsyncEvent::Strftime *>(value.data())
             ->nsecs_since_boot);
   else if (stype.IsMacAddressTy())
     return resolve_mac_address(value.data());
@@ -1482,18 +4397,262 @@ std::string BPFtrace::map_value_to_str(const SizedType &stype,
     return std::to_string(read_data<int64_t>(value.data()) / div);
 }
 
-int BPFtrace::print_map(IMap &map, uint32_t top, uint32_t div)
+void BPFtrace::append_map_value(std::string &out,
+                                const SizedType &stype,
+                                const std::vector<uint8_t> &value,
+                                bool is_per_cpu,
+                                uint32_t div,
+                                const Output &output)
+{
+  char buf[24];
+  std::to_chars_result res;
+  if (stype.IsCountTy() || stype.IsMaxTy() || stype.IsDistinctTy() ||
+      ((stype.IsSumTy() || stype.IsIntTy()) && !stype.IsSigned()))
+    res = std::to_chars(buf,
+                        buf + sizeof(buf),
+                        map_value_to_int(stype, value, is_per_cpu, div));
+  else if (stype.IsMinTy() || stype.IsSumTy() || stype.IsIntTy())
+    res = std::to_chars(buf,
+                        buf + sizeof(buf),
+                        static_cast<int64_t>(map_value_to_int(
+                            stype, value, is_per_cpu, div)));
+  else if (stype.IsStringTy())
+  {
+    auto p = reinterpret_cast<const char *>(value.data());
+    out.append(p, strnlen(p, stype.GetSize()));
+    return;
+  }
+  else
+  {
+    out += map_value_to_str(stype, value, is_per_cpu, div, output);
+    return;
+  }
+  out.append(buf, res.ptr);
+}
+
+uint64_t BPFtrace::map_value_to_int(const SizedType &stype,
+                                    const std::vector<uint8_t> &value,
+                                    bool is_per_cpu,
+                                    uint32_t div)
+{
+  uint32_t nvalues = is_per_cpu ? seen_cpus_ : 1;
+  if (stype.IsIntTy())
+  {
+    auto sign = stype.IsSigned();
+    switch (stype.GetIntBitWidth())
+    {
+      // clang-format off
+      case 64:
+        if (sign)
+          return reduce_value<int64_t>(value, nvalues) / (int64_t)div;
+        return reduce_value<uint64_t>(value, nvalues) / div;
+      case 32:
+        if (sign)
+          return int64_t(reduce_value<int32_t>(value, nvalues) / (int32_t)div);
+        return reduce_value<uint32_t>(value, nvalues) / div;
+      case 16:
+        if (sign)
+          return int64_t(reduce_value<int16_t>(value, nvalues) / (int16_t)div);
+        return reduce_value<uint16_t>(value, nvalues) / div;
+      case 8:
+        if (sign)
+          return int64_t(reduce_value<int8_t>(value, nvalues) / (int8_t)div);
+        return reduce_value<uint8_t>(value, nvalues) / div;
+        // clang-format on
+      default:
+        LOG(FATAL) << "map_value_to_int: Invalid int bitwidth: "
+                   << stype.GetIntBitWidth() << "provided";
+        return 0;
+    }
+  }
+  else if (stype.IsSumTy() && stype.IsSigned())
+    return reduce_value<int64_t>(value, nvalues) / div;
+  else if (stype.IsSumTy() || stype.IsCountTy())
+    return reduce_value<uint64_t>(value, nvalues) / div;
+  else if (stype.IsMinTy())
+    return min_value(value, nvalues) / div;
+  else if (stype.IsMaxTy())
+    return max_value(value, nvalues) / div;
+  else if (stype.IsDistinctTy())
+    return distinct_value(value, nvalues) / div;
+  return read_data<int64_t>(value.data()) / div;
+}
+
+// Read all the [key, value] pairs of a map. With BPF_MAP_LOOKUP_BATCH, this
+// takes a few syscalls per thousands of entries instead of two per entry.
+int BPFtrace::dump_map(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  if (!prefetched_maps_.empty())
+  {
+    auto found = prefetched_maps_.find(std::make_pair(&map, key_size));
+    if (found != prefetched_maps_.end())
+    {
+      auto &prefetched = found->second;
+      int err = prefetched.err;
+      entries.insert(entries.end(),
+                     std::make_move_iterator(prefetched.entries.begin()),
+                     std::make_move_iterator(prefetched.entries.end()));
+      prefetched_maps_.erase(found);
+      return err;
+    }
+  }
+
+  if (auto snapshot = dynamic_cast<SnapshotMap *>(&map))
+  {
+    entries.insert(entries.end(),
+                   snapshot->entries_.begin(),
+                   snapshot->entries_.end());
+    return 0;
+  }
+
+  if (map.is_mmapped())
+  {
+    dump_map_mmapped(map, key_size, entries);
+    return 0;
+  }
+
+  if (map.bucket_array_)
+    return dump_map_buckets(map, key_size, entries);
+
+  return dump_map_stored(map, key_size, entries);
+}
+
+// Read the entries of a map as they are stored in the BPF map, by the kind of
+// its keys
+int BPFtrace::dump_map_stored(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  if (map.key_.is_packed())
+    return dump_map_packed(map, key_size, entries);
+
+  if (map.is_windowed())
+    return dump_map_window(map, key_size, entries);
+
+  // Only the programs can find the entries, by their task, and the keys
+  // added to a bloom map aren't kept
+  if (map.task_storage_ || map.bloom_)
+    return 0;
+
+  if (map.dense_)
+    return dump_map_dense(map, entries);
+
+  if (map.hashed_key_)
+    return dump_map_hashed(map, key_size, entries);
+
+  return dump_map_keys(map, key_size, entries);
+}
+
+// Read the entries of a map holding a bucket array per key, see
+// IMap::bucket_array_. Each array is split into an entry per bucket, keyed
+// by the key followed by the bucket number, with the empty buckets left out
+// as they would be missing from a map storing them that way.
+int BPFtrace::dump_map_buckets(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> arrays;
+  int err = dump_map_stored(map, key_size - sizeof(uint64_t), arrays);
+  if (err)
+    return err;
+
+  size_t value_size = map.bpf_value_size();
+  for (auto &[akey, value] : arrays)
+  {
+    size_t nvalues = value.size() / value_size;
+    for (uint64_t bucket = 0; bucket < map.bucket_array_; bucket++)
+    {
+      std::vector<uint8_t> counts(nvalues * sizeof(uint64_t));
+      bool empty = true;
+      for (size_t cpu = 0; cpu < nvalues; cpu++)
+      {
+        const uint8_t *count = value.data() + cpu * value_size +
+                               bucket * sizeof(uint64_t);
+        std::memcpy(counts.data() + cpu * sizeof(uint64_t),
+                    count,
+                    sizeof(uint64_t));
+        empty &= read_data<uint64_t>(count) == 0;
+      }
+      if (empty)
+        continue;
+
+      std::vector<uint8_t> key(akey);
+      key.resize(key_size);
+      std::memcpy(key.data() + key_size - sizeof(bucket),
+                  &bucket,
+                  sizeof(bucket));
+      entries.push_back({ std::move(key), std::move(counts) });
+    }
+  }
+  return 0;
+}
+
+// Read the entries of a window map, the values of a key in each slot added
+// up. They're all 64-bit counters, sums and bucket counts.
+int BPFtrace::dump_map_window(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  std::map<std::vector<uint8_t>, size_t> index;
+  int mapfd = map.mapfd_;
+  for (int slot_fd : map.window_mapfds_)
+  {
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> slot;
+    // The slot is read as the map itself
+    map.mapfd_ = slot_fd;
+    int err = dump_map_keys(map, key_size, slot);
+    map.mapfd_ = mapfd;
+    if (err)
+      return err;
+
+    for (auto &[key, value] : slot)
+    {
+      auto found = index.emplace(key, entries.size());
+      if (found.second)
+      {
+        entries.emplace_back(std::move(key), std::move(value));
+        continue;
+      }
+      auto &sum = entries[found.first->second].second;
+      for (size_t i = 0; i + sizeof(uint64_t) <= value.size();
+           i += sizeof(uint64_t))
+      {
+        uint64_t a, b;
+        std::memcpy(&a, sum.data() + i, sizeof(a));
+        std::memcpy(&b, value.data() + i, sizeof(b));
+        a += b;
+        std::memcpy(sum.data() + i, &a, sizeof(a));
+      }
+    }
+  }
+  return 0;
+}
+
+// Read the entries of a hash map by walking its keys
+int BPFtrace::dump_map_keys(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries,
+    const std::function<void()> &flush)
 {
-  if (map.type_.IsHistTy() || map.type_.IsLhistTy())
-    return print_map_hist(map, top, div);
-  else if (map.type_.IsAvgTy() || map.type_.IsStatsTy())
-    return print_map_stats(map, top, div);
+  if (feature_->has_map_batch())
+  {
+    int err = dump_map_batch(map, key_size, entries, false, flush);
+    if (err <= 0)
+      return err;
+  }
 
   uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
   std::vector<uint8_t> old_key;
   try
   {
-    old_key = find_empty_key(map, map.key_.size());
+    old_key = find_empty_key(map, key_size);
   }
   catch (std::runtime_error &e)
   {
@@ -1503,14 +4662,12 @@ int BPFtrace::print_map(IMap &map, uint32_t top, uint32_t div)
   }
   auto key(old_key);
 
-  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> values_by_key;
-
-  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  while (bpf_get_next_key(map.read_mapfd(), old_key.data(), key.data()) == 0)
   {
-    int value_size = map.type_.GetSize();
+    int value_size = map.bpf_value_size();
     value_size *= nvalues;
     auto value = std::vector<uint8_t>(value_size);
-    int err = bpf_lookup_elem(map.mapfd_, key.data(), value.data());
+    int err = bpf_lookup_elem(map.read_mapfd(), key.data(), value.data());
     if (err == -1)
     {
       // key was removed by the eBPF program during bpf_get_next_key() and bpf_lookup_elem(),
@@ -1523,33 +4680,352 @@ int BPFtrace::print_map(IMap &map, uint32_t top, uint32_t div)
       return -1;
     }
 
-    values_by_key.push_back({key, value});
+    entries.push_back({ key, value });
+    if (flush && entries.size() >= 1024)
+      flush();
 
     old_key = key;
   }
 
-  if (map.type_.IsCountTy() || map.type_.IsSumTy() || map.type_.IsIntTy())
+  return 0;
+}
+
+int BPFtrace::dump_map_streamed(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries,
+    const std::function<void()> &flush)
+{
+  bool by_keys = !prefetched_maps_.count(std::make_pair(&map, key_size)) &&
+                 !dynamic_cast<SnapshotMap *>(&map) && !map.is_mmapped() &&
+                 !map.bucket_array_ && !map.key_.is_packed() &&
+                 !map.is_windowed() && !map.task_storage_ && !map.bloom_ &&
+                 !map.dense_ && !map.hashed_key_;
+  int err = by_keys ? dump_map_keys(map, key_size, entries, flush)
+                    : dump_map(map, key_size, entries);
+  if (!entries.empty())
+    flush();
+  return err;
+}
+
+// Read the entries of a map keyed by the hash of a string, see
+// IMap::hashed_key_. The hashes are replaced with their strings, looked up in
+// the strings map, so that the keys are the ones of an unhashed map. A string
+// missing from it, e.g. as it was full, is shown as its hash.
+int BPFtrace::dump_map_hashed(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  size_t str_size = map.key_.args_.at(0).GetSize();
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> hashed;
+  int err = dump_map_keys(
+      map, key_size - map.key_.size() + sizeof(uint64_t), hashed);
+  if (err)
+    return err;
+
+  for (auto &[hkey, value] : hashed)
   {
-    bool is_signed = map.type_.IsSigned();
-    std::sort(values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b)
+    uint64_t hash = read_data<uint64_t>(hkey.data());
+    std::vector<uint8_t> key(str_size);
+    if (bpf_lookup_elem(map.strings_mapfd_, &hash, key.data()) != 0)
     {
-      if (is_signed)
-        return reduce_value<int64_t>(a.second, nvalues) < reduce_value<int64_t>(b.second, nvalues);
-      return reduce_value<uint64_t>(a.second, nvalues) < reduce_value<uint64_t>(b.second, nvalues);
-    });
+      std::ostringstream hex;
+      hex << "0x" << std::hex << std::setfill('0') << std::setw(16) << hash;
+      std::string shown = hex.str().substr(0, str_size - 1);
+      std::memcpy(key.data(), shown.data(), shown.size());
+    }
+    key.insert(key.end(), hkey.begin() + sizeof(uint64_t), hkey.end());
+    entries.push_back({ std::move(key), std::move(value) });
   }
-  else if (map.type_.IsMinTy())
+  return 0;
+}
+
+// Read the entries of a map whose keys are packed, see MapKey::packed_. The
+// arguments are unpacked so that the keys are the ones printing expects,
+// what follows them (the bucket number of hist() keys) is kept as it is.
+int BPFtrace::dump_map_packed(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  size_t args_size = map.key_.size();
+  size_t packed_size = map.key_.packed_size();
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> packed;
+  size_t packed_key_size = key_size - args_size + packed_size;
+  int err = map.is_windowed() ? dump_map_window(map, packed_key_size, packed)
+                              : dump_map_keys(map, packed_key_size, packed);
+  if (err)
+    return err;
+
+  for (auto &[pkey, value] : packed)
+  {
+    std::vector<uint8_t> key(args_size);
+    map.key_.unpack(pkey.data(), key.data());
+    key.insert(key.end(), pkey.begin() + packed_size, pkey.end());
+    entries.push_back({ std::move(key), std::move(value) });
+  }
+  return 0;
+}
+
+// Read the entries of a mmapped map straight from its memory. The array index
+// is stored where the bucket number of hist() and lhist() keys goes, their
+// empty buckets and unset integers are skipped as they would be missing from
+// a hash map.
+void BPFtrace::dump_map_mmapped(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  auto values = static_cast<const uint64_t *>(map.mmapped_);
+  size_t stride = map.mmapped_value_size() / sizeof(uint64_t);
+  bool skip_empty = map.type_.IsHistTy() || map.type_.IsLhistTy();
+  for (uint32_t i = 0; i < map.max_entries_; i++)
+  {
+    uint64_t value = __atomic_load_n(&values[i * stride], __ATOMIC_RELAXED);
+    if (skip_empty && value == 0)
+      continue;
+    if (map.type_.IsIntTy() &&
+        !__atomic_load_n(&values[i * stride + 1], __ATOMIC_RELAXED))
+      continue;
+
+    std::vector<uint8_t> key(std::max<size_t>(key_size, sizeof(uint64_t)));
+    uint64_t idx = i;
+    std::memcpy(key.data() + map.key_.size(), &idx, sizeof(idx));
+    std::vector<uint8_t> data(sizeof(value));
+    std::memcpy(data.data(), &value, sizeof(value));
+    entries.push_back({ std::move(key), std::move(data) });
+  }
+}
+
+// Read the entries of a dense map, in one batch when the kernel supports it.
+// The array index is widened to the integer key, the entries still holding 0
+// on every CPU are skipped as they would be missing from a hash map.
+int BPFtrace::dump_map_dense(
+    IMap &map,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries)
+{
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> indexed;
+  int err = 1;
+  if (feature_->has_map_batch())
+    err = dump_map_batch(map, sizeof(uint32_t), indexed, false);
+  if (err < 0)
+    return err;
+
+  if (err > 0)
+  {
+    uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
+    size_t value_size = map.type_.GetSize() * nvalues;
+    for (uint32_t i = 0; i < map.max_entries_; i++)
+    {
+      std::vector<uint8_t> key(sizeof(i));
+      std::memcpy(key.data(), &i, sizeof(i));
+      std::vector<uint8_t> value(value_size);
+      if (bpf_lookup_elem(map.read_mapfd(), key.data(), value.data()))
+      {
+        LOG(ERROR) << "failed to look up elem: " << strerror(errno);
+        return -1;
+      }
+      indexed.push_back({ std::move(key), std::move(value) });
+    }
+  }
+
+  for (auto &[index, value] : indexed)
+  {
+    if (std::all_of(value.begin(), value.end(), [](uint8_t b) {
+          return b == 0;
+        }))
+      continue;
+
+    uint32_t i;
+    std::memcpy(&i, index.data(), sizeof(i));
+    uint64_t idx = i;
+    std::vector<uint8_t> key(map.key_.size());
+    std::memcpy(key.data(), &idx, std::min(key.size(), sizeof(idx)));
+    entries.push_back({ std::move(key), std::move(value) });
+  }
+  return 0;
+}
+
+// Returns 1 when the map doesn't support batch operations, for the caller to
+// fall back to walking the keys one by one
+int BPFtrace::dump_map_batch(
+    IMap &map,
+    size_t key_size,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &entries,
+    bool delete_entries,
+    const std::function<void()> &flush)
+{
+#ifndef HAVE_LIBBPF_MAP_BATCH
+  (void)map;
+  (void)key_size;
+  (void)entries;
+  (void)delete_entries;
+  (void)flush;
+  return 1;
+#else
+  uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
+  size_t value_size = map.bpf_value_size() * nvalues;
+  // The batch position is a bucket index for hash maps, but a key for others
+  std::vector<uint8_t> in_batch(std::max<size_t>(key_size, sizeof(uint64_t)));
+  std::vector<uint8_t> out_batch(in_batch.size());
+  std::vector<uint8_t> keys;
+  std::vector<uint8_t> values;
+  uint32_t batch_size = 1024;
+  if (map.max_entries_ > 0)
+    batch_size = std::min(batch_size, map.max_entries_);
+  bool first = true;
+
+  while (true)
   {
-    std::sort(values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b)
+    keys.resize(batch_size * key_size);
+    values.resize(batch_size * value_size);
+    uint32_t count = batch_size;
+    void *in = first ? nullptr : in_batch.data();
+    int err = delete_entries
+                  ? bpf_map_lookup_and_delete_batch(map.read_mapfd(),
+                                                    in,
+                                                    out_batch.data(),
+                                                    keys.data(),
+                                                    values.data(),
+                                                    &count,
+                                                    nullptr)
+                  : bpf_map_lookup_batch(map.read_mapfd(),
+                                         in,
+                                         out_batch.data(),
+                                         keys.data(),
+                                         values.data(),
+                                         &count,
+                                         nullptr);
+    int saved_errno = errno;
+    if (err && saved_errno == ENOSPC && count == 0)
+    {
+      // A single hash bucket holds more entries than the batch
+      batch_size *= 2;
+      continue;
+    }
+    if (err && saved_errno != ENOENT)
+    {
+      if (first)
+        return 1;
+      LOG(ERROR) << "failed to look up elems of map '" << map.name_
+                 << "': " << strerror(saved_errno);
+      return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
     {
-      return min_value(a.second, nvalues) < min_value(b.second, nvalues);
+      entries.emplace_back(
+          std::vector<uint8_t>(keys.begin() + i * key_size,
+                               keys.begin() + (i + 1) * key_size),
+          std::vector<uint8_t>(values.begin() + i * value_size,
+                               values.begin() + (i + 1) * value_size));
+    }
+    if (flush)
+      flush();
+
+    // ENOENT: no entries left
+    if (err)
+      return 0;
+
+    std::swap(in_batch, out_batch);
+    first = false;
+  }
+#endif
+}
+
+// Sort entries in ascending order of cmp. When only the top entries are going
+// to be printed, select them first so that just those need sorting.
+template <typename T, typename Compare>
+static void sort_top(std::vector<T> &entries, uint32_t top, Compare cmp)
+{
+  if (top && entries.size() > top)
+  {
+    auto first = entries.end() - top;
+    std::nth_element(entries.begin(), first, entries.end(), cmp);
+    entries.erase(entries.begin(), first);
+  }
+  std::sort(entries.begin(), entries.end(), cmp);
+}
+
+// Sort map entries by their value reduced across the CPUs, see sort_top().
+// Every value is reduced once up front rather than on each comparison, which
+// on machines with many CPUs dominates the cost of printing the map.
+template <typename T, typename Reduce>
+static void sort_top_by_value(
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+        &values_by_key,
+    uint32_t top,
+    Reduce reduce)
+{
+  std::vector<std::pair<T, size_t>> reduced;
+  reduced.reserve(values_by_key.size());
+  for (size_t i = 0; i < values_by_key.size(); i++)
+    reduced.push_back({ reduce(values_by_key[i].second), i });
+
+  sort_top(reduced, top, [](auto &a, auto &b) { return a.first < b.first; });
+
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> sorted;
+  sorted.reserve(reduced.size());
+  for (auto &r : reduced)
+    sorted.push_back(std::move(values_by_key[r.second]));
+  values_by_key = std::move(sorted);
+}
+
+int BPFtrace::print_map(IMap &map, uint32_t top, uint32_t div)
+{
+  HandlingTimer timer(self_stats_interval_ ? &self_stats_.maps[map.name_]
+                                           : nullptr);
+  stacks_.clear();
+  if (map.type_.IsHistTy() || map.type_.IsLhistTy() || map.type_.IsLlhistTy())
+    return print_map_hist(map, top, div);
+  else if (map.type_.IsAvgTy() || map.type_.IsStatsTy())
+    return print_map_stats(map, top, div);
+  else if (map.type_.IsCmsTy())
+    return print_map_cms(map, top, div);
+
+  if (stream_maps_ && !top && out_->map_begin(map))
+    return print_map_streamed(map, div == 0 ? 1 : div);
+
+  bool by_value = map.type_.IsCountTy() || map.type_.IsSumTy() ||
+                  map.type_.IsIntTy() || map.type_.IsMinTy() ||
+                  map.type_.IsMaxTy() || map.type_.IsDistinctTy();
+  if (top && by_value)
+    return print_map_top(map, top, div == 0 ? 1 : div);
+
+  uint32_t nvalues = map.is_per_cpu_type() ? seen_cpus_ : 1;
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> values_by_key;
+  int err = dump_map(map, map.key_.size(), values_by_key);
+  if (err)
+    return err;
+
+  if (map.type_.IsCountTy() || map.type_.IsSumTy() || map.type_.IsIntTy())
+  {
+    if (map.type_.IsSigned())
+      sort_top_by_value<int64_t>(values_by_key, top, [&](auto &value) {
+        return reduce_value<int64_t>(value, nvalues);
+      });
+    else
+      sort_top_by_value<uint64_t>(values_by_key, top, [&](auto &value) {
+        return reduce_value<uint64_t>(value, nvalues);
+      });
+  }
+  else if (map.type_.IsMinTy())
+  {
+    sort_top_by_value<int64_t>(values_by_key, top, [&](auto &value) {
+      return min_value(value, nvalues);
     });
   }
   else if (map.type_.IsMaxTy())
   {
-    std::sort(values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b)
-    {
-      return max_value(a.second, nvalues) < max_value(b.second, nvalues);
+    sort_top_by_value<uint64_t>(values_by_key, top, [&](auto &value) {
+      return max_value(value, nvalues);
+    });
+  }
+  else if (map.type_.IsDistinctTy())
+  {
+    sort_top_by_value<uint64_t>(values_by_key, top, [&](auto &value) {
+      return distinct_value(value, nvalues);
     });
   }
   else
@@ -1563,140 +5039,383 @@ int BPFtrace::print_map(IMap &map, uint32_t top, uint32_t div)
   return 0;
 }
 
-int BPFtrace::print_map_hist(IMap &map, uint32_t top, uint32_t div)
+// Print the top entries of a map by value, see print_map(). Only those are
+// kept, on a heap, as the map is read a batch at a time, along with one
+// more when there are more entries, for out_->map() to skip like it skips
+// the rest of them.
+int BPFtrace::print_map_top(IMap &map, uint32_t top, uint32_t div)
 {
-  // A hist-map adds an extra 8 bytes onto the end of its key for storing
-  // the bucket number.
-  // e.g. A map defined as: @x[1, 2] = @hist(3);
-  // would actually be stored with the key: [1, 2, 3]
+  using Entry = std::pair<std::vector<uint8_t>, std::vector<uint8_t>>;
+  uint32_t nvalues = map.is_per_cpu_type() ? seen_cpus_ : 1;
+  std::vector<Entry> values_by_key;
+  int err = 0;
+
+  auto select = [&](auto reduce) {
+    using T = decltype(reduce(std::declval<const std::vector<uint8_t> &>()));
+    // The smallest value on top
+    std::vector<std::pair<T, Entry>> heap;
+    auto greater = [](auto &a, auto &b) { return a.first > b.first; };
+    std::vector<Entry> batch;
+    err = dump_map_streamed(map, map.key_.size(), batch, [&]() {
+      for (auto &entry : batch)
+      {
+        T value = reduce(entry.second);
+        if (heap.size() > top)
+        {
+          if (value <= heap.front().first)
+            continue;
+          std::pop_heap(heap.begin(), heap.end(), greater);
+          heap.pop_back();
+        }
+        heap.emplace_back(value, std::move(entry));
+        std::push_heap(heap.begin(), heap.end(), greater);
+      }
+      batch.clear();
+    });
 
-  uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
-  std::vector<uint8_t> old_key;
-  try
-  {
-    old_key = find_empty_key(map, map.key_.size() + 8);
-  }
-  catch (std::runtime_error &e)
-  {
-    LOG(ERROR) << "failed to get key for map '" << map.name_
-               << "': " << e.what();
-    return -2;
-  }
-  auto key(old_key);
+    std::sort(heap.begin(), heap.end(), [](auto &a, auto &b) {
+      return a.first < b.first;
+    });
+    values_by_key.reserve(heap.size());
+    for (auto &h : heap)
+      values_by_key.push_back(std::move(h.second));
+  };
 
-  std::map<std::vector<uint8_t>, std::vector<uint64_t>> values_by_key;
+  if (map.type_.IsMinTy())
+    select([&](auto &value) { return min_value(value, nvalues); });
+  else if (map.type_.IsMaxTy())
+    select([&](auto &value) { return max_value(value, nvalues); });
+  else if (map.type_.IsDistinctTy())
+    select([&](auto &value) { return distinct_value(value, nvalues); });
+  else if (map.type_.IsSigned())
+    select([&](auto &value) { return reduce_value<int64_t>(value, nvalues); });
+  else
+    select(
+        [&](auto &value) { return reduce_value<uint64_t>(value, nvalues); });
+  if (err)
+    return err;
 
-  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
-  {
-    auto key_prefix = std::vector<uint8_t>(map.key_.size());
-    uint64_t bucket = read_data<uint64_t>(key.data() + map.key_.size());
+  out_->map(*this, map, top, div, values_by_key);
+  return 0;
+}
 
-    for (size_t i=0; i<map.key_.size(); i++)
-      key_prefix.at(i) = key.at(i);
+// Print the entries of a map as they are read, a batch at a time and
+// unsorted, see BPFTRACE_STREAM_MAPS
+int BPFtrace::print_map_streamed(IMap &map, uint32_t div)
+{
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  int err = dump_map_streamed(map, map.key_.size(), entries, [&]() {
+    out_->map_entries(*this, map, div, entries);
+    entries.clear();
+  });
+  out_->map_end(map);
+  return err;
+}
 
-    int value_size = map.type_.GetSize() * nvalues;
-    auto value = std::vector<uint8_t>(value_size);
-    int err = bpf_lookup_elem(map.mapfd_, key.data(), value.data());
-    if (err == -1)
+// Print what changed in a count(), sum() or integer map since its previous
+// print_delta(): the keys whose value changed, with the difference. A value
+// of an unsigned map going down was reset, e.g. by clear(), its delta is the
+// value itself.
+int BPFtrace::print_map_delta(IMap &map, uint32_t top, uint32_t div)
+{
+  uint32_t nvalues = map.is_per_cpu_type() ? seen_cpus_ : 1;
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  int err = dump_map(map, map.key_.size(), entries);
+  if (err)
+    return err;
+
+  // Keys that went away are dropped from the snapshot along with the others
+  auto &prev = delta_snapshots_[map.id];
+  DeltaSnapshot next;
+  next.reserve(entries.size());
+  bool is_signed = map.type_.IsSigned();
+  size_t changed = 0;
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    auto &entry = entries[i];
+    auto &value = entry.second;
+    uint64_t total = is_signed ? reduce_value<int64_t>(value, nvalues)
+                               : reduce_value<uint64_t>(value, nvalues);
+    auto it = prev.find(entry.first);
+    uint64_t last = it == prev.end() ? 0 : it->second;
+    if (total == last)
     {
-      // key was removed by the eBPF program during bpf_get_next_key() and bpf_lookup_elem(),
-      // let's skip this key
+      next.emplace(std::move(entry.first), total);
       continue;
     }
-    else if (err)
+
+    // The delta goes in the first CPU's slot, which the printing sums up
+    uint64_t delta = !is_signed && total < last ? total : total - last;
+    std::fill(value.begin(), value.end(), 0);
+    std::memcpy(value.data(), &delta, sizeof(delta));
+    next.emplace(entry.first, total);
+    if (changed != i)
+      entries[changed] = std::move(entry);
+    changed++;
+  }
+  entries.resize(changed);
+  prev = std::move(next);
+
+  if (is_signed)
+    sort_top_by_value<int64_t>(entries, top, [&](auto &value) {
+      return read_data<int64_t>(value.data());
+    });
+  else
+    sort_top_by_value<uint64_t>(entries, top, [&](auto &value) {
+      return read_data<uint64_t>(value.data());
+    });
+
+  if (div == 0)
+    div = 1;
+  out_->map(*this, map, top, div, entries);
+  return 0;
+}
+
+int BPFtrace::print_map_cms(IMap &map, uint32_t top, uint32_t div)
+{
+  // Only the tracked keys are in the map, their counts are in the sketch
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  int err = dump_map(map, map.key_.size(), entries);
+  if (err)
+    return err;
+
+  // Sum the counters of all the CPUs, row by row
+  std::vector<uint64_t> rows(CMS_DEPTH * CMS_WIDTH, 0);
+  std::vector<uint64_t> counters(ncpus_ * CMS_WIDTH);
+  for (uint32_t row = 0; row < CMS_DEPTH; row++)
+  {
+    err = bpf_lookup_elem(map.sketch_mapfd_, &row, counters.data());
+    if (err)
     {
       LOG(ERROR) << "failed to look up elem: " << err;
       return -1;
     }
-
-    if (values_by_key.find(key_prefix) == values_by_key.end())
+    uint64_t *sum = rows.data() + row * CMS_WIDTH;
+    for (int cpu = 0; cpu < seen_cpus_; cpu++)
     {
-      // New key - create a list of buckets for it
-      if (map.type_.IsHistTy())
-        values_by_key[key_prefix] = std::vector<uint64_t>(65);
-      else
-        values_by_key[key_prefix] = std::vector<uint64_t>(1002);
+      const uint64_t *counter = counters.data() + cpu * CMS_WIDTH;
+      for (int col = 0; col < CMS_WIDTH; col++)
+        sum[col] += counter[col];
     }
-    values_by_key[key_prefix].at(bucket) = reduce_value<uint64_t>(value, nvalues);
+  }
 
-    old_key = key;
+  bool is_string = map.key_.args_.at(0).IsStringTy();
+  std::vector<std::pair<std::vector<uint8_t>, uint64_t>> counts_by_key;
+  counts_by_key.reserve(entries.size());
+  for (auto &entry : entries)
+  {
+    auto &key = entry.first;
+    uint64_t hash = cms_hash(key.data(), key.size(), is_string);
+    uint64_t count = UINT64_MAX;
+    for (int row = 0; row < CMS_DEPTH; row++)
+      count = std::min(count, rows[row * CMS_WIDTH + cms_column(hash, row)]);
+    counts_by_key.emplace_back(std::move(key), count);
   }
 
-  // Sort based on sum of counts in all buckets
-  std::vector<std::pair<std::vector<uint8_t>, uint64_t>> total_counts_by_key;
-  for (auto &map_elem : values_by_key)
+  sort_top(counts_by_key, top, [](auto &a, auto &b) {
+    if (a.second != b.second)
+      return a.second < b.second;
+    return a.first < b.first;
+  });
+
+  if (div == 0)
+    div = 1;
+  out_->map_cms(*this, map, div, counts_by_key);
+  return 0;
+}
+
+// Reset the counters of a cms_count() map, on every CPU
+int BPFtrace::zero_cms_sketch(IMap &map)
+{
+  std::vector<uint64_t> zero(ncpus_ * CMS_WIDTH, 0);
+  for (uint32_t row = 0; row < CMS_DEPTH; row++)
   {
-    int64_t sum = 0;
-    for (size_t i=0; i<map_elem.second.size(); i++)
+    int err = bpf_update_elem(map.sketch_mapfd_, &row, zero.data(), BPF_ANY);
+    if (err)
     {
-      sum += map_elem.second.at(i);
+      LOG(ERROR) << "failed to update elem: " << err;
+      return -1;
     }
-    total_counts_by_key.push_back({map_elem.first, sum});
   }
-  std::sort(total_counts_by_key.begin(), total_counts_by_key.end(), [&](auto &a, auto &b)
+  return 0;
+}
+
+int BPFtrace::read_map_hist(IMap &map, uint32_t top)
+{
+  // A hist-map adds an extra 8 bytes onto the end of its key for storing
+  // the bucket number.
+  // e.g. A map defined as: @x[1, 2] = @hist(3);
+  // would actually be stored with the key: [1, 2, 3]
+
+  uint32_t nvalues = map.is_per_cpu_type() ? seen_cpus_ : 1;
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  int err = dump_map(map, map.key_.size() + 8, entries);
+  if (err)
+    return err;
+
+  if (map.type_.IsHistTy())
+    hist_buckets_.reset(65);
+  else if (map.type_.IsLlhistTy())
+    hist_buckets_.reset(llhist_buckets(map.lqstep));
+  else
+    hist_buckets_.reset(1002);
+  for (auto &entry : entries)
   {
-    return a.second < b.second;
+    auto &key = entry.first;
+    uint64_t bucket = read_data<uint64_t>(key.data() + map.key_.size());
+    hist_buckets_.buckets(key.data(), map.key_.size()).at(bucket) =
+        reduce_value<uint64_t>(entry.second, nvalues);
+  }
+
+  // Sort based on sum of counts in all buckets
+  hist_buckets_.compute_totals();
+  hist_sorted_.resize(hist_buckets_.size());
+  for (size_t i = 0; i < hist_sorted_.size(); i++)
+    hist_sorted_[i] = i;
+  sort_top(hist_sorted_, top, [&](size_t a, size_t b) {
+    // Keys with the same total are printed in key order
+    auto &ea = hist_buckets_[a];
+    auto &eb = hist_buckets_[b];
+    if (ea.total != eb.total)
+      return ea.total < eb.total;
+    return ea.key < eb.key;
   });
+  return 0;
+}
+
+int BPFtrace::print_map_hist(IMap &map, uint32_t top, uint32_t div)
+{
+  int err = read_map_hist(map, top);
+  if (err)
+    return err;
 
   if (div == 0)
     div = 1;
-  out_->map_hist(*this, map, top, div, values_by_key, total_counts_by_key);
+  out_->map_hist(*this, map, top, div, hist_buckets_, hist_sorted_);
   return 0;
 }
 
-int BPFtrace::print_map_stats(IMap &map, uint32_t top, uint32_t div)
+// Values covered by bucket index of a hist(), lhist() or llhist() map, as
+// [low, high). The out of range buckets are reported as just below or at
+// their bound.
+static void hist_bucket_range(IMap &map,
+                              size_t index,
+                              double &low,
+                              double &high)
 {
-  uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
-  // stats() and avg() maps add an extra 8 bytes onto the end of their key for
-  // storing the bucket number.
-
-  std::vector<uint8_t> old_key;
-  try
+  if (map.type_.IsHistTy())
   {
-    old_key = find_empty_key(map, map.key_.size() + 8);
+    if (index == 0)
+      low = -1;
+    else if (index == 1)
+      low = 0;
+    else
+      low = std::ldexp(1, index - 2);
+    high = index < 2 ? low + 1 : low * 2;
   }
-  catch (std::runtime_error &e)
+  else if (map.type_.IsLlhistTy())
   {
-    LOG(ERROR) << "failed to get key for map '" << map.name_
-               << "': " << e.what();
-    return -2;
+    if (index == 0)
+    {
+      low = -1;
+      high = 0;
+      return;
+    }
+    uint64_t min, max;
+    llhist_bucket_range(index, map.lqstep, min, max);
+    low = min;
+    high = max + 1.0;
   }
-  auto key(old_key);
-
-  std::map<std::vector<uint8_t>, std::vector<int64_t>> values_by_key;
-
-  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  else
   {
-    auto key_prefix = std::vector<uint8_t>(map.key_.size());
-    uint64_t bucket = read_data<uint64_t>(key.data() + map.key_.size());
+    size_t buckets = (map.lqmax - map.lqmin) / map.lqstep;
+    if (index == 0)
+      low = map.lqmin - 1;
+    else if (index == buckets + 1)
+      low = map.lqmax;
+    else
+      low = map.lqmin + (index - 1) * static_cast<double>(map.lqstep);
+    high = index == 0 || index == buckets + 1 ? low + 1 : low + map.lqstep;
+  }
+}
 
-    for (size_t i=0; i<map.key_.size(); i++)
-      key_prefix.at(i) = key.at(i);
+int BPFtrace::print_map_quantiles(IMap &map,
+                                  const std::vector<double> &quantiles)
+{
+  int err = read_map_hist(map, 0);
+  if (err)
+    return err;
 
-    int value_size = map.type_.GetSize() * nvalues;
-    auto value = std::vector<uint8_t>(value_size);
-    int err = bpf_lookup_elem(map.mapfd_, key.data(), value.data());
-    if (err == -1)
-    {
-      // key was removed by the eBPF program during bpf_get_next_key() and bpf_lookup_elem(),
-      // let's skip this key
-      continue;
-    }
-    else if (err)
+  // Each quantile is interpolated linearly within the bucket it falls in
+  std::vector<QuantileSummary> summaries;
+  summaries.reserve(hist_sorted_.size());
+  for (size_t idx : hist_sorted_)
+  {
+    auto &entry = hist_buckets_[idx];
+    QuantileSummary summary;
+    summary.key = entry.key;
+    summary.count = entry.total;
+    for (double q : quantiles)
     {
-      LOG(ERROR) << "failed to look up elem: " << err;
-      return -1;
+      double rank = q / 100 * entry.total;
+      double value = 0;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < entry.buckets.size(); i++)
+      {
+        uint64_t count = entry.buckets[i];
+        if (count == 0)
+          continue;
+
+        double low, high;
+        hist_bucket_range(map, i, low, high);
+        value = std::min(low + (rank - seen) / count * (high - low),
+                         high - 1);
+        seen += count;
+        if (seen >= rank)
+          break;
+      }
+      summary.values.push_back(std::floor(value));
     }
+    summaries.emplace_back(std::move(summary));
+  }
 
-    if (values_by_key.find(key_prefix) == values_by_key.end())
+  out_->map_quantiles(*this, map, quantiles, summaries);
+  return 0;
+}
+
+// Read the count and total of each key of a stats() or avg() map, which are
+// the two halves of its value
+int BPFtrace::read_map_stats(
+    IMap &map,
+    std::map<std::vector<uint8_t>, std::vector<int64_t>> &values_by_key)
+{
+  uint32_t nvalues = map.is_per_cpu_type() ? seen_cpus_ : 1;
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  int err = dump_map(map, map.key_.size(), entries);
+  if (err)
+    return err;
+
+  size_t value_size = map.type_.GetSize();
+  for (auto &[key, value] : entries)
+  {
+    std::vector<int64_t> stats(2);
+    for (uint32_t cpu = 0; cpu < nvalues; cpu++)
     {
-      // New key - create a list of buckets for it
-      values_by_key[key_prefix] = std::vector<int64_t>(2);
+      const uint8_t *p = value.data() + cpu * value_size;
+      stats[0] += read_data<int64_t>(p);
+      stats[1] += read_data<int64_t>(p + sizeof(int64_t));
     }
-    values_by_key[key_prefix].at(bucket) = reduce_value<int64_t>(value, nvalues);
-
-    old_key = key;
+    values_by_key[key] = std::move(stats);
   }
+  return 0;
+}
+
+int BPFtrace::print_map_stats(IMap &map, uint32_t top, uint32_t div)
+{
+  std::map<std::vector<uint8_t>, std::vector<int64_t>> values_by_key;
+  int err = read_map_stats(map, values_by_key);
+  if (err)
+    return err;
 
   // Sort based on sum of counts in all buckets
   std::vector<std::pair<std::vector<uint8_t>, int64_t>> total_counts_by_key;
@@ -1712,8 +5431,8 @@ int BPFtrace::print_map_stats(IMap &map, uint32_t top, uint32_t div)
 
     total_counts_by_key.push_back({map_elem.first, value});
   }
-  std::sort(total_counts_by_key.begin(), total_counts_by_key.end(), [&](auto &a, auto &b)
-  {
+  // top only applies to avg() maps
+  sort_top(total_counts_by_key, map.type_.IsAvgTy() ? top : 0, [&](auto &a, auto &b) {
     return a.second < b.second;
   });
 
@@ -1723,29 +5442,220 @@ int BPFtrace::print_map_stats(IMap &map, uint32_t top, uint32_t div)
   return 0;
 }
 
+// OpenMetrics type of the metric of a map, nullptr for the maps that can't be
+// one (e.g. of strings or stacks)
+static const char *metric_type(const SizedType &type)
+{
+  if (type.IsCountTy() || type.IsSumTy())
+    return "counter";
+  if (type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy())
+    return "histogram";
+  if (type.IsAvgTy() || type.IsStatsTy())
+    return "summary";
+  if (type.IsIntTy() || type.IsMinTy() || type.IsMaxTy() || type.IsDistinctTy())
+    return "gauge";
+  return nullptr;
+}
+
+int BPFtrace::setup_metrics(int epollfd)
+{
+  for (auto &name : metrics_maps_)
+  {
+    auto map = maps.Lookup(name);
+    if (!map)
+    {
+      LOG(ERROR) << "--metrics-maps: " << name << " is not a map of the program";
+      return -1;
+    }
+    if (!metric_type((*map)->type_))
+    {
+      LOG(ERROR) << "--metrics-maps: " << name << " holds " << (*map)->type_
+                 << " values, which can't be exported";
+      return -1;
+    }
+  }
+
+  // The consumer threads have their own epoll instance, their batches are
+  // waited for instead, see poll_perf_consumers()
+  if (perf_consumers_)
+    return 0;
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = metrics_server_.get();
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, metrics_server_->fd(), &ev) == -1)
+  {
+    LOG(ERROR) << "Failed to add the metrics server to epoll";
+    return -1;
+  }
+  return 0;
+}
+
+void BPFtrace::serve_metrics()
+{
+  metrics_server_->serve([this]() {
+    MetricsText text;
+    for (auto &mapmap : maps)
+    {
+      IMap &map = *mapmap.get();
+      if (metrics_maps_.empty() ? !metric_type(map.type_)
+                                : std::find(metrics_maps_.begin(),
+                                            metrics_maps_.end(),
+                                            map.name_) == metrics_maps_.end())
+        continue;
+      if (write_metric(text, map))
+        LOG(WARNING) << "Failed to read " << map.name_ << " for a scrape";
+    }
+    return text.finish();
+  });
+}
+
+// Write the current contents of a map as a metric family, every key as a
+// sample labelled key (or key0, key1... for several key arguments)
+int BPFtrace::write_metric(MetricsText &text, IMap &map)
+{
+  auto labels = [&](const std::vector<uint8_t> &key) {
+    MetricsText::Labels labels;
+    auto values = map.key_.argument_value_list(*this, key);
+    for (size_t i = 0; i < values.size(); i++)
+      labels.emplace_back(values.size() == 1 ? "key"
+                                             : "key" + std::to_string(i),
+                          std::move(values[i]));
+    return labels;
+  };
+  stacks_.clear();
+  text.family(metric_name(map.name_), metric_type(map.type_));
+
+  if (map.type_.IsHistTy() || map.type_.IsLhistTy() || map.type_.IsLlhistTy())
+  {
+    int err = read_map_hist(map, 0);
+    if (err)
+      return err;
+
+    // Only the buckets holding values are written, the counts of the
+    // others are the ones of the buckets below them
+    size_t lhist_above = map.type_.IsLhistTy()
+                             ? (map.lqmax - map.lqmin) / map.lqstep + 1
+                             : SIZE_MAX;
+    for (size_t idx = 0; idx < hist_buckets_.size(); idx++)
+    {
+      auto &entry = hist_buckets_[idx];
+      auto key_labels = labels(entry.key);
+      uint64_t seen = 0;
+      for (size_t i = 0; i < entry.buckets.size(); i++)
+      {
+        if (entry.buckets[i] == 0)
+          continue;
+        seen += entry.buckets[i];
+        // The values above the range of an lhist() are only in "+Inf"
+        if (i == lhist_above)
+          continue;
+        double low, high;
+        hist_bucket_range(map, i, low, high);
+        text.bucket(key_labels, high - 1, seen);
+      }
+      text.bucket(key_labels, INFINITY, entry.total);
+      text.sample("_count", key_labels, entry.total);
+    }
+    return 0;
+  }
+
+  if (map.type_.IsAvgTy() || map.type_.IsStatsTy())
+  {
+    std::map<std::vector<uint8_t>, std::vector<int64_t>> values_by_key;
+    int err = read_map_stats(map, values_by_key);
+    if (err)
+      return err;
+
+    for (auto &entry : values_by_key)
+    {
+      auto key_labels = labels(entry.first);
+      text.sample("_count", key_labels, entry.second.at(0));
+      text.sample("_sum", key_labels, entry.second.at(1));
+    }
+    return 0;
+  }
+
+  uint32_t nvalues = map.is_per_cpu_type() ? seen_cpus_ : 1;
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  int err = dump_map(map, map.key_.size(), entries);
+  if (err)
+    return err;
+
+  const char *suffix = map.type_.IsCountTy() || map.type_.IsSumTy() ? "_total"
+                                                                    : "";
+  for (auto &entry : entries)
+  {
+    auto key_labels = labels(entry.first);
+    auto &value = entry.second;
+    if (map.type_.IsMinTy())
+      text.sample(suffix, key_labels, min_value(value, nvalues));
+    else if (map.type_.IsMaxTy())
+      text.sample(suffix, key_labels, max_value(value, nvalues));
+    else if (map.type_.IsDistinctTy())
+      text.sample(suffix, key_labels, distinct_value(value, nvalues));
+    else if (map.type_.IsSigned())
+      text.sample(suffix, key_labels, reduce_value<int64_t>(value, nvalues));
+    else
+      text.sample(suffix, key_labels, reduce_value<uint64_t>(value, nvalues));
+  }
+  return 0;
+}
+
 template <typename T>
 T BPFtrace::reduce_value(const std::vector<uint8_t> &value, int nvalues)
 {
+  // Kept free of branches so that the compiler can vectorize it
   T sum = 0;
+  const uint8_t *data = value.data();
   for (int i=0; i<nvalues; i++)
   {
-    sum += read_data<T>(value.data() + i * sizeof(T));
+    sum += read_data<T>(data + i * sizeof(T));
   }
   return sum;
 }
 
 uint64_t BPFtrace::max_value(const std::vector<uint8_t> &value, int nvalues)
 {
-  uint64_t val, max = 0;
+  uint64_t max = 0;
+  const uint8_t *data = value.data();
   for (int i=0; i<nvalues; i++)
   {
-    val = read_data<uint64_t>(value.data() + i * sizeof(uint64_t));
-    if (val > max)
-      max = val;
+    max = std::max(max, read_data<uint64_t>(data + i * sizeof(uint64_t)));
   }
   return max;
 }
 
+// HyperLogLog estimate of a distinct() value. Each CPU fills its own set of
+// registers, the union of the sets is their register-wise maximum.
+uint64_t BPFtrace::distinct_value(const std::vector<uint8_t> &value,
+                                  int nvalues)
+{
+  const int m = DISTINCT_REGISTERS;
+  uint8_t registers[DISTINCT_REGISTERS] = {};
+  for (int i = 0; i < nvalues; i++)
+  {
+    const uint8_t *data = value.data() + i * m;
+    for (int j = 0; j < m; j++)
+      registers[j] = std::max(registers[j], data[j]);
+  }
+
+  double sum = 0;
+  int zeros = 0;
+  for (int j = 0; j < m; j++)
+  {
+    sum += std::ldexp(1.0, -registers[j]);
+    zeros += registers[j] == 0;
+  }
+
+  double alpha = 0.7213 / (1 + 1.079 / m);
+  double estimate = alpha * m * m / sum;
+  // Small range correction, count the empty registers instead
+  if (estimate <= 2.5 * m && zeros)
+    estimate = m * std::log(static_cast<double>(m) / zeros);
+  return static_cast<uint64_t>(std::llround(estimate));
+}
+
 std::optional<std::string> BPFtrace::get_watchpoint_binary_path() const
 {
   if (child_)
@@ -1766,12 +5676,11 @@ std::optional<std::string> BPFtrace::get_watchpoint_binary_path() const
 
 int64_t BPFtrace::min_value(const std::vector<uint8_t> &value, int nvalues)
 {
-  int64_t val, max = 0, retval;
+  int64_t max = 0, retval;
+  const uint8_t *data = value.data();
   for (int i=0; i<nvalues; i++)
   {
-    val = read_data<int64_t>(value.data() + i * sizeof(int64_t));
-    if (val > max)
-      max = val;
+    max = std::max(max, read_data<int64_t>(data + i * sizeof(int64_t)));
   }
 
   /*
@@ -1797,18 +5706,18 @@ std::vector<uint8_t> BPFtrace::find_empty_key(IMap &map, size_t size) const
   if (size == 0) size = 8;
   auto key = std::vector<uint8_t>(size);
   uint32_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
-  int value_size = map.type_.GetSize() * nvalues;
+  int value_size = map.bpf_value_size() * nvalues;
   auto value = std::vector<uint8_t>(value_size);
 
-  if (bpf_lookup_elem(map.mapfd_, key.data(), value.data()))
+  if (bpf_lookup_elem(map.read_mapfd(), key.data(), value.data()))
     return key;
 
   for (auto &elem : key) elem = 0xff;
-  if (bpf_lookup_elem(map.mapfd_, key.data(), value.data()))
+  if (bpf_lookup_elem(map.read_mapfd(), key.data(), value.data()))
     return key;
 
   for (auto &elem : key) elem = 0x55;
-  if (bpf_lookup_elem(map.mapfd_, key.data(), value.data()))
+  if (bpf_lookup_elem(map.read_mapfd(), key.data(), value.data()))
     return key;
 
   throw std::runtime_error("Could not find empty key");
@@ -1816,78 +5725,303 @@ std::vector<uint8_t> BPFtrace::find_empty_key(IMap &map, size_t size) const
 
 std::string BPFtrace::get_stack(uint64_t stackidpid, bool ustack, StackType stack_type, int indent)
 {
-  int32_t stackid = stackidpid & 0xffffffff;
-  int pid = stackidpid >> 32;
-  auto stack_trace = std::vector<uint64_t>(stack_type.limit);
-  int err = bpf_lookup_elem(maps[stack_type].value()->mapfd_,
-                            &stackid,
-                            stack_trace.data());
-  if (err)
+  // Stack-keyed maps often hold the same stack many times over
+  auto cache_key = std::make_tuple(
+      stackidpid, ustack, stack_type.limit, stack_type.mode, indent);
+  auto cached = stacks_.find(cache_key);
+  if (cached != stacks_.end())
+    return cached->second;
+
+  std::string stack = "\n";
+  std::string padding(indent, ' ');
+  if (stack_type.mode == StackMode::build_id)
   {
-    // ignore EFAULT errors: eg, kstack used but no kernel stack
-    if (stackid != -EFAULT)
-      LOG(ERROR) << "failed to look up stack id " << stackid << " (pid " << pid
-                 << "): " << err;
-    return "";
+    std::vector<std::string> frames;
+    if (!read_build_id_stack(stackidpid, stack_type, frames))
+      return "";
+    for (auto &frame : frames)
+      append_frame(stack, 0, frame, stack_type.mode, padding);
+    stacks_.emplace(cache_key, stack);
+    return stack;
   }
 
-  std::ostringstream stack;
-  std::string padding(indent, ' ');
+  int pid = stackidpid >> 32;
+  std::vector<uint64_t> stack_trace;
+  if (!read_stack(stackidpid, stack_type, stack_trace))
+    return "";
 
-  stack << "\n";
+  bool perf_mode = stack_type.mode == StackMode::perf;
   for (auto &addr : stack_trace)
   {
     if (addr == 0)
       break;
-    std::string sym;
-    if (!ustack)
-      sym = resolve_ksym(addr, true);
-    else
-      sym = resolve_usym(addr, pid, true, stack_type.mode == StackMode::perf);
 
-    switch (stack_type.mode) {
-      case StackMode::bpftrace:
-        stack << padding << sym << std::endl;
-        break;
-      case StackMode::perf:
-        stack << "\t" << std::hex << addr << std::dec << " " << sym << std::endl;
-        break;
+    std::string uncached;
+    const std::string &sym = stack_symbol(
+        pid, addr, ustack, perf_mode, uncached);
+    append_frame(stack, addr, sym, stack_type.mode, padding);
+  }
+
+  stacks_.emplace(cache_key, stack);
+  return stack;
+}
+
+std::vector<uint64_t> BPFtrace::unwind_stack(const uint8_t *data,
+                                             size_t limit,
+                                             int &pid)
+{
+  // The stack is packed in the event, it's copied to be read aligned
+  auto stack = std::make_unique<DwarfStack>();
+  memcpy(stack.get(), data, sizeof(DwarfStack));
+  pid = stack->pid;
+  return unwinder_.unwind(*stack, limit);
+}
+
+std::string BPFtrace::get_dwarf_stack(const uint8_t *data,
+                                      StackType stack_type,
+                                      int indent)
+{
+  int pid;
+  std::vector<uint64_t> frames = unwind_stack(data, stack_type.limit, pid);
+  // Same as get_stack(), an empty string if the stack couldn't be unwound
+  if (frames.empty())
+    return "";
+
+  std::string stack = "\n";
+  std::string padding(indent, ' ');
+  for (auto addr : frames)
+  {
+    std::string uncached;
+    const std::string &sym = stack_symbol(pid, addr, true, false, uncached);
+    append_frame(stack, addr, sym, stack_type.mode, padding);
+  }
+  return stack;
+}
+
+void BPFtrace::append_folded_stack(std::string &out,
+                                   uint64_t stackidpid,
+                                   bool ustack,
+                                   StackType stack_type)
+{
+  if (stack_type.mode == StackMode::build_id)
+  {
+    std::vector<std::string> frames;
+    if (!read_build_id_stack(stackidpid, stack_type, frames))
+      return;
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it)
+    {
+      if (!out.empty())
+        out += ';';
+      out += *it;
     }
+    return;
   }
 
-  return stack.str();
+  int pid = stackidpid >> 32;
+  std::vector<uint64_t> stack_trace;
+  if (!read_stack(stackidpid, stack_type, stack_trace))
+    return;
+
+  auto end = std::find(stack_trace.begin(), stack_trace.end(), 0);
+  std::string uncached;
+  for (auto it = std::make_reverse_iterator(end); it != stack_trace.rend();
+       ++it)
+  {
+    const std::string &sym = stack_symbol(pid, *it, ustack, false, uncached);
+    // The symbols are cached with their offsets, "name+123"
+    size_t len = sym.size();
+    size_t plus = sym.rfind('+');
+    if (plus != std::string::npos && plus + 1 < sym.size() &&
+        sym.find_first_not_of("0123456789", plus + 1) == std::string::npos)
+      len = plus;
+
+    if (!out.empty())
+      out += ';';
+    out.append(sym, 0, len);
+  }
 }
 
-std::string BPFtrace::resolve_uid(uintptr_t addr) const
+const std::string &BPFtrace::stack_symbol(int pid,
+                                          uint64_t addr,
+                                          bool ustack,
+                                          bool perf_mode,
+                                          std::string &uncached)
 {
-  std::string file_name = "/etc/passwd";
-  std::string uid = std::to_string(addr);
-  std::string username = "";
+  if (!ustack)
+  {
+    auto it = kstack_syms_.find(addr);
+    if (it == kstack_syms_.end())
+    {
+      self_stats_.ksym_misses++;
+      it = kstack_syms_.emplace(addr, resolve_ksym(addr, true)).first;
+    }
+    else
+      self_stats_.ksym_hits++;
+    return it->second;
+  }
 
-  std::ifstream file(file_name);
-  if (file.fail())
+  auto key = std::make_tuple(pid, addr, perf_mode);
+  auto it = cache_user_symbols_ ? ustack_syms_.find(key) : ustack_syms_.end();
+  if (it != ustack_syms_.end())
   {
-    LOG(ERROR) << strerror(errno) << ": " << file_name;
-    return username;
+    self_stats_.usym_hits++;
+    return it->second;
   }
+  self_stats_.usym_misses++;
+
+  if (!symcaches_)
+    symcaches_ = std::make_unique<ProcSymcaches>(cache_user_symbols_);
+  // Unresolved frames are looked up again next time, the mappings of the
+  // process may have changed by then
+  if (resolve_usym(*symcaches_, addr, pid, true, perf_mode, uncached) &&
+      cache_user_symbols_)
+    return ustack_syms_.emplace(key, std::move(uncached)).first->second;
+  return uncached;
+}
 
-  std::string line;
-  bool found = false;
+bool BPFtrace::read_stack(uint64_t stackidpid,
+                          StackType stack_type,
+                          std::vector<uint64_t> &frames)
+{
+  frames.assign(stack_type.limit, 0);
+  return lookup_stack(stackidpid, stack_type, frames.data());
+}
+
+bool BPFtrace::read_build_id_stack(uint64_t stackidpid,
+                                   StackType stack_type,
+                                   std::vector<std::string> &frames)
+{
+  std::vector<struct bpf_stack_build_id> entries(stack_type.limit);
+  if (!lookup_stack(stackidpid, stack_type, entries.data()))
+    return false;
+
+  frames.clear();
+  for (auto &entry : entries)
+  {
+    if (entry.status == BPF_STACK_BUILD_ID_EMPTY)
+      break;
+    std::ostringstream frame;
+    frame << std::hex << std::setfill('0');
+    if (entry.status == BPF_STACK_BUILD_ID_VALID)
+    {
+      for (auto byte : entry.build_id)
+        frame << std::setw(2) << static_cast<unsigned>(byte);
+      frame << "+0x" << entry.offset;
+    }
+    else
+      frame << "0x" << entry.ip;
+    frames.push_back(frame.str());
+  }
+  return true;
+}
 
-  while (std::getline(file, line) && !found)
+// Read the entries of a stack id into entries, an array of stack_type.limit
+// frames as the stack map holds them
+bool BPFtrace::lookup_stack(uint64_t stackidpid,
+                            StackType stack_type,
+                            void *entries)
+{
+  int32_t stackid = stackidpid & 0xffffffff;
+  int pid = stackidpid >> 32;
+  // Another stack held the hash bucket of this one, summed up by
+  // print_maps() rather than reported for every key
+  if (stackid == -EEXIST)
+  {
+    lost_stacks_[stack_type].insert(pid);
+    return false;
+  }
+  int err = bpf_lookup_elem(maps[stack_type].value()->mapfd_,
+                            &stackid,
+                            entries);
+  if (err)
   {
-    auto fields = split_string(line, ':');
+    // ignore EFAULT errors: eg, kstack used but no kernel stack
+    if (stackid != -EFAULT)
+      LOG(ERROR) << "failed to look up stack id " << stackid << " (pid " << pid
+                 << "): " << err;
+    return false;
+  }
+  return true;
+}
 
-    if (fields[2] == uid)
+void BPFtrace::append_frame(std::string &stack,
+                            uint64_t addr,
+                            const std::string &sym,
+                            StackMode mode,
+                            const std::string &padding)
+{
+  switch (mode) {
+    case StackMode::bpftrace:
+    case StackMode::build_id:
+    case StackMode::dwarf:
+      stack += padding;
+      break;
+    case StackMode::perf:
     {
-      found = true;
-      username = fields[0];
+      char hex[2 * sizeof(addr)];
+      auto res = std::to_chars(hex, hex + sizeof(hex), addr, 16);
+      stack += '\t';
+      stack.append(hex, res.ptr);
+      stack += ' ';
+      break;
     }
   }
+  stack += sym;
+  stack += '\n';
+}
 
-  file.close();
+std::string BPFtrace::resolve_uid(uintptr_t addr)
+{
+  std::string file_name = "/etc/passwd";
+
+  auto now = std::chrono::steady_clock::now();
+  if (passwd_checked_ == std::chrono::steady_clock::time_point() ||
+      now - passwd_checked_ >= std::chrono::seconds(1))
+  {
+    passwd_checked_ = now;
+    struct stat st;
+    if (stat(file_name.c_str(), &st) != 0)
+    {
+      LOG(ERROR) << strerror(errno) << ": " << file_name;
+      usernames_.clear();
+      passwd_mtime_ = {};
+      return "";
+    }
+    if (st.st_mtim.tv_sec != passwd_mtime_.tv_sec ||
+        st.st_mtim.tv_nsec != passwd_mtime_.tv_nsec)
+    {
+      std::ifstream file(file_name);
+      if (file.fail())
+      {
+        LOG(ERROR) << strerror(errno) << ": " << file_name;
+        return "";
+      }
+      passwd_mtime_ = st.st_mtim;
+      usernames_.clear();
+      std::string line;
+      while (std::getline(file, line))
+      {
+        auto fields = split_string(line, ':');
+        if (fields.size() < 3)
+          continue;
+        uint64_t uid;
+        auto end = fields[2].data() + fields[2].size();
+        auto res = std::from_chars(fields[2].data(), end, uid);
+        // The first entry of a uid wins
+        if (res.ec == std::errc() && res.ptr == end)
+          usernames_.emplace(uid, fields[0]);
+      }
+    }
+  }
+
+  auto found = usernames_.find(addr);
+  return found != usernames_.end() ? found->second : "";
+}
 
-  return username;
+std::string BPFtrace::resolve_cgroup_path(uint64_t cgroup_id)
+{
+  // The id itself for cgroups of another hierarchy, or already gone
+  return cgroup_paths_.resolve(cgroup_id).value_or(std::to_string(cgroup_id));
 }
 
 std::string BPFtrace::resolve_timestamp(uint32_t strftime_id,
@@ -1903,6 +6037,11 @@ std::string BPFtrace::resolve_timestamp(uint32_t strftime_id,
   struct tm tmp;
   time_t time = boottime_->tv_sec +
                 ((boottime_->tv_nsec + nsecs_since_boot) / 1e9);
+  // The formats have no sub-second fields, events of the same second print
+  // the same
+  auto cached = timestamps_.find(strftime_id);
+  if (cached != timestamps_.end() && cached->second.first == time)
+    return cached->second.second;
   if (!localtime_r(&time, &tmp))
   {
     LOG(ERROR) << "localtime_r: " << strerror(errno);
@@ -1913,6 +6052,7 @@ std::string BPFtrace::resolve_timestamp(uint32_t strftime_id,
     LOG(ERROR) << "strftime returned 0";
     return "(?)";
   }
+  timestamps_[strftime_id] = { time, timestr };
   return timestr;
 }
 
@@ -1923,24 +6063,20 @@ std::string BPFtrace::resolve_buf(char *buf, size_t size)
 
 std::string BPFtrace::resolve_ksym(uintptr_t addr, bool show_offset)
 {
-  struct bcc_symbol ksym;
-  std::ostringstream symbol;
-
-  if (!ksyms_)
-    ksyms_ = bcc_symcache_new(-1, nullptr);
-
-  if (bcc_symcache_resolve(ksyms_, addr, &ksym) == 0)
-  {
-    symbol << ksym.name;
-    if (show_offset)
-      symbol << "+" << ksym.offset;
-  }
-  else
+  if (raw_symbols_)
+    return RawSymbols::kernel_token(addr, show_offset);
+
+  std::string symbol;
+  if (ksyms_loaded_.valid())
+    ksyms_loaded_.wait();
+  ksyms_.load();
+  if (!ksyms_.resolve(addr, show_offset, symbol))
   {
-    symbol << (void*)addr;
+    char hex[2 + 2 * sizeof(addr)] = "0x";
+    auto res = std::to_chars(hex + 2, hex + sizeof(hex), addr, 16);
+    symbol.assign(addr ? hex : hex + 2, res.ptr);
   }
-
-  return symbol.str();
+  return symbol;
 }
 
 uint64_t BPFtrace::resolve_kname(const std::string &name) const
@@ -2171,59 +6307,112 @@ bool BPFtrace::is_aslr_enabled(int pid)
 
 std::string BPFtrace::resolve_usym(uintptr_t addr, int pid, bool show_offset, bool show_module)
 {
-  struct bcc_symbol usym;
-  std::ostringstream symbol;
-  void *psyms = nullptr;
-  struct bcc_symbol_option symopts;
+  if (!symcaches_)
+    symcaches_ = std::make_unique<ProcSymcaches>(cache_user_symbols_);
+  std::string symbol;
+  resolve_usym(*symcaches_, addr, pid, show_offset, show_module, symbol);
+  return symbol;
+}
 
-  memset(&symopts, 0, sizeof(symopts));
-  symopts.use_debug_file = 1;
-  symopts.check_debug_file_crc = 1;
-  symopts.use_symbol_type = BCC_SYM_ALL_TYPES;
+bool BPFtrace::resolve_usym(ProcSymcaches &symcaches,
+                            uintptr_t addr,
+                            int pid,
+                            bool show_offset,
+                            bool show_module,
+                            std::string &symbol)
+{
+  if (raw_symbols_)
+  {
+    raw_symbols_->add_process(pid);
+    symbol = RawSymbols::user_token(pid, addr, show_offset, show_module);
+    return true;
+  }
 
-  if (resolve_user_symbols_)
+  if (!resolve_user_symbols_)
   {
-    if (cache_user_symbols_)
-    {
-      std::string pid_exe = get_pid_exe(pid);
-      if (exe_sym_.find(pid_exe) == exe_sym_.end())
-      {
-        // not cached, create new ProcSyms cache
-        psyms = bcc_symcache_new(pid, &symopts);
-        exe_sym_[pid_exe] = std::make_pair(pid, psyms);
-      }
-      else
-      {
-        psyms = exe_sym_[pid_exe].second;
-      }
-    }
-    else
+    symbol = format_usym(addr, "", 0, "", show_offset, show_module);
+    return false;
+  }
+
+  if (symbol_cache_)
+  {
+    std::string name, module;
+    uint64_t offset;
+    if (symbol_cache_->resolve(pid, addr, name, offset, module))
     {
-      psyms = bcc_symcache_new(pid, &symopts);
+      symbol = format_usym(addr, name, offset, module, show_offset, show_module);
+      return !name.empty();
     }
   }
 
-  if (psyms && bcc_symcache_resolve(psyms, addr, &usym) == 0)
+  // Addresses that don't resolve may belong to a library that was just
+  // loaded
+  void *psyms = symcaches.get(pid);
+  if (resolve_usym(psyms, addr, show_offset, show_module, symbol))
+    return true;
+
+  // Or to JIT compiled code
+  PerfMap &perf_map = symcaches.perf_map(pid);
+  std::string name;
+  uint64_t offset;
+  if (perf_map.lookup(addr, name, offset))
   {
-    if (demangle_cpp_symbols_)
-      symbol << usym.demangle_name;
-    else
-      symbol << usym.name;
-    if (show_offset)
-      symbol << "+" << usym.offset;
-    if (show_module)
-      symbol << " (" << usym.module << ")";
+    // Named the way the runtime sees it, without the /proc/<pid>/root prefix
+    const std::string &path = perf_map.path();
+    std::string module = path.substr(path.rfind("/tmp/"));
+    symbol = format_usym(addr, name, offset, module, show_offset, show_module);
+    return true;
   }
-  else
+
+  if (!symcaches.refresh(pid))
+    return false;
+  return resolve_usym(
+      symcaches.get(pid), addr, show_offset, show_module, symbol);
+}
+
+bool BPFtrace::resolve_usym(void *psyms,
+                            uintptr_t addr,
+                            bool show_offset,
+                            bool show_module,
+                            std::string &symbol) const
+{
+  // Demangled through demangle_cache_ rather than by bcc for every lookup
+  struct bcc_symbol usym;
+  if (!psyms || bcc_symcache_resolve_no_demangle(psyms, addr, &usym) != 0)
+  {
+    symbol = format_usym(addr, "", 0, "", show_offset, show_module);
+    return false;
+  }
+
+  symbol = format_usym(
+      addr, usym.name, usym.offset, usym.module, show_offset, show_module);
+  return true;
+}
+
+std::string BPFtrace::format_usym(uintptr_t addr,
+                                  const std::string &name,
+                                  uint64_t offset,
+                                  const std::string &module,
+                                  bool show_offset,
+                                  bool show_module) const
+{
+  std::ostringstream symbol;
+  if (name.empty())
   {
-    symbol << (void*)addr;
+    symbol << (void *)addr;
     if (show_module)
       symbol << " ([unknown])";
+    return symbol.str();
   }
 
-  if (psyms && !cache_user_symbols_)
-    bcc_free_symcache(psyms, pid);
-
+  const std::string *demangled = demangle_cpp_symbols_
+                                     ? demangle_cache_.demangle(name)
+                                     : nullptr;
+  symbol << (demangled ? *demangled : name);
+  if (show_offset)
+    symbol << "+" << offset;
+  if (show_module)
+    symbol << " (" << module << ")";
   return symbol.str();
 }
 
@@ -2236,58 +6425,91 @@ std::string BPFtrace::resolve_probe(uint64_t probe_id) const
 void BPFtrace::sort_by_key(std::vector<SizedType> key_args,
     std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key)
 {
-  int arg_offset = 0;
-  for (auto arg : key_args)
+  // The integer and string arguments are sorted on, in order, the others
+  // don't get sorted. Each is read once per entry up front, an entry's
+  // integers at ints[entry * n_ints] and strings at strs[entry * n_strs].
+  struct Column
   {
-    arg_offset += arg.GetSize();
-  }
-
-  // Sort the key arguments in reverse order so the results are sorted by
-  // the first argument first, then the second, etc.
-  for (size_t i=key_args.size(); i-- > 0; )
+    bool is_int;
+    size_t index;
+  };
+  std::vector<Column> columns;
+  std::vector<std::pair<size_t, size_t>> int_args, str_args;
+  size_t arg_offset = 0;
+  for (auto &arg : key_args)
   {
-    auto arg = key_args.at(i);
-    arg_offset -= arg.GetSize();
-
     if (arg.IsIntTy())
     {
-      if (arg.GetSize() == 8)
-      {
-        std::stable_sort(
-            values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b) {
-              auto va = read_data<uint64_t>(a.first.data() + arg_offset);
-              auto vb = read_data<uint64_t>(b.first.data() + arg_offset);
-              return va < vb;
-            });
-      }
-      else if (arg.GetSize() == 4)
-      {
-        std::stable_sort(
-            values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b) {
-              auto va = read_data<uint32_t>(a.first.data() + arg_offset);
-              auto vb = read_data<uint32_t>(b.first.data() + arg_offset);
-              return va < vb;
-            });
-      }
-      else
+      if (arg.GetSize() != 8 && arg.GetSize() != 4)
       {
         LOG(FATAL) << "invalid integer argument size. 4 or 8  expected, but "
                    << arg.GetSize() << " provided";
       }
-
+      columns.push_back({ true, int_args.size() });
+      int_args.emplace_back(arg_offset, arg.GetSize());
     }
     else if (arg.IsStringTy())
     {
-      std::stable_sort(
-          values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b) {
-            return strncmp((const char *)(a.first.data() + arg_offset),
-                           (const char *)(b.first.data() + arg_offset),
-                           arg.GetSize()) < 0;
-          });
+      columns.push_back({ false, str_args.size() });
+      str_args.emplace_back(arg_offset, arg.GetSize());
     }
+    arg_offset += arg.GetSize();
+  }
+  if (columns.empty())
+    return;
 
-    // Other types don't get sorted
+  size_t n = values_by_key.size();
+  size_t n_ints = int_args.size(), n_strs = str_args.size();
+  std::vector<uint64_t> ints(n * n_ints);
+  std::vector<std::string_view> strs(n * n_strs);
+  for (size_t e = 0; e < n; e++)
+  {
+    const uint8_t *key = values_by_key[e].first.data();
+    for (size_t c = 0; c < n_ints; c++)
+    {
+      auto [offset, size] = int_args[c];
+      ints[e * n_ints + c] = size == 8 ? read_data<uint64_t>(key + offset)
+                                       : read_data<uint32_t>(key + offset);
+    }
+    for (size_t c = 0; c < n_strs; c++)
+    {
+      // Compares like strncmp() over the size of the argument
+      auto [offset, size] = str_args[c];
+      auto str = reinterpret_cast<const char *>(key + offset);
+      strs[e * n_strs + c] = std::string_view(str, strnlen(str, size));
+    }
   }
+
+  // A single stable sort by the first argument, then the second, etc.
+  std::vector<size_t> order(n);
+  for (size_t e = 0; e < n; e++)
+    order[e] = e;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    for (auto &column : columns)
+    {
+      if (column.is_int)
+      {
+        uint64_t va = ints[a * n_ints + column.index];
+        uint64_t vb = ints[b * n_ints + column.index];
+        if (va != vb)
+          return va < vb;
+      }
+      else
+      {
+        int cmp = strs[a * n_strs + column.index].compare(
+            strs[b * n_strs + column.index]);
+        if (cmp != 0)
+          return cmp < 0;
+      }
+    }
+    return false;
+  });
+
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> sorted;
+  sorted.reserve(n);
+  for (size_t e : order)
+    sorted.push_back(std::move(values_by_key[e]));
+  values_by_key = std::move(sorted);
 }
 
 std::string BPFtrace::get_string_literal(const ast::Expression *expr) const
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -14,17 +19,30 @@
 #include "bpffeature.h"
 #include "bpforc.h"
 #include "btf.h"
+#include "cat_cache.h"
+#include "cgroup_paths.h"
 #include "child.h"
+#include "demangle_cache.h"
+#include "ksyms.h"
 #include "map.h"
 #include "mapmanager.h"
+#include "metrics.h"
 #include "output.h"
+#include "perf_consumers.h"
 #include "printf.h"
 #include "probe_matcher.h"
 #include "procmon.h"
 #include "struct.h"
+#include "symbol_cache.h"
+#include "symbolize_pool.h"
+#include "symbolizer.h"
+#include "system_pool.h"
 #include "types.h"
+#include "unwind.h"
 #include "utils.h"
 
+struct ring_buffer;
+
 namespace bpftrace {
 
 struct symbol
@@ -83,6 +101,20 @@ private:
   std::string msg_;
 };
 
+void perf_event_printer(void *cb_cookie, void *data, int size);
+void perf_event_lost(void *cb_cookie, uint64_t lost);
+
+class BPFtrace;
+class CountingBuf;
+
+// Cookie of the perf buffer of a single CPU, so that its events and lost
+// events can be accounted to it
+struct PerfReaderCookie
+{
+  BPFtrace *bpftrace;
+  size_t reader; // index into BPFtrace::event_stats_.readers
+};
+
 struct HelperErrorInfo
 {
   int func_id;
@@ -96,7 +128,8 @@ public:
       : out_(std::move(o)),
         feature_(std::make_unique<BPFfeature>()),
         probe_matcher_(std::make_unique<ProbeMatcher>(this)),
-        ncpus_(get_possible_cpus().size())
+        ncpus_(get_possible_cpus().size()),
+        seen_cpus_(ncpus_)
   {
   }
   virtual ~BPFtrace();
@@ -106,19 +139,139 @@ public:
                                      const ast::Probe &probe);
   int num_probes() const;
   int run(std::unique_ptr<BpfOrc> bpforc);
+  // progfd is the program of probe if it has already been loaded
   std::vector<std::unique_ptr<AttachedProbe>> attach_probe(Probe &probe,
-                                                           BpfOrc &bpforc);
+                                                           BpfOrc &bpforc,
+                                                           int progfd = -1);
   int run_iter(std::unique_ptr<BpfOrc> bpforc);
+  // Print what the iterator of an iter probe wrote
+  void read_iter(int iter_fd, std::mutex &output_mutex);
   int print_maps();
+  // Maps print_maps() leaves out, the ones written to a --snapshot
+  std::set<std::string> unprinted_maps_;
+  // Maps printed on SIGUSR1 (--print), all of them when empty
+  std::vector<std::string> signal_maps_;
+  // Print what bpftrace did since the last self stats, and start over
+  void print_self_stats();
+  // The probe sampling bpftrace's own stacks for --self-profile, and the map
+  // it counts them in, which print_maps() leaves out
+  static std::string self_profile_probe(int hz);
+  // The probe sending the printf() events batched on each CPU and the
+  // repeats counted by BPFTRACE_DEDUPE_MS every EVENT_BATCH_FLUSH_MS, see
+  // BPFTRACE_EVENT_BATCH
+  static std::string event_batch_probe();
+  static constexpr int EVENT_BATCH_FLUSH_MS = 100;
+  static constexpr uint64_t EVENT_BATCH_MAX = 8192;
+  static size_t event_batch_value_size(uint64_t batch)
+  {
+    return 2 * sizeof(uint64_t) + 2 * batch;
+  }
+  // The slot of an event in the ring of --flight-recorder: the time it was
+  // recorded at, its size, then its bytes
+  static constexpr uint64_t FLIGHT_EVENT_MAX = 1024;
+  static size_t flight_slot_size(uint64_t event_size)
+  {
+    return 2 * sizeof(uint64_t) + ((event_size + 7) & ~7UL);
+  }
+  // Print the printf() events recorded in the last flight_recorder_secs_ and
+  // not printed by an earlier dump, in the order they happened
+  void dump_flight_recorder();
+  // The value of the Dedupe map: the time the last event was sent at, the
+  // times it was repeated since, its size, then its bytes. Larger events
+  // are always sent.
+  static constexpr uint64_t DEDUPE_EVENT_MAX = 256;
+  static constexpr uint64_t DEDUPE_VALUE_SIZE = 3 * sizeof(uint64_t) +
+                                                DEDUPE_EVENT_MAX;
+  // Whether the program gets the probe of event_batch_probe()
+  bool flushes_events() const
+  {
+    return event_batch_ || dedupe_ms_;
+  }
+  static constexpr const char *SELF_PROFILE_MAP = "@__self_profile";
+  // Print the stacks sampled with --self-profile in the folded format
+  void print_self_profile(std::ostream &out);
+  // The probes summing up the time threads spend off-CPU for --off-cpu, in
+  // microseconds by thread name and stacks, for the times of at least
+  // min_us. print_maps() prints OFF_CPU_MAP folded whatever the output
+  // format, and leaves out the start times.
+  static std::string off_cpu_probes(uint64_t min_us);
+  static constexpr const char *OFF_CPU_MAP = "@__off_cpu";
+  static constexpr const char *OFF_CPU_START_MAP = "@__off_cpu_start";
+  // The probes keeping the set of processes of --pids and --comm, the other
+  // probes only run for, as they fork, exec and exit. The map of the set is
+  // left out by print_maps() too.
+  static std::string target_tracking_probes(const std::string &comm);
+  static int target_tracking_probe_count(const std::string &comm);
+  int add_target_pids();
+  static constexpr const char *TARGET_PIDS_MAP = "@__target_pids";
+  // Processes of --pids and name of those of --comm, added to the set on
+  // start
+  std::vector<pid_t> target_pids_;
+  std::string target_comm_;
+  // Detect the features and read the kernel's symbols ahead of the programs
+  // of --daemon, which run in forks of this process
+  void warm_up();
+  // Detect the features and index the BTF of vmlinux on other threads while
+  // the program is parsed. finish_startup_work() waits for them before the
+  // passes use the features.
+  void start_startup_work();
+  void finish_startup_work();
+  // Read /proc/kallsyms on another thread while the program is compiled and
+  // attached, resolve_ksym() waits for it
+  void prefetch_ksyms();
+  // The program resolves kernel symbols, with ksym() or kstack
+  bool needs_ksyms_ = false;
   int clear_map(IMap &map);
+  int flip_map(IMap &map);
   int zero_map(IMap &map);
   int print_map(IMap &map, uint32_t top, uint32_t div);
+  int print_map_quantiles(IMap &map, const std::vector<double> &quantiles);
+  int print_map_delta(IMap &map, uint32_t top, uint32_t div);
   std::string get_stack(uint64_t stackidpid, bool ustack, StackType stack_type, int indent=0);
+  bool read_stack(uint64_t stackidpid,
+                  StackType stack_type,
+                  std::vector<uint64_t> &frames);
+  // The frames of a stack of the build_id mode, "<build ID>+0x<offset>" or
+  // "0x<address>" when the kernel couldn't find the build ID of the file
+  bool read_build_id_stack(uint64_t stackidpid,
+                           StackType stack_type,
+                           std::vector<std::string> &frames);
+  // The DwarfStack of a ustack(dwarf) at data, unwound and symbolized
+  std::string get_dwarf_stack(const uint8_t *data,
+                              StackType stack_type,
+                              int indent = 0);
+  static void append_frame(std::string &stack,
+                           uint64_t addr,
+                           const std::string &sym,
+                           StackMode mode,
+                           const std::string &padding);
+  // Appends the frames of the stack to out, outermost first, separated by
+  // ';' (also from what out already holds) and without the offsets into
+  // their symbols, as flame graphs want them
+  void append_folded_stack(std::string &out,
+                           uint64_t stackidpid,
+                           bool ustack,
+                           StackType stack_type);
   std::string resolve_buf(char *buf, size_t size);
   std::string resolve_ksym(uintptr_t addr, bool show_offset=false);
   std::string resolve_usym(uintptr_t addr, int pid, bool show_offset=false, bool show_module=false);
+  // Returns false when addr couldn't be resolved, symbol is then its hex
+  // value
+  bool resolve_usym(ProcSymcaches &symcaches,
+                    uintptr_t addr,
+                    int pid,
+                    bool show_offset,
+                    bool show_module,
+                    std::string &symbol);
+  std::string format_usym(uintptr_t addr,
+                          const std::string &name,
+                          uint64_t offset,
+                          const std::string &module,
+                          bool show_offset,
+                          bool show_module) const;
   std::string resolve_inet(int af, const uint8_t* inet) const;
-  std::string resolve_uid(uintptr_t addr) const;
+  std::string resolve_uid(uintptr_t addr);
+  std::string resolve_cgroup_path(uint64_t cgroup_id);
   std::string resolve_timestamp(uint32_t strftime_id, uint64_t nsecs);
   uint64_t resolve_kname(const std::string &name) const;
   virtual int resolve_uname(const std::string &name,
@@ -126,14 +279,39 @@ public:
                             const std::string &path) const;
   std::string resolve_mac_address(const uint8_t *mac_addr) const;
   std::string map_value_to_str(const SizedType &stype,
-                               std::vector<uint8_t> value,
+                               const std::vector<uint8_t> &value,
                                bool is_per_cpu,
                                uint32_t div,
                                const Output &output);
+  // Append map_value_to_str() to out, integers without an intermediate
+  // string
+  void append_map_value(std::string &out,
+                        const SizedType &stype,
+                        const std::vector<uint8_t> &value,
+                        bool is_per_cpu,
+                        uint32_t div,
+                        const Output &output);
+  // The value map_value_to_str() prints for count(), sum(), min(), max(),
+  // distinct() and integer maps, as the bits of an int64_t for min() and
+  // signed integers
+  uint64_t map_value_to_int(const SizedType &stype,
+                            const std::vector<uint8_t> &value,
+                            bool is_per_cpu,
+                            uint32_t div);
   virtual std::string extract_func_symbols_from_path(const std::string &path) const;
   std::string resolve_probe(uint64_t probe_id) const;
   uint64_t resolve_cgroupid(const std::string &path) const;
-  std::vector<std::unique_ptr<IPrintable>> get_arg_values(const std::vector<Field> &args, uint8_t* arg_data);
+  std::vector<std::unique_ptr<IPrintable>> get_arg_values(
+      const std::vector<Field> &args,
+      uint8_t *arg_data,
+      std::vector<PrintableSymbols *> *deferred = nullptr);
+  // Append the printf() arguments in arg_data to out, formatted by plan
+  void format_args(const FormatPlan &plan,
+                   const std::vector<Field> &args,
+                   uint8_t *arg_data,
+                   std::string &out);
+  // Resolve the argument of a type printed as a string (e.g. ksym)
+  std::string resolve_arg(const Field &arg, uint8_t *arg_data);
   void add_param(const std::string &param);
   std::string get_param(size_t index, bool is_str) const;
   size_t num_params() const;
@@ -144,10 +322,31 @@ public:
 
   std::vector<std::unique_ptr<AttachedProbe>> attached_probes_;
   std::vector<Probe> watchpoint_probes_;
+  // The watchpoint_attach and watchpoint_detach events of the current batch
+  // of events, handled at its end by arm_watchpoints()
+  struct WatchpointRequest
+  {
+    bool attach;
+    uint64_t probe_idx;
+    uint64_t addr;
+  };
+  std::vector<WatchpointRequest> watchpoint_requests_;
+  void arm_watchpoints();
   std::string cmd_;
   bool finalize_ = false;
   // Global variable checking if an exit signal was received
   static volatile sig_atomic_t exitsig_recv;
+  // Set by SIGUSR1 to print the self stats right away
+  static volatile sig_atomic_t self_stats_recv;
+  // Set by SIGUSR1 to print the maps from userspace, see print_signal_maps()
+  static volatile sig_atomic_t print_maps_recv;
+  // Set by SIGUSR2 with --flight-recorder, see dump_flight_recorder()
+  static volatile sig_atomic_t flight_dump_recv;
+  // Set by SIGHUP with --reload to run the changed script, see reload()
+  static volatile sig_atomic_t reload_recv;
+  // Compiles the script again into this BPFtrace for --reload, returns
+  // nullptr (the error has been logged) if it failed
+  std::function<std::unique_ptr<BpfOrc>()> reload_;
 
   MapManager maps;
   std::unique_ptr<BpfOrc> bpforc_;
@@ -155,6 +354,8 @@ public:
   std::map<std::string, std::string> macros_;
   std::map<std::string, uint64_t> enums_;
   std::vector<std::tuple<std::string, std::vector<Field>>> printf_args_;
+  // printf_args_ format strings, split when the program is run
+  std::vector<FormatPlan> printf_plans_;
   std::vector<std::tuple<std::string, std::vector<Field>>> system_args_;
   std::vector<std::tuple<std::string, std::vector<Field>>> seq_printf_args_;
   std::vector<std::string> join_args_;
@@ -162,28 +363,175 @@ public:
   std::vector<std::string> strftime_args_;
   std::vector<std::tuple<std::string, std::vector<Field>>> cat_args_;
   std::vector<SizedType> non_map_print_args_;
+  std::vector<std::vector<double>> quantiles_args_;
   std::unordered_map<int64_t, struct HelperErrorInfo> helper_error_info_;
+  // Fields whose offsets codegen left to be relocated, see relocate_fields_
+  std::vector<FieldReloc> field_relocs_;
 
   std::vector<std::string> probe_ids_;
   unsigned int join_argnum_ = 16;
   unsigned int join_argsize_ = 1024;
+  // Largest join() event: the lengths of the arguments, then the arguments
+  size_t join_size() const
+  {
+    return 8 + 8 + join_argnum_ * (sizeof(uint32_t) + join_argsize_);
+  }
+  // Size of the value of the scratch map, the most any probe keeps there
+  uint64_t scratch_size_ = 0;
   std::unique_ptr<Output> out_;
+  // Where the printf() messages and their repeat counts go instead of out_,
+  // see --printf-output
+  std::unique_ptr<Output> printf_out_;
+  Output &printf_output() const
+  {
+    return printf_out_ ? *printf_out_ : *out_;
+  }
   std::unique_ptr<BPFfeature> feature_;
 
   uint64_t strlen_ = 64;
   uint64_t mapmax_ = 4096;
+  // Entries of each stack id map, see BPFTRACE_STACK_MAP_ENTRIES
+  uint64_t stack_map_entries_ = 128 << 10;
   size_t cat_bytes_max_ = 10240;
   uint64_t max_probes_ = 512;
   uint64_t log_size_ = 1000000;
   uint64_t perf_rb_pages_ = 64;
+  // Bytes of kernel memory the maps and perf buffers may lock, 0 for no
+  // limit, see BPFTRACE_MEMORY_BUDGET
+  uint64_t memory_budget_ = 0;
+  uint64_t perf_rb_wakeup_ = 1;
+  uint64_t ringbuf_pages_ = 512;
+  // Of the ring buffer of the async actions, see BPFTRACE_CONTROL_RINGBUF_PAGES
+  uint64_t control_ringbuf_pages_ = 4;
+  // Bytes of printf() events sent at a time by each CPU, 0 to send them one
+  // by one, see BPFTRACE_EVENT_BATCH
+  uint64_t event_batch_ = 0;
+  // Seconds of printf() events kept in the kernel and only printed by
+  // dump() or on SIGUSR2, 0 to send them, see --flight-recorder
+  uint64_t flight_recorder_secs_ = 0;
+  // Slots of the ring of each CPU, see BPFTRACE_FLIGHT_RECORDER_EVENTS
+  uint64_t flight_recorder_events_ = 4096;
+  // Of the largest printf() event recorded, larger ones are sent. Set by the
+  // semantic analyser.
+  uint64_t flight_event_size_ = 0;
+  // Time (CLOCK_MONOTONIC ns) of the last event dumped
+  uint64_t flight_dumped_ns_ = 0;
+  // Milliseconds a printf() event identical to the last one of its CPU is
+  // counted rather than sent for, 0 to send them all, see BPFTRACE_DEDUPE_MS
+  uint64_t dedupe_ms_ = 0;
+  // The gates of the probes enable() and disable() turn on and off, with
+  // the names of their attach points as written. Set by the semantic
+  // analyser, the ProbeGates map has an entry per gate.
+  std::vector<std::pair<uint32_t, std::string>> probe_gates_;
+  uint64_t perf_consumer_threads_ = 0;
+  uint64_t event_count_ = 0;
+  uint64_t event_stats_interval_ = 0;
+  uint64_t probe_stats_interval_ = 0;
+  // Overhead budget, probes going over it are detached
+  uint64_t probe_max_cpu_pct_ = 0;
+  uint64_t probe_max_ns_ = 0;
+  EventStats event_stats_;
+  // Runs of each probe are counted in the kernel, printed at exit and every
+  // probe_counts_interval_ seconds
+  bool probe_counts_ = false;
+  uint64_t probe_counts_interval_ = 0;
+  // Seconds the probes only count their runs for, rather than running the
+  // program, see --estimate. The section of the actual program of each probe
+  // id, for its instructions.
+  uint64_t estimate_secs_ = 0;
+  std::map<std::string, std::string> estimate_sections_;
+  uint64_t self_stats_interval_ = 0;
+  SelfStats self_stats_;
+  // Counts the output bytes for the self stats
+  const CountingBuf *output_counter_ = nullptr;
+  bool use_ringbuf_ = false;
+  bool use_control_ringbuf_ = false;
+  bool double_buffer_maps_ = false;
+  bool hash_str_keys_ = false;
+  bool hist_arrays_ = false;
+  bool stream_maps_ = false;
+  bool coalesce_reads_ = false;
+  bool kprobe_to_kfunc_ = false;
+  // Offsets of the fields of kernel structs are relocated when the program
+  // is loaded, for --emit-elf on kernels with BTF
+  bool relocate_fields_ = false;
+  MapAlloc map_alloc_ = MapAlloc::prealloc;
   uint64_t max_type_res_iterations = 0;
   bool demangle_cpp_symbols_ = true;
+  // Shared by probe matching and symbolization
+  mutable DemangleCache demangle_cache_;
   bool resolve_user_symbols_ = true;
   bool cache_user_symbols_ = true;
+  // On-disk user symbol indexes, see BPFTRACE_SYMBOL_CACHE_DIR
+  std::unique_ptr<SymbolCache> symbol_cache_;
+  // Compiled programs, see BPFTRACE_PROGRAM_CACHE_DIR
+  std::string program_cache_dir_;
+  // Headers the C definitions were parsed from, which the cached program
+  // depends on too
+  std::set<std::string> included_files_;
+  // Set to print symbols as raw addresses, see --raw-symbols
+  std::unique_ptr<RawSymbols> raw_symbols_;
+  // Most processes remembered as sent to userspace for --raw-symbols, the
+  // ones forgotten are sent again
+  static constexpr uint32_t RAW_SYMBOLS_PIDS_MAX = 4096;
+  // Symbolize printf() events off the main thread, see
+  // BPFTRACE_SYMBOLIZE_THREADS
+  uint64_t symbolize_threads_ = 0;
+  std::unique_ptr<SymbolizePool> symbolize_pool_;
+  // Reads of cat(), see BPFTRACE_CAT_CACHE_MS and BPFTRACE_CAT_FDS. Made
+  // before system_pool_, whose workers read through it.
+  uint64_t cat_cache_ms_ = 0;
+  uint64_t cat_fds_ = 0;
+  uint64_t cat_threads_ = 0;
+  std::unique_ptr<CatCache> cat_cache_;
+  // Run the system() commands off the main thread, see
+  // BPFTRACE_SYSTEM_THREADS
+  uint64_t system_threads_ = 0;
+  uint64_t system_queue_ = 64;
+  bool system_drop_ = false;
+  std::unique_ptr<SystemPool> system_pool_;
+  // Reused for the printf() messages, so they don't need their own
+  // allocation
+  std::string printf_buf_;
+  // Threads loading the programs before they're attached, 0 for one per
+  // CPU, see BPFTRACE_LOAD_THREADS
+  uint64_t load_threads_ = 0;
+  // Threads optimizing and compiling the programs, 0 for one per CPU, see
+  // BPFTRACE_CODEGEN_THREADS
+  uint64_t codegen_threads_ = 0;
+  // Threads reading the maps printed on exit, 0 for one per CPU, see
+  // BPFTRACE_PRINT_THREADS
+  uint64_t print_threads_ = 0;
+  // Bytes read from an iter at a time, see BPFTRACE_ITER_BUFFER_SIZE
+  uint64_t iter_buffer_size_ = 64 * 1024;
+  // Where the output goes when nothing of bpftrace's buffers it on the way
+  // (-o, BPFTRACE_OUTPUT_BUFFER, BPFTRACE_SELF_STATS), for iter programs to
+  // be spliced to. -1 otherwise.
+  int output_fd_ = -1;
+  // BPFTRACE_OPT_LEVEL, see CodegenLLVM::optimize()
+  uint64_t opt_level_ = 3;
   bool safe_mode_ = true;
   bool has_usdt_ = false;
   bool usdt_file_activation_ = false;
   int helper_check_level_ = 0;
+  // Send a warning event for every failed helper call (-k, -kk) rather than
+  // counting them in the kernel, BPFTRACE_HELPER_ERROR_EVENTS
+  bool helper_error_events_ = false;
+  // Most (helper error id, return value) pairs counted
+  static constexpr uint32_t HELPER_ERRORS_MAX = 1024;
+  // Sample the runs of the probes down as events get lost, see
+  // BPFTRACE_ADAPTIVE_SAMPLING
+  bool adaptive_sampling_ = false;
+  static constexpr uint64_t ADAPTIVE_SAMPLING_MAX = 1 << 16;
+  // Id of the cgroup given with --cgroup, the probes only run for its tasks
+  uint64_t cgroup_filter_ = 0;
+  // Serves the maps of metrics_maps_ (all of them when empty), --metrics
+  std::unique_ptr<MetricsServer> metrics_server_;
+  std::vector<std::string> metrics_maps_;
+  // Directory in bpffs the maps are pinned to, --pin-maps
+  std::string pin_maps_dir_;
+  // Times the command of -c is run in the session, --repeat
+  uint64_t child_runs_ = 1;
   uint64_t ast_max_nodes_ = 0; // Maximum AST nodes allowed for fuzzing
   std::optional<struct timespec> boottime_;
 
@@ -209,16 +557,119 @@ public:
   std::vector<Probe> probes_;
   std::vector<Probe> special_probes_;
 private:
+  std::optional<std::tuple<uint8_t *, uintptr_t>> get_probe_section(
+      const Probe &probe,
+      BpfOrc &bpforc);
+  std::vector<int> load_progs(BpfOrc &bpforc);
+  void detach_probes();
+  void compact();
+  // What a compiled program leaves in BPFtrace, which swap_program()
+  // exchanges with the running one on a reload
+  struct ProgramState
+  {
+    MapManager maps;
+    std::unique_ptr<BpfOrc> bpforc;
+    std::vector<Probe> probes;
+    std::vector<Probe> special_probes;
+    std::vector<Probe> watchpoint_probes;
+    std::map<std::string, Struct> structs;
+    std::map<std::string, std::string> macros;
+    std::map<std::string, uint64_t> enums;
+    std::vector<std::tuple<std::string, std::vector<Field>>> printf_args;
+    std::vector<FormatPlan> printf_plans;
+    std::vector<std::tuple<std::string, std::vector<Field>>> system_args;
+    std::vector<std::tuple<std::string, std::vector<Field>>> seq_printf_args;
+    std::vector<std::string> join_args;
+    std::vector<std::string> time_args;
+    std::vector<std::string> strftime_args;
+    std::vector<std::tuple<std::string, std::vector<Field>>> cat_args;
+    std::vector<SizedType> non_map_print_args;
+    std::vector<std::vector<double>> quantiles_args;
+    std::unordered_map<int64_t, struct HelperErrorInfo> helper_error_info;
+    std::vector<std::string> probe_ids;
+    std::vector<std::pair<uint32_t, std::string>> probe_gates;
+    std::vector<std::tuple<int, int>> seq_printf_ids;
+    std::unordered_set<std::string> btf_set;
+    std::map<std::string, std::map<std::string, SizedType>> btf_ap_args;
+    uint64_t scratch_size = 0;
+    bool has_usdt = false;
+    std::set<std::string> tail_calls_loaded;
+  };
+  void swap_program(ProgramState &state);
+  void reload();
+  void read_pending_events();
+  // Replaced programs some of whose probes are still attached, which refer
+  // to their Probe and code
+  std::vector<std::unique_ptr<ProgramState>> retired_programs_;
+  // CLOCK_BOOTTIME the elapsed map starts from
+  uint64_t elapsed_start_ns_ = 0;
+  void load_tail_calls(const Probe &probe, BpfOrc &bpforc);
+  // Sections of the probe programs whose tail calls are loaded
+  std::set<std::string> tail_calls_loaded_;
   int run_special_probe(std::string name,
                         BpfOrc &bpforc,
                         void (*trigger)(void));
-  void* ksyms_{nullptr};
-  std::map<std::string, std::pair<int, void *>> exe_sym_; // exe -> (pid, cache)
+  KSyms ksyms_;
+  // Set by prefetch_ksyms()
+  std::shared_future<void> ksyms_loaded_;
+  // The features detected by start_startup_work(), replacing feature_
+  std::future<std::unique_ptr<BPFfeature>> features_detected_;
+  std::future<void> btf_indexed_;
+  bool resolve_usym(void *psyms,
+                    uintptr_t addr,
+                    bool show_offset,
+                    bool show_module,
+                    std::string &symbol) const;
+  std::unique_ptr<ProcSymcaches> symcaches_;
+  const std::string &stack_symbol(int pid,
+                                  uint64_t addr,
+                                  bool ustack,
+                                  bool perf_mode,
+                                  std::string &uncached);
+  // Symbols of the stack frames, by address for kernel stacks, and by (pid,
+  // address, perf mode) for user stacks when user symbols are cached
+  std::unordered_map<uint64_t, std::string> kstack_syms_;
+  std::map<std::tuple<int, uint64_t, bool>, std::string> ustack_syms_;
+  // Formatted stacks by (stackidpid, ustack, limit, mode, indent), only kept
+  // for the duration of a print_map()
+  std::map<std::tuple<uint64_t, bool, size_t, StackMode, int>, std::string>
+      stacks_;
+  // Processes whose stack ids lookup_stack() found failed with -EEXIST (hash
+  // collision), by stack map, the kernel's stacks being those of pid -1. The
+  // failed ids only differ by their pid, so printing the same lost stacks
+  // again doesn't count them again.
+  std::unordered_map<StackType, std::unordered_set<int>> lost_stacks_;
+  void read_stack_map_stats();
+  // Prints the map through a FoldedOutput for the occasion
+  int print_folded(IMap &map, std::ostream &out);
+  // Of the ustack(dwarf) stacks, see get_dwarf_stack()
+  Unwinder unwinder_;
+  std::vector<uint64_t> unwind_stack(const uint8_t *data,
+                                     size_t limit,
+                                     int &pid);
+  bool lookup_stack(uint64_t stackidpid, StackType stack_type, void *entries);
+  // uid -> user name, as of the modification time of /etc/passwd, which is
+  // checked at most once a second
+  std::unordered_map<uint64_t, std::string> usernames_;
+  struct timespec passwd_mtime_ = {};
+  std::chrono::steady_clock::time_point passwd_checked_;
+  CgroupPaths cgroup_paths_;
+  // The second each strftime() call last formatted, and the result
+  std::unordered_map<uint32_t, std::pair<time_t, std::string>> timestamps_;
   int ncpus_;
   int online_cpus_;
+  // The possible CPUs up to the highest one online since the run started.
+  // The values of per-CPU maps are only reduced over these, the others never
+  // wrote theirs.
+  int seen_cpus_;
   std::vector<std::string> params_;
 
   std::vector<std::unique_ptr<void, void (*)(void *)>> open_perf_buffers_;
+  std::unique_ptr<PerfConsumers> perf_consumers_;
+  std::vector<std::unique_ptr<PerfReaderCookie>> perf_reader_cookies_;
+  struct ring_buffer *ringbuf_ = nullptr;
+  struct ring_buffer *control_ringbuf_ = nullptr;
+  uint64_t ringbuf_loss_cnt_ = 0;
 
   std::vector<std::unique_ptr<AttachedProbe>> attach_usdt_probe(
       Probe &probe,
@@ -226,16 +677,196 @@ private:
       int pid,
       bool file_activation);
   int setup_perf_events();
+  int check_memory();
+  int open_perf_reader(int epollfd, int cpu);
+  void close_perf_reader(int epollfd, size_t idx);
+  // The CPU of each of open_perf_buffers_, whose buffer is null while the CPU
+  // is offline
+  std::vector<int> perf_reader_cpus_;
+  bool attach_watchpoint(Probe &probe, uint64_t addr);
+  void detach_watchpoint(uint64_t addr);
+  // Watchpoints unwatch()ed, disabled but holding on to their program and
+  // debug registers, to be moved to the next address of their probe
+  std::vector<std::unique_ptr<AttachedProbe>> spare_watchpoints_;
+  int setup_hotplug_watch(int epollfd);
+  bool cpus_changed();
+  int sync_perf_readers(int epollfd);
+  // Netlink socket of the kernel uevents, which tell about CPUs going online
+  // and offline. Without it the online CPUs are checked once a second.
+  int hotplug_fd_ = -1;
+  std::vector<int> online_cpu_list_;
+  std::chrono::steady_clock::time_point cpus_checked_;
+  int setup_ringbuf(int epollfd);
+  int setup_control_ringbuf(int epollfd);
+  void drain_event_batches();
+  void drain_repeats();
+  void consume_control();
+  void free_ringbuf();
   void poll_perf_events(int epollfd, bool drain = false);
+  int setup_exit_watch(int epollfd);
+  bool exit_watch_event(int epollfd, void *ptr);
+  int rerun_child(int epollfd, uint64_t run);
+  // Whether the exits of procmon_ and child_ come through the epoll set
+  // rather than having is_alive() polled after every wakeup
+  bool exit_watched_ = false;
+  void poll_perf_consumers(bool drain);
+  void poll_ringbuf_loss();
+  void poll_stats();
+  void advance_windows();
+  // Whether there are window maps, see advance_windows()
+  bool has_windows_ = false;
+  void expire_maps();
+  int read_ttl_times(IMap &map,
+                     size_t key_size,
+                     std::vector<uint8_t> &keys,
+                     std::vector<uint8_t> &times);
+  std::chrono::steady_clock::time_point ttl_last_;
+  std::chrono::steady_clock::time_point event_stats_last_;
+  std::chrono::steady_clock::time_point probe_stats_last_;
+  std::chrono::steady_clock::time_point self_stats_last_;
+  std::chrono::steady_clock::time_point probe_counts_last_;
+  void print_probe_counts();
+  int print_program_maps(bool snapshot_maps);
+  void print_signal_maps();
+  // Rates of the probes with --estimate, printed instead of the maps
+  void print_estimates();
+  std::chrono::steady_clock::time_point estimate_start_;
+  // Warn about the helper calls that failed since the previous call, every
+  // second and at exit
+  void print_helper_errors();
+  std::chrono::steady_clock::time_point helper_errors_last_;
+  std::map<std::pair<int32_t, int32_t>, uint64_t> helper_errors_reported_;
+  uint64_t output_bytes_last_ = 0;
+  int enable_probe_stats();
+  void read_probe_stats();
+  bool probe_stats_enabled() const;
+  void check_probe_budget();
+  std::chrono::steady_clock::time_point probe_budget_last_;
+  // Raises the divisor of the adaptive sampling every second events were
+  // lost, lowers it again after a while without loss
+  void adjust_sampling();
+  // How many of the runs of the probes were let through, printed at exit
+  void print_sampling();
+  std::chrono::steady_clock::time_point sampling_last_;
+  uint64_t sampling_divisor_ = 1;
+  uint64_t sampling_received_ = 0;
+  uint64_t sampling_lost_ = 0;
+  uint64_t sampling_clean_secs_ = 0;
+  std::map<std::string, ProbeStats> probe_budget_stats_;
+  int bpf_stats_fd_ = -1;
+  std::map<std::string, ProbeStats> probe_stats_;
+  // Of the probes attached, printed with -v
+  std::map<std::string, LoadStats> load_stats_;
+  int dump_map(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  int dump_map_stored(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  int dump_map_buckets(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  void prefetch_maps(const std::vector<IMap *> &printed);
+  struct PrefetchedMap
+  {
+    int err = 0;
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  };
+  // Read by prefetch_maps(), by map and key size, until dump_map() takes them
+  std::map<std::pair<const IMap *, size_t>, PrefetchedMap> prefetched_maps_;
+  void dump_map_mmapped(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  // With flush, it's called after each batch of entries is read, to consume
+  // them and clear entries, rather than holding all of them at once
+  int dump_map_keys(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries,
+      const std::function<void()> &flush = nullptr);
+  // Like dump_map(), a batch at a time for the maps dump_map_keys() reads,
+  // the others are passed to flush whole
+  int dump_map_streamed(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries,
+      const std::function<void()> &flush);
+  int dump_map_hashed(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  int dump_map_packed(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  int dump_map_dense(
+      IMap &map,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  int dump_map_batch(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries,
+      bool delete_entries,
+      const std::function<void()> &flush = nullptr);
+  int dump_map_window(
+      IMap &map,
+      size_t key_size,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries);
+  int print_map_top(IMap &map, uint32_t top, uint32_t div);
+  int print_map_streamed(IMap &map, uint32_t div);
+  int read_map_hist(IMap &map, uint32_t top);
   int print_map_hist(IMap &map, uint32_t top, uint32_t div);
+  // Reused by every print_map_hist() call
+  HistBuckets hist_buckets_;
+  std::vector<size_t> hist_sorted_;
+  int read_map_stats(
+      IMap &map,
+      std::map<std::vector<uint8_t>, std::vector<int64_t>> &values_by_key);
   int print_map_stats(IMap &map, uint32_t top, uint32_t div);
+  int setup_metrics(int epollfd);
+  void serve_metrics();
+  int write_metric(MetricsText &text, IMap &map);
+  int print_map_cms(IMap &map, uint32_t top, uint32_t div);
+  struct KeyBytesHash
+  {
+    size_t operator()(const std::vector<uint8_t> &key) const
+    {
+      return std::hash<std::string_view>()(std::string_view(
+          reinterpret_cast<const char *>(key.data()), key.size()));
+    }
+  };
+  using DeltaSnapshot =
+      std::unordered_map<std::vector<uint8_t>, uint64_t, KeyBytesHash>;
+  // Values of the maps at their last print_delta(), by map id and raw key
+  std::unordered_map<uint32_t, DeltaSnapshot> delta_snapshots_;
+  int zero_cms_sketch(IMap &map);
   template <typename T>
   static T reduce_value(const std::vector<uint8_t> &value, int nvalues);
   static int64_t min_value(const std::vector<uint8_t> &value, int nvalues);
   static uint64_t max_value(const std::vector<uint8_t> &value, int nvalues);
+  static uint64_t distinct_value(const std::vector<uint8_t> &value,
+                                 int nvalues);
   static uint64_t read_address_from_output(std::string output);
   std::vector<uint8_t> find_empty_key(IMap &map, size_t size) const;
   bool has_iter_ = false;
+
+  friend class ProgramImage;
+  friend class Session;
 };
 
 } // namespace bpftrace
@@ -3,6 +3,7 @@
 #include "bpftrace.h"
 #include "log.h"
 #include "probe_matcher.h"
+#include "struct.h"
 #include "types.h"
 #include "utils.h"
 #include <cstring>
@@ -13,6 +14,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <type_traits>
 #include <unistd.h>
 
 #ifdef HAVE_LIBBPF_BTF_DUMP
@@ -90,7 +92,8 @@ static int libbpf_print(enum libbpf_print_level level, const char *msg, va_list
   return vfprintf(stderr, msg, ap);
 }
 
-static struct btf *btf_open(const struct vmlinux_location *locs)
+static struct btf *btf_open(const struct vmlinux_location *locs,
+                            std::string &id)
 {
   struct utsname buf;
 
@@ -130,6 +133,14 @@ static struct btf *btf_open(const struct vmlinux_location *locs)
     {
       std::cerr << "BTF: using data from " << path << std::endl;
     }
+
+    struct stat st;
+    if (::stat(path, &st) == 0)
+      id = std::string(path) + " " + std::to_string(st.st_size) + " " +
+           std::to_string(st.st_mtim.tv_sec) + "." +
+           std::to_string(st.st_mtim.tv_nsec);
+    else
+      id = path;
     return btf;
   }
 
@@ -154,7 +165,7 @@ BTF::BTF(void) : btf(nullptr), state(NODATA)
     locs = locs_env;
   }
 
-  btf = btf_open(locs);
+  btf = btf_open(locs, id_);
   if (btf)
   {
     libbpf_set_print(libbpf_print);
@@ -173,7 +184,21 @@ BTF::BTF(void) : btf(nullptr), state(NODATA)
 
 BTF::~BTF()
 {
+  release();
+}
+
+void BTF::release()
+{
+  // The modules are split from vmlinux, they go first
+  for (auto &[module, index] : modules_)
+    if (index)
+      btf__free(index->btf);
+  modules_.clear();
+  vmlinux_.reset();
   btf__free(btf);
+  btf = nullptr;
+  traceable_funcs_.clear();
+  state = NODATA;
 }
 
 static void dump_printf(void *ctx, const char *fmt, va_list args)
@@ -280,13 +305,21 @@ std::string BTF::type_of(const std::string& name, const std::string& field)
   if (!has_data())
     return std::string("");
 
-  __s32 type_id = btf__find_by_name(btf, btf_type_str(name).c_str());
-
-  if (type_id < 0)
-    return std::string("");
+  std::string type_name = btf_type_str(name);
+  auto &ids = index()->type_ids;
+  auto it = ids.find(type_name);
+  if (it != ids.end())
+    return type_of(btf, btf__type_by_id(btf, it->second), field);
 
-  const struct btf_type *type = btf__type_by_id(btf, type_id);
-  return type_of(type, field);
+  for (auto &[module, mod] : modules_)
+  {
+    if (!mod)
+      continue;
+    auto found = mod->type_ids.find(type_name);
+    if (found != mod->type_ids.end())
+      return type_of(mod->btf, btf__type_by_id(mod->btf, found->second), field);
+  }
+  return std::string("");
 }
 
 std::string BTF::type_of(const btf_type *type, const std::string &field)
@@ -294,6 +327,13 @@ std::string BTF::type_of(const btf_type *type, const std::string &field)
   if (!has_data())
     return std::string("");
 
+  return type_of(btf, type, field);
+}
+
+std::string BTF::type_of(const struct btf *data,
+                         const btf_type *type,
+                         const std::string &field)
+{
   if (!type ||
       (BTF_INFO_KIND(type->info) != BTF_KIND_STRUCT &&
        BTF_INFO_KIND(type->info) != BTF_KIND_UNION))
@@ -308,13 +348,13 @@ std::string BTF::type_of(const btf_type *type, const std::string &field)
 
   for (unsigned int i = 0; i < BTF_INFO_VLEN(type->info); i++)
   {
-    std::string m_name = btf__name_by_offset(btf, m[i].name_off);
+    std::string m_name = btf__name_by_offset(data, m[i].name_off);
 
     // anonymous struct/union
     if (m_name == "")
     {
-      const struct btf_type *type = btf__type_by_id(btf, m[i].type);
-      std::string type_name = type_of(type, field);
+      const struct btf_type *type = btf__type_by_id(data, m[i].type);
+      std::string type_name = type_of(data, type, field);
       if (!type_name.empty())
         return type_name;
     }
@@ -322,7 +362,7 @@ std::string BTF::type_of(const btf_type *type, const std::string &field)
     if (m_name != field)
       continue;
 
-    const struct btf_type *f = btf__type_by_id(btf, m[i].type);
+    const struct btf_type *f = btf__type_by_id(data, m[i].type);
 
     if (!f)
       break;
@@ -333,10 +373,10 @@ std::string BTF::type_of(const btf_type *type, const std::string &field)
            BTF_INFO_KIND(f->info) == BTF_KIND_VOLATILE ||
            BTF_INFO_KIND(f->info) == BTF_KIND_RESTRICT)
     {
-      f = btf__type_by_id(btf, f->type);
+      f = btf__type_by_id(data, f->type);
     }
 
-    return full_type_str(btf, f);
+    return full_type_str(data, f);
   }
 
   return std::string("");
@@ -365,7 +405,8 @@ static bool btf_type_is_modifier(const struct btf_type *t)
   }
 }
 
-const struct btf_type *BTF::btf_type_skip_modifiers(const struct btf_type *t)
+static const struct btf_type *btf_type_skip_modifiers(const struct btf *btf,
+                                                      const struct btf_type *t)
 {
   while (btf_type_is_modifier(t))
   {
@@ -375,14 +416,14 @@ const struct btf_type *BTF::btf_type_skip_modifiers(const struct btf_type *t)
   return t;
 }
 
-SizedType BTF::get_stype(__u32 id)
+SizedType BTF::get_stype(const struct btf *data, __u32 id)
 {
-  const struct btf_type *t = btf__type_by_id(btf, id);
+  const struct btf_type *t = btf__type_by_id(data, id);
 
   if (!t)
     return CreateNone();
 
-  t = btf_type_skip_modifiers(t);
+  t = btf_type_skip_modifiers(data, t);
 
   auto stype = CreateNone();
 
@@ -393,7 +434,7 @@ SizedType BTF::get_stype(__u32 id)
   }
   else if (btf_is_composite(t))
   {
-    const char *cast = btf_str(btf, t->name_off);
+    const char *cast = btf_str(data, t->name_off);
     assert(cast);
     std::string comp = btf_is_struct(t) ? "struct" : "union";
     stype = CreateRecord(t->size, comp + " " + cast);
@@ -401,41 +442,80 @@ SizedType BTF::get_stype(__u32 id)
   else if (btf_is_ptr(t))
   {
     // t->type is the pointee type
-    stype = CreatePointer(get_stype(t->type));
+    stype = CreatePointer(get_stype(data, t->type));
   }
 
   return stype;
 }
 
+SizedType BTF::get_stype(const std::string &type_name)
+{
+  if (!has_data())
+    return CreateNone();
+
+  // The kind of type the name asks for, the index has the bare names
+  auto kind_of = [](const std::string &name) {
+    if (name.rfind("struct ", 0) == 0)
+      return BTF_KIND_STRUCT;
+    if (name.rfind("union ", 0) == 0)
+      return BTF_KIND_UNION;
+    if (name.rfind("enum ", 0) == 0)
+      return BTF_KIND_ENUM;
+    return BTF_KIND_UNKN;
+  };
+  int kind = kind_of(type_name);
+  std::string name = type_name;
+  if (kind != BTF_KIND_UNKN)
+    name = name.substr(name.find(' ') + 1);
+
+  auto lookup = [&](const Index *idx) {
+    auto it = idx->type_ids.find(name);
+    if (it == idx->type_ids.end())
+      return CreateNone();
+    const struct btf_type *t = btf__type_by_id(idx->btf, it->second);
+    bool tagged = btf_is_composite(t) || btf_is_enum(t);
+    if ((kind == BTF_KIND_UNKN && tagged) ||
+        (kind != BTF_KIND_UNKN && (int)btf_kind(t) != kind))
+      return CreateNone();
+    return get_stype(idx->btf, it->second);
+  };
+
+  auto stype = lookup(index());
+  for (auto &[module, mod] : modules_)
+    if (stype.IsNoneTy() && mod)
+      stype = lookup(mod.get());
+  return stype;
+}
+
 int BTF::resolve_args(const std::string &func,
                       std::map<std::string, SizedType> &args,
-                      bool ret)
+                      bool ret,
+                      const std::string &module)
 {
   if (!has_data())
     throw std::runtime_error("BTF data not available");
 
-  __s32 id, max = (__s32)btf__get_nr_types(btf);
+  const Index *idx = index(module);
+  if (!idx)
+    throw std::runtime_error("no BTF data for module " + module +
+                             " (is it loaded?)");
+
   std::string name = func;
+  auto found = idx->func_ids.find(name);
 
-  for (id = 1; id <= max; id++)
+  if (found != idx->func_ids.end())
   {
-    const struct btf_type *t = btf__type_by_id(btf, id);
-
-    if (!btf_is_func(t))
-      continue;
-
-    const char *str = btf_str(btf, t->name_off);
+    const struct btf *data = idx->btf;
+    const struct btf_type *t = btf__type_by_id(data, found->second);
+    const char *str;
 
-    if (name != str)
-      continue;
-
-    t = btf__type_by_id(btf, t->type);
+    t = btf__type_by_id(data, t->type);
     if (!btf_is_func_proto(t))
     {
       throw std::runtime_error("not a function");
     }
 
-    if (!is_traceable_func(name))
+    if (!is_traceable_func(name, module))
     {
       if (traceable_funcs_.empty())
         throw std::runtime_error("could not read traceable functions from " +
@@ -457,13 +537,13 @@ int BTF::resolve_args(const std::string &func,
 
     for (; j < vlen; j++, p++)
     {
-      str = btf_str(btf, p->name_off);
+      str = btf_str(data, p->name_off);
       if (!str)
       {
         throw std::runtime_error("failed to resolve arguments");
       }
 
-      SizedType stype = get_stype(p->type);
+      SizedType stype = get_stype(data, p->type);
       stype.kfarg_idx = j;
       stype.is_kfarg = true;
       args.insert({ str, stype });
@@ -471,7 +551,7 @@ int BTF::resolve_args(const std::string &func,
 
     if (ret)
     {
-      SizedType stype = get_stype(t->type);
+      SizedType stype = get_stype(data, t->type);
       stype.kfarg_idx = j;
       stype.is_kfarg = true;
       args.insert({ "$retval", stype });
@@ -483,68 +563,85 @@ int BTF::resolve_args(const std::string &func,
   throw std::runtime_error("no BTF data for the function");
 }
 
-std::unique_ptr<std::istream> BTF::get_all_funcs() const
+int BTF::resolve_raw_tracepoint_args(const std::string &event,
+                                     std::map<std::string, SizedType> &args)
 {
-  __s32 id, max = (__s32)btf__get_nr_types(btf);
-  std::string type = std::string("");
-  struct btf_dump_opts opts = {
-    .ctx = &type,
-  };
-  struct btf_dump *dump;
-  std::string funcs;
-  char err_buf[256];
-  int err;
-
-  dump = btf_dump__new(btf, nullptr, &opts, dump_printf);
-  err = libbpf_get_error(dump);
-  if (err)
-  {
-    libbpf_strerror(err, err_buf, sizeof(err_buf));
-    LOG(ERROR) << "BTF: failed to initialize dump (" << err_buf << ")";
-    return nullptr;
-  }
+  if (!has_data())
+    throw std::runtime_error("BTF data not available");
 
-  for (id = 1; id <= max; id++)
+  std::string name = "__bpf_trace_" + event;
+  const Index *idx = index();
+  auto found = idx->func_ids.find(name);
+  for (auto &[module, mod] : modules_)
   {
-    const struct btf_type *t = btf__type_by_id(btf, id);
-
-    if (!btf_is_func(t))
-      continue;
-
-    const char *str = btf__name_by_offset(btf, t->name_off);
-    std::string func_name = str;
-
-    t = btf__type_by_id(btf, t->type);
-    if (!btf_is_func_proto(t))
-    {
-      /* bad.. */
-      if (!bt_verbose)
-        LOG(ERROR) << func_name << " function does not have FUNC_PROTO record";
+    if (found != idx->func_ids.end())
       break;
+    if (mod)
+    {
+      idx = mod.get();
+      found = idx->func_ids.find(name);
     }
-
-    if (!is_traceable_func(func_name))
-      continue;
-
-    if (btf_vlen(t) > arch::max_arg() + 1)
-      continue;
-
-    funcs += std::string(func_name) + "\n";
   }
+  if (found == idx->func_ids.end())
+    throw std::runtime_error("no BTF data for the tracepoint");
+
+  const struct btf *data = idx->btf;
+  const struct btf_type *t = btf__type_by_id(data, found->second);
+  t = btf__type_by_id(data, t->type);
+  if (!btf_is_func_proto(t))
+    throw std::runtime_error("not a function");
+
+  // The first parameter is the data of the tracepoint's probe, the program
+  // is passed the others
+  const struct btf_param *p = btf_params(t);
+  __u16 vlen = btf_vlen(t);
+  for (int j = 1; j < vlen; j++)
+  {
+    const char *str = btf_str(data, p[j].name_off);
+    if (!str)
+      throw std::runtime_error("failed to resolve arguments");
+
+    SizedType stype = get_stype(data, p[j].type);
+    stype.kfarg_idx = j - 1;
+    stype.is_kfarg = true;
+    args.insert({ str, stype });
+  }
+  return 0;
+}
 
-  if (id != (max + 1))
-    LOG(ERROR) << "BTF data inconsistency " << id << "," << max;
-
-  btf_dump__free(dump);
+std::unique_ptr<std::istream> BTF::get_all_funcs(
+    const std::string &module) const
+{
+  if (!has_data())
+    return nullptr;
+  const Index *idx = index(module);
+  if (!idx)
+    return nullptr;
+  return std::make_unique<std::istringstream>(idx->traceable_func_list);
+}
 
-  return std::make_unique<std::istringstream>(funcs);
+__u32 BTF::module_func_id(const std::string &module,
+                          const std::string &func) const
+{
+  if (!has_data())
+    return 0;
+  const Index *idx = index(module);
+  if (!idx)
+    return 0;
+  auto found = idx->func_ids.find(func);
+  return found != idx->func_ids.end() ? found->second : 0;
 }
 
 std::map<std::string, std::vector<std::string>> BTF::get_params(
-    const std::set<std::string> &funcs) const
+    const std::set<std::string> &funcs,
+    const std::string &module) const
 {
 #ifdef HAVE_LIBBPF_BTF_DUMP_EMIT_TYPE_DECL
-  __s32 id, max = (__s32)btf__get_nr_types(btf);
+  const Index *idx = has_data() ? index(module) : nullptr;
+  if (!idx)
+    return {};
+  const struct btf *btf = idx->btf;
+
   std::string type = std::string("");
   struct btf_dump_opts opts = {
     .ctx = &type,
@@ -563,19 +660,13 @@ std::map<std::string, std::vector<std::string>> BTF::get_params(
   }
 
   std::map<std::string, std::vector<std::string>> params;
-  for (id = 1; id <= max; id++)
+  for (auto &func_name : funcs)
   {
-    const struct btf_type *t = btf__type_by_id(btf, id);
-
-    if (!btf_is_func(t))
-      continue;
-
-    const char *str = btf__name_by_offset(btf, t->name_off);
-    std::string func_name = str;
-
-    if (funcs.find(func_name) == funcs.end())
+    auto found = idx->func_ids.find(func_name);
+    if (found == idx->func_ids.end())
       continue;
 
+    const struct btf_type *t = btf__type_by_id(btf, found->second);
     t = btf__type_by_id(btf, t->type);
 
     _Pragma("GCC diagnostic push")
@@ -622,15 +713,14 @@ std::map<std::string, std::vector<std::string>> BTF::get_params(
     params[func_name].push_back(type + " retval");
   }
 
-  if (id != (max + 1))
-    LOG(ERROR) << "BTF data inconsistency " << id << "," << max;
-
   btf_dump__free(dump);
 
   return params;
 #else
+  (void)funcs;
+  (void)module;
   LOG(ERROR) << "Could not get kfunc arguments "
-                "(HAVE_LIBBPF_BTF_DUMP_EMIT_TYPE_DECL is not set)" return {};
+                "(HAVE_LIBBPF_BTF_DUMP_EMIT_TYPE_DECL is not set)";
   return {};
 #endif
 }
@@ -711,12 +801,430 @@ std::set<std::string> BTF::get_all_structs() const
   return struct_set;
 }
 
-bool BTF::is_traceable_func(const std::string &func_name) const
+namespace {
+
+// Reads the definitions of types from BTF into Structs, the way the clang
+// parser reads them from the header c_def() writes for those types
+class StructResolver
+{
+public:
+  // Types are looked for from first_id on, e.g. only among the ones of a
+  // module, the ones it uses from vmlinux are still read
+  StructResolver(const struct btf *btf,
+                 std::map<std::string, Struct> &structs,
+                 std::map<std::string, uint64_t> &enums,
+                 __u32 first_id = 1)
+      : btf_(btf), structs_(structs), enums_(enums), first_id_(first_id)
+  {
+  }
+
+  // Types c_def() dumps for set
+  std::vector<__u32> find_types(const std::unordered_set<std::string> &set)
+  {
+    std::vector<__u32> ids;
+    std::unordered_set<std::string> myset(set);
+    __s32 id, max = (__s32)btf__get_nr_types(btf_);
+
+    for (id = first_id_; id <= max && myset.size(); id++)
+    {
+      const struct btf_type *t = btf__type_by_id(btf_, id);
+      if (btf_is_enum(t))
+      {
+        const struct btf_enum *p = btf_enum(t);
+        uint16_t vlen = btf_vlen(t);
+        for (int e = 0; e < vlen; ++e, ++p)
+        {
+          auto it = myset.find(btf_str(btf_, p->name_off));
+          if (it != myset.end())
+          {
+            ids.push_back(id);
+            myset.erase(it);
+            break;
+          }
+        }
+      }
+
+      auto it = myset.find(full_type_str(btf_, t));
+      if (it != myset.end())
+      {
+        ids.push_back(id);
+        myset.erase(it);
+      }
+    }
+    return ids;
+  }
+
+  // Collects the structs, unions and enums btf_dump defines when dumping id:
+  // the ones it embeds, but not the named ones it only points to
+  void add_type(__u32 id, bool through_ptr = false)
+  {
+    const struct btf_type *t = btf__type_by_id(btf_, id);
+    if (!t)
+      return;
+
+    if (btf_is_composite(t))
+    {
+      if ((through_ptr && t->name_off) || !defined_.insert(id).second)
+        return;
+      const struct btf_member *m = btf_members(t);
+      for (uint16_t i = 0; i < btf_vlen(t); i++, m++)
+        add_type(m->type);
+    }
+    else if (btf_is_enum(t))
+      defined_.insert(id);
+    else if (btf_is_ptr(t))
+      add_type(t->type, true);
+    else if (btf_is_array(t))
+      add_type(btf_array(t)->type, through_ptr);
+    else if (btf_is_typedef(t) || btf_is_mod(t))
+      add_type(t->type, through_ptr);
+    else if (btf_is_func_proto(t))
+    {
+      add_type(t->type, through_ptr);
+      const struct btf_param *p = btf_params(t);
+      for (uint16_t i = 0; i < btf_vlen(t); i++, p++)
+        add_type(p->type, through_ptr);
+    }
+  }
+
+  // Named structs and unions fields of the defined ones point to, which
+  // aren't defined themselves
+  std::unordered_set<std::string> get_incomplete_types()
+  {
+    std::unordered_set<std::string> complete_types;
+    for (__u32 id : defined_)
+    {
+      const struct btf_type *t = btf__type_by_id(btf_, id);
+      if (btf_is_composite(t) && t->name_off)
+        complete_types.insert(record_name(t));
+    }
+
+    std::unordered_set<std::string> incomplete_types;
+    for (__u32 id : defined_)
+    {
+      const struct btf_type *t = btf__type_by_id(btf_, id);
+      if (!btf_is_composite(t))
+        continue;
+
+      const struct btf_member *m = btf_members(t);
+      for (uint16_t i = 0; i < btf_vlen(t); i++, m++)
+      {
+        auto mt = skip_typedefs(btf__type_by_id(btf_, m->type));
+        if (!mt || !btf_is_ptr(mt))
+          continue;
+        mt = skip_typedefs(btf__type_by_id(btf_, mt->type));
+        if (!mt || !(btf_is_composite(mt) || btf_is_fwd(mt)) || !mt->name_off)
+          continue;
+        auto type_name = record_name(mt);
+        if (complete_types.find(type_name) == complete_types.end())
+          incomplete_types.emplace(std::move(type_name));
+      }
+    }
+    return incomplete_types;
+  }
+
+  // Fills in the structs and enums that were collected
+  void resolve()
+  {
+    for (__u32 id : defined_)
+    {
+      const struct btf_type *t = btf__type_by_id(btf_, id);
+      if (btf_is_enum(t))
+      {
+        const struct btf_enum *p = btf_enum(t);
+        for (uint16_t e = 0; e < btf_vlen(t); ++e, ++p)
+          enums_[btf_str(btf_, p->name_off)] = static_cast<int64_t>(p->val);
+      }
+      // Anonymous ones are resolved along with the fields of that type
+      else if (t->name_off)
+        add_fields(t, record_name(t), 0);
+    }
+  }
+
+private:
+  const struct btf_type *skip_typedefs(const struct btf_type *t) const
+  {
+    while (t && (btf_is_typedef(t) || btf_is_mod(t)))
+      t = btf__type_by_id(btf_, t->type);
+    return t;
+  }
+
+  std::string record_name(const struct btf_type *t) const
+  {
+    bool is_union = btf_is_union(t) || (btf_is_fwd(t) && btf_kflag(t));
+    return std::string(is_union ? "union " : "struct ") +
+           btf_str(btf_, t->name_off);
+  }
+
+  bool is_plain_char(const struct btf_type *t) const
+  {
+    return std::strcmp(btf_str(btf_, t->name_off), "char") == 0;
+  }
+
+  void add_fields(const struct btf_type *t,
+                  const std::string &name,
+                  size_t base_bit_offset)
+  {
+    const struct btf_member *m = btf_members(t);
+    for (uint16_t i = 0; i < btf_vlen(t); i++, m++)
+    {
+      size_t bit_offset = base_bit_offset + btf_member_bit_offset(t, i);
+      auto mt = btf__type_by_id(btf_, m->type);
+
+      if (!m->name_off)
+      {
+        // Fields of anonymous structs and unions are fields of the named one
+        // they are in
+        mt = skip_typedefs(mt);
+        if (mt && btf_is_composite(mt))
+          add_fields(mt, name, bit_offset);
+        continue;
+      }
+
+      // Without kind_flag, the bits of bitfields are in their int type
+      size_t bit_width = btf_member_bitfield_size(t, i);
+      auto int_type = skip_typedefs(mt);
+      if (!bit_width && int_type && btf_is_int(int_type) &&
+          (btf_int_bits(int_type) != int_type->size * 8 ||
+           btf_int_offset(int_type)))
+      {
+        bit_width = btf_int_bits(int_type);
+        bit_offset += btf_int_offset(int_type);
+      }
+
+      std::string ident = btf_str(btf_, m->name_off);
+      auto type = get_stype(m->type, name, ident);
+      auto &field = structs_[name].fields[ident];
+      field.type = type;
+      field.offset = bit_offset / 8;
+      field.is_bitfield = bit_width != 0;
+      field.bitfield = field.is_bitfield ? Bitfield::Create(bit_offset,
+                                                            bit_width)
+                                         : Bitfield{};
+      field.is_data_loc = false;
+      structs_[name].size = t->size;
+    }
+  }
+
+  // Type of the field ident of parent, like get_sized_type() gives for the
+  // clang type
+  SizedType get_stype(__u32 id,
+                      const std::string &parent,
+                      const std::string &ident)
+  {
+    auto t = btf__type_by_id(btf_, id);
+    std::string typedef_name;
+    while (t && (btf_is_typedef(t) || btf_is_mod(t)))
+    {
+      if (btf_is_typedef(t))
+        typedef_name = btf_str(btf_, t->name_off);
+      t = btf__type_by_id(btf_, t->type);
+    }
+    if (!t)
+      return CreateNone();
+
+    if (btf_is_int(t))
+    {
+      bool is_signed = !(btf_int_encoding(t) & BTF_INT_BOOL) &&
+                       ((btf_int_encoding(t) & BTF_INT_SIGNED) ||
+                        (is_plain_char(t) && std::is_signed<char>::value));
+      return is_signed ? CreateInt(t->size * 8) : CreateUInt(t->size * 8);
+    }
+    else if (btf_is_enum(t))
+      return CreateUInt(t->size * 8);
+    else if (btf_is_ptr(t))
+      return CreatePointer(get_stype(t->type, parent, ident));
+    else if (btf_is_array(t))
+    {
+      const struct btf_array *array = btf_array(t);
+      auto elem = skip_typedefs(btf__type_by_id(btf_, array->type));
+      if (elem && btf_is_int(elem) && is_plain_char(elem))
+        return CreateString(array->nelems);
+      return CreateArray(array->nelems, get_stype(array->type, parent, ident));
+    }
+    else if (btf_is_fwd(t))
+      return CreateRecord(0, record_name(t));
+    else if (btf_is_composite(t))
+    {
+      if (t->name_off)
+        return CreateRecord(t->size, record_name(t));
+
+      // Clang names anonymous types after their typedef, or after the
+      // scope they're defined in
+      std::string name = typedef_name;
+      if (name.empty())
+      {
+        std::string scope = parent;
+        if (scope.compare(0, 7, "struct ") == 0)
+          scope = scope.substr(7);
+        else if (scope.compare(0, 6, "union ") == 0)
+          scope = scope.substr(6);
+        name = std::string(btf_is_union(t) ? "union " : "struct ") + scope +
+               "::(anonymous " + ident + ")";
+      }
+      if (anonymous_.insert(name).second)
+        add_fields(t, name, 0);
+      return CreateRecord(t->size, name);
+    }
+    return CreateNone();
+  }
+
+  const struct btf *btf_;
+  std::map<std::string, Struct> &structs_;
+  std::map<std::string, uint64_t> &enums_;
+  __u32 first_id_;
+  // Structs, unions and enums the header defines
+  std::set<__u32> defined_;
+  std::unordered_set<std::string> anonymous_;
+};
+
+// Resolves the types of set, and the ones their fields point to, up to
+// max_iterations levels deep
+void resolve_types(StructResolver &resolver,
+                   std::unordered_set<std::string> &set,
+                   unsigned int max_iterations)
+{
+  for (unsigned int i = 0;; i++)
+  {
+    for (__u32 id : resolver.find_types(set))
+      resolver.add_type(id);
+    if (i >= max_iterations)
+      break;
+
+    size_t types_cnt = set.size();
+    auto incomplete_types = resolver.get_incomplete_types();
+    set.insert(incomplete_types.cbegin(), incomplete_types.cend());
+    if (types_cnt == set.size())
+      break;
+  }
+  resolver.resolve();
+}
+
+} // namespace
+
+void BTF::resolve_structs(std::unordered_set<std::string> &set,
+                          unsigned int max_iterations,
+                          std::map<std::string, Struct> &structs,
+                          std::map<std::string, uint64_t> &enums) const
+{
+  if (!has_data())
+    return;
+
+  StructResolver resolver(btf, structs, enums);
+  resolve_types(resolver, set, max_iterations);
+
+  // The types vmlinux doesn't have are looked for in the modules the
+  // probes loaded the BTF of
+  for (auto &[module, idx] : modules_)
+  {
+    if (!idx)
+      continue;
+    std::unordered_set<std::string> missing;
+    for (auto &name : set)
+      if (structs.find(name) == structs.end())
+        missing.insert(name);
+    if (missing.empty())
+      break;
+
+    StructResolver module_resolver(idx->btf, structs, enums, idx->first_id);
+    resolve_types(module_resolver, missing, max_iterations);
+    set.insert(missing.cbegin(), missing.cend());
+  }
+}
+
+void BTF::prefetch_index() const
+{
+  if (has_data())
+    index();
+}
+
+const BTF::Index *BTF::index(const std::string &module) const
+{
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  if (module.empty())
+  {
+    if (!vmlinux_)
+    {
+      vmlinux_ = std::make_unique<Index>();
+      vmlinux_->btf = btf;
+      build_index(*vmlinux_, module);
+    }
+    return vmlinux_.get();
+  }
+
+  auto found = modules_.find(module);
+  if (found != modules_.end())
+    return found->second.get();
+
+  auto &idx = modules_[module];
+#ifdef HAVE_LIBBPF_BTF_SPLIT
+  if (module.find('/') != std::string::npos)
+    return nullptr;
+  std::string path = "/sys/kernel/btf/" + module;
+  struct btf *data = btf__parse_split(path.c_str(), btf);
+  if (libbpf_get_error(data))
+  {
+    if (bt_debug != DebugLevel::kNone)
+      LOG(ERROR) << "BTF: failed to read data for module " << module
+                 << " from: " << path;
+    return nullptr;
+  }
+  if (bt_debug != DebugLevel::kNone)
+    std::cerr << "BTF: using data from " << path << std::endl;
+
+  idx = std::make_unique<Index>();
+  idx->btf = data;
+  idx->first_id = btf__get_nr_types(btf) + 1;
+  build_index(*idx, module);
+#endif
+  return idx.get();
+}
+
+void BTF::build_index(Index &idx, const std::string &module) const
+{
+  __s32 id, max = (__s32)btf__get_nr_types(idx.btf);
+  for (id = idx.first_id; id <= max; id++)
+  {
+    const struct btf_type *t = btf__type_by_id(idx.btf, id);
+    if (!t->name_off)
+      continue;
+    std::string name = btf__name_by_offset(idx.btf, t->name_off);
+
+    if (!btf_is_func(t))
+    {
+      // The first one, like btf__find_by_name()
+      idx.type_ids.emplace(std::move(name), id);
+      continue;
+    }
+
+    idx.func_ids.emplace(name, id);
+    const struct btf_type *proto = btf__type_by_id(idx.btf, t->type);
+    if (!btf_is_func_proto(proto))
+    {
+      /* bad.. */
+      if (!bt_verbose)
+        LOG(ERROR) << name << " function does not have FUNC_PROTO record";
+      continue;
+    }
+    if (is_traceable_func(name, module) &&
+        btf_vlen(proto) <= arch::max_arg() + 1)
+      idx.traceable_func_list += name + "\n";
+  }
+}
+
+bool BTF::is_traceable_func(const std::string &func_name,
+                            const std::string &module) const
 {
 #ifdef FUZZ
   (void)func_name;
+  (void)module;
   return true;
 #else
+  // available_filter_functions lists the functions of modules as
+  // "func [module]"
+  if (!module.empty())
+    return traceable_funcs_.find(func_name + " [" + module + "]") !=
+           traceable_funcs_.end();
   return traceable_funcs_.find(func_name) != traceable_funcs_.end();
 #endif
 }
@@ -730,6 +1238,10 @@ BTF::BTF() { }
 
 BTF::~BTF() { }
 
+void BTF::release()
+{
+}
+
 std::string BTF::c_def(const std::unordered_set<std::string>& set
                        __attribute__((__unused__))) const
 {
@@ -744,26 +1256,62 @@ std::string BTF::type_of(const std::string& name __attribute__((__unused__)),
 int BTF::resolve_args(const std::string &func __attribute__((__unused__)),
                       std::map<std::string, SizedType>& args
                       __attribute__((__unused__)),
-                      bool ret __attribute__((__unused__)))
+                      bool ret __attribute__((__unused__)),
+                      const std::string &module __attribute__((__unused__)))
 {
   return -1;
 }
 
+int BTF::resolve_raw_tracepoint_args(
+    const std::string &event __attribute__((__unused__)),
+    std::map<std::string, SizedType> &args __attribute__((__unused__)))
+{
+  return -1;
+}
+
+__u32 BTF::module_func_id(const std::string &module __attribute__((__unused__)),
+                          const std::string &func
+                          __attribute__((__unused__))) const
+{
+  return 0;
+}
+
+void BTF::prefetch_index() const
+{
+}
+
+SizedType BTF::get_stype(const std::string &type_name __attribute__((__unused__)))
+{
+  return CreateNone();
+}
+
 std::set<std::string> BTF::get_all_structs() const
 {
   return {};
 }
 
-std::unique_ptr<std::istream> BTF::get_all_funcs() const
+std::unique_ptr<std::istream> BTF::get_all_funcs(
+    const std::string &module __attribute__((__unused__))) const
 {
   return nullptr;
 }
 
 std::map<std::string, std::vector<std::string>> BTF::get_params(
-    const std::set<std::string>& funcs __attribute__((__unused__))) const
+    const std::set<std::string>& funcs __attribute__((__unused__)),
+    const std::string &module __attribute__((__unused__))) const
 {
   return {};
 }
+
+void BTF::resolve_structs(std::unordered_set<std::string> &set
+                          __attribute__((__unused__)),
+                          unsigned int max_iterations __attribute__((__unused__)),
+                          std::map<std::string, Struct> &structs
+                          __attribute__((__unused__)),
+                          std::map<std::string, uint64_t> &enums
+                          __attribute__((__unused__))) const
+{
+}
 } // namespace bpftrace
 
 #endif // HAVE_LIBBPF_BTF_DUMP
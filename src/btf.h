@@ -3,10 +3,13 @@
 #include "types.h"
 #include <linux/types.h>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
 
 struct btf;
@@ -14,6 +17,8 @@ struct btf_type;
 
 namespace bpftrace {
 
+struct Struct;
+
 class BTF
 {
   enum state
@@ -27,27 +32,92 @@ public:
   ~BTF();
 
   bool has_data(void) const;
+  // Frees the data once nothing is left to compile, has_data() is then false
+  void release();
+  // File the data was read from, with its size and modification time
+  const std::string &id() const
+  {
+    return id_;
+  }
   std::string c_def(const std::unordered_set<std::string>& set) const;
+  // Reads the definitions of the types in set, and of the types they embed,
+  // the way the clang parser would from c_def(set). Structs their fields
+  // point to are added to set and read too, max_iterations levels deep.
+  void resolve_structs(std::unordered_set<std::string> &set,
+                       unsigned int max_iterations,
+                       std::map<std::string, Struct> &structs,
+                       std::map<std::string, uint64_t> &enums) const;
+  // Types not in vmlinux are looked up in the modules loaded so far
   std::string type_of(const std::string& name, const std::string& field);
   std::string type_of(const btf_type* type, const std::string& field);
 
+  // The type named type_name, e.g. "struct task_struct" or "pid_t", as the
+  // fields resolve_structs() reads have it. None if there's no such type.
+  SizedType get_stype(const std::string &type_name);
+
   std::set<std::string> get_all_structs() const;
-  std::unique_ptr<std::istream> get_all_funcs() const;
+  // The functions of module, or of vmlinux without one
+  std::unique_ptr<std::istream> get_all_funcs(
+      const std::string &module = "") const;
   std::map<std::string, std::vector<std::string>> get_params(
-      const std::set<std::string>& funcs) const;
+      const std::set<std::string> &funcs,
+      const std::string &module = "") const;
 
   int resolve_args(const std::string &func,
                    std::map<std::string, SizedType>& args,
-                   bool ret);
+                   bool ret,
+                   const std::string &module = "");
+  // The arguments of the tracepoint event as a raw tracepoint program reads
+  // them, from the parameters of its __bpf_trace_<event> function in the
+  // BTF of vmlinux or of a loaded module
+  int resolve_raw_tracepoint_args(const std::string &event,
+                                  std::map<std::string, SizedType> &args);
+  // Id of func in the BTF of module, which the kernel needs to load a kfunc
+  // program for it, 0 if there is none
+  __u32 module_func_id(const std::string &module,
+                       const std::string &func) const;
+  // Builds the index of vmlinux ahead of its first use, from another thread
+  // while the program is parsed
+  void prefetch_index() const;
 
 private:
-  SizedType get_stype(__u32 id);
-  const struct btf_type* btf_type_skip_modifiers(const struct btf_type* t);
-  bool is_traceable_func(const std::string& func_name) const;
+  // Name indexes of the types and functions of the vmlinux BTF, or of the
+  // BTF of a module split from it
+  struct Index
+  {
+    struct btf *btf = nullptr;
+    // First type of the module, the ones before it are vmlinux's
+    __u32 first_id = 1;
+    std::unordered_map<std::string, __u32> type_ids;
+    std::unordered_map<std::string, __u32> func_ids;
+    // Traceable functions with few enough arguments, as get_all_funcs()
+    // lists them
+    std::string traceable_func_list;
+  };
+
+  SizedType get_stype(const struct btf *btf, __u32 id);
+  std::string type_of(const struct btf *btf,
+                      const btf_type *type,
+                      const std::string &field);
+  bool is_traceable_func(const std::string &func_name,
+                         const std::string &module = "") const;
+  // The index of vmlinux, or of module, whose BTF is read from
+  // /sys/kernel/btf the first time it's asked for. nullptr if module has no
+  // BTF.
+  const Index *index(const std::string &module = "") const;
+  void build_index(Index &index, const std::string &module) const;
 
   struct btf* btf;
   enum state state = NODATA;
+  std::string id_;
   std::unordered_set<std::string> traceable_funcs_;
+  // The vmlinux BTF holds 100k+ types, scanning them all for every function
+  // a probe or -l looks up is most of what kfunc scripts take to start. The
+  // indexes are built on first use, and modules only read when needed.
+  // Held while an index is looked up or built, see prefetch_index()
+  mutable std::mutex index_mutex_;
+  mutable std::unique_ptr<Index> vmlinux_;
+  mutable std::map<std::string, std::unique_ptr<Index>> modules_;
 };
 
 inline bool BTF::has_data(void) const
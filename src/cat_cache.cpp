@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <unistd.h>
+
+#include "cat_cache.h"
+
+namespace bpftrace {
+
+namespace {
+
+// Past that many paths, the expired ones are dropped on the next insert
+const size_t MAX_ENTRIES = 4096;
+const size_t BUFSIZE = 4096;
+
+// Reads up to max_bytes of fd, from offset 0 with pread() or from where it is
+// with read()
+bool read_fd(int fd, bool positional, size_t max_bytes, std::string &out)
+{
+  char buf[BUFSIZE];
+  off_t off = 0;
+  while (out.size() < max_bytes)
+  {
+    size_t size = std::min(BUFSIZE, max_bytes - out.size());
+    ssize_t n = positional ? pread(fd, buf, size, off) : read(fd, buf, size);
+    if (n == 0)
+      break;
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    out.append(buf, n);
+    off += n;
+  }
+  return true;
+}
+
+} // namespace
+
+CatCache::CatCache(uint64_t ttl_ms, size_t max_fds, size_t max_bytes)
+    : ttl_(ttl_ms), max_fds_(max_fds), max_bytes_(max_bytes)
+{
+}
+
+CatCache::~CatCache()
+{
+  for (auto &fd : fds_)
+    close(fd.second.fd);
+}
+
+bool CatCache::read(const std::string &path,
+                    std::string &out,
+                    std::string &error)
+{
+  if (ttl_.count())
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = entries_.find(path);
+    if (entry != entries_.end() && Clock::now() - entry->second.read < ttl_)
+    {
+      out = entry->second.contents;
+      return true;
+    }
+  }
+
+  if (!read_file(path, out, error))
+    return false;
+
+  if (ttl_.count())
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = Clock::now();
+    if (entries_.size() >= MAX_ENTRIES)
+    {
+      for (auto it = entries_.begin(); it != entries_.end();)
+        it = now - it->second.read < ttl_ ? std::next(it) : entries_.erase(it);
+      if (entries_.size() >= MAX_ENTRIES)
+        entries_.clear();
+    }
+    entries_[path] = Entry{ out, now };
+  }
+  return true;
+}
+
+bool CatCache::read_file(const std::string &path,
+                         std::string &out,
+                         std::string &error)
+{
+  out.clear();
+  int fd = take_fd(path);
+  if (fd >= 0)
+  {
+    if (read_fd(fd, true, max_bytes_, out))
+    {
+      give_fd(path, fd);
+      return true;
+    }
+    // E.g. the process of a /proc file exited, opened again below in case
+    // the path now refers to something else
+    close(fd);
+    out.clear();
+  }
+
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    error = "failed to open file '" + path + "': " + strerror(errno);
+    return false;
+  }
+
+  if (max_fds_)
+  {
+    if (read_fd(fd, true, max_bytes_, out))
+    {
+      give_fd(path, fd);
+      return true;
+    }
+    // Pipes and the like, pread() didn't move the offset
+    out.clear();
+  }
+
+  bool ok = read_fd(fd, false, max_bytes_, out);
+  if (!ok)
+    error = "failed to read file '" + path + "': " + strerror(errno);
+  close(fd);
+  return ok;
+}
+
+int CatCache::take_fd(const std::string &path)
+{
+  if (!max_fds_)
+    return -1;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = fds_.find(path);
+  if (it == fds_.end())
+    return -1;
+  int fd = it->second.fd;
+  lru_.erase(it->second.lru);
+  fds_.erase(it);
+  return fd;
+}
+
+void CatCache::give_fd(const std::string &path, int fd)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Another worker opened it meanwhile
+  if (fds_.count(path))
+  {
+    close(fd);
+    return;
+  }
+  if (fds_.size() >= max_fds_)
+  {
+    auto oldest = fds_.find(lru_.back());
+    close(oldest->second.fd);
+    fds_.erase(oldest);
+    lru_.pop_back();
+  }
+  lru_.push_front(path);
+  fds_.emplace(path, Fd{ fd, lru_.begin() });
+}
+
+} // namespace bpftrace
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace bpftrace {
+
+/**
+   Reads the files of cat(), see BPFTRACE_CAT_CACHE_MS and BPFTRACE_CAT_FDS.
+
+   What was read from a path is given again for ttl_ms, rather than reading
+   the file once per event. Up to max_fds files are kept open and read again
+   with pread() from the start (the least recently read one is closed for a
+   new one), files pread() doesn't work on are opened every time. Safe to
+   call from the workers of SystemPool.
+*/
+class CatCache
+{
+public:
+  CatCache(uint64_t ttl_ms, size_t max_fds, size_t max_bytes);
+  ~CatCache();
+
+  CatCache(const CatCache &) = delete;
+  CatCache &operator=(const CatCache &) = delete;
+
+  /**
+     Contents of the file at path, at most max_bytes of it. False with error
+     set when it couldn't be read.
+  */
+  bool read(const std::string &path, std::string &out, std::string &error);
+
+private:
+  using Clock = std::chrono::steady_clock;
+  struct Entry
+  {
+    std::string contents;
+    Clock::time_point read;
+  };
+  struct Fd
+  {
+    int fd;
+    std::list<std::string>::iterator lru;
+  };
+
+  bool read_file(const std::string &path,
+                 std::string &out,
+                 std::string &error);
+  // An open fd of path out of the pool, so that it's only used by the
+  // caller until it's given back, -1 if there's none
+  int take_fd(const std::string &path);
+  void give_fd(const std::string &path, int fd);
+
+  std::chrono::milliseconds ttl_;
+  size_t max_fds_;
+  size_t max_bytes_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::unordered_map<std::string, Fd> fds_;
+  // Paths of fds_, the most recently read first
+  std::list<std::string> lru_;
+};
+
+} // namespace bpftrace
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "cgroup_paths.h"
+#include "resolve_cgroupid.h"
+
+namespace bpftrace {
+
+static std::string find_cgroup2_root()
+{
+  // <device> <mount point> <type> <options> <dump> <pass>
+  std::ifstream mounts("/proc/self/mounts");
+  std::string line;
+  while (std::getline(mounts, line))
+  {
+    std::istringstream fields(line);
+    std::string device, mount_point, type;
+    if (fields >> device >> mount_point >> type && type == "cgroup2")
+      return mount_point;
+  }
+  return "";
+}
+
+CgroupPaths::CgroupPaths(std::string root, IdOf id_of)
+    : root_(std::move(root)), id_of_(std::move(id_of))
+{
+  if (!id_of_)
+  {
+    // The id of the file handle is the one bpf_get_current_cgroup_id()
+    // returns, the inode number only matches it on recent kernels
+    id_of_ = [](const std::string &path) -> std::optional<uint64_t> {
+      try
+      {
+        return bpftrace_linux::resolve_cgroupid(path);
+      }
+      catch (const std::runtime_error &)
+      {
+        return std::nullopt;
+      }
+    };
+  }
+}
+
+std::optional<std::string> CgroupPaths::resolve(uint64_t id)
+{
+  auto found = paths_.find(id);
+  if (found != paths_.end())
+    return found->second;
+
+  auto now = std::chrono::steady_clock::now();
+  if (refreshed_ != std::chrono::steady_clock::time_point() &&
+      now - refreshed_ < std::chrono::seconds(1))
+    return std::nullopt;
+  refresh();
+  refreshed_ = now;
+
+  found = paths_.find(id);
+  if (found != paths_.end())
+    return found->second;
+  return std::nullopt;
+}
+
+void CgroupPaths::refresh()
+{
+  if (!found_root_)
+  {
+    if (root_.empty())
+      root_ = find_cgroup2_root();
+    found_root_ = true;
+  }
+  if (!root_.empty())
+    scan("");
+}
+
+void CgroupPaths::scan(const std::string &path)
+{
+  std::string dir_path = root_ + path;
+  struct stat st;
+  if (stat(dir_path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+  {
+    forget(path);
+    return;
+  }
+
+  auto found = dirs_.find(path);
+  if (found == dirs_.end() || found->second.mtime.tv_sec != st.st_mtim.tv_sec ||
+      found->second.mtime.tv_nsec != st.st_mtim.tv_nsec)
+  {
+    std::vector<std::string> children;
+    DIR *dir = opendir(dir_path.c_str());
+    if (!dir)
+    {
+      forget(path);
+      return;
+    }
+    while (struct dirent *entry = readdir(dir))
+    {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..")
+        continue;
+      // The files of the controllers are most of the entries
+      if (entry->d_type == DT_DIR)
+        children.push_back(name);
+      else if (entry->d_type == DT_UNKNOWN)
+      {
+        struct stat child;
+        if (stat((dir_path + "/" + name).c_str(), &child) == 0 &&
+            S_ISDIR(child.st_mode))
+          children.push_back(name);
+      }
+    }
+    closedir(dir);
+    std::sort(children.begin(), children.end());
+
+    Dir &d = dirs_[path];
+    for (auto &child : d.children)
+    {
+      if (!std::binary_search(children.begin(), children.end(), child))
+        forget(path + "/" + child);
+    }
+    // An mtime read before the directory was changes the next time
+    d.mtime = st.st_mtim;
+    d.children = std::move(children);
+    // Also read again for a cgroup removed and created again with the same
+    // name, the mtime of its directory isn't the same
+    if (auto id = id_of_(dir_path))
+      paths_[*id] = path.empty() ? "/" : path;
+  }
+
+  // Copied, forgetting a path below invalidates the reference
+  std::vector<std::string> children = dirs_[path].children;
+  for (auto &child : children)
+    scan(path + "/" + child);
+}
+
+void CgroupPaths::forget(const std::string &path)
+{
+  auto found = dirs_.find(path);
+  if (found == dirs_.end())
+    return;
+  std::vector<std::string> children = std::move(found->second.children);
+  dirs_.erase(found);
+  for (auto &child : children)
+    forget(path + "/" + child);
+}
+
+} // namespace bpftrace
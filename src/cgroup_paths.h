@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bpftrace {
+
+/**
+   Index of the cgroup2 hierarchy from the cgroup ids, as returned by the
+   cgroup builtin, to their paths.
+
+   The hierarchy is walked once when the first id is looked up, and again
+   when an id isn't found, at most once a second. Only the directories whose
+   mtime changed since, i.e. which had cgroups created or removed below them,
+   are read again, the others are only stat()ed.
+*/
+class CgroupPaths
+{
+public:
+  using IdOf = std::function<std::optional<uint64_t>(const std::string &)>;
+
+  // The cgroup2 hierarchy mounted on root, found in /proc/self/mounts if
+  // empty. id_of reads the id of a cgroup from its directory.
+  explicit CgroupPaths(std::string root = "", IdOf id_of = nullptr);
+
+  /**
+     The path of the cgroup from the root of the hierarchy, e.g.
+     "/system.slice/sshd.service". Cgroups removed since they were seen keep
+     their path, their events can still be in the buffers. Returns nullopt
+     if the cgroup isn't found.
+  */
+  std::optional<std::string> resolve(uint64_t id);
+
+  // Walk the hierarchy again, whether or not an id is missing
+  void refresh();
+
+private:
+  struct Dir
+  {
+    struct timespec mtime = {};
+    std::vector<std::string> children;
+  };
+  void scan(const std::string &path);
+  void forget(const std::string &path);
+
+  std::string root_;
+  IdOf id_of_;
+  bool found_root_ = false;
+  // By the path from the root, "" being the root itself
+  std::unordered_map<std::string, Dir> dirs_;
+  std::unordered_map<uint64_t, std::string> paths_;
+  std::chrono::steady_clock::time_point refreshed_;
+};
+
+} // namespace bpftrace
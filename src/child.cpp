@@ -7,6 +7,7 @@
 #include <sys/eventfd.h>
 #include <sys/prctl.h>
 #include <sys/ptrace.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <system_error>
@@ -25,6 +26,10 @@ constexpr uint64_t CHILD_GO = 'g';
 constexpr uint64_t CHILD_PTRACE = 'p';
 constexpr unsigned int STACK_SIZE = (64 * 1024UL);
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
 std::system_error SYS_ERROR(std::string msg)
 {
   return std::system_error(errno, std::generic_category(), msg);
@@ -146,6 +151,12 @@ ChildProc::ChildProc(std::string cmd)
 
   child_pid_ = cpid;
   state_ = State::FORKED;
+
+  // The child isn't reaped before we waitpid() it, so this can't race with
+  // its pid being reused. Without pidfds is_alive() is polled instead.
+  int pidfd = syscall(__NR_pidfd_open, cpid, 0);
+  if (pidfd >= 0)
+    pidfd_ = pidfd;
 }
 
 ChildProc::~ChildProc()
@@ -157,6 +168,9 @@ ChildProc::~ChildProc()
 
   if (is_alive())
     terminate(true);
+
+  if (pidfd_ >= 0)
+    close(pidfd_);
 }
 
 bool ChildProc::is_alive()
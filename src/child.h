@@ -45,6 +45,16 @@ public:
   */
   virtual bool is_alive() = 0;
 
+  /**
+     fd that becomes readable when the child exits, for waiting on its exit
+     along with other fds. -1 if there's none, is_alive() has to be polled
+     then
+  */
+  virtual int exit_fd()
+  {
+    return -1;
+  };
+
   /**
      return the child pid
   */
@@ -115,6 +125,10 @@ public:
   void run(bool pause = false) override;
   void terminate(bool force = false) override;
   bool is_alive() override;
+  int exit_fd() override
+  {
+    return pidfd_;
+  };
   void resume(void) override;
 
 private:
@@ -137,6 +151,8 @@ private:
   };
 
   int child_event_fd_ = -1;
+  // Of the child, -1 if pidfds are not supported
+  int pidfd_ = -1;
 };
 
 } // namespace bpftrace
@@ -1,6 +1,7 @@
 #include <cstring>
 #include <iostream>
 #include <regex>
+#include <unistd.h>
 #include <vector>
 
 #include "llvm/Config/llvm-config.h"
@@ -11,6 +12,7 @@
 #include "field_analyser.h"
 #include "headers.h"
 #include "log.h"
+#include "program_image.h"
 #include "types.h"
 #include "utils.h"
 
@@ -203,46 +205,8 @@ static bool getBitfield(CXCursor c, Bitfield &bitfield)
     return false;
   }
 
-  // Algorithm description:
-  // To handle bitfields, we need to give codegen 3 additional pieces
-  // of information: `read_bytes`, `access_rshift`, and `mask`.
-  //
-  // `read_bytes` tells codegen how many bytes to read starting at `Field::offset`.
-  // This information is necessary because we can't always issue, for example, a
-  // 1 byte read, as the bitfield could be the last 4 bits of the struct. Reading
-  // past the end of the struct could cause a page fault. Therefore, we compute the
-  // minimum number of bytes necessary to fully read the bitfield. This will always
-  // keep the read within the bounds of the struct.
-  //
-  // `access_rshift` tells codegen how much to shift the masked value so that the
-  // LSB of the bitfield is the LSB of the interpreted integer.
-  //
-  // `mask` tells codegen how to mask out the surrounding bitfields.
-
-  size_t bitfield_offset = clang_Cursor_getOffsetOfField(c) % 8;
-  size_t bitfield_bitwidth = clang_getFieldDeclBitWidth(c);
-  size_t bitfield_bitdidth_max = sizeof(uint64_t) * 8;
-
-  if (bitfield_bitwidth > bitfield_bitdidth_max)
-  {
-    LOG(WARNING) << "bitfiled bitwidth " << bitfield_bitwidth
-                 << "is not supporeted."
-                 << " Use bitwidth " << bitfield_bitdidth_max;
-    bitfield_bitwidth = bitfield_bitdidth_max;
-  }
-  if (bitfield_bitwidth == bitfield_bitdidth_max)
-    bitfield.mask = std::numeric_limits<uint64_t>::max();
-  else
-    bitfield.mask = (1ULL << bitfield_bitwidth) - 1;
-  // Round up to nearest byte
-  bitfield.read_bytes = (bitfield_offset + bitfield_bitwidth + 7) / 8;
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  bitfield.access_rshift = bitfield_offset;
-#else
-  bitfield.access_rshift = (bitfield.read_bytes * 8 - bitfield_offset -
-                            bitfield_bitwidth);
-#endif
-
+  bitfield = Bitfield::Create(clang_Cursor_getOffsetOfField(c),
+                              clang_getFieldDeclBitWidth(c));
   return true;
 }
 
@@ -340,9 +304,10 @@ static SizedType get_sized_type(CXType clang_type)
   }
 }
 
-ClangParser::ClangParserHandler::ClangParserHandler()
+ClangParser::ClangParserHandler::ClangParserHandler(bool pch_declarations)
 {
-  index = clang_createIndex(1, 1);
+  index = clang_createIndex(!pch_declarations, 1);
+  translation_unit = nullptr;
 }
 
 ClangParser::ClangParserHandler::~ClangParserHandler()
@@ -430,6 +395,35 @@ bool ClangParser::ClangParserHandler::parse_file(
   return check_diagnostics(input, bail_on_errors);
 }
 
+bool ClangParser::ClangParserHandler::save_pch(
+    const std::string &filename,
+    const std::string &input,
+    const std::vector<const char *> &args,
+    std::vector<CXUnsavedFile> &unsaved_files,
+    const std::string &path)
+{
+  StderrSilencer silencer;
+  silencer.silence();
+
+  CXErrorCode error = parse_translation_unit(
+      filename.c_str(),
+      args.data(),
+      args.size(),
+      unsaved_files.data(),
+      unsaved_files.size(),
+      CXTranslationUnit_DetailedPreprocessingRecord |
+          CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization);
+
+  error_msgs.clear();
+  if (error || !check_diagnostics(input, true))
+    return false;
+
+  return clang_saveTranslationUnit(translation_unit,
+                                   path.c_str(),
+                                   clang_defaultSaveOptions(
+                                       translation_unit)) == CXSaveError_None;
+}
+
 const std::vector<std::string>
     &ClangParser::ClangParserHandler::get_error_messages()
 {
@@ -446,6 +440,19 @@ bool ClangParser::ClangParserHandler::has_redefinition_error()
   return false;
 }
 
+std::set<std::string> ClangParser::ClangParserHandler::get_included_files()
+{
+  std::set<std::string> files;
+  clang_getInclusions(
+      translation_unit,
+      [](CXFile included_file, CXSourceLocation *, unsigned, CXClientData data) {
+        static_cast<std::set<std::string> *>(data)->insert(
+            get_clang_string(clang_getFileName(included_file)));
+      },
+      &files);
+  return files;
+}
+
 bool ClangParser::ClangParserHandler::has_unknown_type_error()
 {
   for (auto &msg : error_msgs)
@@ -634,9 +641,8 @@ std::unordered_set<std::string> ClangParser::get_incomplete_types()
   return type_data.incomplete_types;
 }
 
-void ClangParser::resolve_incomplete_types_from_btf(
-    BPFtrace &bpftrace,
-    const ast::ProbeList *probes)
+unsigned ClangParser::get_type_res_iterations(BPFtrace &bpftrace,
+                                              const ast::ProbeList *probes)
 {
   // Resolution of incomplete types must run at least once, maximum should be
   // the number of levels of nested field accesses for tracepoint args.
@@ -647,8 +653,14 @@ void ClangParser::resolve_incomplete_types_from_btf(
     if (probe->tp_args_structs_level > (int)field_lvl)
       field_lvl = probe->tp_args_structs_level;
 
-  unsigned max_iterations = std::max(bpftrace.max_type_res_iterations,
-                                     field_lvl);
+  return std::max(bpftrace.max_type_res_iterations, field_lvl);
+}
+
+void ClangParser::resolve_incomplete_types_from_btf(
+    BPFtrace &bpftrace,
+    const ast::ProbeList *probes)
+{
+  unsigned max_iterations = get_type_res_iterations(bpftrace, probes);
 
   bool check_incomplete_types = true;
   for (unsigned i = 0; i < max_iterations && check_incomplete_types; i++)
@@ -699,6 +711,22 @@ bool ClangParser::parse(ast::Program *program, BPFtrace &bpftrace, std::vector<s
   StderrSilencer silencer;
   silencer.silence();
 #endif
+  // Without C definitions, all types come from BTF and are read from it
+  // directly instead of having libclang parse the header generated for them.
+  // The field analyser already asked for the types the program dereferences,
+  // so the ones their fields point to are only added when
+  // BPFTRACE_MAX_TYPE_RES_ITERATIONS, or the fields accessed through
+  // tracepoint args, ask for them.
+  if (program->c_definitions.empty() && bpftrace.btf_.has_data())
+  {
+    bpftrace.btf_.resolve_structs(bpftrace.btf_set_,
+                                  get_type_res_iterations(bpftrace,
+                                                          program->probes),
+                                  bpftrace.structs_,
+                                  bpftrace.enums_);
+    return true;
+  }
+
   input = "#include <__btf_generated_header.h>\n" + program->c_definitions;
 
   input_files = getTranslationUnitFiles(CXUnsavedFile{
@@ -719,6 +747,21 @@ bool ClangParser::parse(ast::Program *program, BPFtrace &bpftrace, std::vector<s
     args.push_back(flag.c_str());
   }
 
+  // Types resolved by an earlier run from the same definitions and BTF
+  std::unique_ptr<DefinitionsCache> definitions_cache;
+  if (!bpftrace.program_cache_dir_.empty())
+  {
+    definitions_cache = std::make_unique<DefinitionsCache>(
+        bpftrace.program_cache_dir_,
+        DefinitionsCache::key(bpftrace,
+                              input,
+                              args,
+                              get_type_res_iterations(bpftrace,
+                                                      program->probes)));
+    if (definitions_cache->load(bpftrace))
+      return true;
+  }
+
   // Push the generated BTF header into input files.
   // The header must be the last file in the vector since the following methods
   // count on it.
@@ -775,7 +818,16 @@ bool ClangParser::parse(ast::Program *program, BPFtrace &bpftrace, std::vector<s
     input_files.back() = get_empty_btf_generated_header();
   }
 
-  if (!handler.parse_file("definitions.h", input, args, input_files))
+  // BTF types come ahead of the headers the definitions include, they can
+  // only be precompiled when there are none
+  ClangParserHandler pch_handler(true);
+  std::set<std::string> pch_headers;
+  ClangParserHandler *parsed = &handler;
+  if ((!bpftrace.btf_.has_data() || btf_conflict) &&
+      parse_with_pch(
+          pch_handler, bpftrace, program->c_definitions, pch_headers))
+    parsed = &pch_handler;
+  else if (!handler.parse_file("definitions.h", input, args, input_files))
   {
     if (handler.has_redefinition_error())
     {
@@ -790,8 +842,112 @@ bool ClangParser::parse(ast::Program *program, BPFtrace &bpftrace, std::vector<s
     return false;
   }
 
-  CXCursor cursor = handler.get_translation_unit_cursor();
-  return visit_children(cursor, bpftrace);
+  CXCursor cursor = parsed->get_translation_unit_cursor();
+  if (!visit_children(cursor, bpftrace))
+    return false;
+
+  if (definitions_cache)
+  {
+    auto headers = parsed->get_included_files();
+    headers.insert(pch_headers.begin(), pch_headers.end());
+    definitions_cache->store(bpftrace, headers);
+    bpftrace.included_files_ = std::move(headers);
+  }
+  return true;
+}
+
+bool ClangParser::parse_with_pch(ClangParserHandler &handler,
+                                 BPFtrace &bpftrace,
+                                 const std::string &definitions,
+                                 std::set<std::string> &headers)
+{
+  if (bpftrace.program_cache_dir_.empty())
+    return false;
+
+  // The #include lines the definitions start with, and the blank ones
+  // between them
+  size_t end = 0;
+  bool has_include = false;
+  while (end < definitions.size())
+  {
+    size_t next = definitions.find('\n', end);
+    next = next == std::string::npos ? definitions.size() : next + 1;
+    size_t first = definitions.find_first_not_of(" \t\n", end);
+    if (first < next)
+    {
+      if (definitions.compare(first, 8, "#include") != 0)
+        break;
+      has_include = true;
+    }
+    end = next;
+  }
+  if (!has_include)
+    return false;
+  std::string includes = definitions.substr(0, end);
+
+  const std::string includes_name = "__bpftrace_includes.h";
+  auto includes_files = getTranslationUnitFiles(CXUnsavedFile{
+      .Filename = includes_name.c_str(),
+      .Contents = includes.c_str(),
+      .Length = includes.size(),
+  });
+
+  // Made with the --include files and the workarounds ahead of the includes,
+  // as they are when the definitions are parsed in one go
+  HeaderCache cache(bpftrace.program_cache_dir_,
+                    HeaderCache::key(includes, args));
+  std::string pch = cache.load(headers);
+  if (pch.empty())
+  {
+    ClangParserHandler pch_handler;
+    if (!pch_handler.save_pch(
+            includes_name, includes, args, includes_files, cache.tmp_path()))
+    {
+      unlink(cache.tmp_path().c_str());
+      return false;
+    }
+    headers = pch_handler.get_included_files();
+    if (!cache.store(headers))
+      return false;
+    pch = cache.path();
+  }
+
+  // The --include files are already in the precompiled header
+  std::vector<const char *> pch_args;
+  for (size_t i = 0; i < args.size(); i++)
+  {
+    if (strcmp(args[i], "-include") == 0 && i + 1 < args.size())
+    {
+      i++;
+      continue;
+    }
+    pch_args.push_back(args[i]);
+  }
+  pch_args.push_back("-include-pch");
+  pch_args.push_back(pch.c_str());
+
+  std::string rest = "#include <__btf_generated_header.h>\n" +
+                     definitions.substr(end);
+  auto files = input_files;
+  files.front().Contents = rest.c_str();
+  files.front().Length = rest.size();
+  files.push_back(includes_files.front());
+
+  if (!handler.parse_file("definitions.h", rest, pch_args, files))
+  {
+    // Out of date or from another clang, made again on the next run
+    for (auto &msg : handler.get_error_messages())
+    {
+      if (msg.find("precompiled header") != std::string::npos ||
+          msg.find("PCH") != std::string::npos)
+      {
+        cache.remove();
+        break;
+      }
+    }
+    return false;
+  }
+  return true;
 }
 
 /*
@@ -856,7 +1012,12 @@ void ClangParser::resolve_unknown_typedefs_from_btf(BPFtrace &bpftrace)
 
 CXUnsavedFile ClangParser::get_btf_generated_header(BPFtrace &bpftrace)
 {
-  btf_cdef = bpftrace.btf_.c_def(bpftrace.btf_set_);
+  // The resolution loops ask for it again until no type is added
+  if (!btf_cdef_set || *btf_cdef_set != bpftrace.btf_set_)
+  {
+    btf_cdef = bpftrace.btf_.c_def(bpftrace.btf_set_);
+    btf_cdef_set = bpftrace.btf_set_;
+  }
   return CXUnsavedFile{
     .Filename = "/bpftrace/include/__btf_generated_header.h",
     .Contents = btf_cdef.c_str(),
@@ -867,6 +1028,7 @@ CXUnsavedFile ClangParser::get_btf_generated_header(BPFtrace &bpftrace)
 CXUnsavedFile ClangParser::get_empty_btf_generated_header()
 {
   btf_cdef = "";
+  btf_cdef_set.reset();
   return CXUnsavedFile{
     .Filename = "/bpftrace/include/__btf_generated_header.h",
     .Contents = btf_cdef.c_str(),
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <optional>
+#include <set>
 #include <unordered_set>
 
 #include "bpftrace.h"
@@ -40,6 +42,8 @@ private:
    */
   void resolve_incomplete_types_from_btf(BPFtrace &bpftrace,
                                          const ast::ProbeList *probes);
+  static unsigned get_type_res_iterations(BPFtrace &bpftrace,
+                                          const ast::ProbeList *probes);
 
   /*
    * Collect names of types defined by typedefs that are in non-included
@@ -58,15 +62,31 @@ private:
   CXUnsavedFile get_btf_generated_header(BPFtrace &bpftrace);
   CXUnsavedFile get_empty_btf_generated_header();
 
+  class ClangParserHandler;
+  /*
+   * Parse the definitions without types from BTF, taking the #include lines
+   * they start with from a precompiled header in the program cache directory,
+   * which is built first if there is none. Returns false if that couldn't be
+   * done, for the caller to parse them as usual.
+   */
+  bool parse_with_pch(ClangParserHandler &handler,
+                      BPFtrace &bpftrace,
+                      const std::string &definitions,
+                      std::set<std::string> &headers);
+
   std::string input;
   std::vector<const char *> args;
   std::vector<CXUnsavedFile> input_files;
   std::string btf_cdef;
+  // Types btf_cdef was generated for
+  std::optional<std::unordered_set<std::string>> btf_cdef_set;
 
   class ClangParserHandler
   {
   public:
-    ClangParserHandler();
+    // With pch_declarations, the declarations a precompiled header holds are
+    // visited too
+    explicit ClangParserHandler(bool pch_declarations = false);
 
     ~ClangParserHandler();
 
@@ -76,6 +96,13 @@ private:
                     std::vector<CXUnsavedFile> &unsaved_files,
                     bool bail_on_errors = true);
 
+    // Parse filename as a header and save it precompiled at path
+    bool save_pch(const std::string &filename,
+                  const std::string &input,
+                  const std::vector<const char *> &args,
+                  std::vector<CXUnsavedFile> &unsaved_files,
+                  const std::string &path);
+
     CXTranslationUnit get_translation_unit();
 
     CXErrorCode parse_translation_unit(const char *source_filename,
@@ -99,6 +126,9 @@ private:
     bool has_redefinition_error();
     bool has_unknown_type_error();
 
+    // Files included by the translation unit, the unsaved ones too
+    std::set<std::string> get_included_files();
+
   private:
     CXIndex index;
     CXTranslationUnit translation_unit;
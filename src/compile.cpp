@@ -0,0 +1,118 @@
+#include <sys/utsname.h>
+
+#include "ast/node_counter.h"
+#include "bpftrace.h"
+#include "clang_parser.h"
+#include "compile.h"
+#include "driver.h"
+#include "field_analyser.h"
+#include "optimizer.h"
+#include "semantic_analyser.h"
+#include "timings.h"
+#include "tracepoint_format_parser.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+[[nodiscard]] std::unique_ptr<ast::Node> parse_program(
+    BPFtrace& bpftrace,
+    const std::string& name,
+    const std::string& program,
+    const std::vector<std::string>& include_dirs,
+    const std::vector<std::string>& include_files)
+{
+  Driver driver(bpftrace);
+  driver.source(name, program);
+  int err;
+
+  bpftrace.start_startup_work();
+  {
+    Timings::Scope timing("parse");
+    err = driver.parse();
+  }
+  if (err)
+    return nullptr;
+  bpftrace.probe_matcher_->prefetch_probes(driver.root_);
+
+  {
+    Timings::Scope timing("field analysis");
+    ast::FieldAnalyser fields(driver.root_, bpftrace);
+    err = fields.analyse();
+  }
+  if (err)
+    return nullptr;
+
+  {
+    Timings::Scope timing("TracepointFormatParser::parse");
+    if (TracepointFormatParser::parse(driver.root_, bpftrace) == false)
+      return nullptr;
+  }
+
+  ClangParser clang;
+  std::vector<std::string> extra_flags;
+  {
+    struct utsname utsname;
+    uname(&utsname);
+    std::string ksrc, kobj;
+    // Rather than feature_->has_btf(), which reads the BTF of vmlinux again
+    auto kdirs = get_kernel_dirs(utsname, !bpftrace.btf_.has_data());
+    ksrc = std::get<0>(kdirs);
+    kobj = std::get<1>(kdirs);
+
+    if (ksrc != "")
+      extra_flags = get_kernel_cflags(utsname.machine, ksrc, kobj);
+  }
+  extra_flags.push_back("-include");
+  extra_flags.push_back(CLANG_WORKAROUNDS_H);
+
+  for (auto dir : include_dirs)
+  {
+    extra_flags.push_back("-I");
+    extra_flags.push_back(dir);
+  }
+  for (auto file : include_files)
+  {
+    extra_flags.push_back("-include");
+    extra_flags.push_back(file);
+  }
+
+  // NOTE(mmarchini): if there are no C definitions, clang parser won't run to
+  // avoid issues in some versions. Since we're including files in the command
+  // line, we want to force parsing, so we make sure C definitions are not
+  // empty before going to clang parser stage.
+  if (!include_files.empty() && driver.root_->c_definitions.empty())
+    driver.root_->c_definitions = "#define __BPFTRACE_DUMMY__";
+
+  {
+    Timings::Scope timing("ClangParser::parse");
+    if (!clang.parse(driver.root_, bpftrace, extra_flags))
+      return nullptr;
+  }
+
+  {
+    Timings::Scope timing("parse");
+    err = driver.parse();
+  }
+  if (err)
+    return nullptr;
+
+  // The passes look the features up
+  bpftrace.finish_startup_work();
+  auto ast = driver.root_;
+  driver.root_ = nullptr;
+  return std::unique_ptr<ast::Node>(ast);
+}
+
+ast::PassManager CreatePM()
+{
+  ast::PassManager pm;
+  pm.AddPass(ast::CreateFoldPass());
+  pm.AddPass(ast::CreateDeadCodePass());
+  pm.AddPass(ast::CreatePredicateReorderPass());
+  pm.AddPass(ast::CreateSemanticPass());
+  pm.AddPass(ast::CreateCounterPass());
+  pm.AddPass(ast::CreateMapCreatePass());
+  return pm;
+}
+
+} // namespace bpftrace
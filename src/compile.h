@@ -0,0 +1,27 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "pass_manager.h"
+
+namespace bpftrace {
+
+class BPFtrace;
+
+// Parse program, resolving its tracepoint structs and C definitions with
+// the kernel headers and the -I and --include of the command line. Returns
+// nullptr after logging the error.
+[[nodiscard]] std::unique_ptr<ast::Node> parse_program(
+    BPFtrace &bpftrace,
+    const std::string &name,
+    const std::string &program,
+    const std::vector<std::string> &include_dirs,
+    const std::vector<std::string> &include_files);
+
+// Passes run on a parsed program, up to the creation of its maps
+ast::PassManager CreatePM();
+
+} // namespace bpftrace
@@ -0,0 +1,197 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "log.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+namespace {
+
+// Largest program read from a client
+const size_t PROGRAM_MAX = 1024 * 1024;
+
+volatile sig_atomic_t stop_requested = false;
+
+} // namespace
+
+Daemon::~Daemon()
+{
+  if (fd_ < 0)
+    return;
+  close(fd_);
+  if (!forked_)
+    unlink(path_.c_str());
+}
+
+int Daemon::listen(const std::string &path)
+{
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+  {
+    LOG(ERROR) << "--daemon: " << path << " is too long for a socket path";
+    return -1;
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0)
+  {
+    if (!S_ISSOCK(st.st_mode))
+    {
+      LOG(ERROR) << "--daemon: " << path << " exists and isn't a socket";
+      return -1;
+    }
+    unlink(path.c_str());
+  }
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0)
+  {
+    LOG(ERROR) << "--daemon: failed to create socket: " << strerror(errno);
+    return -1;
+  }
+  // The programs run as root, only root may connect, see run_in_fork()
+  mode_t mask = umask(0077);
+  int err = bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+  umask(mask);
+  if (err < 0 || ::listen(fd_, SOMAXCONN) < 0)
+  {
+    LOG(ERROR) << "--daemon: failed to listen on " << path << ": "
+               << strerror(errno);
+    close(fd_);
+    fd_ = -1;
+    return -1;
+  }
+  path_ = path;
+  return 0;
+}
+
+bool Daemon::serve(std::string &program)
+{
+  // Forks are reaped by the kernel
+  struct sigaction act = {};
+  act.sa_handler = SIG_IGN;
+  act.sa_flags = SA_NOCLDWAIT;
+  sigaction(SIGCHLD, &act, nullptr);
+  // Without SA_RESTART, so that accept() returns
+  struct sigaction stop = {};
+  stop.sa_handler = [](int) { stop_requested = true; };
+  sigaction(SIGINT, &stop, nullptr);
+  sigaction(SIGTERM, &stop, nullptr);
+
+  while (!stop_requested)
+  {
+    int conn = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      LOG(ERROR) << "--daemon: accept failed: " << strerror(errno);
+      return false;
+    }
+
+    // The program is read by the fork, a slow client holds up only its own
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+      LOG(ERROR) << "--daemon: fork failed: " << strerror(errno);
+      close(conn);
+      continue;
+    }
+    if (pid == 0)
+    {
+      run_in_fork(conn);
+      if (!read_program(conn, program))
+        _exit(1);
+      return true;
+    }
+    close(conn);
+  }
+  return false;
+}
+
+void Daemon::run_in_fork(int conn)
+{
+  forked_ = true;
+  close(fd_);
+  fd_ = -1;
+
+  struct sigaction act = {};
+  act.sa_handler = SIG_DFL;
+  sigaction(SIGCHLD, &act, nullptr);
+  sigaction(SIGINT, &act, nullptr);
+  sigaction(SIGTERM, &act, nullptr);
+  // Output to a client that went away is dropped, the run stops on its own
+  act.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &act, nullptr);
+
+  int null = open("/dev/null", O_RDONLY);
+  if (null >= 0)
+  {
+    dup2(null, STDIN_FILENO);
+    close(null);
+  }
+  dup2(conn, STDOUT_FILENO);
+  dup2(conn, STDERR_FILENO);
+
+  struct ucred cred = {};
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+      cred.uid != 0)
+  {
+    LOG(ERROR) << "--daemon: only root can run programs";
+    _exit(1);
+  }
+
+  // The connection is only closed by the client when it's done, e.g. on
+  // Ctrl-C, after shutting it down for writing once the program was sent
+  start_thread_without_signals([conn]() {
+    struct pollfd pfd = { conn, 0, 0 };
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+      ;
+    kill(getpid(), SIGINT);
+  }).detach();
+}
+
+bool Daemon::read_program(int conn, std::string &program)
+{
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(conn, buf, sizeof(buf))) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      LOG(ERROR) << "--daemon: failed to read the program: "
+                 << strerror(errno);
+      return false;
+    }
+    program.append(buf, n);
+    if (program.size() > PROGRAM_MAX)
+    {
+      LOG(ERROR) << "--daemon: the program is larger than " << PROGRAM_MAX
+                 << " bytes";
+      return false;
+    }
+  }
+  if (program.empty())
+  {
+    LOG(ERROR) << "--daemon: no program was sent";
+    return false;
+  }
+  return true;
+}
+
+} // namespace bpftrace
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+
+namespace bpftrace {
+
+/**
+   Unix socket server of `--daemon`, running the programs sent to it.
+
+   A client connects, writes a program and shuts down its side for writing.
+   Each program is run by a fork of the daemon, which inherits the features,
+   BTF and symbols the daemon read once, and has the connection as its
+   stdout and stderr. The run is stopped as if by SIGINT when the client
+   closes the connection.
+*/
+class Daemon
+{
+public:
+  Daemon() = default;
+  ~Daemon();
+
+  Daemon(const Daemon &) = delete;
+  Daemon &operator=(const Daemon &) = delete;
+
+  // Listen on the socket at path, replacing the one of a previous daemon
+  int listen(const std::string &path);
+
+  /**
+     Accept connections until SIGINT or SIGTERM, which returns false.
+     Returns true in the fork running a program, with the program in
+     program.
+  */
+  bool serve(std::string &program);
+
+private:
+  bool read_program(int conn, std::string &program);
+  void run_in_fork(int conn);
+
+  int fd_ = -1;
+  std::string path_;
+  bool forked_ = false;
+};
+
+} // namespace bpftrace
@@ -0,0 +1,37 @@
+#include <cstdlib>
+
+#include <llvm/Demangle/Demangle.h>
+
+#include "demangle_cache.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+const std::string *DemangleCache::demangle(const std::string &name)
+{
+  if (!symbol_has_cpp_mangled_signature(name))
+    return nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = names_.find(name);
+    if (it != names_.end())
+      return it->second.empty() ? nullptr : &it->second;
+  }
+
+  // Demangled without the lock, another thread racing on the same name just
+  // does the work twice
+  std::string demangled;
+  char *buf = llvm::itaniumDemangle(name.c_str(), nullptr, nullptr, nullptr);
+  if (buf)
+  {
+    demangled = buf;
+    free(buf);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &interned = names_.emplace(name, std::move(demangled)).first->second;
+  return interned.empty() ? nullptr : &interned;
+}
+
+} // namespace bpftrace
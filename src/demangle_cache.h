@@ -0,0 +1,38 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace bpftrace {
+
+/**
+   Demangled C++ symbol names, interned by mangled name.
+
+   Probe matching and symbolization demangle the same names over and over,
+   a wildcard on a big C++ binary goes through every symbol in it. Each name
+   is only demangled once, then looked up. Thread safe, the symbolize pool
+   workers share it.
+*/
+class DemangleCache
+{
+public:
+  /**
+     Demangled name, nullptr if name isn't a C++ mangled name or can't be
+     demangled. Stays valid for the lifetime of the cache.
+  */
+  const std::string *demangle(const std::string &name);
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return names_.size();
+  }
+
+private:
+  mutable std::mutex mutex_;
+  // Empty for the names that failed to demangle
+  std::unordered_map<std::string, std::string> names_;
+};
+
+} // namespace bpftrace
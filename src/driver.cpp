@@ -19,6 +19,7 @@ Driver::Driver(BPFtrace &bpftrace, std::ostream &o)
 Driver::~Driver()
 {
   delete root_;
+  arena_->release();
 }
 
 void Driver::source(std::string filename, std::string script)
@@ -43,18 +44,22 @@ int Driver::parse()
   // Reset source location info on every pass
   loc.initialize();
 
-  yyscan_t scanner;
-  yylex_init(&scanner);
-  Parser parser(*this, scanner);
-  yy_scan_string(Log::get().get_source().c_str(), scanner);
-  parser.parse();
-  yylex_destroy(scanner);
-
-  if (!failed_)
   {
-    ast::AttachPointParser ap_parser(root_, bpftrace_, out_, listing_);
-    if (ap_parser.parse())
-      failed_ = true;
+    ast::NodeArena::Scope scope(arena_);
+
+    yyscan_t scanner;
+    yylex_init(&scanner);
+    Parser parser(*this, scanner);
+    yy_scan_string(Log::get().get_source().c_str(), scanner);
+    parser.parse();
+    yylex_destroy(scanner);
+
+    if (!failed_)
+    {
+      ast::AttachPointParser ap_parser(root_, bpftrace_, out_, listing_);
+      if (ap_parser.parse())
+        failed_ = true;
+    }
   }
 
   if (failed_)
@@ -19,6 +19,9 @@ public:
   explicit Driver(BPFtrace &bpftrace, std::ostream &o = std::cerr);
   ~Driver();
 
+  Driver(const Driver &) = delete;
+  Driver &operator=(const Driver &) = delete;
+
   int parse();
   int parse_str(std::string script);
   void source(std::string, std::string);
@@ -34,6 +37,8 @@ public:
 private:
   std::ostream &out_;
   bool failed_ = false;
+  // The nodes of the parses come from here, see ast::NodeArena
+  ast::NodeArena *arena_ = ast::NodeArena::create();
 };
 
 } // namespace bpftrace
@@ -0,0 +1,257 @@
+#include <cstring>
+#include <stdexcept>
+#include <streambuf>
+
+#include "bpforc.h"
+#include "bpftrace.h"
+#include "codegen_llvm.h"
+#include "compile.h"
+#include "embed.h"
+#include "log.h"
+#include "output.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+uint64_t Event::integer(size_t i) const
+{
+  auto &arg = args.at(i);
+  auto p = data_ + arg.offset;
+  if (arg.type.IsPtrTy())
+    return read_data<uint64_t>(p);
+  if (!arg.type.IsIntTy())
+    throw std::invalid_argument("argument " + std::to_string(i) +
+                                " of the printf() isn't an integer");
+
+  bool is_signed = arg.type.IsSigned();
+  switch (arg.type.GetIntBitWidth())
+  {
+    case 64:
+      return read_data<uint64_t>(p);
+    case 32:
+      return is_signed ? read_data<int32_t>(p) : read_data<uint32_t>(p);
+    case 16:
+      return is_signed ? read_data<int16_t>(p) : read_data<uint16_t>(p);
+    default:
+      return is_signed ? read_data<int8_t>(p) : read_data<uint8_t>(p);
+  }
+}
+
+std::string Event::text(size_t i) const
+{
+  auto &arg = args.at(i);
+  if (arg.type.IsIntTy())
+  {
+    auto value = integer(i);
+    return arg.type.IsSigned() ? std::to_string(static_cast<int64_t>(value))
+                               : std::to_string(value);
+  }
+  if (arg.type.IsPtrTy())
+    return std::to_string(integer(i));
+  if (arg.type.IsStringTy())
+  {
+    auto p = reinterpret_cast<const char *>(data_ + arg.offset);
+    return std::string(p, strnlen(p, arg.type.GetSize()));
+  }
+  return bpftrace_.resolve_arg(arg, const_cast<uint8_t *>(data_));
+}
+
+// Passes what is written to it to the text callback a line at a time
+class Session::LineBuf : public std::streambuf
+{
+public:
+  explicit LineBuf(Session &session) : session_(session)
+  {
+  }
+
+protected:
+  int_type overflow(int_type c) override
+  {
+    if (c == traits_type::eof())
+      return traits_type::not_eof(c);
+    if (c != '\n')
+    {
+      line_ += static_cast<char>(c);
+      return c;
+    }
+    if (session_.on_text_)
+      session_.on_text_(line_);
+    line_.clear();
+    return c;
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override
+  {
+    for (std::streamsize i = 0; i < n; i++)
+      overflow(traits_type::to_int_type(s[i]));
+    return n;
+  }
+
+private:
+  Session &session_;
+  std::string line_;
+};
+
+// Hands the printf() events to the event callback as they were read
+class Session::EventOutput : public TextOutput
+{
+public:
+  EventOutput(Session &session, std::ostream &out)
+      : TextOutput(out), session_(session)
+  {
+  }
+
+  bool printf_event(uint64_t printf_id,
+                    const uint8_t *data,
+                    size_t size __attribute__((unused))) const override
+  {
+    if (!session_.on_event_)
+      return false;
+    auto &bpftrace = *session_.bpftrace_;
+    auto &[format, args] = bpftrace.printf_args_[printf_id];
+    session_.on_event_(Event(bpftrace, printf_id, format, args, data));
+    return true;
+  }
+
+private:
+  Session &session_;
+};
+
+Session::Session()
+    : buf_(std::make_unique<LineBuf>(*this)),
+      text_(std::make_unique<std::ostream>(buf_.get())),
+      bpftrace_(std::make_unique<BPFtrace>(
+          std::make_unique<EventOutput>(*this, *text_)))
+{
+}
+
+Session::~Session() = default;
+
+int Session::compile(const std::string &program,
+                     const std::vector<std::string> &params,
+                     const std::vector<std::string> &include_dirs,
+                     const std::vector<std::string> &include_files)
+{
+  auto &bpftrace = *bpftrace_;
+  for (auto &param : params)
+    bpftrace.add_param(param);
+  bpftrace.use_ringbuf_ = bpftrace.ringbuf_pages_ > 0 &&
+                          bpftrace.feature_->has_ringbuf();
+  bpftrace.use_control_ringbuf_ = bpftrace.control_ringbuf_pages_ > 0 &&
+                                  bpftrace.feature_->has_ringbuf();
+
+  auto ast_root = parse_program(bpftrace,
+                                "stdin",
+                                bpftrace.flushes_events()
+                                    ? program + "\n" +
+                                          BPFtrace::event_batch_probe()
+                                    : program,
+                                include_dirs,
+                                include_files);
+  if (!ast_root)
+    return 1;
+  if (bpftrace.flushes_events())
+    static_cast<ast::Program *>(ast_root.get())->probes->back()->flush_events =
+        true;
+
+  ast::PassContext ctx(bpftrace);
+  auto pm = CreatePM();
+  ast_root = pm.Run(std::move(ast_root), ctx);
+  if (!ast_root)
+    return 1;
+
+  try
+  {
+    ast::CodegenLLVM llvm(&*ast_root, bpftrace);
+    llvm.generate_ir();
+    llvm.optimize();
+    bpforc_ = llvm.emit();
+  }
+  catch (const std::exception &ex)
+  {
+    LOG(ERROR) << "Failed to compile: " << ex.what();
+    return 1;
+  }
+  return 0;
+}
+
+void Session::on_event(EventCallback callback)
+{
+  on_event_ = std::move(callback);
+}
+
+void Session::on_text(TextCallback callback)
+{
+  on_text_ = std::move(callback);
+}
+
+int Session::run()
+{
+  if (!bpforc_)
+  {
+    LOG(ERROR) << "No program compiled to run";
+    return 1;
+  }
+
+  uint64_t num_probes = bpftrace_->num_probes();
+  if (num_probes == 0)
+  {
+    LOG(ERROR) << "No probes to attach";
+    return 1;
+  }
+  else if (num_probes > bpftrace_->max_probes_)
+  {
+    LOG(ERROR) << "Can't attach to " << num_probes << " probes because it "
+               << "exceeds the current limit of " << bpftrace_->max_probes_
+               << " probes";
+    return 1;
+  }
+  return bpftrace_->run(std::move(bpforc_));
+}
+
+void Session::stop()
+{
+  BPFtrace::exitsig_recv = true;
+}
+
+int Session::snapshot(const std::string &name, std::vector<MapEntry> &entries)
+{
+  auto &bpftrace = *bpftrace_;
+  auto found = bpftrace.maps[name];
+  if (!found)
+  {
+    LOG(ERROR) << "Map " << name << " not found";
+    return 1;
+  }
+  IMap &map = **found;
+  auto &type = map.type_;
+  if (type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy() ||
+      type.IsAvgTy() || type.IsStatsTy() || type.IsCmsTy())
+  {
+    LOG(ERROR) << "Map " << name << " of " << type
+               << " can't be snapshotted, it has several values";
+    return 1;
+  }
+
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> values;
+  int err = bpftrace.dump_map(map, map.key_.size(), values);
+  if (err)
+    return err;
+
+  bool is_integer = type.IsIntTy() || type.IsCountTy() || type.IsSumTy() ||
+                    type.IsMinTy() || type.IsMaxTy() || type.IsDistinctTy();
+  bool is_per_cpu = map.is_per_cpu_type();
+  for (auto &[key, value] : values)
+  {
+    MapEntry entry;
+    entry.key = map.key_.argument_value_list(bpftrace, key);
+    entry.value = bpftrace.map_value_to_str(
+        type, value, is_per_cpu, 1, *bpftrace.out_);
+    if (is_integer)
+      entry.integer = bpftrace.map_value_to_int(type, value, is_per_cpu, 1);
+    entries.push_back(std::move(entry));
+  }
+  return 0;
+}
+
+} // namespace bpftrace
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "struct.h"
+
+namespace bpftrace {
+
+class BPFtrace;
+class BpfOrc;
+
+/**
+   A printf() of the program, as read from the perf buffer. Only valid
+   during the callback it is passed to.
+*/
+class Event
+{
+public:
+  Event(BPFtrace &bpftrace,
+        uint64_t id,
+        const std::string &format,
+        const std::vector<Field> &args,
+        const uint8_t *data)
+      : id(id), format(format), args(args), bpftrace_(bpftrace), data_(data)
+  {
+  }
+
+  // Which printf() of the program, in the order they appear in it
+  uint64_t id;
+  const std::string &format;
+  const std::vector<Field> &args;
+
+  // Argument i of an integer or pointer type, sign extended if it is signed
+  uint64_t integer(size_t i) const;
+  // Argument i as printf() would print it with %s (integers in decimal)
+  std::string text(size_t i) const;
+
+private:
+  BPFtrace &bpftrace_;
+  const uint8_t *data_;
+};
+
+// An entry of a map, see Session::snapshot()
+struct MapEntry
+{
+  // The fields of the key as they are printed
+  std::vector<std::string> key;
+  std::string value;
+  // For count(), sum(), min(), max(), distinct() and integer maps
+  std::optional<uint64_t> integer;
+};
+
+/**
+   Compiles and runs a program in the calling process, for embedding the
+   tracer rather than running the bpftrace binary and parsing its output.
+
+     Session session;
+     session.on_event([](const Event &event) { ... });
+     if (session.compile("kprobe:do_nanosleep { printf(\"%d\\n\", pid); }"))
+       return 1;
+     session.run();
+
+   printf() events are passed to the event callback, everything else the
+   program prints, e.g. maps and time(), to the text callback a line at a
+   time. The BPFTRACE_* environment variables of the command line aren't
+   read, the settings can be set through bpftrace() before compile().
+
+   Only one session of a process can run at a time, they share how the run
+   is stopped.
+*/
+class Session
+{
+public:
+  using EventCallback = std::function<void(const Event &)>;
+  using TextCallback = std::function<void(const std::string &)>;
+
+  Session();
+  ~Session();
+
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  // params are the positional parameters ($1, $2, ...). Returns non-zero
+  // after logging the error.
+  int compile(const std::string &program,
+              const std::vector<std::string> &params = {},
+              const std::vector<std::string> &include_dirs = {},
+              const std::vector<std::string> &include_files = {});
+
+  // Set before run(), events are formatted and passed to the text callback
+  // without one
+  void on_event(EventCallback callback);
+  void on_text(TextCallback callback);
+
+  // Attach the probes and pass the events to the callbacks until stop() or
+  // exit(), then detach them. The maps are left as they are for snapshot().
+  int run();
+  // Can be called from any thread or a signal handler
+  static void stop();
+
+  /**
+     Read the entries of the map, e.g. "@counts". hist(), lhist(), avg(),
+     stats() and the other maps printed as several values aren't supported.
+     Can be called from the callbacks or after run().
+  */
+  int snapshot(const std::string &map, std::vector<MapEntry> &entries);
+
+  BPFtrace &bpftrace()
+  {
+    return *bpftrace_;
+  }
+
+private:
+  class EventOutput;
+  class LineBuf;
+
+  EventCallback on_event_;
+  TextCallback on_text_;
+  std::unique_ptr<LineBuf> buf_;
+  std::unique_ptr<std::ostream> text_;
+  std::unique_ptr<BPFtrace> bpftrace_;
+  std::unique_ptr<BpfOrc> bpforc_;
+};
+
+} // namespace bpftrace
@@ -3,25 +3,30 @@
 // The compiled binary name is "bpftrace_fuzz"
 
 #include <array>
+#include <chrono>
 #include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
 #include <limits>
 #include <optional>
+#include <sstream>
 #include <sys/resource.h>
 #include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "ast/callback_visitor.h"
+#include "bpffeature.h"
 #include "bpforc.h"
 #include "bpftrace.h"
 #include "clang_parser.h"
 #include "codegen_llvm.h"
 #include "driver.h"
+#include "fake_map.h"
 #include "field_analyser.h"
 #include "log.h"
 #include "output.h"
@@ -29,54 +34,50 @@
 #include "tracepoint_format_parser.h"
 
 #define DEFAULT_NODE_MAX 200
+// Inputs run by a process in AFL's persistent mode before it starts over
+#define AFL_LOOP_COUNT 1000
 
 using namespace bpftrace;
 
 int fuzz_main(const char* data, size_t sz);
 
-#ifdef LIBFUZZER
-// main entry for libufuzzer
-// libfuzzer.a provides main function
-extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t sz)
-{
-  fuzz_main((const char*)data, sz);
-  return 0; // Non-zero return values are reserved for future use.
-}
-#else
-// main function for AFL, etc.
-int main(int argc, char* argv[])
+namespace {
+
+// What is kept from one input to the next of a process. Detecting the
+// kernel's features and the flags of its headers is what takes most of the
+// time of an input otherwise.
+struct FuzzState
 {
-  // Read inputs
-  std::stringstream buf;
-  std::string line;
-  if (argc <= 1)
-  {
-    // Input from stdin (AFL's default)
-    while (std::getline(std::cin, line))
-      buf << line << std::endl;
-  }
-  else
-  {
-    // Read from file
-    std::string filename(argv[1]);
-    std::ifstream file(filename);
-    if (file.fail())
-      return 1;
-    buf << file.rdbuf();
-  }
-  const auto& str = buf.str();
-  return fuzz_main(str.c_str(), str.size());
-}
+  std::unique_ptr<BPFfeature> feature = std::make_unique<BPFfeature>();
+  std::vector<std::string> extra_flags;
+  std::ofstream devnull;
+  uint64_t node_max = DEFAULT_NODE_MAX;
+  // Inputs taking longer than this are reported, 0 to not time them
+  uint64_t slow_ms = 0;
+  bool slow_abort = false;
+};
 
-#endif // LIBFUZZER
+// Time taken by each phase of an input
+using PhaseTimes = std::vector<std::pair<const char*, double>>;
 
-int fuzz_main(const char* data, size_t sz)
+FuzzState* get_state()
 {
-  if (data == nullptr || sz == 0)
-    return 0;
+  static std::unique_ptr<FuzzState> state;
+  static bool failed = false;
+  if (state || failed)
+    return state.get();
 
-  if (getuid() != 0)
-    return 1;
+  state = std::make_unique<FuzzState>();
+  uint64_t slow_abort = 0;
+  if (!get_uint64_env_var("BPFTRACE_NODE_MAX", state->node_max) ||
+      !get_uint64_env_var("BPFTRACE_FUZZ_SLOW_MS", state->slow_ms) ||
+      !get_uint64_env_var("BPFTRACE_FUZZ_SLOW_ABORT", slow_abort))
+  {
+    failed = true;
+    state.reset();
+    return nullptr;
+  }
+  state->slow_abort = slow_abort != 0;
 
   DISABLE_LOG(DEBUG);
   DISABLE_LOG(INFO);
@@ -85,21 +86,67 @@ int fuzz_main(const char* data, size_t sz)
   // log to see if an error occurs. Instead, suppress error log output at each
   // place.
   // DISABLE_LOG(ERROR);
-  std::ofstream devnull;
-  devnull.open("/dev/null", std::ofstream::out | std::ofstream::app);
+  state->devnull.open("/dev/null", std::ofstream::out | std::ofstream::app);
+
+  struct utsname utsname;
+  uname(&utsname);
+  std::string ksrc, kobj;
+  auto kdirs = get_kernel_dirs(utsname, !state->feature->has_btf());
+  ksrc = std::get<0>(kdirs);
+  kobj = std::get<1>(kdirs);
+
+  if (ksrc != "")
+    state->extra_flags = get_kernel_cflags(utsname.machine, ksrc, kobj);
+  state->extra_flags.push_back("-include");
+  state->extra_flags.push_back(CLANG_WORKAROUNDS_H);
+  return state.get();
+}
+
+// Lends the features detected so far to a BPFtrace for an input
+class FeatureLoan
+{
+public:
+  FeatureLoan(BPFtrace& bpftrace, FuzzState& state)
+      : bpftrace_(bpftrace), state_(state)
+  {
+    std::swap(bpftrace_.feature_, state_.feature);
+  }
+  ~FeatureLoan()
+  {
+    std::swap(bpftrace_.feature_, state_.feature);
+  }
+
+private:
+  BPFtrace& bpftrace_;
+  FuzzState& state_;
+};
+
+int fuzz_one(FuzzState& state,
+             const std::string& script,
+             PhaseTimes& phases)
+{
+  auto phase_start = std::chrono::steady_clock::now();
+  auto phase_done = [&](const char* name) {
+    auto now = std::chrono::steady_clock::now();
+    phases.emplace_back(
+        name,
+        std::chrono::duration<double, std::milli>(now - phase_start).count());
+    phase_start = now;
+  };
 
   // reset global states
   TracepointFormatParser::clear_struct_list();
+  FakeMap::next_mapfd_ = 1;
 
   std::unique_ptr<Output> output;
   std::ostream* os = &std::cout;
   output = std::make_unique<TextOutput>(*os);
 
   BPFtrace bpftrace(std::move(output));
+  FeatureLoan loan(bpftrace, state);
   bpftrace.safe_mode_ = 0;
 
   Driver driver(bpftrace);
-  std::string script(data, sz);
   driver.source("fuzz", script);
 
   // Create AST
@@ -108,18 +155,15 @@ int fuzz_main(const char* data, size_t sz)
     return err;
 
   // Limit node size
-  uint64_t node_max = DEFAULT_NODE_MAX;
-  if (!get_uint64_env_var("BPFTRACE_NODE_MAX", node_max))
-    return 1;
   uint64_t node_count = 0;
   ast::CallbackVisitor counter(
       [&](ast::Node* node __attribute__((unused))) { node_count += 1; });
   driver.root_->accept(counter);
-  if (node_count > node_max)
+  if (node_count > state.node_max)
     return 1;
 
   // Field Analyzer
-  ast::FieldAnalyser fields(driver.root_, bpftrace, devnull);
+  ast::FieldAnalyser fields(driver.root_, bpftrace, state.devnull);
   err = fields.analyse();
   if (err)
     return err;
@@ -127,32 +171,21 @@ int fuzz_main(const char* data, size_t sz)
   // Tracepoint parser
   if (TracepointFormatParser::parse(driver.root_, bpftrace) == false)
     return 1;
+  phase_done("parse");
 
   // ClangParser
   ClangParser clang;
-  std::vector<std::string> extra_flags;
-  {
-    struct utsname utsname;
-    uname(&utsname);
-    std::string ksrc, kobj;
-    auto kdirs = get_kernel_dirs(utsname, !bpftrace.features_->has_btf());
-    ksrc = std::get<0>(kdirs);
-    kobj = std::get<1>(kdirs);
-
-    if (ksrc != "")
-      extra_flags = get_kernel_cflags(utsname.machine, ksrc, kobj);
-  }
-  extra_flags.push_back("-include");
-  extra_flags.push_back(CLANG_WORKAROUNDS_H);
-  if (!clang.parse(driver.root_, bpftrace, extra_flags))
+  if (!clang.parse(driver.root_, bpftrace, state.extra_flags))
     return 1;
   err = driver.parse();
   if (err)
     return err;
+  phase_done("ClangParser");
 
   // Semantic Analyzer
-  ast::SemanticAnalyser semantics(driver.root_, bpftrace, devnull, false);
+  ast::SemanticAnalyser semantics(driver.root_, bpftrace, state.devnull, false);
   err = semantics.analyse();
+  phase_done("SemanticAnalyser");
   if (err)
     return err;
 
@@ -171,8 +204,11 @@ int fuzz_main(const char* data, size_t sz)
   try
   {
     llvm.generate_ir();
+    phase_done("generate_ir");
     llvm.optimize();
+    phase_done("optimize");
     bpforc = llvm.emit();
+    phase_done("emit");
   }
   catch (const std::system_error& ex)
   {
@@ -189,3 +225,113 @@ int fuzz_main(const char* data, size_t sz)
 
   return 0;
 }
+
+// Performance pathologies, e.g. passes quadratic in some construct, don't
+// crash, so slow inputs are reported with where their time went. Aborting
+// has the fuzzer keep them with its crashes.
+void report_slow(const FuzzState& state,
+                 const std::string& script,
+                 const PhaseTimes& phases,
+                 double total_ms)
+{
+  std::cerr << "Slow input: " << static_cast<uint64_t>(total_ms) << " ms (";
+  for (size_t i = 0; i < phases.size(); i++)
+    std::cerr << (i ? ", " : "") << phases[i].first << " "
+              << static_cast<uint64_t>(phases[i].second) << " ms";
+  std::cerr << "), " << script.size() << " bytes:" << std::endl
+            << script << std::endl;
+  if (state.slow_abort)
+    abort();
+}
+
+#ifndef LIBFUZZER
+// Reads the input from the file, or stdin (AFL's default) without one
+bool read_input(const char* filename, std::string& input)
+{
+  std::stringstream buf;
+  if (!filename)
+  {
+    std::string line;
+    std::cin.clear();
+    while (std::getline(std::cin, line))
+      buf << line << std::endl;
+  }
+  else
+  {
+    std::ifstream file(filename);
+    if (file.fail())
+      return false;
+    buf << file.rdbuf();
+  }
+  input = buf.str();
+  return true;
+}
+
+int run_input(const char* filename)
+{
+  std::string input;
+  if (!read_input(filename, input))
+    return 1;
+  return fuzz_main(input.c_str(), input.size());
+}
+#endif // !LIBFUZZER
+
+} // namespace
+
+#ifdef LIBFUZZER
+// main entry for libufuzzer
+// libfuzzer.a provides main function
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t sz)
+{
+  fuzz_main((const char*)data, sz);
+  return 0; // Non-zero return values are reserved for future use.
+}
+#else
+// main function for AFL, etc.
+int main(int argc, char* argv[])
+{
+  const char* filename = argc > 1 ? argv[1] : nullptr;
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+  // Built with afl-clang-fast: the inputs are run one after the other in
+  // this process (persistent mode) rather than in a fork each
+  __AFL_INIT();
+  int ret = 0;
+  while (__AFL_LOOP(AFL_LOOP_COUNT))
+    ret = run_input(filename);
+  return ret;
+#else
+  if (argc <= 2)
+    return run_input(filename);
+
+  // Several files, e.g. a corpus, are all run in this process
+  for (int i = 1; i < argc; i++)
+    run_input(argv[i]);
+  return 0;
+#endif
+}
+
+#endif // LIBFUZZER
+
+int fuzz_main(const char* data, size_t sz)
+{
+  if (data == nullptr || sz == 0)
+    return 0;
+
+  if (getuid() != 0)
+    return 1;
+
+  FuzzState* state = get_state();
+  if (!state)
+    return 1;
+
+  std::string script(data, sz);
+  PhaseTimes phases;
+  auto start = std::chrono::steady_clock::now();
+  int err = fuzz_one(*state, script, phases);
+  double total_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  if (state->slow_ms && total_ms > state->slow_ms)
+    report_slow(*state, script, phases, total_ms);
+  return err;
+}
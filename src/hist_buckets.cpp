@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <cstring>
+
+#include "hist_buckets.h"
+
+namespace bpftrace {
+
+static uint64_t hash_key(const uint8_t *key, size_t key_size)
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < key_size; i++)
+  {
+    hash ^= key[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void HistBuckets::reset(size_t nbuckets)
+{
+  nbuckets_ = nbuckets;
+  size_ = 0;
+  std::fill(slots_.begin(), slots_.end(), 0);
+}
+
+std::vector<uint64_t> &HistBuckets::buckets(const uint8_t *key,
+                                            size_t key_size)
+{
+  // Keep the table at most half full
+  if ((size_ + 1) * 2 > slots_.size())
+    grow();
+
+  uint64_t hash = hash_key(key, key_size);
+  size_t mask = slots_.size() - 1;
+  size_t slot = hash & mask;
+  while (slots_[slot])
+  {
+    Entry &entry = entries_[slots_[slot] - 1];
+    if (entry.hash == hash && entry.key.size() == key_size &&
+        std::memcmp(entry.key.data(), key, key_size) == 0)
+      return entry.buckets;
+    slot = (slot + 1) & mask;
+  }
+
+  if (size_ == entries_.size())
+    entries_.emplace_back();
+  Entry &entry = entries_[size_++];
+  entry.key.assign(key, key + key_size);
+  entry.buckets.assign(nbuckets_, 0);
+  entry.total = 0;
+  entry.hash = hash;
+  slots_[slot] = size_;
+  return entry.buckets;
+}
+
+void HistBuckets::compute_totals()
+{
+  for (size_t i = 0; i < size_; i++)
+  {
+    Entry &entry = entries_[i];
+    entry.total = 0;
+    for (uint64_t count : entry.buckets)
+      entry.total += count;
+  }
+}
+
+void HistBuckets::grow()
+{
+  slots_.assign(std::max<size_t>(64, slots_.size() * 2), 0);
+  size_t mask = slots_.size() - 1;
+  for (size_t i = 0; i < size_; i++)
+  {
+    size_t slot = entries_[i].hash & mask;
+    while (slots_[slot])
+      slot = (slot + 1) & mask;
+    slots_[slot] = i + 1;
+  }
+}
+
+} // namespace bpftrace
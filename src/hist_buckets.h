@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bpftrace {
+
+/**
+   Buckets of a hist() or lhist() map, grouped by the key the user sees.
+
+   The kernel map stores one entry per (key, bucket) pair. This folds them
+   into one zero-filled, contiguous bucket array per key, looked up through an
+   open addressing table over the key bytes. reset() keeps every allocation
+   around so that printing the same map again (e.g. from an interval probe)
+   doesn't have to reallocate them.
+*/
+class HistBuckets
+{
+public:
+  struct Entry
+  {
+    std::vector<uint8_t> key;
+    std::vector<uint64_t> buckets;
+    // Sum of all the buckets, filled in by compute_totals()
+    uint64_t total = 0;
+    uint64_t hash = 0;
+  };
+
+  /**
+     Drop all the entries, the following ones have nbuckets buckets
+  */
+  void reset(size_t nbuckets);
+
+  /**
+     Buckets of key, added with all buckets zeroed if it's not there yet
+  */
+  std::vector<uint64_t> &buckets(const uint8_t *key, size_t key_size);
+
+  void compute_totals();
+
+  size_t size() const
+  {
+    return size_;
+  }
+  const Entry &operator[](size_t i) const
+  {
+    return entries_[i];
+  }
+
+private:
+  void grow();
+
+  size_t nbuckets_ = 0;
+  size_t size_ = 0;
+  // Only the first size_ entries are in use, the rest are kept for reuse
+  std::vector<Entry> entries_;
+  // Index + 1 into entries_, 0 marks a free slot. The size is a power of 2.
+  std::vector<uint32_t> slots_;
+};
+
+} // namespace bpftrace
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "bpffeature.h"
 #include "mapkey.h"
 #include "types.h"
 
@@ -9,6 +12,19 @@
 
 namespace bpftrace {
 
+// How the hash maps backing the maps of a script are allocated, see
+// BPFTRACE_MAP_ALLOC
+enum class MapAlloc
+{
+  // Every entry is allocated up front, inserts fail once the map is full
+  prealloc,
+  // BPF_F_NO_PREALLOC, entries are allocated on insert
+  no_prealloc,
+  // LRU hash maps, inserting into a full map evicts the least recently
+  // used entries
+  lru,
+};
+
 class IMap
 {
 public:
@@ -22,9 +38,12 @@ public:
   SizedType type_;
   MapKey key_;
   enum bpf_map_type map_type_;
+  // Number of entries the map was created with
+  uint32_t max_entries_ = 0;
   bool is_per_cpu_type()
   {
     return map_type_ == BPF_MAP_TYPE_PERCPU_HASH ||
+           map_type_ == BPF_MAP_TYPE_LRU_PERCPU_HASH ||
            map_type_ == BPF_MAP_TYPE_PERCPU_ARRAY;
   }
   bool is_clearable() const
@@ -33,13 +52,191 @@ public:
            map_type_ != BPF_MAP_TYPE_PERCPU_ARRAY;
   }
 
+  // Double-buffered maps: the BPF programs update the map stored in
+  // outer_mapfd_, which is mapfd_. print() has userspace swap mapfd_ with
+  // spare_mapfd_ and read the snapshot left in spare_mapfd_, which the
+  // following clear() empties.
+  virtual int make_double_buffered() = 0;
+  // Replace spare_mapfd_ with a new empty map, so that clear() doesn't have
+  // to delete the entries one by one
+  virtual int renew_spare() = 0;
+  bool is_double_buffered() const
+  {
+    return outer_mapfd_ >= 0;
+  }
+  // Map userspace reads from and clears
+  int read_mapfd() const
+  {
+    return snapshot_ ? spare_mapfd_ : mapfd_;
+  }
+  int outer_mapfd_ = -1;
+  int spare_mapfd_ = -1;
+  bool snapshot_ = false;
+
+  // Maps declared as window(N): there's a map per slot of the window, the
+  // BPF programs update the one of the current window_slot_ns_ long slice
+  // of bpf_ktime_get_ns(), which they look up in window_outer_mapfd_.
+  // Userspace sums up the slots when reading the map, and replaces the slot
+  // the programs move to next with an empty map, see
+  // BPFtrace::advance_windows().
+  virtual int make_windowed(uint32_t slots, uint64_t slot_ns) = 0;
+  virtual int renew_window_slot(uint32_t slot) = 0;
+  bool is_windowed() const
+  {
+    return window_outer_mapfd_ >= 0;
+  }
+  // The first slot is mapfd_
+  std::vector<int> window_mapfds_;
+  int window_outer_mapfd_ = -1;
+  uint64_t window_slot_ns_ = 0;
+  // The last slice seen by advance_windows(), 0 before the first
+  uint64_t window_slice_ = 0;
+
+  // Maps declared as ttl(N): the BPF programs record when they last updated
+  // each entry, in bpf_ktime_get_ns(), in the hash map ttl_mapfd_ under the
+  // same key. Userspace deletes the entries that weren't updated for ttl_ns_
+  // every second, see BPFtrace::expire_maps().
+  virtual int make_ttl(uint64_t ttl_ns) = 0;
+  int ttl_mapfd_ = -1;
+  uint64_t ttl_ns_ = 0;
+
+  // Keyless count(), sum(), hist(), lhist() and integer maps can be created
+  // as a BPF_F_MMAPABLE array shared by all CPUs. The BPF programs update it
+  // with atomic adds and userspace reads it through mmapped_ without any
+  // syscall. The index is the bucket number, or 0 for the others, whose
+  // single value the programs address directly rather than looking it up.
+  bool is_mmapped() const
+  {
+    return mmapped_ != nullptr;
+  }
+  // Integers are followed by whether they are set, as a hash map would be
+  // missing them when they aren't
+  size_t mmapped_value_size() const
+  {
+    return type_.IsIntTy() ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+  }
+  void *mmapped_ = nullptr;
+  size_t mmapped_size_ = 0;
+
+  // cms_count() maps: the count-min sketch the counts are read from, mapfd_
+  // only holds the keys tracked as heavy hitters.
+  int sketch_mapfd_ = -1;
+
+  // Maps keyed by a single integer known to be below max_entries_, e.g.
+  // @[cpu], are created as arrays indexed by the key instead of hash maps.
+  // Entries still holding 0 are left out when the map is read, as they would
+  // be missing from a hash map.
+  bool dense_ = false;
+
+  // int maps keyed by tid, e.g. @start[tid], can be stored with the current
+  // task rather than in a hash map. The entries can't be listed from
+  // userspace, which reads such maps as empty.
+  bool task_storage_ = false;
+
+  // Maps keyed by a single string can be keyed by a 64-bit hash of it
+  // instead, see BPFTRACE_HASH_STR_KEYS. The programs record each string in
+  // the hash map strings_mapfd_, keyed by its hash, the first time they see
+  // it, and userspace puts the strings back when reading the map.
+  bool hashed_key_ = false;
+  int strings_mapfd_ = -1;
+  // Bytes taken by key_ in the keys of the BPF map
+  size_t bpf_key_args_size() const
+  {
+    return hashed_key_ ? sizeof(uint64_t) : key_.packed_size();
+  }
+
+  // Keyed hist() and lhist() maps can hold all the buckets of a key in its
+  // value, see BPFTRACE_HIST_ARRAYS, rather than an entry per bucket keyed by
+  // the key followed by the bucket number. The programs add to the bucket in
+  // place and userspace splits the arrays back into an entry per bucket when
+  // reading the map. This is the number of buckets, 0 for the other maps.
+  uint32_t bucket_array_ = 0;
+  // Values are zeroed with stores when a key is added, which the BPF backend
+  // only emits for so many bytes
+  static constexpr uint32_t BUCKET_ARRAY_MAX = 128;
+  // Buckets of a hist() or lhist() value, 0 for the other types
+  static uint32_t hist_buckets(const SizedType &type,
+                               int min,
+                               int max,
+                               int step)
+  {
+    if (type.IsHistTy())
+      return 65;
+    if (type.IsLhistTy() && step > 0)
+      return (max - min) / step + 2;
+    return 0;
+  }
+  // Bytes of the keys of the BPF map, hist(), lhist() and llhist() keys are
+  // followed by the bucket number unless they hold a bucket array
+  size_t bpf_key_size() const
+  {
+    size_t size = bpf_key_args_size();
+    if ((type_.IsHistTy() || type_.IsLhistTy() || type_.IsLlhistTy()) &&
+        !bucket_array_)
+      size += 8;
+    return size;
+  }
+  // Bytes of the values of the BPF map, of each CPU for per-CPU maps
+  size_t bpf_value_size() const
+  {
+    return bucket_array_ ? bucket_array_ * sizeof(uint64_t) : type_.GetSize();
+  }
+
+  // Maps declared as bloom(N) are sets of their keys, which can be added and
+  // looked up, but neither listed nor removed. They are
+  // BPF_MAP_TYPE_BLOOM_FILTER maps holding the keys as values or, on kernels
+  // without them, a single array entry of bloom_bytes_ bytes of which the
+  // programs set to 1 the BLOOM_HASHES given by the hash of a key.
+  bool bloom_ = false;
+  uint32_t bloom_bytes_ = 0;
+  static constexpr int BLOOM_HASHES = 7;
+  // About 1% of false positives up to this size, 10 bytes per key
+  static constexpr uint32_t BLOOM_BYTES_MAX = 1 << 21;
+
   // unique id of this map. Used by (bpf) runtime to reference
   // this map
   uint32_t id;
-  // used by lhist(). TODO: move to separate Map object.
+  // used by lhist() and llhist(). TODO: move to separate Map object.
   int lqmin;
   int lqmax;
   int lqstep;
 };
 
+// Creates the map of a bloom(N) declaration, see IMap::bloom_
+template <typename T>
+std::unique_ptr<T> create_bloom_map(const std::string &name,
+                                    const SizedType &type,
+                                    const MapKey &key,
+                                    uint32_t max_entries,
+                                    bool bloom_filter)
+{
+  std::unique_ptr<T> map;
+  if (bloom_filter)
+  {
+    map = std::make_unique<T>(name,
+                              static_cast<enum bpf_map_type>(
+                                  libbpf::BPF_MAP_TYPE_BLOOM_FILTER),
+                              0,
+                              key.size(),
+                              max_entries,
+                              0);
+  }
+  else
+  {
+    // A power of 2, for the programs to mask the hashes into it
+    uint32_t bytes = 8;
+    while (bytes < 10ULL * max_entries && bytes < IMap::BLOOM_BYTES_MAX)
+      bytes *= 2;
+    map = std::make_unique<T>(
+        name, BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), bytes, 1, 0);
+    map->bloom_bytes_ = bytes;
+  }
+  map->type_ = type;
+  map->key_ = key;
+  map->bloom_ = true;
+  // The number of keys declared rather than the entries of the array
+  map->max_entries_ = max_entries;
+  return map;
+}
+
 } // namespace bpftrace
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+
+#include "ksyms.h"
+
+namespace bpftrace {
+
+bool KSyms::load()
+{
+  if (!loaded_)
+  {
+    std::ifstream file("/proc/kallsyms");
+    if (file)
+      load(file);
+    loaded_ = true;
+  }
+  return !addrs_.empty();
+}
+
+void KSyms::load(std::istream &kallsyms)
+{
+  std::vector<uint64_t> addrs;
+  std::vector<uint32_t> names;
+  std::string blob;
+
+  // <address> <type> <name>[\t[<module>]]
+  std::string line;
+  while (std::getline(kallsyms, line))
+  {
+    const char *begin = line.data();
+    const char *end = begin + line.size();
+    uint64_t addr = 0;
+    auto res = std::from_chars(begin, end, addr, 16);
+    if (res.ec != std::errc() || addr == 0)
+      continue;
+
+    // Skip the type
+    const char *name = res.ptr;
+    while (name < end && *name == ' ')
+      name++;
+    name = static_cast<const char *>(memchr(name, ' ', end - name));
+    if (!name)
+      continue;
+    name++;
+    const char *name_end = std::find_if(
+        name, end, [](char c) { return c == '\t' || c == ' '; });
+    if (name == name_end)
+      continue;
+
+    addrs.push_back(addr);
+    names.push_back(blob.size());
+    blob.append(name, name_end);
+    blob.push_back('\0');
+  }
+
+  // /proc/kallsyms is mostly sorted already, the modules come last
+  std::vector<uint32_t> order(addrs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return addrs[a] < addrs[b];
+  });
+
+  addrs_.resize(order.size());
+  names_.resize(order.size());
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    addrs_[i] = addrs[order[i]];
+    names_[i] = names[order[i]];
+  }
+  name_blob_ = std::move(blob);
+  loaded_ = true;
+}
+
+bool KSyms::resolve(uint64_t addr, bool show_offset, std::string &out) const
+{
+  auto it = std::upper_bound(addrs_.begin(), addrs_.end(), addr);
+  if (it == addrs_.begin())
+    return false;
+
+  size_t i = it - addrs_.begin() - 1;
+  out += name_blob_.c_str() + names_[i];
+  if (show_offset)
+  {
+    char offset[20];
+    auto res = std::to_chars(offset, offset + sizeof(offset), addr - addrs_[i]);
+    out += '+';
+    out.append(offset, res.ptr);
+  }
+  return true;
+}
+
+} // namespace bpftrace
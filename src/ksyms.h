@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace bpftrace {
+
+/**
+   Kernel symbols read once from /proc/kallsyms.
+
+   The symbols are kept sorted by address as two arrays, the addresses and
+   the offsets of their names into a single blob of NUL terminated names, so
+   looking an address up is a binary search over the addresses alone.
+*/
+class KSyms
+{
+public:
+  /**
+     Read /proc/kallsyms, unless already done. Returns false when no symbol
+     could be read, e.g. when their addresses are hidden by kptr_restrict.
+  */
+  bool load();
+
+  /**
+     Read symbols in the /proc/kallsyms format
+  */
+  void load(std::istream &kallsyms);
+
+  /**
+     Append the symbol containing addr to out, followed by +offset when
+     show_offset is set. Returns false, leaving out untouched, when addr is
+     below the first symbol.
+  */
+  bool resolve(uint64_t addr, bool show_offset, std::string &out) const;
+
+  size_t size() const
+  {
+    return addrs_.size();
+  }
+
+private:
+  bool loaded_ = false;
+  std::vector<uint64_t> addrs_;
+  std::vector<uint32_t> names_;
+  std::string name_blob_;
+};
+
+} // namespace bpftrace
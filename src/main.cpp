@@ -1,7 +1,9 @@
 #include <array>
+#include <chrono>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
@@ -12,7 +14,6 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "ast/node_counter.h"
 #include "bpffeature.h"
 #include "bpforc.h"
 #include "bpftrace.h"
@@ -20,17 +21,25 @@
 #include "child.h"
 #include "clang_parser.h"
 #include "codegen_llvm.h"
+#include "compile.h"
+#include "daemon.h"
 #include "driver.h"
 #include "field_analyser.h"
 #include "lockdown.h"
 #include "log.h"
+#include "map_pins.h"
+#include "optimizer.h"
 #include "output.h"
+#include "output_writer.h"
 #include "pass_manager.h"
 #include "printer.h"
 #include "probe_matcher.h"
 #include "procmon.h"
+#include "program_image.h"
 #include "semantic_analyser.h"
+#include "timings.h"
 #include "tracepoint_format_parser.h"
+#include "usdt.h"
 
 using namespace bpftrace;
 
@@ -47,6 +56,23 @@ enum class TestMode
   SEMANTIC,
   CODEGEN,
 };
+// BPFTRACE_OUTPUT_BUFFER when it's not set with --compress, rotation or
+// --printf-output
+const uint64_t OUTPUT_BUFFER_IMPLIED = 16 * 1024 * 1024;
+// Samples a second taken with --self-profile, off the round numbers so as
+// not to run in lockstep with bpftrace's own timers
+const int SELF_PROFILE_HZ = 99;
+
+// Prints the --timings on the way out of main(), whichever return that is
+struct TimingsReport
+{
+  bool json = false;
+  ~TimingsReport()
+  {
+    if (Timings::get().enabled())
+      Timings::get().report(std::cerr, json);
+  }
+};
 } // namespace
 
 void usage()
@@ -58,39 +84,128 @@ void usage()
   std::cerr << "    bpftrace [options] -e 'program'" << std::endl;
   std::cerr << std::endl;
   std::cerr << "OPTIONS:" << std::endl;
-  std::cerr << "    -B MODE        output buffering mode ('full', 'none')" << std::endl;
-  std::cerr << "    -f FORMAT      output format ('text', 'json')" << std::endl;
+  std::cerr << "    -B MODE        output buffering mode ('line', 'full', 'none'), line for a terminal otherwise full by default" << std::endl;
+  std::cerr << "    -f FORMAT      output format ('text', 'json', 'folded', 'binary')" << std::endl;
   std::cerr << "    -o file        redirect bpftrace output to file" << std::endl;
   std::cerr << "    -d             debug info dry run" << std::endl;
   std::cerr << "    -dd            verbose debug info dry run" << std::endl;
   std::cerr << "    -e 'program'   execute this program" << std::endl;
+  std::cerr << "    --emit-elf FILE" << std::endl;
+  std::cerr << "                   write the compiled program to FILE, which bpftrace can run" << std::endl;
   std::cerr << "    -h, --help     show this help message" << std::endl;
   std::cerr << "    -I DIR         add the directory to the include search path" << std::endl;
   std::cerr << "    --include FILE add an #include file before preprocessing" << std::endl;
   std::cerr << "    -l [search]    list probes" << std::endl;
-  std::cerr << "    -p PID         enable USDT probes on PID" << std::endl;
+  std::cerr << "    -p PID         enable USDT probes on PID, and only run the other probes for PID" << std::endl;
+  std::cerr << "    --cgroup PATH  only run the probes for the tasks in the cgroup at PATH" << std::endl;
+  std::cerr << "    --pids PID,... only run the probes for these processes and those they fork" << std::endl;
+  std::cerr << "    --comm NAME    only run the probes for the processes named NAME and those they fork" << std::endl;
+  std::cerr << "    --metrics [HOST:]PORT" << std::endl;
+  std::cerr << "                   serve the maps over HTTP in the OpenMetrics format, for Prometheus" << std::endl;
+  std::cerr << "    --metrics-maps @MAP,..." << std::endl;
+  std::cerr << "                   only serve these maps with --metrics" << std::endl;
+  std::cerr << "    --snapshot FILE" << std::endl;
+  std::cerr << "                   write the aggregate maps to FILE on exit, for --merge, instead of printing them" << std::endl;
+  std::cerr << "    --merge FILE..." << std::endl;
+  std::cerr << "                   print the maps of the --snapshot FILEs combined" << std::endl;
+  std::cerr << "    --pin-maps NAME" << std::endl;
+  std::cerr << "                   pin the maps and their layout under /sys/fs/bpf/NAME for other readers" << std::endl;
+  std::cerr << "    --attach-session NAME" << std::endl;
+  std::cerr << "                   print the maps of the bpftrace running with --pin-maps NAME" << std::endl;
+  std::cerr << "    --print @MAP   only print @MAP with --attach-session, or on SIGUSR1" << std::endl;
+  std::cerr << "    --enable PROBE, --disable PROBE" << std::endl;
+  std::cerr << "                   turn PROBE of the session of --attach-session on or off" << std::endl;
+  std::cerr << "    --output-socket unix:PATH|HOST:PORT" << std::endl;
+  std::cerr << "                   send the output to a socket as length-framed records, rather than to stdout" << std::endl;
+  std::cerr << "    --compress FORMAT" << std::endl;
+  std::cerr << "                   compress the output ('zstd', 'lz4')" << std::endl;
+  std::cerr << "    --printf-output FILE" << std::endl;
+  std::cerr << "                   write the printf() messages to FILE, through a writer thread of their own" << std::endl;
+  std::cerr << "    --printf-compress FORMAT" << std::endl;
+  std::cerr << "                   compress the FILE of --printf-output ('zstd', 'lz4')" << std::endl;
   std::cerr << "    -c 'CMD'       run CMD and enable USDT probes on resulting process" << std::endl;
+  std::cerr << "    --repeat N     run the CMD of -c N times, printing and clearing the maps after each run" << std::endl;
   std::cerr << "    --usdt-file-activation" << std::endl;
   std::cerr << "                   activate usdt semaphores based on file path" << std::endl;
   std::cerr << "    --unsafe       allow unsafe builtin functions" << std::endl;
   std::cerr << "    -q             keep messages quiet" << std::endl;
   std::cerr << "    -v             verbose messages" << std::endl;
   std::cerr << "    --info         Print information about kernel BPF support" << std::endl;
+  std::cerr << "    --timings[=FORMAT]" << std::endl;
+  std::cerr << "                   print the time taken by each phase on exit ('text', 'json')" << std::endl;
+  std::cerr << "    --estimate[=SECONDS]" << std::endl;
+  std::cerr << "                   only count the runs of the probes for SECONDS (5), then print their rates and the projected cost of the program" << std::endl;
+  std::cerr << "    --flight-recorder[=SECONDS]" << std::endl;
+  std::cerr << "                   keep the printf() events in the kernel and only print those of the last SECONDS (10) on dump() or SIGUSR2" << std::endl;
+  std::cerr << "    --off-cpu[=MIN_US]" << std::endl;
+  std::cerr << "                   sum the time threads spend off-CPU of at least MIN_US by stack, printed folded on exit" << std::endl;
+  std::cerr << "    --self-profile[=FILE]" << std::endl;
+  std::cerr << "                   sample the stacks of bpftrace itself and print them folded on exit (to FILE)" << std::endl;
+  std::cerr << "    --daemon SOCKET" << std::endl;
+  std::cerr << "                   run the programs sent to the unix socket SOCKET, sharing the startup work" << std::endl;
+  std::cerr << "    --reload       run the program file again on SIGHUP, keeping unchanged maps and probes" << std::endl;
+  std::cerr << "    --redetect-features" << std::endl;
+  std::cerr << "                   detect the kernel BPF features again instead of using the cached ones" << std::endl;
   std::cerr << "    -k             emit a warning when a bpf helper returns an error (except read functions)" << std::endl;
   std::cerr << "    -kk            check all bpf helper functions" << std::endl;
   std::cerr << "    -V, --version  bpftrace version" << std::endl;
   std::cerr << "    --no-warnings  disable all warning messages" << std::endl;
+  std::cerr << "    --raw-symbols  print raw addresses and a module map instead of symbols" << std::endl;
+  std::cerr << "    --symbolize FILE" << std::endl;
+  std::cerr << "                   resolve the symbols of --raw-symbols output ('-' for stdin)" << std::endl;
   std::cerr << std::endl;
   std::cerr << "ENVIRONMENT:" << std::endl;
   std::cerr << "    BPFTRACE_STRLEN             [default: 64] bytes on BPF stack per str()" << std::endl;
   std::cerr << "    BPFTRACE_NO_CPP_DEMANGLE    [default: 0] disable C++ symbol demangling" << std::endl;
   std::cerr << "    BPFTRACE_MAP_KEYS_MAX       [default: 4096] max keys in a map" << std::endl;
+  std::cerr << "    BPFTRACE_STACK_MAP_ENTRIES  [default: 131072] max distinct stacks per stack map" << std::endl;
   std::cerr << "    BPFTRACE_CAT_BYTES_MAX      [default: 10k] maximum bytes read by cat builtin" << std::endl;
   std::cerr << "    BPFTRACE_MAX_PROBES         [default: 512] max number of probes" << std::endl;
   std::cerr << "    BPFTRACE_LOG_SIZE           [default: 1000000] log size in bytes" << std::endl;
   std::cerr << "    BPFTRACE_PERF_RB_PAGES      [default: 64] pages per CPU to allocate for ring buffer" << std::endl;
+  std::cerr << "    BPFTRACE_ADAPTIVE_SAMPLING  [default: 0] sample the runs of the probes down while events are lost" << std::endl;
+  std::cerr << "    BPFTRACE_MEMORY_BUDGET      [default: 0] refuse to start when the maps and buffers would lock more than this many MiB, 0 to disable" << std::endl;
+  std::cerr << "    BPFTRACE_PERF_RB_WAKEUP     [default: 1] events to buffer per CPU before waking up the reader" << std::endl;
+  std::cerr << "    BPFTRACE_PERF_CONSUMERS     [default: 0] threads reading the perf buffers, 0 or 1 reads them from the main thread" << std::endl;
+  std::cerr << "    BPFTRACE_RINGBUF_PAGES      [default: 512] pages to allocate for the shared BPF ring buffer, 0 to use perf buffers" << std::endl;
+  std::cerr << "    BPFTRACE_CONTROL_RINGBUF_PAGES [default: 4] pages of the ring buffer of exit(), print() and the other async actions, 0 to send them with the other events" << std::endl;
+  std::cerr << "    BPFTRACE_EVENT_BATCH        [default: 0] bytes of small printf() events each CPU sends at a time, 0 to send them one by one" << std::endl;
+  std::cerr << "    BPFTRACE_DEDUPE_MS          [default: 0] milliseconds a printf() event repeating the last one of its CPU is counted rather than sent, 0 to disable" << std::endl;
+  std::cerr << "    BPFTRACE_FLIGHT_RECORDER_EVENTS [default: 4096] printf() events each CPU keeps with --flight-recorder" << std::endl;
+  std::cerr << "    BPFTRACE_EVENT_STATS        [default: 0] seconds between printing received and lost event counts, 0 to disable" << std::endl;
+  std::cerr << "    BPFTRACE_PROBE_STATS        [default: 0] seconds between printing the run count and time of each probe, 0 to disable" << std::endl;
+  std::cerr << "    BPFTRACE_PROBE_COUNTS       [default: none] count the runs of each attached probe in the kernel and print them at exit, and every this many seconds unless 0" << std::endl;
+  std::cerr << "    BPFTRACE_PROBE_MAX_CPU      [default: 0] detach probes using more than this percentage of a CPU, 0 to disable" << std::endl;
+  std::cerr << "    BPFTRACE_PROBE_MAX_NS       [default: 0] detach probes taking more than this many ns per run, 0 to disable" << std::endl;
+  std::cerr << "    BPFTRACE_DOUBLE_BUFFER_MAPS [default: 0] double-buffer maps that are cleared right after being printed" << std::endl;
+  std::cerr << "    BPFTRACE_HASH_STR_KEYS      [default: 0] key the maps indexed by a string by a hash of it" << std::endl;
+  std::cerr << "    BPFTRACE_HIST_ARRAYS        [default: 0] store the buckets of each key of hist() and lhist() maps in one value" << std::endl;
+  std::cerr << "    BPFTRACE_STREAM_MAPS        [default: 0] print the maps unsorted as they are read, a batch of entries at a time" << std::endl;
+  std::cerr << "    BPFTRACE_COALESCE_READS     [default: 0] read the fields a probe accesses through the same pointer at once" << std::endl;
+  std::cerr << "    BPFTRACE_KPROBE_TO_KFUNC    [default: 0] attach the kprobes only reading argN and retval as kfuncs" << std::endl;
+  std::cerr << "    BPFTRACE_HELPER_ERROR_EVENTS [default: 0] send an event for every helper error of -k, rather than counting them" << std::endl;
+  std::cerr << "    BPFTRACE_MAP_ALLOC          [default: prealloc] allocation of map entries: prealloc, noprealloc (on insert) or lru (evict when full)" << std::endl;
   std::cerr << "    BPFTRACE_NO_USER_SYMBOLS    [default: 0] disable user symbol resolution" << std::endl;
   std::cerr << "    BPFTRACE_CACHE_USER_SYMBOLS [default: auto] enable user symbol cache" << std::endl;
+  std::cerr << "    BPFTRACE_SYMBOL_CACHE_DIR   [default: none] directory of the on-disk user symbol indexes" << std::endl;
+  std::cerr << "    BPFTRACE_PROGRAM_CACHE_DIR  [default: none] directory to cache compiled programs in" << std::endl;
+  std::cerr << "    BPFTRACE_SYMBOLIZE_THREADS  [default: 0] threads resolving the user symbols of printf() events, 0 to resolve them inline" << std::endl;
+  std::cerr << "    BPFTRACE_SYSTEM_THREADS     [default: 0] threads running the system() commands, 0 to run them inline" << std::endl;
+  std::cerr << "    BPFTRACE_SYSTEM_QUEUE       [default: 64] system() commands queued or running before the queue is full" << std::endl;
+  std::cerr << "    BPFTRACE_SYSTEM_FULL        [default: block] when the system() queue is full: block (wait for a command) or drop" << std::endl;
+  std::cerr << "    BPFTRACE_CAT_CACHE_MS       [default: 0] milliseconds the contents read by cat() are reused for the same path" << std::endl;
+  std::cerr << "    BPFTRACE_CAT_FDS            [default: 0] files of cat() kept open and read again with pread()" << std::endl;
+  std::cerr << "    BPFTRACE_CAT_THREADS        [default: 0] threads reading the files of cat(), 0 to read them inline" << std::endl;
+  std::cerr << "    BPFTRACE_LOAD_THREADS       [default: 0] threads loading the programs before they are attached and detaching them on exit, 0 for one per CPU, 1 for none" << std::endl;
+  std::cerr << "    BPFTRACE_CODEGEN_THREADS    [default: 0] threads optimizing and compiling the programs, 0 for one per CPU, 1 for none" << std::endl;
+  std::cerr << "    BPFTRACE_PRINT_THREADS      [default: 0] threads reading the maps printed on exit, 0 for one per CPU, 1 for none" << std::endl;
+  std::cerr << "    BPFTRACE_ITER_BUFFER_SIZE   [default: 65536] bytes read from an iter probe at a time" << std::endl;
+  std::cerr << "    BPFTRACE_OUTPUT_BUFFER      [default: 0] bytes of output queued for a writer thread, 0 to write it from the main thread" << std::endl;
+  std::cerr << "    BPFTRACE_OUTPUT_FULL        [default: block] when the output queue is full: block (wait for the writer) or drop" << std::endl;
+  std::cerr << "    BPFTRACE_OUTPUT_ROTATE_SIZE [default: 0] bytes written to the -o file before it's rotated, 0 for no limit" << std::endl;
+  std::cerr << "    BPFTRACE_OUTPUT_ROTATE_INTERVAL [default: 0] seconds before the -o file is rotated, 0 for no limit" << std::endl;
+  std::cerr << "    BPFTRACE_SELF_STATS         [default: 0] seconds between printing what bpftrace itself did (also on SIGUSR1), 0 to disable" << std::endl;
+  std::cerr << "    BPFTRACE_OPT_LEVEL          [default: 3] 0 to only inline, 1 for a short pass list tuned for bpftrace, 2 or 3 for LLVM's -O2 or -O3" << std::endl;
   std::cerr << "    BPFTRACE_VMLINUX            [default: none] vmlinux path used for kernel symbol resolution" << std::endl;
   std::cerr << "    BPFTRACE_BTF                [default: none] BTF file" << std::endl;
   std::cerr << std::endl;
@@ -252,6 +367,18 @@ static std::optional<struct timespec> get_boottime()
   if (!get_uint64_env_var("BPFTRACE_MAP_KEYS_MAX", bpftrace.mapmax_))
     return false;
 
+  if (!get_uint64_env_var("BPFTRACE_STACK_MAP_ENTRIES",
+                          bpftrace.stack_map_entries_))
+    return false;
+  if (bpftrace.stack_map_entries_ == 0 ||
+      bpftrace.stack_map_entries_ > std::numeric_limits<int>::max())
+  {
+    LOG(ERROR) << "'BPFTRACE_STACK_MAP_ENTRIES' " << bpftrace.stack_map_entries_
+               << " is out of range, it must be between 1 and "
+               << std::numeric_limits<int>::max();
+    return false;
+  }
+
   if (!get_uint64_env_var("BPFTRACE_MAX_PROBES", bpftrace.max_probes_))
     return false;
 
@@ -261,6 +388,288 @@ static std::optional<struct timespec> get_boottime()
   if (!get_uint64_env_var("BPFTRACE_PERF_RB_PAGES", bpftrace.perf_rb_pages_))
     return false;
 
+  if (!get_uint64_env_var("BPFTRACE_PERF_RB_WAKEUP", bpftrace.perf_rb_wakeup_))
+    return false;
+
+  uint64_t memory_budget_mib = 0;
+  if (!get_uint64_env_var("BPFTRACE_MEMORY_BUDGET", memory_budget_mib))
+    return false;
+  bpftrace.memory_budget_ = memory_budget_mib << 20;
+
+  if (!get_uint64_env_var("BPFTRACE_PERF_CONSUMERS",
+                          bpftrace.perf_consumer_threads_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_RINGBUF_PAGES", bpftrace.ringbuf_pages_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_CONTROL_RINGBUF_PAGES",
+                          bpftrace.control_ringbuf_pages_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_EVENT_BATCH", bpftrace.event_batch_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_DEDUPE_MS", bpftrace.dedupe_ms_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_FLIGHT_RECORDER_EVENTS",
+                          bpftrace.flight_recorder_events_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_SYMBOLIZE_THREADS",
+                          bpftrace.symbolize_threads_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_LOAD_THREADS", bpftrace.load_threads_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_CODEGEN_THREADS",
+                          bpftrace.codegen_threads_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_PRINT_THREADS", bpftrace.print_threads_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_SYSTEM_THREADS",
+                          bpftrace.system_threads_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_CAT_CACHE_MS", bpftrace.cat_cache_ms_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_CAT_FDS", bpftrace.cat_fds_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_CAT_THREADS", bpftrace.cat_threads_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_SYSTEM_QUEUE", bpftrace.system_queue_))
+    return false;
+  if (bpftrace.system_queue_ == 0)
+  {
+    LOG(ERROR) << "Env var 'BPFTRACE_SYSTEM_QUEUE' must be at least 1.";
+    return false;
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_SYSTEM_FULL"))
+  {
+    if (std::string(env_p) == "drop")
+      bpftrace.system_drop_ = true;
+    else if (std::string(env_p) != "block")
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_SYSTEM_FULL' did not contain a valid "
+                    "value (block or drop).";
+      return false;
+    }
+  }
+
+  if (!get_uint64_env_var("BPFTRACE_ITER_BUFFER_SIZE",
+                          bpftrace.iter_buffer_size_))
+    return false;
+  if (bpftrace.iter_buffer_size_ == 0)
+  {
+    LOG(ERROR) << "Env var 'BPFTRACE_ITER_BUFFER_SIZE' must be at least 1";
+    return false;
+  }
+
+  if (!get_uint64_env_var("BPFTRACE_OPT_LEVEL", bpftrace.opt_level_))
+    return false;
+  if (bpftrace.opt_level_ > 3)
+  {
+    LOG(ERROR) << "Env var 'BPFTRACE_OPT_LEVEL' did not contain a valid value "
+                  "(0 to 3).";
+    return false;
+  }
+
+  if (!get_uint64_env_var("BPFTRACE_EVENT_STATS",
+                          bpftrace.event_stats_interval_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_PROBE_STATS",
+                          bpftrace.probe_stats_interval_))
+    return false;
+
+  if (std::getenv("BPFTRACE_PROBE_COUNTS"))
+  {
+    if (!get_uint64_env_var("BPFTRACE_PROBE_COUNTS",
+                            bpftrace.probe_counts_interval_))
+      return false;
+    bpftrace.probe_counts_ = true;
+  }
+
+  if (!get_uint64_env_var("BPFTRACE_PROBE_MAX_CPU",
+                          bpftrace.probe_max_cpu_pct_))
+    return false;
+
+  if (!get_uint64_env_var("BPFTRACE_PROBE_MAX_NS", bpftrace.probe_max_ns_))
+    return false;
+
+  if (const char *env_p = std::getenv("BPFTRACE_DOUBLE_BUFFER_MAPS"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.double_buffer_maps_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.double_buffer_maps_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_DOUBLE_BUFFER_MAPS' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_HASH_STR_KEYS"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.hash_str_keys_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.hash_str_keys_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_HASH_STR_KEYS' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_HIST_ARRAYS"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.hist_arrays_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.hist_arrays_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_HIST_ARRAYS' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_STREAM_MAPS"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.stream_maps_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.stream_maps_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_STREAM_MAPS' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_COALESCE_READS"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.coalesce_reads_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.coalesce_reads_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_COALESCE_READS' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_KPROBE_TO_KFUNC"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.kprobe_to_kfunc_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.kprobe_to_kfunc_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_KPROBE_TO_KFUNC' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_HELPER_ERROR_EVENTS"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.helper_error_events_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.helper_error_events_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_HELPER_ERROR_EVENTS' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_ADAPTIVE_SAMPLING"))
+  {
+    if (std::string(env_p) == "1")
+      bpftrace.adaptive_sampling_ = true;
+    else if (std::string(env_p) == "0")
+      bpftrace.adaptive_sampling_ = false;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_ADAPTIVE_SAMPLING' did not contain a "
+                    "valid value (0 or 1).";
+      return false;
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_MAP_ALLOC"))
+  {
+    std::string alloc(env_p);
+    if (alloc == "prealloc")
+      bpftrace.map_alloc_ = MapAlloc::prealloc;
+    else if (alloc == "noprealloc")
+      bpftrace.map_alloc_ = MapAlloc::no_prealloc;
+    else if (alloc == "lru")
+      bpftrace.map_alloc_ = MapAlloc::lru;
+    else
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_MAP_ALLOC' did not contain a valid "
+                    "value (prealloc, noprealloc or lru).";
+      return false;
+    }
+  }
+
+  if (bpftrace.ringbuf_pages_ & (bpftrace.ringbuf_pages_ - 1))
+  {
+    LOG(ERROR) << "'BPFTRACE_RINGBUF_PAGES' " << bpftrace.ringbuf_pages_
+               << " is not a power of 2.";
+    return false;
+  }
+
+  if (bpftrace.control_ringbuf_pages_ & (bpftrace.control_ringbuf_pages_ - 1))
+  {
+    LOG(ERROR) << "'BPFTRACE_CONTROL_RINGBUF_PAGES' "
+               << bpftrace.control_ringbuf_pages_ << " is not a power of 2.";
+    return false;
+  }
+
+  if (bpftrace.event_batch_ & (bpftrace.event_batch_ - 1))
+  {
+    LOG(ERROR) << "'BPFTRACE_EVENT_BATCH' " << bpftrace.event_batch_
+               << " is not a power of 2.";
+    return false;
+  }
+  if (bpftrace.event_batch_ > BPFtrace::EVENT_BATCH_MAX)
+  {
+    LOG(ERROR) << "'BPFTRACE_EVENT_BATCH' " << bpftrace.event_batch_
+               << " is more than " << BPFtrace::EVENT_BATCH_MAX << ".";
+    return false;
+  }
+
+  if (bpftrace.flight_recorder_events_ == 0 ||
+      bpftrace.flight_recorder_events_ & (bpftrace.flight_recorder_events_ - 1))
+  {
+    LOG(ERROR) << "'BPFTRACE_FLIGHT_RECORDER_EVENTS' "
+               << bpftrace.flight_recorder_events_
+               << " is not a power of 2.";
+    return false;
+  }
+
   if (!get_uint64_env_var("BPFTRACE_MAX_TYPE_RES_ITERATIONS",
                           bpftrace.max_type_res_iterations))
     return 1;
@@ -319,6 +728,18 @@ static std::optional<struct timespec> get_boottime()
                                    !bpftrace.is_aslr_enabled(-1);
   }
 
+  if (const char *env_p = std::getenv("BPFTRACE_SYMBOL_CACHE_DIR"))
+  {
+    if (*env_p)
+    {
+      bpftrace.symbol_cache_ = std::make_unique<SymbolCache>(env_p);
+      USDTHelper::set_cache_dir(env_p);
+    }
+  }
+
+  if (const char *env_p = std::getenv("BPFTRACE_PROGRAM_CACHE_DIR"))
+    bpftrace.program_cache_dir_ = env_p;
+
   uint64_t node_max = std::numeric_limits<uint64_t>::max();
   if (!get_uint64_env_var("BPFTRACE_NODE_MAX", node_max))
     return false;
@@ -327,82 +748,114 @@ static std::optional<struct timespec> get_boottime()
   return true;
 }
 
-[[nodiscard]] std::unique_ptr<ast::Node> parse(
-    BPFtrace& bpftrace,
-    const std::string& name,
-    const std::string& program,
-    const std::vector<std::string>& include_dirs,
-    const std::vector<std::string>& include_files)
+// Writes the maps that can be merged to file for --snapshot, print_maps()
+// then leaves them out
+static int write_snapshot(BPFtrace& bpftrace, const std::string& file)
 {
-  Driver driver(bpftrace);
-  driver.source(name, program);
-  int err;
-
-  err = driver.parse();
-  if (err)
-    return nullptr;
-
-  ast::FieldAnalyser fields(driver.root_, bpftrace);
-  err = fields.analyse();
-  if (err)
-    return nullptr;
-
-  if (TracepointFormatParser::parse(driver.root_, bpftrace) == false)
-    return nullptr;
-
-  ClangParser clang;
-  std::vector<std::string> extra_flags;
+  std::string snapshot;
+  try
   {
-    struct utsname utsname;
-    uname(&utsname);
-    std::string ksrc, kobj;
-    auto kdirs = get_kernel_dirs(utsname, !bpftrace.feature_->has_btf());
-    ksrc = std::get<0>(kdirs);
-    kobj = std::get<1>(kdirs);
-
-    if (ksrc != "")
-      extra_flags = get_kernel_cflags(utsname.machine, ksrc, kobj);
+    snapshot = ProgramImage::save_snapshot(bpftrace, bpftrace.unprinted_maps_);
   }
-  extra_flags.push_back("-include");
-  extra_flags.push_back(CLANG_WORKAROUNDS_H);
-
-  for (auto dir : include_dirs)
+  catch (const std::runtime_error& ex)
   {
-    extra_flags.push_back("-I");
-    extra_flags.push_back(dir);
+    LOG(ERROR) << "--snapshot: " << ex.what();
+    return 1;
   }
-  for (auto file : include_files)
+  std::ofstream out(file, std::ios::binary | std::ios::trunc);
+  out << snapshot;
+  out.close();
+  if (out.fail())
   {
-    extra_flags.push_back("-include");
-    extra_flags.push_back(file);
+    LOG(ERROR) << "--snapshot: failed to write " << file << ": "
+               << strerror(errno);
+    return 1;
   }
+  return 0;
+}
 
-  // NOTE(mmarchini): if there are no C definitions, clang parser won't run to
-  // avoid issues in some versions. Since we're including files in the command
-  // line, we want to force parsing, so we make sure C definitions are not
-  // empty before going to clang parser stage.
-  if (!include_files.empty() && driver.root_->c_definitions.empty())
-    driver.root_->c_definitions = "#define __BPFTRACE_DUMMY__";
-
-  if (!clang.parse(driver.root_, bpftrace, extra_flags))
-    return nullptr;
+// Prints the maps of the snapshots of --merge combined
+static int merge_snapshots(BPFtrace& bpftrace,
+                           const std::vector<std::string>& files)
+{
+  for (auto& file : files)
+  {
+    std::ifstream in(file, std::ios::binary);
+    std::stringstream buf;
+    buf << in.rdbuf();
+    if (in.fail())
+    {
+      LOG(ERROR) << "--merge: failed to read " << file << ": "
+                 << strerror(errno);
+      return 1;
+    }
+    try
+    {
+      ProgramImage::merge_snapshot(bpftrace, buf.str());
+    }
+    catch (const std::runtime_error& ex)
+    {
+      LOG(ERROR) << "--merge: " << file << ": " << ex.what();
+      return 1;
+    }
+  }
+  return bpftrace.print_maps();
+}
 
-  err = driver.parse();
-  if (err)
-    return nullptr;
+// Whether name can be the directory of pinned maps under /sys/fs/bpf
+static bool is_pin_name(const std::string& name)
+{
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string::npos;
+}
 
-  auto ast = driver.root_;
-  driver.root_ = nullptr;
-  return std::unique_ptr<ast::Node>(ast);
+// The compression named by option (--compress or --printf-compress), none
+// when it's empty
+static bool parse_compression(const std::string& name,
+                              const std::string& option,
+                              Compression& compression)
+{
+  compression = Compression::none;
+  if (name == "zstd")
+    compression = Compression::zstd;
+  else if (name == "lz4")
+    compression = Compression::lz4;
+  else if (!name.empty())
+  {
+    LOG(ERROR) << "USAGE: " << option << " must be either 'zstd' or 'lz4'.";
+    return false;
+  }
+  if (!OutputWriter::supports(compression))
+  {
+    LOG(ERROR) << option << ": bpftrace was built without " << name
+               << " support";
+    return false;
+  }
+  return true;
 }
 
-ast::PassManager CreatePM()
+// Prints the live maps of the session pinned under dir for
+// --attach-session, or only the ones named
+static int print_session_maps(BPFtrace& bpftrace,
+                              const std::string& dir,
+                              const std::vector<std::string>& names)
 {
-  ast::PassManager pm;
-  pm.AddPass(ast::CreateSemanticPass());
-  pm.AddPass(ast::CreateCounterPass());
-  pm.AddPass(ast::CreateMapCreatePass());
-  return pm;
+  if (open_pinned_maps(bpftrace, dir) < 0)
+    return 1;
+  if (names.empty())
+    return bpftrace.print_maps();
+  for (auto& name : names)
+  {
+    auto map = bpftrace.maps.Lookup(name);
+    if (!map)
+    {
+      LOG(ERROR) << "--print: " << dir << " has no map " << name;
+      return 1;
+    }
+    if (bpftrace.print_map(**map, 0, 0))
+      return 1;
+  }
+  return 0;
 }
 
 int main(int argc, char* argv[])
@@ -416,6 +869,33 @@ int main(int argc, char* argv[])
   int helper_check_level = 0;
   TestMode test_mode = TestMode::UNSET;
   std::string script, search, file_name, output_file, output_format, output_elf;
+  std::string symbolize_file;
+  std::string cgroup_path;
+  std::string metrics_address;
+  std::vector<std::string> metrics_maps;
+  std::string pin_maps_name;
+  std::string attach_session;
+  std::vector<std::string> session_maps;
+  // --enable and --disable, with whether the probe is turned off
+  std::vector<std::pair<std::string, bool>> session_probes;
+  uint64_t child_runs = 1;
+  std::vector<pid_t> target_pids;
+  std::string target_comm;
+  std::string snapshot_file;
+  bool merge = false;
+  std::string compress;
+  std::string output_socket_address;
+  std::string printf_file, printf_compress;
+  bool raw_symbols = false;
+  bool redetect_features = false;
+  bool self_profile = false;
+  std::string self_profile_file;
+  bool off_cpu = false;
+  uint64_t off_cpu_min_us = 1;
+  uint64_t estimate_secs = 0;
+  uint64_t flight_recorder_secs = 0;
+  std::string daemon_socket;
+  bool reload = false;
   OutputBufferConfig obc = OutputBufferConfig::UNSET;
   int c;
 
@@ -431,10 +911,38 @@ int main(int argc, char* argv[])
     option{ "emit-elf", required_argument, nullptr, 2001 },
     option{ "no-warnings", no_argument, nullptr, 2002 },
     option{ "test", required_argument, nullptr, 2003 },
+    option{ "raw-symbols", no_argument, nullptr, 2004 },
+    option{ "symbolize", required_argument, nullptr, 2005 },
+    option{ "redetect-features", no_argument, nullptr, 2006 },
+    option{ "cgroup", required_argument, nullptr, 2007 },
+    option{ "metrics", required_argument, nullptr, 2008 },
+    option{ "metrics-maps", required_argument, nullptr, 2009 },
+    option{ "compress", required_argument, nullptr, 2010 },
+    option{ "timings", optional_argument, nullptr, 2011 },
+    option{ "self-profile", optional_argument, nullptr, 2012 },
+    option{ "daemon", required_argument, nullptr, 2013 },
+    option{ "reload", no_argument, nullptr, 2014 },
+    option{ "pin-maps", required_argument, nullptr, 2015 },
+    option{ "snapshot", required_argument, nullptr, 2016 },
+    option{ "merge", no_argument, nullptr, 2017 },
+    option{ "attach-session", required_argument, nullptr, 2018 },
+    option{ "print", required_argument, nullptr, 2019 },
+    option{ "repeat", required_argument, nullptr, 2020 },
+    option{ "pids", required_argument, nullptr, 2021 },
+    option{ "comm", required_argument, nullptr, 2022 },
+    option{ "off-cpu", optional_argument, nullptr, 2023 },
+    option{ "estimate", optional_argument, nullptr, 2024 },
+    option{ "flight-recorder", optional_argument, nullptr, 2025 },
+    option{ "output-socket", required_argument, nullptr, 2026 },
+    option{ "enable", required_argument, nullptr, 2027 },
+    option{ "disable", required_argument, nullptr, 2028 },
+    option{ "printf-output", required_argument, nullptr, 2029 },
+    option{ "printf-compress", required_argument, nullptr, 2030 },
     option{ nullptr, 0, nullptr, 0 }, // Must be last
   };
   std::vector<std::string> include_dirs;
   std::vector<std::string> include_files;
+  TimingsReport timings_report;
   while ((c = getopt_long(
               argc, argv, short_options, long_options, nullptr)) != -1)
   {
@@ -462,27 +970,179 @@ int main(int argc, char* argv[])
           return 1;
         }
         break;
-      case 'o':
-        output_file = optarg;
+      case 2004: // --raw-symbols
+        raw_symbols = true;
         break;
-      case 'd':
-        bt_debug++;
-        if (bt_debug == DebugLevel::kNone) {
-          usage();
+      case 2005: // --symbolize
+        symbolize_file = optarg;
+        break;
+      case 2006: // --redetect-features
+        redetect_features = true;
+        break;
+      case 2007: // --cgroup
+        cgroup_path = optarg;
+        break;
+      case 2008: // --metrics
+        metrics_address = optarg;
+        break;
+      case 2009: // --metrics-maps
+        for (auto &name : split_string(optarg, ',', true))
+          metrics_maps.push_back(name[0] == '@' ? name : "@" + name);
+        break;
+      case 2010: // --compress
+        compress = optarg;
+        break;
+      case 2011: // --timings
+        if (optarg && std::strcmp(optarg, "json") == 0)
+          timings_report.json = true;
+        else if (optarg && std::strcmp(optarg, "text") != 0)
+        {
+          LOG(ERROR) << "USAGE: --timings must be either 'text' or 'json'.";
           return 1;
         }
+        Timings::get().enable();
         break;
-      case 'q':
-        bt_quiet = true;
+      case 2012: // --self-profile
+        self_profile = true;
+        if (optarg)
+          self_profile_file = optarg;
         break;
-      case 'v':
-        bt_verbose = true;
+      case 2013: // --daemon
+        daemon_socket = optarg;
         break;
-      case 'B':
-        if (std::strcmp(optarg, "line") == 0) {
-          obc = OutputBufferConfig::LINE;
-        } else if (std::strcmp(optarg, "full") == 0) {
-          obc = OutputBufferConfig::FULL;
+      case 2014: // --reload
+        reload = true;
+        break;
+      case 2015: // --pin-maps
+        pin_maps_name = optarg;
+        if (!is_pin_name(pin_maps_name))
+        {
+          LOG(ERROR) << "USAGE: --pin-maps takes a name, the maps are pinned "
+                        "under /sys/fs/bpf/NAME";
+          return 1;
+        }
+        break;
+      case 2016: // --snapshot
+        snapshot_file = optarg;
+        break;
+      case 2017: // --merge
+        merge = true;
+        break;
+      case 2018: // --attach-session
+        attach_session = optarg;
+        if (!is_pin_name(attach_session))
+        {
+          LOG(ERROR) << "USAGE: --attach-session takes the NAME of the "
+                        "session run with --pin-maps NAME";
+          return 1;
+        }
+        break;
+      case 2019: // --print
+        if (optarg[0] != '@')
+        {
+          LOG(ERROR) << "USAGE: --print takes the name of a map, e.g. @x";
+          return 1;
+        }
+        session_maps.emplace_back(optarg);
+        break;
+      case 2027: // --enable
+      case 2028: // --disable
+        session_probes.emplace_back(optarg, c == 2028);
+        break;
+      case 2021: // --pids
+        try
+        {
+          for (auto &pid : split_string(optarg, ',', true))
+            target_pids.push_back(parse_pid(pid));
+        }
+        catch (const InvalidPIDException& e)
+        {
+          LOG(ERROR) << "USAGE: --pids: " << e.what();
+          return 1;
+        }
+        break;
+      case 2022: // --comm
+        target_comm = optarg;
+        // Compared with the comm builtin, which the kernel truncates
+        if (target_comm.empty() || target_comm.size() > 15 ||
+            target_comm.find_first_of("\"\\") != std::string::npos)
+        {
+          LOG(ERROR) << "USAGE: --comm takes a process name of up to 15 "
+                        "characters, without quotes or backslashes";
+          return 1;
+        }
+        break;
+      case 2023: // --off-cpu
+        off_cpu = true;
+        if (optarg)
+        {
+          if (!is_numeric(optarg))
+          {
+            LOG(ERROR) << "USAGE: --off-cpu takes the shortest time off-CPU "
+                          "to count, in microseconds";
+            return 1;
+          }
+          off_cpu_min_us = std::stoull(optarg);
+        }
+        break;
+      case 2024: // --estimate
+        estimate_secs = 5;
+        if (optarg &&
+            (!is_numeric(optarg) || (estimate_secs = std::stoull(optarg)) == 0))
+        {
+          LOG(ERROR) << "USAGE: --estimate takes the number of seconds to "
+                        "count the runs of the probes for";
+          return 1;
+        }
+        break;
+      case 2025: // --flight-recorder
+        flight_recorder_secs = 10;
+        if (optarg && (!is_numeric(optarg) ||
+                       (flight_recorder_secs = std::stoull(optarg)) == 0))
+        {
+          LOG(ERROR) << "USAGE: --flight-recorder takes the number of seconds "
+                        "of events to print";
+          return 1;
+        }
+        break;
+      case 2026: // --output-socket
+        output_socket_address = optarg;
+        break;
+      case 2029: // --printf-output
+        printf_file = optarg;
+        break;
+      case 2030: // --printf-compress
+        printf_compress = optarg;
+        break;
+      case 2020: // --repeat
+        if (!is_numeric(optarg) || (child_runs = std::stoull(optarg)) == 0)
+        {
+          LOG(ERROR) << "USAGE: --repeat takes the number of runs of the "
+                        "command";
+          return 1;
+        }
+        break;
+      case 'o':
+        output_file = optarg;
+        break;
+      case 'd':
+        bt_debug++;
+        if (bt_debug == DebugLevel::kNone) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'q':
+        bt_quiet = true;
+        break;
+      case 'v':
+        bt_verbose = true;
+        break;
+      case 'B':
+        if (std::strcmp(optarg, "line") == 0) {
+          obc = OutputBufferConfig::LINE;
+        } else if (std::strcmp(optarg, "full") == 0) {
+          obc = OutputBufferConfig::FULL;
         } else if (std::strcmp(optarg, "none") == 0) {
           obc = OutputBufferConfig::NONE;
         } else {
@@ -558,16 +1218,171 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  if ((!target_pids.empty() || !target_comm.empty()) &&
+      (!cmd_str.empty() || !pid_str.empty()))
+  {
+    LOG(ERROR) << "USAGE: --pids and --comm can't be used with -c or -p.";
+    return 1;
+  }
+
+  if (child_runs > 1 && cmd_str.empty())
+  {
+    LOG(ERROR) << "USAGE: --repeat can only be used with -c.";
+    return 1;
+  }
+
+  // Read ahead of parse_env(), the output is set up before BPFtrace
+  uint64_t output_buffer = 0;
+  bool output_drop = false;
+  if (!get_uint64_env_var("BPFTRACE_OUTPUT_BUFFER", output_buffer))
+    return 1;
+  if (const char *env_p = std::getenv("BPFTRACE_OUTPUT_FULL"))
+  {
+    if (std::string(env_p) == "drop")
+      output_drop = true;
+    else if (std::string(env_p) != "block")
+    {
+      LOG(ERROR) << "Env var 'BPFTRACE_OUTPUT_FULL' did not contain a valid "
+                    "value (block or drop).";
+      return 1;
+    }
+  }
+
+  // The output is compressed by the writer thread, which it then always goes
+  // through
+  Compression compression;
+  if (!parse_compression(compress, "--compress", compression))
+    return 1;
+  if (compression != Compression::none && !output_buffer)
+    output_buffer = OUTPUT_BUFFER_IMPLIED;
+
+  // So is the -o file rotated, by size, time or SIGHUP
+  OutputRotation rotation;
+  if (!get_uint64_env_var("BPFTRACE_OUTPUT_ROTATE_SIZE", rotation.size) ||
+      !get_uint64_env_var("BPFTRACE_OUTPUT_ROTATE_INTERVAL",
+                          rotation.interval))
+    return 1;
+  if (rotation.size || rotation.interval)
+  {
+    if (output_file.empty())
+    {
+      LOG(ERROR) << "BPFTRACE_OUTPUT_ROTATE_SIZE and "
+                    "BPFTRACE_OUTPUT_ROTATE_INTERVAL require -o";
+      return 1;
+    }
+    if (!output_buffer)
+      output_buffer = OUTPUT_BUFFER_IMPLIED;
+  }
+
+  // And is the output sent to a socket, dropped unless
+  // BPFTRACE_OUTPUT_FULL=block when the connection is too slow or lost
+  OutputSocket output_socket;
+  if (!output_socket_address.empty())
+  {
+    if (!output_socket.parse(output_socket_address))
+    {
+      LOG(ERROR) << "USAGE: --output-socket takes unix:PATH or HOST:PORT";
+      return 1;
+    }
+    if (!output_file.empty() || compression != Compression::none)
+    {
+      LOG(ERROR) << "--output-socket can't be used with -o or --compress";
+      return 1;
+    }
+    if (!output_buffer)
+      output_buffer = OUTPUT_BUFFER_IMPLIED;
+    if (!std::getenv("BPFTRACE_OUTPUT_FULL"))
+      output_drop = true;
+  }
+
   std::ostream * os = &std::cout;
   std::ofstream outputstream;
+  std::unique_ptr<OutputWriter> writer;
+  std::ostream writerstream(nullptr);
   if (!output_file.empty()) {
-    outputstream.open(output_file);
-    if (outputstream.fail()) {
+    if (output_buffer) {
+      int fd = open(output_file.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0666);
+      rotation.path = output_file;
+      if (fd >= 0)
+        writer = std::make_unique<OutputWriter>(
+            fd, output_buffer, output_drop, compression, rotation);
+    }
+    else {
+      outputstream.open(output_file);
+      os = &outputstream;
+    }
+    if (output_buffer ? !writer : outputstream.fail()) {
       LOG(ERROR) << "Failed to open output file: \"" << output_file
                  << "\": " << strerror(errno);
       return 1;
     }
-    os = &outputstream;
+  }
+  else if (!output_socket.empty()) {
+    writer = std::make_unique<OutputWriter>(-1,
+                                            output_buffer,
+                                            output_drop,
+                                            Compression::none,
+                                            OutputRotation(),
+                                            output_socket);
+  }
+  else if (output_buffer) {
+    writer = std::make_unique<OutputWriter>(STDOUT_FILENO,
+                                            output_buffer,
+                                            output_drop,
+                                            compression);
+  }
+  if (writer) {
+    writerstream.rdbuf(writer.get());
+    os = &writerstream;
+  }
+  // The self stats count the bytes of output
+  uint64_t self_stats_interval = 0;
+  if (!get_uint64_env_var("BPFTRACE_SELF_STATS", self_stats_interval))
+    return 1;
+  std::unique_ptr<CountingBuf> counter;
+  std::ostream counterstream(nullptr);
+  if (self_stats_interval) {
+    counter = std::make_unique<CountingBuf>(os->rdbuf());
+    counterstream.rdbuf(counter.get());
+    os = &counterstream;
+  }
+
+  // The printf() messages of --printf-output always go through a writer of
+  // their own, with its own buffer and compression, so that a large stream
+  // of them is written apart from the rest of the output
+  Compression printf_compression;
+  if (!parse_compression(printf_compress, "--printf-compress", printf_compression))
+    return 1;
+  if (printf_compression != Compression::none && printf_file.empty())
+  {
+    LOG(ERROR) << "--printf-compress requires --printf-output";
+    return 1;
+  }
+  std::unique_ptr<OutputWriter> printf_writer;
+  std::ostream printfstream(nullptr);
+  if (!printf_file.empty()) {
+    int fd = open(printf_file.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    if (fd < 0) {
+      LOG(ERROR) << "Failed to open printf output file: \"" << printf_file
+                 << "\": " << strerror(errno);
+      return 1;
+    }
+    printf_writer = std::make_unique<OutputWriter>(
+        fd,
+        output_buffer ? output_buffer : OUTPUT_BUFFER_IMPLIED,
+        output_drop,
+        printf_compression);
+    printfstream.rdbuf(printf_writer.get());
+  }
+  if (writer && !output_file.empty()) {
+    struct sigaction act = {};
+    act.sa_handler = [](int) { OutputWriter::request_rotation(); };
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &act, NULL);
   }
 
   std::unique_ptr<Output> output;
@@ -577,14 +1392,29 @@ int main(int argc, char* argv[])
   else if (output_format == "json") {
     output = std::make_unique<JsonOutput>(*os);
   }
+  else if (output_format == "folded") {
+    output = std::make_unique<FoldedOutput>(*os);
+  }
+  else if (output_format == "binary") {
+    output = std::make_unique<BinaryOutput>(*os);
+  }
   else {
     LOG(ERROR) << "Invalid output format \"" << output_format << "\"\n"
-               << "Valid formats: 'text', 'json'";
+               << "Valid formats: 'text', 'json', 'folded', 'binary'";
     return 1;
   }
 
+  // Without -B, each line is flushed when printing to a terminal, otherwise
+  // the output is flushed once per batch of events
+  bool line_buffered = obc == OutputBufferConfig::LINE ||
+                       obc == OutputBufferConfig::NONE ||
+                       (obc == OutputBufferConfig::UNSET && !writer &&
+                        output_file.empty() && isatty(STDOUT_FILENO));
+  output->set_line_buffered(line_buffered);
   switch (obc) {
     case OutputBufferConfig::UNSET:
+      std::setvbuf(stdout, NULL, line_buffered ? _IOLBF : _IOFBF, BUFSIZ);
+      break;
     case OutputBufferConfig::LINE:
       std::setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
       break;
@@ -597,18 +1427,188 @@ int main(int argc, char* argv[])
   }
 
   BPFtrace bpftrace(std::move(output));
+  if (printf_writer) {
+    if (output_format == "json")
+      bpftrace.printf_out_ = std::make_unique<JsonOutput>(printfstream);
+    else if (output_format == "binary")
+      bpftrace.printf_out_ = std::make_unique<BinaryOutput>(printfstream);
+    else
+      bpftrace.printf_out_ = std::make_unique<TextOutput>(printfstream);
+  }
+  bpftrace.self_stats_interval_ = self_stats_interval;
+  bpftrace.output_counter_ = counter.get();
+  if (os == &std::cout)
+    bpftrace.output_fd_ = STDOUT_FILENO;
 
   if (!cmd_str.empty())
     bpftrace.cmd_ = cmd_str;
+  bpftrace.child_runs_ = child_runs;
 
+  bpftrace.flight_recorder_secs_ = flight_recorder_secs;
   if (!parse_env(bpftrace))
     return 1;
 
+  // Detecting the features takes a few dozen programs through the verifier,
+  // the results are kept with the compiled programs
+  if (!bpftrace.program_cache_dir_.empty())
+  {
+    std::string features_path = bpftrace.program_cache_dir_ + "/features";
+    if (redetect_features || !bpftrace.feature_->load(features_path))
+      bpftrace.feature_->store(features_path);
+  }
+
   bpftrace.usdt_file_activation_ = usdt_file_activation;
   bpftrace.safe_mode_ = safe_mode;
   bpftrace.helper_check_level_ = helper_check_level;
   bpftrace.boottime_ = get_boottime();
 
+  if (!cgroup_path.empty())
+  {
+    if (!bpftrace.feature_->has_helper_get_current_cgroup_id())
+    {
+      LOG(ERROR) << "--cgroup: the kernel doesn't support "
+                    "bpf_get_current_cgroup_id()";
+      return 1;
+    }
+    try
+    {
+      bpftrace.cgroup_filter_ = bpftrace.resolve_cgroupid(cgroup_path);
+    }
+    catch (const std::runtime_error &e)
+    {
+      LOG(ERROR) << "--cgroup: " << e.what();
+      return 1;
+    }
+  }
+
+  if (!metrics_maps.empty() && metrics_address.empty())
+  {
+    LOG(ERROR) << "USAGE: --metrics-maps can only be used with --metrics.";
+    return 1;
+  }
+  if (!metrics_address.empty())
+  {
+    bpftrace.metrics_server_ = std::make_unique<MetricsServer>();
+    if (bpftrace.metrics_server_->listen(metrics_address) < 0)
+      return 1;
+    bpftrace.metrics_maps_ = std::move(metrics_maps);
+  }
+  if (!pin_maps_name.empty())
+    bpftrace.pin_maps_dir_ = "/sys/fs/bpf/" + pin_maps_name;
+
+  // The maps are read from the running session, no program is run
+  if (!attach_session.empty())
+  {
+    if (listing || !script.empty() || optind < argc || !pid_str.empty() ||
+        !cmd_str.empty() || merge || !snapshot_file.empty() ||
+        !pin_maps_name.empty() || !daemon_socket.empty())
+    {
+      LOG(ERROR) << "USAGE: --attach-session can't be used with a program, "
+                    "-l, -p, -c, --merge, --snapshot, --pin-maps or "
+                    "--daemon.";
+      return 1;
+    }
+    // The probes are turned on and off rather than the maps printed
+    if (!session_probes.empty())
+    {
+      if (!session_maps.empty())
+      {
+        LOG(ERROR) << "USAGE: --print can't be used with --enable or "
+                      "--disable.";
+        return 1;
+      }
+      for (auto &[probe, disabled] : session_probes)
+        if (set_pinned_probes(
+                "/sys/fs/bpf/" + attach_session, probe, disabled) < 0)
+          return 1;
+      return 0;
+    }
+    return print_session_maps(
+        bpftrace, "/sys/fs/bpf/" + attach_session, session_maps);
+  }
+  if (!session_probes.empty())
+  {
+    LOG(ERROR) << "USAGE: --enable and --disable can only be used with "
+                  "--attach-session.";
+    return 1;
+  }
+  // Otherwise they're the maps printed on SIGUSR1
+  bpftrace.signal_maps_ = std::move(session_maps);
+
+  // The snapshots are files, no program is run
+  if (merge)
+  {
+    if (listing || !script.empty() || !pid_str.empty() || !cmd_str.empty() ||
+        !snapshot_file.empty() || !daemon_socket.empty())
+    {
+      LOG(ERROR) << "USAGE: --merge takes the snapshot files to print and "
+                    "can't be used with -l, -e, -p, -c, --snapshot or "
+                    "--daemon.";
+      return 1;
+    }
+    if (optind >= argc)
+    {
+      LOG(ERROR) << "USAGE: --merge requires the snapshot files";
+      return 1;
+    }
+    return merge_snapshots(
+        bpftrace, std::vector<std::string>(argv + optind, argv + argc));
+  }
+
+  // Each program sent is run by a fork of this process from here on, as if
+  // it had been given with -e
+  std::unique_ptr<Daemon> daemon;
+  if (!daemon_socket.empty())
+  {
+    if (listing || !script.empty() || optind < argc || !pid_str.empty() ||
+        !cmd_str.empty() || !symbolize_file.empty() || !output_elf.empty())
+    {
+      LOG(ERROR) << "USAGE: --daemon takes the programs from its socket and "
+                    "can't be used with -l, -e, -p, -c, --symbolize, "
+                    "--emit-elf or a program file.";
+      return 1;
+    }
+    // The forks get their output through the connection, and no threads
+    if (!output_file.empty() || writer || printf_writer ||
+        bpftrace.metrics_server_)
+    {
+      LOG(ERROR) << "--daemon can't be used with -o, --metrics, --compress, "
+                    "--output-socket, --printf-output or "
+                    "BPFTRACE_OUTPUT_BUFFER";
+      return 1;
+    }
+    if (!is_root())
+      return 1;
+
+    bpftrace.warm_up();
+    daemon = std::make_unique<Daemon>();
+    if (daemon->listen(daemon_socket) < 0)
+      return 1;
+    if (!daemon->serve(script))
+      return 0;
+  }
+
+  if (!symbolize_file.empty())
+  {
+    std::ifstream file;
+    std::istream *in = &std::cin;
+    if (symbolize_file != "-")
+    {
+      file.open(symbolize_file);
+      if (file.fail())
+      {
+        LOG(ERROR) << "Failed to open \"" << symbolize_file
+                   << "\": " << strerror(errno);
+        return 1;
+      }
+      in = &file;
+    }
+    Symbolizer(bpftrace).symbolize(*in, bpftrace.out_->outputstream());
+    return 0;
+  }
+  if (raw_symbols)
+    bpftrace.raw_symbols_ = std::make_unique<RawSymbols>();
+
   if (!pid_str.empty())
   {
     try
@@ -680,8 +1680,16 @@ int main(int argc, char* argv[])
 
   std::string filename;
   std::string program;
+  // Read again by --reload
+  std::string program_file;
 
-  if (script.empty())
+  if (script.empty() && argv[optind] == nullptr && off_cpu)
+  {
+    // The off-CPU probes make a program of their own, which runs until
+    // Ctrl-C or the end of -c
+    filename = "stdin";
+  }
+  else if (script.empty())
   {
     // Script file
     if (argv[optind] == nullptr)
@@ -719,6 +1727,7 @@ int main(int argc, char* argv[])
       program = buf.str();
       buf << file.rdbuf();
       program = buf.str();
+      program_file = filename;
     }
 
     optind++;
@@ -748,80 +1757,270 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  // Use a single ring buffer shared by all CPUs instead of per-CPU perf
+  // buffers when both the kernel and libbpf support it.
+  bpftrace.use_ringbuf_ = bpftrace.ringbuf_pages_ > 0 &&
+                          bpftrace.feature_->has_ringbuf();
+  // The async actions get a small ring buffer of their own, so that they
+  // don't wait behind (or get dropped with) a flood of printf() events
+  bpftrace.use_control_ringbuf_ = bpftrace.control_ringbuf_pages_ > 0 &&
+                                  bpftrace.feature_->has_ringbuf();
+
+  if (bpftrace.map_alloc_ == MapAlloc::lru &&
+      !bpftrace.feature_->has_map_lru_hash())
+  {
+    LOG(ERROR) << "BPFTRACE_MAP_ALLOC=lru: the kernel doesn't support LRU hash "
+                  "maps";
+    return 1;
+  }
+
   // FIXME (mmarchini): maybe we don't want to always enforce an infinite
   // rlimit?
   enforce_infinite_rlimit();
 
-  auto ast_root = parse(
-      bpftrace, filename, program, include_dirs, include_files);
-  if (!ast_root)
+  // A program compiled with --emit-elf
+  bool precompiled = ProgramImage::is_elf(program);
+  if (precompiled && !bpftrace.cmd_.empty())
+  {
+    LOG(ERROR) << "-c can't be used with a program compiled with --emit-elf";
     return 1;
+  }
 
-  ast::PassContext ctx(bpftrace);
-  auto pm = CreatePM();
-  ast_root = pm.Run(std::move(ast_root), ctx);
-  if (!ast_root)
-    return 1;
+  // Filtered by -p, --cgroup, --pids and --comm like the probes of the
+  // program are
+  if (off_cpu)
+  {
+    if (precompiled)
+    {
+      LOG(ERROR) << "--off-cpu can't be used with a program compiled with "
+                    "--emit-elf";
+      return 1;
+    }
+    if (output_format == "json" || output_format == "binary")
+    {
+      LOG(ERROR) << "--off-cpu prints the stacks folded, it can't be used with "
+                    "-f "
+                 << output_format;
+      return 1;
+    }
+    program += "\n" + BPFtrace::off_cpu_probes(off_cpu_min_us);
+  }
 
-  if (!bpftrace.cmd_.empty())
+  // The probes get different programs, which aren't worth compiling into an
+  // ELF or caching
+  if (estimate_secs)
   {
-    try
+    if (precompiled || !output_elf.empty())
     {
-      bpftrace.child_ = std::make_unique<ChildProc>(cmd_str);
+      LOG(ERROR) << "--estimate can't be used with --emit-elf";
+      return 1;
     }
-    catch (const std::runtime_error& e)
+    bpftrace.estimate_secs_ = estimate_secs;
+    bpftrace.probe_counts_ = true;
+  }
+
+  // The set of processes is filled on start, the probes keeping it are added
+  // to the program here rather than compiled into an ELF or cached
+  bool target_set = !target_pids.empty() || !target_comm.empty();
+  if (target_set)
+  {
+    if (precompiled || !output_elf.empty())
     {
-      LOG(ERROR) << "Failed to fork child: " << e.what();
-      return -1;
+      LOG(ERROR) << "--pids and --comm can't be used with --emit-elf";
+      return 1;
+    }
+    program += "\n" + BPFtrace::target_tracking_probes(target_comm);
+    bpftrace.target_pids_ = std::move(target_pids);
+    bpftrace.target_comm_ = target_comm;
+  }
+
+  // The profile probe filters on the pid of this run, so it's added to the
+  // program here rather than compiled into an ELF or cached
+  if (self_profile)
+  {
+    if (precompiled || !output_elf.empty())
+    {
+      LOG(ERROR) << "--self-profile can't be used with --emit-elf";
+      return 1;
     }
+    program += "\n" + BPFtrace::self_profile_probe(SELF_PROFILE_HZ);
   }
+  if (bpftrace.flushes_events())
+    program += "\n" + BPFtrace::event_batch_probe();
+
+  if (reload)
+  {
+    if (program_file.empty())
+    {
+      LOG(ERROR) << "USAGE: --reload requires a program file";
+      return 1;
+    }
+    if (precompiled || self_profile || !output_elf.empty())
+    {
+      LOG(ERROR) << "--reload can't be used with --emit-elf or --self-profile";
+      return 1;
+    }
+    if (writer && !output_file.empty())
+    {
+      LOG(ERROR) << "--reload can't be used with a buffered -o file, which is "
+                    "rotated on SIGHUP";
+      return 1;
+    }
+  }
+
+  // Programs that start a child, or are only being compiled, aren't cached
+  std::unique_ptr<ProgramCache> program_cache;
+  if (!bpftrace.program_cache_dir_.empty() && bpftrace.cmd_.empty() &&
+      !self_profile && !target_set && !estimate_secs &&
+      test_mode == TestMode::UNSET && bt_debug == DebugLevel::kNone &&
+      output_elf.empty() && !precompiled)
+    program_cache = std::make_unique<ProgramCache>(
+        bpftrace.program_cache_dir_,
+        ProgramCache::key(bpftrace, program, include_dirs, include_files));
+
+  // An ELF is loaded on other kernels, where the structs may be laid out
+  // differently
+  bpftrace.relocate_fields_ = !output_elf.empty() && bpftrace.btf_.has_data();
 
-  ast::CodegenLLVM llvm(&*ast_root, bpftrace);
   std::unique_ptr<BpfOrc> bpforc;
-  try
+  if (precompiled)
+  {
+    try
+    {
+      bpforc = ProgramImage::load_elf(bpftrace, program);
+    }
+    catch (const std::runtime_error& ex)
+    {
+      LOG(ERROR) << "Failed to load " << filename << ": " << ex.what();
+      return 1;
+    }
+    if (!bpforc)
+      return 1;
+  }
+  else if (program_cache && program_cache->load(bpftrace, bpforc))
   {
-    llvm.generate_ir();
-    if (bt_debug == DebugLevel::kFullDebug)
+    if (!bpforc)
+      return 1;
+    Log::get().set_source(filename, program);
+  }
+  else
+  {
+    auto ast_root = parse_program(
+        bpftrace, filename, program, include_dirs, include_files);
+    if (!ast_root)
+      return 1;
+    auto probes = static_cast<ast::Program *>(ast_root.get())->probes;
+    auto last = probes->end();
+    if (bpftrace.flushes_events())
+      (*--last)->flush_events = true;
+    if (self_profile)
+      (*--last)->self_profile = true;
+    if (target_set)
     {
-      std::cout << "Before optimization\n";
-      std::cout << "-------------------\n\n";
-      llvm.DumpIR();
+      auto count = BPFtrace::target_tracking_probe_count(target_comm);
+      for (auto it = last - count; it != last; ++it)
+        (*it)->target_tracking = true;
     }
 
-    llvm.optimize();
-    if (bt_debug != DebugLevel::kNone)
+    ast::PassContext ctx(bpftrace);
+    auto pm = CreatePM();
+    ast_root = pm.Run(std::move(ast_root), ctx);
+    if (!ast_root)
+      return 1;
+    // Read while the program is compiled and attached, rather than when the
+    // first kernel symbol is printed
+    if (bpftrace.needs_ksyms_ && output_elf.empty())
+      bpftrace.prefetch_ksyms();
+
+    if (!bpftrace.cmd_.empty())
     {
+      try
+      {
+        bpftrace.child_ = std::make_unique<ChildProc>(cmd_str);
+      }
+      catch (const std::runtime_error& e)
+      {
+        LOG(ERROR) << "Failed to fork child: " << e.what();
+        return -1;
+      }
+    }
+
+    ast::CodegenLLVM llvm(&*ast_root, bpftrace);
+    try
+    {
+      auto phase_start = std::chrono::steady_clock::now();
+      // Time since phase_start, which it resets
+      auto phase_ms = [&phase_start]() {
+        auto now = std::chrono::steady_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      now - phase_start)
+                      .count();
+        phase_start = now;
+        return ms;
+      };
+
+      {
+        Timings::Scope timing("generate_ir");
+        llvm.generate_ir();
+      }
+      auto generate_ms = phase_ms();
+      if (bt_debug == DebugLevel::kFullDebug)
+      {
+        std::cout << "Before optimization\n";
+        std::cout << "-------------------\n\n";
+        llvm.DumpIR();
+      }
+
+      phase_ms();
+      {
+        Timings::Scope timing("optimize");
+        llvm.optimize();
+      }
+      auto optimize_ms = phase_ms();
+      if (bt_debug != DebugLevel::kNone)
+      {
+        if (bt_debug == DebugLevel::kFullDebug)
+        {
+          std::cout << "\nAfter optimization\n";
+          std::cout << "------------------\n\n";
+        }
+        llvm.DumpIR();
+      }
+      if (!output_elf.empty())
+      {
+        llvm.emit_elf(output_elf, ProgramImage::save(bpftrace, {}));
+        return 0;
+      }
+      phase_ms();
+      {
+        Timings::Scope timing("emit");
+        bpforc = llvm.emit();
+      }
+      if (bt_verbose)
+        std::cerr << "Codegen: generate_ir " << generate_ms << " ms, optimize "
+                  << optimize_ms << " ms, emit " << phase_ms() << " ms"
+                  << std::endl;
+      if (program_cache)
+        program_cache->store(bpftrace, *bpforc);
       if (bt_debug == DebugLevel::kFullDebug)
       {
-        std::cout << "\nAfter optimization\n";
+        std::cout << "\nLLVM JITDLib state\n";
         std::cout << "------------------\n\n";
+        raw_os_ostream os(std::cout);
+        bpforc->dump(os);
       }
-      llvm.DumpIR();
     }
-    if (!output_elf.empty())
+    catch (const std::system_error& ex)
     {
-      llvm.emit_elf(output_elf);
-      return 0;
+      LOG(ERROR) << "failed to write elf: " << ex.what();
+      return 1;
     }
-    bpforc = llvm.emit();
-    if (bt_debug == DebugLevel::kFullDebug)
+    catch (const std::exception& ex)
     {
-      std::cout << "\nLLVM JITDLib state\n";
-      std::cout << "------------------\n\n";
-      raw_os_ostream os(std::cout);
-      bpforc->dump(os);
+      LOG(ERROR) << "Failed to compile: " << ex.what();
+      return 1;
     }
   }
-  catch (const std::system_error& ex)
-  {
-    LOG(ERROR) << "failed to write elf: " << ex.what();
-    return 1;
-  }
-  catch (const std::exception& ex)
-  {
-    LOG(ERROR) << "Failed to compile: " << ex.what();
-    return 1;
-  }
 
   if (bt_debug != DebugLevel::kNone)
     return 0;
@@ -834,6 +2033,96 @@ int main(int argc, char* argv[])
   act.sa_handler = [](int) { BPFtrace::exitsig_recv = true; };
   sigaction(SIGINT, &act, NULL);
   sigaction(SIGTERM, &act, NULL);
+  // Without SA_RESTART, so that the poll loop gets to print
+  struct sigaction usr1 = {};
+  if (bpftrace.self_stats_interval_)
+    usr1.sa_handler = [](int) {
+      BPFtrace::print_maps_recv = true;
+      BPFtrace::self_stats_recv = true;
+    };
+  else
+    usr1.sa_handler = [](int) { BPFtrace::print_maps_recv = true; };
+  sigaction(SIGUSR1, &usr1, NULL);
+  if (bpftrace.flight_recorder_secs_)
+  {
+    struct sigaction usr2 = {};
+    usr2.sa_handler = [](int) { BPFtrace::flight_dump_recv = true; };
+    sigaction(SIGUSR2, &usr2, NULL);
+  }
+  if (reload)
+  {
+    // Compiled the way the program was on start, the cache and the other
+    // ways of getting a program don't apply
+    bpftrace.reload_ = [&bpftrace,
+                        program_file,
+                        include_dirs,
+                        include_files,
+                        target_set]() -> std::unique_ptr<BpfOrc> {
+      std::ifstream file(program_file);
+      if (file.fail())
+      {
+        LOG(ERROR) << "failed to open file '" << program_file
+                   << "': " << std::strerror(errno);
+        return nullptr;
+      }
+      std::stringstream buf;
+      buf << file.rdbuf();
+      // The set of processes is kept, its map being the same
+      if (target_set)
+        buf << "\n" << BPFtrace::target_tracking_probes(bpftrace.target_comm_);
+      if (bpftrace.flushes_events())
+        buf << "\n" << BPFtrace::event_batch_probe();
+
+      // The structs of the tracepoints are generated again
+      TracepointFormatParser::clear_struct_list();
+      auto ast_root = parse_program(
+          bpftrace, program_file, buf.str(), include_dirs, include_files);
+      if (!ast_root)
+        return nullptr;
+      auto probes = static_cast<ast::Program *>(ast_root.get())->probes;
+      auto last = probes->end();
+      if (bpftrace.flushes_events())
+        (*--last)->flush_events = true;
+      if (target_set)
+      {
+        auto count = BPFtrace::target_tracking_probe_count(
+            bpftrace.target_comm_);
+        for (auto it = last - count; it != last; ++it)
+          (*it)->target_tracking = true;
+      }
+      ast::PassContext ctx(bpftrace);
+      auto pm = CreatePM();
+      ast_root = pm.Run(std::move(ast_root), ctx);
+      if (!ast_root)
+        return nullptr;
+
+      try
+      {
+        ast::CodegenLLVM llvm(&*ast_root, bpftrace);
+        llvm.generate_ir();
+        llvm.optimize();
+        return llvm.emit();
+      }
+      catch (const std::exception& ex)
+      {
+        LOG(ERROR) << "Failed to compile: " << ex.what();
+        return nullptr;
+      }
+    };
+    // Without SA_RESTART, so that the poll loop gets to reload
+    struct sigaction hup = {};
+    hup.sa_handler = [](int) { BPFtrace::reload_recv = true; };
+    sigaction(SIGHUP, &hup, NULL);
+  }
+
+  for (auto &name : bpftrace.signal_maps_)
+  {
+    if (!bpftrace.maps.Has(name))
+    {
+      LOG(ERROR) << "--print: the program has no map " << name;
+      return 1;
+    }
+  }
 
   uint64_t num_probes = bpftrace.num_probes();
   if (num_probes == 0)
@@ -854,7 +2143,11 @@ int main(int argc, char* argv[])
     return 1;
   }
   else if (!bt_quiet)
+  {
+    // Seen before the probes are attached, which can take a while
     bpftrace.out_->attached_probes(num_probes);
+    bpftrace.out_->outputstream().flush();
+  }
 
   err = bpftrace.run(move(bpforc));
   if (err)
@@ -867,7 +2160,32 @@ int main(int argc, char* argv[])
 
   std::cout << "\n\n";
 
-  err = bpftrace.print_maps();
+  {
+    Timings::Scope timing("print_maps");
+    if (!snapshot_file.empty())
+      err = write_snapshot(bpftrace, snapshot_file);
+    if (!err)
+      err = bpftrace.print_maps();
+  }
+  if (bpftrace.self_stats_interval_)
+    bpftrace.print_self_stats();
+  if (self_profile)
+  {
+    if (self_profile_file.empty())
+      bpftrace.print_self_profile(std::cerr);
+    else
+    {
+      std::ofstream out(self_profile_file);
+      if (out)
+        bpftrace.print_self_profile(out);
+      else
+        LOG(ERROR) << "Failed to open " << self_profile_file << ": "
+                   << strerror(errno);
+    }
+  }
+
+  if (bpftrace.raw_symbols_)
+    bpftrace.raw_symbols_->write_module_map(bpftrace.out_->outputstream());
 
   if (bt_verbose && bpftrace.child_)
   {
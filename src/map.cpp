@@ -1,12 +1,18 @@
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <linux/version.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "bpftrace.h"
 #include "log.h"
 #include "utils.h"
 #include <bcc/libbpf.h>
+#ifdef HAVE_LIBBPF_BPF_H
+#include <bpf/bpf.h>
+#endif
 
 #include "map.h"
 #include "mapmanager.h"
@@ -36,46 +42,191 @@ int Map::create_map(enum bpf_map_type map_type,
 #endif
 }
 
+int create_task_storage_map(const std::string &name, int value_size)
+{
+  // The kernel only creates local storage maps with the BTF of their key,
+  // an int, and value, described here as an array of value_size bytes
+  struct
+  {
+    uint16_t magic = 0xeb9f;
+    uint8_t version = 1;
+    uint8_t flags = 0;
+    uint32_t hdr_len = 24;
+    uint32_t type_off = 0;
+    uint32_t type_len = sizeof(types);
+    uint32_t str_off = sizeof(types);
+    uint32_t str_len = sizeof(strings);
+    uint32_t types[14] = {
+      // [1] int
+      1, 1 << 24, 4, (1 << 24) | 32,
+      // [2] unsigned char
+      5, 1 << 24, 1, 8,
+      // [3] unsigned char[value_size]
+      0, 3 << 24, 0, 2, 1, 0,
+    };
+    char strings[19] = "\0int\0unsigned char";
+  } __attribute__((packed)) btf;
+  btf.types[13] = value_size;
+
+  // BPF_BTF_LOAD and BPF_MAP_CREATE with the attributes up to the BTF type
+  // ids, from linux/bpf.h, which may be older than the running kernel
+  const int bpf_map_create_cmd = 0;
+  const int bpf_btf_load_cmd = 18;
+  union
+  {
+    struct
+    {
+      alignas(8) uint64_t btf;
+      alignas(8) uint64_t btf_log_buf;
+      uint32_t btf_size;
+      uint32_t btf_log_size;
+      uint32_t btf_log_level;
+    } btf_load;
+    struct
+    {
+      uint32_t map_type;
+      uint32_t key_size;
+      uint32_t value_size;
+      uint32_t max_entries;
+      uint32_t map_flags;
+      uint32_t inner_map_fd;
+      uint32_t numa_node;
+      char map_name[16];
+      uint32_t map_ifindex;
+      uint32_t btf_fd;
+      uint32_t btf_key_type_id;
+      uint32_t btf_value_type_id;
+    } map_create;
+    uint8_t pad[128];
+  } attr = {};
+  attr.btf_load.btf = reinterpret_cast<uint64_t>(&btf);
+  attr.btf_load.btf_size = sizeof(btf);
+  int btf_fd = syscall(__NR_bpf, bpf_btf_load_cmd, &attr, sizeof(attr));
+  if (btf_fd < 0)
+    return btf_fd;
+
+  std::string fixed_name = name;
+  if (!name.empty() && name[0] == '@')
+    fixed_name = "AT_" + name.substr(1);
+  attr = {};
+  attr.map_create.map_type = libbpf::BPF_MAP_TYPE_TASK_STORAGE;
+  attr.map_create.key_size = sizeof(int);
+  attr.map_create.value_size = value_size;
+  attr.map_create.map_flags = BPF_F_NO_PREALLOC;
+  strncpy(attr.map_create.map_name,
+          fixed_name.c_str(),
+          sizeof(attr.map_create.map_name) - 1);
+  attr.map_create.btf_fd = btf_fd;
+  attr.map_create.btf_key_type_id = 1;
+  attr.map_create.btf_value_type_id = 3;
+  int fd = syscall(__NR_bpf, bpf_map_create_cmd, &attr, sizeof(attr));
+  int saved_errno = errno;
+  close(btf_fd);
+  errno = saved_errno;
+  return fd;
+}
+
 Map::Map(const std::string &name,
          const SizedType &type,
          const MapKey &key,
          int min,
          int max,
          int step,
-         int max_entries)
+         int max_entries,
+         MapAlloc alloc,
+         bool mmapable,
+         bool dense,
+         bool task_storage,
+         bool hashed_key,
+         bool bucket_array)
 {
   name_ = name;
   type_ = type;
   key_ = key;
-  // for lhist maps:
+  // for lhist maps (llhist maps only use step, for the number of sub-buckets):
   lqmin = min;
   lqmax = max;
   lqstep = step;
 
-  int key_size = key.size();
-  if (type.IsHistTy() || type.IsLhistTy() || type.IsAvgTy() || type.IsStatsTy())
-    key_size += 8;
+  hashed_key_ = hashed_key;
+  if (bucket_array && !key.args_.empty() && !dense)
+    bucket_array_ = hist_buckets(type, min, max, step);
+  int key_size = bpf_key_size();
   if (key_size == 0)
     key_size = 8;
 
-  if (type.IsCountTy() && !key.args_.size())
+  int flags = 0;
+  if (mmapable && key.args_.empty() &&
+      (type.IsCountTy() || type.IsSumTy() || type.IsHistTy() ||
+       type.IsLhistTy() || type.IsIntTy()))
+  {
+    // One entry per bucket, see IMap::is_mmapped()
+    map_type_ = BPF_MAP_TYPE_ARRAY;
+    flags |= libbpf::BPF_F_MMAPABLE;
+    key_size = 4;
+    if (type.IsHistTy())
+      max_entries = 65;
+    else if (type.IsLhistTy())
+      max_entries = (max - min) / step + 2;
+    else
+      max_entries = 1;
+  }
+  else if (dense)
+  {
+    // Indexed by the key, see IMap::dense_
+    map_type_ = type.IsCountTy() || type.IsSumTy() ? BPF_MAP_TYPE_PERCPU_ARRAY
+                                                   : BPF_MAP_TYPE_ARRAY;
+    dense_ = true;
+    key_size = 4;
+  }
+  else if (type.IsCountTy() && !key.args_.size())
   {
     map_type_ = BPF_MAP_TYPE_PERCPU_ARRAY;
     max_entries = 1;
     key_size = 4;
   }
-  else if ((type.IsHistTy() || type.IsLhistTy() || type.IsCountTy() ||
-            type.IsSumTy() || type.IsMinTy() || type.IsMaxTy() ||
-            type.IsAvgTy() || type.IsStatsTy()) &&
+  else if (type.IsCmsTy())
+  {
+    // Tracked keys are never evicted, the first ones over the threshold stay
+    map_type_ = BPF_MAP_TYPE_HASH;
+    max_entries = CMS_TRACKED;
+  }
+  else if ((type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy() ||
+            type.IsCountTy() || type.IsSumTy() || type.IsMinTy() ||
+            type.IsMaxTy() || type.IsAvgTy() || type.IsStatsTy() ||
+            type.IsDistinctTy()) &&
            (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)))
   {
-    map_type_ = BPF_MAP_TYPE_PERCPU_HASH;
+    map_type_ = alloc == MapAlloc::lru ? BPF_MAP_TYPE_LRU_PERCPU_HASH
+                                       : BPF_MAP_TYPE_PERCPU_HASH;
   }
   else
-    map_type_ = BPF_MAP_TYPE_HASH;
+    map_type_ = alloc == MapAlloc::lru ? BPF_MAP_TYPE_LRU_HASH
+                                       : BPF_MAP_TYPE_HASH;
 
-  int value_size = type.GetSize();
-  int flags = 0;
+  if (task_storage)
+  {
+    // Keyed by the current task, see IMap::task_storage_
+    map_type_ = static_cast<enum bpf_map_type>(
+        libbpf::BPF_MAP_TYPE_TASK_STORAGE);
+    task_storage_ = true;
+    mapfd_ = create_task_storage_map(name, type.GetSize());
+    if (mapfd_ < 0)
+    {
+      LOG(ERROR) << "failed to create map: '" << name_
+                 << "': " << strerror(errno);
+    }
+    return;
+  }
+
+  max_entries_ = max_entries;
+  int value_size = (flags & libbpf::BPF_F_MMAPABLE) ? mmapped_value_size()
+                                                     : bpf_value_size();
+  // LRU maps are always preallocated
+  if (alloc == MapAlloc::no_prealloc &&
+      (map_type_ == BPF_MAP_TYPE_HASH ||
+       map_type_ == BPF_MAP_TYPE_PERCPU_HASH))
+    flags |= BPF_F_NO_PREALLOC;
   mapfd_ = create_map(
       map_type_, name, key_size, value_size, max_entries, flags);
   if (mapfd_ < 0)
@@ -83,6 +234,67 @@ Map::Map(const std::string &name,
     LOG(ERROR) << "failed to create map: '" << name_
                << "': " << strerror(errno);
   }
+
+  if ((flags & libbpf::BPF_F_MMAPABLE) && mapfd_ >= 0)
+  {
+    size_t page_size = getpagesize();
+    mmapped_size_ = (static_cast<size_t>(value_size) * max_entries +
+                     page_size - 1) /
+                    page_size * page_size;
+    void *addr = mmap(nullptr,
+                      mmapped_size_,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED,
+                      mapfd_,
+                      0);
+    if (addr == MAP_FAILED)
+    {
+      LOG(ERROR) << "failed to mmap map: '" << name_
+                 << "': " << strerror(errno);
+      close(mapfd_);
+      mapfd_ = -1;
+    }
+    else
+      mmapped_ = addr;
+  }
+
+  if (type.IsCmsTy() && mapfd_ >= 0)
+  {
+    // One row of counters per entry, counted per CPU so that the BPF
+    // programs can increment them in place without atomics
+    sketch_mapfd_ = create_map(BPF_MAP_TYPE_PERCPU_ARRAY,
+                               name,
+                               4,
+                               CMS_WIDTH * sizeof(uint64_t),
+                               CMS_DEPTH,
+                               0);
+    if (sketch_mapfd_ < 0)
+    {
+      LOG(ERROR) << "failed to create map: '" << name_
+                 << "': " << strerror(errno);
+      close(mapfd_);
+      mapfd_ = -1;
+    }
+  }
+
+  if (hashed_key && mapfd_ >= 0)
+  {
+    // Sized like the map, which holds only as many distinct strings
+    strings_mapfd_ = create_map(
+        alloc == MapAlloc::lru ? BPF_MAP_TYPE_LRU_HASH : BPF_MAP_TYPE_HASH,
+        name,
+        sizeof(uint64_t),
+        key.args_.at(0).GetSize(),
+        max_entries,
+        alloc == MapAlloc::no_prealloc ? BPF_F_NO_PREALLOC : 0);
+    if (strings_mapfd_ < 0)
+    {
+      LOG(ERROR) << "failed to create map: '" << name_
+                 << "': " << strerror(errno);
+      close(mapfd_);
+      mapfd_ = -1;
+    }
+  }
 }
 
 Map::Map(const std::string &name,
@@ -94,6 +306,7 @@ Map::Map(const std::string &name,
 {
   map_type_ = type;
   name_ = name;
+  max_entries_ = max_entries;
   mapfd_ = create_map(type, name, key_size, value_size, max_entries, flags);
   if (mapfd_ < 0)
   {
@@ -122,9 +335,10 @@ Map::Map(const std::string &name,
 // bpf_get_stack() to write into. Using the stack directly wouldn't work well
 // b/c it would take too much stack space.
 //
-// The temporary fix is to bump the map size to 128K. Any futher bumps should
-// warrant consideration of the previous paragraph.
-Map::Map(const SizedType &type)
+// The temporary fix is to bump the map size to 128K by default, see
+// BPFTRACE_STACK_MAP_ENTRIES. Any futher bumps should warrant consideration
+// of the previous paragraph.
+Map::Map(const SizedType &type, int max_entries)
 {
 #ifdef DEBUG
   // TODO (mmarchini): replace with DCHECK
@@ -138,9 +352,17 @@ Map::Map(const SizedType &type)
   int key_size = 4;
   int value_size = sizeof(uintptr_t) * type.stack_type.limit;
   std::string name = "stack";
-  int max_entries = 128 << 10;
   int flags = 0;
+  if (type.stack_type.mode == StackMode::build_id)
+  {
+    // The kernel writes the build ID of the file of each frame and the
+    // offset in it instead of the address
+    value_size = sizeof(struct bpf_stack_build_id) * type.stack_type.limit;
+    flags = BPF_F_STACK_BUILD_ID;
+  }
   enum bpf_map_type map_type = BPF_MAP_TYPE_STACK_TRACE;
+  map_type_ = map_type;
+  max_entries_ = max_entries;
 
   mapfd_ = create_map(map_type, name, key_size, value_size, max_entries, flags);
   if (mapfd_ < 0)
@@ -191,8 +413,278 @@ Map::Map(enum bpf_map_type map_type)
 
 Map::~Map()
 {
+  if (mmapped_)
+    munmap(mmapped_, mmapped_size_);
+  if (mapfd_ >= 0)
+    close(mapfd_);
+  if (spare_mapfd_ >= 0)
+    close(spare_mapfd_);
+  if (outer_mapfd_ >= 0)
+    close(outer_mapfd_);
+  for (size_t slot = 1; slot < window_mapfds_.size(); slot++)
+    close(window_mapfds_[slot]);
+  if (window_outer_mapfd_ >= 0)
+    close(window_outer_mapfd_);
+  if (sketch_mapfd_ >= 0)
+    close(sketch_mapfd_);
+  if (strings_mapfd_ >= 0)
+    close(strings_mapfd_);
+  if (ttl_mapfd_ >= 0)
+    close(ttl_mapfd_);
+}
+
+static uint64_t type_memory(uint32_t type,
+                            uint64_t key,
+                            uint64_t value,
+                            uint64_t entries)
+{
+  // Per-CPU values are each rounded up to 8 bytes
+  uint64_t percpu = ((value + 7) & ~7ULL) * get_possible_cpus().size();
+  switch (type)
+  {
+    case libbpf::BPF_MAP_TYPE_PERCPU_ARRAY:
+      return percpu * entries;
+    case libbpf::BPF_MAP_TYPE_PERCPU_HASH:
+    case libbpf::BPF_MAP_TYPE_LRU_PERCPU_HASH:
+      return (key + percpu) * entries;
+    case libbpf::BPF_MAP_TYPE_ARRAY:
+      return value * entries;
+    case libbpf::BPF_MAP_TYPE_PERF_EVENT_ARRAY:
+    case libbpf::BPF_MAP_TYPE_PROG_ARRAY:
+    case libbpf::BPF_MAP_TYPE_ARRAY_OF_MAPS:
+    case libbpf::BPF_MAP_TYPE_TASK_STORAGE:
+      // Pointers, or nothing allocated up front
+      return sizeof(void *) * entries;
+    case libbpf::BPF_MAP_TYPE_STACK_TRACE:
+      // value_size is the most frames, each bucket also has its length
+      return (value + 16) * entries;
+    case libbpf::BPF_MAP_TYPE_RINGBUF:
+      return entries;
+    default:
+      return (key + value) * entries;
+  }
+}
+
+static uint64_t fd_memory(int mapfd)
+{
+  struct bpf_map_info info = {};
+  uint32_t info_len = sizeof(info);
+  if (mapfd < 0 || bpf_obj_get_info(mapfd, &info, &info_len) != 0)
+    return 0;
+  return type_memory(
+      info.type, info.key_size, info.value_size, info.max_entries);
+}
+
+uint64_t map_memory(const IMap &map)
+{
+  // From what the map was to be created with when the kernel can't tell, so
+  // that it never counts as nothing
+  uint64_t bytes = fd_memory(map.mapfd_);
+  if (!bytes)
+    bytes = std::max<uint64_t>(type_memory(map.map_type_,
+                                           map.key_.size(),
+                                           map.type_.GetSize(),
+                                           map.max_entries_),
+                               1);
+  bytes += fd_memory(map.spare_mapfd_);
+  for (size_t slot = 1; slot < map.window_mapfds_.size(); slot++)
+    bytes += fd_memory(map.window_mapfds_[slot]);
+  bytes += fd_memory(map.sketch_mapfd_);
+  bytes += fd_memory(map.strings_mapfd_);
+  bytes += fd_memory(map.ttl_mapfd_);
+  return bytes;
+}
+
+// A new empty map of the same kind as the one of mapfd, -1 if it couldn't be
+// created
+static int create_empty_like(Map &map, int mapfd)
+{
+#ifdef HAVE_LIBBPF_BPF_H
+  struct bpf_map_info info = {};
+  uint32_t info_len = sizeof(info);
+  if (bpf_obj_get_info(mapfd, &info, &info_len) != 0)
+    return -1;
+
+  int fd = map.create_map(map.map_type_,
+                          map.name_,
+                          info.key_size,
+                          info.value_size,
+                          info.max_entries,
+                          info.map_flags);
+  if (fd < 0)
+    LOG(ERROR) << "failed to create map: '" << map.name_
+               << "': " << strerror(errno);
+  return fd;
+#else
+  (void)map;
+  (void)mapfd;
+  return -1;
+#endif
+}
+
+int Map::make_double_buffered()
+{
+#ifdef HAVE_LIBBPF_BPF_H
+  spare_mapfd_ = create_empty_like(*this, mapfd_);
+  if (spare_mapfd_ < 0)
+    return -1;
+
+  // A single slot holding the map the BPF programs update
+  outer_mapfd_ = bpf_create_map_in_map(BPF_MAP_TYPE_ARRAY_OF_MAPS,
+                                       nullptr,
+                                       sizeof(uint32_t),
+                                       mapfd_,
+                                       1,
+                                       0);
+  uint32_t key = 0;
+  if (outer_mapfd_ < 0 || bpf_update_elem(outer_mapfd_, &key, &mapfd_, 0))
+  {
+    LOG(ERROR) << "failed to create map: '" << name_
+               << "': " << strerror(errno);
+    return -1;
+  }
+  return 0;
+#else
+  LOG(ERROR) << "double-buffered maps are not available for linked bpf "
+                "version";
+  return -1;
+#endif
+}
+
+int Map::renew_spare()
+{
+  // The kernel frees the old map and its entries once it's closed
+  int fd = create_empty_like(*this, mapfd_);
+  if (fd < 0)
+    return -1;
+  close(spare_mapfd_);
+  spare_mapfd_ = fd;
+  return 0;
+}
+
+int Map::make_windowed(uint32_t slots, uint64_t slot_ns)
+{
+#ifdef HAVE_LIBBPF_BPF_H
+  window_outer_mapfd_ = bpf_create_map_in_map(BPF_MAP_TYPE_ARRAY_OF_MAPS,
+                                              nullptr,
+                                              sizeof(uint32_t),
+                                              mapfd_,
+                                              slots,
+                                              0);
+  if (window_outer_mapfd_ < 0)
+  {
+    LOG(ERROR) << "failed to create map: '" << name_
+               << "': " << strerror(errno);
+    return -1;
+  }
+  window_slot_ns_ = slot_ns;
+
+  for (uint32_t slot = 0; slot < slots; slot++)
+  {
+    int fd = slot == 0 ? mapfd_ : create_empty_like(*this, mapfd_);
+    if (fd < 0)
+      return -1;
+    window_mapfds_.push_back(fd);
+    if (bpf_update_elem(window_outer_mapfd_, &slot, &fd, 0))
+    {
+      LOG(ERROR) << "failed to create map: '" << name_
+                 << "': " << strerror(errno);
+      return -1;
+    }
+  }
+  return 0;
+#else
+  (void)slots;
+  (void)slot_ns;
+  LOG(ERROR) << "window maps are not available for linked bpf version";
+  return -1;
+#endif
+}
+
+int Map::renew_window_slot(uint32_t slot)
+{
+  int fd = create_empty_like(*this, window_mapfds_[slot]);
+  if (fd < 0)
+    return -1;
+  if (bpf_update_elem(window_outer_mapfd_, &slot, &fd, 0))
+  {
+    LOG(ERROR) << "failed to renew slot " << slot << " of map '" << name_
+               << "': " << strerror(errno);
+    close(fd);
+    return -1;
+  }
+  close(window_mapfds_[slot]);
+  window_mapfds_[slot] = fd;
+  if (slot == 0)
+    mapfd_ = fd;
+  return 0;
+}
+
+int Map::make_ttl(uint64_t ttl_ns)
+{
+  // Keyed like the map, hist() keys with their bucket number unless they hold
+  // a bucket array
+  int key_size = bpf_key_size();
+  ttl_mapfd_ = create_map(BPF_MAP_TYPE_HASH,
+                          name_,
+                          key_size,
+                          sizeof(uint64_t),
+                          max_entries_,
+                          0);
+  if (ttl_mapfd_ < 0)
+  {
+    LOG(ERROR) << "failed to create map: '" << name_
+               << "': " << strerror(errno);
+    return -1;
+  }
+  ttl_ns_ = ttl_ns;
+  return 0;
+}
+
+SnapshotMap::SnapshotMap(const std::string &name,
+                         const SizedType &type,
+                         const MapKey &key,
+                         int min,
+                         int max,
+                         int step)
+{
+  name_ = name;
+  type_ = type;
+  key_ = key;
+  lqmin = min;
+  lqmax = max;
+  lqstep = step;
+  mapfd_ = -1;
+  // Not per-CPU, the values are already combined
+  map_type_ = BPF_MAP_TYPE_HASH;
+}
+
+PinnedMap::PinnedMap(const std::string &name,
+                     const SizedType &type,
+                     const MapKey &key,
+                     int min,
+                     int max,
+                     int step)
+{
+  name_ = name;
+  type_ = type;
+  key_ = key;
+  lqmin = min;
+  lqmax = max;
+  lqstep = step;
+  mapfd_ = -1;
+}
+
+PinnedMap::~PinnedMap()
+{
+  if (mmapped_)
+    munmap(mmapped_, mmapped_size_);
   if (mapfd_ >= 0)
     close(mapfd_);
+  if (sketch_mapfd_ >= 0)
+    close(sketch_mapfd_);
+  if (strings_mapfd_ >= 0)
+    close(strings_mapfd_);
 }
 
 void MapManager::Add(std::unique_ptr<IMap> map)
@@ -270,18 +762,90 @@ bool MapManager::Has(StackType t)
   return stackid_maps_.find(t) != stackid_maps_.end();
 }
 
+std::vector<std::pair<std::string, IMap *>> MapManager::All() const
+{
+  std::vector<std::pair<std::string, IMap *>> all;
+  for (auto &map : maps_by_id_)
+    all.emplace_back(map->name_, map.get());
+  for (auto &it : maps_by_type_)
+    all.emplace_back(to_string(it.first), it.second.get());
+  for (auto &it : stackid_maps_)
+    all.emplace_back("stack map (" + std::to_string(it.first.limit) +
+                         " frames)",
+                     it.second.get());
+  return all;
+}
+
+void MapManager::Swap(MapManager &other)
+{
+  maps_by_id_.swap(other.maps_by_id_);
+  maps_by_name_.swap(other.maps_by_name_);
+  maps_by_type_.swap(other.maps_by_type_);
+  stackid_maps_.swap(other.stackid_maps_);
+}
+
+void MapManager::SwapMap(MapManager &other, const std::string &name)
+{
+  auto &mine = maps_by_id_.at(maps_by_name_.at(name)->id);
+  auto &theirs = other.maps_by_id_.at(other.maps_by_name_.at(name)->id);
+  std::swap(mine->id, theirs->id);
+  std::swap(mine, theirs);
+  maps_by_name_[name] = mine.get();
+  other.maps_by_name_[name] = theirs.get();
+}
+
+void MapManager::SwapMap(MapManager &other, Type t)
+{
+  std::swap(maps_by_type_.at(t), other.maps_by_type_.at(t));
+}
+
+void MapManager::SwapMap(MapManager &other, StackType t)
+{
+  std::swap(stackid_maps_.at(t), other.stackid_maps_.at(t));
+}
+
 std::string to_string(MapManager::Type t)
 {
   switch (t)
   {
     case MapManager::Type::PerfEvent:
       return "perf_event";
+    case MapManager::Type::Ringbuf:
+      return "ringbuf";
+    case MapManager::Type::RingbufLoss:
+      return "ringbuf_loss";
     case MapManager::Type::Join:
       return "join";
     case MapManager::Type::Elapsed:
       return "elapsed";
     case MapManager::Type::SeqPrintfData:
       return "seq_printf_data";
+    case MapManager::Type::Sample:
+      return "sample";
+    case MapManager::Type::Scratch:
+      return "scratch";
+    case MapManager::Type::TailCalls:
+      return "tail_calls";
+    case MapManager::Type::ProbeCounts:
+      return "probe_counts";
+    case MapManager::Type::Counters:
+      return "counters";
+    case MapManager::Type::Control:
+      return "control";
+    case MapManager::Type::EventBatch:
+      return "event_batch";
+    case MapManager::Type::HelperErrors:
+      return "helper_errors";
+    case MapManager::Type::AdaptiveSample:
+      return "adaptive_sample";
+    case MapManager::Type::FlightRecorder:
+      return "flight_recorder";
+    case MapManager::Type::Dedupe:
+      return "dedupe";
+    case MapManager::Type::ProbeGates:
+      return "probe_gates";
+    case MapManager::Type::RawSymbolsPids:
+      return "raw_symbols_pids";
   }
   return {}; // unreached
 }
@@ -1,34 +1,76 @@
 #pragma once
 
+#include <map>
+#include <vector>
+
 #include "imap.h"
 
 namespace bpftrace {
 
+// Creates a BPF_MAP_TYPE_TASK_STORAGE map with values of value_size bytes,
+// along with the BTF the kernel requires for it. Returns the fd or -1.
+int create_task_storage_map(const std::string &name, int value_size);
+
+// Estimate of the kernel memory held by map and the maps created along with
+// it (spare, window slots, sketch, strings), from their types and sizes. The
+// bookkeeping of the kernel for each entry is left out.
+uint64_t map_memory(const IMap &map);
+
 class Map : public IMap
 {
 public:
   Map(const std::string &name,
       const SizedType &type,
       const MapKey &key,
-      int max_entries)
-      : Map(name, type, key, 0, 0, 0, max_entries){};
+      int max_entries,
+      MapAlloc alloc = MapAlloc::prealloc,
+      bool mmapable = false,
+      bool dense = false,
+      bool task_storage = false,
+      bool hashed_key = false,
+      bool bucket_array = false)
+      : Map(name,
+            type,
+            key,
+            0,
+            0,
+            0,
+            max_entries,
+            alloc,
+            mmapable,
+            dense,
+            task_storage,
+            hashed_key,
+            bucket_array){};
   Map(const std::string &name,
       const SizedType &type,
       const MapKey &key,
       int min,
       int max,
       int step,
-      int max_entries);
+      int max_entries,
+      MapAlloc alloc = MapAlloc::prealloc,
+      bool mmapable = false,
+      bool dense = false,
+      bool task_storage = false,
+      bool hashed_key = false,
+      bool bucket_array = false);
   Map(const std::string &name,
       enum bpf_map_type type,
       int key_size,
       int value_size,
       int max_entries,
       int flags);
-  Map(const SizedType &type);
+  Map(const SizedType &type, int max_entries);
   Map(enum bpf_map_type map_type);
   virtual ~Map() override;
 
+  int make_double_buffered() override;
+  int renew_spare() override;
+  int make_windowed(uint32_t slots, uint64_t slot_ns) override;
+  int renew_window_slot(uint32_t slot) override;
+  int make_ttl(uint64_t ttl_ns) override;
+
   int create_map(enum bpf_map_type map_type,
                  const std::string &name,
                  int key_size,
@@ -36,4 +78,89 @@ public:
                  int max_entries,
                  int flags);
 };
+
+/**
+   A map merged from the snapshots given to --merge. Its entries, with the
+   values of all the CPUs combined, are held here rather than in the kernel,
+   and printed like those of the map it was saved from.
+*/
+class SnapshotMap : public IMap
+{
+public:
+  SnapshotMap(const std::string &name,
+              const SizedType &type,
+              const MapKey &key,
+              int min,
+              int max,
+              int step);
+
+  int make_double_buffered() override
+  {
+    return -1;
+  }
+  int renew_spare() override
+  {
+    return -1;
+  }
+  int make_windowed(uint32_t slots __attribute__((unused)),
+                    uint64_t slot_ns __attribute__((unused))) override
+  {
+    return -1;
+  }
+  int renew_window_slot(uint32_t slot __attribute__((unused))) override
+  {
+    return -1;
+  }
+  int make_ttl(uint64_t ttl_ns __attribute__((unused))) override
+  {
+    return -1;
+  }
+
+  std::map<std::vector<uint8_t>, std::vector<uint8_t>> entries_;
+};
+
+/**
+   A map another bpftrace pinned with --pin-maps, opened by --attach-session
+   to print it. The fds are the ones of the running session's maps, which are
+   only read: a double-buffered map is opened as the map its programs
+   currently update.
+*/
+class PinnedMap : public IMap
+{
+public:
+  PinnedMap(const std::string &name,
+            const SizedType &type,
+            const MapKey &key,
+            int min,
+            int max,
+            int step);
+  ~PinnedMap() override;
+
+  int make_double_buffered() override
+  {
+    return -1;
+  }
+  int renew_spare() override
+  {
+    return -1;
+  }
+  int make_windowed(uint32_t slots __attribute__((unused)),
+                    uint64_t slot_ns __attribute__((unused))) override
+  {
+    return -1;
+  }
+  int renew_window_slot(uint32_t slot __attribute__((unused))) override
+  {
+    return -1;
+  }
+  int make_ttl(uint64_t ttl_ns __attribute__((unused))) override
+  {
+    return -1;
+  }
+
+  // How the session created the map, which decides how it's opened
+  bool mmapable_ = false;
+  bool double_buffered_ = false;
+  bool has_sketch_ = false;
+};
 } // namespace bpftrace
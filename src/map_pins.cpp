@@ -0,0 +1,381 @@
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bcc/libbpf.h>
+#ifdef HAVE_LIBBPF_BPF_H
+#include <bpf/bpf.h>
+#endif
+
+#include "bpftrace.h"
+#include "log.h"
+#include "map.h"
+#include "map_pins.h"
+#include "program_image.h"
+
+namespace bpftrace {
+
+namespace {
+
+const char *const METADATA_PIN = "metadata";
+const char *const LAYOUT_PIN = "layout";
+const char *const SKETCH_DIR = "sketch";
+const char *const GATES_PIN = "probe_gates";
+const char *const GATE_NAMES_PIN = "probe_names";
+
+// Whether entry of a pin directory was left by pin_maps(), only those are
+// removed in case the directory is shared
+bool is_pin(const std::string &entry)
+{
+  return entry[0] == '@' || entry == METADATA_PIN || entry == LAYOUT_PIN ||
+         entry == GATES_PIN || entry == GATE_NAMES_PIN;
+}
+
+void remove_pins(const std::string &dir, bool sketches = false)
+{
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (struct dirent *entry = readdir(d))
+  {
+    std::string name = entry->d_name;
+    if (name == SKETCH_DIR && !sketches)
+      remove_pins(dir + "/" + name, true);
+    else if (is_pin(name))
+      unlink((dir + "/" + name).c_str());
+  }
+  closedir(d);
+  if (sketches)
+    rmdir(dir.c_str());
+}
+
+int pin(int fd, const std::string &path)
+{
+  if (bpf_obj_pin(fd, path.c_str()) == 0)
+    return 0;
+  LOG(ERROR) << "--pin-maps: failed to pin " << path << ": "
+             << strerror(errno);
+  return -1;
+}
+
+// Pins value as the single entry of an array map, the pin holds the map once
+// ours is closed
+int pin_value(const std::string &value, const std::string &path)
+{
+  Map map(path.substr(path.rfind('/') + 1),
+          BPF_MAP_TYPE_ARRAY,
+          sizeof(uint32_t),
+          value.size() + 1,
+          1,
+          0);
+  uint32_t key = 0;
+  std::vector<char> data(value.begin(), value.end());
+  data.push_back('\0');
+  if (map.mapfd_ < 0 || bpf_update_elem(map.mapfd_, &key, data.data(), 0))
+  {
+    LOG(ERROR) << "--pin-maps: failed to store " << path << ": "
+               << strerror(errno);
+    return -1;
+  }
+  return pin(map.mapfd_, path);
+}
+
+int open_pin(const std::string &path)
+{
+  int fd = bpf_obj_get(path.c_str());
+  if (fd < 0)
+    LOG(ERROR) << "--attach-session: failed to open " << path << ": "
+               << strerror(errno);
+  return fd;
+}
+
+#ifdef HAVE_LIBBPF_BPF_H
+// Reads the value pin_value() stored
+bool read_value(int fd, std::string &value)
+{
+  struct bpf_map_info info = {};
+  uint32_t info_len = sizeof(info);
+  if (bpf_obj_get_info(fd, &info, &info_len) != 0 || info.value_size == 0)
+    return false;
+  std::vector<char> data(info.value_size);
+  uint32_t key = 0;
+  if (bpf_lookup_elem(fd, &key, data.data()))
+    return false;
+  value.assign(data.data(), data.size() - 1);
+  return true;
+}
+#endif
+
+// Stacks and probes are ids into what only the session holds
+bool is_session_only(const SizedType &type)
+{
+  if (type.IsTupleTy())
+  {
+    for (auto &field : type.GetFields())
+      if (is_session_only(field.type))
+        return true;
+    return false;
+  }
+  return type.IsStack() || type.IsProbeTy();
+}
+
+bool has_bucket(const SizedType &type)
+{
+  return type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy();
+}
+
+} // namespace
+
+int pin_maps(BPFtrace &bpftrace, const std::string &dir)
+{
+  auto &maps = bpftrace.maps;
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+  {
+    LOG(ERROR) << "--pin-maps: failed to create " << dir << ": "
+               << strerror(errno);
+    return -1;
+  }
+  remove_pins(dir);
+
+  for (auto &map : maps)
+  {
+    int fd = map->is_double_buffered() ? map->outer_mapfd_ : map->mapfd_;
+    if (pin(fd, dir + "/" + map->name_) < 0)
+      return -1;
+    if (map->sketch_mapfd_ < 0)
+      continue;
+    auto sketch_dir = dir + "/" + SKETCH_DIR;
+    if (mkdir(sketch_dir.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+      LOG(ERROR) << "--pin-maps: failed to create " << sketch_dir << ": "
+                 << strerror(errno);
+      return -1;
+    }
+    if (pin(map->sketch_mapfd_, sketch_dir + "/" + map->name_) < 0)
+      return -1;
+  }
+
+  // For --attach-session to turn the probes on and off, by the names of
+  // their attach points
+  if (auto gates = maps[MapManager::Type::ProbeGates])
+  {
+    if (pin((*gates)->mapfd_, dir + "/" + GATES_PIN) < 0)
+      return -1;
+    std::string names;
+    for (auto &[gate, name] : bpftrace.probe_gates_)
+      names += std::to_string(gate) + " " + name + "\n";
+    if (pin_value(names, dir + "/" + GATE_NAMES_PIN) < 0)
+      return -1;
+  }
+
+  if (pin_value(ProgramImage::save_map_layout(bpftrace),
+                dir + "/" + LAYOUT_PIN) < 0)
+    return -1;
+  return pin_value(pinned_maps_metadata(maps), dir + "/" + METADATA_PIN);
+}
+
+int open_pinned_maps(BPFtrace &bpftrace, const std::string &dir)
+{
+#ifdef HAVE_LIBBPF_BPF_H
+  int fd = open_pin(dir + "/" + LAYOUT_PIN);
+  if (fd < 0)
+    return -1;
+  std::string layout;
+  bool read = read_value(fd, layout);
+  close(fd);
+  if (!read)
+  {
+    LOG(ERROR) << "--attach-session: failed to read the layout of " << dir
+               << ": " << strerror(errno);
+    return -1;
+  }
+
+  std::vector<std::unique_ptr<PinnedMap>> maps;
+  try
+  {
+    maps = ProgramImage::load_map_layout(bpftrace, layout);
+  }
+  catch (const std::runtime_error &ex)
+  {
+    LOG(ERROR) << "--attach-session: " << dir << ": " << ex.what();
+    return -1;
+  }
+
+  for (auto &map : maps)
+  {
+    bool session_only = is_session_only(map->type_);
+    for (auto &arg : map->key_.args_)
+      session_only |= is_session_only(arg);
+    if (session_only)
+    {
+      LOG(WARNING) << "--attach-session: " << map->name_
+                   << " holds stacks or probes, which only the session can "
+                      "print";
+      continue;
+    }
+
+    auto path = dir + "/" + map->name_;
+    map->mapfd_ = open_pin(path);
+    if (map->mapfd_ < 0)
+      return -1;
+    if (map->double_buffered_)
+    {
+      // Slot 0 of the array of maps has the id of the map being updated
+      int outer_mapfd = map->mapfd_;
+      uint32_t key = 0, id = 0;
+      map->mapfd_ = bpf_lookup_elem(outer_mapfd, &key, &id) == 0
+                        ? bpf_map_get_fd_by_id(id)
+                        : -1;
+      close(outer_mapfd);
+      if (map->mapfd_ < 0)
+      {
+        LOG(ERROR) << "--attach-session: failed to open the map in " << path
+                   << ": " << strerror(errno);
+        return -1;
+      }
+    }
+    if (map->mmapable_)
+    {
+      size_t page_size = getpagesize();
+      size_t size = (map->mmapped_value_size() * map->max_entries_ +
+                     page_size - 1) /
+                    page_size * page_size;
+      void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, map->mapfd_, 0);
+      if (addr == MAP_FAILED)
+      {
+        LOG(ERROR) << "--attach-session: failed to mmap " << path << ": "
+                   << strerror(errno);
+        return -1;
+      }
+      map->mmapped_ = addr;
+      map->mmapped_size_ = size;
+    }
+    if (map->has_sketch_)
+    {
+      map->sketch_mapfd_ = open_pin(dir + "/" + SKETCH_DIR + "/" +
+                                    map->name_);
+      if (map->sketch_mapfd_ < 0)
+        return -1;
+    }
+    bpftrace.maps.Add(std::move(map));
+  }
+  return 0;
+#else
+  (void)bpftrace;
+  (void)dir;
+  LOG(ERROR) << "--attach-session: bpftrace was built without libbpf";
+  return -1;
+#endif
+}
+
+int set_pinned_probes(const std::string &dir,
+                      const std::string &probe,
+                      bool disabled)
+{
+#ifdef HAVE_LIBBPF_BPF_H
+  int fd = open_pin(dir + "/" + GATE_NAMES_PIN);
+  if (fd < 0)
+    return -1;
+  std::string names;
+  bool read = read_value(fd, names);
+  close(fd);
+  if (!read)
+  {
+    LOG(ERROR) << "--attach-session: failed to read the probes of " << dir
+               << ": " << strerror(errno);
+    return -1;
+  }
+
+  std::vector<uint32_t> gates;
+  std::istringstream lines(names);
+  uint32_t gate;
+  std::string name;
+  while (lines >> gate && lines.get() == ' ' && std::getline(lines, name))
+  {
+    if (name == probe)
+      gates.push_back(gate);
+  }
+  if (gates.empty())
+  {
+    LOG(ERROR) << "--attach-session: " << dir << " has no probe " << probe;
+    return -1;
+  }
+
+  fd = open_pin(dir + "/" + GATES_PIN);
+  if (fd < 0)
+    return -1;
+  uint64_t value = disabled;
+  int err = 0;
+  for (uint32_t key : gates)
+  {
+    if (bpf_update_elem(fd, &key, &value, 0))
+    {
+      LOG(ERROR) << "--attach-session: failed to turn " << probe
+                 << (disabled ? " off: " : " on: ") << strerror(errno);
+      err = -1;
+      break;
+    }
+  }
+  close(fd);
+  return err;
+#else
+  (void)dir;
+  (void)probe;
+  (void)disabled;
+  LOG(ERROR) << "--attach-session: bpftrace was built without libbpf";
+  return -1;
+#endif
+}
+
+std::string pinned_maps_metadata(MapManager &maps)
+{
+  std::ostringstream json;
+  json << "{\"maps\": [";
+  bool first = true;
+  for (auto &map : maps)
+  {
+    auto &type = map->type_;
+    size_t key_size = map->key_.size() + (has_bucket(type) ? 8 : 0);
+    if (map->map_type_ == BPF_MAP_TYPE_ARRAY ||
+        map->map_type_ == BPF_MAP_TYPE_PERCPU_ARRAY)
+      key_size = sizeof(uint32_t);
+    else if (map->task_storage_)
+      // A pidfd
+      key_size = sizeof(int);
+    else if (key_size == 0)
+      key_size = 8;
+
+    json << (first ? "" : ", ") << "{\"name\": \"" << map->name_
+         << "\", \"type\": \"" << type << "\", \"value_size\": "
+         << type.GetSize() << ", \"key\": [";
+    for (size_t i = 0; i < map->key_.args_.size(); i++)
+    {
+      auto &arg = map->key_.args_[i];
+      json << (i ? ", " : "") << "{\"type\": \"" << arg
+           << "\", \"size\": " << arg.GetSize() << "}";
+    }
+    json << "], \"bucket\": " << (has_bucket(type) ? "true" : "false")
+         << ", \"key_size\": " << key_size
+         << ", \"map_type\": " << map->map_type_
+         << ", \"max_entries\": " << map->max_entries_
+         << ", \"per_cpu\": " << (map->is_per_cpu_type() ? "true" : "false")
+         << ", \"mmapped\": " << (map->is_mmapped() ? "true" : "false")
+         << ", \"dense\": " << (map->dense_ ? "true" : "false")
+         << ", \"double_buffered\": "
+         << (map->is_double_buffered() ? "true" : "false")
+         << ", \"sketch\": " << (map->sketch_mapfd_ >= 0 ? "true" : "false");
+    if (type.IsLhistTy() || type.IsLlhistTy())
+      json << ", \"min\": " << map->lqmin << ", \"max\": " << map->lqmax
+           << ", \"step\": " << map->lqstep;
+    json << "}";
+    first = false;
+  }
+  json << "]}";
+  return json.str();
+}
+
+} // namespace bpftrace
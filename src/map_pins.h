@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+
+#include "mapmanager.h"
+
+namespace bpftrace {
+
+class BPFtrace;
+
+/**
+   Pins the named maps under dir for `--pin-maps`, so that other processes
+   can read them with their own lookups.
+
+   Each map is pinned as dir/@name. Double-buffered maps are pinned as the
+   array of maps whose slot 0 holds the map being updated, the count-min
+   sketch of cms_count() maps as dir/sketch/@name. The layout of the maps,
+   see pinned_maps_metadata(), is the value of the single entry of the
+   array map pinned as dir/metadata, bpffs holding nothing but BPF objects.
+   The layout of dir/layout, see ProgramImage::save_map_layout(), is the
+   same for --attach-session. The probe gates map is pinned as
+   dir/probe_gates, with the names of the probes of each gate in
+   dir/probe_names.
+
+   What a previous run left in dir is replaced. The pins stay after
+   bpftrace exits, until they are removed.
+*/
+int pin_maps(BPFtrace &bpftrace, const std::string &dir);
+
+/**
+   Adds the maps pinned under dir by pin_maps() to bpftrace for
+   --attach-session, as PinnedMaps to print. The maps holding stacks or
+   probes are left out with a warning, they're ids into what only the session
+   that pinned them has.
+*/
+int open_pinned_maps(BPFtrace &bpftrace, const std::string &dir);
+
+/**
+   Turns off (or back on) the probes named probe, e.g. "kprobe:vfs_read", of
+   the session pinned under dir, as disable() and enable() would. Those are
+   the probes with an attach point of that name, as written in the program.
+*/
+int set_pinned_probes(const std::string &dir,
+                      const std::string &probe,
+                      bool disabled);
+
+/**
+   JSON describing the keys and values of the maps, e.g.
+
+     {"maps": [{"name": "@x", "type": "hist", "value_size": 8,
+                "key": [{"type": "int64", "size": 8}], "bucket": true,
+                "key_size": 16, "map_type": 5, "per_cpu": true, ...}]}
+
+   "key" are the fields of the key in order, followed by the 8 byte index
+   of the bucket (or of the count and total of avg() and stats()) when
+   "bucket" is set. Array maps are indexed by a 4 byte key instead.
+*/
+std::string pinned_maps_metadata(MapManager &maps);
+
+} // namespace bpftrace
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <charconv>
 #include <cstring>
 
 #include "async_event_types.h"
@@ -21,6 +23,64 @@ size_t MapKey::size() const
   return size;
 }
 
+size_t MapKey::packed_size() const
+{
+  if (packed_.empty())
+    return size();
+  size_t size = 0;
+  for (auto &slot : packed_)
+    size += slot.size;
+  return size;
+}
+
+void MapKey::pack(const std::vector<Width> &widths)
+{
+  packed_.clear();
+  if (args_.size() < 2 || widths.size() != args_.size() ||
+      std::all_of(widths.begin(), widths.end(), [](Width w) {
+        return w == Width::any;
+      }))
+    return;
+
+  packed_.resize(args_.size());
+  size_t offset = 0;
+  auto place = [&](size_t i, size_t size, bool is_signed) {
+    packed_[i] = Slot{ offset, size, is_signed };
+    offset += size;
+  };
+  // Every integer is then aligned
+  for (size_t i = 0; i < args_.size(); i++)
+    if (args_[i].IsIntTy() && widths[i] == Width::any)
+      place(i, args_[i].GetSize(), false);
+  for (size_t i = 0; i < args_.size(); i++)
+    if (args_[i].IsIntTy() && widths[i] != Width::any)
+      place(i, sizeof(uint32_t), widths[i] == Width::s32);
+  for (size_t i = 0; i < args_.size(); i++)
+    if (!args_[i].IsIntTy())
+      place(i, args_[i].GetSize(), false);
+}
+
+void MapKey::unpack(const uint8_t *packed, uint8_t *data) const
+{
+  size_t offset = 0;
+  for (size_t i = 0; i < args_.size(); i++)
+  {
+    auto &slot = packed_[i];
+    size_t size = args_[i].GetSize();
+    if (slot.size == size)
+      std::memcpy(data + offset, packed + slot.offset, size);
+    else
+    {
+      // Widened to 64 bits, as the programs store the unpacked integers
+      int64_t value = slot.is_signed
+                          ? read_data<int32_t>(packed + slot.offset)
+                          : read_data<uint32_t>(packed + slot.offset);
+      std::memcpy(data + offset, &value, sizeof(value));
+    }
+    offset += size;
+  }
+}
+
 std::string MapKey::argument_type_list() const
 {
   std::ostringstream list;
@@ -50,10 +110,53 @@ std::vector<std::string> MapKey::argument_value_list(BPFtrace &bpftrace,
 
 std::string MapKey::argument_value_list_str(BPFtrace &bpftrace,
     const std::vector<uint8_t> &data) const
+{
+  std::string list;
+  append_argument_value_list(bpftrace, data, list);
+  return list;
+}
+
+void MapKey::append_argument_value_list(BPFtrace &bpftrace,
+                                        const std::vector<uint8_t> &data,
+                                        std::string &out) const
 {
   if (args_.empty())
-    return "";
-  return "[" + str_join(argument_value_list(bpftrace, data), ", ") + "]";
+    return;
+  out += '[';
+  size_t offset = 0;
+  for (size_t i = 0; i < args_.size(); i++)
+  {
+    if (i)
+      out += ", ";
+    append_argument_value(bpftrace, args_[i], &data[offset], out);
+    offset += args_[i].GetSize();
+  }
+  out += ']';
+}
+
+void MapKey::append_argument_value(BPFtrace &bpftrace,
+                                   const SizedType &arg,
+                                   const void *data,
+                                   std::string &out)
+{
+  char buf[24];
+  std::to_chars_result res;
+  if (arg.type == Type::integer && arg.GetSize() == 8)
+    res = std::to_chars(buf, buf + sizeof(buf), read_data<int64_t>(data));
+  else if (arg.type == Type::integer && arg.GetSize() == 4)
+    res = std::to_chars(buf, buf + sizeof(buf), read_data<int32_t>(data));
+  else if (arg.type == Type::string)
+  {
+    auto p = static_cast<const char *>(data);
+    out.append(p, strnlen(p, arg.GetSize()));
+    return;
+  }
+  else
+  {
+    out += argument_value(bpftrace, arg, data);
+    return;
+  }
+  out.append(buf, res.ptr);
 }
 
 std::string MapKey::argument_value(BPFtrace &bpftrace,
@@ -100,6 +203,8 @@ std::string MapKey::argument_value(BPFtrace &bpftrace,
                                    (const uint8_t *)(arg_data + 8));
     case Type::username:
       return bpftrace.resolve_uid(read_data<uint64_t>(data));
+    case Type::cgroup_path:
+      return bpftrace.resolve_cgroup_path(read_data<uint64_t>(data));
     case Type::probe:
       return bpftrace.probe_ids_[read_data<uint64_t>(data)];
     case Type::string:
@@ -14,15 +14,63 @@ class MapKey
 public:
   std::vector<SizedType> args_;
 
+  // How an integer argument is known to be bounded, see pack()
+  enum class Width
+  {
+    any,
+    u32,
+    s32,
+  };
+
+  // Keys of several arguments can be stored packed in the BPF map: the
+  // 64-bit integers first, then those known to fit in 32 bits in 4 bytes
+  // each, then the other arguments. One slot per argument, empty when the
+  // arguments are stored one after the other, as size() and the printing
+  // expect them. Userspace unpacks the keys as it reads the map.
+  struct Slot
+  {
+    size_t offset;
+    size_t size;
+    // 4-byte integers are sign extended when unpacked
+    bool is_signed;
+
+    bool operator==(const Slot &s) const
+    {
+      return offset == s.offset && size == s.size && is_signed == s.is_signed;
+    }
+  };
+  std::vector<Slot> packed_;
+
   bool operator!=(const MapKey &k) const;
 
   size_t size() const;
+  bool is_packed() const
+  {
+    return !packed_.empty();
+  }
+  // Bytes of the arguments in the keys of the BPF map
+  size_t packed_size() const;
+  // Lay out the arguments packed, widths has one entry per argument. Nothing
+  // changes unless there are two arguments or more and some can be narrowed.
+  void pack(const std::vector<Width> &widths);
+  // Write the size() bytes of the arguments of the packed key to data
+  void unpack(const uint8_t *packed, uint8_t *data) const;
   std::string argument_type_list() const;
   std::vector<std::string> argument_value_list(
       BPFtrace &bpftrace,
       const std::vector<uint8_t> &data) const;
   std::string argument_value_list_str(BPFtrace &bpftrace,
                                       const std::vector<uint8_t> &data) const;
+  // Append argument_value_list_str() to out
+  void append_argument_value_list(BPFtrace &bpftrace,
+                                  const std::vector<uint8_t> &data,
+                                  std::string &out) const;
+  // Append argument_value() to out, integers and strings without an
+  // intermediate string
+  static void append_argument_value(BPFtrace &bpftrace,
+                                    const SizedType &arg,
+                                    const void *data,
+                                    std::string &out);
 
 private:
   static std::string argument_value(BPFtrace &bpftrace,
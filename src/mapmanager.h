@@ -3,7 +3,9 @@
 #include "imap.h"
 #include <map>
 #include <memory>
+#include <optional>
 #include <unordered_map>
+#include <vector>
 
 namespace bpftrace {
 
@@ -57,9 +59,41 @@ public:
   {
     // Also update to_string
     PerfEvent,
+    Ringbuf,
+    RingbufLoss,
     Join,
     Elapsed,
     SeqPrintfData,
+    Sample,
+    Scratch,
+    TailCalls,
+    ProbeCounts,
+    Counters,
+    // Ring buffer of the async actions (exit(), print(), clear()...), read
+    // ahead of the other events
+    Control,
+    // Per-CPU buffer of the printf() events sent in batches, see
+    // BPFTRACE_EVENT_BATCH
+    EventBatch,
+    // Per-CPU counts of the failed helper calls by helper error id and
+    // return value, see BPFtrace::print_helper_errors()
+    HelperErrors,
+    // Per-CPU divisor of the adaptive sampling written by userspace, and
+    // the runs of the probes seen and let through, see
+    // BPFTRACE_ADAPTIVE_SAMPLING
+    AdaptiveSample,
+    // Per-CPU ring of the last printf() events for --flight-recorder: the
+    // head in entry 0, then the slots the events overwrite, see
+    // BPFtrace::dump_flight_recorder()
+    FlightRecorder,
+    // Per-CPU copy of the last printf() event sent, the time it was sent at
+    // and the times it was repeated since, see BPFTRACE_DEDUPE_MS
+    Dedupe,
+    // Whether each probe was turned off by disable(), by the gate of the
+    // probe, see BPFtrace::probe_gates_
+    ProbeGates,
+    // The processes already sent to userspace for --raw-symbols, by pid
+    RawSymbolsPids,
   };
 
   void Set(Type t, std::unique_ptr<IMap> map);
@@ -84,6 +118,29 @@ public:
   {
     return stackid_maps_.size();
   };
+  const std::unordered_map<StackType, std::unique_ptr<IMap>> &StackMaps() const
+  {
+    return stackid_maps_;
+  }
+
+  /**
+     Every map (named, internal and stack maps) along with its name, or
+     what it is for when it has none
+  */
+  std::vector<std::pair<std::string, IMap *>> All() const;
+
+  /**
+     Exchange all the maps with the ones of other, see BPFtrace::reload()
+  */
+  void Swap(MapManager &other);
+
+  /**
+     Exchange a map with the one of the same name or type of other. Each
+     map takes over the id of the one it replaces.
+  */
+  void SwapMap(MapManager &other, const std::string &name);
+  void SwapMap(MapManager &other, Type t);
+  void SwapMap(MapManager &other, StackType t);
 
 private:
   std::vector<std::unique_ptr<IMap>> maps_by_id_;
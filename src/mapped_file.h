@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bpftrace {
+
+/**
+   Read-only mapping of a whole file, empty if it couldn't be mapped
+*/
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string &path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED)
+      {
+        data_ = addr;
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile()
+  {
+    if (data_)
+      munmap(data_, size_);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const
+  {
+    return static_cast<const uint8_t *>(data_);
+  }
+  size_t size() const
+  {
+    return size_;
+  }
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Program headers of the 64-bit ELF file, or nullptr
+inline const Elf64_Phdr *program_headers(const MappedFile &file,
+                                         size_t &count)
+{
+  if (file.size() < sizeof(Elf64_Ehdr))
+    return nullptr;
+  auto ehdr = reinterpret_cast<const Elf64_Ehdr *>(file.data());
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+      ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > file.size())
+    return nullptr;
+  count = ehdr->e_phnum;
+  return reinterpret_cast<const Elf64_Phdr *>(file.data() + ehdr->e_phoff);
+}
+
+} // namespace bpftrace
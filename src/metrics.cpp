@@ -0,0 +1,311 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+namespace {
+
+// How long a client gets to send its request, and then to take the response,
+// on the thread reading the events
+const auto CLIENT_TIMEOUT = std::chrono::milliseconds(100);
+// Largest request read, the headers are ignored
+const size_t REQUEST_MAX = 8 * 1024;
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+void append_label_value(std::string &out, const std::string &value)
+{
+  for (char c : value)
+  {
+    if (c == '\\')
+      out += "\\\\";
+    else if (c == '"')
+      out += "\\\"";
+    else if (c == '\n')
+      out += "\\n";
+    else
+      out += c;
+  }
+}
+
+// Waits for the events on fd until the deadline, false if it passed
+bool wait_for(int fd, short events, Deadline deadline)
+{
+  struct pollfd pfd = { fd, events, 0 };
+  int ready;
+  do
+  {
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0)
+      return false;
+    ready = poll(&pfd, 1, left.count());
+  } while (ready < 0 && errno == EINTR);
+  return ready > 0;
+}
+
+// Sends what the client takes of data before the deadline
+bool send_all(int fd, const std::string &data, Deadline deadline)
+{
+  size_t sent = 0;
+  while (sent < data.size())
+  {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          wait_for(fd, POLLOUT, deadline))
+        continue;
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+} // namespace
+
+void MetricsText::family(const std::string &name, const char *type)
+{
+  name_ = name;
+  text_ += "# TYPE ";
+  text_ += name;
+  text_ += ' ';
+  text_ += type;
+  text_ += '\n';
+}
+
+void MetricsText::begin_sample(const char *suffix,
+                               const Labels &labels,
+                               const char *le)
+{
+  text_ += name_;
+  text_ += suffix;
+  if (labels.empty() && !le)
+  {
+    text_ += ' ';
+    return;
+  }
+
+  text_ += '{';
+  for (auto &label : labels)
+  {
+    text_ += label.first;
+    text_ += "=\"";
+    append_label_value(text_, label.second);
+    text_ += "\",";
+  }
+  if (le)
+  {
+    text_ += "le=\"";
+    text_ += le;
+    text_ += "\",";
+  }
+  text_.back() = '}';
+  text_ += ' ';
+}
+
+void MetricsText::sample(const char *suffix,
+                         const Labels &labels,
+                         uint64_t value)
+{
+  begin_sample(suffix, labels, nullptr);
+  append_num(text_, value);
+  text_ += '\n';
+}
+
+void MetricsText::sample(const char *suffix,
+                         const Labels &labels,
+                         int64_t value)
+{
+  begin_sample(suffix, labels, nullptr);
+  append_num(text_, value);
+  text_ += '\n';
+}
+
+void MetricsText::bucket(const Labels &labels, double le, uint64_t count)
+{
+  // Thresholds are written as OpenMetrics canonical floats, e.g. "1.0"
+  char buf[32];
+  if (std::isinf(le))
+    std::strcpy(buf, "+Inf");
+  else if (le == std::floor(le) && std::fabs(le) < 0x1p53)
+    snprintf(buf, sizeof(buf), "%.1f", le);
+  else
+    snprintf(buf, sizeof(buf), "%.17g", le);
+  begin_sample("_bucket", labels, buf);
+  append_num(text_, count);
+  text_ += '\n';
+}
+
+const std::string &MetricsText::finish()
+{
+  text_ += "# EOF\n";
+  return text_;
+}
+
+std::string metric_name(const std::string &map_name)
+{
+  // Map names are identifiers, which metric names allow as they are
+  if (map_name.size() <= 1)
+    return "bpftrace";
+  return "bpftrace_" + map_name.substr(1);
+}
+
+MetricsServer::~MetricsServer()
+{
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+int MetricsServer::listen(const std::string &address)
+{
+  std::string host, port = address;
+  auto colon = address.rfind(':');
+  if (colon != std::string::npos)
+  {
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    // [::1]:9090
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+  }
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  struct addrinfo *res;
+  int err = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                        port.c_str(),
+                        &hints,
+                        &res);
+  if (err)
+  {
+    LOG(ERROR) << "--metrics: invalid address \"" << address
+               << "\": " << gai_strerror(err);
+    return -1;
+  }
+
+  // Without a host, the IPv6 wildcard also takes the IPv4 connections
+  struct addrinfo *ai = res;
+  for (struct addrinfo *i = res; host.empty() && i; i = i->ai_next)
+    if (i->ai_family == AF_INET6)
+      ai = i;
+
+  fd_ = socket(ai->ai_family,
+               ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+               ai->ai_protocol);
+  int one = 1, zero = 0;
+  if (fd_ >= 0 && ai->ai_family == AF_INET6 && host.empty())
+    setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  if (fd_ < 0 ||
+      setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(fd_, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(fd_, 16) != 0)
+  {
+    LOG(ERROR) << "--metrics: failed to listen on \"" << address
+               << "\": " << strerror(errno);
+    freeaddrinfo(res);
+    return -1;
+  }
+  freeaddrinfo(res);
+  return 0;
+}
+
+uint16_t MetricsServer::port() const
+{
+  struct sockaddr_storage addr = {};
+  socklen_t len = sizeof(addr);
+  if (getsockname(fd_, reinterpret_cast<struct sockaddr *>(&addr), &len) != 0)
+    return 0;
+  if (addr.ss_family == AF_INET6)
+    return ntohs(reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port);
+  return ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+}
+
+void MetricsServer::serve(const std::function<std::string()> &render)
+{
+  while (true)
+  {
+    int conn = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      // EAGAIN once they've all been answered
+      return;
+    }
+    answer(conn, render);
+    close(conn);
+  }
+}
+
+void MetricsServer::answer(int conn,
+                           const std::function<std::string()> &render)
+{
+  auto deadline = std::chrono::steady_clock::now() + CLIENT_TIMEOUT;
+  std::string request;
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < REQUEST_MAX)
+  {
+    char buf[1024];
+    ssize_t n = recv(conn, buf, sizeof(buf), 0);
+    if (n > 0)
+    {
+      request.append(buf, n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        wait_for(conn, POLLIN, deadline))
+      continue;
+    // Closed, or too slow to be waited for
+    return;
+  }
+
+  std::string status = "404 Not Found";
+  std::string body;
+  auto line = request.substr(0, request.find("\r\n"));
+  bool head = line.rfind("HEAD ", 0) == 0;
+  if (line.rfind("GET ", 0) != 0 && !head)
+    status = "405 Method Not Allowed";
+  else
+  {
+    auto path = line.substr(line.find(' ') + 1);
+    path = path.substr(0, path.find(' '));
+    path = path.substr(0, path.find('?'));
+    if (path == "/metrics" || path == "/")
+    {
+      status = "200 OK";
+      body = render();
+    }
+  }
+
+  std::string response = "HTTP/1.1 " + status + "\r\n";
+  if (status == "200 OK")
+    response += "Content-Type: application/openmetrics-text; version=1.0.0; "
+                "charset=utf-8\r\n";
+  response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  response += "Connection: close\r\n\r\n";
+  if (!head)
+    response += body;
+  // Rendering the maps isn't the client's time
+  send_all(conn, response, std::chrono::steady_clock::now() + CLIENT_TIMEOUT);
+}
+
+} // namespace bpftrace
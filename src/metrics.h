@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bpftrace {
+
+/**
+   Text of the maps in the OpenMetrics exposition format, served by
+   MetricsServer.
+
+   Each map is a metric family, started with family(), followed by its
+   samples. Label values are escaped, the families aren't checked for the
+   samples their type requires.
+*/
+class MetricsText
+{
+public:
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  void family(const std::string &name, const char *type);
+  // Sample of the current family, e.g. suffix "_total" for counters
+  void sample(const char *suffix, const Labels &labels, uint64_t value);
+  void sample(const char *suffix, const Labels &labels, int64_t value);
+  // Histogram bucket counting the values up to le, INFINITY for "+Inf"
+  void bucket(const Labels &labels, double le, uint64_t count);
+
+  // The text, ended by "# EOF"
+  const std::string &finish();
+
+private:
+  void begin_sample(const char *suffix, const Labels &labels, const char *le);
+
+  std::string text_;
+  std::string name_;
+};
+
+// Name of the metric of a map, "bpftrace_x" for @x and "bpftrace" for @
+std::string metric_name(const std::string &map_name);
+
+/**
+   HTTP server answering the Prometheus scrapes of `--metrics`.
+
+   The connections are accepted and answered by serve(), from the thread
+   reading the events, so that the maps are only read on a scrape and never
+   concurrently with printing them. A client is dropped if it takes over
+   100 ms to send its request, or then to take the response, so that a slow
+   one doesn't hold up the events.
+*/
+class MetricsServer
+{
+public:
+  MetricsServer() = default;
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer &) = delete;
+  MetricsServer &operator=(const MetricsServer &) = delete;
+
+  // Listen on [HOST:]PORT, on all the interfaces without HOST
+  int listen(const std::string &address);
+  int fd() const
+  {
+    return fd_;
+  }
+  uint16_t port() const;
+
+  // Answer the pending connections, with the text of render for /metrics
+  void serve(const std::function<std::string()> &render);
+
+private:
+  void answer(int conn, const std::function<std::string()> &render);
+
+  int fd_ = -1;
+};
+
+} // namespace bpftrace
@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <string_view>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "output.h"
 #include "bpftrace.h"
 #include "log.h"
@@ -10,27 +16,113 @@ bool is_quoted_type(const SizedType &ty)
 {
   return ty.IsKstackTy() || ty.IsUstackTy() || ty.IsKsymTy() || ty.IsUsymTy() ||
          ty.IsInetTy() || ty.IsUsernameTy() || ty.IsStringTy() ||
-         ty.IsBufferTy() || ty.IsProbeTy();
+         ty.IsBufferTy() || ty.IsProbeTy() || ty.IsCgroupPathTy();
+}
+
+const char *message_type_name(MessageType type)
+{
+  switch (type)
+  {
+    case MessageType::map: return "map";
+    case MessageType::value: return "value";
+    case MessageType::hist: return "hist";
+    case MessageType::stats: return "stats";
+    case MessageType::printf: return "printf";
+    case MessageType::time: return "time";
+    case MessageType::cat: return "cat";
+    case MessageType::join: return "join";
+    case MessageType::syscall: return "syscall";
+    case MessageType::attached_probes: return "attached_probes";
+    case MessageType::lost_events: return "lost_events";
+    case MessageType::event_stats: return "event_stats";
+    case MessageType::probe_stats: return "probe_stats";
+    case MessageType::load_stats: return "load_stats";
+    case MessageType::quantiles: return "quantiles";
+    case MessageType::self_stats: return "self_stats";
+    case MessageType::probe_counts: return "probe_counts";
+    case MessageType::child_run: return "child_run";
+    case MessageType::probe_estimates: return "probe_estimates";
+    case MessageType::repeated_events: return "repeated_events";
+    default: return "?";
+  }
+}
+
+// Whether the character has to be escaped in a JSON string
+bool json_needs_escape(char c)
+{
+  return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+}
+
+// First character from p on to escape in a JSON string, or end
+const char *find_json_escape(const char *p, const char *end)
+{
+#ifdef __SSE2__
+  // Most strings have nothing to escape, look at them 16 bytes at a time
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    // Unsigned c <= 0x1f
+    __m128i matches = _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk);
+    matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, quote));
+    matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, backslash));
+    int mask = _mm_movemask_epi8(matches);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p < end && !json_needs_escape(*p))
+    p++;
+  return p;
 }
+
 } // namespace
 
-std::ostream& operator<<(std::ostream& out, MessageType type) {
-  switch (type) {
-    case MessageType::map: out << "map"; break;
-    case MessageType::value:
-      out << "value";
-      break;
-    case MessageType::hist: out << "hist"; break;
-    case MessageType::stats: out << "stats"; break;
-    case MessageType::printf: out << "printf"; break;
-    case MessageType::time: out << "time"; break;
-    case MessageType::cat: out << "cat"; break;
-    case MessageType::join: out << "join"; break;
-    case MessageType::syscall: out << "syscall"; break;
-    case MessageType::attached_probes: out << "attached_probes"; break;
-    case MessageType::lost_events: out << "lost_events"; break;
-    default: out << "?";
+void append_json_escaped(std::string &out, std::string_view str)
+{
+  const char *p = str.data();
+  const char *end = p + str.size();
+  while (true)
+  {
+    const char *next = find_json_escape(p, end);
+    out.append(p, next);
+    if (next == end)
+      return;
+
+    switch (*next)
+    {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+      {
+        static const char hex[] = "0123456789abcdef";
+        char c = *next;
+        out += "\\u00";
+        out += hex[(c >> 4) & 0xf];
+        out += hex[c & 0xf];
+      }
+    }
+    p = next + 1;
   }
+}
+
+std::ostream& operator<<(std::ostream& out, MessageType type) {
+  out << message_type_name(type);
   return out;
 }
 
@@ -92,6 +184,30 @@ std::string TextOutput::lhist_index_label(int number)
   return label.str();
 }
 
+std::string TextOutput::llhist_index_label(uint64_t number)
+{
+  const char *suffixes = "KMGTPE";
+  int suffix = -1;
+  while (number >= 1024 && number % 1024 == 0 && suffix < 5)
+  {
+    number /= 1024;
+    suffix++;
+  }
+
+  std::ostringstream label;
+  label << number;
+  if (suffix >= 0)
+    label << suffixes[suffix];
+  return label.str();
+}
+
+std::string Output::quantile_label(double quantile)
+{
+  std::ostringstream label;
+  label << "p" << quantile;
+  return label.str();
+}
+
 void Output::hist_prepare(const std::vector<uint64_t> &values, int &min_index, int &max_index, int &max_value) const
 {
   min_index = -1;
@@ -153,10 +269,13 @@ void TextOutput::map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
 {
   uint32_t i = 0;
   size_t total = values_by_key.size();
+  // Each line is put together in the same buffer, and the stream is only
+  // flushed at the end
+  std::string line;
   for (auto &pair : values_by_key)
   {
-    auto key = pair.first;
-    auto value = pair.second;
+    auto &key = pair.first;
+    auto &value = pair.second;
 
     if (top)
     {
@@ -164,20 +283,59 @@ void TextOutput::map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
         continue;
     }
 
-    out_ << map.name_ << map.key_.argument_value_list_str(bpftrace, key) << ": ";
-    if (map.type_.type == Type::tuple)
-      out_ << tuple_to_str(bpftrace, map.type_, value);
-    else
-      out_ << bpftrace.map_value_to_str(
-          map.type_, value, map.is_per_cpu_type(), div, *this);
-
-    if (map.type_.type != Type::kstack && map.type_.type != Type::ustack &&
-        map.type_.type != Type::ksym && map.type_.type != Type::usym &&
-        map.type_.type != Type::inet)
-      out_ << std::endl;
+    map_entry(bpftrace, map, div, key, value, line);
+    out_.write(line.data(), line.size());
   }
   if (i == 0)
-    out_ << std::endl;
+    out_ << "\n";
+  out_.flush();
+}
+
+void TextOutput::map_entry(BPFtrace &bpftrace,
+                           IMap &map,
+                           uint32_t div,
+                           const std::vector<uint8_t> &key,
+                           const std::vector<uint8_t> &value,
+                           std::string &line) const
+{
+  line = map.name_;
+  map.key_.append_argument_value_list(bpftrace, key, line);
+  line += ": ";
+  if (map.type_.type == Type::tuple)
+    line += tuple_to_str(bpftrace, map.type_, value);
+  else
+    bpftrace.append_map_value(
+        line, map.type_, value, map.is_per_cpu_type(), div, *this);
+  if (map.type_.type != Type::kstack && map.type_.type != Type::ustack &&
+      map.type_.type != Type::ksym && map.type_.type != Type::usym &&
+      map.type_.type != Type::inet)
+    line += '\n';
+}
+
+bool TextOutput::map_begin(IMap &map __attribute__((unused))) const
+{
+  return true;
+}
+
+void TextOutput::map_entries(
+    BPFtrace &bpftrace,
+    IMap &map,
+    uint32_t div,
+    const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+        &entries) const
+{
+  std::string line;
+  for (auto &entry : entries)
+  {
+    map_entry(bpftrace, map, div, entry.first, entry.second, line);
+    out_.write(line.data(), line.size());
+  }
+}
+
+void TextOutput::map_end(IMap &map __attribute__((unused))) const
+{
+  out_ << "\n";
+  out_.flush();
 }
 
 void TextOutput::hist(const std::vector<uint64_t> &values, uint32_t div) const
@@ -215,7 +373,7 @@ void TextOutput::hist(const std::vector<uint64_t> &values, uint32_t div) const
     out_ << std::setw(16) << std::left << header.str()
          << std::setw(8) << std::right << (values.at(i) / div)
          << " |" << std::setw(max_width) << std::left << bar << "|"
-         << std::endl;
+         << "\n";
   }
 }
 
@@ -245,31 +403,71 @@ void TextOutput::lhist(const std::vector<uint64_t> &values, int min, int max, in
     out_ << std::setw(16) << std::left << header.str()
          << std::setw(8) << std::right << values.at(i)
          << " |" << std::setw(max_width) << std::left << bar << "|"
-         << std::endl;
+         << "\n";
+  }
+}
+
+void TextOutput::llhist(const std::vector<uint64_t> &values,
+                        int sub_buckets) const
+{
+  int min_index, max_index, max_value;
+  hist_prepare(values, min_index, max_index, max_value);
+  if (max_index == -1)
+    return;
+
+  for (int i = min_index; i <= max_index; i++)
+  {
+    std::ostringstream header;
+    if (i == 0)
+    {
+      header << "(..., 0)";
+    }
+    else
+    {
+      uint64_t low, high;
+      llhist_bucket_range(i, sub_buckets, low, high);
+      if (low == high)
+        header << "[" << llhist_index_label(low) << "]";
+      else
+        header << "[" << llhist_index_label(low) << ", "
+               << llhist_index_label(high + 1) << ")";
+    }
+
+    int max_width = 52;
+    int bar_width = values.at(i)/(float)max_value*max_width;
+    std::string bar(bar_width, '@');
+
+    out_ << std::setw(16) << std::left << header.str()
+         << std::setw(8) << std::right << values.at(i)
+         << " |" << std::setw(max_width) << std::left << bar << "|"
+         << "\n";
   }
 }
 
 void TextOutput::map_hist(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
-                          const std::map<std::vector<uint8_t>, std::vector<uint64_t>> &values_by_key,
-                          const std::vector<std::pair<std::vector<uint8_t>, uint64_t>> &total_counts_by_key) const
+                          const HistBuckets &values_by_key,
+                          const std::vector<size_t> &sorted_by_total) const
 {
   uint32_t i = 0;
-  for (auto &key_count : total_counts_by_key)
+  for (size_t idx : sorted_by_total)
   {
-    auto &key = key_count.first;
-    auto &value = values_by_key.at(key);
+    auto &key = values_by_key[idx].key;
+    auto &value = values_by_key[idx].buckets;
 
-    if (top && values_by_key.size() > top && i++ < (values_by_key.size() - top))
+    if (top && sorted_by_total.size() > top &&
+        i++ < (sorted_by_total.size() - top))
       continue;
 
-    out_ << map.name_ << map.key_.argument_value_list_str(bpftrace, key) << ": " << std::endl;
+    out_ << map.name_ << map.key_.argument_value_list_str(bpftrace, key) << ": \n";
 
     if (map.type_.IsHistTy())
       hist(value, div);
+    else if (map.type_.IsLlhistTy())
+      llhist(value, map.lqstep);
     else
       lhist(value, map.lqmin, map.lqmax, map.lqstep);
 
-    out_ << std::endl;
+    out_ << "\n";
   }
 }
 
@@ -288,8 +486,8 @@ void TextOutput::map_stats(
     auto &key = key_count.first;
     auto &value = values_by_key.at(key);
 
-    if (map.type_.IsAvgTy() && top && values_by_key.size() > top &&
-        i++ < (values_by_key.size() - top))
+    if (map.type_.IsAvgTy() && top && total_counts_by_key.size() > top &&
+        i++ < (total_counts_by_key.size() - top))
       continue;
 
     out_ << map.name_ << map.key_.argument_value_list_str(bpftrace, key) << ": ";
@@ -302,12 +500,12 @@ void TextOutput::map_stats(
       average = total / count;
 
     if (map.type_.IsStatsTy())
-      out_ << "count " << count << ", average " <<  average << ", total " << total << std::endl;
+      out_ << "count " << count << ", average " <<  average << ", total " << total << "\n";
     else
-      out_ << average / div << std::endl;
+      out_ << average / div << "\n";
   }
 
-  out_ << std::endl;
+  out_ << "\n";
 }
 
 void TextOutput::value(BPFtrace &bpftrace,
@@ -319,27 +517,161 @@ void TextOutput::value(BPFtrace &bpftrace,
   else
     out_ << bpftrace.map_value_to_str(ty, value, false, 1, *this);
 
-  out_ << std::endl;
+  out_ << "\n";
 }
 
 void TextOutput::message(MessageType type __attribute__((unused)), const std::string& msg, bool nl) const
 {
   out_ << msg;
   if (nl)
-    out_ << std::endl;
+    out_ << "\n";
 }
 
 void TextOutput::lost_events(uint64_t lost) const
 {
-  out_ << "Lost " << lost << " events" << std::endl;
+  out_ << "Lost " << lost << " events\n";
+}
+
+void TextOutput::repeated_events(uint64_t count) const
+{
+  out_ << "Last event repeated " << count << " times\n";
+}
+
+void TextOutput::event_stats(const EventStats &stats) const
+{
+  out_ << "Event stats:\n";
+  for (auto &reader : stats.readers)
+  {
+    if (reader.received == 0 && reader.lost == 0)
+      continue;
+    out_ << "  " << reader.name << ": received " << reader.received
+         << ", lost " << reader.lost << "\n";
+  }
+  for (auto &event : stats.events)
+    out_ << "  " << asynceventstr(event.first) << ": " << event.second
+         << "\n";
+  for (auto &stack_map : stats.stack_maps)
+    out_ << "  " << stack_map.name << ": " << stack_map.used << "/"
+         << stack_map.max_entries << " entries, lost " << stack_map.lost
+         << "\n";
+}
+
+void TextOutput::probe_stats(
+    const std::map<std::string, ProbeStats> &stats) const
+{
+  out_ << "Probe stats:\n";
+  for (auto &probe : stats)
+  {
+    auto &s = probe.second;
+    uint64_t avg = s.run_cnt ? s.run_time_ns / s.run_cnt : 0;
+    out_ << "  " << probe.first << ": " << s.run_cnt << " runs, avg " << avg
+         << " ns, total " << s.run_time_ns / 1000 << " us\n";
+  }
+}
+
+void TextOutput::load_stats(
+    const std::map<std::string, LoadStats> &stats) const
+{
+  out_ << "\n"
+       << std::left << std::setw(40) << "PROBE" << std::right << std::setw(6)
+       << "PROGS" << std::setw(10) << "INSNS" << std::setw(12) << "VERIFIED"
+       << std::setw(12) << "LOAD (us)" << "\n";
+  for (auto &probe : stats)
+  {
+    auto &s = probe.second;
+    out_ << std::left << std::setw(40) << probe.first << std::right
+         << std::setw(6) << s.progs << std::setw(10) << s.insns
+         << std::setw(12) << s.verified_insns << std::setw(12)
+         << s.load_time_us << "\n";
+  }
+}
+
+// Events handled in all, and a second over the stats' elapsed time
+static uint64_t self_stats_events(const SelfStats &stats)
+{
+  uint64_t events = 0;
+  for (auto &event : stats.events)
+    events += event.second.count;
+  return events;
+}
+
+static uint64_t per_sec(uint64_t count, uint64_t elapsed_ns)
+{
+  return elapsed_ns ? count * 1e9 / elapsed_ns : 0;
+}
+
+void TextOutput::probe_counts(
+    const std::vector<std::pair<std::string, uint64_t>> &counts) const
+{
+  out_ << "Probe counts:\n";
+  for (auto &probe : counts)
+    out_ << "  " << probe.first << ": " << probe.second << "\n";
+}
+
+void TextOutput::probe_estimates(const std::vector<ProbeEstimate> &estimates,
+                                 uint64_t elapsed_ns) const
+{
+  uint64_t total = 0;
+  out_ << "Probe rates over " << elapsed_ns / 1000000 << " ms:\n"
+       << std::left << std::setw(40) << "PROBE" << std::right << std::setw(12)
+       << "RUNS/s" << std::setw(8) << "INSNS" << std::setw(14) << "INSNS/s"
+       << "\n";
+  for (auto &e : estimates)
+  {
+    uint64_t insns = per_sec(e.runs * e.insns, elapsed_ns);
+    total += insns;
+    out_ << std::left << std::setw(40) << e.name << std::right << std::setw(12)
+         << per_sec(e.runs, elapsed_ns) << std::setw(8) << e.insns
+         << std::setw(14) << insns << "\n";
+  }
+  out_ << "Projected: at most " << total
+       << " instructions/s of the actual programs\n";
+}
+
+void TextOutput::self_stats(const SelfStats &stats) const
+{
+  uint64_t events = self_stats_events(stats);
+  out_ << "Self stats:\n";
+  out_ << "  elapsed: " << stats.elapsed_ns / 1000000 << " ms\n";
+  out_ << "  events: " << events << " ("
+       << per_sec(events, stats.elapsed_ns) << "/s)\n";
+  for (auto &event : stats.events)
+  {
+    auto &h = event.second;
+    out_ << "  " << asynceventstr(event.first) << ": " << h.count
+         << " events, avg " << (h.count ? h.time_ns / h.count : 0) << " ns"
+         << "\n";
+  }
+  for (auto &map : stats.maps)
+    out_ << "  " << map.first << ": " << map.second.count
+         << " prints, total " << map.second.time_ns / 1000 << " us"
+         << "\n";
+  out_ << "  kernel stack symbols: " << stats.ksym_hits << " hits, "
+       << stats.ksym_misses << " misses\n";
+  out_ << "  user stack symbols: " << stats.usym_hits << " hits, "
+       << stats.usym_misses << " misses\n";
+  out_ << "  output: " << stats.output_bytes << " bytes ("
+       << per_sec(stats.output_bytes, stats.elapsed_ns) << "/s)\n";
 }
 
 void TextOutput::attached_probes(uint64_t num_probes) const
 {
   if (num_probes == 1)
-    out_ << "Attaching " << num_probes << " probe..." << std::endl;
+    out_ << "Attaching " << num_probes << " probe...\n";
+  else
+    out_ << "Attaching " << num_probes << " probes...\n";
+}
+
+void TextOutput::child_run(uint64_t run, int exit_code, int term_signal) const
+{
+  out_ << "Run " << run << ": ";
+  if (exit_code >= 0)
+    out_ << "exited with code " << exit_code;
+  else if (term_signal >= 0)
+    out_ << "terminated by signal " << term_signal;
   else
-    out_ << "Attaching " << num_probes << " probes..." << std::endl;
+    out_ << "stopped";
+  out_ << "\n\n";
 }
 
 std::string TextOutput::tuple_to_str(BPFtrace &bpftrace,
@@ -378,6 +710,38 @@ std::string TextOutput::tuple_to_str(BPFtrace &bpftrace,
   return ret;
 }
 
+void TextOutput::map_quantiles(
+    BPFtrace &bpftrace,
+    IMap &map,
+    const std::vector<double> &quantiles,
+    const std::vector<QuantileSummary> &summaries) const
+{
+  for (auto &summary : summaries)
+  {
+    out_ << map.name_ << map.key_.argument_value_list_str(bpftrace, summary.key)
+         << ": count " << summary.count;
+    for (size_t i = 0; i < quantiles.size(); i++)
+      out_ << ", " << quantile_label(quantiles[i]) << " " << summary.values[i];
+    out_ << "\n";
+  }
+  out_ << "\n";
+}
+
+void TextOutput::map_cms(
+    BPFtrace &bpftrace,
+    IMap &map,
+    uint32_t div,
+    const std::vector<std::pair<std::vector<uint8_t>, uint64_t>>
+        &counts_by_key) const
+{
+  for (auto &pair : counts_by_key)
+  {
+    out_ << map.name_ << map.key_.argument_value_list_str(bpftrace, pair.first)
+         << ": " << pair.second / div << "\n";
+  }
+  out_ << "\n";
+}
+
 std::string TextOutput::struct_field_def_to_str(const std::string &field) const
 {
   return "." + field + " = ";
@@ -385,40 +749,66 @@ std::string TextOutput::struct_field_def_to_str(const std::string &field) const
 
 std::string JsonOutput::json_escape(const std::string &str) const
 {
-  std::ostringstream escaped;
-  for (const char &c : str)
-  {
-    switch (c)
-    {
-      case '"':
-        escaped << "\\\"";
-        break;
-
-      case '\\':
-        escaped << "\\\\";
-        break;
+  std::string escaped;
+  append_json_escaped(escaped, str);
+  return escaped;
+}
 
-      case '\n':
-        escaped << "\\n";
-        break;
+void FoldedOutput::map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
+                       const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key) const
+{
+  bool has_stack = false;
+  for (auto &arg : map.key_.args_)
+    has_stack |= arg.IsKstackTy() || arg.IsUstackTy();
+  if (!has_stack || !(map.type_.IsCountTy() || map.type_.IsSumTy() ||
+                      map.type_.IsIntTy()))
+  {
+    TextOutput::map(bpftrace, map, top, div, values_by_key);
+    return;
+  }
 
-      case '\r':
-        escaped << "\\r";
-        break;
+  uint32_t i = 0;
+  size_t total = values_by_key.size();
+  std::string line;
+  for (auto &pair : values_by_key)
+  {
+    auto &key = pair.first;
+    auto &value = pair.second;
 
-      case '\t':
-        escaped << "\\t";
-        break;
+    if (top)
+    {
+      if (total > top && i++ < (total - top))
+        continue;
+    }
 
-      default:
-        if ('\x00' <= c && c <= '\x1f') {
-          escaped << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c;
-        } else {
-          escaped << c;
-        }
+    // Built straight from the stack ids, without formatting the stacks
+    line.clear();
+    size_t offset = 0;
+    for (auto &arg : map.key_.args_)
+    {
+      if (arg.IsKstackTy() || arg.IsUstackTy())
+      {
+        bpftrace.append_folded_stack(line,
+                                     read_data<uint64_t>(key.data() + offset),
+                                     arg.IsUstackTy(),
+                                     arg.stack_type);
+      }
+      else
+      {
+        if (!line.empty())
+          line += ';';
+        MapKey::append_argument_value(
+            bpftrace, arg, key.data() + offset, line);
+      }
+      offset += arg.GetSize();
     }
+
+    out_ << line << " "
+         << bpftrace.map_value_to_str(
+                map.type_, value, map.is_per_cpu_type(), div, *this)
+         << "\n";
   }
-  return escaped.str();
+  out_ << std::flush;
 }
 
 void JsonOutput::map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
@@ -431,18 +821,15 @@ void JsonOutput::map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
     LOG(WARNING) << "JSON format for structs inside tuples is unsupported, may "
                     "cause ill-formatted JSON";
 
-  out_ << "{\"type\": \"" << MessageType::map << "\", \"data\": {";
-  out_ << "\"" << json_escape(map.name_) << "\": ";
-  if (map.key_.size() > 0) // check if this map has keys
-    out_ << "{";
+  begin_record(MessageType::map, map);
 
   uint32_t i = 0;
   uint32_t j = 0;
   size_t total = values_by_key.size();
   for (auto &pair : values_by_key)
   {
-    auto key = pair.first;
-    auto value = pair.second;
+    auto &key = pair.first;
+    auto &value = pair.second;
 
     if (top)
     {
@@ -450,35 +837,76 @@ void JsonOutput::map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
         continue;
     }
 
-    std::vector<std::string> args = map.key_.argument_value_list(bpftrace, key);
     if (i > 0)
-      out_ << ", ";
-    if (args.size() > 0) {
-      out_ << "\"" << json_escape(str_join(args, ",")) << "\": ";
-    }
-
-    if (is_quoted_type(map.type_))
-    {
-      out_ << "\""
-           << json_escape(bpftrace.map_value_to_str(
-                  map.type_, value, map.is_per_cpu_type(), div, *this))
-           << "\"";
-    }
-    else if (map.type_.type == Type::tuple)
-    {
-      out_ << tuple_to_str(bpftrace, map.type_, value);
-    }
-    else {
-      out_ << bpftrace.map_value_to_str(
-          map.type_, value, map.is_per_cpu_type(), div, *this);
-    }
+      buf_ += ", ";
+    append_map_entry(bpftrace, map, div, key, value);
 
     i++;
   }
 
-  if (map.key_.size() > 0)
-    out_ << "}";
-  out_ << "}}" << std::endl;
+  end_record(map);
+}
+
+void JsonOutput::append_map_entry(BPFtrace &bpftrace,
+                                  IMap &map,
+                                  uint32_t div,
+                                  const std::vector<uint8_t> &key,
+                                  const std::vector<uint8_t> &value) const
+{
+  append_key(bpftrace, map, key);
+
+  if (is_quoted_type(map.type_))
+  {
+    append_str(bpftrace.map_value_to_str(
+        map.type_, value, map.is_per_cpu_type(), div, *this));
+  }
+  else if (map.type_.type == Type::tuple)
+  {
+    buf_ += tuple_to_str(bpftrace, map.type_, value);
+  }
+  else {
+    bpftrace.append_map_value(
+        buf_, map.type_, value, map.is_per_cpu_type(), div, *this);
+  }
+}
+
+// The record of a streamed map is written a batch at a time, like map()
+// writes it once it's put together. It's begun with the first entry, as
+// map() writes nothing for an empty map.
+bool JsonOutput::map_begin(IMap &map) const
+{
+  if (map.type_.IsTupleWithStruct())
+    LOG(WARNING) << "JSON format for structs inside tuples is unsupported, may "
+                    "cause ill-formatted JSON";
+  streamed_ = 0;
+  return true;
+}
+
+void JsonOutput::map_entries(
+    BPFtrace &bpftrace,
+    IMap &map,
+    uint32_t div,
+    const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+        &entries) const
+{
+  for (auto &entry : entries)
+  {
+    if (streamed_ == 0)
+      begin_record(MessageType::map, map);
+    else
+      buf_ += ", ";
+    append_map_entry(bpftrace, map, div, entry.first, entry.second);
+    streamed_++;
+  }
+  out_.write(buf_.data(), buf_.size());
+  buf_.clear();
+}
+
+void JsonOutput::map_end(IMap &map) const
+{
+  if (streamed_ > 0)
+    end_record(map);
+  streamed_ = 0;
 }
 
 void JsonOutput::hist(const std::vector<uint64_t> &values, uint32_t div) const
@@ -488,35 +916,40 @@ void JsonOutput::hist(const std::vector<uint64_t> &values, uint32_t div) const
   if (max_index == -1)
     return;
 
-  out_ << "[";
+  buf_ += "[";
   for (int i = min_index; i <= max_index; i++)
   {
     if (i > min_index)
-      out_ << ", ";
+      buf_ += ", ";
 
-    out_ << "{";
+    buf_ += "{";
     if (i == 0)
     {
-      out_ << "\"max\": -1, ";
+      buf_ += "\"max\": -1, ";
     }
     else if (i == 1)
     {
-      out_ << "\"min\": 0, \"max\": 0, ";
+      buf_ += "\"min\": 0, \"max\": 0, ";
     }
     else if (i == 2)
     {
-      out_ << "\"min\": 1, \"max\": 1, ";
+      buf_ += "\"min\": 1, \"max\": 1, ";
     }
     else
     {
       long low = 1 << (i-2);
       long high = (1 << (i-2+1)) - 1;
-      out_ << "\"min\": " << low << ", \"max\": " << high << ", ";
+      buf_ += "\"min\": ";
+      append_num(buf_, low);
+      buf_ += ", \"max\": ";
+      append_num(buf_, high);
+      buf_ += ", ";
     }
-    out_ << "\"count\": " << values.at(i) / div;
-    out_ << "}";
+    buf_ += "\"count\": ";
+    append_num(buf_, values.at(i) / div);
+    buf_ += "}";
   }
-  out_ << "]";
+  buf_ += "]";
 }
 
 void JsonOutput::lhist(const std::vector<uint64_t> &values, int min, int max, int step) const
@@ -526,69 +959,108 @@ void JsonOutput::lhist(const std::vector<uint64_t> &values, int min, int max, in
   if (max_index == -1)
     return;
 
-  out_ << "[";
+  buf_ += "[";
   for (int i = start_value; i <= end_value; i++)
   {
     if (i > start_value)
-      out_ << ", ";
+      buf_ += ", ";
 
-    out_ << "{";
+    buf_ += "{";
     if (i == 0) {
-      out_ << "\"max\": " << min - 1 << ", ";
-
+      buf_ += "\"max\": ";
+      append_num(buf_, min - 1);
+      buf_ += ", ";
     } else if (i == (buckets + 1)) {
-      out_ << "\"min\": " << max << ", ";
+      buf_ += "\"min\": ";
+      append_num(buf_, max);
+      buf_ += ", ";
     } else {
       long low = (i - 1) * step + min;
       long high = i * step + min - 1;
-      out_ << "\"min\": " << low << ", \"max\": " << high << ", ";
+      buf_ += "\"min\": ";
+      append_num(buf_, low);
+      buf_ += ", \"max\": ";
+      append_num(buf_, high);
+      buf_ += ", ";
     }
-    out_ << "\"count\": " << values.at(i);
-    out_ << "}";
+    buf_ += "\"count\": ";
+    append_num(buf_, values.at(i));
+    buf_ += "}";
+  }
+  buf_ += "]";
+}
+
+void JsonOutput::llhist(const std::vector<uint64_t> &values,
+                        int sub_buckets) const
+{
+  int min_index, max_index, max_value;
+  hist_prepare(values, min_index, max_index, max_value);
+  if (max_index == -1)
+    return;
+
+  buf_ += "[";
+  for (int i = min_index; i <= max_index; i++)
+  {
+    if (i > min_index)
+      buf_ += ", ";
+
+    buf_ += "{";
+    if (i == 0)
+    {
+      buf_ += "\"max\": -1, ";
+    }
+    else
+    {
+      uint64_t low, high;
+      llhist_bucket_range(i, sub_buckets, low, high);
+      buf_ += "\"min\": ";
+      append_num(buf_, low);
+      buf_ += ", \"max\": ";
+      append_num(buf_, high);
+      buf_ += ", ";
+    }
+    buf_ += "\"count\": ";
+    append_num(buf_, values.at(i));
+    buf_ += "}";
   }
-  out_ << "]";
+  buf_ += "]";
 }
 
 void JsonOutput::map_hist(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
-                          const std::map<std::vector<uint8_t>, std::vector<uint64_t>> &values_by_key,
-                          const std::vector<std::pair<std::vector<uint8_t>, uint64_t>> &total_counts_by_key) const
+                          const HistBuckets &values_by_key,
+                          const std::vector<size_t> &sorted_by_total) const
 {
-  if (total_counts_by_key.empty())
+  if (sorted_by_total.empty())
     return;
 
-  out_ << "{\"type\": \"" << MessageType::hist << "\", \"data\": {";
-  out_ << "\"" << json_escape(map.name_) << "\": ";
-  if (map.key_.size() > 0) // check if this map has keys
-    out_ << "{";
+  begin_record(MessageType::hist, map);
 
   uint32_t i = 0;
   uint32_t j = 0;
-  for (auto &key_count : total_counts_by_key)
+  for (size_t idx : sorted_by_total)
   {
-    auto &key = key_count.first;
-    auto &value = values_by_key.at(key);
+    auto &key = values_by_key[idx].key;
+    auto &value = values_by_key[idx].buckets;
 
-    if (top && values_by_key.size() > top && j++ < (values_by_key.size() - top))
+    if (top && sorted_by_total.size() > top &&
+        j++ < (sorted_by_total.size() - top))
       continue;
 
-    std::vector<std::string> args = map.key_.argument_value_list(bpftrace, key);
     if (i > 0)
-      out_ << ", ";
-    if (args.size() > 0) {
-      out_ << "\"" << json_escape(str_join(args, ",")) << "\": ";
-    }
+      buf_ += ", ";
+    append_key(bpftrace, map, key);
 
     if (map.type_.IsHistTy())
       hist(value, div);
+    else if (map.type_.IsLlhistTy())
+      llhist(value, map.lqstep);
     else
       lhist(value, map.lqmin, map.lqmax, map.lqstep);
 
     i++;
   }
 
-  if (map.key_.size() > 0)
-    out_ << "}";
-  out_ << "}}" << std::endl;
+  end_record(map);
 }
 
 void JsonOutput::map_stats(
@@ -603,10 +1075,7 @@ void JsonOutput::map_stats(
   if (total_counts_by_key.empty())
     return;
 
-  out_ << "{\"type\": \"" << MessageType::stats << "\", \"data\": {";
-  out_ << "\"" << json_escape(map.name_) << "\": ";
-  if (map.key_.size() > 0) // check if this map has keys
-    out_ << "{";
+  begin_record(MessageType::stats, map);
 
   uint32_t i = 0;
   uint32_t j = 0;
@@ -615,16 +1084,15 @@ void JsonOutput::map_stats(
     auto &key = key_count.first;
     auto &value = values_by_key.at(key);
 
-    if (map.type_.IsAvgTy() && top && values_by_key.size() > top &&
-        j++ < (values_by_key.size() - top))
+    if (map.type_.IsAvgTy() && top && total_counts_by_key.size() > top &&
+        j++ < (total_counts_by_key.size() - top))
       continue;
 
-    std::vector<std::string> args = map.key_.argument_value_list(bpftrace, key);
     if (i > 0)
-      out_ << ", ";
-    if (args.size() > 0) {
-      out_ << "    \"" << json_escape(str_join(args, ",")) << "\": ";
-    }
+      buf_ += ", ";
+    if (map.key_.size() > 0)
+      buf_ += "    ";
+    append_key(bpftrace, map, key);
 
     uint64_t count = value.at(0);
     int64_t total = value.at(1);
@@ -634,16 +1102,22 @@ void JsonOutput::map_stats(
       average = total / count;
 
     if (map.type_.IsStatsTy())
-      out_ << "{\"count\": " << count << ", \"average\": " <<  average << ", \"total\": " << total << "}";
+    {
+      buf_ += "{\"count\": ";
+      append_num(buf_, count);
+      buf_ += ", \"average\": ";
+      append_num(buf_, average);
+      buf_ += ", \"total\": ";
+      append_num(buf_, total);
+      buf_ += "}";
+    }
     else
-      out_ << average / div;
+      append_num(buf_, average / div);
 
     i++;
   }
 
-  if (map.key_.size() > 0)
-    out_ << "}";
-  out_ << "}}" << std::endl;
+  end_record(map);
 }
 
 void JsonOutput::value(BPFtrace &bpftrace,
@@ -654,35 +1128,101 @@ void JsonOutput::value(BPFtrace &bpftrace,
     LOG(WARNING) << "JSON format for structs inside tuples is unsupported, may "
                     "cause ill-formatted JSON";
 
-  out_ << "{\"type\": \"" << MessageType::value << "\", \"data\": ";
+  buf_ += "{\"type\": \"";
+  buf_ += message_type_name(MessageType::value);
+  buf_ += "\", \"data\": ";
 
   if (is_quoted_type(ty))
   {
-    out_ << "\""
-         << json_escape(bpftrace.map_value_to_str(ty, value, false, 1, *this))
-         << "\"";
+    append_str(bpftrace.map_value_to_str(ty, value, false, 1, *this));
   }
   else if (ty.type == Type::tuple)
   {
-    out_ << tuple_to_str(bpftrace, ty, value);
+    buf_ += tuple_to_str(bpftrace, ty, value);
   }
   else
   {
-    out_ << bpftrace.map_value_to_str(ty, value, false, 1, *this);
+    buf_ += bpftrace.map_value_to_str(ty, value, false, 1, *this);
   }
 
-  out_ << "}" << std::endl;
+  buf_ += "}";
+  flush_record();
 }
 
 void JsonOutput::message(MessageType type, const std::string& msg, bool nl __attribute__((unused))) const
 {
-  out_ << "{\"type\": \"" << type << "\", \"data\": \"" << json_escape(msg) << "\"}" << std::endl;
+  buf_ += "{\"type\": \"";
+  buf_ += message_type_name(type);
+  buf_ += "\", \"data\": ";
+  append_str(msg);
+  buf_ += "}";
+  flush_record();
 }
 
 void JsonOutput::message(MessageType type, const std::string& field, uint64_t value) const
 {
-  out_ << "{\"type\": \"" << type << "\", \"data\": " <<  "{\"" << field
-       << "\": " << value << "}" << "}" << std::endl;
+  buf_ += "{\"type\": \"";
+  buf_ += message_type_name(type);
+  buf_ += "\", \"data\": {\"";
+  buf_ += field;
+  buf_ += "\": ";
+  append_num(buf_, value);
+  buf_ += "}}";
+  flush_record();
+}
+
+void JsonOutput::append_str(std::string_view str) const
+{
+  buf_ += '"';
+  append_json_escaped(buf_, str);
+  buf_ += '"';
+}
+
+void JsonOutput::append_key(BPFtrace &bpftrace,
+                            IMap &map,
+                            const std::vector<uint8_t> &key) const
+{
+  auto &args = map.key_.args_;
+  if (args.empty())
+    return;
+  buf_ += '"';
+  size_t offset = 0;
+  for (size_t i = 0; i < args.size(); i++)
+  {
+    if (i > 0)
+      buf_ += ',';
+    arg_.clear();
+    MapKey::append_argument_value(bpftrace, args[i], &key[offset], arg_);
+    append_json_escaped(buf_, arg_);
+    offset += args[i].GetSize();
+  }
+  buf_ += "\": ";
+}
+
+void JsonOutput::begin_record(MessageType type, IMap &map) const
+{
+  buf_ += "{\"type\": \"";
+  buf_ += message_type_name(type);
+  buf_ += "\", \"data\": {";
+  append_str(map.name_);
+  buf_ += ": ";
+  if (map.key_.size() > 0) // check if this map has keys
+    buf_ += "{";
+}
+
+void JsonOutput::end_record(IMap &map) const
+{
+  if (map.key_.size() > 0)
+    buf_ += "}";
+  buf_ += "}}";
+  flush_record();
+}
+
+void JsonOutput::flush_record() const
+{
+  out_.write(buf_.data(), buf_.size());
+  out_ << "\n";
+  buf_.clear();
 }
 
 void JsonOutput::lost_events(uint64_t lost) const
@@ -690,11 +1230,157 @@ void JsonOutput::lost_events(uint64_t lost) const
   message(MessageType::lost_events, "events", lost);
 }
 
+void JsonOutput::repeated_events(uint64_t count) const
+{
+  message(MessageType::repeated_events, "events", count);
+}
+
+void JsonOutput::event_stats(const EventStats &stats) const
+{
+  out_ << "{\"type\": \"" << MessageType::event_stats << "\", \"data\": {";
+  out_ << "\"readers\": {";
+  bool first = true;
+  for (auto &reader : stats.readers)
+  {
+    if (reader.received == 0 && reader.lost == 0)
+      continue;
+    out_ << (first ? "" : ", ") << "\"" << reader.name << "\": "
+         << "{\"received\": " << reader.received
+         << ", \"lost\": " << reader.lost << "}";
+    first = false;
+  }
+  out_ << "}, \"events\": {";
+  first = true;
+  for (auto &event : stats.events)
+  {
+    out_ << (first ? "" : ", ") << "\"" << asynceventstr(event.first)
+         << "\": " << event.second;
+    first = false;
+  }
+  out_ << "}, \"stack_maps\": {";
+  first = true;
+  for (auto &stack_map : stats.stack_maps)
+  {
+    out_ << (first ? "" : ", ") << "\"" << stack_map.name << "\": "
+         << "{\"used\": " << stack_map.used
+         << ", \"max_entries\": " << stack_map.max_entries
+         << ", \"lost\": " << stack_map.lost << "}";
+    first = false;
+  }
+  out_ << "}}}\n";
+}
+
+void JsonOutput::probe_stats(
+    const std::map<std::string, ProbeStats> &stats) const
+{
+  out_ << "{\"type\": \"" << MessageType::probe_stats << "\", \"data\": {";
+  bool first = true;
+  for (auto &probe : stats)
+  {
+    auto &s = probe.second;
+    uint64_t avg = s.run_cnt ? s.run_time_ns / s.run_cnt : 0;
+    out_ << (first ? "" : ", ") << "\"" << json_escape(probe.first)
+         << "\": {\"run_cnt\": " << s.run_cnt
+         << ", \"run_time_ns\": " << s.run_time_ns
+         << ", \"avg_ns\": " << avg << "}";
+    first = false;
+  }
+  out_ << "}}\n";
+}
+
+void JsonOutput::load_stats(
+    const std::map<std::string, LoadStats> &stats) const
+{
+  out_ << "{\"type\": \"" << MessageType::load_stats << "\", \"data\": {";
+  bool first = true;
+  for (auto &probe : stats)
+  {
+    auto &s = probe.second;
+    out_ << (first ? "" : ", ") << "\"" << json_escape(probe.first)
+         << "\": {\"progs\": " << s.progs << ", \"insns\": " << s.insns
+         << ", \"verified_insns\": " << s.verified_insns
+         << ", \"load_time_us\": " << s.load_time_us << "}";
+    first = false;
+  }
+  out_ << "}}\n";
+}
+
+void JsonOutput::probe_counts(
+    const std::vector<std::pair<std::string, uint64_t>> &counts) const
+{
+  out_ << "{\"type\": \"" << MessageType::probe_counts << "\", \"data\": {";
+  bool first = true;
+  for (auto &probe : counts)
+  {
+    out_ << (first ? "" : ", ") << "\"" << json_escape(probe.first)
+         << "\": " << probe.second;
+    first = false;
+  }
+  out_ << "}}\n";
+}
+
+void JsonOutput::probe_estimates(const std::vector<ProbeEstimate> &estimates,
+                                 uint64_t elapsed_ns) const
+{
+  out_ << "{\"type\": \"" << MessageType::probe_estimates
+       << "\", \"data\": {\"elapsed_ns\": " << elapsed_ns
+       << ", \"probes\": {";
+  bool first = true;
+  for (auto &e : estimates)
+  {
+    out_ << (first ? "" : ", ") << "\"" << json_escape(e.name)
+         << "\": {\"runs\": " << e.runs
+         << ", \"runs_per_sec\": " << per_sec(e.runs, elapsed_ns)
+         << ", \"insns\": " << e.insns << ", \"insns_per_sec\": "
+         << per_sec(e.runs * e.insns, elapsed_ns) << "}";
+    first = false;
+  }
+  out_ << "}}}\n";
+}
+
+void JsonOutput::self_stats(const SelfStats &stats) const
+{
+  uint64_t events = self_stats_events(stats);
+  out_ << "{\"type\": \"" << MessageType::self_stats << "\", \"data\": {";
+  out_ << "\"elapsed_ns\": " << stats.elapsed_ns << ", \"events\": " << events
+       << ", \"events_per_sec\": " << per_sec(events, stats.elapsed_ns)
+       << ", \"handling\": {";
+  bool first = true;
+  for (auto &event : stats.events)
+  {
+    out_ << (first ? "" : ", ") << "\"" << asynceventstr(event.first)
+         << "\": {\"count\": " << event.second.count
+         << ", \"time_ns\": " << event.second.time_ns << "}";
+    first = false;
+  }
+  out_ << "}, \"maps\": {";
+  first = true;
+  for (auto &map : stats.maps)
+  {
+    out_ << (first ? "" : ", ") << "\"" << json_escape(map.first)
+         << "\": {\"count\": " << map.second.count
+         << ", \"time_ns\": " << map.second.time_ns << "}";
+    first = false;
+  }
+  out_ << "}, \"stack_symbols\": {\"kernel\": {\"hits\": " << stats.ksym_hits
+       << ", \"misses\": " << stats.ksym_misses
+       << "}, \"user\": {\"hits\": " << stats.usym_hits
+       << ", \"misses\": " << stats.usym_misses
+       << "}}, \"output_bytes\": " << stats.output_bytes << "}}\n";
+}
+
 void JsonOutput::attached_probes(uint64_t num_probes) const
 {
   message(MessageType::attached_probes, "probes", num_probes);
 }
 
+void JsonOutput::child_run(uint64_t run, int exit_code, int term_signal) const
+{
+  out_ << "{\"type\": \"" << MessageType::child_run << "\", \"data\": {"
+       << "\"run\": " << run << ", \"exit_code\": " << exit_code
+       << ", \"signal\": " << term_signal << "}}\n";
+}
+
 std::string JsonOutput::tuple_to_str(BPFtrace &bpftrace,
                                      const SizedType &ty,
                                      const std::vector<uint8_t> &value) const
@@ -738,9 +1424,429 @@ std::string JsonOutput::tuple_to_str(BPFtrace &bpftrace,
   return ret;
 }
 
+void JsonOutput::map_quantiles(
+    BPFtrace &bpftrace,
+    IMap &map,
+    const std::vector<double> &quantiles,
+    const std::vector<QuantileSummary> &summaries) const
+{
+  if (summaries.empty())
+    return;
+
+  out_ << "{\"type\": \"" << MessageType::quantiles << "\", \"data\": {";
+  out_ << "\"" << json_escape(map.name_) << "\": ";
+  if (map.key_.size() > 0) // check if this map has keys
+    out_ << "{";
+
+  for (size_t i = 0; i < summaries.size(); i++)
+  {
+    auto &summary = summaries[i];
+    std::vector<std::string> args = map.key_.argument_value_list(bpftrace,
+                                                                 summary.key);
+    if (i > 0)
+      out_ << ", ";
+    if (args.size() > 0)
+      out_ << "\"" << json_escape(str_join(args, ",")) << "\": ";
+
+    out_ << "{\"count\": " << summary.count;
+    for (size_t j = 0; j < quantiles.size(); j++)
+      out_ << ", \"" << quantile_label(quantiles[j])
+           << "\": " << summary.values[j];
+    out_ << "}";
+  }
+
+  if (map.key_.size() > 0)
+    out_ << "}";
+  out_ << "}}\n";
+}
+
+void JsonOutput::map_cms(
+    BPFtrace &bpftrace,
+    IMap &map,
+    uint32_t div,
+    const std::vector<std::pair<std::vector<uint8_t>, uint64_t>>
+        &counts_by_key) const
+{
+  if (counts_by_key.empty())
+    return;
+
+  out_ << "{\"type\": \"" << MessageType::map << "\", \"data\": {";
+  out_ << "\"" << json_escape(map.name_) << "\": {";
+  for (size_t i = 0; i < counts_by_key.size(); i++)
+  {
+    auto &pair = counts_by_key[i];
+    std::vector<std::string> args = map.key_.argument_value_list(bpftrace,
+                                                                 pair.first);
+    if (i > 0)
+      out_ << ", ";
+    out_ << "\"" << json_escape(str_join(args, ",")) << "\": "
+         << pair.second / div;
+  }
+  out_ << "}}}\n";
+}
+
 std::string JsonOutput::struct_field_def_to_str(const std::string &field) const
 {
   return "\"" + field + "\": ";
 }
 
+static void put_u8(std::string &out, uint8_t value)
+{
+  out.push_back(static_cast<char>(value));
+}
+
+static void put_u32(std::string &out, uint32_t value)
+{
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void put_str(std::string &out, const std::string &str)
+{
+  put_u32(out, str.size());
+  out += str;
+}
+
+static void put_type(std::string &out, const SizedType &type)
+{
+  put_str(out, typestr(type.type));
+  put_u32(out, type.GetSize());
+  put_u8(out, type.IsSigned());
+}
+
+void BinaryOutput::record(Record kind, const char *data, size_t size) const
+{
+  uint32_t header[2] = { static_cast<uint32_t>(kind),
+                         static_cast<uint32_t>(size) };
+  out_.write(reinterpret_cast<const char *>(header), sizeof(header));
+  out_.write(data, size);
+}
+
+void BinaryOutput::text(MessageType type) const
+{
+  std::string payload;
+  put_str(payload, message_type_name(type));
+  payload += buf_.str();
+  buf_.str("");
+  record(Record::message, payload.data(), payload.size());
+  out_.flush();
+}
+
+void BinaryOutput::header(BPFtrace &bpftrace) const
+{
+  // Magic, version, then 0x01020304 for the byte order
+  std::string magic = "BPFTRBIN";
+  put_u32(magic, VERSION);
+  put_u32(magic, 0x01020304);
+  out_.write(magic.data(), magic.size());
+
+  std::string schema;
+  raw_printf_.clear();
+  put_u32(schema, bpftrace.printf_args_.size());
+  for (auto &printf : bpftrace.printf_args_)
+  {
+    auto &args = std::get<1>(printf);
+    // What the reader can print without this host
+    bool raw = std::all_of(args.begin(), args.end(), [](const Field &arg) {
+      switch (arg.type.type)
+      {
+        case Type::integer:
+        case Type::pointer:
+        case Type::string:
+        case Type::buffer:
+        case Type::inet:
+        case Type::mac_address:
+        case Type::probe:
+          return true;
+        default:
+          return false;
+      }
+    });
+    raw_printf_.push_back(raw);
+
+    put_str(schema, std::get<0>(printf));
+    put_u8(schema, raw);
+    put_u32(schema, args.size());
+    for (auto &arg : args)
+    {
+      put_type(schema, arg.type);
+      put_u32(schema, arg.offset);
+    }
+  }
+
+  put_u32(schema, bpftrace.probe_ids_.size());
+  for (auto &probe_id : bpftrace.probe_ids_)
+    put_str(schema, probe_id);
+
+  size_t nmaps = 0;
+  std::string maps;
+  for (auto &map : bpftrace.maps)
+  {
+    put_str(maps, map->name_);
+    put_u32(maps, map->key_.args_.size());
+    for (auto &key : map->key_.args_)
+      put_type(maps, key);
+    put_type(maps, map->type_);
+    nmaps++;
+  }
+  put_u32(schema, nmaps);
+  schema += maps;
+
+  record(Record::schema, schema.data(), schema.size());
+  out_.flush();
+}
+
+bool BinaryOutput::printf_event(uint64_t printf_id,
+                                const uint8_t *data,
+                                size_t size) const
+{
+  if (printf_id >= raw_printf_.size() || !raw_printf_[printf_id])
+    return false;
+  record(Record::printf, reinterpret_cast<const char *>(data), size);
+  return true;
+}
+
+void BinaryOutput::map(
+    BPFtrace &bpftrace,
+    IMap &map,
+    uint32_t top,
+    uint32_t div,
+    const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+        &values_by_key) const
+{
+  if (map.type_.IsTupleTy())
+  {
+    text_.map(bpftrace, map, top, div, values_by_key);
+    text(MessageType::map);
+    return;
+  }
+
+  // Skipped like by TextOutput::map()
+  size_t skip = top && values_by_key.size() > top ? values_by_key.size() - top
+                                                  : 0;
+  size_t rows = values_by_key.size() - skip;
+  std::string payload;
+  put_str(payload, map.name_);
+  put_u32(payload, rows);
+  put_u32(payload, map.key_.args_.size() + 1);
+
+  // Integers as 64 bits, the rest as map_value_to_str() prints it
+  auto column = [&](const std::string &name,
+                    const SizedType &type,
+                    Column layout,
+                    auto &&get_int,
+                    auto &&append_str) {
+    put_str(payload, name);
+    put_str(payload, typestr(type.type));
+    put_u8(payload, static_cast<uint8_t>(layout));
+    if (layout != Column::str)
+    {
+      for (size_t i = skip; i < values_by_key.size(); i++)
+      {
+        uint64_t value = get_int(values_by_key[i]);
+        payload.append(reinterpret_cast<const char *>(&value), sizeof(value));
+      }
+      return;
+    }
+    std::string bytes;
+    put_u32(payload, 0);
+    for (size_t i = skip; i < values_by_key.size(); i++)
+    {
+      append_str(values_by_key[i], bytes);
+      put_u32(payload, bytes.size());
+    }
+    payload += bytes;
+  };
+
+  auto &args = map.key_.args_;
+  size_t offset = 0;
+  for (size_t k = 0; k < args.size(); k++)
+  {
+    auto &arg = args[k];
+    Column layout = !arg.IsIntTy() ? Column::str
+                    : arg.IsSigned() ? Column::i64
+                                     : Column::u64;
+    column(
+        args.size() == 1 ? "key" : "key" + std::to_string(k),
+        arg,
+        layout,
+        [&](auto &entry) -> uint64_t {
+          auto data = entry.first.data() + offset;
+          switch (arg.GetSize())
+          {
+            case 1:
+              return arg.IsSigned() ? read_data<int8_t>(data)
+                                    : read_data<uint8_t>(data);
+            case 2:
+              return arg.IsSigned() ? read_data<int16_t>(data)
+                                    : read_data<uint16_t>(data);
+            case 4:
+              return arg.IsSigned() ? read_data<int32_t>(data)
+                                    : read_data<uint32_t>(data);
+            default:
+              return read_data<uint64_t>(data);
+          }
+        },
+        [&](auto &entry, std::string &out) {
+          MapKey::append_argument_value(
+              bpftrace, arg, entry.first.data() + offset, out);
+        });
+    offset += arg.GetSize();
+  }
+
+  auto &type = map.type_;
+  Column layout = Column::str;
+  if (type.IsCountTy() || type.IsMaxTy() || type.IsDistinctTy())
+    layout = Column::u64;
+  else if (type.IsMinTy())
+    layout = Column::i64;
+  else if (type.IsSumTy() || type.IsIntTy())
+    layout = type.IsSigned() ? Column::i64 : Column::u64;
+  column(
+      "value",
+      type,
+      layout,
+      [&](auto &entry) {
+        return bpftrace.map_value_to_int(
+            type, entry.second, map.is_per_cpu_type(), div);
+      },
+      [&](auto &entry, std::string &out) {
+        bpftrace.append_map_value(
+            out, type, entry.second, map.is_per_cpu_type(), div, *this);
+      });
+
+  record(Record::map, payload.data(), payload.size());
+  out_.flush();
+}
+
+void BinaryOutput::map_hist(BPFtrace &bpftrace,
+                            IMap &map,
+                            uint32_t top,
+                            uint32_t div,
+                            const HistBuckets &values_by_key,
+                            const std::vector<size_t> &sorted_by_total) const
+{
+  text_.map_hist(bpftrace, map, top, div, values_by_key, sorted_by_total);
+  text(MessageType::hist);
+}
+
+void BinaryOutput::map_stats(
+    BPFtrace &bpftrace,
+    IMap &map,
+    uint32_t top,
+    uint32_t div,
+    const std::map<std::vector<uint8_t>, std::vector<int64_t>> &values_by_key,
+    const std::vector<std::pair<std::vector<uint8_t>, int64_t>>
+        &total_counts_by_key) const
+{
+  text_.map_stats(bpftrace, map, top, div, values_by_key, total_counts_by_key);
+  text(MessageType::stats);
+}
+
+void BinaryOutput::map_quantiles(
+    BPFtrace &bpftrace,
+    IMap &map,
+    const std::vector<double> &quantiles,
+    const std::vector<QuantileSummary> &summaries) const
+{
+  text_.map_quantiles(bpftrace, map, quantiles, summaries);
+  text(MessageType::quantiles);
+}
+
+void BinaryOutput::map_cms(
+    BPFtrace &bpftrace,
+    IMap &map,
+    uint32_t div,
+    const std::vector<std::pair<std::vector<uint8_t>, uint64_t>> &counts_by_key)
+    const
+{
+  text_.map_cms(bpftrace, map, div, counts_by_key);
+  text(MessageType::map);
+}
+
+void BinaryOutput::value(BPFtrace &bpftrace,
+                         const SizedType &ty,
+                         const std::vector<uint8_t> &value) const
+{
+  text_.value(bpftrace, ty, value);
+  text(MessageType::value);
+}
+
+std::string BinaryOutput::struct_field_def_to_str(
+    const std::string &field) const
+{
+  return text_.struct_field_def_to_str(field);
+}
+
+void BinaryOutput::message(MessageType type,
+                           const std::string &msg,
+                           bool nl) const
+{
+  text_.message(type, msg, nl);
+  text(type);
+}
+
+void BinaryOutput::lost_events(uint64_t lost) const
+{
+  text_.lost_events(lost);
+  text(MessageType::lost_events);
+}
+
+void BinaryOutput::repeated_events(uint64_t count) const
+{
+  text_.repeated_events(count);
+  text(MessageType::repeated_events);
+}
+
+void BinaryOutput::event_stats(const EventStats &stats) const
+{
+  text_.event_stats(stats);
+  text(MessageType::event_stats);
+}
+
+void BinaryOutput::probe_stats(
+    const std::map<std::string, ProbeStats> &stats) const
+{
+  text_.probe_stats(stats);
+  text(MessageType::probe_stats);
+}
+
+void BinaryOutput::load_stats(
+    const std::map<std::string, LoadStats> &stats) const
+{
+  text_.load_stats(stats);
+  text(MessageType::load_stats);
+}
+
+void BinaryOutput::probe_estimates(const std::vector<ProbeEstimate> &estimates,
+                                   uint64_t elapsed_ns) const
+{
+  text_.probe_estimates(estimates, elapsed_ns);
+  text(MessageType::probe_estimates);
+}
+
+void BinaryOutput::self_stats(const SelfStats &stats) const
+{
+  text_.self_stats(stats);
+  text(MessageType::self_stats);
+}
+
+void BinaryOutput::probe_counts(
+    const std::vector<std::pair<std::string, uint64_t>> &counts) const
+{
+  text_.probe_counts(counts);
+  text(MessageType::probe_counts);
+}
+
+void BinaryOutput::attached_probes(uint64_t num_probes) const
+{
+  text_.attached_probes(num_probes);
+  text(MessageType::attached_probes);
+}
+
+void BinaryOutput::child_run(uint64_t run, int exit_code, int term_signal) const
+{
+  text_.child_run(run, exit_code, term_signal);
+  text(MessageType::child_run);
+}
+
 } // namespace bpftrace
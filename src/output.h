@@ -3,8 +3,11 @@
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <sstream>
+#include <string_view>
 #include <vector>
 
+#include "hist_buckets.h"
 #include "imap.h"
 
 namespace bpftrace {
@@ -12,7 +15,7 @@ namespace bpftrace {
 enum class MessageType
 {
   // don't forget to update std::ostream& operator<<(std::ostream& out,
-  // MessageType type) in output.cpp
+  // MessageType type) in output.cpp, the binary output writes those names
   map,
   value,
   hist,
@@ -23,11 +26,114 @@ enum class MessageType
   join,
   syscall,
   attached_probes,
-  lost_events
+  lost_events,
+  event_stats,
+  probe_stats,
+  load_stats,
+  quantiles,
+  self_stats,
+  probe_counts,
+  child_run,
+  probe_estimates,
+  repeated_events
 };
 
 std::ostream& operator<<(std::ostream& out, MessageType type);
 
+// Appends str to out escaped as the contents of a JSON string
+void append_json_escaped(std::string &out, std::string_view str);
+
+// Counters of the events received from the kernel, kept by BPFtrace
+struct EventStats
+{
+  struct Reader
+  {
+    std::string name; // e.g. "cpu 3" or "ringbuf"
+    uint64_t received = 0;
+    uint64_t lost = 0;
+  };
+  std::vector<Reader> readers;
+  // Received events by event id (printf_id or AsyncAction)
+  std::map<uint64_t, uint64_t> events;
+  // Occupancy of the stack id maps, when there are any
+  struct StackMap
+  {
+    std::string name; // e.g. "stacks(perf, 127)"
+    uint64_t used = 0;
+    uint64_t max_entries = 0;
+    // Stacks seen printing maps that were dropped by bpf_get_stackid()
+    uint64_t lost = 0;
+  };
+  std::vector<StackMap> stack_maps;
+};
+
+// What bpftrace itself did since the last stats, see BPFTRACE_SELF_STATS
+struct SelfStats
+{
+  struct Handling
+  {
+    uint64_t count = 0;
+    uint64_t time_ns = 0;
+  };
+  uint64_t elapsed_ns = 0;
+  // Events handled by perf_event_printer(), by event id (printf_id or
+  // AsyncAction)
+  std::map<uint64_t, Handling> events;
+  // print_map() calls, by map name
+  std::map<std::string, Handling> maps;
+  // Lookups of the symbols of stack frames in the kernel and user caches
+  uint64_t ksym_hits = 0;
+  uint64_t ksym_misses = 0;
+  uint64_t usym_hits = 0;
+  uint64_t usym_misses = 0;
+  uint64_t output_bytes = 0;
+};
+
+// Kernel accounting of the BPF programs of a probe
+struct ProbeStats
+{
+  uint64_t run_cnt = 0;
+  uint64_t run_time_ns = 0;
+};
+
+// What loading the BPF programs of a probe took, printed with -v
+struct LoadStats
+{
+  uint64_t progs = 0;
+  // Instructions of the programs, and the ones the verifier went through
+  // following every path, as it reports in its log
+  uint64_t insns = 0;
+  uint64_t verified_insns = 0;
+  uint64_t load_time_us = 0;
+
+  LoadStats &operator+=(const LoadStats &other)
+  {
+    progs += other.progs;
+    insns += other.insns;
+    verified_insns += other.verified_insns;
+    load_time_us += other.load_time_us;
+    return *this;
+  }
+};
+
+// Runs of a probe while only they were counted, and the instructions of its
+// actual program, see --estimate
+struct ProbeEstimate
+{
+  std::string name;
+  uint64_t runs = 0;
+  uint64_t insns = 0;
+};
+
+// Quantiles of the histogram of one key, as computed for quantiles()
+struct QuantileSummary
+{
+  std::vector<uint8_t> key;
+  uint64_t count = 0;
+  // One for each of the requested quantiles
+  std::vector<int64_t> values;
+};
+
 class Output
 {
 public:
@@ -41,8 +147,8 @@ public:
   virtual void map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
                    const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key) const = 0;
   virtual void map_hist(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
-                        const std::map<std::vector<uint8_t>, std::vector<uint64_t>> &values_by_key,
-                        const std::vector<std::pair<std::vector<uint8_t>, uint64_t>> &total_counts_by_key) const = 0;
+                        const HistBuckets &values_by_key,
+                        const std::vector<size_t> &sorted_by_total) const = 0;
   virtual void map_stats(
       BPFtrace &bpftrace,
       IMap &map,
@@ -51,6 +157,37 @@ public:
       const std::map<std::vector<uint8_t>, std::vector<int64_t>> &values_by_key,
       const std::vector<std::pair<std::vector<uint8_t>, int64_t>>
           &total_counts_by_key) const = 0;
+  virtual void map_quantiles(
+      BPFtrace &bpftrace,
+      IMap &map,
+      const std::vector<double> &quantiles,
+      const std::vector<QuantileSummary> &summaries) const = 0;
+  // Estimated counts of the keys tracked by a cms_count() map, sorted
+  virtual void map_cms(
+      BPFtrace &bpftrace,
+      IMap &map,
+      uint32_t div,
+      const std::vector<std::pair<std::vector<uint8_t>, uint64_t>>
+          &counts_by_key) const = 0;
+  // Print a map a batch of entries at a time as it's read, unsorted, see
+  // BPFTRACE_STREAM_MAPS: map_begin(), map_entries() for each batch, then
+  // map_end(). False from map_begin() when the format can't be written that
+  // way, for the map to be read whole and printed by map() instead.
+  virtual bool map_begin(IMap &) const
+  {
+    return false;
+  }
+  virtual void map_entries(
+      BPFtrace &,
+      IMap &,
+      uint32_t,
+      const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &) const
+  {
+  }
+  virtual void map_end(IMap &) const
+  {
+  }
   virtual void value(BPFtrace &bpftrace,
                      const SizedType &ty,
                      const std::vector<uint8_t> &value) const = 0;
@@ -60,12 +197,63 @@ public:
 
   virtual void message(MessageType type, const std::string& msg, bool nl = true) const = 0;
   virtual void lost_events(uint64_t lost) const = 0;
+  // The printf() event before it was sent count more times, see
+  // BPFTRACE_DEDUPE_MS
+  virtual void repeated_events(uint64_t count) const = 0;
+  virtual void event_stats(const EventStats &stats) const = 0;
+  virtual void probe_stats(
+      const std::map<std::string, ProbeStats> &stats) const = 0;
+  virtual void load_stats(
+      const std::map<std::string, LoadStats> &stats) const = 0;
+  virtual void self_stats(const SelfStats &stats) const = 0;
+  // Runs of each probe id, see BPFTRACE_PROBE_COUNTS
+  virtual void probe_counts(
+      const std::vector<std::pair<std::string, uint64_t>> &counts) const = 0;
+  // Rates of the probes over elapsed_ns, see --estimate
+  virtual void probe_estimates(const std::vector<ProbeEstimate> &estimates,
+                               uint64_t elapsed_ns) const = 0;
   virtual void attached_probes(uint64_t num_probes) const = 0;
+  // How a run of the command of -c ended, before its maps with --repeat.
+  // exit_code and term_signal are -1 when it didn't exit or wasn't killed.
+  virtual void child_run(uint64_t run, int exit_code, int term_signal) const = 0;
+
+  // Called once the program is loaded, before any of it is printed
+  virtual void header(BPFtrace &bpftrace __attribute__((unused))) const
+  {
+  }
+  // Whether what iter programs write is printed as it is, rather than as a
+  // printf message for each line
+  virtual bool raw_text() const
+  {
+    return false;
+  }
+  // Print the printf() event as read from the perf buffer, returns false
+  // for it to be formatted and passed to message() instead
+  virtual bool printf_event(uint64_t printf_id __attribute__((unused)),
+                            const uint8_t *data __attribute__((unused)),
+                            size_t size __attribute__((unused))) const
+  {
+    return false;
+  }
+
+  // Lines are written without flushing the stream, which is flushed after
+  // each event when line buffered, otherwise after each batch of events and
+  // each map printed
+  bool line_buffered() const
+  {
+    return line_buffered_;
+  }
+  void set_line_buffered(bool line_buffered)
+  {
+    line_buffered_ = line_buffered;
+  }
 
 protected:
   std::ostream &out_;
   std::ostream &err_;
+  bool line_buffered_ = false;
   void hist_prepare(const std::vector<uint64_t> &values, int &min_index, int &max_index, int &max_value) const;
+  static std::string quantile_label(double quantile);
   void lhist_prepare(const std::vector<uint64_t> &values, int min, int max, int step, int &max_index, int &max_value, int &buckets, int &start_value, int &end_value) const;
 };
 
@@ -73,11 +261,16 @@ class TextOutput : public Output {
 public:
   explicit TextOutput(std::ostream& out = std::cout, std::ostream& err = std::cerr) : Output(out, err) { }
 
+  bool raw_text() const override
+  {
+    return true;
+  }
+
   void map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
            const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key) const override;
   void map_hist(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
-                const std::map<std::vector<uint8_t>, std::vector<uint64_t>> &values_by_key,
-                const std::vector<std::pair<std::vector<uint8_t>, uint64_t>> &total_counts_by_key) const override;
+                const HistBuckets &values_by_key,
+                const std::vector<size_t> &sorted_by_total) const override;
   void map_stats(
       BPFtrace &bpftrace,
       IMap &map,
@@ -86,6 +279,24 @@ public:
       const std::map<std::vector<uint8_t>, std::vector<int64_t>> &values_by_key,
       const std::vector<std::pair<std::vector<uint8_t>, int64_t>>
           &total_counts_by_key) const override;
+  void map_quantiles(
+      BPFtrace &bpftrace,
+      IMap &map,
+      const std::vector<double> &quantiles,
+      const std::vector<QuantileSummary> &summaries) const override;
+  void map_cms(BPFtrace &bpftrace,
+               IMap &map,
+               uint32_t div,
+               const std::vector<std::pair<std::vector<uint8_t>, uint64_t>>
+                   &counts_by_key) const override;
+  bool map_begin(IMap &map) const override;
+  void map_entries(
+      BPFtrace &bpftrace,
+      IMap &map,
+      uint32_t div,
+      const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries) const override;
+  void map_end(IMap &map) const override;
   virtual void value(BPFtrace &bpftrace,
                      const SizedType &ty,
                      const std::vector<uint8_t> &value) const override;
@@ -93,18 +304,61 @@ public:
 
   void message(MessageType type, const std::string& msg, bool nl = true) const override;
   void lost_events(uint64_t lost) const override;
+  void repeated_events(uint64_t count) const override;
+  void event_stats(const EventStats &stats) const override;
+  void probe_stats(
+      const std::map<std::string, ProbeStats> &stats) const override;
+  void load_stats(
+      const std::map<std::string, LoadStats> &stats) const override;
+  void self_stats(const SelfStats &stats) const override;
+  void probe_counts(const std::vector<std::pair<std::string, uint64_t>> &counts)
+      const override;
+  void probe_estimates(const std::vector<ProbeEstimate> &estimates,
+                       uint64_t elapsed_ns) const override;
   void attached_probes(uint64_t num_probes) const override;
+  void child_run(uint64_t run, int exit_code, int term_signal) const override;
 
 private:
+  // The line of an entry of map()
+  void map_entry(BPFtrace &bpftrace,
+                 IMap &map,
+                 uint32_t div,
+                 const std::vector<uint8_t> &key,
+                 const std::vector<uint8_t> &value,
+                 std::string &line) const;
   static std::string hist_index_label(int power);
   static std::string lhist_index_label(int number);
+  static std::string llhist_index_label(uint64_t number);
   void hist(const std::vector<uint64_t> &values, uint32_t div) const;
   void lhist(const std::vector<uint64_t> &values, int min, int max, int step) const;
+  void llhist(const std::vector<uint64_t> &values, int sub_buckets) const;
   std::string tuple_to_str(BPFtrace &bpftrace,
                            const SizedType &ty,
                            const std::vector<uint8_t> &value) const;
 };
 
+/**
+   Text output, except that the maps keyed by stacks with count(), sum() or
+   integer values are printed in the folded format flame graphs are made
+   from, one line per key:
+
+     frame1;frame2;... value
+
+   The frames of each stack go outermost first, the key parts in the order
+   they were given, with the parts that aren't stacks as frames too.
+*/
+class FoldedOutput : public TextOutput {
+public:
+  explicit FoldedOutput(std::ostream& out = std::cout, std::ostream& err = std::cerr) : TextOutput(out, err) { }
+
+  void map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
+           const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key) const override;
+  bool map_begin(IMap &) const override
+  {
+    return false;
+  }
+};
+
 class JsonOutput : public Output {
 public:
   explicit JsonOutput(std::ostream& out = std::cout, std::ostream& err = std::cerr) : Output(out, err) { }
@@ -112,8 +366,8 @@ public:
   void map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
            const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key) const override;
   void map_hist(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
-                const std::map<std::vector<uint8_t>, std::vector<uint64_t>> &values_by_key,
-                const std::vector<std::pair<std::vector<uint8_t>, uint64_t>> &total_counts_by_key) const override;
+                const HistBuckets &values_by_key,
+                const std::vector<size_t> &sorted_by_total) const override;
   void map_stats(
       BPFtrace &bpftrace,
       IMap &map,
@@ -122,6 +376,24 @@ public:
       const std::map<std::vector<uint8_t>, std::vector<int64_t>> &values_by_key,
       const std::vector<std::pair<std::vector<uint8_t>, int64_t>>
           &total_counts_by_key) const override;
+  void map_quantiles(
+      BPFtrace &bpftrace,
+      IMap &map,
+      const std::vector<double> &quantiles,
+      const std::vector<QuantileSummary> &summaries) const override;
+  void map_cms(BPFtrace &bpftrace,
+               IMap &map,
+               uint32_t div,
+               const std::vector<std::pair<std::vector<uint8_t>, uint64_t>>
+                   &counts_by_key) const override;
+  bool map_begin(IMap &map) const override;
+  void map_entries(
+      BPFtrace &bpftrace,
+      IMap &map,
+      uint32_t div,
+      const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &entries) const override;
+  void map_end(IMap &map) const override;
   virtual void value(BPFtrace &bpftrace,
                      const SizedType &ty,
                      const std::vector<uint8_t> &value) const override;
@@ -130,19 +402,154 @@ public:
   void message(MessageType type, const std::string& msg, bool nl = true) const override;
   void message(MessageType type, const std::string& field, uint64_t value) const;
   void lost_events(uint64_t lost) const override;
+  void repeated_events(uint64_t count) const override;
+  void event_stats(const EventStats &stats) const override;
+  void probe_stats(
+      const std::map<std::string, ProbeStats> &stats) const override;
+  void load_stats(
+      const std::map<std::string, LoadStats> &stats) const override;
+  void self_stats(const SelfStats &stats) const override;
+  void probe_counts(const std::vector<std::pair<std::string, uint64_t>> &counts)
+      const override;
+  void probe_estimates(const std::vector<ProbeEstimate> &estimates,
+                       uint64_t elapsed_ns) const override;
   void attached_probes(uint64_t num_probes) const override;
+  void child_run(uint64_t run, int exit_code, int term_signal) const override;
 
 private:
   std::string json_escape(const std::string &str) const;
 
+  // The records are put together in buf_ and written at once
+  void append_str(std::string_view str) const;
+  void append_key(BPFtrace &bpftrace,
+                  IMap &map,
+                  const std::vector<uint8_t> &key) const;
+  void begin_record(MessageType type, IMap &map) const;
+  void end_record(IMap &map) const;
+  void flush_record() const;
+  void append_map_entry(BPFtrace &bpftrace,
+                        IMap &map,
+                        uint32_t div,
+                        const std::vector<uint8_t> &key,
+                        const std::vector<uint8_t> &value) const;
+
   void hist(const std::vector<uint64_t> &values, uint32_t div) const;
   void lhist(const std::vector<uint64_t> &values,
              int min,
              int max,
              int step) const;
+  void llhist(const std::vector<uint64_t> &values, int sub_buckets) const;
   std::string tuple_to_str(BPFtrace &bpftrace,
                            const SizedType &ty,
                            const std::vector<uint8_t> &value) const;
+
+  mutable std::string buf_;
+  // Part of a key before it's escaped, reused across the keys
+  mutable std::string arg_;
+  // Entries of the map being streamed written so far, see map_begin()
+  mutable size_t streamed_ = 0;
+};
+
+/**
+   Binary output, for the consumers that would otherwise parse the text, see
+   -f binary.
+
+   A header describing the program (the printf() formats and the types of
+   their arguments, the probe names and the types of the maps) is followed
+   by records: the printf() events as they were read from the perf buffer,
+   the maps print() prints one value per key of, as columns (a column of
+   integers or strings per part of the key and one for the values), and
+   everything else as the text -f text prints. The printf() events with
+   arguments that need resolving on this host (e.g. stacks or symbols) are
+   text records too, as are the maps of tuples.
+
+   Integers are in the byte order of the host. The layout is described in
+   docs/reference_guide.md, scripts/decode_binary_output.py prints the
+   records back as text.
+*/
+class BinaryOutput : public Output {
+public:
+  explicit BinaryOutput(std::ostream& out = std::cout, std::ostream& err = std::cerr)
+      : Output(out, err), text_(buf_, err)
+  {
+  }
+
+  static constexpr uint32_t VERSION = 2;
+  enum class Record : uint32_t
+  {
+    schema = 1,
+    printf = 2,
+    message = 3,
+    map = 4,
+  };
+  // How the values of a column of a map record are written
+  enum class Column : uint8_t
+  {
+    u64 = 0,
+    i64 = 1,
+    // u32 offsets of the rows and of the end, then the bytes
+    str = 2,
+  };
+
+  void map(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
+           const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key) const override;
+  void map_hist(BPFtrace &bpftrace, IMap &map, uint32_t top, uint32_t div,
+                const HistBuckets &values_by_key,
+                const std::vector<size_t> &sorted_by_total) const override;
+  void map_stats(
+      BPFtrace &bpftrace,
+      IMap &map,
+      uint32_t top,
+      uint32_t div,
+      const std::map<std::vector<uint8_t>, std::vector<int64_t>> &values_by_key,
+      const std::vector<std::pair<std::vector<uint8_t>, int64_t>>
+          &total_counts_by_key) const override;
+  void map_quantiles(
+      BPFtrace &bpftrace,
+      IMap &map,
+      const std::vector<double> &quantiles,
+      const std::vector<QuantileSummary> &summaries) const override;
+  void map_cms(BPFtrace &bpftrace,
+               IMap &map,
+               uint32_t div,
+               const std::vector<std::pair<std::vector<uint8_t>, uint64_t>>
+                   &counts_by_key) const override;
+  void value(BPFtrace &bpftrace,
+             const SizedType &ty,
+             const std::vector<uint8_t> &value) const override;
+  std::string struct_field_def_to_str(const std::string &field) const override;
+
+  void message(MessageType type, const std::string& msg, bool nl = true) const override;
+  void lost_events(uint64_t lost) const override;
+  void repeated_events(uint64_t count) const override;
+  void event_stats(const EventStats &stats) const override;
+  void probe_stats(
+      const std::map<std::string, ProbeStats> &stats) const override;
+  void load_stats(
+      const std::map<std::string, LoadStats> &stats) const override;
+  void self_stats(const SelfStats &stats) const override;
+  void probe_counts(const std::vector<std::pair<std::string, uint64_t>> &counts)
+      const override;
+  void probe_estimates(const std::vector<ProbeEstimate> &estimates,
+                       uint64_t elapsed_ns) const override;
+  void attached_probes(uint64_t num_probes) const override;
+  void child_run(uint64_t run, int exit_code, int term_signal) const override;
+
+  void header(BPFtrace &bpftrace) const override;
+  bool printf_event(uint64_t printf_id,
+                    const uint8_t *data,
+                    size_t size) const override;
+
+private:
+  void record(Record kind, const char *data, size_t size) const;
+  // Write what text_ printed as a message record
+  void text(MessageType type) const;
+
+  mutable std::ostringstream buf_;
+  // Renders everything but the printf() events into buf_
+  TextOutput text_;
+  // Whether the events of each printf() are written as they were read
+  mutable std::vector<bool> raw_printf_;
 };
 
 } // namespace bpftrace
@@ -0,0 +1,741 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#include "log.h"
+#include "output_writer.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+// Most of the output to collect before passing it to the writer
+static const size_t CHUNK_SZ = 64 * 1024;
+// Chunks waiting to be written, one writev() takes them all
+static const size_t RING_SZ = IOV_MAX;
+// How often an idle writer checks whether the file is due for rotation
+static const std::chrono::seconds ROTATION_CHECK(1);
+// How often the writer tries to connect to the socket again
+static const std::chrono::seconds SOCKET_RETRY(1);
+
+std::atomic<bool> OutputWriter::rotation_requested_{ false };
+
+/**
+   Streaming compressor appending a single frame to out, blocks are only cut
+   by flush()
+*/
+class Compressor
+{
+public:
+  virtual ~Compressor() = default;
+  virtual bool compress(const char *data,
+                        size_t size,
+                        std::vector<char> &out) = 0;
+  // Write out what was compressed so far, so that it can be decoded
+  virtual bool flush(std::vector<char> &out) = 0;
+  // End the frame
+  virtual bool end(std::vector<char> &out) = 0;
+};
+
+#ifdef HAVE_LIBZSTD
+class ZstdCompressor : public Compressor
+{
+public:
+  ZstdCompressor() : cctx_(ZSTD_createCCtx())
+  {
+  }
+  ~ZstdCompressor() override
+  {
+    ZSTD_freeCCtx(cctx_);
+  }
+
+  bool compress(const char *data, size_t size, std::vector<char> &out) override
+  {
+    return stream(data, size, ZSTD_e_continue, out);
+  }
+  bool flush(std::vector<char> &out) override
+  {
+    return stream(nullptr, 0, ZSTD_e_flush, out);
+  }
+  bool end(std::vector<char> &out) override
+  {
+    return stream(nullptr, 0, ZSTD_e_end, out);
+  }
+
+private:
+  bool stream(const char *data,
+              size_t size,
+              ZSTD_EndDirective mode,
+              std::vector<char> &out)
+  {
+    ZSTD_inBuffer in = { data, size, 0 };
+    while (true)
+    {
+      size_t pos = out.size();
+      out.resize(pos + ZSTD_CStreamOutSize());
+      ZSTD_outBuffer buf = { out.data() + pos, out.size() - pos, 0 };
+      size_t left = ZSTD_compressStream2(cctx_, &buf, &in, mode);
+      out.resize(pos + buf.pos);
+      if (ZSTD_isError(left))
+      {
+        LOG(WARNING) << "zstd: " << ZSTD_getErrorName(left);
+        return false;
+      }
+      // Everything is taken in for ZSTD_e_continue, and written out for the
+      // others once nothing is left
+      if (mode == ZSTD_e_continue ? in.pos == in.size : left == 0)
+        return true;
+    }
+  }
+
+  ZSTD_CCtx *cctx_;
+};
+#endif
+
+#ifdef HAVE_LIBLZ4
+class Lz4Compressor : public Compressor
+{
+public:
+  Lz4Compressor()
+  {
+    prefs_.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    LZ4F_createCompressionContext(&cctx_, LZ4F_VERSION);
+  }
+  ~Lz4Compressor() override
+  {
+    LZ4F_freeCompressionContext(cctx_);
+  }
+
+  bool compress(const char *data, size_t size, std::vector<char> &out) override
+  {
+    if (!begin(out))
+      return false;
+    return check(out,
+                 LZ4F_compressBound(size, &prefs_),
+                 [&](char *dst, size_t capacity) {
+                   return LZ4F_compressUpdate(
+                       cctx_, dst, capacity, data, size, nullptr);
+                 });
+  }
+  bool flush(std::vector<char> &out) override
+  {
+    if (!begin(out))
+      return false;
+    return check(out,
+                 LZ4F_compressBound(0, &prefs_),
+                 [&](char *dst, size_t capacity) {
+                   return LZ4F_flush(cctx_, dst, capacity, nullptr);
+                 });
+  }
+  bool end(std::vector<char> &out) override
+  {
+    if (!begin(out))
+      return false;
+    return check(out,
+                 LZ4F_compressBound(0, &prefs_),
+                 [&](char *dst, size_t capacity) {
+                   return LZ4F_compressEnd(cctx_, dst, capacity, nullptr);
+                 });
+  }
+
+private:
+  // The frame header goes before the first block
+  bool begin(std::vector<char> &out)
+  {
+    if (started_)
+      return true;
+    started_ = true;
+    return check(out, LZ4F_HEADER_SIZE_MAX, [&](char *dst, size_t capacity) {
+      return LZ4F_compressBegin(cctx_, dst, capacity, &prefs_);
+    });
+  }
+
+  template <typename F>
+  bool check(std::vector<char> &out, size_t bound, F op)
+  {
+    size_t pos = out.size();
+    out.resize(pos + bound);
+    size_t written = op(out.data() + pos, bound);
+    if (LZ4F_isError(written))
+    {
+      out.resize(pos);
+      LOG(WARNING) << "lz4: " << LZ4F_getErrorName(written);
+      return false;
+    }
+    out.resize(pos + written);
+    return true;
+  }
+
+  LZ4F_cctx *cctx_ = nullptr;
+  LZ4F_preferences_t prefs_ = {};
+  bool started_ = false;
+};
+#endif
+
+static std::unique_ptr<Compressor> make_compressor(Compression compression)
+{
+  switch (compression)
+  {
+#ifdef HAVE_LIBZSTD
+    case Compression::zstd:
+      return std::make_unique<ZstdCompressor>();
+#endif
+#ifdef HAVE_LIBLZ4
+    case Compression::lz4:
+      return std::make_unique<Lz4Compressor>();
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+bool OutputSocket::parse(const std::string &addr)
+{
+  address = addr;
+  if (addr.rfind("unix:", 0) == 0)
+  {
+    path = addr.substr(5);
+    return !path.empty() && path.size() < sizeof(sockaddr_un::sun_path);
+  }
+  auto colon = addr.rfind(':');
+  if (colon == std::string::npos || colon == 0)
+    return false;
+  host = addr.substr(0, colon);
+  port = addr.substr(colon + 1);
+  // [::1]:9000
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+  return !port.empty() && std::all_of(port.begin(), port.end(), ::isdigit);
+}
+
+bool OutputWriter::supports(Compression compression)
+{
+  return compression == Compression::none ||
+         make_compressor(compression) != nullptr;
+}
+
+OutputWriter::OutputWriter(int fd,
+                           size_t budget,
+                           bool drop,
+                           Compression compression,
+                           const OutputRotation &rotation,
+                           const OutputSocket &socket)
+    : fd_(fd),
+      budget_(budget),
+      drop_(drop),
+      chunk_(std::max<size_t>(std::min(CHUNK_SZ, budget), 1)),
+      ring_(RING_SZ),
+      compressor_(make_compressor(compression)),
+      compression_(compression),
+      rotation_(rotation),
+      file_opened_(std::chrono::steady_clock::now()),
+      socket_(socket)
+{
+  setp(chunk_.data(), chunk_.data() + chunk_.size());
+
+  thread_ = start_thread_without_signals([this]() { work(); });
+}
+
+OutputWriter::~OutputWriter()
+{
+  // Whatever is left is waited for, even when dropping
+  publish(false, true);
+  stop_ = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+  }
+  chunks_cv_.notify_one();
+  thread_.join();
+  if (!rotation_.path.empty() || (!socket_.empty() && fd_ >= 0))
+    close(fd_);
+  if (unsent_)
+    LOG(WARNING) << unsent_ << " bytes of output couldn't be sent to "
+                 << socket_.address;
+
+  if (dropped_)
+    LOG(WARNING) << dropped_ << " bytes of output were dropped as they "
+                 << "couldn't be written fast enough. Consider raising "
+                 << "BPFTRACE_OUTPUT_BUFFER (currently " << budget_ << ").";
+}
+
+OutputWriter::int_type OutputWriter::overflow(int_type ch)
+{
+  publish(drop_);
+  if (traits_type::eq_int_type(ch, traits_type::eof()))
+    return traits_type::not_eof(ch);
+  *pptr() = traits_type::to_char_type(ch);
+  pbump(1);
+  return ch;
+}
+
+std::streamsize OutputWriter::xsputn(const char *s, std::streamsize n)
+{
+  std::streamsize written = std::streambuf::xsputn(s, n);
+  // Don't leave what isn't flushed (e.g. printf() messages) behind while the
+  // writer is idle
+  if (writer_waiting_)
+    publish(drop_);
+  return written;
+}
+
+int OutputWriter::sync()
+{
+  publish(drop_, true);
+  return 0;
+}
+
+bool OutputWriter::has_room(size_t size) const
+{
+  return head_.load() - tail_.load() < RING_SZ &&
+         pending_.load() + size <= budget_;
+}
+
+void OutputWriter::publish(bool drop, bool flushed)
+{
+  size_t size = pptr() - pbase();
+  // A compressed stream still has to be flushed, and the record sent to a
+  // socket ended, when the output was already published, e.g. by xsputn()
+  if (size == 0 &&
+      (!flushed || last_flushed_ || (!compressor_ && socket_.empty())))
+    return;
+  last_flushed_ = flushed;
+  setp(chunk_.data(), chunk_.data() + chunk_.size());
+
+  if (!has_room(size))
+  {
+    if (drop)
+    {
+      dropped_ += size;
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    producer_waiting_ = true;
+    room_cv_.wait(lock, [&]() { return has_room(size); });
+    producer_waiting_ = false;
+  }
+
+  size_t head = head_.load(std::memory_order_relaxed);
+  auto &chunk = ring_[head % RING_SZ];
+  chunk.data.assign(chunk_.data(), chunk_.data() + size);
+  chunk.flushed = flushed;
+  pending_ += size;
+  head_.store(head + 1);
+  // The writer checks head_ again under the mutex before it sleeps, so the
+  // wake up can't be missed
+  if (writer_waiting_)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    chunks_cv_.notify_one();
+  }
+}
+
+void OutputWriter::work()
+{
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  while (true)
+  {
+    maybe_rotate();
+    size_t head = head_.load();
+    if (head == tail)
+    {
+      if (stop_)
+      {
+        if (compressor_ && !failed_)
+        {
+          compressed_.clear();
+          if (compressor_->end(compressed_))
+            write_all(compressed_.data(), compressed_.size());
+        }
+        return;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      writer_waiting_ = true;
+      auto ready = [&]() { return head_.load() != tail || stop_; };
+      // Signal handlers can't wake the writer, it has to check every so often
+      if (rotation_.path.empty())
+        chunks_cv_.wait(lock, ready);
+      else
+        chunks_cv_.wait_for(lock, ROTATION_CHECK, ready);
+      writer_waiting_ = false;
+      continue;
+    }
+
+    write_chunks(tail, head);
+    at_flush_ = ring_[(head - 1) % RING_SZ].flushed;
+
+    // Don't keep more than the budget around in the capacity of the chunks
+    size_t bytes = 0;
+    for (size_t i = tail; i != head; i++)
+    {
+      auto &chunk = ring_[i % RING_SZ].data;
+      bytes += chunk.size();
+      if (chunk.capacity() > budget_ / RING_SZ)
+        std::vector<char>().swap(chunk);
+      else
+        chunk.clear();
+    }
+    pending_ -= bytes;
+    tail = head;
+    tail_.store(tail);
+
+    if (producer_waiting_)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+      }
+      room_cv_.notify_one();
+    }
+  }
+}
+
+void OutputWriter::write_chunks(size_t begin, size_t end)
+{
+  if (!socket_.empty())
+  {
+    send_records(begin, end);
+    return;
+  }
+  if (failed_)
+    return;
+  if (compressor_)
+  {
+    compress_chunks(begin, end);
+    return;
+  }
+
+  std::vector<struct iovec> iov;
+  iov.reserve(end - begin);
+  for (size_t i = begin; i != end; i++)
+  {
+    auto &chunk = ring_[i % RING_SZ].data;
+    iov.push_back({ chunk.data(), chunk.size() });
+  }
+
+  size_t first = 0;
+  while (first < iov.size())
+  {
+    ssize_t written = writev(fd_, &iov[first], iov.size() - first);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      // The rest of the output is discarded, like a std::ofstream would
+      LOG(WARNING) << "Failed to write output: " << strerror(errno);
+      failed_ = true;
+      return;
+    }
+    file_bytes_ += written;
+    // Skip what was written, the last chunk possibly in part
+    size_t left = written;
+    while (first < iov.size() && left >= iov[first].iov_len)
+      left -= iov[first++].iov_len;
+    if (left)
+    {
+      iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + left;
+      iov[first].iov_len -= left;
+    }
+  }
+}
+
+void OutputWriter::send_records(size_t begin, size_t end)
+{
+  records_.clear();
+  // Where each record starts in records_, and where they end
+  std::vector<size_t> starts;
+  for (size_t i = begin; i != end; i++)
+  {
+    auto &chunk = ring_[i % RING_SZ];
+    record_.insert(record_.end(), chunk.data.begin(), chunk.data.end());
+    if (record_.empty() || (!chunk.flushed && record_.size() < budget_))
+      continue;
+    starts.push_back(records_.size());
+    uint32_t size = htonl(record_.size());
+    const char *header = reinterpret_cast<const char *>(&size);
+    records_.insert(records_.end(), header, header + sizeof(size));
+    records_.insert(records_.end(), record_.begin(), record_.end());
+    record_.clear();
+  }
+  starts.push_back(records_.size());
+
+  size_t sent = 0;
+  // The record sent is within, it's sent again whole on a new connection
+  size_t record = 0;
+  while (sent < records_.size())
+  {
+    if (fd_ < 0 && !connect_socket())
+    {
+      if (stop_)
+      {
+        unsent_ += records_.size() - sent;
+        break;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      chunks_cv_.wait_for(lock, SOCKET_RETRY, [&]() { return stop_.load(); });
+      continue;
+    }
+    ssize_t n = send(
+        fd_, records_.data() + sent, records_.size() - sent, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      // Timed out on a peer not reading, it's waited for until bpftrace
+      // stops
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (!stop_)
+          continue;
+        unsent_ += records_.size() - sent;
+        break;
+      }
+      LOG(WARNING) << "Lost the connection to the output socket "
+                   << socket_.address << ": " << strerror(errno);
+      close(fd_);
+      fd_ = -1;
+      sent = starts[record];
+      continue;
+    }
+    sent += n;
+    while (record + 1 < starts.size() && starts[record + 1] <= sent)
+      record++;
+  }
+  if (records_.capacity() > budget_)
+    std::vector<char>().swap(records_);
+}
+
+bool OutputWriter::connect_socket()
+{
+  int fd = -1;
+  std::string error;
+  if (!socket_.path.empty())
+  {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_.path.c_str(), sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 &&
+        connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)))
+    {
+      error = strerror(errno);
+      close(fd);
+      fd = -1;
+    }
+  }
+  else
+  {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    struct addrinfo *res;
+    int err = getaddrinfo(
+        socket_.host.c_str(), socket_.port.c_str(), &hints, &res);
+    if (err)
+      error = gai_strerror(err);
+    for (struct addrinfo *ai = err ? nullptr : res; ai && fd < 0;
+         ai = ai->ai_next)
+    {
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0);
+      if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen))
+      {
+        error = strerror(errno);
+        close(fd);
+        fd = -1;
+      }
+    }
+    if (!err)
+      freeaddrinfo(res);
+    // The records are already batched
+    int one = 1;
+    if (fd >= 0)
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (fd < 0)
+  {
+    if (error.empty())
+      error = strerror(errno);
+    if (!connect_warned_)
+      LOG(WARNING) << "Failed to connect to the output socket "
+                   << socket_.address << ": " << error
+                   << ", retrying every second";
+    connect_warned_ = true;
+    return false;
+  }
+
+  // So that a peer not reading doesn't hold the writer up once stopped
+  struct timeval timeout = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  connect_warned_ = false;
+  fd_ = fd;
+  return true;
+}
+
+void OutputWriter::compress_chunks(size_t begin, size_t end)
+{
+  compressed_.clear();
+  bool ok = true;
+  for (size_t i = begin; ok && i != end; i++)
+  {
+    auto &chunk = ring_[i % RING_SZ].data;
+    ok = compressor_->compress(chunk.data(), chunk.size(), compressed_);
+  }
+  if (ok && ring_[(end - 1) % RING_SZ].flushed)
+    ok = compressor_->flush(compressed_);
+  if (!ok)
+  {
+    LOG(WARNING) << "Failed to compress output";
+    failed_ = true;
+    return;
+  }
+
+  write_all(compressed_.data(), compressed_.size());
+  if (compressed_.capacity() > budget_)
+    std::vector<char>().swap(compressed_);
+}
+
+void OutputWriter::write_all(const char *data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t written = write(fd_, data, size);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      LOG(WARNING) << "Failed to write output: " << strerror(errno);
+      failed_ = true;
+      return;
+    }
+    file_bytes_ += written;
+    data += written;
+    size -= written;
+  }
+}
+
+void OutputWriter::maybe_rotate()
+{
+  if (rotation_.path.empty() || !at_flush_)
+    return;
+
+  bool requested = rotation_requested_.exchange(false);
+  bool due = requested || (rotation_.size && file_bytes_ >= rotation_.size);
+  if (!due && rotation_.interval &&
+      std::chrono::steady_clock::now() - file_opened_ >=
+          std::chrono::seconds(rotation_.interval))
+  {
+    // Empty files aren't kept, the time starts again instead
+    if (file_bytes_)
+      due = true;
+    else
+      file_opened_ = std::chrono::steady_clock::now();
+  }
+  if (due)
+    rotate(requested);
+}
+
+void OutputWriter::rotate(bool requested)
+{
+  const char *path = rotation_.path.c_str();
+  if (compressor_ && !failed_)
+  {
+    compressed_.clear();
+    if (compressor_->end(compressed_))
+      write_all(compressed_.data(), compressed_.size());
+  }
+
+  // On request, the file may already have been moved away, e.g. by
+  // logrotate, it's then only reopened
+  struct stat path_st, fd_st;
+  bool moved = requested &&
+               (stat(path, &path_st) != 0 || fstat(fd_, &fd_st) != 0 ||
+                path_st.st_dev != fd_st.st_dev ||
+                path_st.st_ino != fd_st.st_ino);
+  bool reopen = true;
+  if (!moved)
+  {
+    // Files of earlier runs aren't overwritten
+    std::string rotated;
+    do
+      rotated = rotation_.path + "." + std::to_string(++rotated_);
+    while (access(rotated.c_str(), F_OK) == 0);
+    if (rename(path, rotated.c_str()) != 0)
+    {
+      LOG(WARNING) << "Failed to rotate output file \"" << rotation_.path
+                   << "\": " << strerror(errno);
+      reopen = false;
+    }
+  }
+
+  // The output otherwise keeps going to the old file
+  int fd = -1;
+  if (reopen &&
+      (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+    LOG(WARNING) << "Failed to reopen output file \"" << rotation_.path
+                 << "\": " << strerror(errno);
+  if (fd >= 0)
+  {
+    close(fd_);
+    fd_ = fd;
+    failed_ = false;
+  }
+  compressor_ = make_compressor(compression_);
+  file_bytes_ = 0;
+  file_opened_ = std::chrono::steady_clock::now();
+}
+
+CountingBuf::CountingBuf(std::streambuf *dest)
+    : dest_(dest), buf_(CHUNK_SZ)
+{
+  setp(buf_.data(), buf_.data() + buf_.size());
+}
+
+CountingBuf::~CountingBuf()
+{
+  sync();
+}
+
+bool CountingBuf::pass()
+{
+  std::streamsize n = pptr() - pbase();
+  bytes_ += n;
+  setp(buf_.data(), buf_.data() + buf_.size());
+  return dest_->sputn(buf_.data(), n) == n;
+}
+
+CountingBuf::int_type CountingBuf::overflow(int_type ch)
+{
+  if (!pass())
+    return traits_type::eof();
+  if (traits_type::eq_int_type(ch, traits_type::eof()))
+    return traits_type::not_eof(ch);
+  *pptr() = traits_type::to_char_type(ch);
+  pbump(1);
+  return ch;
+}
+
+int CountingBuf::sync()
+{
+  bool passed = pass();
+  return dest_->pubsync() == 0 && passed ? 0 : -1;
+}
+
+} // namespace bpftrace
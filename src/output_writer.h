@@ -0,0 +1,227 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bpftrace {
+
+enum class Compression
+{
+  none,
+  zstd,
+  lz4,
+};
+
+class Compressor;
+
+// When the writer starts a new output file, see BPFTRACE_OUTPUT_ROTATE_SIZE
+struct OutputRotation
+{
+  // File the output is written to, no rotation without it
+  std::string path;
+  // Bytes written to a file before it's rotated, 0 for no limit
+  uint64_t size = 0;
+  // Seconds before a file that was written to is rotated, 0 for no limit
+  uint64_t interval = 0;
+};
+
+/**
+   Socket the writer sends the output to rather than to a file, see
+   --output-socket. The output goes as records, each what was written
+   between two flushes of the producer (whole events, or at most the budget)
+   preceded by its size in 4 bytes, in network order.
+*/
+struct OutputSocket
+{
+  // "unix:PATH" or "HOST:PORT", false when it's neither
+  bool parse(const std::string &address);
+  bool empty() const
+  {
+    return path.empty() && port.empty();
+  }
+
+  // As given, for the messages
+  std::string address;
+  // Of a unix socket
+  std::string path;
+  std::string host;
+  std::string port;
+};
+
+/**
+   Stream buffer writing the output from a thread of its own, so that a slow
+   disk or consumer doesn't hold up the reading of the events, see
+   BPFTRACE_OUTPUT_BUFFER.
+
+   What is written to the stream is collected into chunks, passed to the
+   writer thread on each flush (e.g. std::endl), when the chunk is full or
+   when the writer has nothing else to do.
+   The chunks go through a single producer, single consumer ring, and the
+   writer writes all the ones that are queued with a single writev().
+
+   At most budget bytes wait to be written. When there's no room for a
+   chunk, it either waits for the writer or is dropped, as set by drop.
+
+   With compression, the writer compresses the chunks into a single frame,
+   flushed whenever the last chunk it writes was flushed by the producer, so
+   that a file cut short can be decoded up to the last complete event.
+
+   With a rotation path, the writer moves the file to the first free
+   "path.N" and reopens path when the file gets too big or too old, or on
+   request_rotation(). Files are only rotated where the producer flushed, so
+   that events aren't split across files, and each compressed file is a
+   frame of its own. The writer then owns fd, which it closes.
+
+   With a socket, fd isn't used. The writer connects to the socket, sends
+   all the records of the queued chunks at once, and connects again every
+   second while the connection is lost, as the queue fills up. A record cut
+   short by the lost connection is sent again whole. What is left once the
+   writer is stopped while it can't connect is dropped.
+*/
+class OutputWriter : public std::streambuf
+{
+public:
+  OutputWriter(int fd,
+               size_t budget,
+               bool drop,
+               Compression compression = Compression::none,
+               const OutputRotation &rotation = {},
+               const OutputSocket &socket = {});
+  ~OutputWriter() override;
+
+  // Whether bpftrace was built with the library for compression
+  static bool supports(Compression compression);
+  // Have the file rotated soon, safe to call from a signal handler (SIGHUP),
+  // a file moved away (e.g. by logrotate) is only reopened
+  static void request_rotation()
+  {
+    rotation_requested_ = true;
+  }
+
+  OutputWriter(const OutputWriter &) = delete;
+  OutputWriter &operator=(const OutputWriter &) = delete;
+
+  // Bytes of output dropped so far
+  uint64_t dropped() const
+  {
+    return dropped_;
+  }
+
+protected:
+  int_type overflow(int_type ch) override;
+  std::streamsize xsputn(const char *s, std::streamsize n) override;
+  int sync() override;
+
+private:
+  struct Chunk
+  {
+    std::vector<char> data;
+    // Whether it ends where the producer flushed
+    bool flushed = false;
+  };
+
+  // Queue the chunk in the put area for the writer
+  void publish(bool drop, bool flushed = false);
+  bool has_room(size_t size) const;
+  void work();
+  void write_chunks(size_t begin, size_t end);
+  void compress_chunks(size_t begin, size_t end);
+  void write_all(const char *data, size_t size);
+  void maybe_rotate();
+  void rotate(bool requested);
+  void send_records(size_t begin, size_t end);
+  bool connect_socket();
+
+  int fd_;
+  size_t budget_;
+  bool drop_;
+  uint64_t dropped_ = 0;
+  // Put area, only touched by the producer
+  std::vector<char> chunk_;
+  bool last_flushed_ = true;
+
+  // Chunks from tail_ to head_ belong to the writer, the others to the
+  // producer
+  std::vector<Chunk> ring_;
+  std::atomic<size_t> head_{ 0 };
+  std::atomic<size_t> tail_{ 0 };
+  // Bytes in the queued chunks
+  std::atomic<size_t> pending_{ 0 };
+
+  // Only used by either thread to sleep, when it has nothing to do
+  std::mutex mutex_;
+  std::condition_variable chunks_cv_;
+  std::condition_variable room_cv_;
+  std::atomic<bool> writer_waiting_{ false };
+  std::atomic<bool> producer_waiting_{ false };
+  std::atomic<bool> stop_{ false };
+  bool failed_ = false;
+  // Only used by the writer
+  std::unique_ptr<Compressor> compressor_;
+  std::vector<char> compressed_;
+  Compression compression_;
+  OutputRotation rotation_;
+  // Bytes written to the current file, and when it was opened
+  uint64_t file_bytes_ = 0;
+  std::chrono::steady_clock::time_point file_opened_;
+  // Whether the last chunk written was flushed, so that a rotation doesn't
+  // split an event
+  bool at_flush_ = true;
+  // Last N of "path.N" in use
+  uint64_t rotated_ = 0;
+  static std::atomic<bool> rotation_requested_;
+  OutputSocket socket_;
+  // The output since the producer last flushed, waiting for the rest of its
+  // record
+  std::vector<char> record_;
+  std::vector<char> records_;
+  // Bytes of records that were never sent
+  uint64_t unsent_ = 0;
+  // Whether it was told that the socket can't be connected to
+  bool connect_warned_ = false;
+  std::thread thread_;
+};
+
+/**
+   Stream buffer counting the bytes written through it to dest, for
+   BPFTRACE_SELF_STATS. They're collected in a buffer of its own, passed on
+   to dest when it's full or flushed, so that counting costs a copy rather
+   than a call for every character.
+*/
+class CountingBuf : public std::streambuf
+{
+public:
+  explicit CountingBuf(std::streambuf *dest);
+  ~CountingBuf() override;
+
+  CountingBuf(const CountingBuf &) = delete;
+  CountingBuf &operator=(const CountingBuf &) = delete;
+
+  // Bytes written so far
+  uint64_t bytes() const
+  {
+    return bytes_ + (pptr() - pbase());
+  }
+
+protected:
+  int_type overflow(int_type ch) override;
+  int sync() override;
+
+private:
+  // Pass the buffer on to dest
+  bool pass();
+
+  std::streambuf *dest_;
+  std::vector<char> buf_;
+  uint64_t bytes_ = 0;
+};
+
+} // namespace bpftrace
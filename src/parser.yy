@@ -116,6 +116,7 @@ void yyerror(bpftrace::Driver &driver, const char *s);
 
 %type <std::string> c_definitions
 %type <ast::ProbeList *> probes
+%type <ast::MapDeclList *> map_decls
 %type <ast::Probe *> probe
 %type <ast::Predicate *> pred
 %type <ast::Ternary *> ternary
@@ -154,9 +155,13 @@ void yyerror(bpftrace::Driver &driver, const char *s);
 
 %%
 
-program : c_definitions probes { driver.root_ = new ast::Program($1, $2); }
+program : c_definitions map_decls probes { driver.root_ = new ast::Program($1, $2, $3); }
         ;
 
+map_decls : map_decls MAP "=" IDENT "(" INT ")" ";" { $$ = $1; $1->emplace_back($2, $4, $6, @2 + @7); }
+          |                                         { $$ = new ast::MapDeclList; }
+          ;
+
 c_definitions : CPREPROC c_definitions    { $$ = $1 + "\n" + $2; }
               | STRUCT_DEFN c_definitions { $$ = $1 + ";\n" + $2; }
               | ENUM c_definitions        { $$ = $1 + ";\n" + $2; }
@@ -267,6 +272,7 @@ jump_stmt  : BREAK    { $$ = new ast::Jump(token::BREAK, @$); }
 loop_stmt  : UNROLL "(" int ")" block             { $$ = new ast::Unroll($3, $5, @1 + @4); }
            | UNROLL "(" param ")" block           { $$ = new ast::Unroll($3, $5, @1 + @4); }
            | WHILE  "(" expr ")" block            { $$ = new ast::While($3, $5, @1); }
+           | FOR    "(" var ":" MAP ")" block     { $$ = new ast::For($3, new ast::Map($5, @5), $7, @1); }
            ;
 
 if_stmt : IF "(" expr ")" block                  { $$ = new ast::If($3, $5); }
@@ -0,0 +1,300 @@
+#include <algorithm>
+#include <bcc/perf_reader.h>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <queue>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "bpftrace.h"
+#include "log.h"
+#include "perf_consumers.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+void perf_event_enqueue(void *cb_cookie, void *data, int size)
+{
+  auto reader = static_cast<PerfConsumers::Reader *>(cb_cookie);
+  auto &batch = reader->shard->local;
+  size_t offset = batch.data.size();
+  batch.data.insert(batch.data.end(),
+                    static_cast<uint8_t *>(data),
+                    static_cast<uint8_t *>(data) + size);
+  batch.records.push_back({ monotonic_ns(),
+                            reader->idx,
+                            0,
+                            offset,
+                            static_cast<size_t>(size) });
+}
+
+void perf_event_lost_enqueue(void *cb_cookie, uint64_t lost)
+{
+  auto reader = static_cast<PerfConsumers::Reader *>(cb_cookie);
+  reader->shard->local.records.push_back(
+      { monotonic_ns(), reader->idx, lost, 0, 0 });
+}
+
+PerfConsumers::PerfConsumers(BPFtrace &bpftrace,
+                             unsigned int nthreads,
+                             const std::vector<std::vector<int>> &nodes)
+    : bpftrace_(bpftrace)
+{
+  // A node without a thread of its own would have its buffers read remotely
+  // anyway
+  if (nodes.size() > 1 && nthreads >= nodes.size())
+    nodes_ = nodes;
+  for (unsigned int i = 0; i < nthreads; i++)
+  {
+    auto shard = std::make_unique<Shard>();
+    if (!nodes_.empty())
+      shard->cpus = nodes_[i % nodes_.size()];
+    shard->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->epollfd == -1)
+      throw std::runtime_error("Failed to create epollfd: " +
+                               std::string(strerror(errno)));
+    shards_.emplace_back(std::move(shard));
+  }
+  taken_.resize(nthreads);
+}
+
+PerfConsumers::~PerfConsumers()
+{
+  stop();
+  for (auto &shard : shards_)
+    close(shard->epollfd);
+}
+
+// The shards of a node take its CPUs in turn, so that a CPU coming back
+// online is read by the same shard as before
+PerfConsumers::Shard &PerfConsumers::shard_of(unsigned int idx, int cpu)
+{
+  for (size_t node = 0; node < nodes_.size(); node++)
+  {
+    auto &cpus = nodes_[node];
+    auto found = std::find(cpus.begin(), cpus.end(), cpu);
+    if (found == cpus.end())
+      continue;
+    size_t node_shards = (shards_.size() - node + nodes_.size() - 1) /
+                         nodes_.size();
+    size_t nth = (found - cpus.begin()) % node_shards;
+    return *shards_[node + nth * nodes_.size()];
+  }
+  return *shards_[idx % shards_.size()];
+}
+
+void *PerfConsumers::cookie(unsigned int idx, int cpu)
+{
+  Shard &shard = shard_of(idx, cpu);
+  if (idx >= reader_shards_.size())
+    reader_shards_.resize(idx + 1);
+  reader_shards_[idx] = &shard;
+  readers_.emplace_back(std::make_unique<Reader>(Reader{ &shard, idx }));
+  return readers_.back().get();
+}
+
+int PerfConsumers::add_reader(unsigned int idx, void *reader, int reader_fd)
+{
+  auto &shard = *reader_shards_.at(idx);
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = reader;
+  if (epoll_ctl(shard.epollfd, EPOLL_CTL_ADD, reader_fd, &ev) == -1)
+    return -1;
+  shard.readers.push_back(reader);
+  return 0;
+}
+
+void PerfConsumers::remove_reader(unsigned int idx, void *reader, int reader_fd)
+{
+  auto &shard = *reader_shards_.at(idx);
+  perf_reader_event_read(static_cast<perf_reader *>(reader));
+  if (!shard.local.empty())
+    publish(shard);
+  epoll_ctl(shard.epollfd, EPOLL_CTL_DEL, reader_fd, nullptr);
+  shard.readers.erase(
+      std::remove(shard.readers.begin(), shard.readers.end(), reader),
+      shard.readers.end());
+}
+
+void PerfConsumers::start()
+{
+  stop_ = false;
+  for (auto &shard : shards_)
+  {
+    if (shard->readers.empty())
+      continue;
+    Shard *s = shard.get();
+    shard->thread = start_thread_without_signals([this, s]() { consume(*s); });
+    if (shard->cpus.empty())
+      continue;
+    // The batches are then allocated on the node as well
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : shard->cpus)
+      CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(
+        shard->thread.native_handle(), sizeof(set), &set);
+    if (err)
+      LOG(WARNING) << "Failed to bind a perf consumer thread to its NUMA "
+                      "node: "
+                   << strerror(err);
+  }
+  started_ = true;
+}
+
+void PerfConsumers::stop()
+{
+  if (!started_)
+    return;
+
+  stop_ = true;
+  for (auto &shard : shards_)
+  {
+    if (shard->thread.joinable())
+      shard->thread.join();
+  }
+  started_ = false;
+}
+
+void PerfConsumers::consume(Shard &shard)
+{
+  auto events = std::vector<struct epoll_event>(shard.readers.size());
+  while (!stop_)
+  {
+    int ready = epoll_wait(
+        shard.epollfd, events.data(), shard.readers.size(), 100);
+    if (ready < 0 && errno != EINTR)
+    {
+      LOG(ERROR) << "perf consumer: epoll_wait failed: " << strerror(errno);
+      return;
+    }
+
+    if (ready == 0)
+    {
+      // Buffers opened with a wakeup watermark can hold events without being
+      // reported as ready
+      for (auto reader : shard.readers)
+        perf_reader_event_read(static_cast<perf_reader *>(reader));
+    }
+
+    for (int i = 0; i < ready; i++)
+      perf_reader_event_read(static_cast<perf_reader *>(events[i].data.ptr));
+
+    if (!shard.local.empty())
+      publish(shard);
+  }
+}
+
+void PerfConsumers::publish(Shard &shard)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &pending = shard.pending;
+    if (pending.empty())
+    {
+      std::swap(pending, shard.local);
+    }
+    else
+    {
+      size_t base = pending.data.size();
+      pending.data.insert(pending.data.end(),
+                          shard.local.data.begin(),
+                          shard.local.data.end());
+      for (auto record : shard.local.records)
+      {
+        record.offset += base;
+        pending.records.push_back(record);
+      }
+    }
+  }
+  shard.local.clear();
+  cv_.notify_one();
+}
+
+size_t PerfConsumers::dispatch(int timeout_ms)
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto has_pending = [this]() {
+      for (auto &shard : shards_)
+      {
+        if (!shard->pending.empty())
+          return true;
+      }
+      return false;
+    };
+    cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), has_pending);
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      taken_[i].clear();
+      std::swap(taken_[i], shards_[i]->pending);
+    }
+  }
+
+  // Records of a single shard are already in timestamp order, merge the
+  // shards by always picking the oldest head record.
+  using Head = std::pair<uint64_t, size_t>; // (timestamp, shard)
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  std::vector<size_t> pos(taken_.size(), 0);
+  for (size_t i = 0; i < taken_.size(); i++)
+  {
+    if (!taken_[i].empty())
+      heads.push({ taken_[i].records[0].timestamp, i });
+  }
+
+  size_t dispatched = 0;
+  while (!heads.empty())
+  {
+    size_t i = heads.top().second;
+    heads.pop();
+
+    auto &batch = taken_[i];
+    auto &record = batch.records[pos[i]];
+    auto &stats = bpftrace_.event_stats_.readers[record.reader];
+    if (record.lost)
+    {
+      stats.lost += record.lost;
+      perf_event_lost(&bpftrace_, record.lost);
+    }
+    else
+    {
+      stats.received++;
+      perf_event_printer(&bpftrace_,
+                         batch.data.data() + record.offset,
+                         record.size);
+    }
+    dispatched++;
+
+    if (++pos[i] < batch.records.size())
+      heads.push({ batch.records[pos[i]].timestamp, i });
+  }
+
+  return dispatched;
+}
+
+size_t PerfConsumers::drain()
+{
+  stop();
+
+  for (auto &shard : shards_)
+  {
+    for (auto reader : shard->readers)
+      perf_reader_event_read(static_cast<perf_reader *>(reader));
+    if (!shard->local.empty())
+      publish(*shard);
+  }
+
+  return dispatch(0);
+}
+
+} // namespace bpftrace
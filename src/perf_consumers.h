@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bpftrace {
+
+class BPFtrace;
+
+/**
+   Drains per-CPU perf buffers from a pool of consumer threads.
+
+   The perf readers are sharded across the threads, each thread copies the
+   events it reads into a batch stamped with the time they were read. The
+   thread calling dispatch() merges the batches of all shards back into
+   timestamp order and hands the events to perf_event_printer(), so event
+   decoding and everything touching Output stays single threaded.
+
+   With at least as many threads as NUMA nodes, the threads are spread over
+   the nodes and bound to their CPUs, and a perf buffer is read by a thread
+   of the node of its CPU. The kernel places the pages of a perf buffer on
+   that node too, so the events don't cross the interconnect until they are
+   dispatched.
+*/
+class PerfConsumers
+{
+public:
+  // nodes are the CPUs of each NUMA node, see get_numa_nodes()
+  PerfConsumers(BPFtrace &bpftrace,
+                unsigned int nthreads,
+                const std::vector<std::vector<int>> &nodes = {});
+  ~PerfConsumers();
+
+  PerfConsumers(const PerfConsumers &) = delete;
+  PerfConsumers &operator=(const PerfConsumers &) = delete;
+  PerfConsumers(PerfConsumers &&) = delete;
+  PerfConsumers &operator=(PerfConsumers &&) = delete;
+
+  /**
+     Cookie to open the perf buffer of the idx-th CPU, cpu, with, to be used
+     together with perf_event_enqueue() and perf_event_lost_enqueue(). Its
+     events are accounted to BPFtrace::event_stats_.readers[idx].
+  */
+  void *cookie(unsigned int idx, int cpu);
+
+  /**
+     Register the reader opened with cookie(idx) with the matching consumer
+  */
+  int add_reader(unsigned int idx, void *reader, int reader_fd);
+
+  /**
+     Read what is left in the reader added with add_reader(idx, ...) and stop
+     consuming it, for its CPU going offline. The threads must be stopped.
+  */
+  void remove_reader(unsigned int idx, void *reader, int reader_fd);
+
+  /**
+     Start the consumer threads, the readers must all be added before
+  */
+  void start();
+
+  /**
+     Stop and join the consumer threads
+  */
+  void stop();
+
+  /**
+     Wait up to timeout_ms for events and pass all the pending events to
+     perf_event_printer() in the order they were read.
+
+     Returns the number of events (including lost event records) dispatched
+  */
+  size_t dispatch(int timeout_ms);
+
+  /**
+     Stop the consumer threads, then read whatever is left in the perf buffers
+     (including events below the wakeup watermark) and dispatch it.
+  */
+  size_t drain();
+
+  struct Record
+  {
+    uint64_t timestamp;
+    size_t reader;
+    uint64_t lost;
+    size_t offset;
+    size_t size;
+  };
+
+  struct Batch
+  {
+    std::vector<uint8_t> data;
+    std::vector<Record> records;
+
+    void clear()
+    {
+      data.clear();
+      records.clear();
+    }
+    bool empty() const
+    {
+      return records.empty();
+    }
+  };
+
+  struct Shard
+  {
+    int epollfd = -1;
+    std::vector<void *> readers;
+    // Only touched by the consumer thread
+    Batch local;
+    // Protected by PerfConsumers::mutex_
+    Batch pending;
+    std::thread thread;
+    // The CPUs of the NUMA node the thread is bound to, any CPU if empty
+    std::vector<int> cpus;
+  };
+
+  struct Reader
+  {
+    Shard *shard;
+    size_t idx;
+  };
+
+private:
+  Shard &shard_of(unsigned int idx, int cpu);
+  void consume(Shard &shard);
+  void publish(Shard &shard);
+
+  BPFtrace &bpftrace_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<std::unique_ptr<Reader>> readers_;
+  // The shard of each reader, by its idx
+  std::vector<Shard *> reader_shards_;
+  // Set when the shards are spread over the NUMA nodes: shard i is bound to
+  // node i % nodes_.size()
+  std::vector<std::vector<int>> nodes_;
+  // Batches taken from the shards by dispatch(), kept around to reuse their
+  // capacity
+  std::vector<Batch> taken_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> stop_{ false };
+  bool started_ = false;
+};
+
+// perf_reader callbacks used with PerfConsumers::cookie()
+void perf_event_enqueue(void *cb_cookie, void *data, int size);
+void perf_event_lost_enqueue(void *cb_cookie, uint64_t lost);
+
+} // namespace bpftrace
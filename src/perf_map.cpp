@@ -0,0 +1,156 @@
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "perf_map.h"
+
+namespace bpftrace {
+
+namespace {
+
+// How long a lookup that hits trusts the symbols already read
+const auto PERF_MAP_REFRESH_INTERVAL = std::chrono::seconds(1);
+
+// pid as seen from inside its own pid namespace, the one the runtime names the
+// file after
+int ns_pid(int pid)
+{
+  std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(status, line))
+  {
+    if (line.compare(0, 6, "NSpid:") != 0)
+      continue;
+    // The innermost namespace comes last
+    std::istringstream fields(line.substr(6));
+    int nspid = pid;
+    int n;
+    while (fields >> n)
+      nspid = n;
+    return nspid;
+  }
+  return pid;
+}
+
+bool parse_hex(const char *&pos, const char *end, uint64_t &n)
+{
+  if (end - pos > 2 && pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'X'))
+    pos += 2;
+  auto res = std::from_chars(pos, end, n, 16);
+  if (res.ec != std::errc() || res.ptr == pos)
+    return false;
+  pos = res.ptr;
+  return true;
+}
+
+} // namespace
+
+std::string PerfMap::path(int pid)
+{
+  return "/proc/" + std::to_string(pid) + "/root/tmp/perf-" +
+         std::to_string(ns_pid(pid)) + ".map";
+}
+
+bool PerfMap::lookup(uint64_t addr, std::string &name, uint64_t &offset)
+{
+  if (std::chrono::steady_clock::now() - checked_ < PERF_MAP_REFRESH_INTERVAL &&
+      find(addr, name, offset))
+    return true;
+  update();
+  return find(addr, name, offset);
+}
+
+void PerfMap::update()
+{
+  checked_ = std::chrono::steady_clock::now();
+  struct stat st;
+  // Keep the symbols of a process that's gone, its last events can still
+  // need them
+  if (::stat(path_.c_str(), &st) != 0)
+    return;
+  if (st.st_dev != dev_ || st.st_ino != ino_ || st.st_size < pos_)
+  {
+    reset();
+    dev_ = st.st_dev;
+    ino_ = st.st_ino;
+  }
+  if (st.st_size == pos_)
+    return;
+
+  int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  char buf[64 * 1024];
+  ssize_t n;
+  while ((n = ::pread(fd, buf, sizeof(buf), pos_)) > 0)
+  {
+    parse(buf, n);
+    pos_ += n;
+  }
+  ::close(fd);
+}
+
+void PerfMap::parse(const char *data, size_t size)
+{
+  const char *end = data + size;
+  while (data < end)
+  {
+    auto eol = static_cast<const char *>(memchr(data, '\n', end - data));
+    if (!eol)
+    {
+      partial_.append(data, end - data);
+      return;
+    }
+    if (partial_.empty())
+    {
+      parse_line(data, eol - data);
+    }
+    else
+    {
+      partial_.append(data, eol - data);
+      parse_line(partial_.data(), partial_.size());
+      partial_.clear();
+    }
+    data = eol + 1;
+  }
+}
+
+void PerfMap::parse_line(const char *line, size_t size)
+{
+  const char *pos = line;
+  const char *end = line + size;
+  if (end > pos && end[-1] == '\r')
+    end--;
+
+  uint64_t start, len;
+  if (!parse_hex(pos, end, start) || pos == end || *pos++ != ' ' ||
+      !parse_hex(pos, end, len) || pos == end || *pos++ != ' ' || len == 0)
+    return;
+  symbols_[start] = Symbol{ start + len, std::string(pos, end) };
+}
+
+bool PerfMap::find(uint64_t addr, std::string &name, uint64_t &offset) const
+{
+  auto it = symbols_.upper_bound(addr);
+  if (it == symbols_.begin())
+    return false;
+  --it;
+  if (addr >= it->second.end)
+    return false;
+  name = it->second.name;
+  offset = addr - it->first;
+  return true;
+}
+
+void PerfMap::reset()
+{
+  symbols_.clear();
+  partial_.clear();
+  pos_ = 0;
+}
+
+} // namespace bpftrace
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+namespace bpftrace {
+
+/**
+   Symbols of JIT compiled code, read from the /tmp/perf-<pid>.map file the
+   runtime (e.g. the JVM with perf-map-agent, node --perf-basic-prof) writes
+   them to. One symbol per line:
+
+     <start> <size> <name>
+
+   with start and size in hex. JITs only ever append to the file, so it is
+   tailed: each update reads just the lines added since the previous one.
+   Later lines win over earlier ones starting at the same address, code
+   memory gets reused.
+*/
+class PerfMap
+{
+public:
+  explicit PerfMap(std::string path) : path_(std::move(path))
+  {
+  }
+
+  /**
+     Path of the perf map of pid, inside its mount namespace
+  */
+  static std::string path(int pid);
+
+  /**
+     Looks up the symbol containing addr, reading what was appended to the
+     file first when addr isn't known yet or the last read is getting old
+  */
+  bool lookup(uint64_t addr, std::string &name, uint64_t &offset);
+
+  /**
+     Reads whatever was appended to the file since the last call. Starts over
+     when the file was replaced or truncated.
+  */
+  void update();
+
+  /**
+     Parses perf map data, a trailing partial line is kept until the rest of
+     it comes in
+  */
+  void parse(const char *data, size_t size);
+
+  const std::string &path() const
+  {
+    return path_;
+  }
+
+  size_t size() const
+  {
+    return symbols_.size();
+  }
+
+private:
+  struct Symbol
+  {
+    uint64_t end;
+    std::string name;
+  };
+  bool find(uint64_t addr, std::string &name, uint64_t &offset) const;
+  void parse_line(const char *line, size_t size);
+  void reset();
+
+  std::string path_;
+  dev_t dev_ = 0;
+  ino_t ino_ = 0;
+  off_t pos_ = 0;
+  std::string partial_;
+  std::chrono::steady_clock::time_point checked_;
+  // By start address
+  std::map<uint64_t, Symbol> symbols_;
+};
+
+} // namespace bpftrace
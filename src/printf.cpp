@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
 #include <regex>
 
+#include "log.h"
 #include "printf.h"
 #include "printf_format_types.h"
 #include "struct.h"
@@ -38,7 +42,7 @@ std::string verify_format_string(const std::string &fmt, std::vector<Field> args
         arg_type == Type::probe || arg_type == Type::username ||
         arg_type == Type::kstack || arg_type == Type::ustack ||
         arg_type == Type::inet || arg_type == Type::timestamp ||
-        arg_type == Type::mac_address)
+        arg_type == Type::mac_address || arg_type == Type::cgroup_path)
       arg_type = Type::string; // Symbols should be printed as strings
     if (arg_type == Type::pointer)
       arg_type = Type::integer; // Casts (pointers) can be printed as integers
@@ -70,6 +74,163 @@ std::string verify_format_string(const std::string &fmt, std::vector<Field> args
   return "";
 }
 
+namespace {
+
+// Room left for snprintf() at the end of the output if it has less
+const size_t MIN_SNPRINTF_SZ = 64;
+
+// Append what print(buf, size) writes with snprintf() to out
+template <typename F>
+void append_snprintf(std::string &out, F print)
+{
+  auto check_snprintf_ret = [](int r) {
+    if (r < 0)
+    {
+      LOG(FATAL) << "format() error occurred: " << std::strerror(errno);
+    }
+  };
+  size_t pos = out.size();
+  size_t avail = std::max(out.capacity() - pos, MIN_SNPRINTF_SZ);
+  // The string keeps room for the terminating null byte past its end
+  out.resize(pos + avail);
+  int r = print(&out[pos], avail + 1);
+  check_snprintf_ret(r);
+  if (static_cast<size_t>(r) > avail)
+  {
+    out.resize(pos + r);
+    r = print(&out[pos], r + 1);
+    check_snprintf_ret(r);
+  }
+  // Like %s, the message stops at a null byte (e.g. printed with %c)
+  out.resize(pos + strnlen(&out[pos], r));
+}
+
+} // namespace
+
+FormatPlan::FormatPlan(const std::string &fmt)
+{
+  auto tokens_begin = std::sregex_iterator(fmt.begin(),
+                                           fmt.end(),
+                                           format_specifier_re);
+  auto tokens_end = std::sregex_iterator();
+
+  size_t literal_text_pos = 0;
+  for (auto token = tokens_begin; token != tokens_end; ++token)
+  {
+    Arg arg;
+    arg.literal = fmt.substr(literal_text_pos,
+                             token->position() - literal_text_pos);
+    arg.spec = token->str();
+    // Args have been made safe for printing by now, so replace nonstandard
+    // format specifiers with %s
+    if (arg.spec.back() == 'r')
+      arg.spec.back() = 's';
+
+    // Only the specifiers without a width or a precision are rendered here
+    arg.conv = Conv::other;
+    arg.bits = 32;
+    const std::string length = arg.spec.substr(1, arg.spec.size() - 2);
+    char conv = arg.spec.back();
+    if (length == "hh")
+      arg.bits = 8;
+    else if (length == "h")
+      arg.bits = 16;
+    else if (length == "l" || length == "ll" || length == "j" ||
+             length == "z" || length == "t")
+      arg.bits = 64;
+    else if (!length.empty())
+      conv = '\0';
+    if (conv == 's' && length.empty())
+      arg.conv = Conv::str;
+    else if (conv == 'd')
+      arg.conv = Conv::dec;
+    else if (conv == 'u')
+      arg.conv = Conv::udec;
+    else if (conv == 'x')
+      arg.conv = Conv::hex;
+    else if (conv == 'X')
+      arg.conv = Conv::uhex;
+
+    args_.push_back(std::move(arg));
+    literal_text_pos = token->position() + token->length();
+  }
+  tail_ = fmt.substr(literal_text_pos);
+}
+
+void FormatPlan::append_int(std::string &out, size_t i, uint64_t value) const
+{
+  const Arg &arg = args_.at(i);
+  // Truncated to the length modifier, as printf() does
+  uint64_t mask = arg.bits == 64 ? ~0ULL : (1ULL << arg.bits) - 1;
+  char buf[24];
+  std::to_chars_result r;
+  switch (arg.conv)
+  {
+    case Conv::dec:
+    {
+      int64_t sval = value & mask;
+      if (arg.bits < 64 && (sval >> (arg.bits - 1)))
+        sval -= static_cast<int64_t>(1ULL << arg.bits);
+      r = std::to_chars(buf, buf + sizeof(buf), sval);
+      break;
+    }
+    case Conv::udec:
+      r = std::to_chars(buf, buf + sizeof(buf), value & mask);
+      break;
+    case Conv::hex:
+    case Conv::uhex:
+      r = std::to_chars(buf, buf + sizeof(buf), value & mask, 16);
+      if (arg.conv == Conv::uhex)
+        std::transform(buf, r.ptr, buf, ::toupper);
+      break;
+    default:
+      append_snprintf(out, [&](char *buf, size_t size) {
+        return snprintf(buf, size, arg.spec.c_str(), value);
+      });
+      return;
+  }
+  out.append(buf, r.ptr);
+}
+
+void FormatPlan::append_str(std::string &out,
+                            size_t i,
+                            std::string_view value) const
+{
+  const Arg &arg = args_.at(i);
+  // %s stops at the first null byte
+  value = value.substr(0, value.find('\0'));
+  if (arg.conv == Conv::str)
+  {
+    out.append(value);
+    return;
+  }
+  std::string str(value);
+  append_snprintf(out, [&](char *buf, size_t size) {
+    return snprintf(buf, size, arg.spec.c_str(), str.c_str());
+  });
+}
+
+void FormatPlan::append(std::string &out, size_t i, IPrintable &value) const
+{
+  const Arg &arg = args_.at(i);
+  append_snprintf(out, [&](char *buf, size_t size) {
+    return value.print(buf, size, arg.spec.c_str());
+  });
+}
+
+std::string FormatPlan::render(
+    std::vector<std::unique_ptr<IPrintable>> &args) const
+{
+  std::string out;
+  for (size_t i = 0; i < args_.size(); i++)
+  {
+    out += args_[i].literal;
+    append(out, i, *args.at(i));
+  }
+  out += tail_;
+  return out;
+}
+
 int PrintableString::print(char *buf, size_t size, const char *fmt)
 {
   return snprintf(buf, size, fmt, value_.c_str());
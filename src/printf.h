@@ -1,6 +1,10 @@
 #pragma once
 
+#include <memory>
+#include <regex>
 #include <sstream>
+#include <string_view>
+#include <vector>
 
 #include "ast.h"
 #include "printf_format_types.h"
@@ -76,4 +80,61 @@ private:
   int64_t value_;
 };
 
+/**
+   printf() format string split into its literal text and the specifiers of
+   its arguments, so that events are formatted without parsing it again.
+
+   The plain integer and %s specifiers are rendered directly, the ones with
+   a width or a precision still go through snprintf().
+*/
+class FormatPlan
+{
+public:
+  explicit FormatPlan(const std::string &fmt);
+
+  size_t size() const
+  {
+    return args_.size();
+  }
+  // Text ahead of argument i
+  const std::string &literal(size_t i) const
+  {
+    return args_[i].literal;
+  }
+  // Text after the last argument
+  const std::string &tail() const
+  {
+    return tail_;
+  }
+
+  // Append argument i to out, value holds the bits of the integer
+  void append_int(std::string &out, size_t i, uint64_t value) const;
+  void append_str(std::string &out, size_t i, std::string_view value) const;
+  void append(std::string &out, size_t i, IPrintable &value) const;
+
+  std::string render(std::vector<std::unique_ptr<IPrintable>> &args) const;
+
+private:
+  enum class Conv
+  {
+    str,
+    dec,
+    udec,
+    hex,
+    uhex,
+    other,
+  };
+  struct Arg
+  {
+    std::string literal;
+    std::string spec;
+    Conv conv;
+    // Integer width of the length modifier
+    int bits;
+  };
+
+  std::vector<Arg> args_;
+  std::string tail_;
+};
+
 } // namespace bpftrace
@@ -1,9 +1,13 @@
+#include <algorithm>
+#include <atomic>
 #include <dirent.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <regex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include "bpftrace.h"
@@ -13,8 +17,6 @@
 
 #include <bcc/bcc_syms.h>
 
-#include <llvm/Demangle/Demangle.h>
-
 #ifdef HAVE_BCC_ELF_FOREACH_SYM
 #include <bcc/bcc_elf.h>
 #include <linux/elf.h>
@@ -34,6 +36,40 @@ static int add_symbol(const char* symname,
 }
 #endif
 
+const ProbeListItem* hardware_event(const std::string& event)
+{
+  for (auto& item : HW_PROBE_LIST)
+  {
+    if (event == item.path || (!item.alias.empty() && event == item.alias))
+      return &item;
+  }
+  return nullptr;
+}
+
+std::vector<std::string> hardware_events(const std::string& target)
+{
+  return split_string(target, '+');
+}
+
+int hardware_event_index(const std::string& target, const std::string& event)
+{
+  auto item = hardware_event(event);
+  if (!item)
+    return -1;
+  auto events = hardware_events(target);
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    if (hardware_event(events[i]) == item)
+      return i;
+  }
+  return -1;
+}
+
+uint32_t counter_cpus()
+{
+  return get_possible_cpus().back() + 1;
+}
+
 /*
  * Splits input string by '*' delimiter and return the individual parts.
  * Sets start_wildcard and end_wildcard if input starts or ends with '*'.
@@ -54,23 +90,23 @@ std::vector<std::string> get_tokens(const std::string& input,
 }
 
 /*
- * Finds all matches of search_input in the provided input stream.
+ * Reads the candidate matches from the provided input stream.
  *
  * If `ignore_trailing_module` is true, will ignore trailing kernel module.
  * For example, `[ehci_hcd]` will be ignored in:
  *     ehci_disable_ASE [ehci_hcd]
  */
-std::set<std::string> ProbeMatcher::get_matches_in_stream(
-    const std::string& search_input,
-    bool ignore_trailing_module,
+ProbeMatcher::SymbolList ProbeMatcher::read_symbol_list(
     std::istream& symbol_stream,
-    const char delim)
+    bool ignore_trailing_module,
+    const char delim) const
 {
-  bool start_wildcard, end_wildcard;
-  auto tokens = get_tokens(search_input, start_wildcard, end_wildcard);
+  DemangleCache local_cache;
+  DemangleCache& demangle_cache = bpftrace_ ? bpftrace_->demangle_cache_
+                                            : local_cache;
 
+  SymbolList list;
   std::string line;
-  std::set<std::string> matches;
   while (std::getline(symbol_stream, line, delim))
   {
     if (ignore_trailing_module && !line.empty() && line[line.size() - 1] == ']')
@@ -79,41 +115,76 @@ std::set<std::string> ProbeMatcher::get_matches_in_stream(
         line = line.substr(0, idx);
     }
 
-    if (!wildcard_match(line, tokens, start_wildcard, end_wildcard))
-    {
-      auto fun_line = line;
-      auto prefix = fun_line.find(':') != std::string::npos
-                        ? erase_prefix(fun_line) + ":"
-                        : "";
-      if (symbol_has_cpp_mangled_signature(fun_line))
-      {
-        char* demangled_name = llvm::itaniumDemangle(
-            fun_line.c_str(), nullptr, nullptr, nullptr);
-        if (demangled_name)
-        {
-          if (!wildcard_match(prefix + demangled_name, tokens, true, true))
-          {
-            free(demangled_name);
-          }
-          else
-          {
-            free(demangled_name);
-            goto out;
-          }
-        }
-      }
-      continue;
-    }
-  out:
     // skip the ".part.N" kprobe variants, as they can't be traced:
     if (line.find(".part.") != std::string::npos)
       continue;
 
-    matches.insert(line);
+    auto fun_line = line;
+    auto prefix = fun_line.find(':') != std::string::npos
+                      ? erase_prefix(fun_line) + ":"
+                      : "";
+    const std::string* demangled_name = demangle_cache.demangle(fun_line);
+    if (demangled_name)
+      list.mangled.emplace_back(line, prefix + *demangled_name);
+
+    list.symbols.push_back(std::move(line));
+  }
+  std::sort(list.symbols.begin(), list.symbols.end());
+  list.symbols.erase(std::unique(list.symbols.begin(), list.symbols.end()),
+                     list.symbols.end());
+  return list;
+}
+
+/*
+ * Finds all matches of search_input in the provided symbol list.
+ */
+std::set<std::string> ProbeMatcher::get_matches_in_list(
+    const std::string& search_input,
+    const SymbolList& list) const
+{
+  bool start_wildcard = false, end_wildcard = false;
+  auto tokens = get_tokens(search_input, start_wildcard, end_wildcard);
+  if (tokens.empty() && !start_wildcard)
+    return {};
+
+  // Only the symbols starting with the literal prefix of the search input
+  // can match it as they are
+  std::string prefix = start_wildcard ? "" : tokens[0];
+  auto it = std::lower_bound(list.symbols.begin(),
+                             list.symbols.end(),
+                             prefix);
+
+  std::set<std::string> matches;
+  for (; it != list.symbols.end() && it->compare(0, prefix.size(), prefix) == 0;
+       ++it)
+  {
+    if (wildcard_match(*it, tokens, start_wildcard, end_wildcard))
+      matches.insert(*it);
+  }
+
+  // while C++ symbols may match through their demangled name
+  for (auto& [line, demangled] : list.mangled)
+  {
+    if (wildcard_match(demangled, tokens, true, true))
+      matches.insert(line);
   }
   return matches;
 }
 
+/*
+ * Finds all matches of search_input in the provided input stream.
+ */
+std::set<std::string> ProbeMatcher::get_matches_in_stream(
+    const std::string& search_input,
+    bool ignore_trailing_module,
+    std::istream& symbol_stream,
+    const char delim)
+{
+  return get_matches_in_list(
+      search_input,
+      read_symbol_list(symbol_stream, ignore_trailing_module, delim));
+}
+
 std::unique_ptr<std::istream> ProbeMatcher::get_iter_symbols(void) const
 {
   return std::make_unique<std::istringstream>("task\ntask_file");
@@ -123,28 +194,90 @@ std::unique_ptr<std::istream> ProbeMatcher::get_iter_symbols(void) const
  * Get matches of search_input (containing a wildcard) for a given probe_type.
  * probe_type determines where to take the candidate matches from.
  * Some probe types (e.g. uprobe) require target to be specified.
+ *
+ * The candidates are read once per probe type and target, and the matches
+ * are remembered, as each wildcard attach point is matched by several passes.
  */
 std::set<std::string> ProbeMatcher::get_matches_for_probetype(
     const ProbeType& probe_type,
     const std::string& target,
     const std::string& search_input)
 {
-  std::unique_ptr<std::istream> symbol_stream;
-  bool ignore_trailing_module = false;
+  ProbeType source = symbol_source(probe_type);
+  auto key = std::make_tuple(source, target, search_input);
+  auto found = matches_.find(key);
+  if (found != matches_.end())
+    return found->second;
+
+  auto matches = get_matches_in_list(search_input,
+                                     get_symbol_list(source, target));
+  matches_.emplace(std::move(key), matches);
+  return matches;
+}
 
+/*
+ * Probe types whose candidate matches are taken from the same place are
+ * mapped to one of them.
+ */
+ProbeType ProbeMatcher::symbol_source(const ProbeType& probe_type)
+{
   switch (probe_type)
   {
-    case ProbeType::kprobe:
     case ProbeType::kretprobe:
+      return ProbeType::kprobe;
+    case ProbeType::uretprobe:
+    case ProbeType::watchpoint:
+    case ProbeType::asyncwatchpoint:
+      return ProbeType::uprobe;
+    case ProbeType::kretfunc:
+      return ProbeType::kfunc;
+    case ProbeType::rawtracepoint:
+      return ProbeType::tracepoint;
+    default:
+      return probe_type;
+  }
+}
+
+const ProbeMatcher::SymbolList& ProbeMatcher::get_symbol_list(
+    const ProbeType& source,
+    const std::string& target)
+{
+  auto key = std::make_pair(source, target);
+  auto found = symbol_lists_.find(key);
+  if (found != symbol_lists_.end())
+    return found->second;
+
+  if (auto pending = pending_lists_.find(source);
+      pending != pending_lists_.end() && target.empty())
+  {
+    auto future = std::move(pending->second);
+    pending_lists_.erase(pending);
+    return symbol_lists_.emplace(std::move(key), future.get()).first->second;
+  }
+
+  bool ignore_trailing_module = false;
+  auto symbol_stream = get_symbol_stream(source, target, ignore_trailing_module);
+  SymbolList list;
+  if (symbol_stream)
+    list = read_symbol_list(*symbol_stream, ignore_trailing_module);
+  return symbol_lists_.emplace(std::move(key), std::move(list)).first->second;
+}
+
+std::unique_ptr<std::istream> ProbeMatcher::get_symbol_stream(
+    const ProbeType& source,
+    const std::string& target,
+    bool& ignore_trailing_module)
+{
+  std::unique_ptr<std::istream> symbol_stream;
+  switch (source)
+  {
+    case ProbeType::kprobe:
     {
       symbol_stream = get_symbols_from_file(kprobe_path);
       ignore_trailing_module = true;
       break;
     }
     case ProbeType::uprobe:
-    case ProbeType::uretprobe:
-    case ProbeType::watchpoint:
-    case ProbeType::asyncwatchpoint:
     {
       symbol_stream = get_func_symbols_from_file(target);
       break;
@@ -170,9 +303,8 @@ std::set<std::string> ProbeMatcher::get_matches_for_probetype(
       break;
     }
     case ProbeType::kfunc:
-    case ProbeType::kretfunc:
     {
-      symbol_stream = bpftrace_->btf_.get_all_funcs();
+      symbol_stream = bpftrace_->btf_.get_all_funcs(target);
       break;
     }
     case ProbeType::iter:
@@ -181,15 +313,25 @@ std::set<std::string> ProbeMatcher::get_matches_for_probetype(
       break;
     }
     default:
-      return {};
+      break;
   }
+  return symbol_stream;
+}
 
-  if (symbol_stream)
-    return get_matches_in_stream(search_input,
-                                 ignore_trailing_module,
-                                 *symbol_stream);
-  else
-    return {};
+void ProbeMatcher::prefetch_symbol_list(const ProbeType& source)
+{
+  // Read only from files, which is safe to do from another thread
+  if ((source != ProbeType::kprobe && source != ProbeType::tracepoint) ||
+      symbol_lists_.count(std::make_pair(source, std::string())) ||
+      pending_lists_.count(source))
+    return;
+
+  auto read = [this, source]() {
+    bool ignore_trailing_module = false;
+    auto symbol_stream = get_symbol_stream(source, "", ignore_trailing_module);
+    return read_symbol_list(*symbol_stream, ignore_trailing_module);
+  };
+  pending_lists_.emplace(source, std::async(std::launch::async, read));
 }
 
 /*
@@ -245,6 +387,19 @@ std::unique_ptr<std::istream> ProbeMatcher::get_func_symbols_from_file(
   for (auto& real_path : real_paths)
   {
     std::set<std::string> syms;
+    const SymbolIndex* index = nullptr;
+    if (bpftrace_ && bpftrace_->symbol_cache_)
+      index = bpftrace_->symbol_cache_->index(real_path);
+    if (!index)
+      index = SymbolIndex::shared(real_path);
+    if (index)
+    {
+      for (auto& sym : *index)
+        syms.insert(index->name(sym));
+      for (auto& sym : syms)
+        result += real_path + ":" + sym + "\n";
+      continue;
+    }
 #ifdef HAVE_BCC_ELF_FOREACH_SYM
     // Workaround: bcc_elf_foreach_sym() can return the same symbol twice if
     // it's also found in debug info (#1138), so a std::set is used here (and in
@@ -361,41 +516,78 @@ std::unique_ptr<std::istream> ProbeMatcher::userspace_probe_list()
   return std::make_unique<std::istringstream>(probes);
 }
 
+// Format files read by a thread of get_tracepoints_params()
+const size_t TRACEPOINT_FORMATS_PER_THREAD = 64;
+
 FuncParamLists ProbeMatcher::get_tracepoints_params(
     const std::set<std::string>& tracepoints)
 {
-  FuncParamLists params;
+  // Hundreds of format files, each of them slow to read from tracefs, are
+  // read by several threads
+  std::vector<const std::string*> names;
   for (auto& tracepoint : tracepoints)
-  {
-    auto event = tracepoint;
-    auto category = erase_prefix(event);
+    names.push_back(&tracepoint);
+  std::vector<std::vector<std::string>> fields(names.size());
+  // Not a vector<bool>, its elements are set by different threads
+  std::vector<char> found(names.size(), false);
+
+  std::atomic<size_t> next = 0;
+  auto read = [&]() {
+    for (size_t n = next++; n < names.size(); n = next++)
+    {
+      auto event = *names[n];
+      auto category = erase_prefix(event);
 
-    std::string format_file_path = tp_path + "/" + category + "/" + event +
-                                   "/format";
-    std::ifstream format_file(format_file_path.c_str());
-    std::string line;
+      std::string format_file_path = tp_path + "/" + category + "/" + event +
+                                     "/format";
+      std::ifstream format_file(format_file_path.c_str());
+      std::string line;
 
-    if (format_file.fail())
-    {
-      LOG(ERROR) << "tracepoint format file not found: " << format_file_path;
-      return {};
-    }
+      if (format_file.fail())
+        continue;
+      found[n] = true;
 
-    // Skip lines until the first empty line
-    do
-    {
-      getline(format_file, line);
-    } while (line.length() > 0);
+      // Skip lines until the first empty line
+      do
+      {
+        getline(format_file, line);
+      } while (line.length() > 0);
 
-    while (getline(format_file, line))
-    {
-      if (line.find("\tfield:") == 0)
+      while (getline(format_file, line))
       {
-        size_t col_pos = line.find(':') + 1;
-        params[tracepoint].push_back(
-            line.substr(col_pos, line.find(';') - col_pos));
+        if (line.find("\tfield:") == 0)
+        {
+          size_t col_pos = line.find(':') + 1;
+          fields[n].push_back(line.substr(col_pos, line.find(';') - col_pos));
+        }
       }
     }
+  };
+
+  size_t threads = std::min<size_t>(
+      get_online_cpus().size(),
+      (names.size() + TRACEPOINT_FORMATS_PER_THREAD - 1) /
+          TRACEPOINT_FORMATS_PER_THREAD);
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i)
+    workers.emplace_back(read);
+  read();
+  for (auto& worker : workers)
+    worker.join();
+
+  FuncParamLists params;
+  for (size_t n = 0; n < names.size(); n++)
+  {
+    if (!found[n])
+    {
+      auto event = *names[n];
+      auto category = erase_prefix(event);
+      LOG(ERROR) << "tracepoint format file not found: "
+                 << tp_path + "/" + category + "/" + event + "/format";
+      return {};
+    }
+    if (!fields[n].empty())
+      params[*names[n]] = std::move(fields[n]);
   }
   return params;
 }
@@ -422,8 +614,21 @@ FuncParamLists ProbeMatcher::get_iters_params(
   return params;
 }
 
+void ProbeMatcher::prefetch_probes(ast::Program* prog)
+{
+  for (auto* probe : *prog->probes)
+  {
+    for (auto* ap : *probe->attach_points)
+      prefetch_symbol_list(symbol_source(probetype(ap->provider)));
+  }
+}
+
 void ProbeMatcher::list_probes(ast::Program* prog)
 {
+  // The kernel's functions and tracepoints are read while the probe types
+  // listed ahead of them are
+  prefetch_probes(prog);
+
   for (auto* probe : *prog->probes)
   {
     for (auto* ap : *probe->attach_points)
@@ -437,20 +642,30 @@ void ProbeMatcher::list_probes(ast::Program* prog)
           param_lists = get_tracepoints_params(matches);
         else if (probe_type == ProbeType::kfunc ||
                  probe_type == ProbeType::kretfunc)
-          param_lists = bpftrace_->btf_.get_params(matches);
+          param_lists = bpftrace_->btf_.get_params(matches, ap->target);
         else if (probe_type == ProbeType::iter)
           param_lists = get_iters_params(matches);
       }
 
+      // The functions of a module are listed with it
+      std::string module;
+      if ((probe_type == ProbeType::kfunc ||
+           probe_type == ProbeType::kretfunc) &&
+          !ap->target.empty())
+        module = ap->target + ":";
+
       for (auto& match : matches)
       {
-        std::cout << probetypeName(probe_type) << ":" << match << std::endl;
+        std::cout << probetypeName(probe_type) << ":" << module << match
+                  << "\n";
         if (bt_verbose)
         {
           for (auto& param : param_lists[match])
-            std::cout << "    " << param << std::endl;
+            std::cout << "    " << param << "\n";
         }
       }
+      // Each probe type is printed as soon as it's matched
+      std::cout.flush();
     }
   }
 }
@@ -475,6 +690,7 @@ std::set<std::string> ProbeMatcher::get_matches_for_ap(
     case ProbeType::watchpoint:
     case ProbeType::asyncwatchpoint:
     case ProbeType::tracepoint:
+    case ProbeType::rawtracepoint:
     case ProbeType::hardware:
     case ProbeType::software:
     {
@@ -530,6 +746,14 @@ std::set<std::string> ProbeMatcher::expand_probetype_userspace(
     return { probe_type };
 }
 
+void ProbeMatcher::prefetch_kernel_symbols()
+{
+  prefetch_symbol_list(ProbeType::kprobe);
+  prefetch_symbol_list(ProbeType::tracepoint);
+  get_symbol_list(ProbeType::kprobe, "");
+  get_symbol_list(ProbeType::tracepoint, "");
+}
+
 void ProbeMatcher::list_structs(const std::string& search)
 {
   auto structs = bpftrace_->btf_.get_all_structs();
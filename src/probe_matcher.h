@@ -2,8 +2,12 @@
 
 #include "ast.h"
 
+#include <future>
+#include <map>
 #include <set>
 #include <sstream>
+#include <tuple>
+#include <vector>
 
 #include <linux/perf_event.h>
 
@@ -51,6 +55,19 @@ const std::vector<ProbeListItem> HW_PROBE_LIST = {
 };
 // clang-format on
 
+// The item of HW_PROBE_LIST event is the name or the alias of, nullptr if
+// it isn't a hardware event
+const ProbeListItem *hardware_event(const std::string &event);
+// The events counted by a hardware probe, e.g. "cycles+instructions" for a
+// group of them. The first one is the leader of the group, which samples.
+std::vector<std::string> hardware_events(const std::string &target);
+// Index of event among the events of a hardware probe, -1 if it's none of
+// them
+int hardware_event_index(const std::string &target, const std::string &event);
+// The counters map has a slot per CPU number for each event of the groups,
+// see counter()
+uint32_t counter_cpus();
+
 class BPFtrace;
 
 typedef std::map<std::string, std::vector<std::string>> FuncParamLists;
@@ -83,10 +100,48 @@ public:
    * Print definitions of structures matching search.
    */
   void list_structs(const std::string &search);
+  /*
+   * Read the kernel's functions and tracepoints ahead of matching them,
+   * for --daemon to share them with the programs it runs.
+   */
+  void prefetch_kernel_symbols();
+  /*
+   * Start reading the kernel's functions and tracepoints the probes of prog
+   * are matched against, while the rest of prog is parsed.
+   */
+  void prefetch_probes(ast::Program *prog);
 
   const BPFtrace *bpftrace_;
 
 private:
+  /*
+   * Candidate matches of a probe type, sorted so that search inputs not
+   * starting with a wildcard only look at the ones having their prefix.
+   */
+  struct SymbolList
+  {
+    std::vector<std::string> symbols;
+    // C++ mangled symbols, with the demangled name they can be matched by
+    std::vector<std::pair<std::string, std::string>> mangled;
+  };
+
+  SymbolList read_symbol_list(std::istream &symbol_stream,
+                              bool ignore_trailing_module,
+                              const char delim = '\n') const;
+  std::set<std::string> get_matches_in_list(const std::string &search_input,
+                                            const SymbolList &list) const;
+  static ProbeType symbol_source(const ProbeType &probe_type);
+  const SymbolList &get_symbol_list(const ProbeType &source,
+                                    const std::string &target);
+  std::unique_ptr<std::istream> get_symbol_stream(const ProbeType &source,
+                                                  const std::string &target,
+                                                  bool &ignore_trailing_module);
+  /*
+   * Start reading the kernel's functions or tracepoints on another thread,
+   * for get_symbol_list() to wait for. Other sources are read when asked for.
+   */
+  void prefetch_symbol_list(const ProbeType &source);
+
   std::set<std::string> get_matches_in_stream(const std::string &search_input,
                                               bool ignore_trailing_module,
                                               std::istream &symbol_stream,
@@ -117,5 +172,14 @@ private:
       const std::set<std::string> &tracepoints);
 
   FuncParamLists get_iters_params(const std::set<std::string> &iters);
+
+  // Keyed by the probe type the candidates are taken from and the target
+  std::map<std::pair<ProbeType, std::string>, SymbolList> symbol_lists_;
+  // The ones prefetch_symbol_list() is reading
+  std::map<ProbeType, std::future<SymbolList>> pending_lists_;
+  // Keyed by the same and the search input
+  std::map<std::tuple<ProbeType, std::string, std::string>,
+           std::set<std::string>>
+      matches_;
 };
 } // namespace bpftrace
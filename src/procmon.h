@@ -15,6 +15,16 @@ public:
   */
   virtual bool is_alive(void) = 0;
 
+  /**
+     fd that becomes readable when the process exits, for waiting on its
+     exit along with other fds. -1 if there's none, is_alive() has to be
+     polled then
+  */
+  virtual int exit_fd(void)
+  {
+    return -1;
+  };
+
   /**
      pid of the process being monitored
   */
@@ -42,6 +52,10 @@ public:
   ProcMon& operator=(ProcMon&&) = delete;
 
   bool is_alive(void) override;
+  int exit_fd(void) override
+  {
+    return pidfd_;
+  };
 
 private:
   int pidfd_ = -1;
@@ -0,0 +1,1966 @@
+#include <algorithm>
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "bpffeature.h"
+#include "bpftrace.h"
+#include "build_info.h"
+#include "fake_map.h"
+#include "log.h"
+#include "map.h"
+#include "program_image.h"
+#include "struct.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+namespace {
+
+const char IMAGE_MAGIC[8] = { 'B', 'T', 'P', 'R', 'O', 'G', 'I', 'M' };
+const uint64_t IMAGE_VERSION = 26;
+const char CACHE_MAGIC[8] = { 'B', 'T', 'P', 'R', 'O', 'G', 'C', 'C' };
+const char DEFINITIONS_MAGIC[8] = { 'B', 'T', 'D', 'E', 'F', 'S', 'C', 'C' };
+const char HEADERS_MAGIC[8] = { 'B', 'T', 'H', 'D', 'R', 'S', 'C', 'C' };
+
+// BPF_LD | BPF_IMM | BPF_DW, the first half of a 16 bytes ld_imm64
+const uint8_t LD_IMM64 = 0x18;
+const size_t INSN_SIZE = 8;
+
+const std::vector<MapManager::Type> INTERNAL_MAPS = {
+  MapManager::Type::PerfEvent,     MapManager::Type::Ringbuf,
+  MapManager::Type::RingbufLoss,   MapManager::Type::Join,
+  MapManager::Type::Elapsed,       MapManager::Type::SeqPrintfData,
+  MapManager::Type::Sample,        MapManager::Type::Scratch,
+  MapManager::Type::TailCalls,     MapManager::Type::ProbeCounts,
+  MapManager::Type::Counters,      MapManager::Type::Control,
+  MapManager::Type::EventBatch,    MapManager::Type::HelperErrors,
+  MapManager::Type::AdaptiveSample, MapManager::Type::FlightRecorder,
+  MapManager::Type::Dedupe,        MapManager::Type::ProbeGates,
+  MapManager::Type::RawSymbolsPids,
+};
+
+// Calls f(name, value, in_image) with the settings the programs are compiled
+// with, which the cached ones are keyed on. Those in the image are also what
+// a program loaded from it runs with, an ELF file from --emit-elf bringing
+// them along.
+template <typename F>
+void for_each_setting(BPFtrace &bpftrace, F f)
+{
+  f("strlen", bpftrace.strlen_, false);
+  f("mapmax", bpftrace.mapmax_, false);
+  f("stack map entries", bpftrace.stack_map_entries_, false);
+  f("cat bytes max", bpftrace.cat_bytes_max_, false);
+  f("log size", bpftrace.log_size_, false);
+  f("ringbuf", bpftrace.use_ringbuf_, false);
+  f("ringbuf pages", bpftrace.ringbuf_pages_, false);
+  f("control ringbuf", bpftrace.use_control_ringbuf_, false);
+  f("control ringbuf pages", bpftrace.control_ringbuf_pages_, false);
+  f("map alloc", bpftrace.map_alloc_, true);
+  f("double buffer maps", bpftrace.double_buffer_maps_, false);
+  f("hash str keys", bpftrace.hash_str_keys_, false);
+  f("hist arrays", bpftrace.hist_arrays_, false);
+  f("flight recorder secs", bpftrace.flight_recorder_secs_, true);
+  f("flight recorder events", bpftrace.flight_recorder_events_, false);
+  f("dedupe ms", bpftrace.dedupe_ms_, false);
+  f("event batch", bpftrace.event_batch_, true);
+  f("coalesce reads", bpftrace.coalesce_reads_, false);
+  f("opt level", bpftrace.opt_level_, false);
+  f("safe mode", bpftrace.safe_mode_, false);
+  f("helper check level", bpftrace.helper_check_level_, false);
+  f("helper error events", bpftrace.helper_error_events_, false);
+  f("adaptive sampling", bpftrace.adaptive_sampling_, false);
+  f("usdt file activation", bpftrace.usdt_file_activation_, false);
+  f("demangle", bpftrace.demangle_cpp_symbols_, false);
+  f("probe counts", bpftrace.probe_counts_, false);
+  f("kprobe to kfunc", bpftrace.kprobe_to_kfunc_, false);
+}
+
+} // namespace
+
+class ImageWriter
+{
+public:
+  void u64(uint64_t n)
+  {
+    out_.append(reinterpret_cast<const char *>(&n), sizeof(n));
+  }
+  void i64(int64_t n)
+  {
+    u64(static_cast<uint64_t>(n));
+  }
+  void str(const std::string &s)
+  {
+    u64(s.size());
+    out_.append(s);
+  }
+  void bytes(const uint8_t *data, size_t size)
+  {
+    u64(size);
+    out_.append(reinterpret_cast<const char *>(data), size);
+  }
+  void raw(const char *data, size_t size)
+  {
+    out_.append(data, size);
+  }
+
+  std::string &data()
+  {
+    return out_;
+  }
+
+private:
+  std::string out_;
+};
+
+class ImageReader
+{
+public:
+  ImageReader(const char *data, size_t size) : pos_(data), end_(data + size)
+  {
+  }
+
+  uint64_t u64()
+  {
+    uint64_t n;
+    memcpy(&n, take(sizeof(n)), sizeof(n));
+    return n;
+  }
+  int64_t i64()
+  {
+    return static_cast<int64_t>(u64());
+  }
+  bool b()
+  {
+    return u64() != 0;
+  }
+  // Number of elements that follow, each taking at least one u64
+  size_t count()
+  {
+    uint64_t n = u64();
+    if (n > static_cast<size_t>(end_ - pos_) / sizeof(uint64_t))
+      throw std::runtime_error("corrupt program image");
+    return n;
+  }
+  std::string str()
+  {
+    uint64_t size = u64();
+    if (size > static_cast<size_t>(end_ - pos_))
+      throw std::runtime_error("corrupt program image");
+    return std::string(take(size), size);
+  }
+  std::vector<uint8_t> bytes()
+  {
+    std::string s = str();
+    return std::vector<uint8_t>(s.begin(), s.end());
+  }
+  bool magic(const char (&magic)[8])
+  {
+    return static_cast<size_t>(end_ - pos_) >= sizeof(magic) &&
+           memcmp(take(sizeof(magic)), magic, sizeof(magic)) == 0;
+  }
+  bool done() const
+  {
+    return pos_ == end_;
+  }
+
+private:
+  const char *take(size_t size)
+  {
+    if (size > static_cast<size_t>(end_ - pos_))
+      throw std::runtime_error("truncated program image");
+    const char *data = pos_;
+    pos_ += size;
+    return data;
+  }
+
+  const char *pos_;
+  const char *end_;
+};
+
+namespace {
+
+void write_probes(ImageWriter &w, const std::vector<Probe> &probes)
+{
+  w.u64(probes.size());
+  for (auto &probe : probes)
+  {
+    w.u64(static_cast<uint64_t>(probe.type));
+    w.str(probe.path);
+    w.str(probe.attach_point);
+    w.str(probe.orig_name);
+    w.str(probe.name);
+    w.str(probe.pin);
+    w.str(probe.ns);
+    w.u64(probe.loc);
+    w.i64(probe.usdt_location_idx);
+    w.u64(probe.log_size);
+    w.i64(probe.index);
+    w.i64(probe.freq);
+    w.i64(probe.pid);
+    w.u64(probe.len);
+    w.str(probe.mode);
+    w.u64(probe.async);
+    w.u64(probe.address);
+    w.u64(probe.func_offset);
+    w.u64(probe.funcs.size());
+    for (auto &func : probe.funcs)
+      w.str(func);
+    w.u64(probe.cookies.size());
+    for (auto cookie : probe.cookies)
+      w.u64(cookie);
+    w.u64(probe.btf_id);
+    w.i64(probe.probe_id);
+    w.i64(probe.counter_slot);
+    w.str(probe.cpus);
+  }
+}
+
+std::vector<Probe> read_probes(ImageReader &r)
+{
+  std::vector<Probe> probes(r.count());
+  for (auto &probe : probes)
+  {
+    probe.type = static_cast<ProbeType>(r.u64());
+    probe.path = r.str();
+    probe.attach_point = r.str();
+    probe.orig_name = r.str();
+    probe.name = r.str();
+    probe.pin = r.str();
+    probe.ns = r.str();
+    probe.loc = r.u64();
+    probe.usdt_location_idx = r.i64();
+    probe.log_size = r.u64();
+    probe.index = r.i64();
+    probe.freq = r.i64();
+    probe.pid = r.i64();
+    probe.len = r.u64();
+    probe.mode = r.str();
+    probe.async = r.b();
+    probe.address = r.u64();
+    probe.func_offset = r.u64();
+    probe.funcs.resize(r.count());
+    for (auto &func : probe.funcs)
+      func = r.str();
+    probe.cookies.resize(r.count());
+    for (auto &cookie : probe.cookies)
+      cookie = r.u64();
+    probe.btf_id = r.u64();
+    probe.probe_id = r.i64();
+    probe.counter_slot = r.i64();
+    probe.cpus = r.str();
+  }
+  return probes;
+}
+
+void write_strings(ImageWriter &w, const std::vector<std::string> &strings)
+{
+  w.u64(strings.size());
+  for (auto &s : strings)
+    w.str(s);
+}
+
+std::vector<std::string> read_strings(ImageReader &r)
+{
+  std::vector<std::string> strings(r.count());
+  for (auto &s : strings)
+    s = r.str();
+  return strings;
+}
+
+// Probe sections hold the code, the other ones (license, version, ...) data
+bool is_code_section(const std::string &name)
+{
+  return name.compare(0, 2, "s_") == 0;
+}
+
+// Calls f with the map fd loaded by each ld_imm64 instruction of code
+template <typename F>
+void for_each_map_fd(std::vector<uint8_t> &code, F f)
+{
+  for (size_t i = 0; i + 2 * INSN_SIZE <= code.size(); i += INSN_SIZE)
+  {
+    uint8_t *insn = code.data() + i;
+    if (insn[0] != LD_IMM64)
+      continue;
+    uint8_t src_reg = insn[1] >> 4;
+    if (src_reg == BPF_PSEUDO_MAP_FD || src_reg == BPF_PSEUDO_MAP_VALUE)
+    {
+      int32_t imm;
+      memcpy(&imm, insn + 4, sizeof(imm));
+      f(imm);
+      memcpy(insn + 4, &imm, sizeof(imm));
+    }
+    // The second half holds no opcode
+    i += INSN_SIZE;
+  }
+}
+
+// Calls f with the index of the FieldReloc of each ld_imm64 of code loading
+// a field offset, which is replaced by a plain ld_imm64 of what f returns
+template <typename F>
+void for_each_field_offset(std::vector<uint8_t> &code, F f)
+{
+  for (size_t i = 0; i + 2 * INSN_SIZE <= code.size(); i += INSN_SIZE)
+  {
+    uint8_t *insn = code.data() + i;
+    if (insn[0] != LD_IMM64)
+      continue;
+    if ((insn[1] >> 4) == BPF_PSEUDO_FIELD_OFFSET)
+    {
+      int32_t imm;
+      memcpy(&imm, insn + 4, sizeof(imm));
+      int32_t offset = f(imm);
+      insn[1] &= 0x0f;
+      memcpy(insn + 4, &offset, sizeof(offset));
+      memset(insn + INSN_SIZE + 4, 0, sizeof(offset));
+    }
+    i += INSN_SIZE;
+  }
+}
+
+// Offsets of the relocated fields on this kernel. The ones of structs that
+// weren't kernel ones when the program was compiled keep their offset.
+std::vector<uint64_t> relocate_fields(BPFtrace &bpftrace,
+                                      const std::vector<FieldReloc> &relocs,
+                                      const std::vector<bool> &kernel)
+{
+  std::vector<uint64_t> offsets;
+  std::unordered_set<std::string> records;
+  for (size_t i = 0; i < relocs.size(); i++)
+  {
+    offsets.push_back(relocs[i].offset);
+    if (kernel[i])
+      records.insert(relocs[i].record);
+  }
+  if (records.empty())
+    return offsets;
+  if (!bpftrace.btf_.has_data())
+  {
+    LOG(WARNING) << "This kernel has no BTF, the struct offsets of the "
+                    "kernel the program was compiled on are used";
+    return offsets;
+  }
+
+  std::map<std::string, Struct> structs;
+  std::map<std::string, uint64_t> enums;
+  bpftrace.btf_.resolve_structs(records, 0, structs, enums);
+  for (size_t i = 0; i < relocs.size(); i++)
+  {
+    if (!kernel[i])
+      continue;
+    auto &reloc = relocs[i];
+    auto cstruct = structs.find(reloc.record);
+    if (cstruct == structs.end())
+      throw std::runtime_error(reloc.record + " isn't in the BTF of this "
+                                              "kernel");
+    auto field = cstruct->second.fields.find(reloc.field);
+    if (field == cstruct->second.fields.end())
+      throw std::runtime_error(reloc.record + " has no field " +
+                               reloc.field + " on this kernel");
+    if (field->second.type.GetSize() != reloc.size || field->second.is_bitfield)
+      throw std::runtime_error("field " + reloc.field + " of " +
+                               reloc.record +
+                               " has another type on this kernel");
+    offsets[i] = field->second.offset;
+  }
+  return offsets;
+}
+
+// Saved map, as it was created by the semantic analyser
+struct MapImage
+{
+  std::string name;
+  SizedType type;
+  MapKey key;
+  int lqmin = 0;
+  int lqmax = 0;
+  int lqstep = 0;
+  uint32_t max_entries = 0;
+  bool mmapped = false;
+  bool dense = false;
+  bool task_storage = false;
+  bool double_buffered = false;
+  bool hashed_key = false;
+  bool bucket_array = false;
+  bool bloom = false;
+  // 0 for BPF_MAP_TYPE_BLOOM_FILTER
+  uint32_t bloom_bytes = 0;
+  uint32_t window_slots = 0;
+  uint64_t window_slot_ns = 0;
+  uint64_t ttl_ns = 0;
+  // fds the code was compiled against
+  int64_t mapfd = -1;
+  int64_t outer_mapfd = -1;
+  int64_t window_outer_mapfd = -1;
+  int64_t sketch_mapfd = -1;
+  int64_t strings_mapfd = -1;
+  int64_t ttl_mapfd = -1;
+};
+
+struct StackMapImage
+{
+  StackType stack_type;
+  uint32_t max_entries = 0;
+  int64_t mapfd = -1;
+};
+
+struct InternalMapImage
+{
+  MapManager::Type type;
+  uint32_t max_entries = 0;
+  int64_t mapfd = -1;
+};
+
+void add_fd(std::unordered_map<int64_t, int> &fds, int64_t old_fd, int new_fd)
+{
+  if (old_fd >= 0)
+    fds[old_fd] = new_fd;
+}
+
+template <typename T>
+bool create_maps(BPFtrace &bpftrace,
+                 const std::vector<MapImage> &maps,
+                 const std::vector<StackMapImage> &stack_maps,
+                 const std::vector<InternalMapImage> &internal_maps,
+                 std::unordered_map<int64_t, int> &fds)
+{
+  bool ok = true;
+  for (auto &m : maps)
+  {
+    if (m.bloom)
+    {
+      auto map = create_bloom_map<T>(
+          m.name, m.type, m.key, m.max_entries, m.bloom_bytes == 0);
+      ok &= map->mapfd_ >= 0 && map->bloom_bytes_ == m.bloom_bytes;
+      add_fd(fds, m.mapfd, map->mapfd_);
+      bpftrace.maps.Add(std::move(map));
+      continue;
+    }
+    auto map = std::make_unique<T>(m.name,
+                                   m.type,
+                                   m.key,
+                                   m.lqmin,
+                                   m.lqmax,
+                                   m.lqstep,
+                                   m.max_entries,
+                                   bpftrace.map_alloc_,
+                                   m.mmapped,
+                                   m.dense,
+                                   m.task_storage,
+                                   m.hashed_key,
+                                   m.bucket_array);
+    ok &= map->mapfd_ >= 0 && (map->bucket_array_ != 0) == m.bucket_array;
+    if (ok && m.double_buffered)
+      ok &= map->make_double_buffered() == 0;
+    if (ok && m.window_slots)
+      ok &= map->make_windowed(m.window_slots, m.window_slot_ns) == 0;
+    if (ok && m.ttl_ns)
+      ok &= map->make_ttl(m.ttl_ns) == 0;
+    add_fd(fds, m.mapfd, map->mapfd_);
+    add_fd(fds, m.outer_mapfd, map->outer_mapfd_);
+    add_fd(fds, m.window_outer_mapfd, map->window_outer_mapfd_);
+    add_fd(fds, m.sketch_mapfd, map->sketch_mapfd_);
+    add_fd(fds, m.strings_mapfd, map->strings_mapfd_);
+    add_fd(fds, m.ttl_mapfd, map->ttl_mapfd_);
+    bpftrace.maps.Add(std::move(map));
+  }
+
+  for (auto &m : stack_maps)
+  {
+    auto map = std::make_unique<T>(CreateStack(true, m.stack_type),
+                                   m.max_entries);
+    ok &= map->mapfd_ >= 0;
+    add_fd(fds, m.mapfd, map->mapfd_);
+    bpftrace.maps.Set(m.stack_type, std::move(map));
+  }
+
+  for (auto &m : internal_maps)
+  {
+    std::unique_ptr<T> map;
+    switch (m.type)
+    {
+      case MapManager::Type::PerfEvent:
+        map = std::make_unique<T>(BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+        break;
+      case MapManager::Type::Ringbuf:
+        map = std::make_unique<T>(
+            "ringbuf",
+            static_cast<enum bpf_map_type>(libbpf::BPF_MAP_TYPE_RINGBUF),
+            0,
+            0,
+            m.max_entries,
+            0);
+        break;
+      case MapManager::Type::RingbufLoss:
+        map = std::make_unique<T>(
+            "ringbuf_loss", BPF_MAP_TYPE_ARRAY, 4, 8, 1, 0);
+        break;
+      case MapManager::Type::Join:
+        map = std::make_unique<T>("join",
+                                  BPF_MAP_TYPE_PERCPU_ARRAY,
+                                  4,
+                                  bpftrace.join_size(),
+                                  1,
+                                  0);
+        break;
+      case MapManager::Type::Elapsed:
+        map = std::make_unique<T>("elapsed", CreateUInt64(), MapKey(), 1);
+        break;
+      case MapManager::Type::SeqPrintfData:
+      {
+        size_t size = 0;
+        for (auto &args : bpftrace.seq_printf_args_)
+          size += std::get<0>(args).size() + 1;
+        int ptr_size = sizeof(unsigned long);
+        size = (size / ptr_size + 1) * ptr_size;
+        map = std::make_unique<T>(
+            "data", BPF_MAP_TYPE_ARRAY, 4, size, 1, 0);
+
+        std::vector<uint8_t> formats(size, 0);
+        for (size_t i = 0; i < bpftrace.seq_printf_args_.size(); i++)
+        {
+          auto &format = std::get<0>(bpftrace.seq_printf_args_[i]);
+          memcpy(formats.data() + std::get<0>(bpftrace.seq_printf_ids_[i]),
+                 format.c_str(),
+                 format.size());
+        }
+        uint64_t id = 0;
+        if (map->mapfd_ >= 0)
+          bpf_update_elem(map->mapfd_, &id, formats.data(), 0);
+        break;
+      }
+      case MapManager::Type::Sample:
+        map = std::make_unique<T>(
+            "sample", BPF_MAP_TYPE_PERCPU_ARRAY, 4, 16, m.max_entries, 0);
+        break;
+      case MapManager::Type::Scratch:
+        map = std::make_unique<T>("scratch",
+                                  BPF_MAP_TYPE_PERCPU_ARRAY,
+                                  4,
+                                  bpftrace.scratch_size_,
+                                  1,
+                                  0);
+        break;
+      case MapManager::Type::TailCalls:
+        map = std::make_unique<T>(
+            "tail_calls", BPF_MAP_TYPE_PROG_ARRAY, 4, 4, m.max_entries, 0);
+        break;
+      case MapManager::Type::ProbeCounts:
+        map = std::make_unique<T>(
+            "probe_counts", BPF_MAP_TYPE_PERCPU_ARRAY, 4, 8, m.max_entries, 0);
+        break;
+      case MapManager::Type::Counters:
+        map = std::make_unique<T>("counters",
+                                  BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+                                  4,
+                                  4,
+                                  m.max_entries,
+                                  0);
+        break;
+      case MapManager::Type::Control:
+        map = std::make_unique<T>(
+            "control",
+            static_cast<enum bpf_map_type>(libbpf::BPF_MAP_TYPE_RINGBUF),
+            0,
+            0,
+            m.max_entries,
+            0);
+        break;
+      case MapManager::Type::EventBatch:
+        map = std::make_unique<T>("event_batch",
+                                  BPF_MAP_TYPE_PERCPU_ARRAY,
+                                  4,
+                                  BPFtrace::event_batch_value_size(
+                                      bpftrace.event_batch_),
+                                  m.max_entries,
+                                  0);
+        break;
+      case MapManager::Type::HelperErrors:
+        map = std::make_unique<T>(
+            "helper_errors", BPF_MAP_TYPE_PERCPU_HASH, 8, 8, m.max_entries, 0);
+        break;
+      case MapManager::Type::AdaptiveSample:
+        map = std::make_unique<T>(
+            "adaptive_sample", BPF_MAP_TYPE_PERCPU_ARRAY, 4, 32, 1, 0);
+        break;
+      case MapManager::Type::FlightRecorder:
+        map = std::make_unique<T>("flight_recorder",
+                                  BPF_MAP_TYPE_PERCPU_ARRAY,
+                                  4,
+                                  BPFtrace::flight_slot_size(
+                                      bpftrace.flight_event_size_),
+                                  m.max_entries,
+                                  0);
+        break;
+      case MapManager::Type::Dedupe:
+        map = std::make_unique<T>("dedupe",
+                                  BPF_MAP_TYPE_PERCPU_ARRAY,
+                                  4,
+                                  BPFtrace::DEDUPE_VALUE_SIZE,
+                                  1,
+                                  0);
+        break;
+      case MapManager::Type::ProbeGates:
+        map = std::make_unique<T>(
+            "probe_gates", BPF_MAP_TYPE_ARRAY, 4, 8, m.max_entries, 0);
+        break;
+      case MapManager::Type::RawSymbolsPids:
+        map = std::make_unique<T>("raw_symbols_pids",
+                                  BPF_MAP_TYPE_LRU_HASH,
+                                  4,
+                                  1,
+                                  m.max_entries,
+                                  0);
+        break;
+    }
+    ok &= map->mapfd_ >= 0;
+    add_fd(fds, m.mapfd, map->mapfd_);
+    bpftrace.maps.Set(m.type, std::move(map));
+  }
+  return ok;
+}
+
+} // namespace
+
+void ProgramImage::write_type(ImageWriter &w, const SizedType &type)
+{
+  w.u64(static_cast<uint64_t>(type.type));
+  w.u64(type.stack_type.limit);
+  w.u64(static_cast<uint64_t>(type.stack_type.mode));
+  w.u64(type.is_internal);
+  w.u64(type.is_tparg);
+  w.u64(type.is_kfarg);
+  w.i64(type.kfarg_idx);
+  w.u64(type.size_);
+  w.u64(type.is_signed_);
+  w.u64(type.num_elements_);
+  w.str(type.name_ ? *type.name_ : "");
+  w.u64(type.ctx_);
+  w.u64(static_cast<uint64_t>(type.as_));
+  w.i64(type.size_bits_);
+
+  w.u64(type.element_type_ != nullptr);
+  if (type.element_type_)
+    write_type(w, *type.element_type_);
+
+  w.u64(type.tuple_fields != nullptr);
+  if (type.tuple_fields)
+  {
+    w.u64(type.tuple_fields->size);
+    w.i64(type.tuple_fields->align);
+    w.u64(type.tuple_fields->padded);
+    w.u64(type.tuple_fields->fields.size());
+    for (auto &field : type.tuple_fields->fields)
+      write_field(w, field);
+  }
+}
+
+SizedType ProgramImage::read_type(ImageReader &r)
+{
+  SizedType type;
+  type.type = static_cast<Type>(r.u64());
+  type.stack_type.limit = r.u64();
+  type.stack_type.mode = static_cast<StackMode>(r.u64());
+  type.is_internal = r.b();
+  type.is_tparg = r.b();
+  type.is_kfarg = r.b();
+  type.kfarg_idx = r.i64();
+  type.size_ = r.u64();
+  type.is_signed_ = r.b();
+  type.num_elements_ = r.u64();
+  std::string name = r.str();
+  if (!name.empty())
+    type.name_ = SizedType::intern_name(name);
+  type.ctx_ = r.b();
+  type.as_ = static_cast<AddrSpace>(r.u64());
+  type.size_bits_ = r.i64();
+
+  if (r.b())
+    type.element_type_ = SizedType::intern_type(read_type(r));
+
+  if (r.b())
+  {
+    auto tuple = std::make_unique<Tuple>();
+    tuple->size = r.u64();
+    tuple->align = r.i64();
+    tuple->padded = r.b();
+    tuple->fields.resize(r.count());
+    for (auto &field : tuple->fields)
+      field = read_field(r);
+    type.tuple_fields = SizedType::keep_tuple(std::move(tuple));
+  }
+  return type;
+}
+
+void ProgramImage::write_field(ImageWriter &w, const Field &field)
+{
+  write_type(w, field.type);
+  w.i64(field.offset);
+  w.u64(field.is_bitfield);
+  w.u64(field.bitfield.read_bytes);
+  w.u64(field.bitfield.access_rshift);
+  w.u64(field.bitfield.mask);
+  w.u64(field.is_data_loc);
+}
+
+Field ProgramImage::read_field(ImageReader &r)
+{
+  Field field;
+  field.type = read_type(r);
+  field.offset = r.i64();
+  field.is_bitfield = r.b();
+  field.bitfield.read_bytes = r.u64();
+  field.bitfield.access_rshift = r.u64();
+  field.bitfield.mask = r.u64();
+  field.is_data_loc = r.b();
+  return field;
+}
+
+void ProgramImage::write_structs(ImageWriter &w,
+                                 const std::map<std::string, Struct> &structs)
+{
+  w.u64(structs.size());
+  for (auto &[name, s] : structs)
+  {
+    w.str(name);
+    w.i64(s.size);
+    w.u64(s.fields.size());
+    for (auto &[field_name, field] : s.fields)
+    {
+      w.str(field_name);
+      write_field(w, field);
+    }
+  }
+}
+
+std::map<std::string, Struct> ProgramImage::read_structs(ImageReader &r)
+{
+  std::map<std::string, Struct> structs;
+  for (size_t n = r.count(); n > 0; n--)
+  {
+    auto &s = structs[r.str()];
+    s.size = r.i64();
+    for (size_t nfields = r.count(); nfields > 0; nfields--)
+    {
+      std::string field_name = r.str();
+      s.fields[field_name] = read_field(r);
+    }
+  }
+  return structs;
+}
+
+std::string ProgramImage::save_definitions(BPFtrace &bpftrace)
+{
+  ImageWriter w;
+  write_structs(w, bpftrace.structs_);
+  w.u64(bpftrace.macros_.size());
+  for (auto &[name, value] : bpftrace.macros_)
+  {
+    w.str(name);
+    w.str(value);
+  }
+  w.u64(bpftrace.enums_.size());
+  for (auto &[name, value] : bpftrace.enums_)
+  {
+    w.str(name);
+    w.u64(value);
+  }
+  // Sorted, so that equal sets give equal images
+  std::set<std::string> btf_set(bpftrace.btf_set_.begin(),
+                                bpftrace.btf_set_.end());
+  w.u64(btf_set.size());
+  for (auto &type : btf_set)
+    w.str(type);
+  return std::move(w.data());
+}
+
+void ProgramImage::load_definitions(BPFtrace &bpftrace,
+                                    const std::string &image)
+{
+  ImageReader r(image.data(), image.size());
+  auto structs = read_structs(r);
+  std::map<std::string, std::string> macros;
+  for (size_t n = r.count(); n > 0; n--)
+  {
+    std::string name = r.str();
+    macros[name] = r.str();
+  }
+  std::map<std::string, uint64_t> enums;
+  for (size_t n = r.count(); n > 0; n--)
+  {
+    std::string name = r.str();
+    enums[name] = r.u64();
+  }
+  std::unordered_set<std::string> btf_set;
+  for (size_t n = r.count(); n > 0; n--)
+    btf_set.insert(r.str());
+  if (!r.done())
+    throw std::runtime_error("corrupt definitions image");
+
+  // The tracepoint args read from BTF before the clang parser are kept
+  bpftrace.structs_.merge(structs);
+  bpftrace.macros_ = std::move(macros);
+  bpftrace.enums_ = std::move(enums);
+  bpftrace.btf_set_ = std::move(btf_set);
+}
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = { 'B', 'T', 'S', 'N', 'A', 'P', 'S', 'H' };
+const uint64_t SNAPSHOT_VERSION = 2;
+
+bool is_mergeable(const SizedType &type)
+{
+  return type.IsCountTy() || type.IsSumTy() || type.IsMinTy() ||
+         type.IsMaxTy() || type.IsAvgTy() || type.IsStatsTy() ||
+         type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy() ||
+         type.IsDistinctTy();
+}
+
+// Key fields printed the same on any host, unlike e.g. stacks, symbols or
+// the ids of the probes
+bool is_portable_key(const SizedType &type)
+{
+  if (type.IsTupleTy())
+  {
+    for (auto &field : type.GetFields())
+      if (!is_portable_key(field.type))
+        return false;
+    return true;
+  }
+  return type.IsIntTy() || type.IsStringTy() || type.IsBufferTy() ||
+         type.IsInetTy() || type.IsMacAddressTy();
+}
+
+// Maps whose keys end with a bucket index, see BPFtrace::read_map_hist()
+bool has_bucket(const SizedType &type)
+{
+  return type.IsHistTy() || type.IsLhistTy() || type.IsLlhistTy();
+}
+
+// Folds the value from into into, the way the values of the CPUs are
+// combined when the map is printed: the HyperLogLog registers of distinct()
+// and the (inverted, see BPFtrace::min_value()) min() and max() by maximum,
+// everything else by sum. It's exact, so merging snapshots gives what one
+// host would have seen.
+void combine(const SizedType &type, uint8_t *into, const uint8_t *from)
+{
+  if (type.IsDistinctTy())
+  {
+    for (size_t i = 0; i < type.GetSize(); i++)
+      into[i] = std::max(into[i], from[i]);
+    return;
+  }
+  // The count and the total of avg() and stats() are both summed
+  for (size_t i = 0; i < type.GetSize(); i += sizeof(uint64_t))
+  {
+    uint64_t a, b;
+    memcpy(&a, into + i, sizeof(a));
+    memcpy(&b, from + i, sizeof(b));
+    if (type.IsMinTy())
+      a = std::max(static_cast<int64_t>(a), static_cast<int64_t>(b));
+    else if (type.IsMaxTy())
+      a = std::max(a, b);
+    else
+      a += b;
+    memcpy(into + i, &a, sizeof(a));
+  }
+}
+
+} // namespace
+
+std::string ProgramImage::save_snapshot(BPFtrace &bpftrace,
+                                        std::set<std::string> &saved)
+{
+  ImageWriter w;
+  w.raw(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  w.u64(SNAPSHOT_VERSION);
+
+  std::vector<IMap *> maps;
+  for (auto &map : bpftrace.maps)
+  {
+    if (!is_mergeable(map->type_))
+      continue;
+    auto key = std::find_if(map->key_.args_.begin(),
+                            map->key_.args_.end(),
+                            [](auto &arg) { return !is_portable_key(arg); });
+    if (key != map->key_.args_.end())
+    {
+      LOG(WARNING) << "--snapshot: " << map->name_ << " is keyed by " << *key
+                   << ", which is only meaningful on this host, it is "
+                      "printed instead";
+      continue;
+    }
+    maps.push_back(map.get());
+  }
+
+  w.u64(maps.size());
+  for (auto map : maps)
+  {
+    size_t key_size = map->key_.size() + (has_bucket(map->type_) ? 8 : 0);
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+    if (bpftrace.dump_map(*map, key_size, entries))
+      throw std::runtime_error("failed to read " + map->name_);
+
+    w.str(map->name_);
+    write_type(w, map->type_);
+    w.u64(map->key_.args_.size());
+    for (auto &arg : map->key_.args_)
+      write_type(w, arg);
+    w.i64(map->lqmin);
+    w.i64(map->lqmax);
+    w.i64(map->lqstep);
+
+    // The values of all the CPUs are combined into one
+    size_t value_size = map->type_.GetSize();
+    uint32_t nvalues = map->is_per_cpu_type() ? bpftrace.seen_cpus_ : 1;
+    w.u64(entries.size());
+    for (auto &[key, value] : entries)
+    {
+      // Keyless maps are read with a placeholder key
+      std::vector<uint8_t> k(key);
+      k.resize(key_size);
+      std::vector<uint8_t> v(value.begin(), value.begin() + value_size);
+      for (uint32_t cpu = 1; cpu < nvalues; cpu++)
+        combine(map->type_, v.data(), value.data() + cpu * value_size);
+      w.bytes(k.data(), k.size());
+      w.bytes(v.data(), v.size());
+    }
+    saved.insert(map->name_);
+  }
+  return std::move(w.data());
+}
+
+void ProgramImage::merge_snapshot(BPFtrace &bpftrace,
+                                  const std::string &snapshot)
+{
+  ImageReader r(snapshot.data(), snapshot.size());
+  if (!r.magic(SNAPSHOT_MAGIC))
+    throw std::runtime_error("not a snapshot written by --snapshot");
+  if (r.u64() != SNAPSHOT_VERSION)
+    throw std::runtime_error("snapshot of another bpftrace version");
+
+  // Everything is read before any map is touched
+  std::vector<std::unique_ptr<SnapshotMap>> maps(r.count());
+  for (auto &map : maps)
+  {
+    auto name = r.str();
+    auto type = read_type(r);
+    MapKey key;
+    key.args_.resize(r.count());
+    for (auto &arg : key.args_)
+      arg = read_type(r);
+    int lqmin = r.i64();
+    int lqmax = r.i64();
+    int lqstep = r.i64();
+    map = std::make_unique<SnapshotMap>(name, type, key, lqmin, lqmax, lqstep);
+    if (!is_mergeable(type))
+      throw std::runtime_error("corrupt snapshot");
+
+    size_t key_size = key.size() + (has_bucket(type) ? 8 : 0);
+    for (size_t n = r.count(); n > 0; n--)
+    {
+      auto k = r.bytes();
+      auto v = r.bytes();
+      if (k.size() != key_size || v.size() != type.GetSize())
+        throw std::runtime_error("corrupt snapshot");
+      map->entries_[std::move(k)] = std::move(v);
+    }
+
+    auto existing = bpftrace.maps.Lookup(name);
+    if (!existing)
+      continue;
+    auto other = dynamic_cast<SnapshotMap *>(*existing);
+    if (!other || other->type_ != type || other->key_ != key ||
+        other->lqmin != lqmin || other->lqmax != lqmax ||
+        other->lqstep != lqstep)
+      throw std::runtime_error(name +
+                               " isn't the same map as in the other "
+                               "snapshots");
+  }
+  if (!r.done())
+    throw std::runtime_error("corrupt snapshot");
+
+  for (auto &map : maps)
+  {
+    auto existing = bpftrace.maps.Lookup(map->name_);
+    if (!existing)
+    {
+      bpftrace.maps.Add(std::move(map));
+      continue;
+    }
+    auto &entries = static_cast<SnapshotMap *>(*existing)->entries_;
+    for (auto &[key, value] : map->entries_)
+    {
+      auto entry = entries.find(key);
+      if (entry == entries.end())
+        entries.emplace(key, value);
+      else
+        combine(map->type_, entry->second.data(), value.data());
+    }
+  }
+}
+
+namespace {
+
+const char LAYOUT_MAGIC[8] = { 'B', 'T', 'M', 'A', 'P', 'L', 'A', 'Y' };
+const uint64_t LAYOUT_VERSION = 2;
+
+} // namespace
+
+std::string ProgramImage::save_map_layout(BPFtrace &bpftrace)
+{
+  ImageWriter w;
+  w.raw(LAYOUT_MAGIC, sizeof(LAYOUT_MAGIC));
+  w.u64(LAYOUT_VERSION);
+  write_structs(w, bpftrace.structs_);
+
+  w.u64(std::distance(bpftrace.maps.begin(), bpftrace.maps.end()));
+  for (auto &map : bpftrace.maps)
+  {
+    w.str(map->name_);
+    write_type(w, map->type_);
+    w.u64(map->key_.args_.size());
+    for (auto &arg : map->key_.args_)
+      write_type(w, arg);
+    w.i64(map->lqmin);
+    w.i64(map->lqmax);
+    w.i64(map->lqstep);
+    w.u64(map->map_type_);
+    w.u64(map->max_entries_);
+    w.u64(map->is_mmapped());
+    w.u64(map->dense_);
+    w.u64(map->is_double_buffered());
+    w.u64(map->sketch_mapfd_ >= 0);
+  }
+  return std::move(w.data());
+}
+
+std::vector<std::unique_ptr<PinnedMap>> ProgramImage::load_map_layout(
+    BPFtrace &bpftrace,
+    const std::string &layout)
+{
+  ImageReader r(layout.data(), layout.size());
+  if (!r.magic(LAYOUT_MAGIC))
+    throw std::runtime_error("not a layout pinned by --pin-maps");
+  if (r.u64() != LAYOUT_VERSION)
+    throw std::runtime_error("maps pinned by another bpftrace version");
+  auto structs = read_structs(r);
+
+  std::vector<std::unique_ptr<PinnedMap>> maps(r.count());
+  for (auto &map : maps)
+  {
+    auto name = r.str();
+    auto type = read_type(r);
+    MapKey key;
+    key.args_.resize(r.count());
+    for (auto &arg : key.args_)
+      arg = read_type(r);
+    int lqmin = r.i64();
+    int lqmax = r.i64();
+    int lqstep = r.i64();
+    map = std::make_unique<PinnedMap>(name, type, key, lqmin, lqmax, lqstep);
+    map->map_type_ = static_cast<enum bpf_map_type>(r.u64());
+    map->max_entries_ = r.u64();
+    map->mmapable_ = r.b();
+    map->dense_ = r.b();
+    map->task_storage_ = map->map_type_ == static_cast<enum bpf_map_type>(
+                             libbpf::BPF_MAP_TYPE_TASK_STORAGE);
+    map->double_buffered_ = r.b();
+    map->has_sketch_ = r.b();
+  }
+  if (!r.done())
+    throw std::runtime_error("corrupt map layout");
+
+  for (auto &[name, s] : structs)
+    bpftrace.structs_[name] = std::move(s);
+  return maps;
+}
+
+std::string ProgramImage::save(BPFtrace &bpftrace, const SectionMap &sections)
+{
+  ImageWriter w;
+  w.raw(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  w.u64(IMAGE_VERSION);
+
+  write_probes(w, bpftrace.probes_);
+  write_probes(w, bpftrace.special_probes_);
+
+  auto write_args = [&](const auto &args_list) {
+    w.u64(args_list.size());
+    for (auto &args : args_list)
+    {
+      w.str(std::get<0>(args));
+      w.u64(std::get<1>(args).size());
+      for (auto &field : std::get<1>(args))
+        write_field(w, field);
+    }
+  };
+  write_args(bpftrace.printf_args_);
+  write_args(bpftrace.system_args_);
+  write_args(bpftrace.seq_printf_args_);
+  write_args(bpftrace.cat_args_);
+  write_strings(w, bpftrace.join_args_);
+  write_strings(w, bpftrace.time_args_);
+  write_strings(w, bpftrace.strftime_args_);
+  write_strings(w, bpftrace.probe_ids_);
+
+  w.u64(bpftrace.non_map_print_args_.size());
+  for (auto &type : bpftrace.non_map_print_args_)
+    write_type(w, type);
+
+  w.u64(bpftrace.quantiles_args_.size());
+  for (auto &quantiles : bpftrace.quantiles_args_)
+  {
+    w.u64(quantiles.size());
+    for (double q : quantiles)
+    {
+      uint64_t bits;
+      memcpy(&bits, &q, sizeof(bits));
+      w.u64(bits);
+    }
+  }
+
+  w.u64(bpftrace.helper_error_info_.size());
+  for (auto &[id, info] : bpftrace.helper_error_info_)
+  {
+    w.i64(id);
+    w.i64(info.func_id);
+    w.i64(info.loc.begin.line);
+    w.i64(info.loc.begin.column);
+    w.i64(info.loc.end.line);
+    w.i64(info.loc.end.column);
+  }
+
+  w.u64(bpftrace.seq_printf_ids_.size());
+  for (auto &[idx, len] : bpftrace.seq_printf_ids_)
+  {
+    w.i64(idx);
+    w.i64(len);
+  }
+
+  write_structs(w, bpftrace.structs_);
+
+  // The fields are only relocated if their structs are the kernel's, not
+  // ones of the program or of headers that happen to have the same name
+  std::map<std::string, Struct> btf_structs;
+  if (!bpftrace.field_relocs_.empty())
+  {
+    std::unordered_set<std::string> records;
+    for (auto &reloc : bpftrace.field_relocs_)
+      records.insert(reloc.record);
+    std::map<std::string, uint64_t> enums;
+    bpftrace.btf_.resolve_structs(records, 0, btf_structs, enums);
+  }
+  w.u64(bpftrace.field_relocs_.size());
+  for (auto &reloc : bpftrace.field_relocs_)
+  {
+    w.str(reloc.record);
+    w.str(reloc.field);
+    w.u64(reloc.offset);
+    w.u64(reloc.size);
+    bool kernel = false;
+    auto cstruct = btf_structs.find(reloc.record);
+    if (cstruct != btf_structs.end())
+    {
+      auto field = cstruct->second.fields.find(reloc.field);
+      kernel = field != cstruct->second.fields.end() &&
+               static_cast<uint64_t>(field->second.offset) == reloc.offset &&
+               field->second.type.GetSize() == reloc.size;
+    }
+    w.u64(kernel);
+  }
+
+  w.u64(bpftrace.join_argnum_);
+  w.u64(bpftrace.join_argsize_);
+  w.u64(bpftrace.scratch_size_);
+  w.u64(bpftrace.flight_event_size_);
+  w.u64(bpftrace.has_usdt_);
+  for_each_setting(bpftrace, [&](const char *, auto &value, bool in_image) {
+    if (in_image)
+      w.u64(static_cast<uint64_t>(value));
+  });
+  w.u64(bpftrace.probe_gates_.size());
+  for (auto &[gate, name] : bpftrace.probe_gates_)
+  {
+    w.u64(gate);
+    w.str(name);
+  }
+
+  // Maps, in order of their ids
+  std::vector<IMap *> maps;
+  for (auto &map : bpftrace.maps)
+    maps.push_back(map.get());
+  w.u64(maps.size());
+  for (IMap *map : maps)
+  {
+    w.str(map->name_);
+    write_type(w, map->type_);
+    w.u64(map->key_.args_.size());
+    for (auto &arg : map->key_.args_)
+      write_type(w, arg);
+    w.u64(map->key_.packed_.size());
+    for (auto &slot : map->key_.packed_)
+    {
+      w.u64(slot.offset);
+      w.u64(slot.size);
+      w.u64(slot.is_signed);
+    }
+    w.i64(map->lqmin);
+    w.i64(map->lqmax);
+    w.i64(map->lqstep);
+    w.u64(map->max_entries_);
+    w.u64(map->is_mmapped());
+    w.u64(map->dense_);
+    w.u64(map->task_storage_);
+    w.u64(map->is_double_buffered());
+    w.u64(map->hashed_key_);
+    w.u64(map->bucket_array_ != 0);
+    w.u64(map->bloom_);
+    w.u64(map->bloom_bytes_);
+    w.u64(map->window_mapfds_.size());
+    w.u64(map->window_slot_ns_);
+    w.u64(map->ttl_ns_);
+    w.i64(map->mapfd_);
+    w.i64(map->outer_mapfd_);
+    w.i64(map->window_outer_mapfd_);
+    w.i64(map->sketch_mapfd_);
+    w.i64(map->strings_mapfd_);
+    w.i64(map->ttl_mapfd_);
+  }
+
+  auto &stack_maps = bpftrace.maps.StackMaps();
+  w.u64(stack_maps.size());
+  for (auto &[stack_type, map] : stack_maps)
+  {
+    w.u64(stack_type.limit);
+    w.u64(static_cast<uint64_t>(stack_type.mode));
+    w.u64(map->max_entries_);
+    w.i64(map->mapfd_);
+  }
+
+  std::vector<std::pair<MapManager::Type, IMap *>> internal_maps;
+  for (auto type : INTERNAL_MAPS)
+  {
+    if (auto map = bpftrace.maps[type])
+      internal_maps.emplace_back(type, *map);
+  }
+  w.u64(internal_maps.size());
+  for (auto &[type, map] : internal_maps)
+  {
+    w.u64(static_cast<uint64_t>(type));
+    w.u64(map->max_entries_);
+    w.i64(map->mapfd_);
+  }
+
+  w.u64(sections.size());
+  for (auto &[name, section] : sections)
+  {
+    w.str(name);
+    w.bytes(std::get<0>(section), std::get<1>(section));
+  }
+
+  return std::move(w.data());
+}
+
+std::unique_ptr<BpfOrc> ProgramImage::load(BPFtrace &bpftrace,
+                                           const std::string &image,
+                                           bool fake_maps)
+{
+  return load(bpftrace, image, {}, fake_maps);
+}
+
+std::unique_ptr<BpfOrc> ProgramImage::load(BPFtrace &bpftrace,
+                                           const std::string &image,
+                                           Sections sections,
+                                           bool fake_maps)
+{
+  ImageReader r(image.data(), image.size());
+  if (!r.magic(IMAGE_MAGIC))
+    throw std::runtime_error("not a program image");
+  if (r.u64() != IMAGE_VERSION)
+    throw std::runtime_error("unsupported program image version");
+
+  auto probes = read_probes(r);
+  auto special_probes = read_probes(r);
+
+  using Args = std::vector<std::tuple<std::string, std::vector<Field>>>;
+  auto read_args = [&]() {
+    Args args_list(r.count());
+    for (auto &args : args_list)
+    {
+      std::get<0>(args) = r.str();
+      std::get<1>(args).resize(r.count());
+      for (auto &field : std::get<1>(args))
+        field = read_field(r);
+    }
+    return args_list;
+  };
+  Args printf_args = read_args();
+  Args system_args = read_args();
+  Args seq_printf_args = read_args();
+  Args cat_args = read_args();
+  auto join_args = read_strings(r);
+  auto time_args = read_strings(r);
+  auto strftime_args = read_strings(r);
+  auto probe_ids = read_strings(r);
+
+  std::vector<SizedType> non_map_print_args(r.count());
+  for (auto &type : non_map_print_args)
+    type = read_type(r);
+
+  std::vector<std::vector<double>> quantiles_args(r.count());
+  for (auto &quantiles : quantiles_args)
+  {
+    quantiles.resize(r.count());
+    for (double &q : quantiles)
+    {
+      uint64_t bits = r.u64();
+      memcpy(&q, &bits, sizeof(q));
+    }
+  }
+
+  std::unordered_map<int64_t, HelperErrorInfo> helper_error_info;
+  for (size_t n = r.count(); n > 0; n--)
+  {
+    int64_t id = r.i64();
+    HelperErrorInfo info;
+    info.func_id = r.i64();
+    info.loc.begin.line = r.i64();
+    info.loc.begin.column = r.i64();
+    info.loc.end.line = r.i64();
+    info.loc.end.column = r.i64();
+    helper_error_info[id] = info;
+  }
+
+  std::vector<std::tuple<int, int>> seq_printf_ids(r.count());
+  for (auto &[idx, len] : seq_printf_ids)
+  {
+    idx = r.i64();
+    len = r.i64();
+  }
+  // The formats are stored back to back in the data map
+  if (seq_printf_ids.size() != seq_printf_args.size())
+    throw std::runtime_error("corrupt program image");
+  for (size_t i = 0, idx = 0; i < seq_printf_ids.size(); i++)
+  {
+    auto len = std::get<0>(seq_printf_args[i]).size() + 1;
+    if (static_cast<size_t>(std::get<0>(seq_printf_ids[i])) != idx ||
+        static_cast<size_t>(std::get<1>(seq_printf_ids[i])) != len)
+      throw std::runtime_error("corrupt program image");
+    idx += len;
+  }
+
+  std::map<std::string, Struct> structs = read_structs(r);
+
+  std::vector<FieldReloc> field_relocs(r.count());
+  std::vector<bool> kernel_fields;
+  for (auto &reloc : field_relocs)
+  {
+    reloc.record = r.str();
+    reloc.field = r.str();
+    reloc.offset = r.u64();
+    reloc.size = r.u64();
+    kernel_fields.push_back(r.b());
+  }
+
+  unsigned int join_argnum = r.u64();
+  unsigned int join_argsize = r.u64();
+  uint64_t scratch_size = r.u64();
+  uint64_t flight_event_size = r.u64();
+  bool has_usdt = r.b();
+  std::vector<uint64_t> settings;
+  for_each_setting(bpftrace, [&](const char *, auto &, bool in_image) {
+    if (in_image)
+      settings.push_back(r.u64());
+  });
+  std::vector<std::pair<uint32_t, std::string>> probe_gates(r.count());
+  for (auto &[gate, name] : probe_gates)
+  {
+    gate = r.u64();
+    name = r.str();
+  }
+
+  std::vector<MapImage> maps(r.count());
+  for (auto &m : maps)
+  {
+    m.name = r.str();
+    m.type = read_type(r);
+    m.key.args_.resize(r.count());
+    for (auto &arg : m.key.args_)
+      arg = read_type(r);
+    m.key.packed_.resize(r.count());
+    for (auto &slot : m.key.packed_)
+    {
+      slot.offset = r.u64();
+      slot.size = r.u64();
+      slot.is_signed = r.b();
+    }
+    if (m.key.is_packed() && m.key.packed_.size() != m.key.args_.size())
+      throw std::runtime_error("corrupt program image");
+    for (auto &slot : m.key.packed_)
+    {
+      if (slot.offset + slot.size > m.key.packed_size())
+        throw std::runtime_error("corrupt program image");
+    }
+    m.lqmin = r.i64();
+    m.lqmax = r.i64();
+    m.lqstep = r.i64();
+    m.max_entries = r.u64();
+    m.mmapped = r.b();
+    m.dense = r.b();
+    m.task_storage = r.b();
+    m.double_buffered = r.b();
+    m.hashed_key = r.b();
+    m.bucket_array = r.b();
+    m.bloom = r.b();
+    m.bloom_bytes = r.u64();
+    m.window_slots = r.u64();
+    m.window_slot_ns = r.u64();
+    m.ttl_ns = r.u64();
+    m.mapfd = r.i64();
+    m.outer_mapfd = r.i64();
+    m.window_outer_mapfd = r.i64();
+    m.sketch_mapfd = r.i64();
+    m.strings_mapfd = r.i64();
+    m.ttl_mapfd = r.i64();
+  }
+
+  std::vector<StackMapImage> stack_maps(r.count());
+  for (auto &m : stack_maps)
+  {
+    m.stack_type.limit = r.u64();
+    m.stack_type.mode = static_cast<StackMode>(r.u64());
+    m.max_entries = r.u64();
+    m.mapfd = r.i64();
+  }
+
+  std::vector<InternalMapImage> internal_maps(r.count());
+  for (auto &m : internal_maps)
+  {
+    uint64_t type = r.u64();
+    if (type > static_cast<uint64_t>(MapManager::Type::RawSymbolsPids))
+      throw std::runtime_error("corrupt program image");
+    m.type = static_cast<MapManager::Type>(type);
+    m.max_entries = r.u64();
+    m.mapfd = r.i64();
+  }
+
+  for (size_t n = r.count(); n > 0; n--)
+  {
+    std::string name = r.str();
+    sections.emplace_back(std::move(name), r.bytes());
+  }
+  if (!r.done())
+    throw std::runtime_error("corrupt program image");
+
+  std::set<int64_t> old_fds;
+  for (auto &m : maps)
+    old_fds.insert({ m.mapfd, m.outer_mapfd, m.sketch_mapfd });
+  for (auto &m : stack_maps)
+    old_fds.insert(m.mapfd);
+  for (auto &m : internal_maps)
+    old_fds.insert(m.mapfd);
+  for (auto &[name, data] : sections)
+  {
+    if (!is_code_section(name))
+      continue;
+    for_each_map_fd(data, [&](int32_t &fd) {
+      if (fd < 0 || !old_fds.count(fd))
+        throw std::runtime_error("program image references unknown map fd " +
+                                 std::to_string(fd));
+    });
+  }
+
+  auto field_offsets = relocate_fields(bpftrace, field_relocs, kernel_fields);
+  for (auto &[name, data] : sections)
+  {
+    if (!is_code_section(name))
+      continue;
+    for_each_field_offset(data, [&](int32_t reloc) -> int32_t {
+      if (reloc < 0 || static_cast<size_t>(reloc) >= field_offsets.size())
+        throw std::runtime_error("program image references unknown field " +
+                                 std::to_string(reloc));
+      return field_offsets[reloc];
+    });
+  }
+
+  // Everything was read, the program can replace what bpftrace has
+  bpftrace.probes_ = std::move(probes);
+  bpftrace.special_probes_ = std::move(special_probes);
+  bpftrace.printf_args_ = std::move(printf_args);
+  bpftrace.system_args_ = std::move(system_args);
+  bpftrace.seq_printf_args_ = std::move(seq_printf_args);
+  bpftrace.cat_args_ = std::move(cat_args);
+  bpftrace.join_args_ = std::move(join_args);
+  bpftrace.time_args_ = std::move(time_args);
+  bpftrace.strftime_args_ = std::move(strftime_args);
+  bpftrace.probe_ids_ = std::move(probe_ids);
+  bpftrace.non_map_print_args_ = std::move(non_map_print_args);
+  bpftrace.quantiles_args_ = std::move(quantiles_args);
+  bpftrace.helper_error_info_ = std::move(helper_error_info);
+  bpftrace.seq_printf_ids_ = std::move(seq_printf_ids);
+  bpftrace.structs_ = std::move(structs);
+  bpftrace.field_relocs_ = std::move(field_relocs);
+  bpftrace.join_argnum_ = join_argnum;
+  bpftrace.join_argsize_ = join_argsize;
+  bpftrace.scratch_size_ = scratch_size;
+  bpftrace.flight_event_size_ = flight_event_size;
+  bpftrace.has_usdt_ = has_usdt;
+  // Only those of an ELF file from --emit-elf can differ from the ones set,
+  // the cached programs being keyed on them
+  auto setting = settings.begin();
+  for_each_setting(bpftrace, [&](const char *, auto &value, bool in_image) {
+    if (in_image)
+      value = static_cast<std::decay_t<decltype(value)>>(*setting++);
+  });
+  bpftrace.probe_gates_ = std::move(probe_gates);
+  bpftrace.has_iter_ = false;
+  for (auto &probe : bpftrace.probes_)
+    bpftrace.has_iter_ |= probe.type == ProbeType::iter;
+  bpftrace.use_ringbuf_ = false;
+  for (auto &m : internal_maps)
+    bpftrace.use_ringbuf_ |= m.type == MapManager::Type::Ringbuf;
+
+  std::unordered_map<int64_t, int> fds;
+  bool maps_ok = fake_maps
+                     ? create_maps<FakeMap>(
+                           bpftrace, maps, stack_maps, internal_maps, fds)
+                     : create_maps<Map>(
+                           bpftrace, maps, stack_maps, internal_maps, fds);
+  if (!maps_ok)
+  {
+    LOG(ERROR) << "Creation of the required BPF maps has failed.";
+    return nullptr;
+  }
+
+  auto bpforc = BpfOrc::Create();
+  for (auto &[name, data] : sections)
+  {
+    if (is_code_section(name))
+      for_each_map_fd(data, [&](int32_t &fd) { fd = fds.at(fd); });
+    bpforc->addSection(name, std::move(data));
+  }
+  return bpforc;
+}
+
+bool ProgramImage::is_elf(const std::string &data)
+{
+  return data.size() >= SELFMAG && memcmp(data.data(), ELFMAG, SELFMAG) == 0;
+}
+
+std::unique_ptr<BpfOrc> ProgramImage::load_elf(BPFtrace &bpftrace,
+                                               const std::string &elf,
+                                               bool fake_maps)
+{
+  auto data = reinterpret_cast<const uint8_t *>(elf.data());
+  auto ehdr = reinterpret_cast<const Elf64_Ehdr *>(data);
+  if (!is_elf(elf) || elf.size() < sizeof(Elf64_Ehdr) ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_BPF ||
+      ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+      ehdr->e_shoff > elf.size() ||
+      ehdr->e_shnum * sizeof(Elf64_Shdr) > elf.size() - ehdr->e_shoff ||
+      ehdr->e_shstrndx >= ehdr->e_shnum)
+    throw std::runtime_error("not a BPF ELF file");
+
+  auto shdrs = reinterpret_cast<const Elf64_Shdr *>(data + ehdr->e_shoff);
+  for (size_t i = 0; i < ehdr->e_shnum; i++)
+  {
+    if (shdrs[i].sh_type != SHT_NOBITS &&
+        (shdrs[i].sh_offset > elf.size() ||
+         shdrs[i].sh_size > elf.size() - shdrs[i].sh_offset))
+      throw std::runtime_error("truncated ELF file");
+  }
+  // A SHT_NOBITS one has no contents in the file to read the names from
+  auto &strtab = shdrs[ehdr->e_shstrndx];
+  if (strtab.sh_type == SHT_NOBITS)
+    throw std::runtime_error("corrupt ELF file");
+  auto section_name = [&](const Elf64_Shdr &shdr) {
+    if (shdr.sh_name >= strtab.sh_size)
+      throw std::runtime_error("corrupt ELF file");
+    auto name = reinterpret_cast<const char *>(data + strtab.sh_offset +
+                                               shdr.sh_name);
+    return std::string(name, strnlen(name, strtab.sh_size - shdr.sh_name));
+  };
+
+  std::string image;
+  bool has_image = false;
+  Sections sections;
+  for (size_t i = 0; i < ehdr->e_shnum; i++)
+  {
+    auto &shdr = shdrs[i];
+    std::string name = section_name(shdr);
+    auto contents = data + shdr.sh_offset;
+    if (shdr.sh_type == SHT_PROGBITS && name == PROGRAM_IMAGE_SECTION)
+    {
+      image.assign(reinterpret_cast<const char *>(contents), shdr.sh_size);
+      has_image = true;
+    }
+    else if (shdr.sh_type == SHT_PROGBITS && is_code_section(name))
+    {
+      sections.emplace_back(
+          name, std::vector<uint8_t>(contents, contents + shdr.sh_size));
+    }
+    // Codegen doesn't emit anything to relocate, the program isn't linked
+    // here anyway
+    else if ((shdr.sh_type == SHT_REL || shdr.sh_type == SHT_RELA) &&
+             shdr.sh_size > 0 && shdr.sh_info < ehdr->e_shnum &&
+             is_code_section(section_name(shdrs[shdr.sh_info])))
+    {
+      throw std::runtime_error("relocations of " +
+                               section_name(shdrs[shdr.sh_info]) +
+                               " aren't supported");
+    }
+  }
+  if (!has_image)
+    throw std::runtime_error("no " + PROGRAM_IMAGE_SECTION +
+                             " section, it wasn't written by --emit-elf");
+  return load(bpftrace, image, std::move(sections), fake_maps);
+}
+
+namespace {
+
+using FileStamps = std::vector<std::tuple<std::string, uint64_t, uint64_t>>;
+
+// File in dir named after a hash of key, which it also holds to tell hash
+// collisions apart
+std::string cache_path(const std::string &dir,
+                       const std::string &key,
+                       const std::string &extension)
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : key)
+  {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  std::ostringstream name;
+  name << std::hex << hash;
+  return dir + "/" + name.str() + extension;
+}
+
+// Size and modification time of the given files, the ones that don't exist
+// are left out
+FileStamps file_stamps(const std::set<std::string> &paths)
+{
+  FileStamps stamps;
+  for (auto &path : paths)
+  {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+      continue;
+    uint64_t mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                     st.st_mtim.tv_nsec;
+    stamps.emplace_back(path, st.st_size, mtime);
+  }
+  return stamps;
+}
+
+void write_file_stamps(ImageWriter &w, const FileStamps &stamps)
+{
+  w.u64(stamps.size());
+  for (auto &[path, size, mtime] : stamps)
+  {
+    w.str(path);
+    w.u64(size);
+    w.u64(mtime);
+  }
+}
+
+// Whether the files read still are the way they were stamped
+bool check_file_stamps(ImageReader &r)
+{
+  FileStamps stamps(r.count());
+  for (auto &[path, size, mtime] : stamps)
+  {
+    path = r.str();
+    size = r.u64();
+    mtime = r.u64();
+  }
+  return std::all_of(stamps.begin(), stamps.end(), [](auto &stamp) {
+    auto current = file_stamps({ std::get<0>(stamp) });
+    return current.size() == 1 && current[0] == stamp;
+  });
+}
+
+// The files stamped, from a reader copied ahead of check_file_stamps()
+void read_file_stamp_paths(ImageReader r, std::set<std::string> &paths)
+{
+  for (uint64_t i = 0, n = r.count(); i < n; i++)
+  {
+    paths.insert(r.str());
+    r.u64();
+    r.u64();
+  }
+}
+
+std::string read_file(const std::string &path)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return "";
+  std::stringstream buf;
+  buf << in.rdbuf();
+  return buf.str();
+}
+
+} // namespace
+
+ProgramCache::ProgramCache(const std::string &dir, std::string key)
+    : key_(std::move(key)), path_(cache_path(dir, key_, ".prog"))
+{
+}
+
+std::string ProgramCache::key(BPFtrace &bpftrace,
+                              const std::string &program,
+                              const std::vector<std::string> &include_dirs,
+                              const std::vector<std::string> &include_files)
+{
+  std::ostringstream key;
+  key << BuildInfo::report();
+
+  struct utsname utsname;
+  uname(&utsname);
+  key << "kernel: " << utsname.release << " " << utsname.version << " "
+      << utsname.machine << std::endl;
+  key << bpftrace.feature_->report();
+
+  key << "program: " << program.size() << std::endl << program << std::endl;
+  for (size_t i = 1; i <= bpftrace.num_params(); i++)
+  {
+    auto param = bpftrace.get_param(i, false);
+    key << "param: " << param.size() << " " << param << std::endl;
+  }
+  for (auto &dir : include_dirs)
+    key << "include dir: " << dir << std::endl;
+  for (auto &file : include_files)
+  {
+    std::ifstream in(file);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    key << "include: " << file << " " << contents.str().size() << std::endl
+        << contents.str() << std::endl;
+  }
+
+  for_each_setting(bpftrace, [&](const char *name, auto &value, bool) {
+    key << name << ": " << static_cast<uint64_t>(value) << std::endl;
+  });
+  key << "pid: " << bpftrace.pid() << std::endl
+      << "cgroup filter: " << bpftrace.cgroup_filter_ << std::endl
+      << "pin maps: " << !bpftrace.pin_maps_dir_.empty() << std::endl
+      << "raw symbols: " << (bpftrace.raw_symbols_ != nullptr) << std::endl;
+  return key.str();
+}
+
+bool ProgramCache::load(BPFtrace &bpftrace, std::unique_ptr<BpfOrc> &bpforc)
+{
+  std::string data = read_file(path_);
+  if (data.empty())
+    return false;
+
+  try
+  {
+    ImageReader r(data.data(), data.size());
+    if (!r.magic(CACHE_MAGIC) || r.str() != key_ || !check_file_stamps(r))
+      return false;
+    std::string image = r.str();
+
+    bpforc = ProgramImage::load(bpftrace, image);
+  }
+  catch (const std::runtime_error &e)
+  {
+    LOG(WARNING) << "Ignoring the cached program " << path_ << ": "
+                 << e.what();
+    return false;
+  }
+  return true;
+}
+
+void ProgramCache::store(BPFtrace &bpftrace, BpfOrc &bpforc)
+{
+  // The files the probes attach to, and the headers the types come from
+  std::set<std::string> paths = bpftrace.included_files_;
+  for (auto &probe : bpftrace.probes_)
+  {
+    if (is_userspace_probe(probe.type) && !probe.path.empty())
+      paths.insert(probe.path);
+  }
+
+  ImageWriter w;
+  w.raw(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  w.str(key_);
+  write_file_stamps(w, file_stamps(paths));
+  w.str(ProgramImage::save(bpftrace, bpforc.getSections()));
+
+  if (!write_file_atomic(path_, w.data()))
+    LOG(WARNING) << "Could not write the compiled program to " << path_;
+}
+
+DefinitionsCache::DefinitionsCache(const std::string &dir, std::string key)
+    : key_(std::move(key)), path_(cache_path(dir, key_, ".defs"))
+{
+}
+
+std::string DefinitionsCache::key(BPFtrace &bpftrace,
+                                  const std::string &input,
+                                  const std::vector<const char *> &args,
+                                  unsigned int type_res_iterations)
+{
+  std::ostringstream key;
+  key << BuildInfo::report();
+
+  struct utsname utsname;
+  uname(&utsname);
+  key << "kernel: " << utsname.release << " " << utsname.version << " "
+      << utsname.machine << std::endl;
+  key << "btf: " << bpftrace.btf_.has_data() << " " << bpftrace.btf_.id()
+      << std::endl;
+
+  key << "input: " << input.size() << std::endl << input << std::endl;
+  for (auto arg : args)
+    key << "arg: " << arg << std::endl;
+  key << "type resolution iterations: " << type_res_iterations << std::endl;
+
+  // What the earlier passes found, the types to take from BTF among others
+  std::string definitions = ProgramImage::save_definitions(bpftrace);
+  key << "definitions: " << definitions.size() << std::endl << definitions;
+  return key.str();
+}
+
+bool DefinitionsCache::load(BPFtrace &bpftrace)
+{
+  std::string data = read_file(path_);
+  if (data.empty())
+    return false;
+
+  try
+  {
+    ImageReader r(data.data(), data.size());
+    if (!r.magic(DEFINITIONS_MAGIC) || r.str() != key_)
+      return false;
+    ImageReader headers = r;
+    if (!check_file_stamps(r))
+      return false;
+    std::string definitions = r.str();
+    if (!r.done())
+      throw std::runtime_error("corrupt definitions image");
+
+    ProgramImage::load_definitions(bpftrace, definitions);
+    bpftrace.included_files_.clear();
+    read_file_stamp_paths(headers, bpftrace.included_files_);
+  }
+  catch (const std::runtime_error &e)
+  {
+    LOG(WARNING) << "Ignoring the cached type definitions " << path_ << ": "
+                 << e.what();
+    return false;
+  }
+  return true;
+}
+
+void DefinitionsCache::store(BPFtrace &bpftrace,
+                             const std::set<std::string> &headers)
+{
+  ImageWriter w;
+  w.raw(DEFINITIONS_MAGIC, sizeof(DEFINITIONS_MAGIC));
+  w.str(key_);
+  write_file_stamps(w, file_stamps(headers));
+  w.str(ProgramImage::save_definitions(bpftrace));
+
+  if (!write_file_atomic(path_, w.data()))
+    LOG(WARNING) << "Could not write the type definitions to " << path_;
+}
+
+HeaderCache::HeaderCache(const std::string &dir, std::string key)
+    : key_(std::move(key)),
+      path_(cache_path(dir, key_, ".hdrs")),
+      pch_path_(cache_path(dir, key_, ".pch"))
+{
+}
+
+std::string HeaderCache::key(const std::string &includes,
+                             const std::vector<const char *> &args)
+{
+  std::ostringstream key;
+  key << BuildInfo::report();
+
+  struct utsname utsname;
+  uname(&utsname);
+  key << "kernel: " << utsname.release << " " << utsname.version << " "
+      << utsname.machine << std::endl;
+
+  key << "includes: " << includes.size() << std::endl
+      << includes << std::endl;
+  for (auto arg : args)
+    key << "arg: " << arg << std::endl;
+  return key.str();
+}
+
+std::string HeaderCache::load(std::set<std::string> &headers)
+{
+  std::string data = read_file(path_);
+  if (data.empty() || access(pch_path_.c_str(), R_OK))
+    return "";
+
+  try
+  {
+    ImageReader r(data.data(), data.size());
+    if (!r.magic(HEADERS_MAGIC) || r.str() != key_)
+      return "";
+    // Read twice, once to check them and once for the names
+    ImageReader names = r;
+    if (!check_file_stamps(r))
+      return "";
+    read_file_stamp_paths(names, headers);
+  }
+  catch (const std::runtime_error &e)
+  {
+    LOG(WARNING) << "Ignoring the cached headers " << path_ << ": "
+                 << e.what();
+    return "";
+  }
+  return pch_path_;
+}
+
+std::string HeaderCache::tmp_path() const
+{
+  return atomic_tmp_path(pch_path_);
+}
+
+bool HeaderCache::store(const std::set<std::string> &headers)
+{
+  std::string tmp = tmp_path();
+  if (rename(tmp.c_str(), pch_path_.c_str()))
+  {
+    unlink(tmp.c_str());
+    LOG(WARNING) << "Could not write the precompiled headers to "
+                 << pch_path_;
+    return false;
+  }
+
+  ImageWriter w;
+  w.raw(HEADERS_MAGIC, sizeof(HEADERS_MAGIC));
+  w.str(key_);
+  write_file_stamps(w, file_stamps(headers));
+
+  if (!write_file_atomic(path_, w.data()))
+    LOG(WARNING) << "Could not write the precompiled headers to " << path_;
+  return true;
+}
+
+void HeaderCache::remove()
+{
+  unlink(path_.c_str());
+  unlink(pch_path_.c_str());
+}
+
+} // namespace bpftrace
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bpforc.h"
+#include "types.h"
+
+namespace bpftrace {
+
+class BPFtrace;
+class ImageWriter;
+class ImageReader;
+class PinnedMap;
+struct Field;
+struct Struct;
+
+// Section of the ELF files written by --emit-elf the ProgramImage of their
+// program is stored in, without the code
+const std::string PROGRAM_IMAGE_SECTION = ".bpftrace";
+
+/**
+   A compiled script: the code sections of its probes, along with everything
+   the semantic analyser and codegen leave in BPFtrace for run() to use (the
+   probes, the printf()/system()/cat()/time() arguments, the maps and so on).
+
+   Map fds are baked into the instructions, so loading an image creates the
+   maps it was compiled against again and patches the new fds into the code.
+*/
+class ProgramImage
+{
+public:
+  /**
+     Serializes the program bpftrace just compiled, with its code sections
+  */
+  static std::string save(BPFtrace &bpftrace, const SectionMap &sections);
+
+  /**
+     Restores a saved program into bpftrace, which must not have compiled
+     anything yet, and creates its maps. The offsets of the fields of kernel
+     structs it was compiled to relocate are looked up in the BTF of this
+     kernel. Throws std::runtime_error if the image is corrupt or one of the
+     fields isn't there, bpftrace is left untouched then. Returns nullptr if
+     the maps couldn't be created, the error has been logged.
+
+     fake_maps creates FakeMaps instead, like the semantic analyser does in
+     debug mode.
+  */
+  static std::unique_ptr<BpfOrc> load(BPFtrace &bpftrace,
+                                      const std::string &image,
+                                      bool fake_maps = false);
+
+  /**
+     Restores a program from the contents of an ELF file written by
+     --emit-elf, like load() does
+  */
+  static std::unique_ptr<BpfOrc> load_elf(BPFtrace &bpftrace,
+                                          const std::string &elf,
+                                          bool fake_maps = false);
+
+  static bool is_elf(const std::string &data);
+
+  /**
+     Serializes the type definitions, macros and enums the clang parser
+     leaves in bpftrace, along with the types it takes from BTF
+  */
+  static std::string save_definitions(BPFtrace &bpftrace);
+
+  /**
+     Restores what save_definitions() saved. Throws std::runtime_error if the
+     image is corrupt, bpftrace is left untouched then.
+  */
+  static void load_definitions(BPFtrace &bpftrace, const std::string &image);
+
+  /**
+     Serializes the count(), sum(), min(), max(), avg(), stats(), hist(),
+     lhist(), llhist() and distinct() maps of bpftrace for --snapshot, with
+     their raw state: the counts of the buckets, the count and total of each
+     key of avg() and stats(), the HyperLogLog registers of distinct(). The
+     names of the maps saved are added to saved, the maps keyed by what only
+     means something on this host (e.g. stacks) are left out with a warning.
+  */
+  static std::string save_snapshot(BPFtrace &bpftrace,
+                                   std::set<std::string> &saved);
+
+  /**
+     Merges a snapshot into bpftrace for --merge, adding the maps it has no
+     SnapshotMap of yet. Snapshots of the same program on several hosts merge
+     into exactly what a single host would have. Throws std::runtime_error if
+     the snapshot is corrupt or has a map of the same name but another type,
+     bpftrace is left untouched then.
+  */
+  static void merge_snapshot(BPFtrace &bpftrace, const std::string &snapshot);
+
+  /**
+     Serializes the layout of the maps of bpftrace for --pin-maps: their
+     types, their keys and how they were created, with the structs their
+     values are printed with
+  */
+  static std::string save_map_layout(BPFtrace &bpftrace);
+
+  /**
+     Restores the maps of a layout for --attach-session, as PinnedMaps whose
+     fds are still to be opened, and its structs into bpftrace. Throws
+     std::runtime_error if the layout is corrupt.
+  */
+  static std::vector<std::unique_ptr<PinnedMap>> load_map_layout(
+      BPFtrace &bpftrace,
+      const std::string &layout);
+
+private:
+  using Sections = std::vector<std::pair<std::string, std::vector<uint8_t>>>;
+  // Sections are added to the ones of the image
+  static std::unique_ptr<BpfOrc> load(BPFtrace &bpftrace,
+                                      const std::string &image,
+                                      Sections sections,
+                                      bool fake_maps);
+
+  static void write_type(ImageWriter &w, const SizedType &type);
+  static SizedType read_type(ImageReader &r);
+  static void write_field(ImageWriter &w, const Field &field);
+  static Field read_field(ImageReader &r);
+  static void write_structs(ImageWriter &w,
+                            const std::map<std::string, Struct> &structs);
+  static std::map<std::string, Struct> read_structs(ImageReader &r);
+};
+
+/**
+   Compiled programs stored in a directory, see BPFTRACE_PROGRAM_CACHE_DIR
+
+   They are keyed by everything the compilation of a script depends on:
+   the bpftrace version, the script and its parameters, the files it
+   includes, the settings codegen looks at, the kernel and the BPF features
+   it has. The binaries uprobes and USDT probes attach to are checked to be
+   the ones the program was compiled against when it's loaded.
+*/
+class ProgramCache
+{
+public:
+  ProgramCache(const std::string &dir, std::string key);
+
+  /**
+     Key of program, compiled by bpftrace with the given -I and --include
+     options
+  */
+  static std::string key(BPFtrace &bpftrace,
+                         const std::string &program,
+                         const std::vector<std::string> &include_dirs,
+                         const std::vector<std::string> &include_files);
+
+  /**
+     Loads the cached program into bpftrace. Returns false if there is none
+     that is still valid, or true and sets bpforc (to nullptr if the maps
+     couldn't be created) otherwise.
+  */
+  bool load(BPFtrace &bpftrace, std::unique_ptr<BpfOrc> &bpforc);
+
+  /**
+     Stores the program bpftrace just compiled into bpforc
+  */
+  void store(BPFtrace &bpftrace, BpfOrc &bpforc);
+
+  const std::string &path() const
+  {
+    return path_;
+  }
+
+private:
+  std::string key_;
+  // File named after a hash of the key, which it also holds to tell hash
+  // collisions apart
+  std::string path_;
+};
+
+/**
+   Type definitions the clang parser resolved, stored in the directory of
+   BPFTRACE_PROGRAM_CACHE_DIR, so that scripts using the same types don't
+   need to dump them from BTF and have libclang parse them again
+
+   They are keyed by the bpftrace version, the kernel and its BTF data, the
+   C definitions and clang arguments of the script, and the types the earlier
+   passes asked for. The headers clang read are checked to be unchanged when
+   they're loaded.
+*/
+class DefinitionsCache
+{
+public:
+  DefinitionsCache(const std::string &dir, std::string key);
+
+  /**
+     Key of the definitions parsed from input with args, taking types from
+     BTF through at most type_res_iterations levels of nesting
+  */
+  static std::string key(BPFtrace &bpftrace,
+                         const std::string &input,
+                         const std::vector<const char *> &args,
+                         unsigned int type_res_iterations);
+
+  /**
+     Loads the cached definitions into bpftrace. Returns false if there are
+     none that are still valid.
+  */
+  bool load(BPFtrace &bpftrace);
+
+  /**
+     Stores the definitions bpftrace was just given by parsing the headers
+  */
+  void store(BPFtrace &bpftrace, const std::set<std::string> &headers);
+
+private:
+  std::string key_;
+  std::string path_;
+};
+
+/**
+   Precompiled header of the #include lines the C definitions of a script
+   start with, stored in the directory of BPFTRACE_PROGRAM_CACHE_DIR, so that
+   scripts including the same kernel headers don't need libclang to parse
+   them again, only their own definitions
+
+   They are keyed by the bpftrace version, the kernel, the #include lines and
+   the clang arguments (the kernel headers path and cflags, -I and
+   --include). The headers clang read are checked to be unchanged when
+   they're loaded, clang then checks them again itself.
+*/
+class HeaderCache
+{
+public:
+  HeaderCache(const std::string &dir, std::string key);
+
+  /**
+     Key of the precompiled header of includes, parsed with args
+  */
+  static std::string key(const std::string &includes,
+                         const std::vector<const char *> &args);
+
+  /**
+     Path of the stored precompiled header, or "" if there is none that is
+     still valid. Sets headers to the files it was made of.
+  */
+  std::string load(std::set<std::string> &headers);
+
+  /**
+     Where libclang is to save a new precompiled header for store()
+  */
+  std::string tmp_path() const;
+
+  /**
+     Stores the precompiled header saved at tmp_path(), made of headers.
+     Returns false if it couldn't be, it's then left at path().
+  */
+  bool store(const std::set<std::string> &headers);
+
+  /**
+     Removes the stored precompiled header, for one clang rejected
+  */
+  void remove();
+
+  const std::string &path() const
+  {
+    return pch_path_;
+  }
+
+private:
+  std::string key_;
+  // Holds the key and the stamps of the headers, the precompiled header
+  // itself is saved next to it by libclang
+  std::string path_;
+  std::string pch_path_;
+};
+
+} // namespace bpftrace
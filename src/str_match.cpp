@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+#include "str_match.h"
+
+namespace bpftrace {
+
+// Parses the set starting with the '[' at pattern[i] into chars, returns the
+// index of its closing ']'
+static size_t parse_set(const std::string &pattern,
+                        size_t i,
+                        std::array<bool, 256> &chars)
+{
+  std::array<bool, 256> set = {};
+  size_t end = pattern.size();
+  i++;
+  bool negated = i < end && (pattern[i] == '!' || pattern[i] == '^');
+  if (negated)
+    i++;
+
+  // A ']' right after the '[' is part of the set
+  for (size_t first = i; i < end && (pattern[i] != ']' || i == first); i++)
+  {
+    uint8_t lo = pattern[i];
+    if (lo == '\\' && i + 1 < end)
+      lo = pattern[++i];
+    uint8_t hi = lo;
+    if (i + 2 < end && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+    {
+      i += 2;
+      hi = pattern[i];
+      if (hi == '\\' && i + 1 < end)
+        hi = pattern[++i];
+      if (hi < lo)
+        throw std::invalid_argument("the range of '[' " +
+                                    std::string(1, lo) + "-" +
+                                    std::string(1, hi) + " is reversed");
+    }
+    for (unsigned c = lo; c <= hi; c++)
+      set[c] = true;
+  }
+  if (i == end)
+    throw std::invalid_argument("the '[' isn't closed");
+
+  for (size_t c = 0; c < set.size(); c++)
+    chars[c] = set[c] != negated;
+  return i;
+}
+
+StrMatcher StrMatcher::glob(const std::string &pattern)
+{
+  std::vector<Token> tokens;
+  for (size_t i = 0; i < pattern.size(); i++)
+  {
+    Token token;
+    char c = pattern[i];
+    if (c == '*')
+    {
+      // "**" matches what '*' does
+      if (!tokens.empty() && tokens.back().star)
+        continue;
+      token.star = true;
+    }
+    else if (c == '?')
+    {
+      token.chars.fill(true);
+    }
+    else if (c == '[')
+    {
+      i = parse_set(pattern, i, token.chars);
+    }
+    else
+    {
+      if (c == '\\')
+      {
+        if (++i == pattern.size())
+          throw std::invalid_argument("the pattern ends with a '\\'");
+        c = pattern[i];
+      }
+      token.chars[static_cast<uint8_t>(c)] = true;
+    }
+    tokens.push_back(token);
+  }
+  return StrMatcher(tokens);
+}
+
+StrMatcher StrMatcher::contains(const std::string &substr)
+{
+  std::vector<Token> tokens(1);
+  tokens[0].star = true;
+  for (char c : substr)
+  {
+    Token token;
+    token.chars[static_cast<uint8_t>(c)] = true;
+    tokens.push_back(token);
+  }
+  if (!substr.empty())
+    tokens.push_back(tokens[0]);
+  return StrMatcher(tokens);
+}
+
+// The subset construction of the automaton matching the tokens one after
+// the other, '*' matching any number of characters
+StrMatcher::StrMatcher(const std::vector<Token> &tokens)
+{
+  // A state is the set of the numbers of tokens that may have been matched
+  using Positions = std::vector<bool>;
+  size_t end = tokens.size();
+  auto skip_stars = [&](Positions &p) {
+    for (size_t i = 0; i < end; i++)
+      if (p[i] && tokens[i].star)
+        p[i + 1] = true;
+    // Past a final '*' whatever else may have been matched makes no
+    // difference, the string matches
+    if (end > 0 && p[end] && tokens[end - 1].star)
+    {
+      p.assign(end + 1, false);
+      p[end - 1] = p[end] = true;
+    }
+  };
+
+  std::map<Positions, int> ids;
+  std::vector<Positions> sets;
+  auto add = [&](Positions p) {
+    if (std::find(p.begin(), p.end(), true) == p.end())
+      return REJECTED;
+    auto found = ids.find(p);
+    if (found != ids.end())
+      return found->second;
+    if (sets.size() == MAX_STATES)
+      throw std::invalid_argument("the pattern needs more than " +
+                                  std::to_string(MAX_STATES) + " states");
+    int id = sets.size();
+    ids.emplace(p, id);
+    sets.push_back(std::move(p));
+    return id;
+  };
+
+  Positions start(end + 1, false);
+  start[0] = true;
+  skip_stars(start);
+  add(std::move(start));
+
+  for (size_t state = 0; state < sets.size(); state++)
+  {
+    std::array<int, 256> next;
+    next[0] = REJECTED;
+    for (unsigned c = 1; c < next.size(); c++)
+    {
+      Positions to(end + 1, false);
+      for (size_t i = 0; i < end; i++)
+      {
+        if (!sets[state][i])
+          continue;
+        if (tokens[i].star)
+          to[i] = true;
+        else if (tokens[i].chars[c])
+          to[i + 1] = true;
+      }
+      skip_stars(to);
+      next[c] = add(std::move(to));
+    }
+    next_.push_back(next);
+    accepting_.push_back(sets[state][end]);
+  }
+}
+
+bool StrMatcher::matched(size_t state) const
+{
+  if (!accepting_[state])
+    return false;
+  for (unsigned c = 1; c < next_[state].size(); c++)
+    if (next_[state][c] != static_cast<int>(state))
+      return false;
+  return true;
+}
+
+bool StrMatcher::matches(const std::string &s) const
+{
+  int state = 0;
+  for (char ch : s)
+  {
+    uint8_t c = ch;
+    if (c == 0 || matched(state))
+      break;
+    state = next_[state][c];
+    if (state == REJECTED)
+      return false;
+  }
+  return accepting_[state];
+}
+
+} // namespace bpftrace
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bpftrace {
+
+/**
+   Deterministic automaton matching a string against the pattern of glob()
+   or strcontains(), built when the program is compiled so that the BPF
+   programs only have to follow one transition per character.
+
+   The automaton reads the string up to its first NUL. State 0 is the start,
+   a transition to REJECTED means the string can't match whatever follows.
+*/
+class StrMatcher
+{
+public:
+  static constexpr int REJECTED = -1;
+  // Most states of an automaton, each is code in every program using it
+  static constexpr size_t MAX_STATES = 64;
+
+  /**
+     Matches strings as fnmatch() does without flags: '*' matches any
+     characters, '/' included, '?' any single one, "[a-z]" and "[!a-z]" (or
+     "[^a-z]") a character of a set or of its complement, and '\' the
+     character after it. Throws std::invalid_argument on a malformed pattern
+     or one needing more than MAX_STATES states.
+  */
+  static StrMatcher glob(const std::string &pattern);
+  // Strings holding substr
+  static StrMatcher contains(const std::string &substr);
+
+  size_t states() const
+  {
+    return next_.size();
+  }
+  int next(size_t state, uint8_t c) const
+  {
+    return next_[state][c];
+  }
+  // Whether the string matches if it ends in state
+  bool accepting(size_t state) const
+  {
+    return accepting_[state];
+  }
+  // Whether the string matches whatever follows once in state
+  bool matched(size_t state) const;
+
+  bool matches(const std::string &s) const;
+
+private:
+  // What one character of the pattern matches, '*' excepted
+  struct Token
+  {
+    bool star = false;
+    std::array<bool, 256> chars = {};
+  };
+  explicit StrMatcher(const std::vector<Token> &tokens);
+
+  // Indexed by the state, then by the character. The NUL character ends the
+  // string and has no transition.
+  std::vector<std::array<int, 256>> next_;
+  std::vector<bool> accepting_;
+};
+
+} // namespace bpftrace
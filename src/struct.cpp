@@ -1,5 +1,7 @@
 #include "struct.h"
+#include "log.h"
 #include <iomanip>
+#include <limits>
 
 namespace bpftrace {
 
@@ -13,6 +15,51 @@ bool Bitfield::operator!=(const Bitfield &other) const {
   return !(*this == other);
 }
 
+Bitfield Bitfield::Create(size_t bit_offset, size_t bit_width)
+{
+  // Algorithm description:
+  // To handle bitfields, we need to give codegen 3 additional pieces
+  // of information: `read_bytes`, `access_rshift`, and `mask`.
+  //
+  // `read_bytes` tells codegen how many bytes to read starting at `Field::offset`.
+  // This information is necessary because we can't always issue, for example, a
+  // 1 byte read, as the bitfield could be the last 4 bits of the struct. Reading
+  // past the end of the struct could cause a page fault. Therefore, we compute the
+  // minimum number of bytes necessary to fully read the bitfield. This will always
+  // keep the read within the bounds of the struct.
+  //
+  // `access_rshift` tells codegen how much to shift the masked value so that the
+  // LSB of the bitfield is the LSB of the interpreted integer.
+  //
+  // `mask` tells codegen how to mask out the surrounding bitfields.
+  Bitfield bitfield;
+  size_t bitfield_offset = bit_offset % 8;
+  size_t bitfield_bitwidth = bit_width;
+  size_t bitfield_bitdidth_max = sizeof(uint64_t) * 8;
+
+  if (bitfield_bitwidth > bitfield_bitdidth_max)
+  {
+    LOG(WARNING) << "bitfiled bitwidth " << bitfield_bitwidth
+                 << "is not supporeted."
+                 << " Use bitwidth " << bitfield_bitdidth_max;
+    bitfield_bitwidth = bitfield_bitdidth_max;
+  }
+  if (bitfield_bitwidth == bitfield_bitdidth_max)
+    bitfield.mask = std::numeric_limits<uint64_t>::max();
+  else
+    bitfield.mask = (1ULL << bitfield_bitwidth) - 1;
+  // Round up to nearest byte
+  bitfield.read_bytes = (bitfield_offset + bitfield_bitwidth + 7) / 8;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  bitfield.access_rshift = bitfield_offset;
+#else
+  bitfield.access_rshift = (bitfield.read_bytes * 8 - bitfield_offset -
+                            bitfield_bitwidth);
+#endif
+
+  return bitfield;
+}
+
 std::unique_ptr<Tuple> Tuple::Create(std::vector<SizedType> fields)
 {
   // See llvm::StructLayout::StructLayout source
@@ -10,6 +10,9 @@ struct Bitfield
   bool operator==(const Bitfield &other) const;
   bool operator!=(const Bitfield &other) const;
 
+  // Bitfield bit_width bits wide, starting bit_offset bits into its struct
+  static Bitfield Create(size_t bit_offset, size_t bit_width);
+
   // Read `read_bytes` bytes starting from this field's offset
   size_t read_bytes;
   // Then rshift the resulting value by `access_rshift` to get field value
@@ -36,6 +39,22 @@ struct Field
 };
 
 using FieldsMap = std::map<std::string, Field>;
+
+// src_reg of the ld_imm64 that loads the offset of a relocated field, its imm
+// is the index of the FieldReloc. The kernel doesn't define it, the program
+// image loader replaces it with the offset on the kernel loaded on.
+const int BPF_PSEUDO_FIELD_OFFSET = 15;
+
+// Field of a kernel struct whose offset is looked up again in the BTF of the
+// kernel a program compiled with --emit-elf is loaded on
+struct FieldReloc
+{
+  std::string record;
+  std::string field;
+  // As the program was compiled
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
 using TupleFields = std::vector<Field>;
 
 struct Struct
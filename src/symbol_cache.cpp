@@ -0,0 +1,626 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bcc/bcc_elf.h>
+#include <bcc/bcc_syms.h>
+
+#include "log.h"
+#include "mapped_file.h"
+#include "symbol_cache.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+namespace {
+
+// How often the mappings of a process are read again, and how often at most
+// when they don't cover an address
+const auto MAPS_REFRESH_INTERVAL = std::chrono::seconds(1);
+const auto MAPS_MISS_INTERVAL = std::chrono::milliseconds(10);
+// Caches kept by ProcSymcaches before starting over
+const size_t MAX_SYMCACHES = 1024;
+
+const char INDEX_MAGIC[8] = { 'B', 'T', 'S', 'Y', 'M', 'I', 'D', 'X' };
+const uint32_t INDEX_VERSION = 1;
+
+struct IndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nloads;
+  uint64_t nsyms;
+  uint64_t names_size;
+};
+
+std::string read_build_id(const MappedFile &file)
+{
+  size_t nphdrs = 0;
+  const Elf64_Phdr *phdrs = program_headers(file, nphdrs);
+  if (!phdrs)
+    return "";
+
+  auto align4 = [](size_t n) { return (n + 3) & ~size_t(3); };
+  for (size_t i = 0; i < nphdrs; i++)
+  {
+    if (phdrs[i].p_type != PT_NOTE ||
+        phdrs[i].p_offset + phdrs[i].p_filesz > file.size())
+      continue;
+
+    size_t pos = phdrs[i].p_offset;
+    size_t end = pos + phdrs[i].p_filesz;
+    while (pos + sizeof(Elf64_Nhdr) <= end)
+    {
+      auto nhdr = reinterpret_cast<const Elf64_Nhdr *>(file.data() + pos);
+      size_t name = pos + sizeof(Elf64_Nhdr);
+      size_t desc = name + align4(nhdr->n_namesz);
+      size_t next = desc + align4(nhdr->n_descsz);
+      if (next > end)
+        break;
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(file.data() + name, "GNU", 4) == 0 && nhdr->n_descsz > 0)
+      {
+        static const char hex[] = "0123456789abcdef";
+        std::string id;
+        for (size_t j = 0; j < nhdr->n_descsz; j++)
+        {
+          uint8_t byte = file.data()[desc + j];
+          id += hex[byte >> 4];
+          id += hex[byte & 0xf];
+        }
+        return id;
+      }
+      pos = next;
+    }
+  }
+  return "";
+}
+
+#ifdef HAVE_BCC_ELF_FOREACH_SYM
+struct SymbolList
+{
+  std::vector<SymbolIndex::Symbol> syms;
+  std::string names;
+};
+
+int add_symbol(const char *name, uint64_t start, uint64_t size, void *payload)
+{
+  auto list = static_cast<SymbolList *>(payload);
+  list->syms.push_back(
+      { start, size, static_cast<uint32_t>(list->names.size()), 0 });
+  list->names += name;
+  list->names += '\0';
+  return 0;
+}
+#endif
+
+bool serialize_index(const std::string &elf_path,
+                     const MappedFile &file,
+                     std::string &out)
+{
+#ifndef HAVE_BCC_ELF_FOREACH_SYM
+  (void)elf_path;
+  (void)file;
+  (void)out;
+  return false;
+#else
+  std::vector<SymbolIndex::Load> loads;
+  size_t nphdrs = 0;
+  const Elf64_Phdr *phdrs = program_headers(file, nphdrs);
+  for (size_t i = 0; phdrs && i < nphdrs; i++)
+  {
+    if (phdrs[i].p_type == PT_LOAD)
+      loads.push_back(
+          { phdrs[i].p_offset, phdrs[i].p_vaddr, phdrs[i].p_filesz });
+  }
+
+  struct bcc_symbol_option option;
+  memset(&option, 0, sizeof(option));
+  option.use_debug_file = 1;
+  option.check_debug_file_crc = 1;
+  option.use_symbol_type = (1 << STT_FUNC) | (1 << STT_GNU_IFUNC);
+  SymbolList list;
+  if (bcc_elf_foreach_sym(elf_path.c_str(), add_symbol, &option, &list))
+    return false;
+
+  // The same symbol can be found in both the file and its debug file
+  auto &syms = list.syms;
+  auto name_of = [&](const SymbolIndex::Symbol &sym) {
+    return list.names.c_str() + sym.name;
+  };
+  std::sort(syms.begin(), syms.end(), [&](auto &a, auto &b) {
+    if (a.start != b.start)
+      return a.start < b.start;
+    return strcmp(name_of(a), name_of(b)) < 0;
+  });
+  syms.erase(std::unique(syms.begin(),
+                         syms.end(),
+                         [&](auto &a, auto &b) {
+                           return a.start == b.start &&
+                                  strcmp(name_of(a), name_of(b)) == 0;
+                         }),
+             syms.end());
+
+  IndexHeader header;
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.nloads = loads.size();
+  header.nsyms = syms.size();
+  header.names_size = list.names.size();
+
+  out.clear();
+  out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.append(reinterpret_cast<const char *>(loads.data()),
+             loads.size() * sizeof(loads[0]));
+  out.append(reinterpret_cast<const char *>(syms.data()),
+             syms.size() * sizeof(syms[0]));
+  out.append(list.names);
+  return true;
+#endif
+}
+
+bool write_index(const std::string &elf_path,
+                 const MappedFile &file,
+                 const std::string &index_path)
+{
+  std::string data;
+  if (!serialize_index(elf_path, file, data))
+    return false;
+  return write_file_atomic(index_path, data);
+}
+
+void *new_symcache(int pid)
+{
+  struct bcc_symbol_option symopts;
+  memset(&symopts, 0, sizeof(symopts));
+  symopts.use_debug_file = 1;
+  symopts.check_debug_file_crc = 1;
+  symopts.use_symbol_type = BCC_SYM_ALL_TYPES;
+  return bcc_symcache_new(pid, &symopts);
+}
+
+} // namespace
+
+SymbolIndex::~SymbolIndex()
+{
+  if (data_)
+    munmap(data_, size_);
+}
+
+std::string SymbolIndex::build_id(const std::string &path)
+{
+  MappedFile file(path);
+  return read_build_id(file);
+}
+
+std::unique_ptr<SymbolIndex> SymbolIndex::open(const std::string &path,
+                                               const std::string &build_id,
+                                               const std::string &cache_dir)
+{
+  std::string index_path = cache_dir + "/" + build_id + ".syms";
+  auto index = std::unique_ptr<SymbolIndex>(new SymbolIndex());
+  if (index->map(index_path))
+    return index;
+
+  if (mkdir(cache_dir.c_str(), 0700) && errno != EEXIST)
+  {
+    LOG(WARNING) << "Could not create symbol cache directory " << cache_dir
+                 << ": " << strerror(errno);
+    return nullptr;
+  }
+  {
+    MappedFile file(path);
+    if (!write_index(path, file, index_path))
+    {
+      LOG(WARNING) << "Could not write the symbol index of " << path << " to "
+                   << index_path;
+      return nullptr;
+    }
+  }
+
+  index = std::unique_ptr<SymbolIndex>(new SymbolIndex());
+  if (!index->map(index_path))
+    return nullptr;
+  return index;
+}
+
+std::unique_ptr<SymbolIndex> SymbolIndex::build(const std::string &path)
+{
+  auto index = std::unique_ptr<SymbolIndex>(new SymbolIndex());
+  {
+    MappedFile file(path);
+    if (!serialize_index(path, file, index->buf_))
+      return nullptr;
+  }
+  if (!index->attach(index->buf_.data(), index->buf_.size()))
+    return nullptr;
+  return index;
+}
+
+const SymbolIndex *SymbolIndex::shared(const std::string &path)
+{
+  static std::mutex mutex;
+  static std::map<std::string, std::unique_ptr<SymbolIndex>> indexes;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = indexes.find(path);
+  if (it == indexes.end())
+    it = indexes.emplace(path, build(path)).first;
+  return it->second.get();
+}
+
+bool SymbolIndex::map(const std::string &index_path)
+{
+  int fd = ::open(index_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(IndexHeader))
+    addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+
+  data_ = addr;
+  size_ = st.st_size;
+  return attach(data_, size_);
+}
+
+bool SymbolIndex::attach(const void *data, size_t size)
+{
+  if (size < sizeof(IndexHeader))
+    return false;
+  auto header = static_cast<const IndexHeader *>(data);
+  if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+      header->version != INDEX_VERSION)
+    return false;
+
+  // The counts come from a file, checked one at a time against what is left
+  // so that they can't overflow
+  size_t left = size - sizeof(IndexHeader);
+  if (header->nloads > left / sizeof(Load))
+    return false;
+  left -= header->nloads * sizeof(Load);
+  if (header->nsyms > left / sizeof(Symbol))
+    return false;
+  left -= header->nsyms * sizeof(Symbol);
+  if (header->names_size != left)
+    return false;
+
+  auto base = static_cast<const uint8_t *>(data) + sizeof(IndexHeader);
+  auto loads = reinterpret_cast<const Load *>(base);
+  auto syms = reinterpret_cast<const Symbol *>(loads + header->nloads);
+  auto names = reinterpret_cast<const char *>(syms + header->nsyms);
+  // Every name is terminated within the names
+  if (header->names_size && names[header->names_size - 1] != '\0')
+    return false;
+  for (uint64_t i = 0; i < header->nsyms; i++)
+  {
+    if (syms[i].name >= header->names_size)
+      return false;
+  }
+
+  loads_ = loads;
+  nloads_ = header->nloads;
+  syms_ = syms;
+  nsyms_ = header->nsyms;
+  names_ = names;
+  return true;
+}
+
+bool SymbolIndex::vaddr(uint64_t off, uint64_t &addr) const
+{
+  for (uint32_t i = 0; i < nloads_; i++)
+  {
+    if (off >= loads_[i].offset && off < loads_[i].offset + loads_[i].filesz)
+    {
+      addr = off - loads_[i].offset + loads_[i].vaddr;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SymbolIndex::offset(uint64_t addr, uint64_t &off) const
+{
+  for (uint32_t i = 0; i < nloads_; i++)
+  {
+    if (addr >= loads_[i].vaddr && addr < loads_[i].vaddr + loads_[i].filesz)
+    {
+      off = addr - loads_[i].vaddr + loads_[i].offset;
+      return true;
+    }
+  }
+  return false;
+}
+
+const SymbolIndex::Symbol *SymbolIndex::lookup(uint64_t addr) const
+{
+  auto it = std::upper_bound(
+      begin(), end(), addr, [](uint64_t addr, const Symbol &sym) {
+        return addr < sym.start;
+      });
+  if (it == begin())
+    return nullptr;
+  --it;
+  // Symbols without a size (e.g. hand written assembly) cover everything up
+  // to the next one
+  if (it->size && addr >= it->start + it->size)
+    return nullptr;
+  return it;
+}
+
+const SymbolIndex *SymbolCache::index(const std::string &path)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string build_id = SymbolIndex::build_id(path);
+  if (build_id.empty())
+    return nullptr;
+  return index(path, build_id);
+}
+
+const SymbolIndex *SymbolCache::index(const std::string &path,
+                                      const std::string &build_id)
+{
+  auto it = indexes_.find(build_id);
+  if (it == indexes_.end())
+    it = indexes_.emplace(build_id, SymbolIndex::open(path, build_id, dir_))
+             .first;
+  return it->second.get();
+}
+
+std::vector<SymbolCache::Mapping> &SymbolCache::mappings(int pid, bool missed)
+{
+  auto now = std::chrono::steady_clock::now();
+  auto it = processes_.find(pid);
+  std::chrono::steady_clock::duration interval = MAPS_REFRESH_INTERVAL;
+  if (missed)
+    interval = MAPS_MISS_INTERVAL;
+  if (it != processes_.end() && now - it->second.read < interval)
+    return it->second.mappings;
+
+  if (it == processes_.end())
+    it = processes_.emplace(pid, Process()).first;
+  auto &process = it->second;
+  process.read = now;
+
+  auto mappings = read_mappings(pid);
+  // Keep what we had for processes that are gone, their last events can
+  // still be printed
+  if (mappings.empty())
+    return process.mappings;
+
+  // Only the mappings that changed need their build-id read again
+  std::map<std::tuple<uint64_t, uint64_t, uint64_t, std::string>, std::string>
+      build_ids;
+  for (auto &mapping : process.mappings)
+    build_ids.emplace(
+        std::make_tuple(
+            mapping.start, mapping.end, mapping.offset, mapping.path),
+        mapping.build_id);
+  for (auto &mapping : mappings)
+  {
+    auto known = build_ids.find(std::make_tuple(
+        mapping.start, mapping.end, mapping.offset, mapping.path));
+    if (known != build_ids.end())
+      mapping.build_id = known->second;
+  }
+  process.mappings = std::move(mappings);
+  return process.mappings;
+}
+
+uint64_t SymbolCache::hash_mappings(const std::vector<Mapping> &mappings)
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  auto add = [&hash](const void *data, size_t size) {
+    for (size_t i = 0; i < size; i++)
+    {
+      hash ^= static_cast<const uint8_t *>(data)[i];
+      hash *= 1099511628211ULL;
+    }
+  };
+  for (auto &mapping : mappings)
+  {
+    add(&mapping.start, sizeof(mapping.start));
+    add(&mapping.end, sizeof(mapping.end));
+    add(&mapping.offset, sizeof(mapping.offset));
+    add(mapping.path.data(), mapping.path.size());
+  }
+  return hash;
+}
+
+std::vector<SymbolCache::Mapping> SymbolCache::read_mappings(int pid)
+{
+  std::vector<Mapping> mappings;
+  std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+  std::string line;
+  // <start>-<end> <perms> <offset> <dev> <inode> <path>
+  while (std::getline(maps, line))
+  {
+    std::istringstream fields(line);
+    std::string range, perms, offset, dev, inode, path;
+    fields >> range >> perms >> offset >> dev >> inode >> path;
+    if (path.empty() || path[0] != '/' || perms.find('x') == std::string::npos)
+      continue;
+    auto dash = range.find('-');
+    if (dash == std::string::npos)
+      continue;
+    mappings.push_back({ std::stoull(range.substr(0, dash), nullptr, 16),
+                         std::stoull(range.substr(dash + 1), nullptr, 16),
+                         std::stoull(offset, nullptr, 16),
+                         path,
+                         "" });
+  }
+  return mappings;
+}
+
+bool SymbolCache::resolve(int pid,
+                          uint64_t addr,
+                          std::string &name,
+                          uint64_t &offset,
+                          std::string &module)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Read the mappings again if none covers addr, it may have just been
+  // mapped
+  for (bool missed : { false, true })
+  {
+    auto &mappings = this->mappings(pid, missed);
+    auto mapping = std::find_if(
+        mappings.begin(), mappings.end(), [addr](const Mapping &mapping) {
+          return addr >= mapping.start && addr < mapping.end;
+        });
+    if (mapping != mappings.end())
+      return resolve(pid, addr, *mapping, name, offset, module);
+  }
+  return false;
+}
+
+bool SymbolCache::resolve(int pid,
+                          uint64_t addr,
+                          Mapping &mapping,
+                          std::string &name,
+                          uint64_t &offset,
+                          std::string &module)
+{
+  // Read the file through the process, it may be gone from its path or
+  // live in another mount namespace
+  std::string path = "/proc/" + std::to_string(pid) + "/root" + mapping.path;
+  if (mapping.build_id.empty())
+  {
+    mapping.build_id = SymbolIndex::build_id(path);
+    if (mapping.build_id.empty())
+      mapping.build_id = "-";
+  }
+  if (mapping.build_id == "-")
+    return false;
+
+  const SymbolIndex *index = this->index(path, mapping.build_id);
+  uint64_t vaddr;
+  if (!index ||
+      !index->vaddr(addr - mapping.start + mapping.offset, vaddr))
+    return false;
+
+  module = mapping.path;
+  const SymbolIndex::Symbol *sym = index->lookup(vaddr);
+  if (sym)
+  {
+    name = index->name(*sym);
+    offset = vaddr - sym->start;
+  }
+  else
+  {
+    name.clear();
+    offset = 0;
+  }
+  return true;
+}
+
+ProcSymcaches::~ProcSymcaches()
+{
+  for (auto &entry : entries_)
+  {
+    if (entry.second.psyms)
+      bcc_free_symcache(entry.second.psyms, entry.second.pid);
+  }
+}
+
+void *ProcSymcaches::get(int pid)
+{
+  auto &entry = this->entry(pid);
+  if (std::chrono::steady_clock::now() - entry.checked >= MAPS_REFRESH_INTERVAL)
+    revalidate(entry, pid);
+  return entry.psyms;
+}
+
+bool ProcSymcaches::refresh(int pid)
+{
+  auto &entry = this->entry(pid);
+  if (std::chrono::steady_clock::now() - entry.checked < MAPS_MISS_INTERVAL)
+    return false;
+  return revalidate(entry, pid);
+}
+
+PerfMap &ProcSymcaches::perf_map(int pid)
+{
+  auto it = perf_maps_.find(pid);
+  if (it != perf_maps_.end())
+    return *it->second;
+
+  if (perf_maps_.size() >= MAX_SYMCACHES)
+    perf_maps_.clear();
+  auto perf_map = std::make_unique<PerfMap>(PerfMap::path(pid));
+  return *perf_maps_.emplace(pid, std::move(perf_map)).first->second;
+}
+
+ProcSymcaches::Entry &ProcSymcaches::entry(int pid)
+{
+  // Keyed by the file rather than its path, which is the one of the mount
+  // namespace of the process: containers running the same image share the
+  // cache, those with another binary at the same path don't
+  std::string key = by_exe_ ? get_pid_exe_id(pid) : "";
+  if (key.empty())
+    key = std::to_string(pid);
+  auto it = entries_.find(key);
+  if (it != entries_.end())
+    return it->second;
+
+  if (entries_.size() >= MAX_SYMCACHES)
+  {
+    for (auto &entry : entries_)
+    {
+      if (entry.second.psyms)
+        bcc_free_symcache(entry.second.psyms, entry.second.pid);
+    }
+    entries_.clear();
+  }
+
+  Entry entry{ pid,
+               new_symcache(pid),
+               SymbolCache::hash_mappings(SymbolCache::read_mappings(pid)),
+               std::chrono::steady_clock::now() };
+  return entries_.emplace(key, entry).first->second;
+}
+
+bool ProcSymcaches::revalidate(Entry &entry, int pid)
+{
+  entry.checked = std::chrono::steady_clock::now();
+  auto mappings = SymbolCache::read_mappings(entry.pid);
+  if (mappings.empty())
+  {
+    // The process is gone. Its cache can still resolve its last events, but
+    // a cache shared by executable moves on to the process asking.
+    if (entry.pid == pid)
+      return false;
+    mappings = SymbolCache::read_mappings(pid);
+    if (mappings.empty())
+      return false;
+    if (entry.psyms)
+      bcc_free_symcache(entry.psyms, entry.pid);
+    entry.pid = pid;
+    entry.psyms = new_symcache(pid);
+    entry.hash = SymbolCache::hash_mappings(mappings);
+    return true;
+  }
+
+  uint64_t hash = SymbolCache::hash_mappings(mappings);
+  if (hash == entry.hash)
+    return false;
+  entry.hash = hash;
+  if (entry.psyms)
+    bcc_symcache_refresh(entry.psyms);
+  return true;
+}
+
+} // namespace bpftrace
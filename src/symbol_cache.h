@@ -0,0 +1,250 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "perf_map.h"
+
+namespace bpftrace {
+
+/**
+   Function symbols of an ELF file, stored in the symbol cache directory
+   under the build-id of the file and mmapped from there.
+
+   The index holds the PT_LOAD segments of the file, to turn file offsets
+   into addresses, then the symbols sorted by address, then their names.
+   Building it takes a full read of the symbol tables (and of the debug file
+   if there is one), loading it is a single mmap().
+*/
+class SymbolIndex
+{
+public:
+  struct Load
+  {
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t filesz;
+  };
+
+  struct Symbol
+  {
+    uint64_t start;
+    uint64_t size;
+    uint32_t name;
+    uint32_t reserved;
+  };
+
+  ~SymbolIndex();
+  SymbolIndex(const SymbolIndex &) = delete;
+  SymbolIndex &operator=(const SymbolIndex &) = delete;
+
+  /**
+     Index of the ELF file at path with the given build-id, read from
+     cache_dir, or built and written there when missing
+  */
+  static std::unique_ptr<SymbolIndex> open(const std::string &path,
+                                           const std::string &build_id,
+                                           const std::string &cache_dir);
+
+  /**
+     Index of the ELF file at path, built in memory
+  */
+  static std::unique_ptr<SymbolIndex> build(const std::string &path);
+
+  /**
+     Index of the ELF file at path, built the first time it's asked for and
+     kept for the rest of the run, nullptr when it couldn't be built. Shared
+     by the matching and the attaching of uprobes, so that each binary is
+     read once however many probes it gets.
+  */
+  static const SymbolIndex *shared(const std::string &path);
+
+  /**
+     Build-id of the 64-bit ELF file at path, in hex, or an empty string.
+     Files without one can't be told apart from another version of
+     themselves, so they don't get an index.
+  */
+  static std::string build_id(const std::string &path);
+
+  /**
+     Address of the byte at file offset off once loaded, false when it's not
+     part of any PT_LOAD segment
+  */
+  bool vaddr(uint64_t off, uint64_t &addr) const;
+
+  /**
+     File offset of the byte at addr once loaded, the reverse of vaddr()
+  */
+  bool offset(uint64_t addr, uint64_t &off) const;
+
+  /**
+     Symbol containing addr, nullptr if there is none
+  */
+  const Symbol *lookup(uint64_t addr) const;
+
+  const char *name(const Symbol &sym) const
+  {
+    return names_ + sym.name;
+  }
+  const Symbol *begin() const
+  {
+    return syms_;
+  }
+  const Symbol *end() const
+  {
+    return syms_ + nsyms_;
+  }
+
+private:
+  SymbolIndex() = default;
+  bool map(const std::string &index_path);
+  bool attach(const void *data, size_t size);
+
+  // The mmapped index file, or buf_ for indexes built by build()
+  void *data_ = nullptr;
+  size_t size_ = 0;
+  std::string buf_;
+  const Load *loads_ = nullptr;
+  uint32_t nloads_ = 0;
+  const Symbol *syms_ = nullptr;
+  uint64_t nsyms_ = 0;
+  const char *names_ = nullptr;
+};
+
+/**
+   Resolves user space addresses through SymbolIndex, see
+   BPFTRACE_SYMBOL_CACHE_DIR
+*/
+class SymbolCache
+{
+public:
+  explicit SymbolCache(const std::string &dir) : dir_(dir)
+  {
+  }
+
+  /**
+     Index of the file at path, nullptr if it can't have one
+  */
+  const SymbolIndex *index(const std::string &path);
+
+  /**
+     Find the function containing addr in the address space of pid. name is
+     left empty when the file has no symbol for it. Returns false when the
+     file it's mapped from has no index, for the caller to fall back to
+     reading its symbols.
+  */
+  bool resolve(int pid,
+               uint64_t addr,
+               std::string &name,
+               uint64_t &offset,
+               std::string &module);
+
+  struct Mapping
+  {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    std::string path;
+    // Filled in on first use, "-" when the file has none
+    std::string build_id;
+  };
+
+  /**
+     Executable file mappings of pid, from /proc/<pid>/maps
+  */
+  static std::vector<Mapping> read_mappings(int pid);
+
+  /**
+     Hash of the executable file mappings, to tell when they changed
+  */
+  static uint64_t hash_mappings(const std::vector<Mapping> &mappings);
+
+private:
+  bool resolve(int pid,
+               uint64_t addr,
+               Mapping &mapping,
+               std::string &name,
+               uint64_t &offset,
+               std::string &module);
+
+  struct Process
+  {
+    std::vector<Mapping> mappings;
+    std::chrono::steady_clock::time_point read;
+  };
+  std::vector<Mapping> &mappings(int pid, bool missed);
+  const SymbolIndex *index(const std::string &path,
+                           const std::string &build_id);
+
+  // index() and resolve() can be called from the SymbolizePool workers
+  std::mutex mutex_;
+  std::string dir_;
+  // By build-id
+  std::map<std::string, std::unique_ptr<SymbolIndex>> indexes_;
+  std::map<int, Process> processes_;
+};
+
+/**
+   bcc symbol caches of processes.
+
+   A cache is kept for as long as the executable file mappings of its process
+   stay the same, they are checked again every second and whenever an address
+   can't be resolved. When they changed (e.g. a library was dlopen()ed) the
+   cache is refreshed, rather than building a new one for every lookup.
+
+   The perf maps of the processes, for their JIT compiled code, are kept
+   alongside.
+*/
+class ProcSymcaches
+{
+public:
+  /**
+     by_exe shares one cache between all the processes running the same
+     executable, see BPFTRACE_CACHE_USER_SYMBOLS
+  */
+  explicit ProcSymcaches(bool by_exe) : by_exe_(by_exe)
+  {
+  }
+  ~ProcSymcaches();
+  ProcSymcaches(const ProcSymcaches &) = delete;
+  ProcSymcaches &operator=(const ProcSymcaches &) = delete;
+
+  /**
+     Cache to resolve the addresses of pid with
+  */
+  void *get(int pid);
+
+  /**
+     An address couldn't be resolved with get(pid), refresh the cache if the
+     mappings of pid changed. Returns true if it's worth trying again.
+  */
+  bool refresh(int pid);
+
+  /**
+     Perf map of pid, see PerfMap
+  */
+  PerfMap &perf_map(int pid);
+
+private:
+  struct Entry
+  {
+    int pid;
+    void *psyms;
+    uint64_t hash;
+    std::chrono::steady_clock::time_point checked;
+  };
+  Entry &entry(int pid);
+  bool revalidate(Entry &entry, int pid);
+
+  bool by_exe_;
+  // By executable file (device:inode) or by pid
+  std::map<std::string, Entry> entries_;
+  std::map<int, std::unique_ptr<PerfMap>> perf_maps_;
+};
+
+} // namespace bpftrace
@@ -0,0 +1,199 @@
+#include "bpftrace.h"
+#include "log.h"
+#include "symbolize_pool.h"
+#include "utils.h"
+
+namespace bpftrace {
+
+std::string format(std::string fmt,
+                   std::vector<std::unique_ptr<IPrintable>> &args);
+
+// Bound on the messages waiting to be printed, the main thread waits for the
+// oldest one before queueing more
+static const size_t MAX_PENDING = 4096;
+
+int PrintableSymbols::print(char *buf, size_t size, const char *fmt)
+{
+  return snprintf(buf, size, fmt, value_.c_str());
+}
+
+SymbolizePool::SymbolizePool(BPFtrace &bpftrace, unsigned int nthreads)
+    : bpftrace_(bpftrace)
+{
+  for (unsigned int i = 0; i < nthreads; i++)
+    threads_.push_back(start_thread_without_signals([this]() { work(); }));
+}
+
+SymbolizePool::~SymbolizePool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &thread : threads_)
+    thread.join();
+}
+
+bool SymbolizePool::wants(const std::vector<Field> &args)
+{
+  for (auto &arg : args)
+  {
+    if (arg.type.type == Type::usym || arg.type.type == Type::ustack)
+      return true;
+  }
+  return false;
+}
+
+void SymbolizePool::submit(const std::string &fmt,
+                           const std::vector<Field> &args,
+                           uint8_t *arg_data)
+{
+  auto job = std::make_unique<Job>();
+  job->fmt = fmt;
+  // Everything but the user symbols is read right away, the event data only
+  // lives for the duration of the callback and the stack map entries can be
+  // reused
+  job->args = bpftrace_.get_arg_values(args, arg_data, &job->symbols);
+  push(std::move(job), false);
+}
+
+void SymbolizePool::submit(std::string msg)
+{
+  auto job = std::make_unique<Job>();
+  job->msg = std::move(msg);
+  job->done = true;
+  push(std::move(job), true);
+}
+
+void SymbolizePool::push(std::unique_ptr<Job> job, bool ready)
+{
+  if (order_.size() >= MAX_PENDING)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this]() { return order_.front()->done; });
+  }
+  flush();
+
+  Job *todo = job.get();
+  order_.push_back(std::move(job));
+  if (!ready)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      todo_.push_back(todo);
+    }
+    work_cv_.notify_one();
+  }
+}
+
+void SymbolizePool::flush()
+{
+  while (!order_.empty())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!order_.front()->done)
+        return;
+    }
+    auto job = std::move(order_.front());
+    order_.pop_front();
+    bpftrace_.printf_output().message(MessageType::printf, job->msg, false);
+  }
+}
+
+void SymbolizePool::drain()
+{
+  while (!order_.empty())
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_cv_.wait(lock, [this]() { return order_.front()->done; });
+    }
+    flush();
+  }
+}
+
+void SymbolizePool::work()
+{
+  Resolver resolver(bpftrace_);
+  while (true)
+  {
+    Job *job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this]() { return stop_ || !todo_.empty(); });
+      if (todo_.empty())
+        return;
+      job = todo_.front();
+      todo_.pop_front();
+    }
+
+    for (auto symbols : job->symbols)
+      resolver.resolve(*symbols);
+    job->msg = format(job->fmt, job->args);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job->done = true;
+    }
+    done_cv_.notify_all();
+  }
+}
+
+SymbolizePool::Resolver::Resolver(BPFtrace &bpftrace)
+    : bpftrace_(bpftrace), symcaches_(bpftrace.cache_user_symbols_)
+{
+}
+
+void SymbolizePool::Resolver::resolve(PrintableSymbols &symbols)
+{
+  if (!symbols.stack_)
+  {
+    bpftrace_.resolve_usym(
+        symcaches_, symbols.addrs_[0], symbols.pid_, false, false,
+        symbols.value_);
+    return;
+  }
+
+  // Same as BPFtrace::get_stack(), an empty string if the stack couldn't be
+  // read
+  auto &stack = symbols.value_;
+  stack.clear();
+  if (symbols.addrs_.empty())
+    return;
+  stack = "\n";
+  std::string padding(symbols.indent_, ' ');
+  bool perf_mode = symbols.stack_type_.mode == StackMode::perf;
+  for (auto addr : symbols.addrs_)
+  {
+    if (addr == 0)
+      break;
+    BPFtrace::append_frame(stack,
+                           addr,
+                           symbol(symbols.pid_, addr, perf_mode),
+                           symbols.stack_type_.mode,
+                           padding);
+  }
+}
+
+const std::string &SymbolizePool::Resolver::symbol(int pid,
+                                                   uint64_t addr,
+                                                   bool perf_mode)
+{
+  auto key = std::make_tuple(pid, addr, perf_mode);
+  if (bpftrace_.cache_user_symbols_)
+  {
+    auto it = frames_.find(key);
+    if (it != frames_.end())
+      return it->second;
+  }
+
+  bool resolved = bpftrace_.resolve_usym(
+      symcaches_, addr, pid, true, perf_mode, uncached_);
+  if (resolved && bpftrace_.cache_user_symbols_)
+    return frames_.emplace(key, std::move(uncached_)).first->second;
+  return uncached_;
+}
+
+} // namespace bpftrace
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "printf.h"
+#include "symbol_cache.h"
+#include "types.h"
+
+namespace bpftrace {
+
+class BPFtrace;
+struct Field;
+
+/**
+   usym or ustack argument of a printf() event, holding the addresses read
+   from the event until a SymbolizePool worker resolves them
+*/
+class PrintableSymbols : public virtual IPrintable
+{
+public:
+  // usym
+  PrintableSymbols(int pid, uint64_t addr) : pid_(pid), addrs_{ addr }
+  {
+  }
+  // ustack, with the frames already read from the stack map
+  PrintableSymbols(int pid,
+                   std::vector<uint64_t> frames,
+                   StackType stack_type,
+                   int indent)
+      : pid_(pid),
+        addrs_(std::move(frames)),
+        stack_(true),
+        stack_type_(stack_type),
+        indent_(indent)
+  {
+  }
+  int print(char *buf, size_t size, const char *fmt) override;
+
+  int pid_;
+  std::vector<uint64_t> addrs_;
+  bool stack_ = false;
+  StackType stack_type_;
+  int indent_ = 0;
+  // Filled in by the worker
+  std::string value_;
+};
+
+/**
+   Resolves the user symbols of printf() events on worker threads, see
+   BPFTRACE_SYMBOLIZE_THREADS.
+
+   Events with usym or ustack arguments are read on the main thread, then
+   symbolized and formatted by one of the workers. Their messages go through
+   a reorder buffer together with the other printf() messages, so flush()
+   still prints everything in the order the events were received.
+*/
+class SymbolizePool
+{
+public:
+  SymbolizePool(BPFtrace &bpftrace, unsigned int nthreads);
+  ~SymbolizePool();
+
+  SymbolizePool(const SymbolizePool &) = delete;
+  SymbolizePool &operator=(const SymbolizePool &) = delete;
+
+  /**
+     Whether a printf() with these arguments has symbols to resolve
+  */
+  static bool wants(const std::vector<Field> &args);
+
+  /**
+     Queue the printf() event in arg_data for a worker to symbolize and format
+  */
+  void submit(const std::string &fmt,
+              const std::vector<Field> &args,
+              uint8_t *arg_data);
+
+  /**
+     Queue a printf() message that is already formatted behind the pending
+     ones
+  */
+  void submit(std::string msg);
+
+  bool empty() const
+  {
+    return order_.empty();
+  }
+
+  /**
+     Print the finished messages at the front of the reorder buffer
+  */
+  void flush();
+
+  /**
+     Wait for all the queued messages and print them
+  */
+  void drain();
+
+private:
+  struct Job
+  {
+    std::string fmt;
+    std::vector<std::unique_ptr<IPrintable>> args;
+    std::vector<PrintableSymbols *> symbols;
+    std::string msg;
+    // Protected by mutex_
+    bool done = false;
+  };
+
+  // Per worker, bcc's symbol caches aren't thread safe
+  class Resolver
+  {
+  public:
+    explicit Resolver(BPFtrace &bpftrace);
+    void resolve(PrintableSymbols &symbols);
+
+  private:
+    const std::string &symbol(int pid, uint64_t addr, bool perf_mode);
+
+    BPFtrace &bpftrace_;
+    ProcSymcaches symcaches_;
+    // (pid, address, perf mode) -> symbol, when user symbols are cached
+    std::map<std::tuple<int, uint64_t, bool>, std::string> frames_;
+    std::string uncached_;
+  };
+
+  void push(std::unique_ptr<Job> job, bool ready);
+  void work();
+
+  BPFtrace &bpftrace_;
+  std::vector<std::thread> threads_;
+  // Only touched by the main thread
+  std::deque<std::unique_ptr<Job>> order_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Job *> todo_;
+  bool stop_ = false;
+};
+
+} // namespace bpftrace
@@ -0,0 +1,250 @@
+#include <charconv>
+#include <sstream>
+
+#include "bpftrace.h"
+#include "log.h"
+#include "symbolizer.h"
+
+namespace bpftrace {
+
+namespace {
+
+std::string hex(uint64_t n)
+{
+  char buf[2 * sizeof(n)];
+  auto res = std::to_chars(buf, buf + sizeof(buf), n, 16);
+  return std::string(buf, res.ptr);
+}
+
+bool parse_number(const std::string &str, uint64_t &n, int base)
+{
+  auto end = str.data() + str.size();
+  auto res = std::from_chars(str.data(), end, n, base);
+  return !str.empty() && res.ec == std::errc() && res.ptr == end;
+}
+
+} // namespace
+
+std::string RawSymbols::kernel_token(uint64_t addr, bool show_offset)
+{
+  std::string token = "[[k";
+  if (show_offset)
+    token += '+';
+  token += ':';
+  token += hex(addr);
+  token += "]]";
+  return token;
+}
+
+std::string RawSymbols::user_token(int pid,
+                                   uint64_t addr,
+                                   bool show_offset,
+                                   bool show_module)
+{
+  std::string token = "[[u";
+  if (show_offset)
+    token += '+';
+  if (show_module)
+    token += 'm';
+  token += ':';
+  token += std::to_string(pid);
+  token += ':';
+  token += hex(addr);
+  token += "]]";
+  return token;
+}
+
+void RawSymbols::add_process(int pid)
+{
+  if (!pids_.insert(pid).second)
+    return;
+
+  std::string root = "/proc/" + std::to_string(pid) + "/root";
+  for (auto &mapping : SymbolCache::read_mappings(pid))
+  {
+    std::string build_id = SymbolIndex::build_id(root + mapping.path);
+    pending_.push_back("[[map " + std::to_string(pid) + " " +
+                       hex(mapping.start) + " " + hex(mapping.end) + " " +
+                       hex(mapping.offset) + " " +
+                       (build_id.empty() ? "-" : build_id) + " " +
+                       mapping.path + "]]");
+  }
+}
+
+void RawSymbols::write_module_map(std::ostream &out)
+{
+  for (auto &line : pending_)
+    out << line << "\n";
+  out << std::flush;
+  pending_.clear();
+}
+
+void Symbolizer::symbolize(std::istream &in, std::ostream &out)
+{
+  // The module map comes last, so read everything before resolving
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (!add_mapping(line))
+      lines.push_back(std::move(line));
+  }
+
+  std::string sym;
+  for (auto &line : lines)
+  {
+    size_t pos = 0;
+    size_t next;
+    while ((next = line.find("[[", pos)) != std::string::npos)
+    {
+      out.write(line.data() + pos, next - pos);
+      size_t len;
+      if (resolve_token(line, next, len, sym))
+      {
+        out << sym;
+        pos = next + len;
+      }
+      else
+      {
+        // Only skip one bracket, a token can start right after it
+        out << '[';
+        pos = next + 1;
+      }
+    }
+    out.write(line.data() + pos, line.size() - pos);
+    out << "\n";
+  }
+  out << std::flush;
+}
+
+bool Symbolizer::resolve_token(const std::string &line,
+                               size_t pos,
+                               size_t &len,
+                               std::string &out)
+{
+  if (line.compare(pos, 2, "[[") != 0)
+    return false;
+  size_t close = line.find("]]", pos + 2);
+  if (close == std::string::npos)
+    return false;
+
+  std::string body = line.substr(pos + 2, close - pos - 2);
+  size_t colon = body.find(':');
+  if (body.empty() || colon == std::string::npos)
+    return false;
+  std::string flags = body.substr(1, colon - 1);
+  bool show_offset = flags.find('+') != std::string::npos;
+  bool show_module = flags.find('m') != std::string::npos;
+  if (flags.find_first_not_of("+m") != std::string::npos)
+    return false;
+
+  uint64_t addr;
+  if (body[0] == 'k' && !show_module)
+  {
+    if (!parse_number(body.substr(colon + 1), addr, 16))
+      return false;
+    out = bpftrace_.resolve_ksym(addr, show_offset);
+  }
+  else if (body[0] == 'u')
+  {
+    size_t colon2 = body.find(':', colon + 1);
+    uint64_t pid;
+    if (colon2 == std::string::npos ||
+        !parse_number(body.substr(colon + 1, colon2 - colon - 1), pid, 10) ||
+        !parse_number(body.substr(colon2 + 1), addr, 16))
+      return false;
+    out = resolve_user(pid, addr, show_offset, show_module);
+  }
+  else
+    return false;
+
+  len = close + 2 - pos;
+  return true;
+}
+
+bool Symbolizer::add_mapping(const std::string &line)
+{
+  const std::string prefix = "[[map ";
+  if (line.compare(0, prefix.size(), prefix) != 0 || line.size() < 2 ||
+      line.compare(line.size() - 2, 2, "]]") != 0)
+    return false;
+
+  std::istringstream fields(
+      line.substr(prefix.size(), line.size() - prefix.size() - 2));
+  std::string pid, start, end, offset, build_id, path;
+  fields >> pid >> start >> end >> offset >> build_id;
+  // The path is all the rest, it can contain spaces
+  fields.get();
+  std::getline(fields, path);
+
+  uint64_t n;
+  SymbolCache::Mapping mapping;
+  if (path.empty() || !parse_number(pid, n, 10) ||
+      !parse_number(start, mapping.start, 16) ||
+      !parse_number(end, mapping.end, 16) ||
+      !parse_number(offset, mapping.offset, 16))
+    return false;
+  mapping.path = path;
+  mapping.build_id = build_id;
+  mappings_[n].push_back(std::move(mapping));
+  return true;
+}
+
+std::string Symbolizer::resolve_user(int pid,
+                                     uint64_t addr,
+                                     bool show_offset,
+                                     bool show_module)
+{
+  for (auto &mapping : mappings_[pid])
+  {
+    if (addr < mapping.start || addr >= mapping.end)
+      continue;
+
+    const SymbolIndex *index = this->index(mapping);
+    uint64_t vaddr;
+    if (!index ||
+        !index->vaddr(addr - mapping.start + mapping.offset, vaddr))
+      break;
+
+    const SymbolIndex::Symbol *sym = index->lookup(vaddr);
+    if (!sym)
+      break;
+    return bpftrace_.format_usym(addr,
+                                 index->name(*sym),
+                                 vaddr - sym->start,
+                                 mapping.path,
+                                 show_offset,
+                                 show_module);
+  }
+  return bpftrace_.format_usym(addr, "", 0, "", show_offset, show_module);
+}
+
+const SymbolIndex *Symbolizer::index(const SymbolCache::Mapping &mapping)
+{
+  auto key = std::make_pair(mapping.path, mapping.build_id);
+  auto it = modules_.find(key);
+  if (it != modules_.end())
+    return it->second;
+
+  const SymbolIndex *index = nullptr;
+  if (mapping.build_id != "-" &&
+      SymbolIndex::build_id(mapping.path) != mapping.build_id)
+  {
+    LOG(WARNING) << mapping.path
+                 << " doesn't match the build-id it was traced with, its "
+                    "addresses are left unresolved";
+  }
+  else if (mapping.build_id != "-" && bpftrace_.symbol_cache_)
+  {
+    index = bpftrace_.symbol_cache_->index(mapping.path);
+  }
+  else
+  {
+    indexes_.push_back(SymbolIndex::build(mapping.path));
+    index = indexes_.back().get();
+  }
+  modules_.emplace(key, index);
+  return index;
+}
+
+} // namespace bpftrace
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "symbol_cache.h"
+
+namespace bpftrace {
+
+class BPFtrace;
+
+/**
+   Raw symbol output, see --raw-symbols.
+
+   Addresses that would be symbolized are printed as tokens instead:
+
+     [[k:<addr>]]             kernel address
+     [[u:<pid>:<addr>]]       user address in process pid
+
+   with '+' after the k or u when the offset into the symbol is to be shown
+   and 'm' after the u when the module is. The executable mappings of every
+   process are recorded when the program first sends its pid, which it does
+   as soon as it takes a user address or stack of the process, or else when
+   its first address is printed. They are written out as the module map,
+   one line per mapping:
+
+     [[map <pid> <start> <end> <offset> <build-id or -> <path>]]
+
+   Addresses and offsets are in hex. Symbolizer reads both back and resolves
+   the tokens.
+*/
+class RawSymbols
+{
+public:
+  static std::string kernel_token(uint64_t addr, bool show_offset);
+  static std::string user_token(int pid,
+                                uint64_t addr,
+                                bool show_offset,
+                                bool show_module);
+
+  /**
+     Record the mappings of pid, if it hasn't been seen yet
+  */
+  void add_process(int pid);
+
+  /**
+     Write the module map lines of the processes recorded since the last call
+  */
+  void write_module_map(std::ostream &out);
+
+private:
+  std::set<int> pids_;
+  std::vector<std::string> pending_;
+};
+
+/**
+   Resolves the tokens of raw symbol output, see --symbolize.
+
+   Kernel addresses are resolved against /proc/kallsyms, so this has to run on
+   the same boot of the same machine. User addresses are resolved against the
+   files named in the module map, which must still match the build-ids they
+   were recorded with.
+*/
+class Symbolizer
+{
+public:
+  explicit Symbolizer(BPFtrace &bpftrace) : bpftrace_(bpftrace)
+  {
+  }
+
+  /**
+     Copy in to out, without the module map and with all the tokens resolved
+  */
+  void symbolize(std::istream &in, std::ostream &out);
+
+  /**
+     Resolution of the token starting at line[pos], sets len to its length.
+     Returns false if there is no valid token there.
+  */
+  bool resolve_token(const std::string &line,
+                     size_t pos,
+                     size_t &len,
+                     std::string &out);
+
+  /**
+     Record a module map line, false if it isn't one
+  */
+  bool add_mapping(const std::string &line);
+
+private:
+  std::string resolve_user(int pid,
+                           uint64_t addr,
+                           bool show_offset,
+                           bool show_module);
+  const SymbolIndex *index(const SymbolCache::Mapping &mapping);
+
+  BPFtrace &bpftrace_;
+  std::map<int, std::vector<SymbolCache::Mapping>> mappings_;
+  // By path and build-id, nullptr for the files that can't be used
+  std::map<std::pair<std::string, std::string>, const SymbolIndex *> modules_;
+  std::vector<std::unique_ptr<SymbolIndex>> indexes_;
+};
+
+} // namespace bpftrace
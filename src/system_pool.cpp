@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bpftrace.h"
+#include "log.h"
+#include "system_pool.h"
+#include "utils.h"
+
+extern char **environ;
+
+namespace bpftrace {
+
+// Same as exec_system(), but the shell doesn't inherit the signal mask of the
+// worker, which blocks everything. Returns false with error set when it
+// couldn't be started.
+static bool run_command(const std::string &cmd,
+                        std::string &output,
+                        std::string &error)
+{
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0)
+  {
+    error = strerror(errno);
+    return false;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t mask;
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+  const char *argv[] = { "sh", "-c", cmd.c_str(), nullptr };
+  pid_t pid;
+  int err = posix_spawn(&pid,
+                        "/bin/sh",
+                        &actions,
+                        &attr,
+                        const_cast<char **>(argv),
+                        environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (err)
+  {
+    close(fds[0]);
+    error = strerror(err);
+    return false;
+  }
+
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    output.append(buf, n);
+  }
+  close(fds[0]);
+  while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR)
+    ;
+  return true;
+}
+
+SystemPool::SystemPool(BPFtrace &bpftrace,
+                       unsigned int nthreads,
+                       size_t max_pending,
+                       bool drop)
+    : bpftrace_(bpftrace), max_pending_(std::max<size_t>(max_pending, 1)),
+      drop_(drop)
+{
+  for (unsigned int i = 0; i < nthreads; i++)
+    threads_.push_back(start_thread_without_signals([this]() { work(); }));
+}
+
+SystemPool::~SystemPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &thread : threads_)
+    thread.join();
+}
+
+void SystemPool::submit(std::string cmd)
+{
+  auto job = std::make_unique<Job>();
+  job->cmd = std::move(cmd);
+  queue(std::move(job));
+}
+
+void SystemPool::submit_cat(std::string path)
+{
+  auto job = std::make_unique<Job>();
+  job->cmd = std::move(path);
+  job->cat = true;
+  queue(std::move(job));
+}
+
+void SystemPool::queue(std::unique_ptr<Job> job)
+{
+  flush();
+  if (order_.size() >= max_pending_)
+  {
+    if (drop_)
+    {
+      dropped_++;
+      return;
+    }
+    while (order_.size() >= max_pending_)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]() { return order_.front()->done; });
+      }
+      flush();
+    }
+  }
+
+  Job *todo = job.get();
+  order_.push_back(std::move(job));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    todo_.push_back(todo);
+  }
+  work_cv_.notify_one();
+}
+
+void SystemPool::flush()
+{
+  while (!order_.empty())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!order_.front()->done)
+        return;
+    }
+    auto job = std::move(order_.front());
+    order_.pop_front();
+    if (job->cat)
+    {
+      if (!job->error.empty())
+        LOG(ERROR) << job->error;
+      else
+        bpftrace_.out_->message(MessageType::cat, job->output, false);
+    }
+    else if (!job->error.empty())
+      LOG(ERROR) << "system(\"" << job->cmd << "\"): " << job->error;
+    else
+      bpftrace_.out_->message(MessageType::syscall, job->output, false);
+  }
+}
+
+void SystemPool::drain()
+{
+  while (!order_.empty())
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_cv_.wait(lock, [this]() { return order_.front()->done; });
+    }
+    flush();
+  }
+}
+
+void SystemPool::work()
+{
+  while (true)
+  {
+    Job *job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this]() { return stop_ || !todo_.empty(); });
+      if (todo_.empty())
+        return;
+      job = todo_.front();
+      todo_.pop_front();
+    }
+
+    if (job->cat)
+      bpftrace_.cat_cache_->read(job->cmd, job->output, job->error);
+    else
+      run_command(job->cmd, job->output, job->error);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job->done = true;
+    }
+    done_cv_.notify_all();
+  }
+}
+
+} // namespace bpftrace
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bpftrace {
+
+class BPFtrace;
+
+/**
+   Runs the commands of system() on worker threads, see
+   BPFTRACE_SYSTEM_THREADS, and reads the files of cat() with
+   BPFTRACE_CAT_THREADS.
+
+   The commands are formatted on the main thread and queued, so that a slow
+   command doesn't hold up the reading of the perf buffers. Their output goes
+   through a reorder buffer, flush() prints it in the order the events were
+   received. Once max_pending commands are queued or running, the main thread
+   waits for the oldest one, or the command is dropped if drop is set.
+*/
+class SystemPool
+{
+public:
+  SystemPool(BPFtrace &bpftrace,
+             unsigned int nthreads,
+             size_t max_pending,
+             bool drop);
+  ~SystemPool();
+
+  SystemPool(const SystemPool &) = delete;
+  SystemPool &operator=(const SystemPool &) = delete;
+
+  void submit(std::string cmd);
+
+  /**
+     Queue a cat() of path, read through bpftrace.cat_cache_
+  */
+  void submit_cat(std::string path);
+
+  bool empty() const
+  {
+    return order_.empty();
+  }
+
+  /**
+     Print the output of the finished commands at the front of the reorder
+     buffer
+  */
+  void flush();
+
+  /**
+     Wait for all the queued commands and print their output
+  */
+  void drain();
+
+  // Commands and reads dropped as the queue was full
+  uint64_t dropped() const
+  {
+    return dropped_;
+  }
+
+private:
+  struct Job
+  {
+    // The path of cat() jobs
+    std::string cmd;
+    bool cat = false;
+    std::string output;
+    std::string error;
+    // Protected by mutex_
+    bool done = false;
+  };
+
+  void queue(std::unique_ptr<Job> job);
+  void work();
+
+  BPFtrace &bpftrace_;
+  size_t max_pending_;
+  bool drop_;
+  uint64_t dropped_ = 0;
+  std::vector<std::thread> threads_;
+  // Only touched by the main thread
+  std::deque<std::unique_ptr<Job>> order_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Job *> todo_;
+  bool stop_ = false;
+};
+
+} // namespace bpftrace
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "timings.h"
+#include "output.h"
+
+namespace bpftrace {
+
+namespace {
+
+double to_ms(std::chrono::nanoseconds time)
+{
+  return std::chrono::duration<double, std::milli>(time).count();
+}
+
+std::string format_ms(double ms, int width = 0)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%*.3f", width, ms);
+  return buf;
+}
+
+// str as a quoted JSON string
+std::string json_string(const std::string &str)
+{
+  std::string quoted = "\"";
+  append_json_escaped(quoted, str);
+  return quoted + '"';
+}
+
+} // namespace
+
+Timings &Timings::get()
+{
+  static Timings timings;
+  return timings;
+}
+
+void Timings::add(const std::string &phase, std::chrono::nanoseconds time)
+{
+  if (!enabled_)
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto [it, inserted] = index_.emplace(phase, phases_.size());
+  if (inserted)
+    phases_.push_back(Phase{ phase });
+  auto &p = phases_[it->second];
+  p.time += time;
+  p.count++;
+}
+
+void Timings::report(std::ostream &out, bool json) const
+{
+  auto total = std::chrono::steady_clock::now() - start_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (json)
+  {
+    out << "{\"type\": \"timings\", \"data\": {\"total_ms\": "
+        << format_ms(to_ms(total)) << ", \"phases\": [";
+    for (size_t i = 0; i < phases_.size(); ++i)
+    {
+      auto &p = phases_[i];
+      out << (i ? ", " : "") << "{\"phase\": " << json_string(p.name)
+          << ", \"ms\": " << format_ms(to_ms(p.time))
+          << ", \"count\": " << p.count << "}";
+    }
+    out << "]}}" << std::endl;
+    return;
+  }
+
+  size_t width = 5; // "total"
+  for (auto &p : phases_)
+    width = std::max(width, p.name.size());
+
+  out << "Timings:" << std::endl;
+  for (auto &p : phases_)
+  {
+    out << "  " << p.name << std::string(width - p.name.size() + 2, ' ')
+        << format_ms(to_ms(p.time), 10) << " ms";
+    if (p.count > 1)
+      out << " (" << p.count << "x)";
+    out << std::endl;
+  }
+  out << "  total" << std::string(width - 5 + 2, ' ')
+      << format_ms(to_ms(total), 10) << " ms" << std::endl;
+}
+
+Timings::Scope::Scope(std::string phase)
+{
+  if (!Timings::get().enabled())
+    return;
+  phase_ = std::move(phase);
+  start_ = std::chrono::steady_clock::now();
+}
+
+Timings::Scope::~Scope()
+{
+  if (!phase_.empty())
+    Timings::get().add(phase_, std::chrono::steady_clock::now() - start_);
+}
+
+} // namespace bpftrace
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bpftrace {
+
+/**
+   Time spent by bpftrace in each phase of a run, reported with --timings.
+
+   Phases are identified by name and listed in the order they first ran,
+   running a phase again (e.g. the second parse, or a probe attached in two
+   passes) adds to its time. Phases can nest, "feature detection" is counted
+   wherever a feature is first asked for, so their times don't add up to the
+   total.
+
+   Nothing is recorded unless enabled, so that the timers can stay in place.
+   Phases can be added from any thread.
+*/
+class Timings
+{
+public:
+  static Timings &get();
+
+  bool enabled() const
+  {
+    return enabled_;
+  }
+  void enable()
+  {
+    enabled_ = true;
+    start_ = std::chrono::steady_clock::now();
+  }
+
+  void add(const std::string &phase, std::chrono::nanoseconds time);
+  // The phases and the total time since enable(), as text or a JSON line
+  void report(std::ostream &out, bool json) const;
+
+  // Times the phase from its construction to its destruction
+  class Scope
+  {
+  public:
+    explicit Scope(std::string phase);
+    ~Scope();
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    std::string phase_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+private:
+  struct Phase
+  {
+    std::string name;
+    std::chrono::nanoseconds time{ 0 };
+    uint64_t count = 0;
+  };
+
+  bool enabled_ = false;
+  std::chrono::steady_clock::time_point start_;
+  mutable std::mutex mutex_;
+  std::vector<Phase> phases_;
+  // Index of each phase in phases_
+  std::unordered_map<std::string, size_t> index_;
+};
+
+} // namespace bpftrace
@@ -1,17 +1,25 @@
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <glob.h>
 #include <iostream>
+#include <sstream>
+#include <unistd.h>
 
 #include "ast.h"
 #include "bpftrace.h"
 #include "log.h"
 #include "struct.h"
 #include "tracepoint_format_parser.h"
+#include "utils.h"
 
 namespace bpftrace {
 
 std::set<std::string> TracepointFormatParser::struct_list;
+std::map<std::string, TracepointFormatParser::Format>
+    TracepointFormatParser::formats;
+bool TracepointFormatParser::formats_loaded = false;
+bool TracepointFormatParser::formats_changed = false;
 
 bool TracepointFormatParser::parse(ast::Program *program, BPFtrace &bpftrace)
 {
@@ -26,6 +34,8 @@ bool TracepointFormatParser::parse(ast::Program *program, BPFtrace &bpftrace)
   if (probes_with_tracepoint.empty())
     return true;
 
+  load_formats(bpftrace);
+
   ast::TracepointArgsVisitor n{};
   if (!bpftrace.btf_.has_data())
     program->c_definitions += "#include <linux/types.h>\n";
@@ -78,7 +88,6 @@ bool TracepointFormatParser::parse(ast::Program *program, BPFtrace &bpftrace)
 
           for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
             std::string filename(glob_result.gl_pathv[i]);
-            std::ifstream format_file(filename);
             std::string prefix("/sys/kernel/debug/tracing/events/");
             size_t pos = prefix.length();
             std::string real_category = filename.substr(
@@ -87,23 +96,16 @@ bool TracepointFormatParser::parse(ast::Program *program, BPFtrace &bpftrace)
             std::string real_event = filename.substr(
                 pos, filename.length() - std::string("/format").length() - pos);
 
-            // Check to avoid adding the same struct more than once to definitions
-            std::string struct_name = get_struct_name(real_category,
-                                                      real_event);
-            if (!TracepointFormatParser::struct_list.count(struct_name))
-            {
-              program->c_definitions += get_tracepoint_struct(
-                  format_file, real_category, real_event, bpftrace);
-              TracepointFormatParser::struct_list.insert(struct_name);
-            }
+            add_tracepoint_struct(
+                program, real_category, real_event, filename, bpftrace);
           }
           globfree(&glob_result);
         }
         else
         {
           // single tracepoint
-          std::ifstream format_file(format_file_path.c_str());
-          if (format_file.fail())
+          if (!formats.count(category + ":" + event_name) &&
+              access(format_file_path.c_str(), R_OK) != 0)
           {
             // Errno might get clobbered by LOG().
             int saved_errno = errno;
@@ -125,15 +127,13 @@ bool TracepointFormatParser::parse(ast::Program *program, BPFtrace &bpftrace)
           if (probe->tp_args_structs_level <= 0)
             continue;
 
-          // Check to avoid adding the same struct more than once to definitions
-          std::string struct_name = get_struct_name(category, event_name);
-          if (TracepointFormatParser::struct_list.insert(struct_name).second)
-            program->c_definitions += get_tracepoint_struct(
-                format_file, category, event_name, bpftrace);
+          add_tracepoint_struct(
+              program, category, event_name, format_file_path, bpftrace);
         }
       }
     }
   }
+  save_formats(bpftrace);
   return true;
 }
 
@@ -150,61 +150,75 @@ std::string TracepointFormatParser::get_struct_name(const std::string &probe_id)
   return get_struct_name(category, event_name);
 }
 
-std::string TracepointFormatParser::parse_field(const std::string &line,
-                                                int *last_offset,
-                                                BPFtrace &bpftrace)
+std::optional<TracepointFormatParser::FormatField> TracepointFormatParser::
+    parse_field(const std::string &line)
 {
-  std::string extra = "";
-
   auto field_pos = line.find("field:");
   if (field_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto field_semi_pos = line.find(';', field_pos);
   if (field_semi_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto offset_pos = line.find("offset:", field_semi_pos);
   if (offset_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto offset_semi_pos = line.find(';', offset_pos);
   if (offset_semi_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto size_pos = line.find("size:", offset_semi_pos);
   if (size_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto size_semi_pos = line.find(';', size_pos);
   if (size_semi_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
-  int size = std::stoi(line.substr(size_pos + 5, size_semi_pos - size_pos - 5));
-  int offset = std::stoi(
+  FormatField field;
+  field.size = std::stoi(
+      line.substr(size_pos + 5, size_semi_pos - size_pos - 5));
+  field.offset = std::stoi(
       line.substr(offset_pos + 7, offset_semi_pos - offset_pos - 7));
 
+  auto signed_pos = line.find("signed:", size_semi_pos);
+  field.is_signed = signed_pos != std::string::npos &&
+                    line.compare(signed_pos + 7, 1, "1") == 0;
+
+  std::string decl = line.substr(field_pos + 6,
+                                 field_semi_pos - field_pos - 6);
+  auto field_type_end_pos = decl.find_last_of("\t ");
+  if (field_type_end_pos == std::string::npos)
+    return std::nullopt;
+  field.type = decl.substr(0, field_type_end_pos);
+  field.name = decl.substr(field_type_end_pos + 1);
+  return field;
+}
+
+std::string TracepointFormatParser::get_field_def(const FormatField &field,
+                                                  int *last_offset,
+                                                  BPFtrace &bpftrace)
+{
+  std::string extra = "";
+
   // If there'a gap between last field and this one,
   // generate padding fields
-  if (offset && *last_offset)
+  if (field.offset && *last_offset)
   {
-    int i, gap = offset - *last_offset;
+    int i, gap = field.offset - *last_offset;
 
     for (i = 0; i < gap; i++)
     {
-      extra += "  char __pad_" + std::to_string(offset - gap + i) + ";\n";
+      extra += "  char __pad_" + std::to_string(field.offset - gap + i) +
+               ";\n";
     }
   }
 
-  *last_offset = offset + size;
-
-  std::string field = line.substr(field_pos + 6, field_semi_pos - field_pos - 6);
-  auto field_type_end_pos = field.find_last_of("\t ");
-  if (field_type_end_pos == std::string::npos)
-    return "";
-  std::string field_type = field.substr(0, field_type_end_pos);
-  std::string field_name = field.substr(field_type_end_pos+1);
+  *last_offset = field.offset + field.size;
 
+  std::string field_type = field.type;
   if (field_type.find("__data_loc") != std::string::npos)
   {
     // Note that the type here (ie `int`) does not matter. Later during parse
@@ -214,14 +228,14 @@ std::string TracepointFormatParser::parse_field(const std::string &line,
   }
 
   // Only adjust field types for non-arrays
-  if (field_name.find("[") == std::string::npos)
-    field_type = adjust_integer_types(field_type, size);
+  if (field.name.find("[") == std::string::npos)
+    field_type = adjust_integer_types(field_type, field.size);
 
   // If BTF is available, we try not to use any header files, including
   // <linux/types.h> and request all the types we need from BTF.
   bpftrace.btf_set_.emplace(field_type);
 
-  return extra + "  " + field_type + " " + field_name + ";\n";
+  return extra + "  " + field_type + " " + field.name + ";\n";
 }
 
 std::string TracepointFormatParser::adjust_integer_types(const std::string &field_type, int size)
@@ -241,22 +255,339 @@ std::string TracepointFormatParser::adjust_integer_types(const std::string &fiel
   return new_type;
 }
 
+TracepointFormatParser::Format TracepointFormatParser::read_format(
+    std::istream &format_file)
+{
+  Format format;
+  for (std::string line; getline(format_file, line);)
+  {
+    if (auto field = parse_field(line))
+      format.push_back(std::move(*field));
+  }
+  return format;
+}
+
 std::string TracepointFormatParser::get_tracepoint_struct(
     std::istream &format_file,
     const std::string &category,
     const std::string &event_name,
     BPFtrace &bpftrace)
+{
+  return get_tracepoint_struct(read_format(format_file),
+                               category,
+                               event_name,
+                               bpftrace);
+}
+
+std::string TracepointFormatParser::get_tracepoint_struct(
+    const Format &format,
+    const std::string &category,
+    const std::string &event_name,
+    BPFtrace &bpftrace)
 {
   std::string format_struct = get_struct_name(category, event_name) + "\n{\n";
   int last_offset = 0;
 
-  for (std::string line; getline(format_file, line); )
+  for (auto &field : format)
   {
-    format_struct += parse_field(line, &last_offset, bpftrace);
+    format_struct += get_field_def(field, &last_offset, bpftrace);
   }
 
   format_struct += "};\n";
   return format_struct;
 }
 
+namespace {
+
+// A C type without its qualifiers, split into the type and how many
+// pointers to it, e.g. "const char *const *" is "char" and 2
+struct CType
+{
+  std::string base;
+  int pointers = 0;
+};
+
+// None for what's not a plain type, e.g. a function pointer
+std::optional<CType> parse_c_type(const std::string &type)
+{
+  CType ctype;
+  std::string word;
+  auto end_word = [&]() {
+    if (!word.empty() && word != "const" && word != "volatile")
+    {
+      if (ctype.pointers)
+        return false;
+      ctype.base += (ctype.base.empty() ? "" : " ") + word;
+    }
+    word.clear();
+    return true;
+  };
+
+  for (char c : type)
+  {
+    if (c == ' ' || c == '\t' || c == '*')
+    {
+      if (!end_word())
+        return std::nullopt;
+      if (c == '*')
+        ctype.pointers++;
+    }
+    else if (isalnum(c) || c == '_')
+      word += c;
+    else
+      return std::nullopt;
+  }
+  if (!end_word() || ctype.base.empty())
+    return std::nullopt;
+  return ctype;
+}
+
+// The integer types pointers can point to without BTF having a name for them
+// ("long" is "long int" there), with their size and signedness
+const std::map<std::string, std::pair<size_t, bool>> c_int_types = {
+  { "_Bool", { sizeof(bool), false } },
+  { "bool", { sizeof(bool), false } },
+  { "char", { sizeof(char), std::is_signed<char>::value } },
+  { "signed char", { sizeof(char), true } },
+  { "unsigned char", { sizeof(char), false } },
+  { "short", { sizeof(short), true } },
+  { "unsigned short", { sizeof(short), false } },
+  { "int", { sizeof(int), true } },
+  { "unsigned", { sizeof(int), false } },
+  { "unsigned int", { sizeof(int), false } },
+  { "long", { sizeof(long), true } },
+  { "unsigned long", { sizeof(long), false } },
+  { "long long", { sizeof(long long), true } },
+  { "unsigned long long", { sizeof(long long), false } },
+};
+
+// The type a pointer field points to, e.g. "struct task_struct" whose
+// definition is then read too, for args->field->field
+std::optional<SizedType> get_pointee_type(const std::string &type,
+                                          BPFtrace &bpftrace)
+{
+  if (type == "void")
+    return CreateNone();
+  auto it = c_int_types.find(type);
+  if (it != c_int_types.end())
+    return CreateInteger(it->second.first * 8, it->second.second);
+
+  auto stype = bpftrace.btf_.get_stype(type);
+  if (stype.IsNoneTy())
+    return std::nullopt;
+  if (stype.IsRecordTy())
+    bpftrace.btf_set_.insert(stype.GetName());
+  return stype;
+}
+
+} // namespace
+
+std::optional<SizedType> TracepointFormatParser::get_field_type(
+    const FormatField &field,
+    BPFtrace &bpftrace)
+{
+  // Rewritten to a u64 the way the clang parser does, see get_field_def()
+  if (field.type.find("__data_loc") != std::string::npos)
+    return CreateInt64();
+
+  // e.g. not a function pointer, which the type and name don't split well
+  auto bracket = field.name.find('[');
+  std::string name = field.name.substr(0, bracket);
+  if (name.empty() || !std::all_of(name.begin(), name.end(), [](char c) {
+        return isalnum(c) || c == '_';
+      }))
+    return std::nullopt;
+
+  auto ctype = parse_c_type(field.type);
+  if (!ctype)
+    return std::nullopt;
+
+  size_t size = field.size;
+  size_t elems = 0;
+  if (bracket != std::string::npos)
+  {
+    elems = std::strtoul(field.name.c_str() + bracket + 1, nullptr, 10);
+    if (elems == 0 || size % elems)
+      return std::nullopt;
+    if (ctype->base == "char" && !ctype->pointers)
+      return CreateString(elems);
+    size /= elems;
+  }
+
+  SizedType stype;
+  if (ctype->pointers)
+  {
+    auto pointee = get_pointee_type(ctype->base, bpftrace);
+    if (!pointee || size != 8)
+      return std::nullopt;
+    stype = *pointee;
+    for (int i = 0; i < ctype->pointers; i++)
+      stype = CreatePointer(stype);
+  }
+  else
+  {
+    // Typedefs of integers are told apart by the size and signedness the
+    // format has for them, as adjust_integer_types() does
+    stype = bpftrace.btf_.get_stype(ctype->base);
+    if (stype.IsRecordTy())
+    {
+      if (stype.GetSize() != size)
+        return std::nullopt;
+      bpftrace.btf_set_.insert(stype.GetName());
+    }
+    else if (size == 1 || size == 2 || size == 4 || size == 8)
+      stype = CreateInteger(size * 8,
+                            field.is_signed &&
+                                ctype->base.rfind("enum ", 0) != 0);
+    else
+      return std::nullopt;
+  }
+
+  if (elems)
+    return CreateArray(elems, stype);
+  return stype;
+}
+
+std::optional<Struct> TracepointFormatParser::get_tracepoint_args(
+    const Format &format,
+    BPFtrace &bpftrace)
+{
+  Struct args;
+  int end = 0;
+  int align = 1;
+  for (auto &field : format)
+  {
+    auto type = get_field_type(field, bpftrace);
+    if (!type)
+      return std::nullopt;
+
+    // Only the integers and pointers are known to be aligned to their size
+    const SizedType &elem = type->IsArrayTy() ? *type->GetElementTy() : *type;
+    if (!elem.IsRecordTy() && !elem.IsStringTy())
+    {
+      int elem_size = type->IsArrayTy() ? field.size / type->GetNumElements()
+                                        : field.size;
+      align = std::max(align, std::min(elem_size, 8));
+    }
+    end = std::max(end, field.offset + field.size);
+
+    auto &f = args.fields[field.name.substr(0, field.name.find('['))];
+    f.type = *type;
+    f.offset = field.offset;
+    f.is_bitfield = false;
+    f.is_data_loc = field.type.find("__data_loc") != std::string::npos;
+  }
+  args.size = (end + align - 1) / align * align;
+  return args;
+}
+
+void TracepointFormatParser::add_tracepoint_struct(
+    ast::Program *program,
+    const std::string &category,
+    const std::string &event_name,
+    const std::string &format_file_path,
+    BPFtrace &bpftrace)
+{
+  // Check to avoid adding the same struct more than once to definitions
+  std::string struct_name = get_struct_name(category, event_name);
+  if (!struct_list.insert(struct_name).second)
+    return;
+
+  const Format &format = get_format(category, event_name, format_file_path);
+
+  // Without C definitions to parse, the clang parser reads every type from
+  // BTF directly
+  if (bpftrace.btf_.has_data())
+  {
+    if (auto args = get_tracepoint_args(format, bpftrace))
+    {
+      bpftrace.structs_[struct_name] = std::move(*args);
+      return;
+    }
+  }
+  program->c_definitions += get_tracepoint_struct(format,
+                                                  category,
+                                                  event_name,
+                                                  bpftrace);
+}
+
+const TracepointFormatParser::Format &TracepointFormatParser::get_format(
+    const std::string &category,
+    const std::string &event_name,
+    const std::string &format_file_path)
+{
+  auto [it, inserted] = formats.try_emplace(category + ":" + event_name);
+  if (inserted)
+  {
+    std::ifstream format_file(format_file_path);
+    it->second = read_format(format_file);
+    // One that couldn't be read isn't kept, its module may be loaded later
+    if (!it->second.empty())
+      formats_changed = true;
+  }
+  return it->second;
+}
+
+static std::string formats_path(BPFtrace &bpftrace)
+{
+  return bpftrace.program_cache_dir_ + "/tracepoint_formats";
+}
+
+// The file starts with the boot id, followed by the tracepoints each with a
+// "category:event fields" line, and a line for each field:
+// "offset size signed\ttype\tname"
+void TracepointFormatParser::load_formats(BPFtrace &bpftrace)
+{
+  if (formats_loaded || bpftrace.program_cache_dir_.empty())
+    return;
+  formats_loaded = true;
+
+  std::ifstream file(formats_path(bpftrace));
+  std::string line;
+  if (!std::getline(file, line) || line != "boot id: " + get_boot_id())
+    return;
+
+  std::map<std::string, Format> loaded;
+  std::string name;
+  size_t count;
+  while (file >> name >> count)
+  {
+    Format &format = loaded[name];
+    for (size_t i = 0; i < count; i++)
+    {
+      FormatField field;
+      if (!(file >> field.offset >> field.size >> field.is_signed) ||
+          file.get() != '\t' || !std::getline(file, field.type, '\t') ||
+          !std::getline(file, field.name))
+        return;
+      format.push_back(std::move(field));
+    }
+  }
+  if (!file.eof())
+    return;
+  // The ones read before are newer
+  formats.merge(loaded);
+}
+
+void TracepointFormatParser::save_formats(BPFtrace &bpftrace)
+{
+  if (!formats_changed || bpftrace.program_cache_dir_.empty())
+    return;
+  formats_changed = false;
+
+  std::ostringstream data;
+  data << "boot id: " << get_boot_id() << std::endl;
+  for (auto &[name, format] : formats)
+  {
+    if (format.empty())
+      continue;
+    data << name << " " << format.size() << std::endl;
+    for (auto &field : format)
+      data << field.offset << " " << field.size << " " << field.is_signed
+           << "\t" << field.type << "\t" << field.name << std::endl;
+  }
+
+  write_file_atomic(formats_path(bpftrace), data.str());
+}
+
 } // namespace bpftrace
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <istream>
+#include <map>
+#include <optional>
 #include <set>
+#include <vector>
 
 #include "ast/visitors.h"
 #include "bpftrace.h"
@@ -40,6 +43,17 @@ private:
 class TracepointFormatParser
 {
 public:
+  // A field of a tracepoint, as its format file describes it
+  struct FormatField
+  {
+    std::string type;
+    std::string name;
+    int offset;
+    int size;
+    bool is_signed;
+  };
+  using Format = std::vector<FormatField>;
+
   static bool parse(ast::Program *program, BPFtrace &bpftrace);
   static std::string get_struct_name(const std::string &category,
                                      const std::string &event_name);
@@ -50,18 +64,47 @@ public:
   }
 
 private:
-  static std::string parse_field(const std::string &line,
-                                 int *last_offset,
-                                 BPFtrace &bpftrace);
+  static std::optional<FormatField> parse_field(const std::string &line);
+  static std::string get_field_def(const FormatField &field,
+                                   int *last_offset,
+                                   BPFtrace &bpftrace);
   static std::string adjust_integer_types(const std::string &field_type,
                                           int size);
+  static std::optional<SizedType> get_field_type(const FormatField &field,
+                                                 BPFtrace &bpftrace);
+  static void add_tracepoint_struct(ast::Program *program,
+                                    const std::string &category,
+                                    const std::string &event_name,
+                                    const std::string &format_file_path,
+                                    BPFtrace &bpftrace);
+  static const Format &get_format(const std::string &category,
+                                  const std::string &event_name,
+                                  const std::string &format_file_path);
+  static void load_formats(BPFtrace &bpftrace);
+  static void save_formats(BPFtrace &bpftrace);
   static std::set<std::string> struct_list;
+  // The formats read so far, by "category:event". With a program cache
+  // directory they're kept there for the rest of the boot, the format files
+  // of hundreds of tracepoints take a while to read.
+  static std::map<std::string, Format> formats;
+  static bool formats_loaded;
+  static bool formats_changed;
 
 protected:
+  static Format read_format(std::istream &format_file);
   static std::string get_tracepoint_struct(std::istream &format_file,
                                            const std::string &category,
                                            const std::string &event_name,
                                            BPFtrace &bpftrace);
+  static std::string get_tracepoint_struct(const Format &format,
+                                           const std::string &category,
+                                           const std::string &event_name,
+                                           BPFtrace &bpftrace);
+  // The struct of the args of a tracepoint, with the layout of its format
+  // and the types of its fields from BTF, or none if the clang parser is
+  // needed to tell the type of a field
+  static std::optional<Struct> get_tracepoint_args(const Format &format,
+                                                   BPFtrace &bpftrace);
 };
 
 } // namespace bpftrace
@@ -1,6 +1,11 @@
 #include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
 
 #include "log.h"
 #include "struct.h"
@@ -8,6 +13,66 @@
 
 namespace bpftrace {
 
+static_assert(std::is_trivially_copyable<SizedType>::value,
+              "SizedType is copied all over, its details are kept out of line");
+
+// Orders types on all their members, the out of line ones by address as
+// they're interned
+struct SizedType::Less
+{
+  static auto key(const SizedType &t)
+  {
+    return std::tie(t.type,
+                    t.stack_type.limit,
+                    t.stack_type.mode,
+                    t.is_internal,
+                    t.is_tparg,
+                    t.is_kfarg,
+                    t.kfarg_idx,
+                    t.size_,
+                    t.is_signed_,
+                    t.element_type_,
+                    t.num_elements_,
+                    t.name_,
+                    t.ctx_,
+                    t.as_,
+                    t.size_bits_,
+                    t.tuple_fields);
+  }
+
+  bool operator()(const SizedType &a, const SizedType &b) const
+  {
+    return key(a) < key(b);
+  }
+};
+
+const std::string *SizedType::intern_name(const std::string &name)
+{
+  static std::mutex mutex;
+  static std::unordered_set<std::string> names;
+  std::lock_guard<std::mutex> lock(mutex);
+  return &*names.insert(name).first;
+}
+
+const SizedType *SizedType::intern_type(const SizedType &type)
+{
+  static std::mutex mutex;
+  static std::set<SizedType, Less> types;
+  std::lock_guard<std::mutex> lock(mutex);
+  return &*types.insert(type).first;
+}
+
+// Tuples aren't interned, their fields are updated in place as the semantic
+// analyser learns more of them
+Tuple *SizedType::keep_tuple(std::unique_ptr<Tuple> tuple)
+{
+  static std::mutex mutex;
+  static std::vector<std::unique_ptr<Tuple>> tuples;
+  std::lock_guard<std::mutex> lock(mutex);
+  tuples.push_back(std::move(tuple));
+  return tuples.back().get();
+}
+
 std::ostream &operator<<(std::ostream &os, Type type)
 {
   os << typestr(type);
@@ -155,6 +220,9 @@ std::string typestr(Type t)
     case Type::record:   return "record";   break;
     case Type::hist:     return "hist";     break;
     case Type::lhist:    return "lhist";    break;
+    case Type::llhist:   return "llhist";   break;
+    case Type::distinct: return "distinct"; break;
+    case Type::cms:      return "cms";      break;
     case Type::count:    return "count";    break;
     case Type::sum:      return "sum";      break;
     case Type::min:      return "min";      break;
@@ -175,6 +243,7 @@ std::string typestr(Type t)
     case Type::tuple:    return "tuple";    break;
     case Type::timestamp:return "timestamp";break;
     case Type::mac_address: return "mac_address"; break;
+    case Type::cgroup_path: return "cgroup_path"; break;
       // clang-format on
   }
 
@@ -237,6 +306,9 @@ std::string probetypeName(ProbeType t)
     case ProbeType::iter:
       return "iter";
       break;
+    case ProbeType::rawtracepoint:
+      return "rawtracepoint";
+      break;
   }
 
   return {}; // unreached
@@ -253,6 +325,43 @@ uint64_t asyncactionint(AsyncAction a)
   return (uint64_t)a;
 }
 
+std::string asynceventstr(uint64_t id)
+{
+  if (id < asyncactionint(AsyncAction::syscall))
+    return "printf:" + std::to_string(id);
+  if (id < asyncactionint(AsyncAction::cat))
+    return "system:" +
+           std::to_string(id - asyncactionint(AsyncAction::syscall));
+  if (id < asyncactionint(AsyncAction::exit))
+    return "cat:" + std::to_string(id - asyncactionint(AsyncAction::cat));
+
+  switch (static_cast<AsyncAction>(id))
+  {
+    // clang-format off
+    case AsyncAction::exit:              return "exit";
+    case AsyncAction::print:             return "print";
+    case AsyncAction::clear:             return "clear";
+    case AsyncAction::zero:              return "zero";
+    case AsyncAction::time:              return "time";
+    case AsyncAction::join:              return "join";
+    case AsyncAction::helper_error:      return "helper_error";
+    case AsyncAction::print_non_map:     return "print_non_map";
+    case AsyncAction::strftime:          return "strftime";
+    case AsyncAction::watchpoint_attach: return "watchpoint_attach";
+    case AsyncAction::watchpoint_detach: return "watchpoint_detach";
+    case AsyncAction::quantiles:         return "quantiles";
+    case AsyncAction::print_delta:       return "print_delta";
+    case AsyncAction::batch:             return "batch";
+    case AsyncAction::flight_dump:       return "flight_dump";
+    case AsyncAction::repeated:          return "repeated";
+    case AsyncAction::raw_symbols_pid:   return "raw_symbols_pid";
+    // clang-format on
+    default:
+      break;
+  }
+  return "unknown:" + std::to_string(id);
+}
+
 // Type wrappers
 SizedType CreateInteger(size_t bits, bool is_signed)
 {
@@ -342,7 +451,7 @@ SizedType CreateArray(size_t num_elements, const SizedType &element_type)
   size_t size = num_elements * element_type.GetSize();
   auto ty = SizedType(Type::array, size);
   ty.num_elements_ = num_elements;
-  ty.element_type_ = std::make_shared<SizedType>(element_type);
+  ty.element_type_ = SizedType::intern_type(element_type);
   return ty;
 }
 
@@ -350,7 +459,7 @@ SizedType CreatePointer(const SizedType &pointee_type, AddrSpace as)
 {
   // Pointer itself is always an uint64
   auto ty = SizedType(Type::pointer, 8);
-  ty.element_type_ = std::make_shared<SizedType>(pointee_type);
+  ty.element_type_ = SizedType::intern_type(pointee_type);
   ty.SetAS(as);
   return ty;
 }
@@ -358,13 +467,15 @@ SizedType CreatePointer(const SizedType &pointee_type, AddrSpace as)
 SizedType CreateRecord(size_t size, const std::string &name)
 {
   auto ty = SizedType(Type::record, size);
-  ty.name_ = name;
+  ty.name_ = SizedType::intern_name(name);
   return ty;
 }
 
 SizedType CreateStack(bool kernel, StackType stack)
 {
-  auto st = SizedType(kernel ? Type::kstack : Type::ustack, 8);
+  size_t size = !kernel && stack.mode == StackMode::dwarf ? sizeof(DwarfStack)
+                                                          : 8;
+  auto st = SizedType(kernel ? Type::kstack : Type::ustack, size);
   st.stack_type = stack;
   return st;
 }
@@ -389,14 +500,15 @@ SizedType CreateCount(bool is_signed)
   return SizedType(Type::count, 8, is_signed);
 }
 
+// The count and the total
 SizedType CreateAvg(bool is_signed)
 {
-  return SizedType(Type::avg, 8, is_signed);
+  return SizedType(Type::avg, 16, is_signed);
 }
 
 SizedType CreateStats(bool is_signed)
 {
-  return SizedType(Type::stats, 8, is_signed);
+  return SizedType(Type::stats, 16, is_signed);
 }
 
 SizedType CreateProbe()
@@ -421,6 +533,21 @@ SizedType CreateLhist()
   return SizedType(Type::lhist, 8);
 }
 
+SizedType CreateLlhist()
+{
+  return SizedType(Type::llhist, 8);
+}
+
+SizedType CreateDistinct()
+{
+  return SizedType(Type::distinct, DISTINCT_REGISTERS);
+}
+
+SizedType CreateCms()
+{
+  return SizedType(Type::cms, 8);
+}
+
 SizedType CreateHist()
 {
   return SizedType(Type::hist, 8);
@@ -449,7 +576,7 @@ SizedType CreateTimestamp()
 SizedType CreateTuple(const std::vector<SizedType> &fields)
 {
   auto s = SizedType(Type::tuple, 0);
-  s.tuple_fields = Tuple::Create(fields);
+  s.tuple_fields = SizedType::keep_tuple(Tuple::Create(fields));
   s.size_ = s.tuple_fields->size;
   return s;
 }
@@ -461,6 +588,11 @@ SizedType CreateMacAddress()
   return st;
 }
 
+SizedType CreateCgroupPath()
+{
+  return SizedType(Type::cgroup_path, 8);
+}
+
 bool SizedType::IsSigned(void) const
 {
   return is_signed_;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <memory>
 #include <ostream>
 #include <sstream>
@@ -15,6 +16,19 @@ const int MAX_STACK_SIZE = 1024;
 const int DEFAULT_STACK_SIZE = 127;
 const int STRING_SIZE = 64;
 const int COMM_SIZE = 16;
+// Number of one byte registers backing a distinct() value. The map update path
+// has to build a zeroed value on the BPF stack, which caps it well below the
+// 512 byte stack limit. 256 registers give a ~6.5% standard error.
+const int DISTINCT_REGISTERS = 256;
+// Count-min sketch of cms_count(): CMS_DEPTH rows of CMS_WIDTH (a power of 2)
+// 64 bit counters per CPU, and up to CMS_TRACKED keys tracked as heavy
+// hitters. Estimates exceed the true count by at most e / CMS_WIDTH of all
+// the counted events with probability 1 - e^-CMS_DEPTH.
+const int CMS_DEPTH = 4;
+const int CMS_WIDTH = 2048;
+const int CMS_TRACKED = 1024;
+// Default number of events on a CPU after which a key is tracked
+const int CMS_THRESHOLD = 64;
 
 enum class Type
 {
@@ -25,6 +39,9 @@ enum class Type
   record, // struct/union, as struct is a protected keyword
   hist,
   lhist,
+  llhist,
+  distinct,
+  cms,
   count,
   sum,
   min,
@@ -44,7 +61,8 @@ enum class Type
   buffer,
   tuple,
   timestamp,
-  mac_address
+  mac_address,
+  cgroup_path
   // clang-format on
 };
 
@@ -62,6 +80,30 @@ enum class StackMode
 {
   bpftrace,
   perf,
+  // ustack() frames as the build ID of their file and their offset in it,
+  // for symbolizing them later or elsewhere
+  build_id,
+  // ustack() unwound in userspace from the .eh_frame of the binaries, for
+  // those built without frame pointers, see DwarfStack
+  dwarf,
+};
+
+// Bytes of the user stack ustack(dwarf) copies for userspace to unwind
+const size_t DWARF_STACK_SIZE = 8192;
+
+/**
+   What a ustack(dwarf) holds: the registers userspace starts unwinding from
+   and the top of the stack they point into. size is 0 when the stack
+   couldn't be read.
+*/
+struct DwarfStack
+{
+  uint64_t pid;
+  uint64_t ip;
+  uint64_t sp;
+  uint64_t bp;
+  uint64_t size;
+  uint8_t data[DWARF_STACK_SIZE];
 };
 
 struct StackType
@@ -77,6 +119,12 @@ struct StackType
 struct Tuple;
 struct Field;
 
+/**
+   A type, small and trivially copyable. What only some types need (names,
+   element types and tuple fields) is kept out of line for the lifetime of
+   the process and shared by the copies: names and element types are
+   interned, equal ones are stored once.
+*/
 class SizedType
 {
 public:
@@ -101,15 +149,21 @@ public:
 private:
   size_t size_ = -1; // in bytes
   bool is_signed_ = false;
-  std::shared_ptr<SizedType> element_type_; // for "container" and pointer
-                                            // (like) types
+  const SizedType *element_type_ = nullptr; // for "container" and pointer
+                                           // (like) types
   size_t num_elements_ = -1;                // for array like types
-  std::string name_; // name of this type, for named types like struct
+  // name of this type, for named types like struct
+  const std::string *name_ = nullptr;
   bool ctx_ = false; // Is bpf program context
   AddrSpace as_ = AddrSpace::none;
   ssize_t size_bits_ = -1; // size in bits for integer types
 
-  std::shared_ptr<Tuple> tuple_fields; // tuple fields
+  Tuple *tuple_fields = nullptr; // tuple fields
+
+  struct Less;
+  static const std::string *intern_name(const std::string &name);
+  static const SizedType *intern_type(const SizedType &type);
+  static Tuple *keep_tuple(std::unique_ptr<Tuple> tuple);
 
 public:
   /**
@@ -152,6 +206,11 @@ public:
   bool IsByteArray() const;
   bool IsAggregate() const;
   bool IsStack() const;
+  // A ustack(dwarf), the stack itself rather than the id of a stack map
+  bool IsDwarfStack() const
+  {
+    return type == Type::ustack && stack_type.mode == StackMode::dwarf;
+  }
 
   bool IsEqual(const SizedType &t) const;
   bool operator==(const SizedType &t) const;
@@ -194,22 +253,23 @@ public:
     return IsStringTy() ? size_ : size_ / element_type_->size_;
   };
 
-  const std::string GetName() const
+  const std::string &GetName() const
   {
     assert(IsRecordTy());
-    return name_;
+    static const std::string no_name;
+    return name_ ? *name_ : no_name;
   }
 
   const SizedType *GetElementTy() const
   {
     assert(IsArrayTy());
-    return element_type_.get();
+    return element_type_;
   }
 
   const SizedType *GetPointeeTy() const
   {
     assert(IsPtrTy());
-    return element_type_.get();
+    return element_type_;
   }
 
   bool IsBoolTy() const
@@ -240,6 +300,18 @@ public:
   {
     return type == Type::lhist;
   };
+  bool IsLlhistTy(void) const
+  {
+    return type == Type::llhist;
+  };
+  bool IsDistinctTy(void) const
+  {
+    return type == Type::distinct;
+  };
+  bool IsCmsTy(void) const
+  {
+    return type == Type::cms;
+  };
   bool IsCountTy(void) const
   {
     return type == Type::count;
@@ -324,6 +396,10 @@ public:
   {
     return type == Type::mac_address;
   };
+  bool IsCgroupPathTy(void) const
+  {
+    return type == Type::cgroup_path;
+  };
 
   bool IsTupleWithStruct(void) const;
 
@@ -339,6 +415,9 @@ public:
   friend SizedType CreateRecord(size_t size, const std::string &name);
   friend SizedType CreateInteger(size_t bits, bool is_signed);
   friend SizedType CreateTuple(const std::vector<SizedType> &fields);
+
+  // Saves and restores types as they are
+  friend class ProgramImage;
 };
 // Type helpers
 
@@ -380,12 +459,16 @@ SizedType CreateProbe();
 SizedType CreateUsername();
 SizedType CreateInet(size_t size);
 SizedType CreateLhist();
+SizedType CreateLlhist();
+SizedType CreateDistinct();
+SizedType CreateCms();
 SizedType CreateHist();
 SizedType CreateUSym();
 SizedType CreateKSym();
 SizedType CreateBuffer(size_t size);
 SizedType CreateTimestamp();
 SizedType CreateMacAddress();
+SizedType CreateCgroupPath();
 
 std::ostream &operator<<(std::ostream &os, const SizedType &type);
 
@@ -407,6 +490,7 @@ enum class ProbeType
   kfunc,
   kretfunc,
   iter,
+  rawtracepoint,
 };
 
 std::ostream &operator<<(std::ostream &os, ProbeType type);
@@ -427,6 +511,7 @@ const std::vector<ProbeItem> PROBE_LIST = {
   { "BEGIN", "BEGIN", ProbeType::uprobe },
   { "END", "END", ProbeType::uprobe },
   { "tracepoint", "t", ProbeType::tracepoint },
+  { "rawtracepoint", "rt", ProbeType::rawtracepoint },
   { "profile", "p", ProbeType::profile },
   { "interval", "i", ProbeType::interval },
   { "software", "s", ProbeType::software },
@@ -466,10 +551,40 @@ struct Probe
   bool async = false; // for watchpoint probes, if it's an async watchpoint
   uint64_t address = 0;
   uint64_t func_offset = 0;
+  std::vector<std::string> funcs; // for kprobe_multi and uprobe_multi
+                                  // probes, the functions matched by the
+                                  // wildcard
+  std::vector<uint64_t> cookies;  // for kprobe_multi probes, the probe id
+                                  // each function is attached with, if the
+                                  // program reads it
+  uint32_t btf_id = 0;            // for kfunc probes on the function of a
+                                  // module (path), its id in the module BTF
+  int64_t probe_id = -1;          // for kfunc probes sharing a program, the
+                                  // probe builtin it is loaded with
+  int counter_slot = -1;          // for hardware probes of a group of
+                                  // events (path), the first of their slots
+                                  // of the counters map
+  std::string cpus;               // for profile, interval and hardware
+                                  // probes, see get_probe_cpus()
 };
 
+// src_reg of the ld_imm64 that loads the probe builtin of a program shared by
+// the matches of a kfunc probe, see Probe::probe_id. The kernel doesn't
+// define it, load_prog() replaces it with the id.
+const int BPF_PSEUDO_PROBE_ID = 14;
+
 const int RESERVED_IDS_PER_ASYNCACTION = 10000;
 
+// Temporaries larger than this many bytes (str() buffers, tuples, printf()
+// arguments and the like) are kept in the per-CPU scratch map rather than on
+// the 512 bytes of BPF stack
+const uint64_t SCRATCH_THRESHOLD = 128;
+
+// Probes with statements adding up to more than this many AST nodes, counting
+// unrolled loops once per iteration, are split into programs tail calling
+// each other, which the verifier checks separately
+const uint64_t TAIL_CALL_THRESHOLD = 1000;
+
 enum class AsyncAction
 {
   // clang-format off
@@ -487,10 +602,19 @@ enum class AsyncAction
   strftime,
   watchpoint_attach,
   watchpoint_detach,
+  quantiles,
+  print_delta,
+  batch,
+  flight_dump,
+  repeated,
+  raw_symbols_pid,
   // clang-format on
 };
 
 uint64_t asyncactionint(AsyncAction a);
+// Name of the event sent with the given printf_id/AsyncAction id, e.g.
+// "printf:3" or "exit"
+std::string asynceventstr(uint64_t id);
 
 enum class PositionalParameterType
 {
@@ -512,6 +636,10 @@ struct hash<bpftrace::StackType>
         return std::hash<std::string>()("bpftrace#" + to_string(obj.limit));
       case bpftrace::StackMode::perf:
         return std::hash<std::string>()("perf#" + to_string(obj.limit));
+      case bpftrace::StackMode::build_id:
+        return std::hash<std::string>()("build_id#" + to_string(obj.limit));
+      case bpftrace::StackMode::dwarf:
+        return std::hash<std::string>()("dwarf#" + to_string(obj.limit));
     }
 
     return {}; // unreached
@@ -0,0 +1,683 @@
+#include <algorithm>
+#include <cstring>
+
+#include "mapped_file.h"
+#include "unwind.h"
+
+namespace bpftrace {
+
+namespace {
+
+// DWARF numbers of the x86_64 registers, the return address has one of its
+// own
+const unsigned REG_RBP = 6;
+const unsigned REG_RSP = 7;
+const unsigned REG_RA = 16;
+
+const auto MAPS_REFRESH_INTERVAL = std::chrono::seconds(1);
+const auto MAPS_MISS_INTERVAL = std::chrono::milliseconds(10);
+// Tables and processes kept before starting over
+const size_t MAX_TABLES = 1024;
+const size_t MAX_PROCESSES = 1024;
+
+// Reads the .eh_frame, which is loaded at addr
+class Reader
+{
+public:
+  Reader(const uint8_t *data, size_t size, uint64_t addr)
+      : data_(data), size_(size), addr_(addr)
+  {
+  }
+
+  bool ok() const
+  {
+    return ok_;
+  }
+  bool done() const
+  {
+    return pos_ >= size_;
+  }
+  size_t pos() const
+  {
+    return pos_;
+  }
+  void seek(size_t pos)
+  {
+    if (pos > size_)
+      ok_ = false;
+    pos_ = std::min(pos, size_);
+  }
+
+  template <typename T>
+  T read()
+  {
+    T value = 0;
+    if (size_ - pos_ < sizeof(T))
+    {
+      ok_ = false;
+      pos_ = size_;
+      return value;
+    }
+    memcpy(&value, data_ + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return value;
+  }
+
+  uint64_t uleb()
+  {
+    uint64_t value = 0;
+    for (unsigned shift = 0; ok_; shift += 7)
+    {
+      uint8_t byte = read<uint8_t>();
+      if (shift < 64)
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    return value;
+  }
+
+  int64_t sleb()
+  {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte = 0;
+    do
+    {
+      byte = read<uint8_t>();
+      if (shift < 64)
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      shift += 7;
+    } while ((byte & 0x80) && ok_);
+    if (shift < 64 && (byte & 0x40))
+      value |= ~0ULL << shift;
+    return static_cast<int64_t>(value);
+  }
+
+  // A pointer in the DW_EH_PE_* encoding enc, absolute or relative to where
+  // it is. The indirect ones are only used for the personality routines,
+  // which are skipped.
+  uint64_t pointer(uint8_t enc)
+  {
+    // DW_EH_PE_omit
+    if (enc == 0xff)
+      return 0;
+    uint64_t base = 0;
+    switch (enc & 0x70)
+    {
+      case 0x00: // DW_EH_PE_absptr
+        break;
+      case 0x10: // DW_EH_PE_pcrel
+        base = addr_ + pos_;
+        break;
+      default:
+        ok_ = false;
+        return 0;
+    }
+    switch (enc & 0x0f)
+    {
+      case 0x00: // DW_EH_PE_absptr
+      case 0x04: // DW_EH_PE_udata8
+      case 0x0c: // DW_EH_PE_sdata8
+        return base + read<uint64_t>();
+      case 0x01: // DW_EH_PE_uleb128
+        return base + uleb();
+      case 0x02: // DW_EH_PE_udata2
+        return base + read<uint16_t>();
+      case 0x03: // DW_EH_PE_udata4
+        return base + read<uint32_t>();
+      case 0x09: // DW_EH_PE_sleb128
+        return base + sleb();
+      case 0x0a: // DW_EH_PE_sdata2
+        return base + read<int16_t>();
+      case 0x0b: // DW_EH_PE_sdata4
+        return base + read<int32_t>();
+      default:
+        ok_ = false;
+        return 0;
+    }
+  }
+
+private:
+  const uint8_t *data_;
+  size_t size_;
+  uint64_t addr_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+// Reads the length and the CIE id (or CIE pointer) of the entry at the
+// position of r, false at the terminator
+bool read_entry(Reader &r, size_t &end, uint64_t &id, size_t &id_pos)
+{
+  uint64_t length = r.read<uint32_t>();
+  bool is64 = length == 0xffffffff;
+  if (is64)
+    length = r.read<uint64_t>();
+  if (length == 0 || !r.ok())
+    return false;
+  id_pos = r.pos();
+  end = id_pos + length;
+  id = is64 ? r.read<uint64_t>() : r.read<uint32_t>();
+  return r.ok();
+}
+
+struct Cie
+{
+  uint64_t code_align;
+  int64_t data_align;
+  uint64_t ra_reg;
+  // DW_EH_PE_absptr unless the augmentation has an 'R'
+  uint8_t fde_enc = 0;
+  bool has_augmentation_data = false;
+  size_t insns;
+  size_t end;
+};
+
+bool read_cie(Reader &r, size_t pos, Cie &cie)
+{
+  r.seek(pos);
+  size_t id_pos;
+  uint64_t id;
+  if (!read_entry(r, cie.end, id, id_pos) || id != 0)
+    return false;
+
+  uint8_t version = r.read<uint8_t>();
+  std::string augmentation;
+  for (char c = r.read<char>(); c && r.ok(); c = r.read<char>())
+    augmentation += c;
+  cie.code_align = r.uleb();
+  cie.data_align = r.sleb();
+  cie.ra_reg = version == 1 ? r.read<uint8_t>() : r.uleb();
+
+  if (!augmentation.empty() && augmentation[0] == 'z')
+  {
+    cie.has_augmentation_data = true;
+    size_t length = r.uleb();
+    size_t data_end = r.pos() + length;
+    for (char c : augmentation.substr(1))
+    {
+      if (c == 'R')
+        cie.fde_enc = r.read<uint8_t>();
+      else if (c == 'P')
+        r.pointer(r.read<uint8_t>());
+      else if (c == 'L')
+        r.read<uint8_t>();
+      else if (c != 'S')
+        break;
+    }
+    r.seek(data_end);
+  }
+  else if (!augmentation.empty())
+  {
+    // e.g. "eh" of old GCCs
+    return false;
+  }
+  cie.insns = r.pos();
+  return r.ok() && cie.ra_reg == REG_RA;
+}
+
+// The rules of the registers at an address, as the call frame instructions
+// of the CIE and of the FDE build them
+struct Row
+{
+  struct Reg
+  {
+    enum class Kind
+    {
+      same,
+      undefined,
+      // Saved at CFA + offset
+      offset,
+      // In another register or computed, not supported
+      other,
+    };
+    Kind kind = Kind::same;
+    int64_t offset = 0;
+  };
+
+  uint64_t cfa_reg = REG_RSP;
+  int64_t cfa_offset = 0;
+  bool cfa_expression = false;
+  Reg regs[REG_RA + 1];
+};
+
+// Runs the call frame instructions of [r.pos(), end) from loc, until past
+// target. initial is the row of the CIE, which DW_CFA_restore goes back to.
+bool run(Reader &r,
+         size_t end,
+         const Cie &cie,
+         uint64_t loc,
+         uint64_t target,
+         const Row &initial,
+         Row &row)
+{
+  std::vector<Row> remembered;
+  auto set = [&row](uint64_t reg, Row::Reg::Kind kind, int64_t offset = 0) {
+    if (reg <= REG_RA)
+      row.regs[reg] = { kind, offset };
+  };
+  auto restore = [&row, &initial](uint64_t reg) {
+    if (reg <= REG_RA)
+      row.regs[reg] = initial.regs[reg];
+  };
+  auto advance = [&](uint64_t delta) {
+    loc += delta * cie.code_align;
+    return loc <= target;
+  };
+
+  while (r.pos() < end && r.ok())
+  {
+    uint8_t op = r.read<uint8_t>();
+    uint8_t low = op & 0x3f;
+    switch (op >> 6)
+    {
+      case 1: // DW_CFA_advance_loc
+        if (!advance(low))
+          return true;
+        continue;
+      case 2: // DW_CFA_offset
+        set(low, Row::Reg::Kind::offset, r.uleb() * cie.data_align);
+        continue;
+      case 3: // DW_CFA_restore
+        restore(low);
+        continue;
+    }
+
+    uint64_t reg;
+    switch (op)
+    {
+      case 0x00: // DW_CFA_nop
+        break;
+      case 0x01: // DW_CFA_set_loc
+        loc = r.pointer(cie.fde_enc);
+        if (loc > target)
+          return true;
+        break;
+      case 0x02: // DW_CFA_advance_loc1
+        if (!advance(r.read<uint8_t>()))
+          return true;
+        break;
+      case 0x03: // DW_CFA_advance_loc2
+        if (!advance(r.read<uint16_t>()))
+          return true;
+        break;
+      case 0x04: // DW_CFA_advance_loc4
+        if (!advance(r.read<uint32_t>()))
+          return true;
+        break;
+      case 0x05: // DW_CFA_offset_extended
+        reg = r.uleb();
+        set(reg, Row::Reg::Kind::offset, r.uleb() * cie.data_align);
+        break;
+      case 0x06: // DW_CFA_restore_extended
+        restore(r.uleb());
+        break;
+      case 0x07: // DW_CFA_undefined
+        set(r.uleb(), Row::Reg::Kind::undefined);
+        break;
+      case 0x08: // DW_CFA_same_value
+        set(r.uleb(), Row::Reg::Kind::same);
+        break;
+      case 0x09: // DW_CFA_register
+        set(r.uleb(), Row::Reg::Kind::other);
+        r.uleb();
+        break;
+      case 0x0a: // DW_CFA_remember_state
+        remembered.push_back(row);
+        break;
+      case 0x0b: // DW_CFA_restore_state
+        if (remembered.empty())
+          return false;
+        row = remembered.back();
+        remembered.pop_back();
+        break;
+      case 0x0c: // DW_CFA_def_cfa
+        row.cfa_reg = r.uleb();
+        row.cfa_offset = r.uleb();
+        row.cfa_expression = false;
+        break;
+      case 0x0d: // DW_CFA_def_cfa_register
+        row.cfa_reg = r.uleb();
+        row.cfa_expression = false;
+        break;
+      case 0x0e: // DW_CFA_def_cfa_offset
+        row.cfa_offset = r.uleb();
+        break;
+      case 0x0f: // DW_CFA_def_cfa_expression
+        row.cfa_expression = true;
+        r.seek(r.pos() + r.uleb());
+        break;
+      case 0x10: // DW_CFA_expression
+        set(r.uleb(), Row::Reg::Kind::other);
+        r.seek(r.pos() + r.uleb());
+        break;
+      case 0x11: // DW_CFA_offset_extended_sf
+        reg = r.uleb();
+        set(reg, Row::Reg::Kind::offset, r.sleb() * cie.data_align);
+        break;
+      case 0x12: // DW_CFA_def_cfa_sf
+        row.cfa_reg = r.uleb();
+        row.cfa_offset = r.sleb() * cie.data_align;
+        row.cfa_expression = false;
+        break;
+      case 0x13: // DW_CFA_def_cfa_offset_sf
+        row.cfa_offset = r.sleb() * cie.data_align;
+        break;
+      case 0x14: // DW_CFA_val_offset
+        set(r.uleb(), Row::Reg::Kind::other);
+        r.uleb();
+        break;
+      case 0x15: // DW_CFA_val_offset_sf
+        set(r.uleb(), Row::Reg::Kind::other);
+        r.sleb();
+        break;
+      case 0x16: // DW_CFA_val_expression
+        set(r.uleb(), Row::Reg::Kind::other);
+        r.seek(r.pos() + r.uleb());
+        break;
+      case 0x2e: // DW_CFA_GNU_args_size
+        r.uleb();
+        break;
+      case 0x2f: // DW_CFA_GNU_negative_offset_extended
+        reg = r.uleb();
+        set(reg,
+            Row::Reg::Kind::offset,
+            -static_cast<int64_t>(r.uleb()) * cie.data_align);
+        break;
+      default:
+        return false;
+    }
+  }
+  return r.ok();
+}
+
+} // namespace
+
+EhFrameTable::EhFrameTable(const std::string &path)
+    : file_(std::make_unique<MappedFile>(path))
+{
+}
+
+EhFrameTable::~EhFrameTable() = default;
+
+std::unique_ptr<EhFrameTable> EhFrameTable::build(const std::string &path)
+{
+  std::unique_ptr<EhFrameTable> table(new EhFrameTable(path));
+  if (!table->parse())
+    return nullptr;
+  return table;
+}
+
+bool EhFrameTable::parse()
+{
+  size_t nphdrs = 0;
+  const Elf64_Phdr *phdrs = program_headers(*file_, nphdrs);
+  if (!phdrs)
+    return false;
+
+  const Elf64_Phdr *eh_frame_hdr = nullptr;
+  for (size_t i = 0; i < nphdrs; i++)
+  {
+    if (phdrs[i].p_offset + phdrs[i].p_filesz > file_->size())
+      continue;
+    if (phdrs[i].p_type == PT_LOAD)
+      loads_.push_back(
+          { phdrs[i].p_offset, phdrs[i].p_vaddr, phdrs[i].p_filesz });
+    else if (phdrs[i].p_type == PT_GNU_EH_FRAME)
+      eh_frame_hdr = &phdrs[i];
+  }
+  if (!eh_frame_hdr)
+    return false;
+
+  // The .eh_frame_hdr starts with where the .eh_frame is
+  Reader hdr(file_->data() + eh_frame_hdr->p_offset,
+             eh_frame_hdr->p_filesz,
+             eh_frame_hdr->p_vaddr);
+  uint8_t version = hdr.read<uint8_t>();
+  uint8_t eh_frame_ptr_enc = hdr.read<uint8_t>();
+  hdr.read<uint16_t>();
+  uint64_t eh_frame = hdr.pointer(eh_frame_ptr_enc);
+  if (!hdr.ok() || version != 1)
+    return false;
+
+  // The .eh_frame runs to its terminator, at most to the end of its segment
+  auto load = std::find_if(loads_.begin(), loads_.end(), [&](auto &segment) {
+    return eh_frame >= segment.vaddr &&
+           eh_frame < segment.vaddr + segment.filesz;
+  });
+  if (load == loads_.end())
+    return false;
+  eh_frame_ = file_->data() + load->offset + (eh_frame - load->vaddr);
+  eh_frame_size_ = load->vaddr + load->filesz - eh_frame;
+  eh_frame_addr_ = eh_frame;
+
+  Reader r(eh_frame_, eh_frame_size_, eh_frame_addr_);
+  std::map<size_t, Cie> cies;
+  while (!r.done())
+  {
+    size_t entry = r.pos();
+    size_t end, id_pos;
+    uint64_t id;
+    if (!read_entry(r, end, id, id_pos) || end > eh_frame_size_)
+      break;
+    // The CIE pointer of an FDE is relative to itself
+    if (id != 0 && id <= id_pos)
+    {
+      size_t cie_pos = id_pos - id;
+      auto found = cies.find(cie_pos);
+      if (found == cies.end())
+      {
+        Reader cr(eh_frame_, eh_frame_size_, eh_frame_addr_);
+        Cie cie;
+        if (!read_cie(cr, cie_pos, cie))
+          cie.ra_reg = ~0ULL;
+        found = cies.emplace(cie_pos, cie).first;
+      }
+      if (found->second.ra_reg == REG_RA)
+      {
+        uint8_t enc = found->second.fde_enc;
+        uint64_t start = r.pointer(enc);
+        uint64_t range = r.pointer(enc & 0x0f);
+        if (r.ok() && range > 0)
+          fdes_.push_back({ start, start + range, entry });
+      }
+    }
+    r.seek(end);
+  }
+  std::sort(fdes_.begin(), fdes_.end(), [](auto &a, auto &b) {
+    return a.start < b.start;
+  });
+  return true;
+}
+
+bool EhFrameTable::find(uint64_t addr, Rule &rule) const
+{
+  auto fde = std::upper_bound(fdes_.begin(),
+                              fdes_.end(),
+                              addr,
+                              [](uint64_t addr, const Fde &fde) {
+                                return addr < fde.start;
+                              });
+  if (fde == fdes_.begin() || addr >= (--fde)->end)
+    return false;
+
+  Reader r(eh_frame_, eh_frame_size_, eh_frame_addr_);
+  r.seek(fde->offset);
+  size_t end, id_pos;
+  uint64_t id;
+  Cie cie;
+  if (!read_entry(r, end, id, id_pos))
+    return false;
+  Reader cr(eh_frame_, eh_frame_size_, eh_frame_addr_);
+  if (!read_cie(cr, id_pos - id, cie))
+    return false;
+  uint64_t start = r.pointer(cie.fde_enc);
+  r.pointer(cie.fde_enc & 0x0f);
+  if (cie.has_augmentation_data)
+    r.seek(r.pos() + r.uleb());
+
+  Row initial;
+  if (!run(cr, cie.end, cie, start, ~0ULL, initial, initial))
+    return false;
+  Row row = initial;
+  if (!run(r, end, cie, start, addr, initial, row))
+    return false;
+
+  if (row.cfa_expression || (row.cfa_reg != REG_RSP && row.cfa_reg != REG_RBP))
+    return false;
+  auto &ra = row.regs[REG_RA];
+  auto &bp = row.regs[REG_RBP];
+  if (ra.kind != Row::Reg::Kind::offset || bp.kind == Row::Reg::Kind::other)
+    return false;
+
+  rule.cfa_reg = row.cfa_reg == REG_RSP ? Rule::Cfa::sp : Rule::Cfa::bp;
+  rule.cfa_offset = row.cfa_offset;
+  rule.ra_offset = ra.offset;
+  rule.bp_saved = bp.kind == Row::Reg::Kind::offset;
+  rule.bp_offset = bp.offset;
+  return true;
+}
+
+bool EhFrameTable::vaddr(uint64_t off, uint64_t &addr) const
+{
+  for (auto &load : loads_)
+  {
+    if (off >= load.offset && off < load.offset + load.filesz)
+    {
+      addr = off - load.offset + load.vaddr;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<uint64_t> Unwinder::unwind(const DwarfStack &stack, size_t limit)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<uint64_t> frames;
+  // Kernel addresses have the top bit set
+  if (limit == 0 || static_cast<int64_t>(stack.ip) < 0)
+    return frames;
+
+  size_t size = std::min<uint64_t>(stack.size, sizeof(stack.data));
+  auto read = [&](uint64_t addr, uint64_t &value) {
+    if (addr < stack.sp || addr - stack.sp + sizeof(value) > size)
+      return false;
+    memcpy(&value, stack.data + (addr - stack.sp), sizeof(value));
+    return true;
+  };
+
+  int pid = stack.pid;
+  uint64_t pc = stack.ip;
+  uint64_t sp = stack.sp;
+  uint64_t bp = stack.bp;
+  while (true)
+  {
+    frames.push_back(pc);
+    if (frames.size() >= limit)
+      break;
+
+    // The return addresses of the callers are past their call instruction,
+    // which can be the last one of the function
+    uint64_t addr = frames.size() > 1 ? pc - 1 : pc;
+    EhFrameTable::Rule rule;
+    bool found = false;
+    if (auto mapping = this->mapping(pid, addr))
+    {
+      auto table = this->table(pid, *mapping);
+      uint64_t vaddr;
+      found = table &&
+              table->vaddr(addr - mapping->start + mapping->offset, vaddr) &&
+              table->find(vaddr, rule);
+    }
+
+    uint64_t cfa, ra, next_bp = bp;
+    if (found)
+    {
+      cfa = (rule.cfa_reg == EhFrameTable::Rule::Cfa::sp ? sp : bp) +
+            rule.cfa_offset;
+      if (!read(cfa + rule.ra_offset, ra) ||
+          (rule.bp_saved && !read(cfa + rule.bp_offset, next_bp)))
+        break;
+    }
+    else
+    {
+      // Code without call frame information, e.g. JIT compiled, may still
+      // keep frame pointers
+      cfa = bp + 16;
+      if (!read(bp + 8, ra) || !read(bp, next_bp))
+        break;
+    }
+    // The stack grows down, each caller's frame is above
+    if (cfa <= sp || ra == 0)
+      break;
+    pc = ra;
+    sp = cfa;
+    bp = next_bp;
+  }
+  return frames;
+}
+
+SymbolCache::Mapping *Unwinder::mapping(int pid, uint64_t addr)
+{
+  if (processes_.size() >= MAX_PROCESSES && !processes_.count(pid))
+    processes_.clear();
+  auto &process = processes_[pid];
+  auto now = std::chrono::steady_clock::now();
+  for (bool missed : { false, true })
+  {
+    auto interval = missed ? MAPS_MISS_INTERVAL : MAPS_REFRESH_INTERVAL;
+    if (process.read == std::chrono::steady_clock::time_point() ||
+        now - process.read >= interval)
+    {
+      auto mappings = SymbolCache::read_mappings(pid);
+      process.read = now;
+      // Keep what we had for processes that are gone, and the build-ids of
+      // the mappings that didn't change
+      if (!mappings.empty())
+      {
+        for (auto &mapping : mappings)
+        {
+          for (auto &known : process.mappings)
+          {
+            if (known.start == mapping.start && known.end == mapping.end &&
+                known.offset == mapping.offset && known.path == mapping.path)
+              mapping.build_id = known.build_id;
+          }
+        }
+        process.mappings = std::move(mappings);
+      }
+    }
+
+    for (auto &mapping : process.mappings)
+    {
+      if (addr >= mapping.start && addr < mapping.end)
+        return &mapping;
+    }
+  }
+  return nullptr;
+}
+
+const EhFrameTable *Unwinder::table(int pid, SymbolCache::Mapping &mapping)
+{
+  // Read the file through the process, as SymbolCache does
+  std::string path = "/proc/" + std::to_string(pid) + "/root" + mapping.path;
+  if (mapping.build_id.empty())
+  {
+    mapping.build_id = SymbolIndex::build_id(path);
+    if (mapping.build_id.empty())
+      mapping.build_id = "-";
+  }
+  const std::string &key = mapping.build_id != "-" ? mapping.build_id : path;
+
+  auto found = tables_.find(key);
+  if (found != tables_.end())
+    return found->second.get();
+  if (tables_.size() >= MAX_TABLES)
+    tables_.clear();
+  // Files without a table are remembered too, they're unwound through rbp
+  return tables_.emplace(key, EhFrameTable::build(path)).first->second.get();
+}
+
+} // namespace bpftrace
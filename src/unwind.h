@@ -0,0 +1,124 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "symbol_cache.h"
+#include "types.h"
+
+namespace bpftrace {
+
+class MappedFile;
+
+/**
+   The call frame information of an ELF file, from the .eh_frame its
+   PT_GNU_EH_FRAME segment points at, sorted by address for finding how to
+   get to the caller of any address of the file.
+
+   Only what the x86_64 System V ABI needs is interpreted: the CFA as rsp or
+   rbp plus an offset, and where the return address and rbp are saved.
+   Functions whose rules are DWARF expressions (e.g. PLT stubs) end the
+   unwinding.
+*/
+class EhFrameTable
+{
+public:
+  // How to find the caller of an address, the CFA (canonical frame
+  // address) is the sp of the caller
+  struct Rule
+  {
+    enum class Cfa
+    {
+      sp,
+      bp,
+    };
+    Cfa cfa_reg;
+    int64_t cfa_offset;
+    // The return address and rbp are saved at CFA + offset, rbp is kept as
+    // it is otherwise
+    int64_t ra_offset;
+    bool bp_saved;
+    int64_t bp_offset;
+  };
+
+  /**
+     Table of the file at path, nullptr if it isn't a 64-bit ELF file or
+     has no .eh_frame
+  */
+  static std::unique_ptr<EhFrameTable> build(const std::string &path);
+  ~EhFrameTable();
+
+  /**
+     Rule at addr (an address of the file as it was linked), false when no
+     FDE covers it or it can't be interpreted
+  */
+  bool find(uint64_t addr, Rule &rule) const;
+
+  /**
+     Address of the byte at file offset off once loaded, false when it's not
+     part of any PT_LOAD segment
+  */
+  bool vaddr(uint64_t off, uint64_t &addr) const;
+
+private:
+  struct Fde
+  {
+    uint64_t start;
+    uint64_t end;
+    // Of the FDE in the .eh_frame
+    size_t offset;
+  };
+
+  explicit EhFrameTable(const std::string &path);
+  bool parse();
+
+  std::unique_ptr<MappedFile> file_;
+  std::vector<SymbolIndex::Load> loads_;
+  // Where the .eh_frame is in file_ and once loaded
+  const uint8_t *eh_frame_ = nullptr;
+  size_t eh_frame_size_ = 0;
+  uint64_t eh_frame_addr_ = 0;
+  std::vector<Fde> fdes_;
+};
+
+/**
+   Unwinds the stacks of ustack(dwarf) from the registers and the copy of
+   the stack the BPF program took, with the EhFrameTable of each binary
+   mapped by the process. Frames of code without call frame information
+   are followed through rbp, as bpf_get_stackid() would.
+
+   The tables are kept by build-id for the rest of the run, the mappings of
+   the processes are read again every second and whenever an address isn't
+   part of any.
+*/
+class Unwinder
+{
+public:
+  /**
+     Return addresses of the stack, the innermost (the address the stack
+     was taken at) first, at most limit of them. Empty for stacks taken in
+     the kernel.
+  */
+  std::vector<uint64_t> unwind(const DwarfStack &stack, size_t limit);
+
+private:
+  struct Process
+  {
+    std::vector<SymbolCache::Mapping> mappings;
+    std::chrono::steady_clock::time_point read;
+  };
+  const EhFrameTable *table(int pid, SymbolCache::Mapping &mapping);
+  SymbolCache::Mapping *mapping(int pid, uint64_t addr);
+
+  std::mutex mutex_;
+  // By build-id, or by path for the files without one
+  std::map<std::string, std::unique_ptr<EhFrameTable>> tables_;
+  std::map<int, Process> processes_;
+};
+
+} // namespace bpftrace
@@ -1,16 +1,29 @@
 #include "usdt.h"
 #include "log.h"
+#include "symbol_cache.h"
+#include "utils.h"
 
 #include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
 #include <bcc/bcc_elf.h>
 #include <bcc/bcc_usdt.h>
 
+// Threads reading the binaries mapped by a process at most
+#define USDT_READ_THREADS_MAX 8
+
 static std::unordered_set<std::string> path_cache;
 static std::unordered_set<int> pid_cache;
 
@@ -24,35 +37,133 @@ static std::unordered_map<std::string,
 static std::unordered_map<int, std::unordered_set<std::string>>
     usdt_pid_to_paths_cache;
 
-// Used as a temporary buffer, during read_probes_for_pid to maintain
-// current tracepoint paths for the current pid
-static std::unordered_set<std::string> current_pid_paths;
+// Directory the probes of each binary are kept in across runs, none if empty
+static std::string cache_dir;
+
+// Where usdt_probe_each() adds the probes of the binary read by the current
+// thread
+static thread_local usdt_probe_list *current_probes;
 
 static void usdt_probe_each(struct bcc_usdt *usdt_probe)
 {
-  usdt_provider_cache[usdt_probe->bin_path][usdt_probe->provider].emplace_back(
-      usdt_probe_entry{
-          .path = usdt_probe->bin_path,
-          .provider = usdt_probe->provider,
-          .name = usdt_probe->name,
+  current_probes->emplace_back(usdt_probe_entry{
+      .path = usdt_probe->bin_path,
+      .provider = usdt_probe->provider,
+      .name = usdt_probe->name,
 #ifdef LIBBCC_ATTACH_UPROBE_SEVEN_ARGS_SIGNATURE
-          .semaphore_offset = usdt_probe->semaphore_offset,
+      .semaphore_offset = usdt_probe->semaphore_offset,
 #else
-          .semaphore_offset = 0,
+      .semaphore_offset = 0,
 #endif
-          .num_locations = usdt_probe->num_locations,
-      });
-  current_pid_paths.emplace(usdt_probe->bin_path);
+      .num_locations = usdt_probe->num_locations,
+  });
+}
+
+/**
+ * The file in cache_dir the probes of the binary at path are kept in, and
+ * the line it starts with as long as it's the same binary: its build-id, or
+ * for binaries without one their modification time and size
+ */
+static bool cache_file(const std::string &path,
+                       std::string &file,
+                       std::string &key)
+{
+  struct stat st;
+  if (cache_dir.empty() || stat(path.c_str(), &st) != 0)
+    return false;
+
+  std::string build_id = bpftrace::SymbolIndex::build_id(path);
+  if (!build_id.empty())
+  {
+    file = cache_dir + "/" + build_id + ".usdt";
+    key = "build-id " + build_id;
+  }
+  else
+  {
+    file = cache_dir + "/" + std::to_string(st.st_dev) + "-" +
+           std::to_string(st.st_ino) + ".usdt";
+    key = "mtime " + std::to_string(st.st_mtim.tv_sec) + "." +
+          std::to_string(st.st_mtim.tv_nsec) + " size " +
+          std::to_string(st.st_size);
+  }
+  return true;
+}
+
+// The rest of the file is a "provider name semaphore_offset locations" line
+// for each probe
+static bool load_probes(const std::string &file,
+                        const std::string &key,
+                        const std::string &path,
+                        usdt_probe_list &probes)
+{
+  std::ifstream in(file);
+  std::string line;
+  if (!std::getline(in, line) || line != key)
+    return false;
+
+  usdt_probe_entry probe;
+  probe.path = path;
+  while (in >> probe.provider >> probe.name >> probe.semaphore_offset >>
+         probe.num_locations)
+    probes.push_back(probe);
+  return in.eof();
+}
+
+static void store_probes(const std::string &file,
+                         const std::string &key,
+                         const usdt_probe_list &probes)
+{
+  if (mkdir(cache_dir.c_str(), 0700) && errno != EEXIST)
+    return;
+
+  std::ostringstream out;
+  out << key << std::endl;
+  for (auto &probe : probes)
+    out << probe.provider << " " << probe.name << " " << probe.semaphore_offset
+        << " " << probe.num_locations << std::endl;
+  bpftrace::write_file_atomic(file, out.str());
 }
 
 /**
- * Move the current pid paths onto the pid_to_paths_cache, and clear
- * current_pid_paths.
+ * Probes of the binary at path, from the cache directory if they were read
+ * before. Returns false if it's not a binary bcc can read.
  */
-static void cache_current_pid_paths(int pid)
+static bool read_binary_probes(const std::string &path,
+                               usdt_probe_list &probes)
+{
+  std::string file, key;
+  bool cacheable = cache_file(path, file, key);
+  if (cacheable && load_probes(file, key, path, probes))
+    return true;
+  probes.clear();
+
+  void *ctx = bcc_usdt_new_frompath(path.c_str());
+  if (ctx == nullptr)
+    return false;
+  current_probes = &probes;
+  bcc_usdt_foreach(ctx, usdt_probe_each);
+  bcc_usdt_close(ctx);
+  current_probes = nullptr;
+
+  // Keyed by the path they were asked for, like the ones read from the cache
+  for (auto &probe : probes)
+    probe.path = path;
+  if (cacheable)
+    store_probes(file, key, probes);
+  return true;
+}
+
+static void cache_probes(const std::string &path, usdt_probe_list &probes)
+{
+  auto &providers = usdt_provider_cache[path];
+  for (auto &probe : probes)
+    providers[probe.provider].push_back(std::move(probe));
+  path_cache.emplace(path);
+}
+
+void USDTHelper::set_cache_dir(const std::string &dir)
 {
-  usdt_pid_to_paths_cache[pid].merge(current_pid_paths);
-  current_pid_paths.clear();
+  cache_dir = dir;
 }
 
 std::optional<usdt_probe_entry> USDTHelper::find(int pid,
@@ -130,8 +241,15 @@ void USDTHelper::read_probes_for_pid(int pid)
 
   if (pid > 0)
   {
-    void *ctx = bcc_usdt_new_frompid(pid, nullptr);
-    if (ctx == nullptr)
+    // The binaries the process maps, as bcc_usdt_new_frompid() reads them
+    std::vector<std::string> paths;
+    for (auto &mapping : bpftrace::SymbolCache::read_mappings(pid))
+    {
+      std::string path = bpftrace::path_for_pid_mountns(pid, mapping.path);
+      if (std::find(paths.begin(), paths.end(), path) == paths.end())
+        paths.push_back(path);
+    }
+    if (paths.empty())
     {
       LOG(ERROR) << "failed to initialize usdt context for pid: " << pid;
 
@@ -140,9 +258,38 @@ void USDTHelper::read_probes_for_pid(int pid)
 
       return;
     }
-    bcc_usdt_foreach(ctx, usdt_probe_each);
-    bcc_usdt_close(ctx);
-    cache_current_pid_paths(pid);
+
+    // Processes can map dozens of libraries, the ones not read yet are read
+    // in parallel
+    std::vector<std::string> unread;
+    for (auto &path : paths)
+      if (!path_cache.count(path))
+        unread.push_back(path);
+    std::vector<usdt_probe_list> probes(unread.size());
+    std::atomic<size_t> next(0);
+    auto read = [&]() {
+      for (size_t i; (i = next++) < unread.size();)
+        read_binary_probes(unread[i], probes[i]);
+    };
+    size_t nthreads = std::min<size_t>(
+        { unread.size(),
+          std::max(1U, std::thread::hardware_concurrency()),
+          USDT_READ_THREADS_MAX });
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++)
+      threads.emplace_back(read);
+    read();
+    for (auto &thread : threads)
+      thread.join();
+
+    for (size_t i = 0; i < unread.size(); i++)
+      cache_probes(unread[i], probes[i]);
+    for (auto &path : paths)
+    {
+      auto providers = usdt_provider_cache.find(path);
+      if (providers != usdt_provider_cache.end() && !providers->second.empty())
+        usdt_pid_to_paths_cache[pid].insert(path);
+    }
 
     pid_cache.emplace(pid);
   }
@@ -157,14 +304,11 @@ void USDTHelper::read_probes_for_path(const std::string &path)
   if (path_cache.count(path))
     return;
 
-  void *ctx = bcc_usdt_new_frompath(path.c_str());
-  if (ctx == nullptr)
+  usdt_probe_list probes;
+  if (!read_binary_probes(path, probes))
   {
     LOG(ERROR) << "failed to initialize usdt context for path " << path;
     return;
   }
-  bcc_usdt_foreach(ctx, usdt_probe_each);
-  bcc_usdt_close(ctx);
-
-  path_cache.emplace(path);
+  cache_probes(path, probes);
 }
@@ -27,6 +27,9 @@ public:
   static usdt_probe_list probes_for_pid(int pid);
   static usdt_probe_list probes_for_path(const std::string &path);
 
+  // Keep the probes found in binaries in dir, see BPFTRACE_SYMBOL_CACHE_DIR
+  static void set_cache_dir(const std::string &dir);
+
 private:
   static void read_probes_for_pid(int pid);
   static void read_probes_for_path(const std::string &path);
@@ -9,11 +9,13 @@
 #include <link.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
 #include <sys/auxv.h>
 #include <sys/stat.h>
+#include <thread>
 #include <tuple>
 #include <unistd.h>
 
@@ -169,6 +171,33 @@ std::string get_pid_exe(pid_t pid)
   return get_pid_exe(std::to_string(pid));
 }
 
+std::string get_pid_exe_id(pid_t pid)
+{
+  // stat() follows the link into the mount namespace of pid
+  struct stat st;
+  std::string exe = "/proc/" + std::to_string(pid) + "/exe";
+  if (stat(exe.c_str(), &st) != 0)
+    return "";
+  return std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+}
+
+std::vector<pid_t> get_pids_by_comm(const std::string &comm)
+{
+  std::vector<pid_t> pids;
+  std::error_code ec;
+  for (auto &entry : std_filesystem::directory_iterator("/proc", ec))
+  {
+    auto pid = entry.path().filename().string();
+    if (!is_numeric(pid))
+      continue;
+    std::ifstream file(entry.path() / "comm");
+    std::string name;
+    if (std::getline(file, name) && name == comm)
+      pids.push_back(std::stoi(pid));
+  }
+  return pids;
+}
+
 bool has_wildcard(const std::string &str)
 {
   return str.find("*") != std::string::npos ||
@@ -232,6 +261,106 @@ std::vector<int> get_possible_cpus()
   return read_cpu_range("/sys/devices/system/cpu/possible");
 }
 
+std::vector<std::vector<int>> get_numa_nodes()
+{
+  std::vector<std::vector<int>> nodes;
+  for (auto &path :
+       expand_wildcard_path("/sys/devices/system/node/node*/cpulist"))
+  {
+    std::ifstream file(path);
+    std::string list;
+    // Nodes of memory alone have an empty list
+    if (!std::getline(file, list) || list.empty())
+      continue;
+    try
+    {
+      nodes.push_back(parse_cpu_list(list));
+    }
+    catch (const std::invalid_argument &)
+    {
+      return {};
+    }
+  }
+  return nodes;
+}
+
+std::vector<int> parse_cpu_list(const std::string &list)
+{
+  auto parse_cpu = [&](const std::string &cpu) {
+    std::size_t idx = 0;
+    int n = -1;
+    try
+    {
+      n = std::stoi(cpu, &idx, 10);
+    }
+    catch (const std::exception &)
+    {
+    }
+    if (n < 0 || idx != cpu.size())
+      throw std::invalid_argument("invalid CPU list: " + list);
+    return n;
+  };
+
+  std::vector<int> cpus;
+  for (auto &range : split_string(list, ','))
+  {
+    std::size_t rangeop = range.find('-');
+    int start = parse_cpu(range.substr(0, rangeop));
+    int end = start;
+    if (rangeop != std::string::npos)
+      end = parse_cpu(range.substr(rangeop + 1));
+    if (end < start)
+      throw std::invalid_argument("invalid CPU list: " + list);
+    for (int i = start; i <= end; i++)
+      cpus.push_back(i);
+  }
+  if (cpus.empty())
+    throw std::invalid_argument("invalid CPU list: " + list);
+  return cpus;
+}
+
+std::vector<int> get_probe_cpus(const std::string &cpus)
+{
+  std::vector<int> online = get_online_cpus();
+  if (cpus.empty())
+    return online;
+
+  std::vector<int> wanted;
+  if (cpus[0] == '/')
+  {
+    // The cpuset of a cgroup, with the cgroup v1 name in second
+    std::string list;
+    for (auto name : { "cpuset.cpus.effective", "cpuset.effective_cpus" })
+    {
+      std::ifstream file(cpus + "/" + name);
+      if (std::getline(file, list))
+        break;
+    }
+    if (list.empty())
+      throw std::runtime_error("could not read the cpuset of cgroup " + cpus);
+    try
+    {
+      wanted = parse_cpu_list(list);
+    }
+    catch (const std::invalid_argument &ex)
+    {
+      throw std::runtime_error("cgroup " + cpus + " has an " + ex.what());
+    }
+  }
+  else
+    wanted = parse_cpu_list(cpus);
+
+  std::vector<int> ret;
+  for (int cpu : wanted)
+  {
+    if (std::find(online.begin(), online.end(), cpu) != online.end())
+      ret.push_back(cpu);
+  }
+  if (ret.empty())
+    throw std::runtime_error("none of the CPUs " + cpus + " is online");
+  return ret;
+}
+
 std::vector<std::string> get_kernel_cflags(
     const char* uname_machine,
     const std::string& ksrc,
@@ -305,6 +434,14 @@ bool is_dir(const std::string& path)
   return std_filesystem::is_directory(buf, ec);
 }
 
+std::string get_boot_id()
+{
+  std::ifstream boot_id_file("/proc/sys/kernel/random/boot_id");
+  std::string boot_id;
+  std::getline(boot_id_file, boot_id);
+  return boot_id;
+}
+
 namespace {
   struct KernelHeaderTmpDir {
     KernelHeaderTmpDir(const std::string& prefix) : path{prefix + "XXXXXX"}
@@ -560,10 +697,11 @@ resolve_binary_path(const std::string &cmd, const char *env_paths, int pid)
     candidate_paths = ::expand_wildcard_paths(candidate_paths);
 
   std::vector<std::string> valid_executable_paths;
+  bool other_mountns = pid > 0 && pid_in_different_mountns(pid);
   for (const auto &path : candidate_paths)
   {
     std::string rel_path;
-    if (pid > 0 && pid_in_different_mountns(pid))
+    if (other_mountns)
       rel_path = path_for_pid_mountns(pid, path);
     else
       rel_path = path;
@@ -607,42 +745,37 @@ If an invalid PID is specified or doesn't exist, it returns false.
 True is only returned if the namespace of the target process could be read and
 it doesn't match that of bpftrace. If there was an error reading either mount
 namespace, it will throw an exception
+
+The namespace of bpftrace is read once, each call then only takes a stat() of
+the one of pid.
 */
 static bool pid_in_different_mountns(int pid)
 {
   if (pid <= 0)
     return false;
 
-  std::error_code ec;
-  std_filesystem::path self_path{ "/proc/self/ns/mnt" };
-  std_filesystem::path target_path{ "/proc" };
-  target_path /= std::to_string(pid);
-  target_path /= "ns/mnt";
-
-  if (!std_filesystem::exists(self_path, ec))
+  static struct stat self_ns;
+  static int self_errno = [] {
+    return stat("/proc/self/ns/mnt", &self_ns) == 0 ? 0 : errno;
+  }();
+  if (self_errno)
   {
     throw MountNSException(
         "Failed to compare mount ns with PID " + std::to_string(pid) +
-        ". The error was open (/proc/self/ns/mnt): " + ec.message());
+        ". The error was open (/proc/self/ns/mnt): " + strerror(self_errno));
   }
 
-  if (!std_filesystem::exists(target_path, ec))
+  struct stat target_ns;
+  std::string target_path = "/proc/" + std::to_string(pid) + "/ns/mnt";
+  if (stat(target_path.c_str(), &target_ns) != 0)
   {
     throw MountNSException(
         "Failed to compare mount ns with PID " + std::to_string(pid) +
-        ". The error was open (/proc/<pid>/ns/mnt): " + ec.message());
-  }
-
-  bool result = !std_filesystem::equivalent(self_path, target_path, ec);
-
-  if (ec)
-  {
-    throw MountNSException("Failed to compare mount ns with PID " +
-                           std::to_string(pid) +
-                           ". The error was (fstat): " + ec.message());
+        ". The error was open (/proc/<pid>/ns/mnt): " + strerror(errno));
   }
 
-  return result;
+  return self_ns.st_dev != target_ns.st_dev ||
+         self_ns.st_ino != target_ns.st_ino;
 }
 
 void cat_file(const char *filename, size_t max_bytes, std::ostream &out)
@@ -800,6 +933,64 @@ uint64_t parse_exponent(const char *str)
   return num;
 }
 
+size_t llhist_buckets(uint64_t sub_buckets)
+{
+  // Values are signed 64 bit, so the largest power-of-2 range is [2^62, 2^63)
+  size_t bits = __builtin_ctzll(sub_buckets);
+  return 1 + (64 - bits) * sub_buckets;
+}
+
+void llhist_bucket_range(size_t index,
+                         uint64_t sub_buckets,
+                         uint64_t &min,
+                         uint64_t &max)
+{
+  uint64_t linear = index - 1;
+  if (linear < sub_buckets)
+  {
+    min = max = linear;
+    return;
+  }
+
+  uint64_t shift = linear / sub_buckets - 1;
+  uint64_t sub = linear % sub_buckets + sub_buckets;
+  min = sub << shift;
+  max = ((sub + 1) << shift) - 1;
+}
+
+uint64_t cms_hash(const uint8_t *key, size_t size, bool is_string)
+{
+  uint64_t hash;
+  if (is_string)
+  {
+    // FNV-1a
+    hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size && key[i]; i++)
+    {
+      hash ^= key[i];
+      hash *= 1099511628211ULL;
+    }
+  }
+  else
+    hash = read_data<uint64_t>(key);
+
+  // splitmix64 finalizer
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+size_t cms_column(uint64_t hash, int row)
+{
+  // Double hashing, the rows only need pairwise independent columns
+  uint32_t h1 = hash;
+  uint32_t h2 = (hash >> 32) | 1;
+  return (h1 + row * h2) & (CMS_WIDTH - 1);
+}
+
 /**
  * Search for LINUX_VERSION_CODE in the vDSO, returning 0 if it can't be found.
  */
@@ -886,6 +1077,9 @@ static uint32_t kernel_version_from_khdr(void)
  */
 uint32_t kernel_version(int attempt)
 {
+  // Programs are loaded on several threads, see BPFtrace::load_progs()
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
   static std::optional<uint32_t> a0, a1, a2;
   switch (attempt)
   {
@@ -913,6 +1107,39 @@ uint32_t kernel_version(int attempt)
   }
 }
 
+namespace {
+std::mutex load_versions_mutex;
+std::optional<uint32_t> loaded_version;
+} // namespace
+
+std::vector<uint32_t> kernel_load_versions()
+{
+  std::vector<uint32_t> versions;
+  {
+    std::lock_guard<std::mutex> lock(load_versions_mutex);
+    if (loaded_version)
+      versions.push_back(*loaded_version);
+  }
+  for (int attempt = 0; attempt < 3; attempt++)
+  {
+    auto version = kernel_version(attempt);
+    // Recent kernels don't check the version so it's tried first even if it
+    // couldn't be determined, but not after that to avoid zeroing the log of
+    // older kernels
+    if (version == 0 && attempt > 0)
+      continue;
+    if (std::find(versions.begin(), versions.end(), version) == versions.end())
+      versions.push_back(version);
+  }
+  return versions;
+}
+
+void kernel_version_loaded(uint32_t version)
+{
+  std::lock_guard<std::mutex> lock(load_versions_mutex);
+  loaded_version = version;
+}
+
 std::optional<std::string> abs_path(const std::string &rel_path)
 {
   // filesystem::canonical does not work very well with /proc/<pid>/root paths
@@ -937,4 +1164,31 @@ std::optional<std::string> abs_path(const std::string &rel_path)
   }
 }
 
+std::string atomic_tmp_path(const std::string &path)
+{
+  auto tid = std::hash<std::thread::id>()(std::this_thread::get_id());
+  return path + ".tmp." + std::to_string(getpid()) + "." +
+         std::to_string(tid);
+}
+
+bool write_file_atomic(const std::string &path, const std::string &data)
+{
+  std::string tmp_path = atomic_tmp_path(path);
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    if (!out)
+    {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()))
+  {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
 } // namespace bpftrace
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <charconv>
+#include <csignal>
 #include <cstring>
 #include <exception>
 #include <iostream>
@@ -7,6 +9,7 @@
 #include <sstream>
 #include <string>
 #include <sys/utsname.h>
+#include <thread>
 #include <tuple>
 #include <unordered_set>
 #include <vector>
@@ -128,6 +131,11 @@ static std::vector<std::string> COMPILE_TIME_FUNCS = { "cgroupid" };
 bool get_uint64_env_var(const ::std::string &str, uint64_t &dest);
 std::string get_pid_exe(pid_t pid);
 std::string get_pid_exe(const std::string &pid);
+// The device and inode of the executable of pid, the same for the processes
+// of all the mount namespaces running the same file, "" if pid is gone
+std::string get_pid_exe_id(pid_t pid);
+// The running processes whose comm is comm
+std::vector<pid_t> get_pids_by_comm(const std::string &comm);
 bool has_wildcard(const std::string &str);
 std::vector<std::string> split_string(const std::string &str,
                                       char delimiter,
@@ -139,7 +147,20 @@ bool wildcard_match(const std::string &str,
                     bool end_wildcard);
 std::vector<int> get_online_cpus();
 std::vector<int> get_possible_cpus();
+// The online CPUs of each NUMA node having some, empty if the system doesn't
+// tell
+std::vector<std::vector<int>> get_numa_nodes();
+// CPUs in the format of the kernel's CPU lists, e.g. "0-3,8". Throws
+// std::invalid_argument if it isn't one.
+std::vector<int> parse_cpu_list(const std::string &list);
+// The online CPUs among the ones a probe counts on: a CPU list or the path
+// of a cgroup whose cpuset is read, all of them if cpus is empty. Throws
+// std::runtime_error if there are none, std::invalid_argument if cpus isn't
+// a CPU list.
+std::vector<int> get_probe_cpus(const std::string &cpus);
 bool is_dir(const std::string &path);
+// Changes with each boot of the kernel
+std::string get_boot_id();
 std::tuple<std::string, std::string> get_kernel_dirs(
     const struct utsname &utsname,
     bool unpack_kheaders);
@@ -162,6 +183,12 @@ bool symbol_has_cpp_mangled_signature(const std::string &sym_name);
 pid_t parse_pid(const std::string &str);
 std::string hex_format_buffer(const char *buf, size_t size);
 std::optional<std::string> abs_path(const std::string &rel_path);
+// The file written before being renamed to path, unique to the calling
+// thread
+std::string atomic_tmp_path(const std::string &path);
+// Writes data to a file renamed to path once complete, so that concurrent
+// runs never see a partial file
+bool write_file_atomic(const std::string &path, const std::string &data);
 
 // Generate object file section name for a given probe
 inline std::string get_section_name_for_probe(
@@ -179,6 +206,23 @@ inline std::string get_section_name_for_probe(
   return ret;
 }
 
+// Section of a program split off a large probe, called from the probe's
+// program through the given slot of the tail call map
+inline std::string get_section_name_for_tail_call(
+    const std::string &section_name,
+    int slot)
+{
+  return section_name + "_tail" + std::to_string(slot);
+}
+
+// Section of the actual program of a probe with --estimate, which only
+// counts the runs of the probe in the section it's attached from
+inline std::string get_section_name_for_estimate(
+    const std::string &section_name)
+{
+  return "estimate_" + section_name;
+}
+
 inline std::string get_watchpoint_setup_probe_name(
     const std::string &probe_name)
 {
@@ -221,6 +265,49 @@ T read_data(const void *src)
   return v;
 }
 
+// Appends the decimal digits of an integer, without going through a stream
+template <typename T>
+void append_num(std::string &out, T value)
+{
+  char buf[24];
+  auto res = std::to_chars(buf, buf + sizeof(buf), value);
+  out.append(buf, res.ptr);
+}
+
+// Starts a thread running f with every signal blocked. Signals (e.g. SIGINT)
+// must keep being delivered to the main thread, which is the one checking for
+// them.
+template <typename F>
+std::thread start_thread_without_signals(F &&f)
+{
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  std::thread thread(std::forward<F>(f));
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  return thread;
+}
+
 uint64_t parse_exponent(const char *str);
+
+// llhist() splits every power-of-2 range into sub_buckets (a power of 2)
+// linear buckets. Bucket 0 is for negative values, and values smaller than
+// sub_buckets get a bucket each.
+size_t llhist_buckets(uint64_t sub_buckets);
+// Smallest and largest value of llhist() bucket index, index must be > 0
+void llhist_bucket_range(size_t index,
+                         uint64_t sub_buckets,
+                         uint64_t &min,
+                         uint64_t &max);
+// Hash of a cms_count() key, the same as computed by the BPF programs. String
+// keys are hashed up to their terminating NUL.
+uint64_t cms_hash(const uint8_t *key, size_t size, bool is_string);
+// Counter of the hash in the given count-min sketch row
+size_t cms_column(uint64_t hash, int row);
 uint32_t kernel_version(int attempt);
+// Kernel versions to try loading a program with, in order, each once. The
+// one a program was last loaded with comes first.
+std::vector<uint32_t> kernel_load_versions();
+// Record the version a program was loaded with
+void kernel_version_loaded(uint32_t version);
 } // namespace bpftrace
@@ -154,6 +154,30 @@ TEST(ast, attach_point_name)
   EXPECT_EQ(ap3->name("readline"), "uprobe:/bin/sh:readline");
 }
 
+TEST(ast, node_arena)
+{
+  using bpftrace::ast::Integer;
+  using bpftrace::ast::NodeArena;
+
+  auto arena = NodeArena::create();
+  Integer *a, *b;
+  {
+    NodeArena::Scope scope(arena);
+    a = new Integer(1, location());
+    b = new Integer(2, location());
+  }
+  // From the heap
+  auto c = new Integer(3, location());
+
+  delete a;
+  // The nodes outlive the owner of the arena
+  arena->release();
+  EXPECT_EQ(b->n, 2);
+  EXPECT_EQ(c->n, 3);
+  delete b;
+  delete c;
+}
+
 } // namespace ast
 } // namespace test
 } // namespace bpftrace
@@ -0,0 +1,52 @@
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "bpftrace.h"
+#include "benchmark/benchmark.h"
+
+namespace bpftrace {
+namespace bench {
+namespace ksyms {
+
+// Kernel text addresses, spread across /proc/kallsyms
+static std::vector<uintptr_t> kernel_addresses()
+{
+  std::vector<uintptr_t> addrs;
+  std::ifstream kallsyms("/proc/kallsyms");
+  std::string line;
+  for (size_t i = 0; std::getline(kallsyms, line); i++)
+  {
+    std::istringstream fields(line);
+    uintptr_t addr;
+    char type;
+    if (i % 64 == 0 && fields >> std::hex >> addr >> type && addr &&
+        (type == 't' || type == 'T'))
+      addrs.push_back(addr + 1);
+  }
+  return addrs;
+}
+
+static void resolve_ksym(benchmark::State &state)
+{
+  auto addrs = kernel_addresses();
+  if (addrs.empty())
+  {
+    state.SkipWithError("no kernel addresses, /proc/kallsyms needs root");
+    return;
+  }
+
+  BPFtrace bpftrace;
+  // The first resolution loads the symbols
+  bpftrace.resolve_ksym(addrs[0]);
+  size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        bpftrace.resolve_ksym(addrs[i++ % addrs.size()], state.range(0)));
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(resolve_ksym)->ArgName("show_offset")->DenseRange(0, 1);
+
+} // namespace ksyms
+} // namespace bench
+} // namespace bpftrace
@@ -0,0 +1,195 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <streambuf>
+#include <sys/resource.h>
+
+#include "bpftrace.h"
+#include "map.h"
+#include "output.h"
+#include "benchmark/benchmark.h"
+
+// Every allocation of the bench binary goes through these, for the
+// benchmarks below to report the allocations made along with their time.
+// The array and nothrow forms call them too.
+static std::atomic<uint64_t> allocations{ 0 };
+static std::atomic<uint64_t> allocated_bytes{ 0 };
+
+void *operator new(size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace bpftrace {
+namespace bench {
+namespace memory {
+
+class NullBuf : public std::streambuf
+{
+protected:
+  int_type overflow(int_type ch) override
+  {
+    return traits_type::not_eof(ch);
+  }
+  std::streamsize xsputn(const char *, std::streamsize n) override
+  {
+    return n;
+  }
+};
+
+static NullBuf null_buf;
+static std::ostream null_stream(&null_buf);
+
+static std::unique_ptr<Output> make_output(int64_t format)
+{
+  switch (format)
+  {
+    case 1:
+      return std::make_unique<JsonOutput>(null_stream, null_stream);
+    case 2:
+      return std::make_unique<BinaryOutput>(null_stream, null_stream);
+    default:
+      return std::make_unique<TextOutput>(null_stream, null_stream);
+  }
+}
+
+// Allocations made between its construction and report(), per item
+class AllocCount
+{
+public:
+  AllocCount()
+      : allocations_(allocations.load()), bytes_(allocated_bytes.load())
+  {
+  }
+
+  void report(benchmark::State &state,
+              const std::string &per,
+              uint64_t items) const
+  {
+    double n = items ? items : 1;
+    state.counters["allocs_per_" + per] = (allocations.load() - allocations_) /
+                                          n;
+    state.counters["bytes_per_" + per] = (allocated_bytes.load() - bytes_) / n;
+    // The peak of the whole process so far, run a single benchmark with
+    // --benchmark_filter for the peak of it alone
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    state.counters["peak_rss_kb"] = usage.ru_maxrss;
+  }
+
+private:
+  uint64_t allocations_;
+  uint64_t bytes_;
+};
+
+static Field field(const SizedType &type, ssize_t offset)
+{
+  Field f;
+  f.type = type;
+  f.offset = offset;
+  f.is_bitfield = false;
+  return f;
+}
+
+// A stream of printf() events with integer, string and symbol arguments, as
+// they are read from the perf buffer: the printf() id, then the arguments
+static void printf_events(benchmark::State &state)
+{
+  BPFtrace bpftrace(make_output(state.range(0)));
+  std::string fmt = "pid %d comm %s ret %x file %s\n";
+  bpftrace.printf_args_.emplace_back(
+      fmt,
+      std::vector<Field>{ field(CreateInt64(), 8),
+                          field(CreateString(16), 16),
+                          field(CreateUInt32(), 32),
+                          field(CreateString(64), 40) });
+  bpftrace.printf_plans_.emplace_back(fmt);
+  bpftrace.out_->header(bpftrace);
+
+  std::vector<std::vector<uint8_t>> events;
+  for (int64_t pid = 0; pid < 64; pid++)
+  {
+    std::vector<uint8_t> event(104);
+    uint32_t ret = 0xdeadbeef + pid;
+    std::memcpy(event.data() + 8, &pid, sizeof(pid));
+    std::snprintf(reinterpret_cast<char *>(event.data() + 16),
+                  16,
+                  "comm-%ld",
+                  pid % 8);
+    std::memcpy(event.data() + 32, &ret, sizeof(ret));
+    std::snprintf(reinterpret_cast<char *>(event.data() + 40),
+                  64,
+                  "/var/log/file-%ld.log",
+                  pid);
+    events.push_back(std::move(event));
+  }
+
+  // The first events fill the caches and buffers reused after them
+  for (auto &event : events)
+    perf_event_printer(&bpftrace, event.data(), event.size());
+
+  AllocCount count;
+  size_t i = 0;
+  for (auto _ : state)
+  {
+    auto &event = events[i++ % events.size()];
+    perf_event_printer(&bpftrace, event.data(), event.size());
+  }
+  count.report(state, "event", state.iterations());
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(printf_events)->ArgName("format")->DenseRange(0, 2);
+
+// print() of a count() map read whole, of keys entries keyed by an integer
+// and a string, or its top 10 entries
+static void print_large_map(benchmark::State &state)
+{
+  BPFtrace bpftrace(make_output(state.range(0)));
+  uint64_t keys = state.range(1);
+  uint32_t top = state.range(2);
+  MapKey key;
+  key.args_ = { CreateInt64(), CreateString(16) };
+  SnapshotMap map("@bench", CreateCount(false), key, 0, 0, 0);
+  bpftrace.out_->header(bpftrace);
+
+  for (uint64_t i = 0; i < keys; i++)
+  {
+    std::vector<uint8_t> k(24), v(8);
+    std::memcpy(k.data(), &i, sizeof(i));
+    std::snprintf(
+        reinterpret_cast<char *>(k.data() + 8), 16, "comm-%lu", i % 500);
+    uint64_t value = i * 7 % 1000003;
+    std::memcpy(v.data(), &value, sizeof(value));
+    map.entries_.emplace(std::move(k), std::move(v));
+  }
+
+  AllocCount count;
+  for (auto _ : state)
+    bpftrace.print_map(map, top, 0);
+  count.report(state, "key", state.iterations() * keys);
+  state.SetItemsProcessed(state.iterations() * keys);
+}
+BENCHMARK(print_large_map)
+    ->ArgNames({ "format", "keys", "top" })
+    ->ArgsProduct({ { 0, 1, 2 }, { 10000, 1000000 }, { 0, 10 } })
+    ->Unit(benchmark::kMillisecond);
+
+} // namespace memory
+} // namespace bench
+} // namespace bpftrace
@@ -0,0 +1,154 @@
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+
+#include "bpftrace.h"
+#include "fake_map.h"
+#include "output.h"
+#include "benchmark/benchmark.h"
+
+namespace bpftrace {
+namespace bench {
+namespace output {
+
+// Throws the output away, so that only the formatting is measured
+class NullBuf : public std::streambuf
+{
+protected:
+  int_type overflow(int_type ch) override
+  {
+    return traits_type::not_eof(ch);
+  }
+  std::streamsize xsputn(const char *, std::streamsize n) override
+  {
+    return n;
+  }
+};
+
+static NullBuf null_buf;
+static std::ostream null_stream(&null_buf);
+
+// -f text, json or binary
+static std::unique_ptr<Output> make_output(int64_t format)
+{
+  switch (format)
+  {
+    case 1:
+      return std::make_unique<JsonOutput>(null_stream, null_stream);
+    case 2:
+      return std::make_unique<BinaryOutput>(null_stream, null_stream);
+    default:
+      return std::make_unique<TextOutput>(null_stream, null_stream);
+  }
+}
+
+static Field field(const SizedType &type, ssize_t offset)
+{
+  Field f;
+  f.type = type;
+  f.offset = offset;
+  f.is_bitfield = false;
+  return f;
+}
+
+static void printf_event(benchmark::State &state)
+{
+  BPFtrace bpftrace(make_output(state.range(0)));
+  std::string fmt = "pid %d comm %s ret %x\n";
+  bpftrace.printf_args_.emplace_back(
+      fmt,
+      std::vector<Field>{ field(CreateInt64(), 8),
+                          field(CreateString(16), 16),
+                          field(CreateUInt32(), 32) });
+  bpftrace.printf_plans_.emplace_back(fmt);
+  bpftrace.out_->header(bpftrace);
+
+  // As read from the perf buffer: the printf() id, then the arguments
+  uint8_t event[40] = {};
+  int64_t pid = 4242;
+  uint32_t ret = 0xdeadbeef;
+  std::memcpy(event + 8, &pid, sizeof(pid));
+  std::memcpy(event + 16, "systemd-journal", 16);
+  std::memcpy(event + 32, &ret, sizeof(ret));
+
+  for (auto _ : state)
+    perf_event_printer(&bpftrace, event, sizeof(event));
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(printf_event)->ArgName("format")->DenseRange(0, 2);
+
+static void print_map(benchmark::State &state)
+{
+  BPFtrace bpftrace(make_output(state.range(0)));
+  MapKey key;
+  key.args_ = { CreateInt64(), CreateString(16) };
+  FakeMap map("@bench", CreateCount(false), key);
+  map.type_ = CreateCount(false);
+  map.key_ = key;
+  map.map_type_ = BPF_MAP_TYPE_HASH;
+  bpftrace.out_->header(bpftrace);
+
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> entries;
+  for (uint64_t i = 0; i < 10000; i++)
+  {
+    std::vector<uint8_t> k(24), v(8);
+    std::memcpy(k.data(), &i, sizeof(i));
+    std::snprintf(
+        reinterpret_cast<char *>(k.data() + 8), 16, "comm-%lu", i % 500);
+    uint64_t count = i * 7;
+    std::memcpy(v.data(), &count, sizeof(count));
+    entries.emplace_back(std::move(k), std::move(v));
+  }
+
+  for (auto _ : state)
+    bpftrace.out_->map(bpftrace, map, 0, 1, entries);
+  state.SetItemsProcessed(state.iterations() * entries.size());
+}
+BENCHMARK(print_map)->ArgName("format")->DenseRange(0, 2);
+
+static void print_map_hist(benchmark::State &state)
+{
+  BPFtrace bpftrace(make_output(state.range(0)));
+  MapKey key;
+  key.args_ = { CreateInt64() };
+  FakeMap map("@bench", CreateHist(), key);
+  map.type_ = CreateHist();
+  map.key_ = key;
+  map.map_type_ = BPF_MAP_TYPE_HASH;
+
+  HistBuckets buckets;
+  buckets.reset(66);
+  std::vector<size_t> sorted_by_total;
+  for (uint64_t i = 0; i < 1000; i++)
+  {
+    auto &b = buckets.buckets(reinterpret_cast<const uint8_t *>(&i),
+                              sizeof(i));
+    for (size_t j = 0; j < 20; j++)
+      b[j + i % 10] = (i + 1) * (j + 1);
+    sorted_by_total.push_back(i);
+  }
+  buckets.compute_totals();
+
+  for (auto _ : state)
+    bpftrace.out_->map_hist(bpftrace, map, 0, 1, buckets, sorted_by_total);
+  state.SetItemsProcessed(state.iterations() * buckets.size());
+}
+BENCHMARK(print_map_hist)->ArgName("format")->DenseRange(0, 2);
+
+static void json_escape(benchmark::State &state)
+{
+  JsonOutput output(null_stream, null_stream);
+  std::string msg;
+  for (int i = 0; i < 100; i++)
+    msg += "path \"/tmp/file\\" + std::to_string(i) + "\"\tok\n";
+
+  for (auto _ : state)
+    output.message(MessageType::printf, msg);
+  state.SetBytesProcessed(state.iterations() * msg.size());
+}
+BENCHMARK(json_escape);
+
+} // namespace output
+} // namespace bench
+} // namespace bpftrace
@@ -0,0 +1,49 @@
+#include <sstream>
+#include <string>
+
+#include "ast.h"
+#include "mocks.h"
+#include "benchmark/benchmark.h"
+
+namespace bpftrace {
+namespace bench {
+namespace probe_matcher {
+
+using ::testing::NiceMock;
+
+// Wildcard kprobe matched against a 50k-line available_filter_functions, as
+// read by a ProbeMatcher that has nothing cached yet
+static void get_matches_for_ap(benchmark::State &state)
+{
+  std::string symbols;
+  for (int i = 0; i < 50000; i++)
+  {
+    symbols += (i % 3 ? "do_sys_" : "vfs_") + std::to_string(i);
+    symbols += i % 10 ? "\n" : " [kernel_mod]\n";
+  }
+  auto bpftrace = test::get_mock_bpftrace();
+  ast::AttachPoint ap(state.range(0) ? "kprobe:*_sys_1*" : "kprobe:vfs_*");
+  ap.provider = "kprobe";
+  ap.func = state.range(0) ? "*_sys_1*" : "vfs_*";
+
+  size_t matches = 0;
+  for (auto _ : state)
+  {
+    NiceMock<test::MockProbeMatcher> matcher(bpftrace.get());
+    ON_CALL(matcher, get_symbols_from_file(::testing::_))
+        .WillByDefault([&symbols](const std::string &) {
+          return std::unique_ptr<std::istream>(
+              new std::istringstream(symbols));
+        });
+    matches = matcher.get_matches_for_ap(ap).size();
+    benchmark::DoNotOptimize(matches);
+  }
+  state.counters["matches"] = matches;
+  state.SetItemsProcessed(state.iterations() * 50000);
+}
+// 0: prefix, 1: leading wildcard
+BENCHMARK(get_matches_for_ap)->ArgName("wildcard")->DenseRange(0, 1);
+
+} // namespace probe_matcher
+} // namespace bench
+} // namespace bpftrace
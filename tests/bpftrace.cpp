@@ -7,6 +7,10 @@
 #include "gtest/gtest.h"
 
 namespace bpftrace {
+
+std::string format(std::string fmt,
+                   std::vector<std::unique_ptr<IPrintable>> &args);
+
 namespace test {
 namespace bpftrace {
 
@@ -223,6 +227,26 @@ TEST(bpftrace, add_probes_wildcard)
   check_kprobe(bpftrace->get_probes().at(3), "sys_write", probe_orig_name);
 }
 
+TEST(bpftrace, add_probes_wildcards_read_symbols_once)
+{
+  ast::Probe *probe = parse_probe("kprobe:my_*,kretprobe:sys_*{}");
+
+  auto bpftrace = get_strict_mock_bpftrace();
+  EXPECT_CALL(*bpftrace->mock_probe_matcher,
+              get_symbols_from_file(
+                  "/sys/kernel/debug/tracing/available_filter_functions"))
+      .Times(1);
+
+  ASSERT_EQ(0, bpftrace->add_probe(*probe));
+  ASSERT_EQ(0, bpftrace->add_probe(*probe));
+  ASSERT_EQ(8U, bpftrace->get_probes().size());
+
+  std::string probe_orig_name = "kprobe:my_*,kretprobe:sys_*";
+  check_kprobe(bpftrace->get_probes().at(0), "my_one", probe_orig_name);
+  check_kprobe(bpftrace->get_probes().at(1), "my_two", probe_orig_name);
+  check_kprobe(bpftrace->get_probes().at(4), "my_one", probe_orig_name);
+}
+
 TEST(bpftrace, add_probes_wildcard_no_matches)
 {
   ast::Probe *probe = parse_probe(
@@ -243,6 +267,81 @@ TEST(bpftrace, add_probes_wildcard_no_matches)
   check_kprobe(bpftrace->get_probes().at(1), "sys_write", probe_orig_name);
 }
 
+TEST(bpftrace, add_probes_wildcard_kprobe_multi)
+{
+  ast::Probe *probe = parse_probe(
+      "kprobe:sys_read,kprobe:my_*,kretprobe:my_*{}");
+
+  auto bpftrace = get_strict_mock_bpftrace();
+  bpftrace->feature_ = std::make_unique<MockBPFfeature>(true, true);
+  EXPECT_CALL(*bpftrace->mock_probe_matcher,
+              get_symbols_from_file(
+                  "/sys/kernel/debug/tracing/available_filter_functions"))
+      .Times(1);
+
+  ASSERT_EQ(0, bpftrace->add_probe(*probe));
+  ASSERT_EQ(3U, bpftrace->get_probes().size());
+
+  std::string probe_orig_name = "kprobe:sys_read,kprobe:my_*,kretprobe:my_*";
+  std::vector<std::string> funcs = { "my_one", "my_two" };
+  check_kprobe(bpftrace->get_probes().at(0), "sys_read", probe_orig_name);
+  EXPECT_TRUE(bpftrace->get_probes().at(0).funcs.empty());
+  check_kprobe(bpftrace->get_probes().at(1), "my_*", probe_orig_name);
+  EXPECT_EQ(funcs, bpftrace->get_probes().at(1).funcs);
+  EXPECT_EQ(ProbeType::kretprobe, bpftrace->get_probes().at(2).type);
+  EXPECT_EQ("kretprobe:my_*", bpftrace->get_probes().at(2).name);
+  EXPECT_EQ(funcs, bpftrace->get_probes().at(2).funcs);
+}
+
+TEST(bpftrace, add_probes_wildcard_kprobe_multi_expansion)
+{
+  ast::Probe *probe = parse_probe("kprobe:my_*{}");
+  probe->need_expansion = true;
+
+  auto bpftrace = get_strict_mock_bpftrace();
+  bpftrace->feature_ = std::make_unique<MockBPFfeature>(true, true);
+  EXPECT_CALL(*bpftrace->mock_probe_matcher,
+              get_symbols_from_file(
+                  "/sys/kernel/debug/tracing/available_filter_functions"))
+      .Times(1);
+
+  ASSERT_EQ(0, bpftrace->add_probe(*probe));
+  ASSERT_EQ(2U, bpftrace->get_probes().size());
+  check_kprobe(bpftrace->get_probes().at(0), "my_one", "kprobe:my_*");
+  check_kprobe(bpftrace->get_probes().at(1), "my_two", "kprobe:my_*");
+}
+
+TEST(bpftrace, add_probes_kprobe_multi_cookies)
+{
+  ast::Probe *probe = parse_probe("kprobe:sys_read,kprobe:my_*{}");
+  probe->use_cookies = true;
+
+  auto bpftrace = get_strict_mock_bpftrace();
+  bpftrace->feature_ = std::make_unique<MockBPFfeature>(true, true);
+  bpftrace->probe_ids_ = { "kprobe:my_two", "kprobe:sys_read", "kprobe:my_one" };
+  EXPECT_CALL(*bpftrace->mock_probe_matcher,
+              get_symbols_from_file(
+                  "/sys/kernel/debug/tracing/available_filter_functions"))
+      .Times(1);
+
+  ASSERT_EQ(0, bpftrace->add_probe(*probe));
+  auto probes = bpftrace->get_probes();
+  ASSERT_EQ(2U, probes.size());
+
+  std::string probe_orig_name = "kprobe:sys_read,kprobe:my_*";
+  auto &sys_read = probes.at(0);
+  check_kprobe(sys_read, "sys_read", probe_orig_name);
+  EXPECT_EQ(std::vector<std::string>{ "sys_read" }, sys_read.funcs);
+  EXPECT_EQ(std::vector<uint64_t>{ 1 }, sys_read.cookies);
+
+  auto &my = probes.at(1);
+  check_kprobe(my, "my_*", probe_orig_name);
+  std::vector<std::string> funcs = { "my_one", "my_two" };
+  std::vector<uint64_t> cookies = { 2, 0 };
+  EXPECT_EQ(funcs, my.funcs);
+  EXPECT_EQ(cookies, my.cookies);
+}
+
 TEST(bpftrace, add_probes_kernel_module)
 {
   ast::Probe *probe = parse_probe("kprobe:func_in_mod{}");
@@ -335,6 +434,29 @@ TEST(bpftrace, add_probes_uprobe_wildcard_file)
       bpftrace->get_probes().at(1), "/bin/sh", "first_open", probe_orig_name);
 }
 
+TEST(bpftrace, add_probes_uprobe_wildcard_multi)
+{
+  ast::Probe *probe = parse_probe("uprobe:/bin/*sh:*open {}");
+  auto bpftrace = get_strict_mock_bpftrace();
+  bpftrace->feature_ = std::make_unique<MockBPFfeature>(true, true);
+  EXPECT_CALL(*bpftrace->mock_probe_matcher,
+              get_func_symbols_from_file("/bin/*sh"))
+      .Times(1);
+
+  ASSERT_EQ(0, bpftrace->add_probe(*probe));
+  auto probes = bpftrace->get_probes();
+  ASSERT_EQ(2U, probes.size());
+
+  // /bin/bash has a single match, which isn't worth a link of its own
+  std::string probe_orig_name = "uprobe:/bin/*sh:*open";
+  std::vector<std::string> funcs = { "first_open", "second_open" };
+  check_uprobe(probes.at(0), "/bin/sh", "*open", probe_orig_name);
+  EXPECT_EQ("/bin/sh", probes.at(0).path);
+  EXPECT_EQ(funcs, probes.at(0).funcs);
+  check_uprobe(probes.at(1), "/bin/bash", "first_open", probe_orig_name);
+  EXPECT_TRUE(probes.at(1).funcs.empty());
+}
+
 TEST(bpftrace, add_probes_uprobe_wildcard_no_matches)
 {
   ast::Probe *probe = parse_probe("uprobe:/bin/sh:foo* {}");
@@ -586,6 +708,25 @@ TEST(bpftrace, add_probes_tracepoint_wildcard)
   check_tracepoint(bpftrace->get_probes().at(1), "sched", "sched_two", probe_orig_name);
 }
 
+TEST(bpftrace, add_probes_rawtracepoint_wildcard)
+{
+  auto probe = parse_probe(("rawtracepoint:sched:sched_* {}"));
+  auto bpftrace = get_strict_mock_bpftrace();
+  EXPECT_CALL(*bpftrace->mock_probe_matcher,
+              get_symbols_from_file(
+                  "/sys/kernel/debug/tracing/available_events"))
+      .Times(1);
+
+  ASSERT_EQ(0, bpftrace->add_probe(*probe));
+  ASSERT_EQ(2U, bpftrace->get_probes().size());
+
+  auto &p = bpftrace->get_probes().at(1);
+  EXPECT_EQ(ProbeType::rawtracepoint, p.type);
+  // Raw tracepoints are attached by the name of the event alone
+  EXPECT_EQ("sched_two", p.attach_point);
+  EXPECT_EQ("rawtracepoint:sched:sched_two", p.name);
+}
+
 TEST(bpftrace, add_probes_tracepoint_category_wildcard)
 {
   auto probe = parse_probe(("tracepoint:sched*:sched_* {}"));
@@ -839,6 +980,37 @@ TEST(bpftrace, sort_by_key_int_int)
   EXPECT_THAT(values_by_key, ContainerEq(expected_values));
 }
 
+TEST(bpftrace, sort_by_key_stable)
+{
+  StrictMock<MockBPFtrace> bpftrace;
+
+  std::vector<SizedType> key_args = {
+    CreateUInt64(),
+    CreateUInt64(),
+  };
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> values_by_key =
+  {
+    key_value_pair_int({3,1}, 1),
+    key_value_pair_int({1,2}, 2),
+    key_value_pair_int({3,1}, 3),
+    key_value_pair_int({1,2}, 4),
+    key_value_pair_int({1,1}, 5),
+  };
+  bpftrace.sort_by_key(key_args, values_by_key);
+
+  // Entries with the same key keep their order
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> expected_values =
+  {
+    key_value_pair_int({1,1}, 5),
+    key_value_pair_int({1,2}, 2),
+    key_value_pair_int({1,2}, 4),
+    key_value_pair_int({3,1}, 1),
+    key_value_pair_int({3,1}, 3),
+  };
+
+  EXPECT_THAT(values_by_key, ContainerEq(expected_values));
+}
+
 TEST(bpftrace, sort_by_key_str)
 {
   StrictMock<MockBPFtrace> bpftrace;
@@ -931,6 +1103,80 @@ TEST(bpftrace, sort_by_key_int_str)
   EXPECT_THAT(values_by_key, ContainerEq(expected_values));
 }
 
+TEST(bpftrace, format_args)
+{
+  StrictMock<MockBPFtrace> bpftrace;
+
+  // int32, uint8, int64, string[8]
+  std::vector<Field> args = { Field{ CreateInt32(), 0, false, {} },
+                              Field{ CreateUInt8(), 4, false, {} },
+                              Field{ CreateInt64(), 8, false, {} },
+                              Field{ CreateString(8), 16, false, {} } };
+  std::vector<uint8_t> data(24);
+  int32_t i32 = -42;
+  uint8_t u8 = 200;
+  int64_t i64 = -1;
+  std::memcpy(data.data(), &i32, sizeof(i32));
+  std::memcpy(data.data() + 4, &u8, sizeof(u8));
+  std::memcpy(data.data() + 8, &i64, sizeof(i64));
+  std::memcpy(data.data() + 16, "abc", 4);
+
+  for (std::string fmt : { "%d %u %ld %s\n",
+                           "%x|%X|%lx|%-5s|\n",
+                           "%5d %hhd %lu %.2s %%\n",
+                           "%u %c %lld %s" })
+  {
+    std::string out;
+    bpftrace.format_args(FormatPlan(fmt), args, data.data(), out);
+    auto arg_values = bpftrace.get_arg_values(args, data.data());
+    EXPECT_EQ(format(fmt, arg_values), out);
+  }
+
+  std::string out = "kept ";
+  bpftrace.format_args(FormatPlan("%d %u %ld %s\n"), args, data.data(), out);
+  EXPECT_EQ("kept -42 200 -1 abc\n", out);
+}
+
+TEST(bpftrace, format_args_packed)
+{
+  StrictMock<MockBPFtrace> bpftrace;
+
+  // The arguments of the events follow each other without padding:
+  // string[3], int16, int64, int32 from an odd address
+  std::vector<Field> args = { Field{ CreateString(3), 1, false, {} },
+                              Field{ CreateInt16(), 4, false, {} },
+                              Field{ CreateInt64(), 6, false, {} },
+                              Field{ CreateUInt32(), 14, false, {} } };
+  std::vector<uint8_t> data(19);
+  int16_t i16 = -7;
+  int64_t i64 = -1LL << 40;
+  uint32_t u32 = 3000000000U;
+  std::memcpy(data.data() + 1, "ab", 3);
+  std::memcpy(data.data() + 4, &i16, sizeof(i16));
+  std::memcpy(data.data() + 6, &i64, sizeof(i64));
+  std::memcpy(data.data() + 14, &u32, sizeof(u32));
+
+  std::string fmt = "%s %d %ld %u\n";
+  std::string out;
+  bpftrace.format_args(FormatPlan(fmt), args, data.data(), out);
+  EXPECT_EQ("ab -7 -1099511627776 3000000000\n", out);
+  auto arg_values = bpftrace.get_arg_values(args, data.data());
+  EXPECT_EQ(format(fmt, arg_values), out);
+}
+
+TEST(bpftrace, target_tracking_probes)
+{
+  for (std::string comm : { "", "nginx" })
+  {
+    StrictMock<MockBPFtrace> bpftrace;
+    Driver driver(bpftrace);
+    ASSERT_EQ(driver.parse_str(BPFtrace::target_tracking_probes(comm)), 0);
+    EXPECT_EQ(driver.root_->probes->size(),
+              static_cast<size_t>(
+                  BPFtrace::target_tracking_probe_count(comm)));
+  }
+}
+
 #ifdef HAVE_LIBBPF_BTF_DUMP
 
 #include "btf_common.h"
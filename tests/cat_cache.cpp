@@ -0,0 +1,99 @@
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+
+#include "cat_cache.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace cat_cache {
+
+class CatCacheTest : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    char path[] = "/tmp/bpftrace-test-cat-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path_ = path;
+  }
+
+  void TearDown() override
+  {
+    unlink(path_.c_str());
+  }
+
+  void write(const std::string &contents)
+  {
+    std::ofstream file(path_, std::ios::trunc);
+    file << contents;
+  }
+
+  std::string path_;
+};
+
+TEST_F(CatCacheTest, read)
+{
+  CatCache cache(0, 0, 10240);
+  std::string out, error;
+  write("hello\n");
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "hello\n");
+  write("world\n");
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "world\n");
+
+  EXPECT_FALSE(cache.read("/does/not/exist", out, error));
+  EXPECT_EQ(error.find("failed to open file '/does/not/exist'"), 0U);
+}
+
+TEST_F(CatCacheTest, max_bytes)
+{
+  CatCache cache(0, 1, 3);
+  std::string out, error;
+  write("hello\n");
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "hel");
+}
+
+TEST_F(CatCacheTest, ttl)
+{
+  CatCache cache(100, 0, 10240);
+  std::string out, error;
+  write("hello\n");
+  EXPECT_TRUE(cache.read(path_, out, error));
+  write("world\n");
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "hello\n");
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "world\n");
+}
+
+TEST_F(CatCacheTest, fds)
+{
+  CatCache cache(0, 1, 10240);
+  std::string out, error;
+  write("hello\n");
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "hello\n");
+  // Read again through the fd kept open
+  write("hi\n");
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "hi\n");
+
+  // Evicts the first one
+  EXPECT_TRUE(cache.read("/proc/self/status", out, error));
+  EXPECT_EQ(out.find("Name:"), 0U);
+  EXPECT_TRUE(cache.read(path_, out, error));
+  EXPECT_EQ(out, "hi\n");
+}
+
+} // namespace cat_cache
+} // namespace test
+} // namespace bpftrace
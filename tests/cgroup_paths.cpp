@@ -0,0 +1,65 @@
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgroup_paths.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace cgroup_paths {
+
+static uint64_t ino(const std::string &path)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    throw std::runtime_error("stat failed: " + path);
+  return st.st_ino;
+}
+
+// The mtime of a directory may not change when it changes within the
+// granularity of the timestamps
+static void touch(const std::string &path, time_t sec)
+{
+  struct timespec times[2] = { { sec, 0 }, { sec, 0 } };
+  utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+TEST(CgroupPaths, resolve)
+{
+  std::string root = "/tmp/bpftrace-test-cgroup-paths-XXXXXX";
+  if (::mkdtemp(&root[0]) == nullptr)
+    throw std::runtime_error("creating temporary path for tests failed");
+  mkdir((root + "/a").c_str(), 0755);
+  mkdir((root + "/a/b").c_str(), 0755);
+
+  CgroupPaths paths(root, [](const std::string &path) {
+    return std::optional<uint64_t>(ino(path));
+  });
+  EXPECT_EQ(paths.resolve(ino(root)), "/");
+  EXPECT_EQ(paths.resolve(ino(root + "/a/b")), "/a/b");
+  uint64_t b = ino(root + "/a/b");
+
+  // Only found once walked again
+  mkdir((root + "/c").c_str(), 0755);
+  touch(root, 1);
+  uint64_t c = ino(root + "/c");
+  EXPECT_EQ(paths.resolve(c), std::nullopt);
+  paths.refresh();
+  EXPECT_EQ(paths.resolve(c), "/c");
+
+  // Removed ones keep their path
+  rmdir((root + "/a/b").c_str());
+  touch(root + "/a", 2);
+  paths.refresh();
+  EXPECT_EQ(paths.resolve(b), "/a/b");
+
+  rmdir((root + "/c").c_str());
+  rmdir((root + "/a").c_str());
+  rmdir(root.c_str());
+}
+
+} // namespace cgroup_paths
+} // namespace test
+} // namespace bpftrace
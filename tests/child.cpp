@@ -4,6 +4,7 @@
 #include <string>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -65,6 +66,22 @@ TEST(childproc, child_exit_success)
   EXPECT_EQ(child->term_signal(), -1);
 }
 
+TEST(childproc, exit_fd)
+{
+  auto child = getChild(TEST_BIN);
+  int fd = child->exit_fd();
+  if (fd < 0)
+    GTEST_SKIP() << "pidfds are not supported";
+
+  struct pollfd pollfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+  EXPECT_EQ(poll(&pollfd, 1, 0), 0);
+
+  child->run();
+  EXPECT_EQ(poll(&pollfd, 1, 1000), 1);
+  EXPECT_FALSE(child->is_alive());
+  EXPECT_EQ(child->exit_code(), 0);
+}
+
 TEST(childproc, child_exit_err)
 {
   // Spawn a child that exits with an error
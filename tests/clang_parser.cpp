@@ -662,6 +662,37 @@ TEST_F(clang_parser_btf, btf_variable_field_struct)
   EXPECT_NE(bpftrace.btf_set_.find("struct Foo3"), bpftrace.btf_set_.end());
 }
 
+TEST_F(clang_parser_btf, btf_without_definitions)
+{
+  // Read from BTF directly, and parsed by clang from the generated header
+  BPFtrace direct;
+  parse("", direct, true, "kprobe:sys_read { @x = (struct Foo2 *) curtask; }");
+  BPFtrace parsed;
+  parse("#define __BPFTRACE_DUMMY__\n",
+        parsed,
+        true,
+        "kprobe:sys_read { @x = (struct Foo2 *) curtask; }");
+
+  StructMap &structs = direct.structs_;
+  ASSERT_EQ(structs.size(), parsed.structs_.size());
+  ASSERT_EQ(structs.count("struct Foo2"), 1U);
+  for (auto &[name, s] : parsed.structs_)
+  {
+    ASSERT_EQ(structs.count(name), 1U);
+    EXPECT_EQ(structs[name].size, s.size);
+    ASSERT_EQ(structs[name].fields.size(), s.fields.size());
+    for (auto &[field_name, field] : s.fields)
+    {
+      ASSERT_EQ(structs[name].fields.count(field_name), 1U);
+      auto &direct_field = structs[name].fields[field_name];
+      EXPECT_EQ(direct_field.type, field.type);
+      EXPECT_EQ(direct_field.offset, field.offset);
+      EXPECT_EQ(direct_field.is_bitfield, field.is_bitfield);
+    }
+  }
+  EXPECT_EQ(direct.enums_, parsed.enums_);
+}
+
 TEST(clang_parser, btf_unresolved_typedef)
 {
   // size_t is defined in stddef.h, but if we have BTF, it should be possible to
@@ -56,6 +56,30 @@ TEST(codegen, populate_sections)
   EXPECT_TRUE(bpforc->getSection("s_kprobe:bar_1").has_value());
 }
 
+TEST(codegen, opt_levels)
+{
+  for (uint64_t opt_level = 0; opt_level <= 3; opt_level++)
+  {
+    BPFtrace bpftrace;
+    bpftrace.opt_level_ = opt_level;
+    Driver driver(bpftrace);
+
+    ASSERT_EQ(driver.parse_str("kprobe:foo { @[comm] = lhist(pid, 0, 100, "
+                               "10); @x = hist(tid); }"),
+              0);
+    // Override to mockbpffeature.
+    bpftrace.feature_ = std::make_unique<MockBPFfeature>(true);
+    ast::SemanticAnalyser semantics(driver.root_, bpftrace);
+    ASSERT_EQ(semantics.analyse(), 0);
+    ASSERT_EQ(semantics.create_maps(true), 0);
+    ast::CodegenLLVM codegen(driver.root_, bpftrace);
+    auto bpforc = codegen.compile();
+
+    EXPECT_TRUE(bpforc->getSection("s_kprobe:foo_1").has_value())
+        << "opt level " << opt_level;
+  }
+}
+
 TEST(codegen, printf_offsets)
 {
   BPFtrace bpftrace;
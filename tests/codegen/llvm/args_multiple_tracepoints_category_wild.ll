@@ -9,7 +9,6 @@ declare i64 @llvm.bpf.pseudo(i64, i64) #0
 define i64 @"tracepoint:sched:sched_one"(i8*) section "s_tracepoint:sched:sched_one_1" {
 entry:
   %"@_val" = alloca i64
-  %lookup_elem_val = alloca i64
   %"@_key" = alloca i64
   %1 = ptrtoint i8* %0 to i64
   %2 = add i64 %1, 8
@@ -20,35 +19,40 @@ entry:
   store i64 %4, i64* %"@_key"
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo, i64* %"@_key")
-  %6 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
   %map_lookup_cond = icmp ne i8* %lookup_elem, null
-  br i1 %map_lookup_cond, label %lookup_success, label %lookup_failure
-
-lookup_success:                                   ; preds = %entry
-  %cast = bitcast i8* %lookup_elem to i64*
-  %7 = load i64, i64* %cast
-  store i64 %7, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_failure:                                   ; preds = %entry
-  store i64 0, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_merge:                                     ; preds = %lookup_failure, %lookup_success
-  %8 = load i64, i64* %lookup_elem_val
-  %9 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
-  %10 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %10)
-  %11 = add i64 %8, 1
-  store i64 %11, i64* %"@_val"
+  br i1 %map_lookup_cond, label %update.in_place, label %update.insert
+
+update.insert:                                    ; preds = %entry
+  %6 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
+  store i64 1, i64* %"@_val"
   %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@_key", i64* %"@_val", i64 0)
-  %12 = bitcast i64* %"@_key" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %12)
-  %13 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %13)
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@_key", i64* %"@_val", i64 1)
+  %7 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %7)
+  %map_insert_cond = icmp eq i64 %update_elem, 0
+  br i1 %map_insert_cond, label %update.done, label %update.retry
+
+update.retry:                                     ; preds = %update.insert
+  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem3 = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo2, i64* %"@_key")
+  %map_lookup_cond4 = icmp ne i8* %lookup_elem3, null
+  br i1 %map_lookup_cond4, label %update.in_place, label %update.failure
+
+update.failure:                                   ; preds = %update.retry
+  br label %update.done
+
+update.in_place:                                  ; preds = %update.retry, %entry
+  %update_ptr = phi i8* [ %lookup_elem, %entry ], [ %lookup_elem3, %update.retry ]
+  %8 = bitcast i8* %update_ptr to i64*
+  %9 = load i64, i64* %8
+  %10 = add i64 %9, 1
+  store i64 %10, i64* %8
+  br label %update.done
+
+update.done:                                      ; preds = %update.in_place, %update.failure, %update.insert
+  %11 = bitcast i64* %"@_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %11)
   ret i64 0
 }
 
@@ -61,7 +65,6 @@ declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #1
 define i64 @"tracepoint:sched:sched_two"(i8*) section "s_tracepoint:sched:sched_two_2" {
 entry:
   %"@_val" = alloca i64
-  %lookup_elem_val = alloca i64
   %"@_key" = alloca i64
   %1 = ptrtoint i8* %0 to i64
   %2 = add i64 %1, 16
@@ -72,42 +75,46 @@ entry:
   store i64 %4, i64* %"@_key"
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo, i64* %"@_key")
-  %6 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
   %map_lookup_cond = icmp ne i8* %lookup_elem, null
-  br i1 %map_lookup_cond, label %lookup_success, label %lookup_failure
-
-lookup_success:                                   ; preds = %entry
-  %cast = bitcast i8* %lookup_elem to i64*
-  %7 = load i64, i64* %cast
-  store i64 %7, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_failure:                                   ; preds = %entry
-  store i64 0, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_merge:                                     ; preds = %lookup_failure, %lookup_success
-  %8 = load i64, i64* %lookup_elem_val
-  %9 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
-  %10 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %10)
-  %11 = add i64 %8, 1
-  store i64 %11, i64* %"@_val"
+  br i1 %map_lookup_cond, label %update.in_place, label %update.insert
+
+update.insert:                                    ; preds = %entry
+  %6 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
+  store i64 1, i64* %"@_val"
   %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@_key", i64* %"@_val", i64 0)
-  %12 = bitcast i64* %"@_key" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %12)
-  %13 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %13)
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@_key", i64* %"@_val", i64 1)
+  %7 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %7)
+  %map_insert_cond = icmp eq i64 %update_elem, 0
+  br i1 %map_insert_cond, label %update.done, label %update.retry
+
+update.retry:                                     ; preds = %update.insert
+  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem3 = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo2, i64* %"@_key")
+  %map_lookup_cond4 = icmp ne i8* %lookup_elem3, null
+  br i1 %map_lookup_cond4, label %update.in_place, label %update.failure
+
+update.failure:                                   ; preds = %update.retry
+  br label %update.done
+
+update.in_place:                                  ; preds = %update.retry, %entry
+  %update_ptr = phi i8* [ %lookup_elem, %entry ], [ %lookup_elem3, %update.retry ]
+  %8 = bitcast i8* %update_ptr to i64*
+  %9 = load i64, i64* %8
+  %10 = add i64 %9, 1
+  store i64 %10, i64* %8
+  br label %update.done
+
+update.done:                                      ; preds = %update.in_place, %update.failure, %update.insert
+  %11 = bitcast i64* %"@_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %11)
   ret i64 0
 }
 
 define i64 @"tracepoint:sched_extra:sched_extra"(i8*) section "s_tracepoint:sched_extra:sched_extra_3" {
 entry:
   %"@_val" = alloca i64
-  %lookup_elem_val = alloca i64
   %"@_key" = alloca i64
   %1 = ptrtoint i8* %0 to i64
   %2 = add i64 %1, 24
@@ -118,35 +125,40 @@ entry:
   store i64 %4, i64* %"@_key"
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo, i64* %"@_key")
-  %6 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
   %map_lookup_cond = icmp ne i8* %lookup_elem, null
-  br i1 %map_lookup_cond, label %lookup_success, label %lookup_failure
-
-lookup_success:                                   ; preds = %entry
-  %cast = bitcast i8* %lookup_elem to i64*
-  %7 = load i64, i64* %cast
-  store i64 %7, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_failure:                                   ; preds = %entry
-  store i64 0, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_merge:                                     ; preds = %lookup_failure, %lookup_success
-  %8 = load i64, i64* %lookup_elem_val
-  %9 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
-  %10 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %10)
-  %11 = add i64 %8, 1
-  store i64 %11, i64* %"@_val"
+  br i1 %map_lookup_cond, label %update.in_place, label %update.insert
+
+update.insert:                                    ; preds = %entry
+  %6 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
+  store i64 1, i64* %"@_val"
   %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@_key", i64* %"@_val", i64 0)
-  %12 = bitcast i64* %"@_key" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %12)
-  %13 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %13)
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@_key", i64* %"@_val", i64 1)
+  %7 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %7)
+  %map_insert_cond = icmp eq i64 %update_elem, 0
+  br i1 %map_insert_cond, label %update.done, label %update.retry
+
+update.retry:                                     ; preds = %update.insert
+  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem3 = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo2, i64* %"@_key")
+  %map_lookup_cond4 = icmp ne i8* %lookup_elem3, null
+  br i1 %map_lookup_cond4, label %update.in_place, label %update.failure
+
+update.failure:                                   ; preds = %update.retry
+  br label %update.done
+
+update.in_place:                                  ; preds = %update.retry, %entry
+  %update_ptr = phi i8* [ %lookup_elem, %entry ], [ %lookup_elem3, %update.retry ]
+  %8 = bitcast i8* %update_ptr to i64*
+  %9 = load i64, i64* %8
+  %10 = add i64 %9, 1
+  store i64 %10, i64* %8
+  br label %update.done
+
+update.done:                                      ; preds = %update.in_place, %update.failure, %update.insert
+  %11 = bitcast i64* %"@_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %11)
   ret i64 0
 }
 
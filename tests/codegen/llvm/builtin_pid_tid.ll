@@ -26,16 +26,15 @@ entry:
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %4)
   %5 = bitcast i64* %"@x_val" to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %5)
-  %get_pid_tgid1 = call i64 inttoptr (i64 14 to i64 ()*)()
-  %6 = and i64 %get_pid_tgid1, 4294967295
+  %6 = and i64 %get_pid_tgid, 4294967295
   %7 = bitcast i64* %"@y_key" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %7)
   store i64 0, i64* %"@y_key"
   %8 = bitcast i64* %"@y_val" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %8)
   store i64 %6, i64* %"@y_val"
-  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 2)
-  %update_elem3 = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo2, i64* %"@y_key", i64* %"@y_val", i64 0)
+  %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 2)
+  %update_elem2 = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@y_key", i64* %"@y_val", i64 0)
   %9 = bitcast i64* %"@y_key" to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
   %10 = bitcast i64* %"@y_val" to i8*
@@ -8,82 +8,59 @@ declare i64 @llvm.bpf.pseudo(i64, i64) #0
 
 define i64 @"kprobe:f"(i8*) section "s_kprobe:f_1" {
 entry:
-  %"@x_val" = alloca i64
-  %lookup_elem_val8 = alloca i64
-  %"@x_key2" = alloca i64
-  %"@x_num" = alloca i64
-  %lookup_elem_val = alloca i64
+  %"@x_val" = alloca [2 x i64]
   %"@x_key" = alloca i64
   %1 = bitcast i64* %"@x_key" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %1)
   store i64 0, i64* %"@x_key"
+  %get_pid_tgid = call i64 inttoptr (i64 14 to i64 ()*)()
+  %2 = lshr i64 %get_pid_tgid, 32
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo, i64* %"@x_key")
-  %2 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %2)
   %map_lookup_cond = icmp ne i8* %lookup_elem, null
-  br i1 %map_lookup_cond, label %lookup_success, label %lookup_failure
-
-lookup_success:                                   ; preds = %entry
-  %cast = bitcast i8* %lookup_elem to i64*
-  %3 = load i64, i64* %cast
-  store i64 %3, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_failure:                                   ; preds = %entry
-  store i64 0, i64* %lookup_elem_val
-  br label %lookup_merge
+  br i1 %map_lookup_cond, label %update.in_place, label %update.insert
 
-lookup_merge:                                     ; preds = %lookup_failure, %lookup_success
-  %4 = load i64, i64* %lookup_elem_val
-  %5 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %5)
-  %6 = bitcast i64* %"@x_num" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
-  %7 = add i64 %4, 1
-  store i64 %7, i64* %"@x_num"
+update.insert:                                    ; preds = %entry
+  %3 = bitcast [2 x i64]* %"@x_val" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %3)
+  %4 = getelementptr [2 x i64], [2 x i64]* %"@x_val", i64 0, i64 0
+  store i64 1, i64* %4
+  %5 = getelementptr [2 x i64], [2 x i64]* %"@x_val", i64 0, i64 1
+  store i64 %2, i64* %5
   %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@x_key", i64* %"@x_num", i64 0)
-  %8 = bitcast i64* %"@x_key" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %8)
-  %9 = bitcast i64* %"@x_num" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
-  %10 = bitcast i64* %"@x_key2" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %10)
-  store i64 1, i64* %"@x_key2"
-  %pseudo3 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %lookup_elem4 = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo3, i64* %"@x_key2")
-  %11 = bitcast i64* %lookup_elem_val8 to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %11)
-  %map_lookup_cond9 = icmp ne i8* %lookup_elem4, null
-  br i1 %map_lookup_cond9, label %lookup_success5, label %lookup_failure6
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, [2 x i64]*, i64)*)(i64 %pseudo1, i64* %"@x_key", [2 x i64]* %"@x_val", i64 1)
+  %6 = bitcast [2 x i64]* %"@x_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %6)
+  %map_insert_cond = icmp eq i64 %update_elem, 0
+  br i1 %map_insert_cond, label %update.done, label %update.retry
 
-lookup_success5:                                  ; preds = %lookup_merge
-  %cast10 = bitcast i8* %lookup_elem4 to i64*
-  %12 = load i64, i64* %cast10
-  store i64 %12, i64* %lookup_elem_val8
-  br label %lookup_merge7
+update.retry:                                     ; preds = %update.insert
+  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem3 = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo2, i64* %"@x_key")
+  %map_lookup_cond4 = icmp ne i8* %lookup_elem3, null
+  br i1 %map_lookup_cond4, label %update.in_place, label %update.failure
 
-lookup_failure6:                                  ; preds = %lookup_merge
-  store i64 0, i64* %lookup_elem_val8
-  br label %lookup_merge7
+update.failure:                                   ; preds = %update.retry
+  br label %update.done
 
-lookup_merge7:                                    ; preds = %lookup_failure6, %lookup_success5
-  %13 = load i64, i64* %lookup_elem_val8
-  %14 = bitcast i64* %lookup_elem_val8 to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %14)
-  %15 = bitcast i64* %"@x_val" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %15)
-  %get_pid_tgid = call i64 inttoptr (i64 14 to i64 ()*)()
-  %16 = lshr i64 %get_pid_tgid, 32
-  %17 = add i64 %16, %13
-  store i64 %17, i64* %"@x_val"
-  %pseudo11 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem12 = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo11, i64* %"@x_key2", i64* %"@x_val", i64 0)
-  %18 = bitcast i64* %"@x_key2" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %18)
-  %19 = bitcast i64* %"@x_val" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %19)
+update.in_place:                                  ; preds = %update.retry, %entry
+  %update_ptr = phi i8* [ %lookup_elem, %entry ], [ %lookup_elem3, %update.retry ]
+  %7 = bitcast i8* %update_ptr to [2 x i64]*
+  %8 = getelementptr [2 x i64], [2 x i64]* %7, i64 0, i64 0
+  %9 = load i64, i64* %8
+  %10 = getelementptr [2 x i64], [2 x i64]* %7, i64 0, i64 1
+  %11 = load i64, i64* %10
+  %12 = add i64 %9, 1
+  %13 = add i64 %11, %2
+  %14 = getelementptr [2 x i64], [2 x i64]* %7, i64 0, i64 0
+  store i64 %12, i64* %14
+  %15 = getelementptr [2 x i64], [2 x i64]* %7, i64 0, i64 1
+  store i64 %13, i64* %15
+  br label %update.done
+
+update.done:                                      ; preds = %update.in_place, %update.failure, %update.insert
+  %16 = bitcast i64* %"@x_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %16)
   ret i64 0
 }
 
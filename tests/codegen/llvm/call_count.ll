@@ -9,42 +9,46 @@ declare i64 @llvm.bpf.pseudo(i64, i64) #0
 define i64 @"kprobe:f"(i8*) section "s_kprobe:f_1" {
 entry:
   %"@x_val" = alloca i64
-  %lookup_elem_val = alloca i64
   %"@x_key" = alloca i64
   %1 = bitcast i64* %"@x_key" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %1)
   store i64 0, i64* %"@x_key"
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo, i64* %"@x_key")
-  %2 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %2)
   %map_lookup_cond = icmp ne i8* %lookup_elem, null
-  br i1 %map_lookup_cond, label %lookup_success, label %lookup_failure
-
-lookup_success:                                   ; preds = %entry
-  %cast = bitcast i8* %lookup_elem to i64*
-  %3 = load i64, i64* %cast
-  store i64 %3, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_failure:                                   ; preds = %entry
-  store i64 0, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_merge:                                     ; preds = %lookup_failure, %lookup_success
-  %4 = load i64, i64* %lookup_elem_val
-  %5 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %5)
-  %6 = bitcast i64* %"@x_val" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
-  %7 = add i64 %4, 1
-  store i64 %7, i64* %"@x_val"
+  br i1 %map_lookup_cond, label %update.in_place, label %update.insert
+
+update.insert:                                    ; preds = %entry
+  %2 = bitcast i64* %"@x_val" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %2)
+  store i64 1, i64* %"@x_val"
   %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@x_key", i64* %"@x_val", i64 0)
-  %8 = bitcast i64* %"@x_key" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %8)
-  %9 = bitcast i64* %"@x_val" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@x_key", i64* %"@x_val", i64 1)
+  %3 = bitcast i64* %"@x_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %3)
+  %map_insert_cond = icmp eq i64 %update_elem, 0
+  br i1 %map_insert_cond, label %update.done, label %update.retry
+
+update.retry:                                     ; preds = %update.insert
+  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem3 = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo2, i64* %"@x_key")
+  %map_lookup_cond4 = icmp ne i8* %lookup_elem3, null
+  br i1 %map_lookup_cond4, label %update.in_place, label %update.failure
+
+update.failure:                                   ; preds = %update.retry
+  br label %update.done
+
+update.in_place:                                  ; preds = %update.retry, %entry
+  %update_ptr = phi i8* [ %lookup_elem, %entry ], [ %lookup_elem3, %update.retry ]
+  %4 = bitcast i8* %update_ptr to i64*
+  %5 = load i64, i64* %4
+  %6 = add i64 %5, 1
+  store i64 %6, i64* %4
+  br label %update.done
+
+update.done:                                      ; preds = %update.in_place, %update.failure, %update.insert
+  %7 = bitcast i64* %"@x_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %7)
   ret i64 0
 }
 
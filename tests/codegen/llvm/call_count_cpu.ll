@@ -0,0 +1,64 @@
+; ModuleID = 'bpftrace'
+source_filename = "bpftrace"
+target datalayout = "e-m:e-p:64:64-i64:64-n32:64-S128"
+target triple = "bpf-pc-linux"
+
+; Function Attrs: nounwind
+declare i64 @llvm.bpf.pseudo(i64, i64) #0
+
+define i64 @"kprobe:f"(i8*) section "s_kprobe:f_1" {
+entry:
+  %"@_val" = alloca i64
+  %"@_key" = alloca i32
+  %get_cpu_id = call i64 inttoptr (i64 8 to i64 ()*)()
+  %1 = bitcast i32* %"@_key" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %1)
+  %2 = trunc i64 %get_cpu_id to i32
+  store i32 %2, i32* %"@_key"
+  %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, i32*)*)(i64 %pseudo, i32* %"@_key")
+  %map_lookup_cond = icmp ne i8* %lookup_elem, null
+  br i1 %map_lookup_cond, label %update.in_place, label %update.insert
+
+update.insert:                                    ; preds = %entry
+  %3 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %3)
+  store i64 1, i64* %"@_val"
+  %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i32*, i64*, i64)*)(i64 %pseudo1, i32* %"@_key", i64* %"@_val", i64 1)
+  %4 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %4)
+  %map_insert_cond = icmp eq i64 %update_elem, 0
+  br i1 %map_insert_cond, label %update.done, label %update.retry
+
+update.retry:                                     ; preds = %update.insert
+  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem3 = call i8* inttoptr (i64 1 to i8* (i64, i32*)*)(i64 %pseudo2, i32* %"@_key")
+  %map_lookup_cond4 = icmp ne i8* %lookup_elem3, null
+  br i1 %map_lookup_cond4, label %update.in_place, label %update.failure
+
+update.failure:                                   ; preds = %update.retry
+  br label %update.done
+
+update.in_place:                                  ; preds = %update.retry, %entry
+  %update_ptr = phi i8* [ %lookup_elem, %entry ], [ %lookup_elem3, %update.retry ]
+  %5 = bitcast i8* %update_ptr to i64*
+  %6 = load i64, i64* %5
+  %7 = add i64 %6, 1
+  store i64 %7, i64* %5
+  br label %update.done
+
+update.done:                                      ; preds = %update.in_place, %update.failure, %update.insert
+  %8 = bitcast i32* %"@_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %8)
+  ret i64 0
+}
+
+; Function Attrs: argmemonly nounwind
+declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture) #1
+
+; Function Attrs: argmemonly nounwind
+declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #1
+
+attributes #0 = { nounwind }
+attributes #1 = { argmemonly nounwind }
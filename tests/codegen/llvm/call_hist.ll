@@ -51,8 +51,8 @@ lookup_merge:                                     ; preds = %lookup_failure, %lo
   ret i64 0
 }
 
-; Function Attrs: alwaysinline
-define internal i64 @log2(i64) #1 section "helpers" {
+; Function Attrs: noinline
+define internal i64 @log2(i64) #1 section "s_kprobe:f_1" {
 entry:
   %1 = alloca i64
   %2 = alloca i64
@@ -71,64 +71,45 @@ hist.is_less_than_zero:                           ; preds = %entry
   ret i64 %7
 
 hist.is_not_less_than_zero:                       ; preds = %entry
-  %8 = load i64, i64* %2
-  %9 = icmp eq i64 %8, 0
-  br i1 %9, label %hist.is_zero, label %hist.is_not_zero
-
-hist.is_zero:                                     ; preds = %hist.is_not_less_than_zero
   store i64 1, i64* %1
-  %10 = load i64, i64* %1
-  ret i64 %10
-
-hist.is_not_zero:                                 ; preds = %hist.is_not_less_than_zero
-  store i64 2, i64* %1
-  %11 = load i64, i64* %2
-  %12 = icmp sge i64 %11, 65536
-  %13 = zext i1 %12 to i64
-  %14 = shl i64 %13, 4
-  %15 = lshr i64 %11, %14
-  store i64 %15, i64* %2
-  %16 = load i64, i64* %1
-  %17 = add i64 %16, %14
-  store i64 %17, i64* %1
-  %18 = load i64, i64* %2
-  %19 = icmp sge i64 %18, 256
-  %20 = zext i1 %19 to i64
-  %21 = shl i64 %20, 3
-  %22 = lshr i64 %18, %21
-  store i64 %22, i64* %2
-  %23 = load i64, i64* %1
-  %24 = add i64 %23, %21
-  store i64 %24, i64* %1
-  %25 = load i64, i64* %2
-  %26 = icmp sge i64 %25, 16
-  %27 = zext i1 %26 to i64
-  %28 = shl i64 %27, 2
-  %29 = lshr i64 %25, %28
-  store i64 %29, i64* %2
-  %30 = load i64, i64* %1
-  %31 = add i64 %30, %28
-  store i64 %31, i64* %1
-  %32 = load i64, i64* %2
-  %33 = icmp sge i64 %32, 4
-  %34 = zext i1 %33 to i64
-  %35 = shl i64 %34, 1
-  %36 = lshr i64 %32, %35
-  store i64 %36, i64* %2
+  %8 = load i64, i64* %2
+  %9 = icmp sge i64 %8, 65536
+  %10 = zext i1 %9 to i64
+  %11 = shl i64 %10, 4
+  %12 = lshr i64 %8, %11
+  store i64 %12, i64* %2
+  %13 = load i64, i64* %1
+  %14 = add i64 %13, %11
+  store i64 %14, i64* %1
+  %15 = load i64, i64* %2
+  %16 = icmp sge i64 %15, 256
+  %17 = zext i1 %16 to i64
+  %18 = shl i64 %17, 3
+  %19 = lshr i64 %15, %18
+  store i64 %19, i64* %2
+  %20 = load i64, i64* %1
+  %21 = add i64 %20, %18
+  store i64 %21, i64* %1
+  %22 = load i64, i64* %2
+  %23 = icmp sge i64 %22, 16
+  %24 = zext i1 %23 to i64
+  %25 = shl i64 %24, 2
+  %26 = lshr i64 %22, %25
+  store i64 %26, i64* %2
+  %27 = load i64, i64* %1
+  %28 = add i64 %27, %25
+  store i64 %28, i64* %1
+  %29 = load i64, i64* %2
+  %30 = icmp ugt i64 %29, 15
+  %31 = select i1 %30, i64 15, i64 %29
+  %32 = shl i64 %31, 2
+  %33 = lshr i64 4919131752702878224, %32
+  %34 = and i64 %33, 15
+  %35 = load i64, i64* %1
+  %36 = add i64 %35, %34
+  store i64 %36, i64* %1
   %37 = load i64, i64* %1
-  %38 = add i64 %37, %35
-  store i64 %38, i64* %1
-  %39 = load i64, i64* %2
-  %40 = icmp sge i64 %39, 2
-  %41 = zext i1 %40 to i64
-  %42 = shl i64 %41, 0
-  %43 = lshr i64 %39, %42
-  store i64 %43, i64* %2
-  %44 = load i64, i64* %1
-  %45 = add i64 %44, %42
-  store i64 %45, i64* %1
-  %46 = load i64, i64* %1
-  ret i64 %46
+  ret i64 %37
 }
 
 ; Function Attrs: argmemonly nounwind
@@ -138,5 +119,5 @@ declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture) #2
 declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #2
 
 attributes #0 = { nounwind }
-attributes #1 = { alwaysinline }
+attributes #1 = { noinline }
 attributes #2 = { argmemonly nounwind }
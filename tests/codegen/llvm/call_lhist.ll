@@ -13,23 +13,26 @@ entry:
   %"@x_key" = alloca i64
   %get_pid_tgid = call i64 inttoptr (i64 14 to i64 ()*)()
   %1 = lshr i64 %get_pid_tgid, 32
-  %get_pid_tgid1 = call i64 inttoptr (i64 14 to i64 ()*)()
-  %2 = lshr i64 %get_pid_tgid1, 32
-  %linear = call i64 @linear(i64 %2, i64 0, i64 100, i64 1)
-  %3 = bitcast i64* %"@x_key" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %3)
+  %2 = lshr i64 %get_pid_tgid, 32
+  %3 = icmp sgt i64 %2, 100
+  %4 = select i1 %3, i64 100, i64 %2
+  %5 = add i64 %4, 1
+  %6 = icmp slt i64 %2, 0
+  %linear = select i1 %6, i64 0, i64 %5
+  %7 = bitcast i64* %"@x_key" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %7)
   store i64 %linear, i64* %"@x_key"
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, i64*)*)(i64 %pseudo, i64* %"@x_key")
-  %4 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %4)
+  %8 = bitcast i64* %lookup_elem_val to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %8)
   %map_lookup_cond = icmp ne i8* %lookup_elem, null
   br i1 %map_lookup_cond, label %lookup_success, label %lookup_failure
 
 lookup_success:                                   ; preds = %entry
   %cast = bitcast i8* %lookup_elem to i64*
-  %5 = load i64, i64* %cast
-  store i64 %5, i64* %lookup_elem_val
+  %9 = load i64, i64* %cast
+  store i64 %9, i64* %lookup_elem_val
   br label %lookup_merge
 
 lookup_failure:                                   ; preds = %entry
@@ -37,87 +40,27 @@ lookup_failure:                                   ; preds = %entry
   br label %lookup_merge
 
 lookup_merge:                                     ; preds = %lookup_failure, %lookup_success
-  %6 = load i64, i64* %lookup_elem_val
-  %7 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %7)
-  %8 = bitcast i64* %"@x_val" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %8)
-  %9 = add i64 %6, 1
-  store i64 %9, i64* %"@x_val"
-  %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo2, i64* %"@x_key", i64* %"@x_val", i64 0)
-  %10 = bitcast i64* %"@x_key" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %10)
-  %11 = bitcast i64* %"@x_val" to i8*
+  %10 = load i64, i64* %lookup_elem_val
+  %11 = bitcast i64* %lookup_elem_val to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %11)
-  ret i64 0
-}
-
-; Function Attrs: alwaysinline
-define internal i64 @linear(i64, i64, i64, i64) #1 section "helpers" {
-entry:
-  %4 = alloca i64
-  %5 = alloca i64
-  %6 = alloca i64
-  %7 = alloca i64
-  %8 = alloca i64
-  %9 = bitcast i64* %8 to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %9)
-  %10 = bitcast i64* %7 to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %10)
-  %11 = bitcast i64* %6 to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %11)
-  %12 = bitcast i64* %5 to i8*
+  %12 = bitcast i64* %"@x_val" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %12)
-  %13 = bitcast i64* %4 to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %13)
-  store i64 %0, i64* %8
-  store i64 %1, i64* %7
-  store i64 %2, i64* %6
-  store i64 %3, i64* %5
-  %14 = load i64, i64* %7
-  %15 = load i64, i64* %8
-  %16 = icmp slt i64 %15, %14
-  br i1 %16, label %lhist.lt_min, label %lhist.ge_min
-
-lhist.lt_min:                                     ; preds = %entry
+  %13 = add i64 %10, 1
+  store i64 %13, i64* %"@x_val"
+  %pseudo1 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo1, i64* %"@x_key", i64* %"@x_val", i64 0)
+  %14 = bitcast i64* %"@x_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %14)
+  %15 = bitcast i64* %"@x_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %15)
   ret i64 0
-
-lhist.ge_min:                                     ; preds = %entry
-  %17 = load i64, i64* %6
-  %18 = load i64, i64* %8
-  %19 = icmp sgt i64 %18, %17
-  br i1 %19, label %lhist.gt_max, label %lhist.le_max
-
-lhist.le_max:                                     ; preds = %lhist.ge_min
-  %20 = load i64, i64* %5
-  %21 = load i64, i64* %7
-  %22 = load i64, i64* %8
-  %23 = sub i64 %22, %21
-  %24 = udiv i64 %23, %20
-  %25 = add i64 %24, 1
-  store i64 %25, i64* %4
-  %26 = load i64, i64* %4
-  ret i64 %26
-
-lhist.gt_max:                                     ; preds = %lhist.ge_min
-  %27 = load i64, i64* %5
-  %28 = load i64, i64* %7
-  %29 = load i64, i64* %6
-  %30 = sub i64 %29, %28
-  %31 = udiv i64 %30, %27
-  %32 = add i64 %31, 1
-  store i64 %32, i64* %4
-  %33 = load i64, i64* %4
-  ret i64 %33
 }
 
 ; Function Attrs: argmemonly nounwind
-declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture) #2
+declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture) #1
 
 ; Function Attrs: argmemonly nounwind
-declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #2
+declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #1
 
 attributes #0 = { nounwind }
-attributes #1 = { alwaysinline }
-attributes #2 = { argmemonly nounwind }
+attributes #1 = { argmemonly nounwind }
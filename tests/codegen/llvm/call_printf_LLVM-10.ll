@@ -3,7 +3,7 @@ source_filename = "bpftrace"
 target datalayout = "e-m:e-p:64:64-i64:64-n32:64-S128"
 target triple = "bpf-pc-linux"
 
-%printf_t = type { i64, i64, i64 }
+%printf_t = type <{ i64, i8, i64 }>
 
 ; Function Attrs: nounwind
 declare i64 @llvm.bpf.pseudo(i64 %0, i64 %1) #0
@@ -25,19 +25,18 @@ entry:
   store i64 %arg0, i64* %"$foo"
   %5 = bitcast %printf_t* %printf_args to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %5)
-  %6 = bitcast %printf_t* %printf_args to i8*
-  call void @llvm.memset.p0i8.i64(i8* align 1 %6, i8 0, i64 24, i1 false)
-  %7 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
-  store i64 0, i64* %7
-  %8 = load i64, i64* %"$foo"
-  %9 = add i64 %8, 0
+  %6 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
+  store i64 0, i64* %6, align 8
+  %7 = load i64, i64* %"$foo"
+  %8 = add i64 %7, 0
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %"struct Foo.c")
-  %probe_read_kernel = call i64 inttoptr (i64 113 to i64 (i8*, i32, i64)*)(i8* %"struct Foo.c", i32 1, i64 %9)
-  %10 = load i8, i8* %"struct Foo.c"
-  %11 = sext i8 %10 to i64
+  %probe_read_kernel = call i64 inttoptr (i64 113 to i64 (i8*, i32, i64)*)(i8* %"struct Foo.c", i32 1, i64 %8)
+  %9 = load i8, i8* %"struct Foo.c"
+  %10 = sext i8 %9 to i64
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %"struct Foo.c")
-  %12 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 1
-  store i64 %11, i64* %12
+  %11 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 1
+  %12 = trunc i64 %10 to i8
+  store i8 %12, i8* %11, align 8
   %13 = load i64, i64* %"$foo"
   %14 = add i64 %13, 8
   %15 = bitcast i64* %"struct Foo.l" to i8*
@@ -47,9 +46,9 @@ entry:
   %17 = bitcast i64* %"struct Foo.l" to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %17)
   %18 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 2
-  store i64 %16, i64* %18
+  store i64 %16, i64* %18, align 1
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %perf_event_output = call i64 inttoptr (i64 25 to i64 (i8*, i64, i64, %printf_t*, i64)*)(i8* %0, i64 %pseudo, i64 4294967295, %printf_t* %printf_args, i64 24)
+  %perf_event_output = call i64 inttoptr (i64 25 to i64 (i8*, i64, i64, %printf_t*, i64)*)(i8* %0, i64 %pseudo, i64 4294967295, %printf_t* %printf_args, i64 17)
   %19 = bitcast %printf_t* %printf_args to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %19)
   ret i64 0
@@ -58,9 +57,6 @@ entry:
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.lifetime.start.p0i8(i64 immarg %0, i8* nocapture %1) #1
 
-; Function Attrs: argmemonly nounwind willreturn
-declare void @llvm.memset.p0i8.i64(i8* nocapture writeonly %0, i8 %1, i64 %2, i1 immarg %3) #1
-
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.lifetime.end.p0i8(i64 immarg %0, i8* nocapture %1) #1
 
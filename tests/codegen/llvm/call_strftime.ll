@@ -4,7 +4,7 @@ target datalayout = "e-m:e-p:64:64-i64:64-n32:64-S128"
 target triple = "bpf-pc-linux"
 
 %strftime_t = type <{ i64, i64 }>
-%printf_t = type { i64, [16 x i8] }
+%printf_t = type <{ i64, [16 x i8] }>
 
 ; Function Attrs: nounwind
 declare i64 @llvm.bpf.pseudo(i64, i64) #0
@@ -15,34 +15,29 @@ entry:
   %printf_args = alloca %printf_t
   %1 = bitcast %printf_t* %printf_args to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %1)
-  %2 = bitcast %printf_t* %printf_args to i8*
-  call void @llvm.memset.p0i8.i64(i8* align 1 %2, i8 0, i64 24, i1 false)
-  %3 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
-  store i64 0, i64* %3
-  %4 = bitcast %strftime_t* %strftime_args to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %4)
-  %5 = getelementptr %strftime_t, %strftime_t* %strftime_args, i64 0, i32 0
-  store i64 0, i64* %5
+  %2 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
+  store i64 0, i64* %2, align 8
+  %3 = bitcast %strftime_t* %strftime_args to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %3)
+  %4 = getelementptr %strftime_t, %strftime_t* %strftime_args, i64 0, i32 0
+  store i64 0, i64* %4
   %get_ns = call i64 inttoptr (i64 5 to i64 ()*)()
-  %6 = getelementptr %strftime_t, %strftime_t* %strftime_args, i64 0, i32 1
-  store i64 %get_ns, i64* %6
-  %7 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 1
-  %8 = bitcast [16 x i8]* %7 to i8*
-  %9 = bitcast %strftime_t* %strftime_args to i8*
-  call void @llvm.memcpy.p0i8.p0i8.i64(i8* align 1 %8, i8* align 1 %9, i64 16, i1 false)
+  %5 = getelementptr %strftime_t, %strftime_t* %strftime_args, i64 0, i32 1
+  store i64 %get_ns, i64* %5
+  %6 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 1
+  %7 = bitcast [16 x i8]* %6 to i8*
+  %8 = bitcast %strftime_t* %strftime_args to i8*
+  call void @llvm.memcpy.p0i8.p0i8.i64(i8* align 1 %7, i8* align 1 %8, i64 16, i1 false)
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %perf_event_output = call i64 inttoptr (i64 25 to i64 (i8*, i64, i64, %printf_t*, i64)*)(i8* %0, i64 %pseudo, i64 4294967295, %printf_t* %printf_args, i64 24)
-  %10 = bitcast %printf_t* %printf_args to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %10)
+  %9 = bitcast %printf_t* %printf_args to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
   ret i64 0
 }
 
 ; Function Attrs: argmemonly nounwind
 declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture) #1
 
-; Function Attrs: argmemonly nounwind
-declare void @llvm.memset.p0i8.i64(i8* nocapture writeonly, i8, i64, i1) #1
-
 ; Function Attrs: argmemonly nounwind
 declare void @llvm.memcpy.p0i8.p0i8.i64(i8* nocapture writeonly, i8* nocapture readonly, i64, i1) #1
 
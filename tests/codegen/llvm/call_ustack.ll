@@ -31,8 +31,7 @@ entry:
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %6)
   %pseudo2 = call i64 @llvm.bpf.pseudo(i64 1, i64 3)
   %get_stackid3 = call i64 inttoptr (i64 27 to i64 (i8*, i64, i64)*)(i8* %0, i64 %pseudo2, i64 256)
-  %get_pid_tgid4 = call i64 inttoptr (i64 14 to i64 ()*)()
-  %7 = shl i64 %get_pid_tgid4, 32
+  %7 = shl i64 %get_pid_tgid, 32
   %8 = or i64 %get_stackid3, %7
   %9 = bitcast i64* %"@y_key" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %9)
@@ -40,8 +39,8 @@ entry:
   %10 = bitcast i64* %"@y_val" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %10)
   store i64 %8, i64* %"@y_val"
-  %pseudo5 = call i64 @llvm.bpf.pseudo(i64 1, i64 2)
-  %update_elem6 = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo5, i64* %"@y_key", i64* %"@y_val", i64 0)
+  %pseudo4 = call i64 @llvm.bpf.pseudo(i64 1, i64 2)
+  %update_elem5 = call i64 inttoptr (i64 2 to i64 (i64, i64*, i64*, i64)*)(i64 %pseudo4, i64* %"@y_key", i64* %"@y_val", i64 0)
   %11 = bitcast i64* %"@y_key" to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %11)
   %12 = bitcast i64* %"@y_val" to i8*
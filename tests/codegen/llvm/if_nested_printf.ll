@@ -3,7 +3,7 @@ source_filename = "bpftrace"
 target datalayout = "e-m:e-p:64:64-i64:64-n32:64-S128"
 target triple = "bpf-pc-linux"
 
-%printf_t = type { i64 }
+%printf_t = type <{ i64 }>
 
 ; Function Attrs: nounwind
 declare i64 @llvm.bpf.pseudo(i64, i64) #0
@@ -19,13 +19,12 @@ entry:
   br i1 %true_cond, label %if_body, label %if_end
 
 if_body:                                          ; preds = %entry
-  %get_pid_tgid3 = call i64 inttoptr (i64 14 to i64 ()*)()
-  %4 = lshr i64 %get_pid_tgid3, 32
+  %4 = lshr i64 %get_pid_tgid, 32
   %5 = urem i64 %4, 2
   %6 = icmp eq i64 %5, 0
   %7 = zext i1 %6 to i64
-  %true_cond4 = icmp ne i64 %7, 0
-  br i1 %true_cond4, label %if_body1, label %if_end2
+  %true_cond3 = icmp ne i64 %7, 0
+  br i1 %true_cond3, label %if_body1, label %if_end2
 
 if_end:                                           ; preds = %if_end2, %entry
   ret i64 0
@@ -33,14 +32,12 @@ if_end:                                           ; preds = %if_end2, %entry
 if_body1:                                         ; preds = %if_body
   %8 = bitcast %printf_t* %printf_args to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %8)
-  %9 = bitcast %printf_t* %printf_args to i8*
-  call void @llvm.memset.p0i8.i64(i8* align 1 %9, i8 0, i64 8, i1 false)
-  %10 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
-  store i64 0, i64* %10
+  %9 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
+  store i64 0, i64* %9, align 8
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
   %perf_event_output = call i64 inttoptr (i64 25 to i64 (i8*, i64, i64, %printf_t*, i64)*)(i8* %0, i64 %pseudo, i64 4294967295, %printf_t* %printf_args, i64 8)
-  %11 = bitcast %printf_t* %printf_args to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %11)
+  %10 = bitcast %printf_t* %printf_args to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %10)
   br label %if_end2
 
 if_end2:                                          ; preds = %if_body1, %if_body
@@ -50,9 +47,6 @@ if_end2:                                          ; preds = %if_body1, %if_body
 ; Function Attrs: argmemonly nounwind
 declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture) #1
 
-; Function Attrs: argmemonly nounwind
-declare void @llvm.memset.p0i8.i64(i8* nocapture writeonly, i8, i64, i1) #1
-
 ; Function Attrs: argmemonly nounwind
 declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #1
 
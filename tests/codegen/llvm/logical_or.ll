@@ -21,8 +21,7 @@ entry:
   br i1 %lhs_true_cond, label %"||_true", label %"||_lhs_false"
 
 "||_lhs_false":                                   ; preds = %entry
-  %get_pid_tgid1 = call i64 inttoptr (i64 14 to i64 ()*)()
-  %5 = lshr i64 %get_pid_tgid1, 32
+  %5 = lshr i64 %get_pid_tgid, 32
   %6 = icmp eq i64 %5, 1235
   %7 = zext i1 %6 to i64
   %rhs_true_cond = icmp ne i64 %7, 0
@@ -3,7 +3,7 @@ source_filename = "bpftrace"
 target datalayout = "e-m:e-p:64:64-i64:64-n32:64-S128"
 target triple = "bpf-pc-linux"
 
-%printf_t = type { i64, i64 }
+%printf_t = type <{ i64, i32 }>
 
 ; Function Attrs: nounwind
 declare i64 @llvm.bpf.pseudo(i64, i64) #0
@@ -22,28 +22,27 @@ entry:
   store i64 0, i64* %"$pp"
   %3 = bitcast %printf_t* %printf_args to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %3)
-  %4 = bitcast %printf_t* %printf_args to i8*
-  call void @llvm.memset.p0i8.i64(i8* align 1 %4, i8 0, i64 16, i1 false)
-  %5 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
-  store i64 0, i64* %5
-  %6 = load i64, i64* %"$pp"
-  %7 = bitcast i64* %deref to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %7)
-  %probe_read = call i64 inttoptr (i64 4 to i64 (i64*, i32, i64)*)(i64* %deref, i32 8, i64 %6)
-  %8 = load i64, i64* %deref
-  %9 = bitcast i64* %deref to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %9)
-  %10 = bitcast i32* %deref1 to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %10)
-  %probe_read2 = call i64 inttoptr (i64 4 to i64 (i32*, i32, i64)*)(i32* %deref1, i32 4, i64 %8)
-  %11 = load i32, i32* %deref1
-  %12 = sext i32 %11 to i64
-  %13 = bitcast i32* %deref1 to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %13)
-  %14 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 1
-  store i64 %12, i64* %14
+  %4 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 0
+  store i64 0, i64* %4, align 8
+  %5 = load i64, i64* %"$pp"
+  %6 = bitcast i64* %deref to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
+  %probe_read = call i64 inttoptr (i64 4 to i64 (i64*, i32, i64)*)(i64* %deref, i32 8, i64 %5)
+  %7 = load i64, i64* %deref
+  %8 = bitcast i64* %deref to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %8)
+  %9 = bitcast i32* %deref1 to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %9)
+  %probe_read2 = call i64 inttoptr (i64 4 to i64 (i32*, i32, i64)*)(i32* %deref1, i32 4, i64 %7)
+  %10 = load i32, i32* %deref1
+  %11 = sext i32 %10 to i64
+  %12 = bitcast i32* %deref1 to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %12)
+  %13 = getelementptr %printf_t, %printf_t* %printf_args, i32 0, i32 1
+  %14 = trunc i64 %11 to i32
+  store i32 %14, i32* %13, align 8
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %perf_event_output = call i64 inttoptr (i64 25 to i64 (i8*, i64, i64, %printf_t*, i64)*)(i8* %0, i64 %pseudo, i64 4294967295, %printf_t* %printf_args, i64 16)
+  %perf_event_output = call i64 inttoptr (i64 25 to i64 (i8*, i64, i64, %printf_t*, i64)*)(i8* %0, i64 %pseudo, i64 4294967295, %printf_t* %printf_args, i64 12)
   %15 = bitcast %printf_t* %printf_args to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %15)
   ret i64 0
@@ -52,9 +51,6 @@ entry:
 ; Function Attrs: argmemonly nounwind
 declare void @llvm.lifetime.start.p0i8(i64, i8* nocapture) #1
 
-; Function Attrs: argmemonly nounwind
-declare void @llvm.memset.p0i8.i64(i8* nocapture writeonly, i8, i64, i1) #1
-
 ; Function Attrs: argmemonly nounwind
 declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #1
 
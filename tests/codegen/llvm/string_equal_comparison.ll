@@ -9,8 +9,7 @@ declare i64 @llvm.bpf.pseudo(i64, i64) #0
 define i64 @"kretprobe:vfs_read"(i8*) section "s_kretprobe:vfs_read_1" {
 entry:
   %"@_val" = alloca i64
-  %lookup_elem_val = alloca i64
-  %comm9 = alloca [16 x i8]
+  %"@_key" = alloca [16 x i8]
   %strcmp.result = alloca i1
   %comm = alloca [16 x i8]
   %1 = bitcast [16 x i8]* %comm to i8*
@@ -30,80 +29,83 @@ pred_false:                                       ; preds = %strcmp.false
   ret i64 0
 
 pred_true:                                        ; preds = %strcmp.false
-  %6 = bitcast [16 x i8]* %comm9 to i8*
+  %6 = bitcast [16 x i8]* %"@_key" to i8*
   call void @llvm.lifetime.start.p0i8(i64 -1, i8* %6)
-  %7 = bitcast [16 x i8]* %comm9 to i8*
-  call void @llvm.memset.p0i8.i64(i8* align 1 %7, i8 0, i64 16, i1 false)
-  %get_comm10 = call i64 inttoptr (i64 16 to i64 ([16 x i8]*, i64)*)([16 x i8]* %comm9, i64 16)
+  %7 = bitcast [16 x i8]* %"@_key" to i8*
+  %8 = bitcast [16 x i8]* %comm to i8*
+  call void @llvm.memcpy.p0i8.p0i8.i64(i8* align 1 %7, i8* align 1 %8, i64 16, i1 false)
   %pseudo = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, [16 x i8]*)*)(i64 %pseudo, [16 x i8]* %comm9)
-  %8 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %8)
+  %lookup_elem = call i8* inttoptr (i64 1 to i8* (i64, [16 x i8]*)*)(i64 %pseudo, [16 x i8]* %"@_key")
   %map_lookup_cond = icmp ne i8* %lookup_elem, null
-  br i1 %map_lookup_cond, label %lookup_success, label %lookup_failure
+  br i1 %map_lookup_cond, label %update.in_place, label %update.insert
 
 strcmp.false:                                     ; preds = %strcmp.loop7, %strcmp.loop5, %strcmp.loop3, %strcmp.loop1, %strcmp.loop, %entry
   %9 = load i1, i1* %strcmp.result
   %10 = bitcast i1* %strcmp.result to i8*
   call void @llvm.lifetime.end.p0i8(i64 -1, i8* %10)
   %11 = zext i1 %9 to i64
-  %12 = bitcast [16 x i8]* %comm to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %12)
   %predcond = icmp eq i64 %11, 0
   br i1 %predcond, label %pred_false, label %pred_true
 
 strcmp.loop:                                      ; preds = %entry
-  %13 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 1
-  %14 = load i8, i8* %13
-  %strcmp.cmp2 = icmp ne i8 %14, 115
+  %12 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 1
+  %13 = load i8, i8* %12
+  %strcmp.cmp2 = icmp ne i8 %13, 115
   br i1 %strcmp.cmp2, label %strcmp.false, label %strcmp.loop1
 
 strcmp.loop1:                                     ; preds = %strcmp.loop
-  %15 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 2
-  %16 = load i8, i8* %15
-  %strcmp.cmp4 = icmp ne i8 %16, 104
+  %14 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 2
+  %15 = load i8, i8* %14
+  %strcmp.cmp4 = icmp ne i8 %15, 104
   br i1 %strcmp.cmp4, label %strcmp.false, label %strcmp.loop3
 
 strcmp.loop3:                                     ; preds = %strcmp.loop1
-  %17 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 3
-  %18 = load i8, i8* %17
-  %strcmp.cmp6 = icmp ne i8 %18, 100
+  %16 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 3
+  %17 = load i8, i8* %16
+  %strcmp.cmp6 = icmp ne i8 %17, 100
   br i1 %strcmp.cmp6, label %strcmp.false, label %strcmp.loop5
 
 strcmp.loop5:                                     ; preds = %strcmp.loop3
-  %19 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 4
-  %20 = load i8, i8* %19
-  %strcmp.cmp8 = icmp ne i8 %20, 0
+  %18 = getelementptr [16 x i8], [16 x i8]* %comm, i32 0, i32 4
+  %19 = load i8, i8* %18
+  %strcmp.cmp8 = icmp ne i8 %19, 0
   br i1 %strcmp.cmp8, label %strcmp.false, label %strcmp.loop7
 
 strcmp.loop7:                                     ; preds = %strcmp.loop5
   store i1 true, i1* %strcmp.result
   br label %strcmp.false
 
-lookup_success:                                   ; preds = %pred_true
-  %cast = bitcast i8* %lookup_elem to i64*
-  %21 = load i64, i64* %cast
-  store i64 %21, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_failure:                                   ; preds = %pred_true
-  store i64 0, i64* %lookup_elem_val
-  br label %lookup_merge
-
-lookup_merge:                                     ; preds = %lookup_failure, %lookup_success
-  %22 = load i64, i64* %lookup_elem_val
-  %23 = bitcast i64* %lookup_elem_val to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %23)
-  %24 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %24)
-  %25 = add i64 %22, 1
-  store i64 %25, i64* %"@_val"
-  %pseudo11 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
-  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, [16 x i8]*, i64*, i64)*)(i64 %pseudo11, [16 x i8]* %comm9, i64* %"@_val", i64 0)
-  %26 = bitcast [16 x i8]* %comm9 to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %26)
-  %27 = bitcast i64* %"@_val" to i8*
-  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %27)
+update.insert:                                    ; preds = %pred_true
+  %20 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.start.p0i8(i64 -1, i8* %20)
+  store i64 1, i64* %"@_val"
+  %pseudo9 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %update_elem = call i64 inttoptr (i64 2 to i64 (i64, [16 x i8]*, i64*, i64)*)(i64 %pseudo9, [16 x i8]* %"@_key", i64* %"@_val", i64 1)
+  %21 = bitcast i64* %"@_val" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %21)
+  %map_insert_cond = icmp eq i64 %update_elem, 0
+  br i1 %map_insert_cond, label %update.done, label %update.retry
+
+update.retry:                                     ; preds = %update.insert
+  %pseudo10 = call i64 @llvm.bpf.pseudo(i64 1, i64 1)
+  %lookup_elem11 = call i8* inttoptr (i64 1 to i8* (i64, [16 x i8]*)*)(i64 %pseudo10, [16 x i8]* %"@_key")
+  %map_lookup_cond12 = icmp ne i8* %lookup_elem11, null
+  br i1 %map_lookup_cond12, label %update.in_place, label %update.failure
+
+update.failure:                                   ; preds = %update.retry
+  br label %update.done
+
+update.in_place:                                  ; preds = %update.retry, %pred_true
+  %update_ptr = phi i8* [ %lookup_elem, %pred_true ], [ %lookup_elem11, %update.retry ]
+  %22 = bitcast i8* %update_ptr to i64*
+  %23 = load i64, i64* %22
+  %24 = add i64 %23, 1
+  store i64 %24, i64* %22
+  br label %update.done
+
+update.done:                                      ; preds = %update.in_place, %update.failure, %update.insert
+  %25 = bitcast [16 x i8]* %"@_key" to i8*
+  call void @llvm.lifetime.end.p0i8(i64 -1, i8* %25)
   ret i64 0
 }
 
@@ -116,5 +118,8 @@ declare void @llvm.memset.p0i8.i64(i8* nocapture writeonly, i8, i64, i1) #1
 ; Function Attrs: argmemonly nounwind
 declare void @llvm.lifetime.end.p0i8(i64, i8* nocapture) #1
 
+; Function Attrs: argmemonly nounwind
+declare void @llvm.memcpy.p0i8.p0i8.i64(i8* nocapture writeonly, i8* nocapture readonly, i64, i1) #1
+
 attributes #0 = { nounwind }
 attributes #1 = { argmemonly nounwind }
@@ -8,6 +8,7 @@ TEST(codegen, runtime_error_check)
 {
   BPFtrace bpftrace;
   bpftrace.helper_check_level_ = 1;
+  bpftrace.helper_error_events_ = true;
   test(bpftrace, "kprobe:f { @++; }", NAME);
 }
 
@@ -15,6 +16,7 @@ TEST(codegen, runtime_error_check_lookup)
 {
   BPFtrace bpftrace;
   bpftrace.helper_check_level_ = 2;
+  bpftrace.helper_error_events_ = true;
   test(bpftrace, "kprobe:f { @++; }", NAME);
 }
 
@@ -0,0 +1,18 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+TEST(codegen, target_filter)
+{
+  BPFtrace bpftrace;
+  bpftrace.procmon_ = std::make_unique<MockProcMon>(1234);
+  bpftrace.cgroup_filter_ = 0x100000001;
+
+  test(bpftrace, "kprobe:f { @x = pid } interval:s:1 { @y = 1 }", NAME);
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,26 @@
+#include "demangle_cache.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace demangle_cache {
+
+TEST(DemangleCache, demangle)
+{
+  DemangleCache cache;
+  EXPECT_EQ(cache.demangle("main"), nullptr);
+  EXPECT_EQ(cache.demangle("_Zinvalid"), nullptr);
+
+  const std::string *name = cache.demangle("_ZN3foo3barEi");
+  ASSERT_NE(name, nullptr);
+  EXPECT_EQ(*name, "foo::bar(int)");
+
+  // Interned, failures included
+  EXPECT_EQ(cache.demangle("_ZN3foo3barEi"), name);
+  EXPECT_EQ(cache.demangle("_Zinvalid"), nullptr);
+  EXPECT_EQ(cache.size(), 2U);
+}
+
+} // namespace demangle_cache
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,61 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bpftrace.h"
+#include "embed.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace embed {
+
+static Field field(const SizedType &type, ssize_t offset)
+{
+  Field f = {};
+  f.type = type;
+  f.offset = offset;
+  return f;
+}
+
+TEST(embed, event_args)
+{
+  BPFtrace bpftrace;
+  // The printf() id comes first
+  std::vector<Field> args = { field(CreateInt32(), 8),
+                              field(CreateUInt64(), 16),
+                              field(CreateString(8), 24) };
+  uint8_t data[32] = {};
+  int32_t i = -3;
+  uint64_t u = 1ULL << 40;
+  memcpy(data + 8, &i, sizeof(i));
+  memcpy(data + 16, &u, sizeof(u));
+  memcpy(data + 24, "abc", 4);
+
+  std::string format = "%d %lu %s\n";
+  Event event(bpftrace, 2, format, args, data);
+  EXPECT_EQ(event.id, 2U);
+  EXPECT_EQ(static_cast<int64_t>(event.integer(0)), -3);
+  EXPECT_EQ(event.integer(1), 1ULL << 40);
+  EXPECT_THROW(event.integer(2), std::invalid_argument);
+  EXPECT_EQ(event.text(0), "-3");
+  EXPECT_EQ(event.text(1), std::to_string(1ULL << 40));
+  EXPECT_EQ(event.text(2), "abc");
+}
+
+TEST(embed, text_lines)
+{
+  Session session;
+  std::vector<std::string> lines;
+  session.on_text([&](const std::string &line) { lines.push_back(line); });
+
+  auto &out = *session.bpftrace().out_;
+  out.message(MessageType::printf, "one\ntw", false);
+  EXPECT_EQ(lines, std::vector<std::string>{ "one" });
+  out.message(MessageType::printf, "o", true);
+  EXPECT_EQ(lines, (std::vector<std::string>{ "one", "two" }));
+}
+
+} // namespace embed
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,51 @@
+#include "hist_buckets.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace hist_buckets {
+
+TEST(HistBuckets, group_by_key)
+{
+  HistBuckets hb;
+  hb.reset(4);
+
+  uint8_t a[] = { 1, 2 };
+  uint8_t b[] = { 2, 1 };
+  hb.buckets(a, sizeof(a))[0] = 5;
+  hb.buckets(b, sizeof(b))[1] = 7;
+  hb.buckets(a, sizeof(a))[3] = 1;
+  ASSERT_EQ(hb.size(), 2U);
+
+  hb.compute_totals();
+  EXPECT_EQ(hb[0].key, std::vector<uint8_t>({ 1, 2 }));
+  EXPECT_EQ(hb[0].buckets, std::vector<uint64_t>({ 5, 0, 0, 1 }));
+  EXPECT_EQ(hb[0].total, 6U);
+  EXPECT_EQ(hb[1].key, std::vector<uint8_t>({ 2, 1 }));
+  EXPECT_EQ(hb[1].buckets, std::vector<uint64_t>({ 0, 7, 0, 0 }));
+  EXPECT_EQ(hb[1].total, 7U);
+}
+
+TEST(HistBuckets, grow_and_reset)
+{
+  HistBuckets hb;
+  hb.reset(2);
+  for (uint32_t i = 0; i < 1000; i++)
+    hb.buckets(reinterpret_cast<uint8_t *>(&i), sizeof(i))[1] = i;
+  ASSERT_EQ(hb.size(), 1000U);
+  for (uint32_t i = 0; i < 1000; i++)
+    EXPECT_EQ(hb.buckets(reinterpret_cast<uint8_t *>(&i), sizeof(i))[1], i);
+  EXPECT_EQ(hb.size(), 1000U);
+
+  // Entries reused after a reset start zeroed, with the new bucket count
+  hb.reset(3);
+  EXPECT_EQ(hb.size(), 0U);
+  uint32_t key = 42;
+  auto &buckets = hb.buckets(reinterpret_cast<uint8_t *>(&key), sizeof(key));
+  EXPECT_EQ(buckets, std::vector<uint64_t>({ 0, 0, 0 }));
+  EXPECT_EQ(hb.size(), 1U);
+}
+
+} // namespace hist_buckets
+} // namespace test
+} // namespace bpftrace
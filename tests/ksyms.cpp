@@ -0,0 +1,63 @@
+#include <sstream>
+
+#include "ksyms.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace ksyms {
+
+static std::string resolve(const KSyms &ksyms, uint64_t addr, bool offset)
+{
+  std::string out;
+  if (!ksyms.resolve(addr, offset, out))
+    return "<none>";
+  return out;
+}
+
+TEST(KSyms, resolve)
+{
+  std::istringstream kallsyms("ffffffff81000000 T _stext\n"
+                              "ffffffff81000100 t do_one\n"
+                              "ffffffff81000200 T do_two\n"
+                              "ffffffffc0001000 t mod_func\t[mod]\n"
+                              "0000000000000000 A fixed_percpu_data\n");
+  KSyms ksyms;
+  ksyms.load(kallsyms);
+  ASSERT_EQ(ksyms.size(), 4U);
+
+  EXPECT_EQ(resolve(ksyms, 0xffffffff80000000, true), "<none>");
+  EXPECT_EQ(resolve(ksyms, 0xffffffff81000000, true), "_stext+0");
+  EXPECT_EQ(resolve(ksyms, 0xffffffff81000104, true), "do_one+4");
+  EXPECT_EQ(resolve(ksyms, 0xffffffff81000104, false), "do_one");
+  EXPECT_EQ(resolve(ksyms, 0xffffffff81000200, true), "do_two+0");
+  EXPECT_EQ(resolve(ksyms, 0xffffffffc0001010, true), "mod_func+16");
+}
+
+TEST(KSyms, unsorted)
+{
+  std::istringstream kallsyms("ffffffffc0001000 t mod_func\t[mod]\n"
+                              "ffffffff81000200 T do_two\n"
+                              "ffffffff81000100 t do_one\n");
+  KSyms ksyms;
+  ksyms.load(kallsyms);
+  ASSERT_EQ(ksyms.size(), 3U);
+
+  EXPECT_EQ(resolve(ksyms, 0xffffffff81000100, true), "do_one+0");
+  EXPECT_EQ(resolve(ksyms, 0xffffffff81000300, true), "do_two+256");
+  EXPECT_EQ(resolve(ksyms, 0xffffffffc0001001, true), "mod_func+1");
+}
+
+TEST(KSyms, hidden_addresses)
+{
+  std::istringstream kallsyms("0000000000000000 T _stext\n"
+                              "0000000000000000 t do_one\n");
+  KSyms ksyms;
+  ksyms.load(kallsyms);
+  EXPECT_EQ(ksyms.size(), 0U);
+  EXPECT_EQ(resolve(ksyms, 0xffffffff81000000, true), "<none>");
+}
+
+} // namespace ksyms
+} // namespace test
+} // namespace bpftrace
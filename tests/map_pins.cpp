@@ -0,0 +1,67 @@
+#include "ast/fake_map.h"
+#include "map_pins.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace map_pins {
+
+// FakeMap only keeps the name, the rest is what Map would have made of it
+static std::unique_ptr<IMap> make_map(const std::string &name,
+                                      const SizedType &type,
+                                      const MapKey &key,
+                                      enum bpf_map_type map_type,
+                                      int max_entries)
+{
+  auto map = std::make_unique<FakeMap>(name, type, key, max_entries);
+  map->type_ = type;
+  map->key_ = key;
+  map->map_type_ = map_type;
+  return map;
+}
+
+TEST(map_pins, metadata)
+{
+  MapManager maps;
+  maps.Add(make_map("@lat",
+                    CreateHist(),
+                    MapKey{ { CreateInt64(), CreateString(16) } },
+                    BPF_MAP_TYPE_PERCPU_HASH,
+                    4096));
+  maps.Add(make_map(
+      "@", CreateCount(true), MapKey{}, BPF_MAP_TYPE_PERCPU_ARRAY, 1));
+  auto lhist = make_map("@l",
+                        CreateLhist(),
+                        MapKey{},
+                        BPF_MAP_TYPE_HASH,
+                        4096);
+  lhist->lqmin = 0;
+  lhist->lqmax = 100;
+  lhist->lqstep = 10;
+  maps.Add(std::move(lhist));
+
+  EXPECT_EQ(pinned_maps_metadata(maps),
+            "{\"maps\": ["
+            "{\"name\": \"@lat\", \"type\": \"hist\", \"value_size\": 8, "
+            "\"key\": [{\"type\": \"int64\", \"size\": 8}, "
+            "{\"type\": \"string[16]\", \"size\": 16}], \"bucket\": true, "
+            "\"key_size\": 32, \"map_type\": 5, \"max_entries\": 4096, "
+            "\"per_cpu\": true, \"mmapped\": false, \"dense\": false, "
+            "\"double_buffered\": false, \"sketch\": false}, "
+            "{\"name\": \"@\", \"type\": \"count\", \"value_size\": 8, "
+            "\"key\": [], \"bucket\": false, \"key_size\": 4, "
+            "\"map_type\": 6, \"max_entries\": 1, \"per_cpu\": true, "
+            "\"mmapped\": false, \"dense\": false, "
+            "\"double_buffered\": false, \"sketch\": false}, "
+            "{\"name\": \"@l\", \"type\": \"lhist\", \"value_size\": 8, "
+            "\"key\": [], \"bucket\": true, \"key_size\": 8, "
+            "\"map_type\": 1, \"max_entries\": 4096, \"per_cpu\": false, "
+            "\"mmapped\": false, \"dense\": false, "
+            "\"double_buffered\": false, \"sketch\": false, \"min\": 0, "
+            "\"max\": 100, \"step\": 10}"
+            "]}");
+}
+
+} // namespace map_pins
+} // namespace test
+} // namespace bpftrace
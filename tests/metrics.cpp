@@ -0,0 +1,142 @@
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "metrics.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace metrics {
+
+TEST(MetricsText, samples)
+{
+  MetricsText text;
+  text.family(metric_name("@syscalls"), "counter");
+  text.sample("_total", { { "key", "read" } }, uint64_t(12));
+  text.sample("_total", { { "key0", "a\"b\\c\nd" }, { "key1", "1" } }, 3L);
+  text.family(metric_name("@"), "gauge");
+  text.sample("", {}, -4L);
+  EXPECT_EQ(text.finish(),
+            "# TYPE bpftrace_syscalls counter\n"
+            "bpftrace_syscalls_total{key=\"read\"} 12\n"
+            "bpftrace_syscalls_total{key0=\"a\\\"b\\\\c\\nd\",key1=\"1\"} 3\n"
+            "# TYPE bpftrace gauge\n"
+            "bpftrace -4\n"
+            "# EOF\n");
+}
+
+TEST(MetricsText, buckets)
+{
+  MetricsText text;
+  text.family("bpftrace_lat", "histogram");
+  text.bucket({}, -1, 1);
+  text.bucket({}, 1023, 5);
+  text.bucket({}, std::ldexp(1, 63) - 1, 6);
+  text.bucket({ { "key", "x" } }, INFINITY, 7);
+  EXPECT_EQ(text.finish(),
+            "# TYPE bpftrace_lat histogram\n"
+            "bpftrace_lat_bucket{le=\"-1.0\"} 1\n"
+            "bpftrace_lat_bucket{le=\"1023.0\"} 5\n"
+            "bpftrace_lat_bucket{le=\"9.2233720368547758e+18\"} 6\n"
+            "bpftrace_lat_bucket{key=\"x\",le=\"+Inf\"} 7\n"
+            "# EOF\n");
+}
+
+// Connects to the server and sends it request, for serve() to answer
+static int send_request(MetricsServer &server, const std::string &request)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server.port());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EXPECT_EQ(connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr)),
+            0);
+  EXPECT_EQ(send(fd, request.data(), request.size(), 0),
+            static_cast<ssize_t>(request.size()));
+  return fd;
+}
+
+// Sends request to the server, answers it and returns the response
+static std::string scrape(MetricsServer &server, const std::string &request)
+{
+  int fd = send_request(server, request);
+
+  server.serve([]() { return std::string("# EOF\n"); });
+
+  std::string response;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    response.append(buf, n);
+  close(fd);
+  return response;
+}
+
+TEST(MetricsServer, serve)
+{
+  MetricsServer server;
+  ASSERT_EQ(server.listen("127.0.0.1:0"), 0);
+  ASSERT_NE(server.port(), 0);
+
+  EXPECT_EQ(scrape(server, "GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n"),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/openmetrics-text; version=1.0.0; "
+            "charset=utf-8\r\n"
+            "Content-Length: 6\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "# EOF\n");
+  EXPECT_EQ(scrape(server, "GET /other HTTP/1.1\r\n\r\n"),
+            "HTTP/1.1 404 Not Found\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n"
+            "\r\n");
+  EXPECT_EQ(scrape(server, "POST /metrics HTTP/1.1\r\n\r\n")
+                .rfind("HTTP/1.1 405 ", 0),
+            0U);
+
+  // Nothing left to answer
+  server.serve([]() { return std::string(); });
+}
+
+TEST(MetricsServer, slow_client)
+{
+  MetricsServer server;
+  ASSERT_EQ(server.listen("127.0.0.1:0"), 0);
+
+  // A client taking the response, which is larger than the socket buffers,
+  // a bit at a time
+  int fd = send_request(server, "GET /metrics HTTP/1.1\r\n\r\n");
+  std::atomic<bool> served = false;
+  std::thread reader([fd, &served]() {
+    std::vector<char> buf(64 * 1024);
+    while (!served && recv(fd, buf.data(), buf.size(), 0) > 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  });
+  auto start = std::chrono::steady_clock::now();
+  server.serve([]() { return std::string(128 << 20, 'x'); });
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+  served = true;
+  reader.join();
+  close(fd);
+}
+
+TEST(MetricsServer, invalid_address)
+{
+  MetricsServer server;
+  EXPECT_LT(server.listen("127.0.0.1:port"), 0);
+}
+
+} // namespace metrics
+} // namespace test
+} // namespace bpftrace
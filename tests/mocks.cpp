@@ -74,6 +74,8 @@ void setup_mock_probe_matcher(MockProbeMatcher &matcher)
 
 void setup_mock_bpftrace(MockBPFtrace &bpftrace)
 {
+  bpftrace.feature_ = std::make_unique<MockBPFfeature>(true);
+
   // Fill in some default tracepoint struct definitions
   bpftrace.structs_["struct _tracepoint_sched_sched_one"] = Struct{
     .size = 8,
@@ -82,18 +82,30 @@ std::unique_ptr<MockBPFtrace> get_strict_mock_bpftrace();
 class MockBPFfeature : public BPFfeature
 {
 public:
-  MockBPFfeature(bool has_features = true)
+  // Wildcard kprobes and uprobes get a probe per match unless multi_links is
+  // set
+  MockBPFfeature(bool has_features = true, bool multi_links = false)
   {
     has_send_signal_ = std::make_optional<bool>(has_features);
     has_get_current_cgroup_id_ = std::make_optional<bool>(has_features);
     has_override_return_ = std::make_optional<bool>(has_features);
     prog_kfunc_ = std::make_optional<bool>(has_features);
+    prog_raw_tracepoint_ = std::make_optional<bool>(has_features);
     prog_iter_task_ = std::make_optional<bool>(has_features);
     prog_iter_task_file_ = std::make_optional<bool>(has_features);
     has_loop_ = std::make_optional<bool>(has_features);
+    has_bpf2bpf_call_ = std::make_optional<bool>(has_features);
     has_probe_read_kernel_ = std::make_optional<bool>(has_features);
     has_features_ = has_features;
     has_d_path_ = std::make_optional<bool>(has_features);
+    has_map_mmapable_ = std::make_optional<bool>(has_features);
+    has_get_attach_cookie_ = std::make_optional<bool>(has_features);
+    has_task_storage_ = std::make_optional<bool>(has_features);
+    has_perf_event_read_value_ = std::make_optional<bool>(has_features);
+    has_for_each_map_elem_ = std::make_optional<bool>(has_features);
+    map_bloom_filter_ = std::make_optional<bool>(has_features);
+    has_kprobe_multi_ = std::make_optional<bool>(multi_links);
+    has_uprobe_multi_ = std::make_optional<bool>(multi_links);
   };
   bool has_features_;
 };
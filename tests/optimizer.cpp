@@ -0,0 +1,299 @@
+#include <sstream>
+
+#include "gtest/gtest.h"
+#include "driver.h"
+#include "optimizer.h"
+#include "printer.h"
+
+namespace bpftrace {
+namespace test {
+namespace optimizer {
+
+void test(BPFtrace &bpftrace,
+          const std::string &input,
+          const std::string &output)
+{
+  Driver driver(bpftrace);
+  ASSERT_EQ(driver.parse_str(input), 0);
+
+  ast::PassContext ctx(bpftrace);
+  ast::PassManager pm;
+  pm.AddPass(ast::CreateFoldPass());
+  pm.AddPass(ast::CreateDeadCodePass());
+  pm.AddPass(ast::CreatePredicateReorderPass());
+  auto root = pm.Run(std::unique_ptr<ast::Node>(driver.root_), ctx);
+  driver.root_ = nullptr;
+  ASSERT_TRUE(root);
+
+  std::ostringstream out;
+  ast::Printer printer(out);
+  printer.print(root.get());
+  EXPECT_EQ(output, out.str());
+}
+
+void test(const std::string &input, const std::string &output)
+{
+  BPFtrace bpftrace;
+  test(bpftrace, input, output);
+}
+
+TEST(optimizer, fold_binop)
+{
+  test("kprobe:f { @ = 1 + 2 * 3; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   int: 7\n");
+  test("kprobe:f { @ = (1 << 4) | 1 == 1; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   int: 17\n");
+  test("kprobe:f { @ = 0 && pid; @x = 1 || pid; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   int: 0\n"
+       "  =\n"
+       "   map: @x\n"
+       "   int: 1\n");
+  test("kprobe:f { @ = pid + 1 * 2; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   +\n"
+       "    builtin: pid\n"
+       "    int: 2\n");
+}
+
+TEST(optimizer, fold_keeps_undefined)
+{
+  // Division by zero, signed division and side effects are left alone
+  test("kprobe:f { @ = 1 / 0; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   /\n"
+       "    int: 1\n"
+       "    int: 0\n");
+  test("kprobe:f { @ = (0 - 4) / 2; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   /\n"
+       "    int: -4\n"
+       "    int: 2\n");
+  test("kprobe:f { @ = 0 && @x++; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   &&\n"
+       "    int: 0\n"
+       "    map: @x\n"
+       "     ++\n");
+}
+
+TEST(optimizer, fold_unop)
+{
+  test("kprobe:f { @ = !0; @x = -(2 + 3); @y = ~0; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   int: 1\n"
+       "  =\n"
+       "   map: @x\n"
+       "   int: -5\n"
+       "  =\n"
+       "   map: @y\n"
+       "   int: -1\n");
+}
+
+TEST(optimizer, fold_ternary)
+{
+  test("kprobe:f { @ = 1 > 2 ? pid : tid; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   builtin: tid\n");
+}
+
+TEST(optimizer, fold_positional_param)
+{
+  BPFtrace bpftrace;
+  bpftrace.add_param("10");
+  bpftrace.add_param("abc");
+
+  test(bpftrace,
+       "kprobe:f { @ = $1 * 2 + $#; @x = str($1 + 1); @y = str($2); }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   int: 22\n"
+       "  =\n"
+       "   map: @x\n"
+       "   call: str\n"
+       "    +\n"
+       "     param: $1\n"
+       "     int: 1\n"
+       "  =\n"
+       "   map: @y\n"
+       "   call: str\n"
+       "    param: $2\n");
+}
+
+TEST(optimizer, compound_assignment)
+{
+  test("kprobe:f { @ += 2 * 2; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @\n"
+       "   +\n"
+       "    map: @\n"
+       "    int: 4\n");
+}
+
+TEST(optimizer, dead_if)
+{
+  test("kprobe:f { if (0) { @a = 1; } else { @b = 2; } if (2 > 1) { @c = 3; } }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @b\n"
+       "   int: 2\n"
+       "  =\n"
+       "   map: @c\n"
+       "   int: 3\n");
+  // @a is still read, so its assignment is kept
+  test("kprobe:f { if (0) { @a = 1; } @b = @a; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  if\n"
+       "   int: 0\n"
+       "   then\n"
+       "    =\n"
+       "     map: @a\n"
+       "     int: 1\n"
+       "  =\n"
+       "   map: @b\n"
+       "   map: @a\n");
+}
+
+TEST(optimizer, dead_while)
+{
+  test("i:s:1 { while (0) { @a = 1; } @b = 1; }",
+       "Program\n"
+       " interval:s:1\n"
+       "  =\n"
+       "   map: @b\n"
+       "   int: 1\n");
+}
+
+TEST(optimizer, dead_predicate)
+{
+  test("kprobe:f /1/ { @a = 1; } kprobe:g /0/ { @b = 1; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @a\n"
+       "   int: 1\n"
+       " kprobe:g\n"
+       "  pred\n"
+       "   int: 0\n");
+}
+
+TEST(optimizer, dead_after_jump)
+{
+  test("kprobe:f { @a = 1; return; @b = 1; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @a\n"
+       "   int: 1\n"
+       "  return\n");
+}
+
+TEST(optimizer, dead_variable)
+{
+  test("kprobe:f { $a = pid; $b = $a + 1; $c = 1; @ = $c; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   variable: $c\n"
+       "   int: 1\n"
+       "  =\n"
+       "   map: @\n"
+       "   variable: $c\n");
+  // Calls might have side effects
+  test("kprobe:f { $a = str(arg0); $b = 1; $b = 2; }",
+       "Program\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   variable: $a\n"
+       "   call: str\n"
+       "    builtin: arg0\n");
+}
+
+TEST(optimizer, dead_map_declaration)
+{
+  test("@a = hash(10); @b = hash(10); kprobe:f { if (0) { @a = 1; } }",
+       "Program\n"
+       " @b = hash(10)\n"
+       " kprobe:f\n");
+}
+
+TEST(optimizer, predicate_reorder)
+{
+  test("kprobe:f /comm == \"nginx\" && pid == 1/ { }",
+       "Program\n"
+       " kprobe:f\n"
+       "  pred\n"
+       "   &&\n"
+       "    ==\n"
+       "     builtin: pid\n"
+       "     int: 1\n"
+       "    ==\n"
+       "     builtin: comm\n"
+       "     string: nginx\n");
+  // Nothing moves across @y++
+  test("kprobe:f /*arg0 == 1 && (@x && tid == 2) && @y++ && comm == \"a\" && "
+       "cgroup == 3/ { }",
+       "Program\n"
+       " kprobe:f\n"
+       "  pred\n"
+       "   &&\n"
+       "    &&\n"
+       "     &&\n"
+       "      &&\n"
+       "       &&\n"
+       "        ==\n"
+       "         builtin: tid\n"
+       "         int: 2\n"
+       "        map: @x\n"
+       "       ==\n"
+       "        dereference\n"
+       "         builtin: arg0\n"
+       "        int: 1\n"
+       "      map: @y\n"
+       "       ++\n"
+       "     ==\n"
+       "      builtin: cgroup\n"
+       "      int: 3\n"
+       "    ==\n"
+       "     builtin: comm\n"
+       "     string: a\n");
+}
+
+} // namespace optimizer
+} // namespace test
+} // namespace bpftrace
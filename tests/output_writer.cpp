@@ -0,0 +1,398 @@
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <arpa/inet.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#include "output_writer.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace output_writer {
+
+// Reads fd until EOF
+static std::thread reader(int fd, std::string &out)
+{
+  return std::thread([fd, &out]() {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+      out.append(buf, n);
+  });
+}
+
+TEST(OutputWriter, order)
+{
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  std::string out;
+  auto thread = reader(fds[0], out);
+
+  std::string expected;
+  {
+    OutputWriter writer(fds[1], 4096, false);
+    std::ostream os(&writer);
+    for (int i = 0; i < 10000; i++)
+    {
+      os << "line " << i << std::endl;
+      expected += "line " + std::to_string(i) + "\n";
+    }
+    // Not flushed, written at the latest when the writer goes away
+    os << "last";
+    expected += "last";
+  }
+  close(fds[1]);
+  thread.join();
+  close(fds[0]);
+
+  EXPECT_EQ(out, expected);
+}
+
+TEST(OutputWriter, drop)
+{
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  std::string out;
+  std::thread thread;
+
+  size_t total = 0;
+  uint64_t dropped;
+  {
+    OutputWriter writer(fds[1], 64, true);
+    std::ostream os(&writer);
+    // Nothing is read until the pipe and the queue are full
+    while (writer.dropped() == 0)
+    {
+      os << "0123456789\n" << std::flush;
+      total += 11;
+    }
+    thread = reader(fds[0], out);
+    dropped = writer.dropped();
+  }
+  close(fds[1]);
+  thread.join();
+  close(fds[0]);
+
+  // Whole lines are dropped
+  EXPECT_EQ(dropped % 11, 0U);
+  EXPECT_EQ(out.size() + dropped, total);
+}
+
+// Writes lines through a compressing writer, returns the compressed output
+static std::string compressed_lines(Compression compression,
+                                    std::string &expected)
+{
+  int fds[2];
+  EXPECT_EQ(pipe(fds), 0);
+  std::string out;
+  auto thread = reader(fds[0], out);
+  {
+    OutputWriter writer(fds[1], 4096, false, compression);
+    std::ostream os(&writer);
+    for (int i = 0; i < 10000; i++)
+    {
+      os << "line " << i % 100 << std::endl;
+      expected += "line " + std::to_string(i % 100) + "\n";
+    }
+  }
+  close(fds[1]);
+  thread.join();
+  close(fds[0]);
+  return out;
+}
+
+#ifdef HAVE_LIBZSTD
+TEST(OutputWriter, zstd)
+{
+  std::string expected;
+  auto out = compressed_lines(Compression::zstd, expected);
+  EXPECT_LT(out.size(), expected.size());
+
+  std::string decoded(expected.size() + 1, '\0');
+  size_t size = ZSTD_decompress(
+      &decoded[0], decoded.size(), out.data(), out.size());
+  ASSERT_FALSE(ZSTD_isError(size)) << ZSTD_getErrorName(size);
+  decoded.resize(size);
+  EXPECT_EQ(decoded, expected);
+}
+#endif
+
+#ifdef HAVE_LIBLZ4
+TEST(OutputWriter, lz4)
+{
+  std::string expected;
+  auto out = compressed_lines(Compression::lz4, expected);
+  EXPECT_LT(out.size(), expected.size());
+
+  LZ4F_dctx *dctx;
+  ASSERT_FALSE(
+      LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)));
+  std::string decoded(expected.size() + 1, '\0');
+  size_t dst_size = decoded.size(), src_size = out.size();
+  size_t left = LZ4F_decompress(
+      dctx, &decoded[0], &dst_size, out.data(), &src_size, nullptr);
+  LZ4F_freeDecompressionContext(dctx);
+  // 0 once the whole frame was decoded
+  ASSERT_EQ(left, 0U);
+  EXPECT_EQ(src_size, out.size());
+  decoded.resize(dst_size);
+  EXPECT_EQ(decoded, expected);
+}
+#endif
+
+static std::string read_file(const std::string &path)
+{
+  std::ifstream file(path);
+  std::stringstream buf;
+  buf << file.rdbuf();
+  return buf.str();
+}
+
+class OutputWriterRotation : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    char tmpl[] = "/tmp/bpftrace-test-rotation-XXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir_ = tmpl;
+    path_ = dir_ + "/out";
+  }
+  void TearDown() override
+  {
+    for (int i = 0; i < 100; i++)
+      std::remove((path_ + "." + std::to_string(i)).c_str());
+    std::remove(path_.c_str());
+    std::remove((dir_ + "/moved").c_str());
+    rmdir(dir_.c_str());
+  }
+
+  int open_path()
+  {
+    return open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  }
+
+  std::string dir_;
+  std::string path_;
+};
+
+TEST_F(OutputWriterRotation, size)
+{
+  // Left alone
+  {
+    std::ofstream(path_ + ".1") << "earlier run\n";
+  }
+
+  std::string expected;
+  {
+    OutputRotation rotation;
+    rotation.path = path_;
+    rotation.size = 100;
+    OutputWriter writer(open_path(), 4096, false, Compression::none, rotation);
+    std::ostream os(&writer);
+    for (int i = 0; i < 100; i++)
+    {
+      os << "line " << i << std::endl;
+      expected += "line " + std::to_string(i) + "\n";
+    }
+  }
+
+  EXPECT_EQ(read_file(path_ + ".1"), "earlier run\n");
+  std::string out;
+  int files = 0;
+  for (int i = 2;; i++)
+  {
+    struct stat st;
+    std::string rotated = path_ + "." + std::to_string(i);
+    if (stat(rotated.c_str(), &st) != 0)
+      break;
+    auto content = read_file(rotated);
+    // Rotated on whole lines, once past the size
+    EXPECT_GE(content.size(), 100U);
+    EXPECT_EQ(content.back(), '\n');
+    out += content;
+    files++;
+  }
+  out += read_file(path_);
+  EXPECT_GE(files, 1);
+  EXPECT_EQ(out, expected);
+}
+
+TEST_F(OutputWriterRotation, requested)
+{
+  // Waits for the writer to have written size bytes to the file at path
+  auto written = [](const std::string &path, off_t size) {
+    struct stat st;
+    while (stat(path.c_str(), &st) != 0 || st.st_size < size)
+      std::this_thread::yield();
+  };
+
+  {
+    OutputRotation rotation;
+    rotation.path = path_;
+    OutputWriter writer(open_path(), 4096, false, Compression::none, rotation);
+    std::ostream os(&writer);
+
+    os << "a" << std::endl;
+    written(path_, 2);
+    OutputWriter::request_rotation();
+    os << "b" << std::endl;
+    // The file rotated away is of the same size
+    written(path_ + ".1", 2);
+    written(path_, 2);
+
+    // Moved away, only reopened
+    ASSERT_EQ(std::rename(path_.c_str(), (dir_ + "/moved").c_str()), 0);
+    OutputWriter::request_rotation();
+    os << "c" << std::endl;
+    written(path_, 2);
+  }
+
+  EXPECT_EQ(read_file(path_ + ".1"), "a\n");
+  EXPECT_EQ(read_file(dir_ + "/moved"), "b\n");
+  EXPECT_EQ(read_file(path_), "c\n");
+  struct stat st;
+  EXPECT_NE(stat((path_ + ".2").c_str(), &st), 0);
+}
+
+TEST(OutputSocket, parse)
+{
+  OutputSocket socket;
+  EXPECT_TRUE(socket.parse("unix:/run/trace.sock"));
+  EXPECT_EQ(socket.path, "/run/trace.sock");
+  socket = {};
+  EXPECT_TRUE(socket.parse("collector:9000"));
+  EXPECT_EQ(socket.host, "collector");
+  EXPECT_EQ(socket.port, "9000");
+  socket = {};
+  EXPECT_TRUE(socket.parse("[::1]:9000"));
+  EXPECT_EQ(socket.host, "::1");
+
+  for (auto address : { "", "unix:", "collector", ":9000", "collector:",
+                        "collector:http" })
+  {
+    socket = {};
+    EXPECT_FALSE(socket.parse(address)) << address;
+  }
+}
+
+// Accepts a connection on the unix socket at path and reads it until EOF
+static std::thread socket_reader(const std::string &path,
+                                 std::string &out,
+                                 std::chrono::milliseconds delay)
+{
+  return std::thread([path, &out, delay]() {
+    std::this_thread::sleep_for(delay);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(bind(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                   sizeof(addr)),
+              0);
+    ASSERT_EQ(listen(fd, 1), 0);
+    int conn = accept(fd, nullptr, nullptr);
+    close(fd);
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(conn, buf, sizeof(buf))) > 0)
+      out.append(buf, n);
+    close(conn);
+  });
+}
+
+// The payloads of the records
+static std::vector<std::string> records(const std::string &out)
+{
+  std::vector<std::string> payloads;
+  size_t pos = 0;
+  while (pos + sizeof(uint32_t) <= out.size())
+  {
+    uint32_t size;
+    memcpy(&size, out.data() + pos, sizeof(size));
+    size = ntohl(size);
+    pos += sizeof(size);
+    payloads.push_back(out.substr(pos, size));
+    pos += size;
+  }
+  EXPECT_EQ(pos, out.size());
+  return payloads;
+}
+
+TEST_F(OutputWriterRotation, socket)
+{
+  std::string out;
+  // Connected to on the second try
+  auto thread = socket_reader(path_, out, std::chrono::milliseconds(200));
+  OutputSocket socket;
+  ASSERT_TRUE(socket.parse("unix:" + path_));
+  {
+    OutputWriter writer(-1, 4096, false, Compression::none, {}, socket);
+    std::ostream os(&writer);
+    for (int i = 0; i < 100; i++)
+    {
+      os << "event " << i << "\n" << std::flush;
+      // Queued until then
+      if (i == 50)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    }
+    // Not flushed, sent when the writer goes away
+    os << "last";
+  }
+  thread.join();
+
+  auto payloads = records(out);
+  ASSERT_EQ(payloads.size(), 101U);
+  for (int i = 0; i < 100; i++)
+    EXPECT_EQ(payloads[i], "event " + std::to_string(i) + "\n");
+  EXPECT_EQ(payloads[100], "last");
+}
+
+TEST(OutputWriter, supports)
+{
+  EXPECT_TRUE(OutputWriter::supports(Compression::none));
+#ifdef HAVE_LIBZSTD
+  EXPECT_TRUE(OutputWriter::supports(Compression::zstd));
+#else
+  EXPECT_FALSE(OutputWriter::supports(Compression::zstd));
+#endif
+}
+
+TEST(CountingBuf, bytes)
+{
+  std::stringstream dest;
+  std::string big(100000, 'x');
+  {
+    CountingBuf counter(dest.rdbuf());
+    std::ostream os(&counter);
+    os << "abc" << 42;
+    EXPECT_EQ(counter.bytes(), 5U);
+    // Only passed on when flushed
+    EXPECT_EQ(dest.str(), "");
+    os << std::endl;
+    EXPECT_EQ(dest.str(), "abc42\n");
+
+    os << big;
+    EXPECT_EQ(counter.bytes(), 6U + big.size());
+    os << 'y';
+  }
+  EXPECT_EQ(dest.str(), "abc42\n" + big + "y");
+}
+
+} // namespace output_writer
+} // namespace test
+} // namespace bpftrace
@@ -4,6 +4,7 @@
 #include "gtest/gtest.h"
 #include "driver.h"
 #include "printer.h"
+#include "visitors.h"
 
 namespace bpftrace {
 namespace test {
@@ -1074,6 +1075,21 @@ TEST(Parser, tracepoint_probe)
   test_parse_failure("tracepoint { 1 }");
 }
 
+TEST(Parser, rawtracepoint_probe)
+{
+  test("rawtracepoint:sched:sched_switch { 1 }",
+       "Program\n"
+       " rawtracepoint:sched:sched_switch\n"
+       "  int: 1\n");
+  test("rt:sched:sched_switch { 1 }",
+       "Program\n"
+       " rawtracepoint:sched:sched_switch\n"
+       "  int: 1\n");
+
+  test_parse_failure("rawtracepoint:f { 1 }");
+  test_parse_failure("rawtracepoint { 1 }");
+}
+
 TEST(Parser, profile_probe)
 {
   test("profile:ms:997 { 1 }",
@@ -1085,6 +1101,21 @@ TEST(Parser, profile_probe)
   test_parse_failure("profile:f { 1 }");
   test_parse_failure("profile { 1 }");
   test_parse_failure("profile:s:1b { 1 }");
+
+  test("profile:hz:99:0-7 { 1 }",
+       "Program\n"
+       " profile:hz:99:0-7\n"
+       "  int: 1\n");
+  test("profile:hz:99:\"0-3,8\" { 1 }",
+       "Program\n"
+       " profile:hz:99:0-3,8\n"
+       "  int: 1\n");
+  test("profile:hz:99:/sys/fs/cgroup/a.service { 1 }",
+       "Program\n"
+       " profile:hz:99:/sys/fs/cgroup/a.service\n"
+       "  int: 1\n");
+  test_parse_failure("profile:hz:99:3-1 { 1 }");
+  test_parse_failure("profile:hz:99:\"\" { 1 }");
 }
 
 TEST(Parser, interval_probe)
@@ -1115,6 +1146,15 @@ TEST(Parser, hardware_probe)
       "  int: 1\n");
 
   test_parse_failure("hardware:cache-references:1b { 1 }");
+
+  test("hardware:cycles+cache-misses:1000000 { 1 }",
+       "Program\n"
+       " hardware:cycles+cache-misses:1000000\n"
+       "  int: 1\n");
+  test("hardware:cycles::0-3 { 1 }",
+       "Program\n"
+       " hardware:cycles::0-3\n"
+       "  int: 1\n");
 }
 
 TEST(Parser, watchpoint_probe)
@@ -1649,6 +1689,20 @@ TEST(Parser, uprobe_offset)
        " uprobe:./test:fn.abc+16\n");
 }
 
+TEST(Parser, kfunc_module)
+{
+  test("kfunc:nvme:nvme_setup_cmd { 1 }",
+       "Program\n"
+       " kfunc:nvme:nvme_setup_cmd\n"
+       "  int: 1\n");
+  test("kretfunc:nvme:nvme_* { 1 }",
+       "Program\n"
+       " kretfunc:nvme:nvme_*\n"
+       "  int: 1\n");
+  test_parse_failure("kfunc:nvme*:nvme_setup_cmd { 1 }");
+  test_parse_failure("kfunc::nvme_setup_cmd { 1 }");
+}
+
 TEST(Parser, uretprobe_offset)
 {
   // Not supported yet
@@ -1718,6 +1772,22 @@ TEST(Parser, while_loop)
 )PROG");
 }
 
+TEST(Parser, for_loop)
+{
+  test("END { for ($kv : @x) { @s = 1; } }",
+       "Program\n"
+       " END\n"
+       "  for\n"
+       "   variable: $kv\n"
+       "   map: @x\n"
+       "   block\n"
+       "    =\n"
+       "     map: @s\n"
+       "     int: 1\n");
+  test_parse_failure("END { for ($kv : @x[1]) { } }");
+  test_parse_failure("END { for (@kv : @x) { } }");
+}
+
 TEST(Parser, tuple_assignment_error_message)
 {
   BPFtrace bpftrace;
@@ -1742,6 +1812,28 @@ TEST(Parser, tuple_assignment_error)
   test_parse_failure("i:s:1 { 0.1 = 1.0 }");
 }
 
+TEST(Parser, map_declaration)
+{
+  test("@x = hash(100); kprobe:f { @x = 1; }",
+       "Program\n"
+       " @x = hash(100)\n"
+       " kprobe:f\n"
+       "  =\n"
+       "   map: @x\n"
+       "   int: 1\n");
+  test("@x = hash(100); @y = hash(0x10); kprobe:f { 1; }",
+       "Program\n"
+       " @x = hash(100)\n"
+       " @y = hash(16)\n"
+       " kprobe:f\n"
+       "  int: 1\n");
+
+  test_parse_failure("@x = hash(); kprobe:f { 1; }");
+  test_parse_failure("@x = hash(100) kprobe:f { 1; }");
+  test_parse_failure("@x[1] = hash(100); kprobe:f { 1; }");
+  test_parse_failure("kprobe:f { 1; } @x = hash(100);");
+}
+
 TEST(Parser, abs_knl_address)
 {
   char in_cstr[64];
@@ -1757,6 +1849,39 @@ TEST(Parser, abs_knl_address)
   test(std::string(in_cstr), std::string(out_cstr));
 }
 
+TEST(Parser, large_program)
+{
+  // Generated programs have thousands of probes, the AST of the last parse
+  // is kept by whoever takes it from the driver
+  std::string prog;
+  for (int i = 0; i < 2000; i++)
+    prog += "kprobe:f" + std::to_string(i) + " { if (arg0 == " +
+            std::to_string(i) + ") { @x = count(); } }\n";
+
+  BPFtrace bpftrace;
+  std::unique_ptr<ast::Node> root;
+  {
+    Driver driver(bpftrace);
+    ASSERT_EQ(driver.parse_str(prog), 0);
+    ASSERT_EQ(driver.parse(), 0);
+    root.reset(driver.root_);
+    driver.root_ = nullptr;
+  }
+
+  class ProbeCounter : public ast::Visitor
+  {
+  public:
+    void visit(ast::Probe &probe) override
+    {
+      count++;
+      ast::Visitor::visit(probe);
+    }
+    size_t count = 0;
+  } counter;
+  counter.Visit(*root);
+  EXPECT_EQ(counter.count, 2000U);
+}
+
 } // namespace parser
 } // namespace test
 } // namespace bpftrace
@@ -0,0 +1,86 @@
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+
+#include "perf_map.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace perf_map {
+
+TEST(PerfMap, parse)
+{
+  PerfMap perf_map("/does/not/exist");
+  std::string input = "1000 100 jitted\n"
+                      "0x2000 0x10 with spaces (in) it\n"
+                      "3000 0 empty\n"
+                      "zz 10 bad\n"
+                      "4000 10\n"
+                      "5000 10 partial";
+  perf_map.parse(input.data(), input.size());
+  EXPECT_EQ(perf_map.size(), 2U);
+
+  std::string name;
+  uint64_t offset;
+  EXPECT_TRUE(perf_map.lookup(0x10ff, name, offset));
+  EXPECT_EQ(name, "jitted");
+  EXPECT_EQ(offset, 0xffU);
+  EXPECT_FALSE(perf_map.lookup(0x1100, name, offset));
+  EXPECT_TRUE(perf_map.lookup(0x2008, name, offset));
+  EXPECT_EQ(name, "with spaces (in) it");
+  EXPECT_FALSE(perf_map.lookup(0xfff, name, offset));
+  EXPECT_FALSE(perf_map.lookup(0x5000, name, offset));
+
+  // The rest of the partial line, and code memory being reused
+  std::string more = "_line\n1000 10 reused\n";
+  perf_map.parse(more.data(), more.size());
+  EXPECT_TRUE(perf_map.lookup(0x5000, name, offset));
+  EXPECT_EQ(name, "partial_line");
+  EXPECT_TRUE(perf_map.lookup(0x1008, name, offset));
+  EXPECT_EQ(name, "reused");
+  EXPECT_FALSE(perf_map.lookup(0x1010, name, offset));
+}
+
+TEST(PerfMap, tail)
+{
+  char path[] = "/tmp/bpftrace-test-perf-map-XXXXXX";
+  int fd = ::mkstemp(path);
+  if (fd < 0)
+  {
+    throw std::runtime_error("creating temporary file for tests failed");
+  }
+  ::close(fd);
+
+  PerfMap perf_map(path);
+  std::string name;
+  uint64_t offset;
+  EXPECT_FALSE(perf_map.lookup(0x1000, name, offset));
+
+  std::ofstream(path, std::ios::app) << "1000 10 first\n2000 10 sec";
+  EXPECT_TRUE(perf_map.lookup(0x1000, name, offset));
+  EXPECT_EQ(name, "first");
+  EXPECT_FALSE(perf_map.lookup(0x2000, name, offset));
+
+  // Only what was appended is read
+  std::ofstream(path, std::ios::app) << "ond\n";
+  EXPECT_TRUE(perf_map.lookup(0x2000, name, offset));
+  EXPECT_EQ(name, "second");
+  EXPECT_EQ(perf_map.size(), 2U);
+
+  // Truncated, read again from the start
+  std::ofstream(path, std::ios::trunc) << "3000 10 third\n";
+  perf_map.update();
+  EXPECT_EQ(perf_map.size(), 1U);
+  EXPECT_TRUE(perf_map.lookup(0x3000, name, offset));
+  EXPECT_EQ(name, "third");
+
+  // The symbols of a process that's gone are kept
+  ::unlink(path);
+  perf_map.update();
+  EXPECT_EQ(perf_map.size(), 1U);
+}
+
+} // namespace perf_map
+} // namespace test
+} // namespace bpftrace
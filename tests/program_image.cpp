@@ -0,0 +1,523 @@
+#include <cstring>
+#include <elf.h>
+
+#include "bpforc.h"
+#include "fake_map.h"
+#include "mocks.h"
+#include "program_image.h"
+#include "struct.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace program_image {
+
+const std::string SECTION = "s_kprobe:f_1";
+
+// r1 = map fd, r0 = 0, exit
+std::vector<uint8_t> map_fd_code(int fd)
+{
+  std::vector<uint8_t> code = {
+    0x18, 0x11, 0, 0, 0, 0, 0, 0, // ld_imm64 r1, BPF_PSEUDO_MAP_FD
+    0,    0,    0, 0, 0, 0, 0, 0, //
+    0xb7, 0,    0, 0, 0, 0, 0, 0, // mov r0, 0
+    0x95, 0,    0, 0, 0, 0, 0, 0, // exit
+  };
+  int32_t imm = fd;
+  memcpy(code.data() + 4, &imm, sizeof(imm));
+  return code;
+}
+
+int code_map_fd(BpfOrc &bpforc)
+{
+  auto section = bpforc.getSection(SECTION);
+  EXPECT_TRUE(section);
+  if (!section || std::get<1>(*section) < 8)
+    return -1;
+  int32_t imm;
+  memcpy(&imm, std::get<0>(*section) + 4, sizeof(imm));
+  return imm;
+}
+
+std::string save_program(BPFtrace &bpftrace)
+{
+  Probe probe;
+  probe.type = ProbeType::kprobe;
+  probe.attach_point = "f";
+  probe.name = probe.orig_name = "kprobe:f";
+  probe.index = 1;
+  bpftrace.probes_.push_back(probe);
+
+  bpftrace.printf_args_.emplace_back(
+      "%d %s\n",
+      std::vector<Field>{ Field{ CreateInt64(), 0, false, {}, false },
+                          Field{ CreateString(64), 8, false, {}, false } });
+  bpftrace.time_args_.push_back("%H:%M:%S\n");
+  bpftrace.probe_ids_.push_back("kprobe:f");
+  bpftrace.non_map_print_args_.push_back(
+      CreateTuple({ CreateInt32(), CreateString(16) }));
+  bpftrace.structs_["struct foo"] = Struct{
+    8, { { "a", Field{ CreateUInt32(), 4, false, {}, false } } }
+  };
+
+  MapKey key;
+  key.args_ = { CreateInt64() };
+  auto map = std::make_unique<FakeMap>("@x", CreateCount(true), key, 100);
+  map->type_ = CreateCount(true);
+  map->key_ = key;
+  int mapfd = map->mapfd_;
+  bpftrace.maps.Add(std::move(map));
+  bpftrace.maps.Set(StackType(),
+                    std::make_unique<FakeMap>(CreateStack(true), 1024));
+  bpftrace.maps.Set(MapManager::Type::PerfEvent,
+                    std::make_unique<FakeMap>(BPF_MAP_TYPE_PERF_EVENT_ARRAY));
+
+  auto bpforc = BpfOrc::Create();
+  bpforc->addSection(SECTION, map_fd_code(mapfd));
+  bpforc->addSection("license", { 'G', 'P', 'L', 0 });
+  return ProgramImage::save(bpftrace, bpforc->getSections());
+}
+
+TEST(ProgramImage, kprobe_multi)
+{
+  auto saved = get_mock_bpftrace();
+  Probe probe;
+  probe.type = ProbeType::kprobe;
+  probe.attach_point = "f*";
+  probe.name = probe.orig_name = "kprobe:f*";
+  probe.funcs = { "f1", "f2" };
+  probe.cookies = { 1, 2 };
+  probe.btf_id = 1234;
+  saved->probes_.push_back(probe);
+  std::string image = save_program(*saved);
+
+  auto bpftrace = get_mock_bpftrace();
+  ASSERT_TRUE(ProgramImage::load(*bpftrace, image, true));
+
+  ASSERT_EQ(bpftrace->probes_.size(), 2U);
+  EXPECT_EQ(bpftrace->probes_[0].funcs, probe.funcs);
+  EXPECT_EQ(bpftrace->probes_[0].cookies, probe.cookies);
+  EXPECT_EQ(bpftrace->probes_[0].btf_id, probe.btf_id);
+  EXPECT_TRUE(bpftrace->probes_[1].funcs.empty());
+}
+
+TEST(ProgramImage, round_trip)
+{
+  auto saved = get_mock_bpftrace();
+  std::string image = save_program(*saved);
+
+  auto bpftrace = get_mock_bpftrace();
+  auto bpforc = ProgramImage::load(*bpftrace, image, true);
+  ASSERT_TRUE(bpforc);
+
+  ASSERT_EQ(bpftrace->probes_.size(), 1U);
+  EXPECT_EQ(bpftrace->probes_[0].type, ProbeType::kprobe);
+  EXPECT_EQ(bpftrace->probes_[0].name, "kprobe:f");
+  EXPECT_EQ(bpftrace->probes_[0].index, 1);
+
+  ASSERT_EQ(bpftrace->printf_args_.size(), 1U);
+  EXPECT_EQ(std::get<0>(bpftrace->printf_args_[0]), "%d %s\n");
+  auto &fields = std::get<1>(bpftrace->printf_args_[0]);
+  ASSERT_EQ(fields.size(), 2U);
+  EXPECT_EQ(fields[0].type, CreateInt64());
+  EXPECT_EQ(fields[1].type, CreateString(64));
+  EXPECT_EQ(fields[1].offset, 8);
+  EXPECT_EQ(bpftrace->time_args_, saved->time_args_);
+  EXPECT_EQ(bpftrace->probe_ids_, saved->probe_ids_);
+
+  ASSERT_EQ(bpftrace->non_map_print_args_.size(), 1U);
+  auto &tuple = bpftrace->non_map_print_args_[0];
+  EXPECT_EQ(tuple, saved->non_map_print_args_[0]);
+  ASSERT_EQ(tuple.GetFieldCount(), 2);
+  EXPECT_EQ(tuple.GetField(1).offset,
+            saved->non_map_print_args_[0].GetField(1).offset);
+
+  ASSERT_EQ(bpftrace->structs_.count("struct foo"), 1U);
+  EXPECT_EQ(bpftrace->structs_["struct foo"].size, 8);
+  EXPECT_EQ(bpftrace->structs_["struct foo"].fields["a"].offset, 4);
+  EXPECT_EQ(bpftrace->structs_["struct foo"].fields["a"].type, CreateUInt32());
+
+  // The maps are created again, and the code uses them
+  auto map = bpftrace->maps["@x"];
+  ASSERT_TRUE(map);
+  EXPECT_EQ((*map)->id, 0U);
+  EXPECT_EQ((*map)->max_entries_, 100U);
+  EXPECT_NE((*map)->mapfd_, (*saved->maps["@x"])->mapfd_);
+  EXPECT_EQ(code_map_fd(*bpforc), (*map)->mapfd_);
+  EXPECT_TRUE(bpftrace->maps.Has(StackType()));
+  EXPECT_EQ((*bpftrace->maps[StackType()])->max_entries_, 1024U);
+  EXPECT_TRUE(bpftrace->maps.Has(MapManager::Type::PerfEvent));
+  EXPECT_FALSE(bpftrace->maps.Has(MapManager::Type::Ringbuf));
+
+  auto license = bpforc->getSection("license");
+  ASSERT_TRUE(license);
+  EXPECT_EQ(std::string(reinterpret_cast<char *>(std::get<0>(*license)),
+                        std::get<1>(*license)),
+            std::string("GPL\0", 4));
+}
+
+TEST(ProgramImage, settings)
+{
+  auto saved = get_mock_bpftrace();
+  saved->flight_recorder_secs_ = 5;
+  saved->map_alloc_ = MapAlloc::no_prealloc;
+  std::string image = save_program(*saved);
+
+  auto bpftrace = get_mock_bpftrace();
+  ASSERT_TRUE(ProgramImage::load(*bpftrace, image, true));
+  EXPECT_EQ(bpftrace->flight_recorder_secs_, 5U);
+  EXPECT_EQ(bpftrace->map_alloc_, MapAlloc::no_prealloc);
+}
+
+TEST(ProgramCache, key)
+{
+  auto bpftrace = get_mock_bpftrace();
+  std::string key = ProgramCache::key(*bpftrace, "k:f {}", {}, {});
+  EXPECT_EQ(ProgramCache::key(*bpftrace, "k:f {}", {}, {}), key);
+  EXPECT_NE(ProgramCache::key(*bpftrace, "k:g {}", {}, {}), key);
+
+  bpftrace->helper_error_events_ = true;
+  std::string helper_error_events = ProgramCache::key(
+      *bpftrace, "k:f {}", {}, {});
+  EXPECT_NE(helper_error_events, key);
+  bpftrace->event_batch_ = 64;
+  std::string event_batch = ProgramCache::key(*bpftrace, "k:f {}", {}, {});
+  EXPECT_NE(event_batch, helper_error_events);
+  bpftrace->event_batch_ = 128;
+  EXPECT_NE(ProgramCache::key(*bpftrace, "k:f {}", {}, {}), event_batch);
+  event_batch = ProgramCache::key(*bpftrace, "k:f {}", {}, {});
+  bpftrace->adaptive_sampling_ = true;
+  EXPECT_NE(ProgramCache::key(*bpftrace, "k:f {}", {}, {}), event_batch);
+}
+
+TEST(ProgramImage, corrupt)
+{
+  auto saved = get_mock_bpftrace();
+  std::string image = save_program(*saved);
+
+  auto bpftrace = get_mock_bpftrace();
+  EXPECT_THROW(ProgramImage::load(*bpftrace, "", true), std::runtime_error);
+  EXPECT_THROW(
+      ProgramImage::load(*bpftrace, image.substr(0, image.size() - 1), true),
+      std::runtime_error);
+  EXPECT_THROW(ProgramImage::load(*bpftrace, image + "x", true),
+               std::runtime_error);
+
+  // Nothing was restored from them
+  EXPECT_TRUE(bpftrace->probes_.empty());
+  EXPECT_FALSE(bpftrace->maps.Has("@x"));
+}
+
+TEST(ProgramImage, field_relocs)
+{
+  auto saved = get_mock_bpftrace();
+  save_program(*saved);
+  // struct foo isn't a kernel struct, the field keeps its offset
+  saved->field_relocs_.push_back(FieldReloc{ "struct foo", "a", 4, 4 });
+  auto code = map_fd_code((*saved->maps["@x"])->mapfd_);
+  std::vector<uint8_t> offset_code = {
+    0x18, 0xf2, 0, 0, 0, 0, 0, 0, // ld_imm64 r2, BPF_PSEUDO_FIELD_OFFSET
+    0,    0,    0, 0, 0, 0, 0, 0, //
+  };
+  code.insert(code.begin() + 16, offset_code.begin(), offset_code.end());
+  auto bpforc = BpfOrc::Create();
+  bpforc->addSection(SECTION, code);
+  auto image = ProgramImage::save(*saved, bpforc->getSections());
+
+  auto bpftrace = get_mock_bpftrace();
+  bpforc = ProgramImage::load(*bpftrace, image, true);
+  ASSERT_TRUE(bpforc);
+  ASSERT_EQ(bpftrace->field_relocs_.size(), 1U);
+  EXPECT_EQ(bpftrace->field_relocs_[0].field, "a");
+
+  auto section = bpforc->getSection(SECTION);
+  ASSERT_TRUE(section);
+  auto insn = std::get<0>(*section) + 16;
+  EXPECT_EQ(insn[1], 0x02);
+  int32_t imm;
+  memcpy(&imm, insn + 4, sizeof(imm));
+  EXPECT_EQ(imm, 4);
+  EXPECT_EQ(code_map_fd(*bpforc), (*bpftrace->maps["@x"])->mapfd_);
+
+  // A field the image has no FieldReloc of
+  code[16 + 4] = 1;
+  bpforc = BpfOrc::Create();
+  bpforc->addSection(SECTION, code);
+  image = ProgramImage::save(*saved, bpforc->getSections());
+  auto other = get_mock_bpftrace();
+  EXPECT_THROW(ProgramImage::load(*other, image, true), std::runtime_error);
+}
+
+TEST(ProgramImage, definitions)
+{
+  auto saved = get_mock_bpftrace();
+  saved->structs_["struct foo"] = Struct{
+    8, { { "a", Field{ CreateUInt32(), 4, false, {}, false } } }
+  };
+  saved->macros_["FOO"] = "1";
+  saved->enums_["BAR"] = 2;
+  saved->btf_set_ = { "struct foo", "struct bar" };
+  std::string image = ProgramImage::save_definitions(*saved);
+
+  // The order the set was filled in doesn't matter
+  auto reordered = get_mock_bpftrace();
+  reordered->structs_ = saved->structs_;
+  reordered->macros_ = saved->macros_;
+  reordered->enums_ = saved->enums_;
+  reordered->btf_set_.insert("struct bar");
+  reordered->btf_set_.insert("struct foo");
+  EXPECT_EQ(ProgramImage::save_definitions(*reordered), image);
+
+  auto bpftrace = get_mock_bpftrace();
+  EXPECT_THROW(ProgramImage::load_definitions(
+                   *bpftrace, image.substr(0, image.size() - 1)),
+               std::runtime_error);
+  EXPECT_THROW(ProgramImage::load_definitions(*bpftrace, image + "x"),
+               std::runtime_error);
+  EXPECT_TRUE(bpftrace->macros_.empty());
+
+  ProgramImage::load_definitions(*bpftrace, image);
+  ASSERT_EQ(bpftrace->structs_.count("struct foo"), 1U);
+  EXPECT_EQ(bpftrace->structs_["struct foo"].size, 8);
+  EXPECT_EQ(bpftrace->structs_["struct foo"].fields["a"].offset, 4);
+  EXPECT_EQ(bpftrace->macros_, saved->macros_);
+  EXPECT_EQ(bpftrace->enums_, saved->enums_);
+  EXPECT_EQ(bpftrace->btf_set_, saved->btf_set_);
+}
+
+// Relocatable BPF ELF file with the given sections, like --emit-elf writes
+std::string make_elf(
+    const std::vector<std::pair<std::string, std::string>> &sections)
+{
+  std::string shstrtab(1, '\0');
+  std::string contents;
+  std::vector<Elf64_Shdr> shdrs(1, Elf64_Shdr{});
+  auto add_section = [&](const std::string &name,
+                         uint32_t type,
+                         const std::string &data) {
+    Elf64_Shdr shdr = {};
+    shdr.sh_name = shstrtab.size();
+    shdr.sh_type = type;
+    shdr.sh_offset = sizeof(Elf64_Ehdr) + contents.size();
+    shdr.sh_size = data.size();
+    shstrtab += name + '\0';
+    contents += data;
+    shdrs.push_back(shdr);
+  };
+  for (auto &[name, data] : sections)
+    add_section(name, SHT_PROGBITS, data);
+  add_section(".shstrtab", SHT_STRTAB, "");
+  // Its own name is in it already
+  shdrs.back().sh_offset = sizeof(Elf64_Ehdr) + contents.size();
+  shdrs.back().sh_size = shstrtab.size();
+  contents += shstrtab;
+
+  Elf64_Ehdr ehdr = {};
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = EM_BPF;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = shdrs.size();
+  ehdr.e_shstrndx = shdrs.size() - 1;
+  ehdr.e_shoff = sizeof(Elf64_Ehdr) + contents.size();
+
+  std::string elf(reinterpret_cast<char *>(&ehdr), sizeof(ehdr));
+  elf += contents;
+  elf.append(reinterpret_cast<char *>(shdrs.data()),
+             shdrs.size() * sizeof(Elf64_Shdr));
+  return elf;
+}
+
+TEST(ProgramImage, load_elf)
+{
+  auto saved = get_mock_bpftrace();
+  save_program(*saved);
+  int mapfd = (*saved->maps["@x"])->mapfd_;
+  std::string image = ProgramImage::save(*saved, {});
+  auto code = map_fd_code(mapfd);
+
+  std::string elf = make_elf({
+      { ".text", "" },
+      { SECTION, std::string(code.begin(), code.end()) },
+      { PROGRAM_IMAGE_SECTION, image },
+  });
+  EXPECT_TRUE(ProgramImage::is_elf(elf));
+  EXPECT_FALSE(ProgramImage::is_elf(image));
+
+  auto bpftrace = get_mock_bpftrace();
+  EXPECT_THROW(ProgramImage::load_elf(*bpftrace, image, true),
+               std::runtime_error);
+  EXPECT_THROW(ProgramImage::load_elf(*bpftrace, elf.substr(0, 100), true),
+               std::runtime_error);
+  EXPECT_THROW(ProgramImage::load_elf(
+                   *bpftrace, make_elf({ { SECTION, "" } }), true),
+               std::runtime_error);
+  EXPECT_TRUE(bpftrace->probes_.empty());
+
+  auto bpforc = ProgramImage::load_elf(*bpftrace, elf, true);
+  ASSERT_TRUE(bpforc);
+  ASSERT_EQ(bpftrace->probes_.size(), 1U);
+  EXPECT_EQ(bpftrace->probes_[0].name, "kprobe:f");
+  auto map = bpftrace->maps["@x"];
+  ASSERT_TRUE(map);
+  EXPECT_EQ(code_map_fd(*bpforc), (*map)->mapfd_);
+  EXPECT_FALSE(bpforc->getSection(".text"));
+}
+
+TEST(ProgramImage, load_elf_overflowing_offsets)
+{
+  std::string elf = make_elf({ { SECTION, "code" } });
+  auto bpftrace = get_mock_bpftrace();
+
+  // The section headers past the end, their offset and size adding up to
+  // less than the size of the file
+  std::string bad_shoff = elf;
+  auto ehdr = reinterpret_cast<Elf64_Ehdr *>(bad_shoff.data());
+  ehdr->e_shoff = UINT64_MAX - sizeof(Elf64_Shdr) + 1;
+  EXPECT_THROW(ProgramImage::load_elf(*bpftrace, bad_shoff, true),
+               std::runtime_error);
+
+  // Likewise for a section
+  std::string bad_offset = elf;
+  ehdr = reinterpret_cast<Elf64_Ehdr *>(bad_offset.data());
+  auto shdrs = reinterpret_cast<Elf64_Shdr *>(bad_offset.data() +
+                                              ehdr->e_shoff);
+  shdrs[1].sh_offset = UINT64_MAX;
+  shdrs[1].sh_size = 2;
+  EXPECT_THROW(ProgramImage::load_elf(*bpftrace, bad_offset, true),
+               std::runtime_error);
+
+  // A string table without contents
+  std::string nobits = elf;
+  ehdr = reinterpret_cast<Elf64_Ehdr *>(nobits.data());
+  shdrs = reinterpret_cast<Elf64_Shdr *>(nobits.data() + ehdr->e_shoff);
+  shdrs[ehdr->e_shstrndx].sh_type = SHT_NOBITS;
+  EXPECT_THROW(ProgramImage::load_elf(*bpftrace, nobits, true),
+               std::runtime_error);
+  EXPECT_TRUE(bpftrace->probes_.empty());
+}
+
+// A hist() key: the int64 key followed by the bucket index
+static std::vector<uint8_t> hist_key(int64_t key, uint64_t bucket)
+{
+  std::vector<uint8_t> data(16);
+  memcpy(data.data(), &key, sizeof(key));
+  memcpy(data.data() + 8, &bucket, sizeof(bucket));
+  return data;
+}
+
+static std::vector<uint8_t> value(uint64_t n)
+{
+  std::vector<uint8_t> data(8);
+  memcpy(data.data(), &n, sizeof(n));
+  return data;
+}
+
+// Snapshot of a host having seen the given hist() buckets of key 7 and
+// min() value (stored inverted, see BPFtrace::min_value())
+static std::string host_snapshot(std::map<uint64_t, uint64_t> buckets,
+                                 uint64_t min,
+                                 std::set<std::string> &saved)
+{
+  auto bpftrace = get_mock_bpftrace();
+  auto hist = std::make_unique<SnapshotMap>(
+      "@h", CreateHist(), MapKey{ { CreateInt64() } }, 0, 0, 0);
+  for (auto &[bucket, count] : buckets)
+    hist->entries_[hist_key(7, bucket)] = value(count);
+  bpftrace->maps.Add(std::move(hist));
+  auto m = std::make_unique<SnapshotMap>(
+      "@m", CreateMin(true), MapKey{}, 0, 0, 0);
+  m->entries_[{}] = value(0xffffffff - min);
+  bpftrace->maps.Add(std::move(m));
+  auto stacks = std::make_unique<SnapshotMap>(
+      "@k", CreateCount(true), MapKey{ { CreateStack(true) } }, 0, 0, 0);
+  bpftrace->maps.Add(std::move(stacks));
+  return ProgramImage::save_snapshot(*bpftrace, saved);
+}
+
+TEST(ProgramImage, snapshot_merge)
+{
+  std::set<std::string> saved;
+  auto a = host_snapshot({ { 3, 5 } }, 10, saved);
+  // Stacks are only meaningful on the host they were taken on
+  EXPECT_EQ(saved, (std::set<std::string>{ "@h", "@m" }));
+  auto b = host_snapshot({ { 3, 2 }, { 4, 1 } }, 4, saved);
+
+  auto bpftrace = get_mock_bpftrace();
+  ProgramImage::merge_snapshot(*bpftrace, a);
+  ProgramImage::merge_snapshot(*bpftrace, b);
+  EXPECT_FALSE(bpftrace->maps.Has("@k"));
+
+  auto hist = dynamic_cast<SnapshotMap *>(*bpftrace->maps.Lookup("@h"));
+  ASSERT_NE(hist, nullptr);
+  EXPECT_EQ(hist->entries_,
+            (std::map<std::vector<uint8_t>, std::vector<uint8_t>>{
+                { hist_key(7, 3), value(7) }, { hist_key(7, 4), value(1) } }));
+  auto m = dynamic_cast<SnapshotMap *>(*bpftrace->maps.Lookup("@m"));
+  ASSERT_NE(m, nullptr);
+  EXPECT_EQ(m->entries_.at({}), value(0xffffffff - 4));
+
+  // Another map of the same name doesn't merge, nothing is merged then
+  auto other = get_mock_bpftrace();
+  other->maps.Add(std::make_unique<SnapshotMap>(
+      "@m", CreateMax(true), MapKey{}, 0, 0, 0));
+  auto c = ProgramImage::save_snapshot(*other, saved);
+  EXPECT_THROW(ProgramImage::merge_snapshot(*bpftrace, c), std::runtime_error);
+  EXPECT_THROW(ProgramImage::merge_snapshot(*bpftrace, a.substr(0, 20)),
+               std::runtime_error);
+  EXPECT_EQ(hist->entries_.at(hist_key(7, 3)), value(7));
+}
+
+TEST(ProgramImage, map_layout)
+{
+  auto saved = get_mock_bpftrace();
+  saved->structs_["struct foo"] = Struct{
+    8, { { "a", Field{ CreateUInt32(), 4, false, {}, false } } }
+  };
+  auto lhist = std::make_unique<SnapshotMap>(
+      "@l", CreateLhist(), MapKey{ { CreateString(16) } }, 0, 100, 10);
+  lhist->map_type_ = BPF_MAP_TYPE_PERCPU_HASH;
+  lhist->max_entries_ = 4096;
+  saved->maps.Add(std::move(lhist));
+  auto count = std::make_unique<SnapshotMap>(
+      "@c", CreateCount(true), MapKey{}, 0, 0, 0);
+  count->map_type_ = BPF_MAP_TYPE_PERCPU_ARRAY;
+  count->max_entries_ = 1;
+  saved->maps.Add(std::move(count));
+  auto layout = ProgramImage::save_map_layout(*saved);
+
+  auto bpftrace = get_mock_bpftrace();
+  auto maps = ProgramImage::load_map_layout(*bpftrace, layout);
+  ASSERT_EQ(maps.size(), 2U);
+  EXPECT_EQ(bpftrace->structs_.at("struct foo").size, 8);
+  auto &l = *maps[0];
+  EXPECT_EQ(l.name_, "@l");
+  EXPECT_EQ(l.type_, CreateLhist());
+  EXPECT_EQ(l.key_.args_, std::vector<SizedType>{ CreateString(16) });
+  EXPECT_EQ(l.lqmin, 0);
+  EXPECT_EQ(l.lqmax, 100);
+  EXPECT_EQ(l.lqstep, 10);
+  EXPECT_EQ(l.map_type_, BPF_MAP_TYPE_PERCPU_HASH);
+  EXPECT_EQ(l.max_entries_, 4096U);
+  EXPECT_FALSE(l.mmapable_);
+  EXPECT_FALSE(l.double_buffered_);
+  EXPECT_FALSE(l.has_sketch_);
+  EXPECT_EQ(l.mapfd_, -1);
+  EXPECT_EQ(maps[1]->name_, "@c");
+  EXPECT_EQ(maps[1]->map_type_, BPF_MAP_TYPE_PERCPU_ARRAY);
+
+  EXPECT_THROW(ProgramImage::load_map_layout(
+                   *bpftrace, layout.substr(0, layout.size() - 1)),
+               std::runtime_error);
+  EXPECT_THROW(ProgramImage::load_map_layout(*bpftrace, "x"),
+               std::runtime_error);
+}
+
+} // namespace program_image
+} // namespace test
+} // namespace bpftrace
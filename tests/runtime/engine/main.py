@@ -3,12 +3,13 @@
 import time
 from datetime import timedelta
 import argparse
+import json
 
 from utils import Utils, ok, fail, warn
 from parser import TestParser, UnknownFieldError, RequiredFieldError
 
 
-def main(test_filter = None):
+def main(test_filter = None, timings_file = None):
     if not test_filter:
         test_filter = "*"
 
@@ -30,10 +31,20 @@ def main(test_filter = None):
 
     start_time = time.time()
     skipped_tests = []
+    timings = open(timings_file, 'w') if timings_file else None
     for fname, tests in test_suite:
         print(ok("[----------]") + " %d tests from %s" % (len(tests), fname))
         for test in tests:
-            status = Utils.run_test(test)
+            timing = {}
+            status = Utils.run_test(test, timing)
+            if timings and not Utils.skipped(status):
+                # One line per test, for tracking the times across runs
+                timings.write(json.dumps({
+                    "test": "%s.%s" % (fname, test.name),
+                    "passed": not Utils.failed(status),
+                    "wall_ms": timing['wall_ms'] and round(timing['wall_ms']),
+                    "attach_ms": timing['attach_ms'] and round(timing['attach_ms']),
+                }) + "\n")
             if Utils.skipped(status):
                 skipped_tests.append((fname, test, status))
             if Utils.failed(status):
@@ -41,6 +52,8 @@ def main(test_filter = None):
         # TODO(mmarchini) elapsed time per test suite and per test (like gtest)
         print(ok("[----------]") + " %d tests from %s\n" % (len(tests), fname))
     elapsed = time.time() - start_time
+    if timings:
+        timings.close()
     total_tests -= len(skipped_tests)
 
     # TODO(mmarchini) pretty print time
@@ -65,7 +78,10 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser(description='Runtime tests for bpftrace.')
     parser.add_argument('--filter', dest='tests_filter',
                         help='filter runtime tests')
+    parser.add_argument('--timings', dest='timings_file',
+                        help='write the wall and attach time of each test '
+                             'to this file, as JSON lines')
 
     args = parser.parse_args()
 
-    main(args.tests_filter)
+    main(args.tests_filter, args.timings_file)
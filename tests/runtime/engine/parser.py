@@ -14,7 +14,7 @@ class UnknownFieldError(Exception):
     pass
 
 
-TestStruct = namedtuple('TestStruct', 'name run expect timeout before after suite kernel requirement env arch, feature_requirement neg_feature_requirement')
+TestStruct = namedtuple('TestStruct', 'name run expect timeout before after suite kernel requirement env arch, feature_requirement neg_feature_requirement budget')
 
 
 class TestParser(object):
@@ -69,6 +69,8 @@ class TestParser(object):
         arch = []
         feature_requirement = set()
         neg_feature_requirement = set()
+        # Performance budget, see Utils.over_budget()
+        budget = {}
 
         for item in test:
             item_split = item.split()
@@ -98,7 +100,7 @@ class TestParser(object):
             elif item_name == 'ARCH':
                 arch = [x.strip() for x in line.split("|")]
             elif item_name == 'REQUIRES_FEATURE':
-                features = {"loop", "btf", "probe_read_kernel", "dpath", "uprobe_refcount", "signal",  "iter:task", "iter:task_file"}
+                features = {"loop", "btf", "probe_read_kernel", "dpath", "uprobe_refcount", "signal",  "iter:task", "iter:task_file", "ringbuf", "for_each_map_elem"}
 
                 for f in line.split(" "):
                     f = f.strip()
@@ -110,6 +112,8 @@ class TestParser(object):
                 unknown = (feature_requirement | neg_feature_requirement) - features
                 if len(unknown) > 0:
                     raise UnknownFieldError('%s is invalid for REQUIRES_FEATURE. Suite: %s' % (','.join(unknown), test_suite))
+            elif item_name in ['MAX_ATTACH_MS', 'MAX_WALL_MS', 'MAX_LOST_EVENTS']:
+                budget[item_name] = int(line.strip(' '))
             else:
                 raise UnknownFieldError('Field %s is unknown. Suite: %s' % (item_name, test_suite))
 
@@ -121,6 +125,9 @@ class TestParser(object):
             raise RequiredFieldError('Test EXPECT is required. Suite: ' + test_suite)
         elif timeout == '':
             raise RequiredFieldError('Test TIMEOUT is required. Suite: ' + test_suite)
+        elif 'MAX_ATTACH_MS' in budget and ' -v' not in run:
+            # The attach time is up to the "Running..." of -v
+            raise RequiredFieldError('Test MAX_ATTACH_MS requires RUN with -v. Suite: ' + test_suite)
 
         return TestStruct(
             name,
@@ -135,4 +142,5 @@ class TestParser(object):
             env,
             arch,
             feature_requirement,
-            neg_feature_requirement)
+            neg_feature_requirement,
+            budget)
@@ -13,6 +13,9 @@ BPF_PATH = environ["BPFTRACE_RUNTIME_TEST_EXECUTABLE"]
 ENV_PATH = environ["PATH"]
 ATTACH_TIMEOUT = 5
 DEFAULT_TIMEOUT = 5
+# Factor applied to the performance budgets of the tests, e.g. for slow
+# machines, 0 to not enforce them
+BUDGET_SCALE = float(environ.get("RUNTIME_TEST_BUDGET_SCALE", "1"))
 
 
 OK_COLOR = '\033[92m'
@@ -44,10 +47,11 @@ class Utils(object):
     SKIP_REQUIREMENT_UNSATISFIED = 4
     SKIP_ENVIRONMENT_DISABLED = 5
     SKIP_FEATURE_REQUIREMENT_UNSATISFIED = 6
+    OVER_BUDGET = 7
 
     @staticmethod
     def failed(status):
-        return status in [Utils.FAIL, Utils.TIMEOUT]
+        return status in [Utils.FAIL, Utils.TIMEOUT, Utils.OVER_BUDGET]
 
     @staticmethod
     def skipped(status):
@@ -73,6 +77,33 @@ class Utils(object):
         else:
             raise ValueError("Invalid skip reason: %d" % status)
 
+    @staticmethod
+    def over_budget(test, timing, output):
+        """What the test went over its performance budget with, if any:
+        the time until bpftrace was running (MAX_ATTACH_MS), the time the
+        whole run took (MAX_WALL_MS) or the events lost because they weren't
+        read in time (MAX_LOST_EVENTS)"""
+        if not BUDGET_SCALE:
+            return []
+        over = []
+        limit = test.budget.get('MAX_ATTACH_MS')
+        if limit is not None and timing.get('attach_ms') is not None and \
+           timing['attach_ms'] > limit * BUDGET_SCALE:
+            over.append("attach took %d ms, budget %d ms" %
+                        (timing['attach_ms'], limit * BUDGET_SCALE))
+        limit = test.budget.get('MAX_WALL_MS')
+        if limit is not None and timing.get('wall_ms') is not None and \
+           timing['wall_ms'] > limit * BUDGET_SCALE:
+            over.append("run took %d ms, budget %d ms" %
+                        (timing['wall_ms'], limit * BUDGET_SCALE))
+        limit = test.budget.get('MAX_LOST_EVENTS')
+        if limit is not None:
+            lost = sum(int(n) for n in
+                       re.findall(r"^Lost ([0-9]+) events$", output, re.M))
+            if lost > limit:
+                over.append("lost %d events, budget %d" % (lost, limit))
+        return over
+
     @staticmethod
     def prepare_bpf_call(test):
         return BPF_PATH + test.run
@@ -106,10 +137,18 @@ class Utils(object):
         bpffeature["signal"] = output.find("send_signal: yes") != -1
         bpffeature["iter:task"] = output.find("iter:task: yes") != -1
         bpffeature["iter:task_file"] = output.find("iter:task_file: yes") != -1
+        bpffeature["ringbuf"] = output.find("ringbuf (depends on Build:libbpf): yes") != -1
+        bpffeature["for_each_map_elem"] = output.find("for_each_map_elem: yes") != -1
         return bpffeature
 
     @staticmethod
-    def run_test(test):
+    def run_test(test, timing=None):
+        """Runs the test, and fills timing with the time the run took and
+        the time until bpftrace was running (with -v), in ms"""
+        if timing is None:
+            timing = {}
+        timing['wall_ms'] = None
+        timing['attach_ms'] = None
         current_kernel = LooseVersion(uname()[2])
         if test.kernel and LooseVersion(test.kernel) > current_kernel:
             print(warn("[   SKIP   ] ") + "%s.%s" % (test.suite, test.name))
@@ -176,6 +215,7 @@ class Utils(object):
                 bpf_call = re.sub("{{BEFORE_PID}}", str(childpid), bpf_call)
             env = {'test': test.name}
             env.update(test.env)
+            start_time = time.monotonic()
             p = subprocess.Popen(
                 bpf_call,
                 shell=True,
@@ -195,12 +235,14 @@ class Utils(object):
                 nextline = p.stdout.readline()
                 output += nextline
                 if nextline == "Running...\n":
+                    timing['attach_ms'] = (time.monotonic() - start_time) * 1000
                     signal.alarm(test.timeout or DEFAULT_TIMEOUT)
                     if not after and test.after:
                         after = subprocess.Popen(test.after, shell=True, preexec_fn=os.setsid)
                     break
 
             output += p.communicate()[0]
+            timing['wall_ms'] = (time.monotonic() - start_time) * 1000
 
             signal.alarm(0)
             result = re.search(test.expect, output, re.M)
@@ -211,6 +253,7 @@ class Utils(object):
             if p.poll() is None:
                 os.killpg(os.getpgid(p.pid), signal.SIGKILL)
             output += p.communicate()[0]
+            timing['wall_ms'] = (time.monotonic() - start_time) * 1000
             result = re.search(test.expect, output)
             if not result:
                 print(fail("[  TIMEOUT ] ") + "%s.%s" % (test.suite, test.name))
@@ -226,7 +269,14 @@ class Utils(object):
                 os.killpg(os.getpgid(after.pid), signal.SIGKILL)
 
         if result:
-            print(ok("[       OK ] ") + "%s.%s" % (test.suite, test.name))
+            over = Utils.over_budget(test, timing, output)
+            if over:
+                print(fail("[  BUDGET  ] ") + "%s.%s" % (test.suite, test.name))
+                print('\tCommand: ' + bpf_call)
+                for reason in over:
+                    print('\tOver budget: ' + reason)
+                return Utils.OVER_BUDGET
+            print(ok("[       OK ] ") + "%s.%s (%d ms)" % (test.suite, test.name, timing['wall_ms']))
             return Utils.PASS
         else:
             print(fail("[  FAILED  ] ") + "%s.%s" % (test.suite, test.name))
@@ -135,6 +135,40 @@ void test(const std::string &input,
        expected_parse);
 }
 
+// Parses and analyses input, then creates its maps, expecting every step to
+// succeed
+void create_maps(BPFtrace &bpftrace,
+                 Driver &driver,
+                 const std::string &input,
+                 bool mock_has_features = true,
+                 bool mock_multi_links = false)
+{
+  ASSERT_EQ(driver.parse_str(input), 0);
+  std::stringstream out;
+  // Override to mockbpffeature.
+  bpftrace.feature_ = std::make_unique<MockBPFfeature>(mock_has_features,
+                                                       mock_multi_links);
+  ast::SemanticAnalyser semantics(driver.root_, bpftrace, out);
+  ASSERT_EQ(semantics.analyse(), 0) << out.str();
+  ASSERT_EQ(semantics.create_maps(true), 0) << out.str();
+}
+
+void create_maps(BPFtrace &bpftrace,
+                 const std::string &input,
+                 bool mock_has_features = true)
+{
+  Driver driver(bpftrace);
+  create_maps(bpftrace, driver, input, mock_has_features);
+}
+
+std::unique_ptr<MockBPFtrace> create_maps(const std::string &input,
+                                          bool mock_has_features = true)
+{
+  auto bpftrace = get_mock_bpftrace();
+  create_maps(*bpftrace, input, mock_has_features);
+  return bpftrace;
+}
+
 TEST(semantic_analyser, builtin_variables)
 {
   // Just check that each builtin variable exists.
@@ -175,6 +209,12 @@ TEST(semantic_analyser, builtin_cpid)
   test("i:ms:100 { printf(\"%d\\n\", cpid); }", 0, false, true);
   test("i:ms:100 { @=cpid }", 0, false, true);
   test("i:ms:100 { $a=cpid }", 0, false, true);
+
+  // Each run of --repeat has another child
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->child_runs_ = 2;
+  Driver driver(*bpftrace);
+  test(*bpftrace, true, driver, "i:ms:100 { @=cpid }", 1, false, true);
 }
 
 TEST(semantic_analyser, builtin_functions)
@@ -377,6 +417,346 @@ TEST(semantic_analyser, call_lhist)
   test("kprobe:f { lhist() ? 0 : 1; }", 1);
 }
 
+TEST(semantic_analyser, call_llhist)
+{
+  test("kprobe:f { @ = llhist(5, 16); }", 0);
+  test("kprobe:f { @ = llhist(5, 2); }", 0);
+  test("kprobe:f { @ = llhist(5, 256); }", 0);
+  test("kprobe:f { @ = llhist(5); }", 1);
+  test("kprobe:f { @ = llhist(); }", 1);
+  test("kprobe:f { @ = llhist(5, 16, 1); }", 1);
+  test("kprobe:f { @ = llhist(5, arg0); }", 1);
+  test("kprobe:f { llhist(5, 16); }", 1);
+  test("kprobe:f { @ = llhist(5, 1); }", 10);
+  test("kprobe:f { @ = llhist(5, 12); }", 10);
+  test("kprobe:f { @ = llhist(5, 512); }", 10);
+  test("kprobe:f { $x = llhist(5, 16); }", 1);
+  test("kprobe:f { @[llhist(5, 16)] = 1; }", 1);
+}
+
+TEST(semantic_analyser, call_distinct)
+{
+  test("kprobe:f { @ = distinct(arg0); }", 0);
+  test("kprobe:f { @[pid] = distinct(tid); }", 0);
+  test("kprobe:f { @ = distinct(); }", 1);
+  test("kprobe:f { @ = distinct(1, 2); }", 1);
+  test("kprobe:f { @ = distinct(\"str\"); }", 10);
+  test("kprobe:f { distinct(arg0); }", 1);
+  test("kprobe:f { $x = distinct(arg0); }", 1);
+  test("kprobe:f { @x = distinct(arg0); $y = @x; }", 1);
+  test("kprobe:f { @x = distinct(arg0); @y = @x; }", 1);
+}
+
+TEST(semantic_analyser, call_cms_count)
+{
+  test("kprobe:f { @ = cms_count(arg0); }", 0);
+  test("kprobe:f { @ = cms_count(comm); }", 0);
+  test("kprobe:f { @ = cms_count(pid, 100); }", 0);
+  test("kprobe:f { @ = cms_count(); }", 1);
+  test("kprobe:f { @ = cms_count(pid, 1, 2); }", 1);
+  test("kprobe:f { @ = cms_count(pid, 0); }", 1);
+  test("kprobe:f { @ = cms_count(pid, arg0); }", 1);
+  test("kprobe:f { @[tid] = cms_count(pid); }", 1);
+  test("kprobe:f { @ = cms_count(kstack); }", 10);
+  test("kprobe:f { cms_count(pid); }", 1);
+  test("kprobe:f { @x = cms_count(pid); $y = @x; }", 1);
+}
+
+TEST(semantic_analyser, map_declaration)
+{
+  test("@x = hash(100); kprobe:f { @x[pid] = count(); }", 0);
+  test("@x = hash(100); @y = hash(1); kprobe:f { @x = 1; @y = 2; }", 0);
+  test("@x = array(100); kprobe:f { @x[pid] = count(); }", 0);
+  test("@x = array(100); kprobe:f { @x[arg0] = sum(arg1); @x[1]; }", 0);
+  test("@x = array(100); kprobe:f { @x[pid] = 1; }", 0);
+  test("@x = array(100); kprobe:f { @x = 1; }", 10);
+  test("@x = array(100); kprobe:f { @x[pid, tid] = count(); }", 10);
+  test("@x = array(100); kprobe:f { @x[comm] = count(); }", 10);
+  test("@x = array(100); kprobe:f { @x[pid] = hist(pid); }", 10);
+  test("@x = window(60); kprobe:f { @x[comm] = count(); }", 0);
+  test("@x = window(60); kprobe:f { @x = hist(arg0); }", 0);
+  test("@x = window(60); kprobe:f { @x[pid] = 1; }", 10);
+  test("@x = window(60); kprobe:f { @x = max(arg0); }", 10);
+  test("@x = window(0); kprobe:f { @x = count(); }", 1);
+  test("@x = bloom(1000); kprobe:f { if (!@x[pid]) { @x[pid] = 1; } }", 0);
+  test("@x = bloom(1000); kprobe:f { @x[comm, pid] = 1; }", 0);
+  test("@x = bloom(1000); kprobe:f { @x[pid] = 2; }", 1);
+  test("@x = bloom(1000); kprobe:f { @x[pid]++; }", 1);
+  test("@x = bloom(1000); kprobe:f { @x = 1; }", 10);
+  test("@x = bloom(1000); kprobe:f { @x[pid] = 1; delete(@x[pid]); }", 10);
+  test("@x = bloom(1000); kprobe:f { @x[pid] = 1; clear(@x); }", 10);
+  test("@x = bloom(1000); kprobe:f { @x[pid] = 1; print(@x); }", 10);
+  test("@x = ttl(60); kprobe:f { @x[pid] = nsecs; }", 0);
+  test("@x = ttl(60); kprobe:f { @x[comm, pid] = hist(arg0); }", 0);
+  test("@x = ttl(60); kprobe:f { @x = count(); }", 10);
+  test("@x = ttl(0); kprobe:f { @x[pid] = 1; }", 1);
+  test("@x = lru(100); kprobe:f { @x = 1; }", 1);
+  test("@x = hash(0); kprobe:f { @x = 1; }", 1);
+  test("@x = hash(100); @x = hash(10); kprobe:f { @x = 1; }", 1);
+
+  test_for_warning("@x = hash(100); kprobe:f { @y = 1; }",
+                   "@x is declared but never used");
+  test_for_warning("@x = hash(100); kprobe:f { @x = 1; }",
+                   "declared but never used",
+                   true);
+}
+
+TEST(semantic_analyser, map_declaration_size)
+{
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->mapmax_ = 4096;
+  create_maps(*bpftrace,
+              "@x = hash(100); kprobe:f { @x[pid] = count(); @y[pid] = 1; }");
+
+  EXPECT_EQ((*bpftrace->maps.Lookup("@x"))->max_entries_, 100U);
+  EXPECT_EQ((*bpftrace->maps.Lookup("@y"))->max_entries_, 4096U);
+}
+
+TEST(semantic_analyser, window_maps)
+{
+  auto bpftrace = create_maps("@a = window(10); @b = window(300); "
+                              "kprobe:f { @a[pid] = count(); @b = sum(arg0); "
+                              "@c = count(); }");
+
+  auto &a = **bpftrace->maps.Lookup("@a");
+  auto &b = **bpftrace->maps.Lookup("@b");
+  ASSERT_TRUE(a.is_windowed());
+  EXPECT_EQ(a.window_mapfds_.size(), 10U);
+  EXPECT_EQ(a.window_slot_ns_, 1000000000ULL);
+  ASSERT_TRUE(b.is_windowed());
+  EXPECT_FALSE(b.is_mmapped());
+  EXPECT_EQ(b.window_mapfds_.size(), 60U);
+  EXPECT_EQ(b.window_slot_ns_, 5000000000ULL);
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@c"))->is_windowed());
+}
+
+TEST(semantic_analyser, ttl_maps)
+{
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->double_buffer_maps_ = true;
+  create_maps(*bpftrace,
+              "@a = ttl(60); kprobe:f { @a[pid] = count(); "
+              "@b[pid] = count(); } "
+              "interval:s:1 { print(@a); clear(@a); }");
+
+  auto &a = **bpftrace->maps.Lookup("@a");
+  EXPECT_GE(a.ttl_mapfd_, 0);
+  EXPECT_EQ(a.ttl_ns_, 60000000000ULL);
+  EXPECT_FALSE(a.is_double_buffered());
+  EXPECT_LT((*bpftrace->maps.Lookup("@b"))->ttl_mapfd_, 0);
+}
+
+TEST(semantic_analyser, bloom_maps)
+{
+  for (bool has_bloom_filter : { false, true })
+  {
+    auto bpftrace = create_maps("@a = bloom(1000); @b = bloom(1000000); "
+                                "kprobe:f { @a[pid] = 1; @b[arg0] = 1; }",
+                                has_bloom_filter);
+
+    auto &a = **bpftrace->maps.Lookup("@a");
+    auto &b = **bpftrace->maps.Lookup("@b");
+    ASSERT_TRUE(a.bloom_);
+    ASSERT_TRUE(b.bloom_);
+    EXPECT_FALSE(a.hashed_key_);
+    EXPECT_EQ(a.max_entries_, 1000U);
+    EXPECT_EQ(a.bloom_bytes_, has_bloom_filter ? 0U : 16384U);
+    EXPECT_EQ(b.bloom_bytes_, has_bloom_filter ? 0U : IMap::BLOOM_BYTES_MAX);
+  }
+}
+
+TEST(semantic_analyser, double_buffered_maps)
+{
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->double_buffer_maps_ = true;
+  create_maps(*bpftrace,
+              "kprobe:f { @a[pid] = 1; @b[pid] = 1; "
+              "@c[pid] = 1; @d[pid] = 1; }"
+              "interval:s:1 { clear(@a); print(@b); clear(@b); "
+              "print(@c); clear(@c); print(@c); print(@d); }");
+
+  EXPECT_TRUE((*bpftrace->maps.Lookup("@a"))->is_double_buffered());
+  EXPECT_TRUE((*bpftrace->maps.Lookup("@b"))->is_double_buffered());
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@c"))->is_double_buffered());
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@d"))->is_double_buffered());
+}
+
+TEST(semantic_analyser, map_declaration_dense)
+{
+  auto bpftrace = create_maps(
+      "@x = array(100); @h = hash(100);"
+      "kprobe:f { @x[pid] = count(); @h[cpu] = count();"
+      "@c[cpu] = sum(pid); @p[pid] = count();"
+      "@m[cpu] = count(); @m[pid] = count(); }");
+
+  auto &x = **bpftrace->maps.Lookup("@x");
+  EXPECT_TRUE(x.dense_);
+  EXPECT_EQ(x.max_entries_, 100U);
+  auto &c = **bpftrace->maps.Lookup("@c");
+  EXPECT_TRUE(c.dense_);
+  EXPECT_EQ(c.max_entries_,
+            static_cast<uint32_t>(get_possible_cpus().back() + 1));
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@h"))->dense_);
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@p"))->dense_);
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@m"))->dense_);
+}
+
+TEST(semantic_analyser, map_task_storage)
+{
+  std::string prog = "kprobe:f { @start[tid] = nsecs; @kept[tid] = nsecs;"
+                     "@other[tid] = 1; @other[pid] = 2; @s[tid] = count(); }"
+                     "kretprobe:f { delete(@start[tid]); }"
+                     "interval:s:1 { clear(@kept); }"
+                     "END { clear(@start); clear(@kept); clear(@other);"
+                     "clear(@s); }";
+  for (bool has_features : { true, false })
+  {
+    auto bpftrace = create_maps(prog, has_features);
+
+    EXPECT_EQ((*bpftrace->maps.Lookup("@start"))->task_storage_,
+              has_features);
+    EXPECT_FALSE((*bpftrace->maps.Lookup("@kept"))->task_storage_);
+    EXPECT_FALSE((*bpftrace->maps.Lookup("@other"))->task_storage_);
+    EXPECT_FALSE((*bpftrace->maps.Lookup("@s"))->task_storage_);
+  }
+}
+
+TEST(semantic_analyser, map_task_storage_off_cpu)
+{
+  for (bool has_features : { true, false })
+  {
+    auto bpftrace = create_maps(BPFtrace::off_cpu_probes(10), has_features);
+
+    EXPECT_EQ((*bpftrace->maps.Lookup(BPFtrace::OFF_CPU_START_MAP))
+                  ->task_storage_,
+              has_features);
+    EXPECT_TRUE((*bpftrace->maps.Lookup(BPFtrace::OFF_CPU_MAP))
+                    ->type_.IsSumTy());
+  }
+}
+
+TEST(semantic_analyser, map_hashed_key)
+{
+  std::string prog = "kprobe:f { @a[comm] = count(); @h[comm] = hist(1);"
+                     "@i[pid] = 1; @two[comm, pid] = 1; @c = cms_count(comm); }";
+  for (bool hash_str_keys : { true, false })
+  {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->hash_str_keys_ = hash_str_keys;
+    create_maps(*bpftrace, prog);
+
+    auto &a = **bpftrace->maps.Lookup("@a");
+    EXPECT_EQ(a.hashed_key_, hash_str_keys);
+    EXPECT_EQ(a.strings_mapfd_ >= 0, hash_str_keys);
+    EXPECT_EQ((*bpftrace->maps.Lookup("@h"))->hashed_key_, hash_str_keys);
+    EXPECT_FALSE((*bpftrace->maps.Lookup("@i"))->hashed_key_);
+    EXPECT_FALSE((*bpftrace->maps.Lookup("@two"))->hashed_key_);
+    EXPECT_FALSE((*bpftrace->maps.Lookup("@c"))->hashed_key_);
+  }
+}
+
+TEST(semantic_analyser, map_packed_key)
+{
+  auto bpftrace = create_maps("kprobe:f { @a[comm, arg0, pid] = 1;"
+                              "@a[comm, arg1, tid] = 2; @b[arg0, arg1] = 1;"
+                              "@c[pid, arg0] = 1; @c[arg1, arg0] = 2;"
+                              "@d[(int32)arg0, (uint16)arg1] = hist(1); }");
+
+  // arg0, then pid in 4 bytes, then comm
+  auto &a = **bpftrace->maps.Lookup("@a");
+  ASSERT_TRUE(a.key_.is_packed());
+  EXPECT_EQ(a.key_.size(), 32U);
+  EXPECT_EQ(a.bpf_key_args_size(), 28U);
+  EXPECT_EQ(a.key_.packed_[0].offset, 12U);
+  EXPECT_EQ(a.key_.packed_[1].offset, 0U);
+  EXPECT_EQ(a.key_.packed_[2].offset, 8U);
+  EXPECT_EQ(a.key_.packed_[2].size, 4U);
+
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@b"))->key_.is_packed());
+  // pid in the one access, arg1 in the other
+  EXPECT_FALSE((*bpftrace->maps.Lookup("@c"))->key_.is_packed());
+
+  auto &d = (*bpftrace->maps.Lookup("@d"))->key_;
+  ASSERT_TRUE(d.is_packed());
+  EXPECT_EQ(d.packed_size(), 8U);
+  EXPECT_TRUE(d.packed_[0].is_signed);
+  EXPECT_FALSE(d.packed_[1].is_signed);
+
+  uint8_t packed[8] = { 0xff, 0xff, 0xff, 0xff, 2, 0, 0, 0 };
+  uint8_t unpacked[16];
+  d.unpack(packed, unpacked);
+  int64_t first, second;
+  std::memcpy(&first, unpacked, sizeof(first));
+  std::memcpy(&second, unpacked + 8, sizeof(second));
+  EXPECT_EQ(first, -1);
+  EXPECT_EQ(second, 2);
+}
+
+TEST(semantic_analyser, hist_arrays)
+{
+  for (bool hist_arrays : { false, true })
+  {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->hist_arrays_ = hist_arrays;
+    create_maps(*bpftrace,
+                "kprobe:f { @h[pid] = hist(arg0);"
+                "@l[comm] = lhist(arg0, 0, 100, 10);"
+                "@w[comm] = lhist(arg0, 0, 1000, 1);"
+                "@k = hist(arg0); @ll[pid] = llhist(arg0, 4); }");
+
+    EXPECT_EQ((*bpftrace->maps.Lookup("@h"))->bucket_array_,
+              hist_arrays ? 65U : 0U);
+    EXPECT_EQ((*bpftrace->maps.Lookup("@l"))->bucket_array_,
+              hist_arrays ? 12U : 0U);
+    // Too many buckets, no key and llhist()
+    EXPECT_EQ((*bpftrace->maps.Lookup("@w"))->bucket_array_, 0U);
+    EXPECT_EQ((*bpftrace->maps.Lookup("@k"))->bucket_array_, 0U);
+    EXPECT_EQ((*bpftrace->maps.Lookup("@ll"))->bucket_array_, 0U);
+  }
+}
+
+TEST(semantic_analyser, stack_map_size)
+{
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->stack_map_entries_ = 1024;
+  create_maps(*bpftrace, "kprobe:f { @[kstack] = count(); }");
+
+  ASSERT_EQ(bpftrace->maps.CountStackTypes(), 1);
+  EXPECT_EQ((*bpftrace->maps.Lookup(StackType()))->max_entries_, 1024U);
+}
+
+TEST(semantic_analyser, call_quantiles)
+{
+  test("kprobe:f { @ = hist(5); quantiles(@); }", 0);
+  test("kprobe:f { @ = lhist(5, 0, 10, 1); quantiles(@, 50); }", 0);
+  test("kprobe:f { @[1] = llhist(5, 16); quantiles(@, 50, 99, \"99.9\"); }",
+       0);
+  test("kprobe:f { @ = hist(5); quantiles(@, 100); }", 0);
+  test("kprobe:f { @ = count(); quantiles(@); }", 10);
+  test("kprobe:f { @ = hist(5); quantiles(); }", 1);
+  test("kprobe:f { @ = hist(5); quantiles(5); }", 1);
+  test("kprobe:f { @[1] = hist(5); quantiles(@[1]); }", 1);
+  test("kprobe:f { @ = hist(5); quantiles(@, 0); }", 1);
+  test("kprobe:f { @ = hist(5); quantiles(@, 101); }", 1);
+  test("kprobe:f { @ = hist(5); quantiles(@, \"p99\"); }", 1);
+  test("kprobe:f { @ = hist(5); quantiles(@, arg0); }", 1);
+  test("kprobe:f { @ = hist(5); @x = quantiles(@); }", 1);
+}
+
+TEST(semantic_analyser, call_print_delta)
+{
+  test("kprobe:f { @[comm] = count(); print_delta(@); }", 0);
+  test("kprobe:f { @ = sum(arg0); print_delta(@, 10, 1000); }", 0);
+  test("kprobe:f { @ = 1; print_delta(@); }", 0);
+  test("kprobe:f { @ = hist(5); print_delta(@); }", 10);
+  test("kprobe:f { @ = \"a\"; print_delta(@); }", 10);
+  test("kprobe:f { @ = count(); print_delta(); }", 1);
+  test("kprobe:f { @ = count(); print_delta(5); }", 1);
+  test("kprobe:f { @[1] = count(); print_delta(@[1]); }", 1);
+  test("kprobe:f { @ = count(); print_delta(@, arg0); }", 10);
+  test("kprobe:f { @ = count(); @x = print_delta(@); }", 1);
+}
+
 TEST(semantic_analyser, call_count)
 {
   test("kprobe:f { @x = count(); }", 0);
@@ -431,6 +811,8 @@ TEST(semantic_analyser, call_avg)
   test("kprobe:f { @[avg(123)] = 1; }", 1);
   test("kprobe:f { if(avg(1)) { 123 } }", 1);
   test("kprobe:f { avg(1) ? 0 : 1; }", 1);
+  test("kprobe:f { @x = avg(1); @y = @x; }", 1);
+  test("kprobe:f { @x = avg(1); $y = @x; }", 1);
 }
 
 TEST(semantic_analyser, call_stats)
@@ -442,6 +824,7 @@ TEST(semantic_analyser, call_stats)
   test("kprobe:f { @[stats(123)] = 1; }", 1);
   test("kprobe:f { if(stats(1)) { 123 } }", 1);
   test("kprobe:f { stats(1) ? 0 : 1; }", 1);
+  test("kprobe:f { @x = stats(1); $y = @x; }", 1);
 }
 
 TEST(semantic_analyser, call_delete)
@@ -468,6 +851,119 @@ TEST(semantic_analyser, call_exit)
   test("kprobe:f { exit() ? 0 : 1; }", 10);
 }
 
+TEST(semantic_analyser, call_dump)
+{
+  test("kprobe:f { dump(); }", 1);
+
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->flight_recorder_secs_ = 10;
+  test(*bpftrace, "kprobe:f { dump(); }", 0);
+  test(*bpftrace, "kprobe:f { dump(1); }", 1);
+  test(*bpftrace, "kprobe:f { @a = dump(); }", 1);
+}
+
+TEST(semantic_analyser, call_enable_disable)
+{
+  test("kprobe:f { disable(\"kprobe:g\"); } kprobe:g { }", 0);
+  test("kprobe:f { enable(\"kprobe:g\"); } kprobe:g { }", 0);
+  test("BEGIN { disable(\"kprobe:g*\"); } kprobe:g* { }", 0);
+  test("kprobe:f,kprobe:g { disable(\"kprobe:g\"); }", 0);
+  test("kprobe:f { disable(\"kprobe:g\"); }", 1);
+  test("kprobe:f { disable(\"BEGIN\"); } BEGIN { }", 1);
+  test("kprobe:f { disable(\"kprobe:f\", 1); }", 1);
+  test("kprobe:f { disable(arg0); }", 1);
+  test("kprobe:f { @a = enable(\"kprobe:f\"); }", 1);
+}
+
+TEST(semantic_analyser, probe_gates)
+{
+  auto bpftrace = get_mock_bpftrace();
+  Driver driver(*bpftrace);
+  create_maps(*bpftrace,
+              driver,
+              "BEGIN { disable(\"kprobe:g\"); } "
+              "kprobe:f,kprobe:g { } END { }");
+  EXPECT_EQ(bpftrace->probe_gates_,
+            (std::vector<std::pair<uint32_t, std::string>>{
+                { 0, "kprobe:f" }, { 0, "kprobe:g" } }));
+  EXPECT_TRUE(bpftrace->maps.Has(MapManager::Type::ProbeGates));
+  EXPECT_EQ(driver.root_->probes->at(0)->gate, -1);
+  EXPECT_EQ(driver.root_->probes->at(1)->gate, 0);
+  EXPECT_EQ(driver.root_->probes->at(2)->gate, -1);
+}
+
+TEST(semantic_analyser, dedupe)
+{
+  for (uint64_t dedupe_ms : { 0, 1000 })
+  {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->dedupe_ms_ = dedupe_ms;
+    create_maps(*bpftrace, "kprobe:f { printf(\"%d\\n\", arg0); }");
+    EXPECT_EQ(bpftrace->maps.Has(MapManager::Type::Dedupe), dedupe_ms != 0);
+  }
+}
+
+TEST(semantic_analyser, raw_symbols_pids)
+{
+  for (auto &[prog, needs_pids] :
+       std::vector<std::pair<std::string, bool>>{
+           { "kprobe:f { @[ustack] = count(); }", true },
+           { "kprobe:f { @[ustack(3)] = count(); }", true },
+           { "kprobe:f { printf(\"%s\\n\", usym(arg0)); }", true },
+           { "kprobe:f { @[kstack] = count(); }", false },
+       })
+  {
+    SCOPED_TRACE(prog);
+    auto bpftrace = get_mock_bpftrace();
+    create_maps(*bpftrace, prog);
+    EXPECT_FALSE(bpftrace->maps.Has(MapManager::Type::RawSymbolsPids));
+
+    bpftrace = get_mock_bpftrace();
+    bpftrace->raw_symbols_ = std::make_unique<RawSymbols>();
+    create_maps(*bpftrace, prog);
+    EXPECT_EQ(bpftrace->maps.Has(MapManager::Type::RawSymbolsPids),
+              needs_pids);
+  }
+}
+
+TEST(semantic_analyser, needs_ksyms)
+{
+  for (auto &[prog, needs_ksyms] :
+       std::vector<std::pair<std::string, bool>>{
+           { "kprobe:f { @[kstack] = count(); }", true },
+           { "kprobe:f { @[kstack(3)] = count(); }", true },
+           { "kprobe:f { printf(\"%s\\n\", ksym(arg0)); }", true },
+           { "kprobe:f { @[func] = count(); }", true },
+           { "kprobe:f { @[ustack] = count(); }", false },
+           { "uprobe:/bin/sh:f { @[func] = count(); }", false },
+       })
+  {
+    auto bpftrace = get_mock_bpftrace();
+    Driver driver(*bpftrace);
+    ASSERT_EQ(driver.parse_str(prog), 0);
+
+    ast::SemanticAnalyser semantics(driver.root_, *bpftrace);
+    ASSERT_EQ(semantics.analyse(), 0) << prog;
+    EXPECT_EQ(bpftrace->needs_ksyms_, needs_ksyms) << prog;
+  }
+}
+
+TEST(semantic_analyser, flight_recorder)
+{
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->flight_recorder_secs_ = 10;
+  bpftrace->strlen_ = 2048;
+  create_maps(*bpftrace,
+              "kprobe:f { printf(\"%d %d\\n\", pid, arg0); "
+              "printf(\"%s\\n\", str(arg0)); }");
+
+  // The str() event is sent as it comes
+  EXPECT_EQ(bpftrace->flight_event_size_, 8U + 8U + 8U);
+  auto map = bpftrace->maps[MapManager::Type::FlightRecorder];
+  ASSERT_TRUE(map.has_value());
+  EXPECT_EQ((*map)->max_entries_, bpftrace->flight_recorder_events_ + 1);
+}
+
 TEST(semantic_analyser, call_print)
 {
   test("kprobe:f { @x = count(); print(@x); }", 0);
@@ -728,6 +1224,15 @@ TEST(semantic_analyser, call_uaddr)
   }
 }
 
+TEST(semantic_analyser, call_cgroup_path)
+{
+  test("kprobe:f { cgroup_path(cgroup); }", 0);
+  test("kprobe:f { @x[cgroup_path(cgroup)] = count(); }", 0);
+  test("kprobe:f { printf(\"%s\", cgroup_path(cgroup)); }", 0);
+  test("kprobe:f { cgroup_path(); }", 1);
+  test("kprobe:f { cgroup_path(\"/sys/fs/cgroup\"); }", 1);
+}
+
 TEST(semantic_analyser, call_cgroupid)
 {
   // Handle args above STRING_SIZE
@@ -763,6 +1268,119 @@ TEST(semantic_analyser, call_probe)
   test("kprobe:f { printf(\"%s\", probe);  }", 0);
 }
 
+TEST(semantic_analyser, call_probe_cookies)
+{
+  auto analyse = [](const std::string &input, bool kprobe_multi) {
+    auto bpftrace = get_mock_bpftrace();
+    Driver driver(*bpftrace);
+    EXPECT_EQ(driver.parse_str(input), 0);
+    bpftrace->feature_ = std::make_unique<MockBPFfeature>(true, kprobe_multi);
+    std::stringstream out;
+    ast::SemanticAnalyser semantics(driver.root_, *bpftrace, out);
+    EXPECT_EQ(semantics.analyse(), 0) << out.str();
+    auto probe = driver.root_->probes->at(0);
+    return std::make_pair(probe->use_cookies, probe->need_expansion);
+  };
+
+  EXPECT_EQ(analyse("kprobe:f,kretprobe:g* { @[probe] = count(); }", true),
+            std::make_pair(true, false));
+  EXPECT_EQ(analyse("kprobe:f { @[probe] = count(); }", false),
+            std::make_pair(false, true));
+  EXPECT_EQ(analyse("kprobe:f+1 { @[probe] = count(); }", true),
+            std::make_pair(false, true));
+  EXPECT_EQ(analyse("kprobe:f,tracepoint:sched:sched_one { @[probe] = "
+                    "count(); }",
+                    true),
+            std::make_pair(false, true));
+}
+
+TEST(semantic_analyser, probe_counts)
+{
+  auto analyse = [](const std::string &input, bool kprobe_multi) {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->probe_counts_ = true;
+    Driver driver(*bpftrace);
+    create_maps(*bpftrace, driver, input, true, kprobe_multi);
+    EXPECT_TRUE(bpftrace->maps.Has(MapManager::Type::ProbeCounts));
+    auto probe = driver.root_->probes->at(0);
+    return std::make_pair(probe->use_cookies, probe->need_expansion);
+  };
+
+  // Matches are told apart the way they are for the probe builtin
+  EXPECT_EQ(analyse("kprobe:f* { @ = count(); }", true),
+            std::make_pair(true, false));
+  EXPECT_EQ(analyse("kprobe:f* { @ = count(); }", false),
+            std::make_pair(false, true));
+  EXPECT_EQ(analyse("tracepoint:sched:sched_* { @ = count(); }", true),
+            std::make_pair(false, true));
+  EXPECT_EQ(analyse("kprobe:f,kprobe:g { @ = count(); }", false),
+            std::make_pair(false, true));
+  // A single match already has its own id
+  EXPECT_EQ(analyse("tracepoint:sched:sched_one { @ = count(); }", true),
+            std::make_pair(false, false));
+}
+
+TEST(semantic_analyser, scratch_map)
+{
+  auto analyse = [](const std::string &input, uint64_t strlen) {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->strlen_ = strlen;
+    Driver driver(*bpftrace);
+    EXPECT_EQ(driver.parse_str(input), 0);
+    std::stringstream out;
+    ast::SemanticAnalyser semantics(driver.root_, *bpftrace, out);
+    EXPECT_EQ(semantics.analyse(), 0) << out.str();
+    EXPECT_EQ(bpftrace->scratch_size_ > 0,
+              driver.root_->probes->at(0)->need_scratch);
+    return bpftrace->scratch_size_;
+  };
+
+  EXPECT_EQ(analyse("kprobe:f { @ = str(arg0); }", 64), 0U);
+  EXPECT_EQ(analyse("kprobe:f { @ = str(arg0); }", 200), 200U);
+  // The id, then the arguments without padding
+  EXPECT_EQ(analyse("kprobe:f { printf(\"%s %s\", str(arg0), str(arg1)); }",
+                    100),
+            208U);
+  EXPECT_EQ(analyse("kprobe:f { @ = (str(arg0), str(arg1)); }", 100), 200U);
+  // The most any probe needs
+  EXPECT_EQ(analyse("kprobe:f { @a = str(arg0); } "
+                    "kprobe:g { @b = str(arg0); @c = str(arg1); }",
+                    150),
+            304U);
+}
+
+TEST(semantic_analyser, tail_calls)
+{
+  auto analyse = [](const std::string &input) {
+    auto bpftrace = get_mock_bpftrace();
+    Driver driver(*bpftrace);
+    EXPECT_EQ(driver.parse_str(input), 0);
+    std::stringstream out;
+    ast::SemanticAnalyser semantics(driver.root_, *bpftrace, out);
+    EXPECT_EQ(semantics.analyse(), 0) << out.str();
+    return driver.root_->probes->at(0)->tail_calls;
+  };
+
+  using Splits = std::vector<size_t>;
+  // Each loop is 502 nodes
+  EXPECT_EQ(analyse("kprobe:f { unroll(100) { @a = @a + 1; } }"), Splits());
+  EXPECT_EQ(analyse("kprobe:f { unroll(100) { @a = @a + 1; } "
+                    "unroll(100) { @b = @b + 1; } @c = 1; }"),
+            Splits({ 1 }));
+  // $x can't be used across programs
+  EXPECT_EQ(analyse("kprobe:f { $x = 1; unroll(100) { @a = @a + $x; } "
+                    "unroll(100) { @b = @b + $x; } }"),
+            Splits());
+  EXPECT_EQ(analyse("kprobe:f { $x = 1; unroll(100) { @a = @a + $x; } "
+                    "unroll(100) { @b = @b + 1; } }"),
+            Splits({ 2 }));
+  // for loops are subprograms, which can't be mixed with tail calls
+  EXPECT_EQ(analyse("kprobe:f { @m[1] = 1; unroll(100) { @a = @a + 1; } "
+                    "unroll(100) { @b = @b + 1; } "
+                    "for ($kv : @m) { @c = 1; } }"),
+            Splits());
+}
+
 TEST(semantic_analyser, call_cat)
 {
   test("kprobe:f { cat(\"/proc/loadavg\"); }", 0);
@@ -788,6 +1406,8 @@ TEST(semantic_analyser, call_stack)
   test("kprobe:f { ustack(3) }", 0);
   test("kprobe:f { kstack(perf, 3) }", 0);
   test("kprobe:f { ustack(perf, 3) }", 0);
+  test("kprobe:f { ustack(build_id) }", 0);
+  test("kprobe:f { ustack(build_id, 3) }", 0);
 
   // Wrong arguments
   test("kprobe:f { kstack(3, perf) }", 1);
@@ -802,6 +1422,16 @@ TEST(semantic_analyser, call_stack)
   test("kprobe:f { ustack(perf, \"str\") }", 1);
   test("kprobe:f { kstack(\"str\", 3) }", 1);
   test("kprobe:f { ustack(\"str\", 3) }", 1);
+  test("kprobe:f { kstack(build_id) }", 1);
+
+#ifdef ARCH_X86_64
+  test("uprobe:/bin/sh:f { printf(\"%s\", ustack(dwarf)) }", 0);
+  test("profile:hz:99 { printf(\"%d %s\", pid, ustack(dwarf, 3)) }", 0);
+  test("uprobe:/bin/sh:f { @x[ustack(dwarf)] = count() }", 10);
+  test("uprobe:/bin/sh:f { ustack(dwarf) }", 10);
+  test("kprobe:f { printf(\"%s\", ustack(dwarf)) }", 1);
+#endif
+  test("uprobe:/bin/sh:f { printf(\"%s\", kstack(dwarf)) }", 1);
 
   // Non-literals
   test("kprobe:f { @x = perf; kstack(@x) }", 1);
@@ -1244,6 +1874,19 @@ TEST(semantic_analyser, tracepoint)
   test("tracepoint:category:event { 1 }", 0);
 }
 
+TEST(semantic_analyser, rawtracepoint)
+{
+  test("rawtracepoint:sched:sched_one { @ = arg0 + arg7 }", 0);
+  test("rawtracepoint:sched:sched_* { @[probe] = count() }", 0);
+  // The mock has no BTF to read the arguments from
+  test("rawtracepoint:sched:sched_one { @ = args->foo }", 1);
+  test("rawtracepoint:sched:sched_one { @ = retval }", 1);
+  test("rawtracepoint:sched:sched_one { @ = func }", 1);
+
+  MockBPFfeature feature(false);
+  test(feature, "rawtracepoint:sched:sched_one { 1 }", 1);
+}
+
 #if defined(ARCH_X86_64) || defined(ARCH_AARCH64)
 TEST(semantic_analyser, watchpoint_invalid_modes)
 {
@@ -1817,6 +2460,100 @@ TEST(semantic_analyser, strncmp)
   test("i:s:1 { strncmp(\"a\",\"a\",\"foo\") }", 1);
 }
 
+TEST(semantic_analyser, glob_strcontains)
+{
+  test("kprobe:f /glob(comm, \"kworker/*\")/ { }", 0);
+  test("kprobe:f /strcontains(str(arg0), \"/tmp/\")/ { }", 0);
+  test("kprobe:f { @ = glob(str(arg0), \"[a-z]?.so*\"); }", 0);
+  test("kprobe:f { glob(comm); }", 1);
+  test("kprobe:f { glob(comm, \"[a\"); }", 1);
+  test("kprobe:f { glob(1, \"a\"); }", 10);
+}
+
+TEST(semantic_analyser, sample_ratelimit)
+{
+  test("kprobe:f /sample(10)/ { }", 0);
+  test("kprobe:f /ratelimit(100)/ { }", 0);
+  test("kprobe:f { $a = sample(2) + ratelimit(2); }", 0);
+  test("kprobe:f /sample()/ { }", 1);
+  test("kprobe:f /sample(1, 2)/ { }", 1);
+  test("kprobe:f /sample(0)/ { }", 1);
+  test("kprobe:f /ratelimit(-1)/ { }", 1);
+  test("kprobe:f /sample(arg0)/ { }", 1);
+  test("kprobe:f /ratelimit(\"a\")/ { }", 1);
+}
+
+TEST(semantic_analyser, counter)
+{
+  test("hardware:cycles+instructions:1000 { @ = counter(\"instructions\"); }",
+       0);
+  test("hardware:cycles+instructions { @ = counter(\"cpu-cycles\"); }", 0);
+  test("hardware:cycles+branches+cache-misses:1000 { "
+       "@ = counter(\"branch-instructions\"); }",
+       0);
+  test("hardware:cycles+pcm:1000 { }", 1);
+  test("hardware:cycles+cpu-cycles:1000 { }", 1);
+  test("hardware:cycles:1000 { @ = counter(\"cycles\"); }", 1);
+  test("hardware:cycles+instructions:1000 { @ = counter(\"cache-misses\"); }",
+       1);
+  test("hardware:cycles+instructions:1000,hardware:cycles+instructions:2000 { "
+       "@ = counter(\"cycles\"); }",
+       1);
+  test("kprobe:f { @ = counter(\"cycles\"); }", 1);
+  test("hardware:cycles+instructions:1000 { @ = counter(); }", 1);
+  test("hardware:cycles+instructions:1000 { $e = \"cycles\"; "
+       "@ = counter($e); }",
+       1);
+
+  auto bpftrace = get_mock_bpftrace();
+  Driver driver(*bpftrace);
+  create_maps(*bpftrace,
+              driver,
+              "hardware:cycles+instructions:1000 { } "
+              "hardware:cache-misses:1000 { } "
+              "hardware:branches+bus-cycles+ref-cycles { }");
+  EXPECT_TRUE(bpftrace->maps.Has(MapManager::Type::Counters));
+  auto &probes = *driver.root_->probes;
+  EXPECT_EQ(probes.at(0)->attach_points->at(0)->counter_slot, 0);
+  EXPECT_EQ(probes.at(1)->attach_points->at(0)->counter_slot, -1);
+  EXPECT_EQ(probes.at(2)->attach_points->at(0)->counter_slot, 2);
+}
+
+TEST(semantic_analyser, control_ringbuf)
+{
+  for (bool control : { false, true })
+  {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->use_control_ringbuf_ = control;
+    create_maps(*bpftrace, "kprobe:f { @x = count(); print(@x); exit(); }");
+    EXPECT_TRUE(bpftrace->maps.Has(MapManager::Type::PerfEvent));
+    EXPECT_EQ(bpftrace->maps.Has(MapManager::Type::Control), control);
+  }
+}
+
+TEST(semantic_analyser, event_batch)
+{
+  for (uint64_t batch : { 0, 1024 })
+  {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->event_batch_ = batch;
+    create_maps(*bpftrace, "kprobe:f { printf(\"%d\\n\", pid); }");
+    EXPECT_EQ(bpftrace->maps.Has(MapManager::Type::EventBatch), batch > 0);
+  }
+}
+
+TEST(semantic_analyser, helper_errors)
+{
+  for (bool events : { false, true })
+  {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->helper_check_level_ = 1;
+    bpftrace->helper_error_events_ = events;
+    create_maps(*bpftrace, "kprobe:f { @x[1] = 1; delete(@x[1]); }");
+    EXPECT_EQ(bpftrace->maps.Has(MapManager::Type::HelperErrors), !events);
+  }
+}
+
 TEST(semantic_analyser, override)
 {
   // literals
@@ -1900,6 +2637,41 @@ i:s:1 {
                    "'print()' in a loop");
 }
 
+TEST(semantic_analyser, for_loop)
+{
+  test("i:s:1 { @x[pid] = 1; } END { for ($kv : @x) { @s += $kv.1; } }", 0);
+  // The map is only typed by a later probe
+  test("END { for ($kv : @x) { @s += $kv.1; } } i:s:1 { @x[pid] = 1; }", 0);
+  test("i:s:1 { @x[comm] = (pid, 1); for ($kv : @x) { "
+       "$c = $kv.1.0; if ($c > 1) { break } printf(\"%s\\n\", $kv.0); } }",
+       0);
+  test("i:s:1 { @x[pid] = 1; for ($kv : @x) { "
+       "for ($kv2 : @x) { @s[$kv2.0] += $kv2.1; } } }",
+       0);
+
+  // Only $kv is in scope in the body
+  test("i:s:1 { $a = 1; @x[pid] = 1; for ($kv : @x) { @s = $a; } }", 1);
+  test("i:s:1 { $a = 1; @x[pid] = 1; for ($kv : @x) { $a = 2; } }", 1);
+  test("i:s:1 { $kv = 1; @x[pid] = 1; for ($kv : @x) { } }", 1);
+  test("i:s:1 { @x[pid] = 1; for ($kv : @x) { "
+       "for ($kv2 : @x) { @s[$kv.0] += $kv2.1; } } }",
+       1);
+  test("i:s:1 { @x[pid] = 1; for ($kv : @x) { return; } }", 1);
+  test("i:s:1 { @x[pid] = 1; for ($kv : @x) { exit(); } }", 1);
+
+  test("i:s:1 { for ($kv : @x) { } }", 10);
+  test("i:s:1 { @x = 1; for ($kv : @x) { } }", 10);
+  test("i:s:1 { @x[pid, tid] = 1; for ($kv : @x) { } }", 10);
+  // The values of each CPU are separate
+  test("i:s:1 { @x[pid] = count(); for ($kv : @x) { } }", 10);
+  test("i:s:1 { @x[pid] = hist(pid); for ($kv : @x) { } }", 10);
+  test("@x = array(10); i:s:1 { @x[pid] = 1; for ($kv : @x) { } }", 10);
+  test("@x = hash(10); i:s:1 { @x[pid] = 1; for ($kv : @x) { } }", 0);
+
+  MockBPFfeature feature(false);
+  test(feature, "i:s:1 { @x[pid] = 1; for ($kv : @x) { } }", 10);
+}
+
 TEST(semantic_analyser, builtin_args)
 {
   auto bpftrace = get_mock_bpftrace();
@@ -2248,6 +3020,53 @@ TEST_F(semantic_analyser_btf, kfunc)
 #endif
 }
 
+TEST_F(semantic_analyser_btf, kfunc_probe_ids)
+{
+  auto analyse = [](const std::string &input) {
+    auto bpftrace = get_mock_bpftrace();
+    Driver driver(*bpftrace);
+    test(*bpftrace, true, driver, input, 0);
+    auto probe = driver.root_->probes->at(0);
+    return std::make_pair(probe->probe_ids_at_load, probe->need_expansion);
+  };
+
+  // The matches share a program, loaded with the id of each
+  EXPECT_EQ(analyse("kfunc:func_* { @[probe] = count(); }"),
+            std::make_pair(true, false));
+  EXPECT_EQ(
+      analyse("kfunc:func_1, kretfunc:func_2 { printf(\"%s\", probe); }"),
+      std::make_pair(true, false));
+  EXPECT_EQ(analyse("kfunc:func_1, tracepoint:sched:sched_one { @[probe] = "
+                    "count(); }"),
+            std::make_pair(false, true));
+}
+
+#ifdef HAVE_BCC_KFUNC
+TEST_F(semantic_analyser_btf, kprobe_to_kfunc)
+{
+  auto provider = [](const std::string &input) {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->kprobe_to_kfunc_ = true;
+    Driver driver(*bpftrace);
+    test(*bpftrace, true, driver, input, 0);
+    auto ap = driver.root_->probes->at(0)->attach_points->at(0);
+    return ap->provider;
+  };
+
+  EXPECT_EQ(provider("kprobe:func_1 { @ = arg0 + arg2 }"), "kfunc");
+  EXPECT_EQ(provider("kprobe:func_1, kprobe:func_2 { @[comm] = count() }"),
+            "kfunc");
+  EXPECT_EQ(provider("kretprobe:func_1 { @ = retval }"), "kretfunc");
+  // func_1 has 3 parameters
+  EXPECT_EQ(provider("kprobe:func_1 { @ = arg3 }"), "kprobe");
+  EXPECT_EQ(provider("kprobe:func_1 { @[func] = count() }"), "kprobe");
+  EXPECT_EQ(provider("kprobe:func_1 { @ = probe }"), "kprobe");
+  EXPECT_EQ(provider("kprobe:func_* { 1 }"), "kprobe");
+  EXPECT_EQ(provider("kprobe:func_1+4 { 1 }"), "kprobe");
+  EXPECT_EQ(provider("kprobe:func_1, kprobe:not_in_btf { 1 }"), "kprobe");
+}
+#endif
+
 TEST_F(semantic_analyser_btf, short_name)
 {
   test("f:func_1 { 1 }", 0);
@@ -2273,6 +3092,12 @@ TEST_F(semantic_analyser_btf, iter)
   test("iter:task_file { printf(\"%d\", ctx->file->ino); }", 0);
   test("iter:task,iter:task_file { 1 }", 1);
   test("iter:task,f:func_1 { 1 }", 1);
+  test("iter:task { 1 } iter:task_file { 1 }", 0);
+  test("iter:task { 1 } f:func_1 { 1 }", 1);
+  test("iter:task:s:5 { 1 }", 0);
+  test("iter:task_file:hz:2 { 1 }", 0);
+  test("iter:task:xx:5 { 1 }", 1);
+  test("iter:task:s:0 { 1 }", 1);
 }
 
 #endif // HAVE_LIBBPF_BTF_DUMP
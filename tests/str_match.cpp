@@ -0,0 +1,76 @@
+#include "str_match.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace str_match {
+
+static bool glob(const std::string &pattern, const std::string &s)
+{
+  return StrMatcher::glob(pattern).matches(s);
+}
+
+static bool contains(const std::string &substr, const std::string &s)
+{
+  return StrMatcher::contains(substr).matches(s);
+}
+
+TEST(StrMatcher, glob)
+{
+  EXPECT_TRUE(glob("/tmp/*", "/tmp/x"));
+  EXPECT_TRUE(glob("/tmp/*", "/tmp/"));
+  EXPECT_TRUE(glob("/tmp/*", "/tmp/a/b"));
+  EXPECT_FALSE(glob("/tmp/*", "/var/tmp/x"));
+  EXPECT_TRUE(glob("*.so*", "libc.so.6"));
+  EXPECT_FALSE(glob("*.so", "libc.so.6"));
+  EXPECT_TRUE(glob("a?c", "abc"));
+  EXPECT_FALSE(glob("a?c", "ac"));
+  EXPECT_TRUE(glob("[a-c]x", "bx"));
+  EXPECT_FALSE(glob("[!a-c]x", "bx"));
+  EXPECT_TRUE(glob("[^a-c]x", "dx"));
+  EXPECT_TRUE(glob("[]]", "]"));
+  EXPECT_TRUE(glob("[a-]", "-"));
+  EXPECT_TRUE(glob("\\*", "*"));
+  EXPECT_FALSE(glob("\\*", "x"));
+  EXPECT_TRUE(glob("", ""));
+  EXPECT_FALSE(glob("", "x"));
+  EXPECT_TRUE(glob("*", ""));
+  // The string ends at its first NUL
+  EXPECT_TRUE(glob("ab", std::string("ab\0c", 4)));
+}
+
+TEST(StrMatcher, glob_errors)
+{
+  EXPECT_THROW(StrMatcher::glob("[a"), std::invalid_argument);
+  EXPECT_THROW(StrMatcher::glob("[z-a]"), std::invalid_argument);
+  EXPECT_THROW(StrMatcher::glob("a\\"), std::invalid_argument);
+}
+
+TEST(StrMatcher, contains)
+{
+  EXPECT_TRUE(contains("abab", "xxabababy"));
+  EXPECT_FALSE(contains("abab", "abaab"));
+  EXPECT_TRUE(contains("foo", "foo"));
+  EXPECT_FALSE(contains("foo", "fo"));
+  EXPECT_TRUE(contains("", "x"));
+  EXPECT_TRUE(contains("*", "a*b"));
+  EXPECT_FALSE(contains("*", "ab"));
+}
+
+TEST(StrMatcher, states)
+{
+  // One state per character matched, the last one matching whatever follows
+  auto matcher = StrMatcher::contains("foo");
+  ASSERT_EQ(matcher.states(), 4U);
+  EXPECT_EQ(matcher.next(0, 'f'), 1);
+  EXPECT_EQ(matcher.next(1, 'x'), 0);
+  EXPECT_EQ(matcher.next(0, 0), StrMatcher::REJECTED);
+  EXPECT_TRUE(matcher.matched(3));
+  EXPECT_FALSE(matcher.matched(2));
+
+  EXPECT_EQ(StrMatcher::glob("abc").next(0, 'x'), StrMatcher::REJECTED);
+}
+
+} // namespace str_match
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,114 @@
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+
+#include "symbol_cache.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace symbol_cache {
+
+TEST(SymbolIndex, build_id)
+{
+  EXPECT_EQ(SymbolIndex::build_id("/does/not/exist"), "");
+  EXPECT_EQ(SymbolIndex::build_id("/proc/self/status"), "");
+
+  std::string build_id = SymbolIndex::build_id("/proc/self/exe");
+  if (build_id.empty())
+    GTEST_SKIP() << "test binary has no build-id";
+  EXPECT_EQ(build_id.size() % 2, 0U);
+  EXPECT_EQ(build_id.find_first_not_of("0123456789abcdef"), std::string::npos);
+}
+
+TEST(SymbolIndex, open)
+{
+  std::string build_id = SymbolIndex::build_id("/proc/self/exe");
+  if (build_id.empty())
+    GTEST_SKIP() << "test binary has no build-id";
+
+  std::string dir = "/tmp/bpftrace-test-symbol-cache-XXXXXX";
+  if (::mkdtemp(&dir[0]) == nullptr)
+  {
+    throw std::runtime_error("creating temporary path for tests failed");
+  }
+  std::string index_path = dir + "/" + build_id + ".syms";
+
+  auto built = SymbolIndex::open("/proc/self/exe", build_id, dir);
+  ASSERT_NE(built, nullptr);
+  EXPECT_EQ(access(index_path.c_str(), R_OK), 0);
+
+  // Opened again from the file written above
+  auto loaded = SymbolIndex::open("/proc/self/exe", build_id, dir);
+  ASSERT_NE(loaded, nullptr);
+  ASSERT_EQ(loaded->end() - loaded->begin(), built->end() - built->begin());
+
+  for (auto &sym : *loaded)
+  {
+    auto found = loaded->lookup(sym.start);
+    ASSERT_NE(found, nullptr);
+    EXPECT_EQ(found->start, sym.start);
+  }
+
+  // A corrupt index is rebuilt
+  std::ofstream(index_path, std::ios::trunc) << "garbage";
+  auto rebuilt = SymbolIndex::open("/proc/self/exe", build_id, dir);
+  ASSERT_NE(rebuilt, nullptr);
+  EXPECT_EQ(rebuilt->end() - rebuilt->begin(), built->end() - built->begin());
+
+  // Indexes with counts overflowing their size or unterminated names are
+  // rebuilt too
+  std::string index;
+  {
+    std::ifstream in(index_path, std::ios::binary);
+    index.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+  }
+  ASSERT_GT(index.size(), 32U);
+  std::string overflow = index;
+  uint64_t nsyms = 1ULL << 60;
+  overflow.replace(
+      16, sizeof(nsyms), reinterpret_cast<char *>(&nsyms), sizeof(nsyms));
+  std::string unterminated = index;
+  unterminated.back() = 'x';
+  for (auto &corrupt : { overflow, unterminated })
+  {
+    std::ofstream(index_path, std::ios::binary | std::ios::trunc) << corrupt;
+    auto reopened = SymbolIndex::open("/proc/self/exe", build_id, dir);
+    ASSERT_NE(reopened, nullptr);
+    EXPECT_EQ(reopened->end() - reopened->begin(),
+              built->end() - built->begin());
+  }
+
+  remove(index_path.c_str());
+  rmdir(dir.c_str());
+}
+
+TEST(SymbolCache, hash_mappings)
+{
+  std::vector<SymbolCache::Mapping> mappings = {
+    { 0x400000, 0x401000, 0, "/usr/bin/a", "" },
+    { 0x7f0000, 0x7f1000, 0x1000, "/lib/b.so", "" },
+  };
+  uint64_t hash = SymbolCache::hash_mappings(mappings);
+  EXPECT_EQ(SymbolCache::hash_mappings(mappings), hash);
+
+  // Build-ids are filled in lazily and don't count
+  mappings[1].build_id = "abcd";
+  EXPECT_EQ(SymbolCache::hash_mappings(mappings), hash);
+
+  // A library loaded with dlopen()
+  mappings.push_back({ 0x7e0000, 0x7e2000, 0, "/lib/plugin.so", "" });
+  EXPECT_NE(SymbolCache::hash_mappings(mappings), hash);
+  mappings.pop_back();
+  EXPECT_EQ(SymbolCache::hash_mappings(mappings), hash);
+
+  // The same library mapped somewhere else
+  mappings[1].start += 0x10000;
+  mappings[1].end += 0x10000;
+  EXPECT_NE(SymbolCache::hash_mappings(mappings), hash);
+}
+
+} // namespace symbol_cache
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,72 @@
+#include <cstring>
+#include <sstream>
+
+#include "bpftrace.h"
+#include "symbolize_pool.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace symbolize_pool {
+
+static std::vector<uint8_t> usym_event(uint64_t addr, int64_t value)
+{
+  // usym (address, then pid), then an int
+  std::vector<uint8_t> data(24);
+  uint64_t pid = 1;
+  std::memcpy(data.data(), &addr, sizeof(addr));
+  std::memcpy(data.data() + 8, &pid, sizeof(pid));
+  std::memcpy(data.data() + 16, &value, sizeof(value));
+  return data;
+}
+
+TEST(SymbolizePool, wants)
+{
+  Field usym{ CreateUSym(), 0, false, {} };
+  Field integer{ CreateInt64(), 16, false, {} };
+  EXPECT_TRUE(SymbolizePool::wants({ integer, usym }));
+  EXPECT_FALSE(SymbolizePool::wants({ integer }));
+  EXPECT_FALSE(SymbolizePool::wants({}));
+}
+
+TEST(SymbolizePool, order)
+{
+  std::stringstream out;
+  BPFtrace bpftrace(std::make_unique<TextOutput>(out));
+  // Addresses are printed in hex without resolving them
+  bpftrace.resolve_user_symbols_ = false;
+  std::vector<Field> args = { Field{ CreateUSym(), 0, false, {} },
+                              Field{ CreateInt64(), 16, false, {} } };
+
+  {
+    SymbolizePool pool(bpftrace, 4);
+    EXPECT_TRUE(pool.empty());
+    for (int i = 0; i < 100; i++)
+    {
+      if (i % 3 == 0)
+      {
+        pool.submit("ready " + std::to_string(i) + "\n");
+        continue;
+      }
+      auto data = usym_event(0x7f0000 + i, i);
+      pool.submit("%s %d\n", args, data.data());
+    }
+    pool.drain();
+    EXPECT_TRUE(pool.empty());
+  }
+
+  std::stringstream expected;
+  for (int i = 0; i < 100; i++)
+  {
+    if (i % 3 == 0)
+      expected << "ready " << i << "\n";
+    else
+      expected << "0x" << std::hex << 0x7f0000 + i << std::dec << " " << i
+               << "\n";
+  }
+  EXPECT_EQ(out.str(), expected.str());
+}
+
+} // namespace symbolize_pool
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,69 @@
+#include <sstream>
+
+#include "bpftrace.h"
+#include "symbolizer.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace symbolizer {
+
+static std::string symbolize(const std::string &input)
+{
+  BPFtrace bpftrace;
+  Symbolizer symbolizer(bpftrace);
+  std::istringstream in(input);
+  std::ostringstream out;
+  symbolizer.symbolize(in, out);
+  return out.str();
+}
+
+TEST(RawSymbols, tokens)
+{
+  EXPECT_EQ(RawSymbols::kernel_token(0xffffffff81000000, false),
+            "[[k:ffffffff81000000]]");
+  EXPECT_EQ(RawSymbols::kernel_token(0xffffffff81000000, true),
+            "[[k+:ffffffff81000000]]");
+  EXPECT_EQ(RawSymbols::user_token(123, 0x7f0010, false, false),
+            "[[u:123:7f0010]]");
+  EXPECT_EQ(RawSymbols::user_token(123, 0x7f0010, true, true),
+            "[[u+m:123:7f0010]]");
+}
+
+TEST(Symbolizer, module_map)
+{
+  BPFtrace bpftrace;
+  Symbolizer symbolizer(bpftrace);
+  EXPECT_TRUE(symbolizer.add_mapping(
+      "[[map 123 400000 401000 0 - /usr/bin/with space]]"));
+  EXPECT_TRUE(
+      symbolizer.add_mapping("[[map 123 7f0000 7f1000 1000 abcdef /lib/x]]"));
+  EXPECT_FALSE(symbolizer.add_mapping("[[map 123 7f0000]]"));
+  EXPECT_FALSE(symbolizer.add_mapping("[[map x 400000 401000 0 - /a]]"));
+  EXPECT_FALSE(symbolizer.add_mapping("@: [[u:123:7f0010]]"));
+
+  // Module map lines are dropped
+  EXPECT_EQ(symbolize("a\n[[map 1 1000 2000 0 - /does/not/exist]]\nb\n"),
+            "a\nb\n");
+}
+
+TEST(Symbolizer, unresolved_user)
+{
+  // No module map for the process, printed the way resolve_usym() does
+  EXPECT_EQ(symbolize("@[[[u:123:7f0010]]]: 1\n"), "@[0x7f0010]: 1\n");
+  EXPECT_EQ(symbolize("[[u+m:123:7f0010]]\n"), "0x7f0010 ([unknown])\n");
+  // Files that are gone can't be resolved
+  EXPECT_EQ(symbolize("[[map 123 7f0000 7f1000 0 - /does/not/exist]]\n"
+                      "[[u+:123:7f0010]]\n"),
+            "0x7f0010\n");
+}
+
+TEST(Symbolizer, not_tokens)
+{
+  EXPECT_EQ(symbolize("[[x:1]] [[k:zz]] [[k:1 [[u:1]] [[km:10]]\n"),
+            "[[x:1]] [[k:zz]] [[k:1 [[u:1]] [[km:10]]\n");
+}
+
+} // namespace symbolizer
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,53 @@
+#include <sstream>
+
+#include "bpftrace.h"
+#include "system_pool.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace system_pool {
+
+TEST(SystemPool, order)
+{
+  std::stringstream out;
+  BPFtrace bpftrace(std::make_unique<TextOutput>(out));
+
+  {
+    SystemPool pool(bpftrace, 4, 8, false);
+    EXPECT_TRUE(pool.empty());
+    for (int i = 0; i < 20; i++)
+    {
+      // The first ones finish last
+      std::string delay = i < 4 ? "0.2" : "0";
+      pool.submit("sleep " + delay + "; echo " + std::to_string(i));
+    }
+    pool.drain();
+    EXPECT_TRUE(pool.empty());
+    EXPECT_EQ(pool.dropped(), 0U);
+  }
+
+  std::stringstream expected;
+  for (int i = 0; i < 20; i++)
+    expected << i << "\n";
+  EXPECT_EQ(out.str(), expected.str());
+}
+
+TEST(SystemPool, drop)
+{
+  std::stringstream out;
+  BPFtrace bpftrace(std::make_unique<TextOutput>(out));
+
+  {
+    SystemPool pool(bpftrace, 1, 2, true);
+    for (int i = 0; i < 5; i++)
+      pool.submit("sleep 0.2; echo " + std::to_string(i));
+    pool.drain();
+    EXPECT_EQ(pool.dropped(), 3U);
+  }
+  EXPECT_EQ(out.str(), "0\n1\n");
+}
+
+} // namespace system_pool
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Load generator for scripts/bench_event_throughput.py: calls event() RATE
+// times a second in total (0 for as fast as it can) for SECONDS, from one
+// process pinned to each of the first CPUS CPUs (wrapping around the online
+// ones), then prints the number of calls.
+//
+//   event_load RATE SECONDS CPUS
+
+#define BATCH 256
+
+__attribute__((noinline)) void event(uint64_t seq, uint64_t cpu)
+{
+  __asm__ volatile("" : : "r"(seq), "r"(cpu) : "memory");
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t generate(uint64_t rate, uint64_t seconds, int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+
+  uint64_t start = now_ns();
+  uint64_t end = start + seconds * 1000000000ULL;
+  uint64_t calls = 0;
+  for (uint64_t now = start; now < end; now = now_ns())
+  {
+    for (int i = 0; i < BATCH; i++)
+      event(calls++, cpu);
+
+    // Sleep until the time the calls so far were due
+    if (rate)
+    {
+      uint64_t due = start + calls * 1000000000ULL / rate;
+      now = now_ns();
+      if (due > now)
+      {
+        struct timespec ts = { (due - now) / 1000000000ULL,
+                               (due - now) % 1000000000ULL };
+        nanosleep(&ts, NULL);
+      }
+    }
+  }
+  return calls;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 4)
+  {
+    fprintf(stderr, "USAGE: %s RATE SECONDS CPUS\n", argv[0]);
+    return 1;
+  }
+  uint64_t rate = strtoull(argv[1], NULL, 10);
+  uint64_t seconds = strtoull(argv[2], NULL, 10);
+  int cpus = atoi(argv[3]);
+  if (cpus < 1)
+    cpus = 1;
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+  // One pipe for the children to report their calls through
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    perror("pipe");
+    return 1;
+  }
+  for (int cpu = 0; cpu < cpus; cpu++)
+  {
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0)
+    {
+      uint64_t cpu_rate = rate && rate < (uint64_t)cpus ? 1 : rate / cpus;
+      uint64_t calls = generate(cpu_rate, seconds, cpu % online);
+      if (write(fds[1], &calls, sizeof(calls)) != sizeof(calls))
+        return 1;
+      return 0;
+    }
+  }
+  close(fds[1]);
+
+  uint64_t total = 0, calls;
+  while (read(fds[0], &calls, sizeof(calls)) == sizeof(calls))
+    total += calls;
+  while (wait(NULL) > 0)
+    ;
+  printf("%llu\n", (unsigned long long)total);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <sstream>
+
+#include "timings.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace timings {
+
+using namespace std::chrono_literals;
+
+TEST(Timings, disabled)
+{
+  Timings timings;
+  timings.add("parse", 1ms);
+  std::stringstream out;
+  timings.report(out, true);
+  EXPECT_NE(out.str().find("\"phases\": []"), std::string::npos);
+}
+
+TEST(Timings, text)
+{
+  Timings timings;
+  timings.enable();
+  timings.add("parse", 1500us);
+  timings.add("attach kprobe:f", 2ms);
+  timings.add("parse", 500us);
+  std::stringstream out;
+  timings.report(out, false);
+  auto text = out.str();
+  EXPECT_EQ(text.rfind("Timings:\n"
+                       "  parse                 2.000 ms (2x)\n"
+                       "  attach kprobe:f       2.000 ms\n"
+                       "  total ",
+                       0),
+            0U);
+}
+
+TEST(Timings, json)
+{
+  Timings timings;
+  timings.enable();
+  timings.add("attach uprobe:\"a\\b\":f", 1ms);
+  std::stringstream out;
+  timings.report(out, true);
+  auto json = out.str();
+  EXPECT_EQ(json.rfind("{\"type\": \"timings\", \"data\": {\"total_ms\": ", 0),
+            0U);
+  EXPECT_NE(json.find(", \"phases\": [{\"phase\": "
+                      "\"attach uprobe:\\\"a\\\\b\\\":f\", \"ms\": 1.000, "
+                      "\"count\": 1}]}}\n"),
+            std::string::npos);
+}
+
+TEST(Timings, scope)
+{
+  auto &timings = Timings::get();
+  {
+    Timings::Scope timing("not recorded");
+  }
+  timings.enable();
+  {
+    Timings::Scope timing("recorded");
+  }
+  std::stringstream out;
+  timings.report(out, true);
+  EXPECT_EQ(out.str().find("not recorded"), std::string::npos);
+  EXPECT_NE(out.str().find("\"phase\": \"recorded\""), std::string::npos);
+}
+
+} // namespace timings
+} // namespace test
+} // namespace bpftrace
@@ -19,6 +19,13 @@ public:
   {
     return get_tracepoint_struct(format_file, category, event_name, bpftrace);
   }
+
+  static std::optional<Struct> get_tracepoint_args_public(
+      std::istream &format_file,
+      BPFtrace &bpftrace)
+  {
+    return get_tracepoint_args(read_format(format_file), bpftrace);
+  }
 };
 
 TEST(tracepoint_format_parser, tracepoint_struct)
@@ -252,6 +259,54 @@ TEST(tracepoint_format_parser, tracepoint_struct_btf)
   EXPECT_THAT(bpftrace.btf_set_, Contains("size_t"));
 }
 
+TEST(tracepoint_format_parser, tracepoint_args)
+{
+  std::string input =
+      "	field:unsigned short common_type;	offset:0;	size:2;	"
+      "signed:0;\n"
+      "	field:int common_pid;	offset:4;	size:4;	signed:1;\n"
+      "	field:unsigned int fd;	offset:16;	size:8;	signed:0;\n"
+      "	field:const char * buf;	offset:24;	size:8;	signed:0;\n"
+      "	field:const char *const * argv;	offset:32;	size:8;	signed:0;\n"
+      "	field:size_t count;	offset:40;	size:8;	signed:0;\n"
+      "	field:char comm[16];	offset:48;	size:16;	signed:1;\n"
+      "	field:u32 ids[2];	offset:64;	size:8;	signed:0;\n"
+      "	field:__data_loc char[] msg;	offset:72;	size:4;	signed:1;\n";
+
+  std::istringstream format_file(input);
+
+  MockBPFtrace bpftrace;
+  auto args = MockTracepointFormatParser::get_tracepoint_args_public(
+      format_file, bpftrace);
+  ASSERT_TRUE(args.has_value());
+
+  SizedType char_type = std::is_signed<char>::value ? CreateInt8()
+                                                    : CreateUInt8();
+  EXPECT_EQ(args->size, 80);
+  EXPECT_EQ(args->fields.size(), 9U);
+  EXPECT_EQ(args->fields["common_type"].type, CreateUInt16());
+  EXPECT_EQ(args->fields["common_pid"].type, CreateInt32());
+  EXPECT_EQ(args->fields["common_pid"].offset, 4);
+  EXPECT_EQ(args->fields["fd"].type, CreateUInt64());
+  EXPECT_EQ(args->fields["buf"].type, CreatePointer(char_type));
+  EXPECT_EQ(args->fields["argv"].type,
+            CreatePointer(CreatePointer(char_type)));
+  EXPECT_EQ(args->fields["count"].type, CreateUInt64());
+  EXPECT_EQ(args->fields["comm"].type, CreateString(16));
+  EXPECT_EQ(args->fields["ids"].type, CreateArray(2, CreateUInt32()));
+  EXPECT_EQ(args->fields["ids"].offset, 64);
+  EXPECT_EQ(args->fields["msg"].type, CreateInt64());
+  EXPECT_TRUE(args->fields["msg"].is_data_loc);
+  EXPECT_FALSE(args->fields["fd"].is_data_loc);
+
+  // A function pointer is left to the clang parser
+  std::istringstream fn_format_file(
+      "	field:void (*fn)(int);	offset:8;	size:8;	signed:0;\n");
+  EXPECT_FALSE(MockTracepointFormatParser::get_tracepoint_args_public(
+                   fn_format_file, bpftrace)
+                   .has_value());
+}
+
 TEST(tracepoint_format_parser, args_field_access)
 {
   // Test computing the level of nested structs accessed from tracepoint args
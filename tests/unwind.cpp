@@ -0,0 +1,78 @@
+#include <cstring>
+#include <unistd.h>
+
+#include "unwind.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace {
+namespace test {
+namespace unwind {
+
+TEST(EhFrameTable, build)
+{
+  EXPECT_EQ(EhFrameTable::build("/does/not/exist"), nullptr);
+  EXPECT_EQ(EhFrameTable::build("/proc/self/status"), nullptr);
+  EXPECT_NE(EhFrameTable::build("/proc/self/exe"), nullptr);
+}
+
+TEST(Unwinder, kernel_stack)
+{
+  auto stack = std::make_unique<DwarfStack>();
+  stack->pid = getpid();
+  stack->ip = 0xffffffff81000000;
+  stack->size = 0;
+  Unwinder unwinder;
+  EXPECT_TRUE(unwinder.unwind(*stack, 127).empty());
+}
+
+#ifdef __x86_64__
+
+// Takes the stack as a uprobe on this function would, and returns where it
+// was called from
+static __attribute__((noinline)) uint64_t take_stack(DwarfStack &stack)
+{
+  uint64_t ip, sp, bp;
+  asm volatile("lea (%%rip), %0\n\t"
+               "mov %%rsp, %1\n\t"
+               "mov %%rbp, %2"
+               : "=r"(ip), "=r"(sp), "=r"(bp));
+  stack.pid = getpid();
+  stack.ip = ip;
+  stack.sp = sp;
+  stack.bp = bp;
+  // Less than all of it may be there above sp, only what's surely part of
+  // the stack of the test is copied
+  stack.size = 1024;
+  memcpy(stack.data, reinterpret_cast<void *>(sp), stack.size);
+  return reinterpret_cast<uint64_t>(__builtin_return_address(0));
+}
+
+static __attribute__((noinline)) uint64_t call_take_stack(DwarfStack &stack)
+{
+  uint64_t ret = take_stack(stack);
+  // Keeps the call from being a tail call
+  asm volatile("");
+  return ret;
+}
+
+TEST(Unwinder, unwind)
+{
+  auto stack = std::make_unique<DwarfStack>();
+  uint64_t ret = call_take_stack(*stack);
+
+  Unwinder unwinder;
+  auto frames = unwinder.unwind(*stack, 127);
+  ASSERT_GE(frames.size(), 2U);
+  EXPECT_EQ(frames[0], stack->ip);
+  EXPECT_EQ(frames[1], ret);
+
+  frames = unwinder.unwind(*stack, 1);
+  ASSERT_EQ(frames.size(), 1U);
+  EXPECT_EQ(frames[0], stack->ip);
+}
+
+#endif // __x86_64__
+
+} // namespace unwind
+} // namespace test
+} // namespace bpftrace
@@ -1,8 +1,11 @@
+#include "types.h"
 #include "utils.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include <algorithm>
 #include <cstring>
 #include <fcntl.h>
+#include <set>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -129,6 +132,15 @@ TEST(utils, resolve_binary_path)
   exec_system(("rm -rf " + path).c_str());
 }
 
+TEST(utils, get_pid_exe_id)
+{
+  struct stat st;
+  ASSERT_EQ(stat("/proc/self/exe", &st), 0);
+  EXPECT_EQ(get_pid_exe_id(getpid()),
+            std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino));
+  EXPECT_EQ(get_pid_exe_id(-1), "");
+}
+
 TEST(utils, parse_exponent)
 {
   EXPECT_EQ(parse_exponent((const char*)"1e0"), 1e0);
@@ -171,6 +183,68 @@ TEST(utils, abs_path)
   remove(rel_file.c_str());
 }
 
+TEST(utils, cms_hash)
+{
+  // String keys are hashed up to their NUL, whatever follows it
+  uint8_t a[8] = { 'a', 'b', 'c', 0, 0, 0, 0, 0 };
+  uint8_t b[8] = { 'a', 'b', 'c', 0, 'x', 'y', 0, 0 };
+  EXPECT_EQ(cms_hash(a, sizeof(a), true), cms_hash(b, sizeof(b), true));
+  EXPECT_NE(cms_hash(a, sizeof(a), false), cms_hash(b, sizeof(b), false));
+
+  uint64_t key = 42;
+  uint64_t hash = cms_hash(reinterpret_cast<uint8_t *>(&key), 8, false);
+  for (int row = 0; row < CMS_DEPTH; row++)
+    EXPECT_LT(cms_column(hash, row), static_cast<size_t>(CMS_WIDTH));
+  EXPECT_NE(cms_column(hash, 0), cms_column(hash, 1));
+}
+
+TEST(utils, kernel_load_versions)
+{
+  auto versions = kernel_load_versions();
+  ASSERT_FALSE(versions.empty());
+  std::set<uint32_t> distinct(versions.begin(), versions.end());
+  EXPECT_EQ(distinct.size(), versions.size());
+
+  kernel_version_loaded(versions.back());
+  auto reordered = kernel_load_versions();
+  EXPECT_EQ(reordered.size(), versions.size());
+  EXPECT_EQ(reordered.front(), versions.back());
+}
+
+TEST(utils, parse_cpu_list)
+{
+  EXPECT_EQ(parse_cpu_list("3"), std::vector<int>({ 3 }));
+  EXPECT_EQ(parse_cpu_list("0-3,8,10-11"),
+            std::vector<int>({ 0, 1, 2, 3, 8, 10, 11 }));
+
+  EXPECT_THROW(parse_cpu_list(""), std::invalid_argument);
+  EXPECT_THROW(parse_cpu_list("3-1"), std::invalid_argument);
+  EXPECT_THROW(parse_cpu_list("0-"), std::invalid_argument);
+  EXPECT_THROW(parse_cpu_list("a"), std::invalid_argument);
+  EXPECT_THROW(parse_cpu_list("1,2x"), std::invalid_argument);
+  EXPECT_THROW(parse_cpu_list("-1"), std::invalid_argument);
+
+  EXPECT_EQ(get_probe_cpus(""), get_online_cpus());
+  EXPECT_EQ(get_probe_cpus("0"), std::vector<int>({ 0 }));
+}
+
+TEST(utils, get_numa_nodes)
+{
+  // Each CPU is on at most one node
+  std::vector<int> possible = get_possible_cpus();
+  std::set<int> seen;
+  for (auto &cpus : get_numa_nodes())
+  {
+    EXPECT_FALSE(cpus.empty());
+    for (int cpu : cpus)
+    {
+      EXPECT_TRUE(seen.insert(cpu).second);
+      EXPECT_NE(std::find(possible.begin(), possible.end(), cpu),
+                possible.end());
+    }
+  }
+}
+
 } // namespace utils
 } // namespace test
 } // namespace bpftrace